@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+
+
+double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+
+static void put_le(uint8_t *out, uint32_t val, int nb_bytes)
+{
+	int i;
+
+	for (i = 0 ; i < nb_bytes ; i++) {
+		out[i] = (val >> (8 * i)) & 0xFF;
+	}
+}
+
+
+uint8_t *bench_make_bmp(int width, int height, int depth, size_t *bmp_size)
+{
+	int nb_colors = (depth == 24 ? 0 : (1 << depth));
+	int line_length = (width * depth + 7) / 8;
+	int padding = (4 - (line_length % 4)) % 4;
+	size_t header_size = 54 + (4 * nb_colors);
+	size_t pixel_data_size = (size_t)(line_length + padding) * height;
+	uint8_t *bmp;
+	size_t i;
+	int c;
+
+	*bmp_size = header_size + pixel_data_size;
+	bmp = calloc(1, *bmp_size);
+	if (bmp == NULL) {
+		return NULL;
+	}
+
+	bmp[0] = 'B';
+	bmp[1] = 'M';
+	put_le(bmp + 2, *bmp_size, 4);
+	put_le(bmp + 10, header_size, 4);
+	put_le(bmp + 14, 0x28, 4);
+	put_le(bmp + 18, width, 4);
+	put_le(bmp + 22, height, 4);
+	put_le(bmp + 26, 1, 2);
+	put_le(bmp + 28, depth, 2);
+	put_le(bmp + 34, pixel_data_size, 4);
+	put_le(bmp + 46, nb_colors, 4);
+
+	for (c = 0 ; c < nb_colors ; c++) {
+		memset(bmp + 54 + (c * 4), (c * 255) / (nb_colors - 1), 3);
+	}
+
+	for (i = header_size ; i < *bmp_size ; i++) {
+		bmp[i] = (i * 7) & 0xFF;
+	}
+
+	return bmp;
+}
+
+
+uint8_t *bench_make_raw(int width, int height, int depth, size_t *raw_size)
+{
+	size_t line_length = ((size_t)width * depth + 7) / 8;
+	uint8_t *raw;
+	size_t x;
+	int y;
+
+	*raw_size = line_length * height;
+	raw = malloc(*raw_size);
+	if (raw == NULL) {
+		return NULL;
+	}
+
+	for (y = 0 ; y < height ; y++) {
+		for (x = 0 ; x < line_length ; x++) {
+			raw[(y * line_length) + x] = (x + y) & 0xFF;
+		}
+	}
+
+	return raw;
+}
+
+
+#ifdef __GLIBC__
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t g_nb_allocs = 0;
+static uint64_t g_nb_bytes = 0;
+
+
+static void count_alloc(size_t size)
+{
+	__atomic_add_fetch(&g_nb_allocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&g_nb_bytes, size, __ATOMIC_RELAXED);
+}
+
+
+void *malloc(size_t size)
+{
+	count_alloc(size);
+	return __libc_malloc(size);
+}
+
+
+void *calloc(size_t nmemb, size_t size)
+{
+	count_alloc(nmemb * size);
+	return __libc_calloc(nmemb, size);
+}
+
+
+void *realloc(void *ptr, size_t size)
+{
+	count_alloc(size);
+	return __libc_realloc(ptr, size);
+}
+
+
+int bench_get_allocs(uint64_t *nb_allocs, uint64_t *nb_bytes)
+{
+	*nb_allocs = __atomic_load_n(&g_nb_allocs, __ATOMIC_RELAXED);
+	*nb_bytes = __atomic_load_n(&g_nb_bytes, __ATOMIC_RELAXED);
+	return 1;
+}
+
+#else
+
+int bench_get_allocs(uint64_t *nb_allocs, uint64_t *nb_bytes)
+{
+	*nb_allocs = 0;
+	*nb_bytes = 0;
+	return 0;
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef __LIBINSANE_BENCHMARKS_BENCH_H
+#define __LIBINSANE_BENCHMARKS_BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A4 @ 300dpi */
+#define BENCH_WIDTH 2480
+#define BENCH_HEIGHT 3508
+
+
+/*!
+ * \brief monotonic clock, in seconds.
+ */
+double bench_now(void);
+
+
+/*!
+ * \brief Bottom-to-top BMP (the most common case, and the one requiring
+ * mirroring), with a gray palette if depth <= 8.
+ * \param[in] depth 1, 8 or 24.
+ */
+uint8_t *bench_make_bmp(int width, int height, int depth, size_t *bmp_size);
+
+
+/*!
+ * \brief Raw image with a gradient pattern.
+ * \param[in] depth 1 (BW), 8 (gray) or 24 (RGB).
+ */
+uint8_t *bench_make_raw(int width, int height, int depth, size_t *raw_size);
+
+
+/*!
+ * \brief Number of calls to malloc() & co, and number of bytes requested,
+ * since the start of the program. Only available with the GNU libc:
+ * returns 0 otherwise.
+ * Allocations made by the worker of the dedicated process are not counted.
+ */
+int bench_get_allocs(uint64_t *nb_allocs, uint64_t *nb_bytes);
+
+#endif
@@ -0,0 +1,153 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libinsane/capi.h>
+#include <libinsane/constants.h>
+#include <libinsane/dumb.h>
+#include <libinsane/log.h>
+#include <libinsane/normalizers.h>
+#include <libinsane/util.h>
+
+#include "bench.h"
+
+
+/*
+ * Micro-benchmark of the bmp2raw normalizer: converts A4 pages @ 300dpi
+ * in each BMP depth supported (1, 8, 24) and reports the throughput (MB of
+ * RAW24 output per second).
+ *
+ * Usage: bench_normalizer_bmp2raw [nb_pages]
+ */
+
+#define DEFAULT_NB_PAGES 10
+#define READ_SIZE (64 * 1024)
+
+
+static enum lis_error bench_depth(int depth, int nb_pages, double *mbps)
+{
+	struct lis_scan_parameters scan_params = {
+		.format = LIS_IMG_FORMAT_BMP,
+		.width = BENCH_WIDTH,
+		.height = BENCH_HEIGHT,
+	};
+	struct lis_api *dumb = NULL, *bmp2raw = NULL;
+	struct lis_dumb_read read;
+	struct lis_item *item = NULL;
+	struct lis_scan_session *session;
+	enum lis_error err;
+	uint8_t *bmp, *buffer;
+	size_t bmp_size, r, total = 0;
+	double start, elapsed = 0.0;
+	int page;
+
+	bmp = bench_make_bmp(BENCH_WIDTH, BENCH_HEIGHT, depth, &bmp_size);
+	buffer = malloc(READ_SIZE);
+	if (bmp == NULL || buffer == NULL) {
+		err = LIS_ERR_NO_MEM;
+		goto end;
+	}
+	read.content = bmp;
+	read.nb_bytes = bmp_size;
+	scan_params.image_size = bmp_size;
+
+	err = lis_api_dumb(&dumb, "bench");
+	if (LIS_IS_ERROR(err)) {
+		goto end;
+	}
+	lis_dumb_set_nb_devices(dumb, 1);
+	lis_dumb_set_scan_parameters(dumb, &scan_params);
+	lis_dumb_set_scan_result(dumb, &read, 1);
+
+	err = lis_api_normalizer_bmp2raw(dumb, &bmp2raw);
+	if (LIS_IS_ERROR(err)) {
+		dumb->cleanup(dumb);
+		goto end;
+	}
+
+	err = bmp2raw->get_device(bmp2raw, LIS_DUMB_DEV_ID_FIRST, &item);
+	if (LIS_IS_ERROR(err)) {
+		goto cleanup;
+	}
+
+	for (page = 0 ; page < nb_pages ; page++) {
+		start = bench_now();
+
+		err = item->scan_start(item, &session);
+		if (LIS_IS_ERROR(err)) {
+			goto close;
+		}
+		while (!session->end_of_page(session)) {
+			r = READ_SIZE;
+			err = session->scan_read(session, buffer, &r);
+			if (LIS_IS_ERROR(err)) {
+				session->cancel(session);
+				goto close;
+			}
+			total += r;
+		}
+		session->cancel(session);
+
+		elapsed += bench_now() - start;
+	}
+
+	if (total != (size_t)BENCH_WIDTH * BENCH_HEIGHT * 3 * nb_pages) {
+		fprintf(
+			stderr, "depth %d: unexpected output size: %lu B\n",
+			depth, (long unsigned)total
+		);
+		err = LIS_ERR_INTERNAL_UNKNOWN_ERROR;
+		goto close;
+	}
+
+	*mbps = total / (1024.0 * 1024.0) / elapsed;
+
+close:
+	item->close(item);
+cleanup:
+	bmp2raw->cleanup(bmp2raw);
+end:
+	FREE(buffer);
+	FREE(bmp);
+	return err;
+}
+
+
+int main(int argc, char **argv)
+{
+	static const int depths[] = { 1, 8, 24 };
+	int nb_pages = DEFAULT_NB_PAGES;
+	enum lis_error err;
+	unsigned int i;
+	double mbps = 0.0;
+
+	if (argc > 1) {
+		nb_pages = atoi(argv[1]);
+		if (nb_pages <= 0) {
+			fprintf(stderr, "Usage: %s [nb_pages]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	lis_set_log_level(LIS_LOG_LVL_WARNING);
+
+	printf(
+		"bmp2raw: %d x %d, %d pages, reads of %d B\n",
+		BENCH_WIDTH, BENCH_HEIGHT, nb_pages, READ_SIZE
+	);
+
+	for (i = 0 ; i < LIS_COUNT_OF(depths) ; i++) {
+		err = bench_depth(depths[i], nb_pages, &mbps);
+		if (LIS_IS_ERROR(err)) {
+			fprintf(
+				stderr, "depth %d: 0x%X, %s\n",
+				depths[i], err, lis_strerror(err)
+			);
+			return EXIT_FAILURE;
+		}
+		printf("bmp2raw: depth %2d: %8.1f MB/s\n", depths[i], mbps);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,438 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libinsane/capi.h>
+#include <libinsane/dumb.h>
+#include <libinsane/log.h>
+#include <libinsane/normalizers.h>
+#include <libinsane/workarounds.h>
+#include <libinsane/util.h>
+
+#include "bench.h"
+
+
+/*
+ * Benchmark of the scan data path: scans synthetic A4 @ 300dpi pages in
+ * each image format through various chains of implementations built on top
+ * of the dumb implementation, with various read buffer sizes.
+ *
+ * For each combination, reports the throughput, the latency of the calls to
+ * scan_read() and the number of allocations made while scanning.
+ *
+ * Results are written as JSON on stdout.
+ *
+ * Usage: bench_pipeline [nb_pages]
+ */
+
+#define DEFAULT_NB_PAGES 3
+#define MAX_WRAPPERS 20
+
+
+typedef enum lis_error (*wrap_cb)(struct lis_api *to_wrap, struct lis_api **out_impl);
+
+
+struct bench_format {
+	const char *name;
+	enum lis_img_format format;
+	int depth;
+
+	uint8_t *page;
+	size_t page_size;
+	/* must remain valid as long as the dumb implementation is used */
+	struct lis_dumb_read read;
+};
+
+
+static struct bench_format g_formats[] = {
+	{ .name = "raw24", .format = LIS_IMG_FORMAT_RAW_RGB_24, .depth = 24 },
+	{ .name = "gray8", .format = LIS_IMG_FORMAT_GRAYSCALE_8, .depth = 8 },
+	{ .name = "bw1", .format = LIS_IMG_FORMAT_BW_1, .depth = 1 },
+	{ .name = "bmp1", .format = LIS_IMG_FORMAT_BMP, .depth = 1 },
+	{ .name = "bmp8", .format = LIS_IMG_FORMAT_BMP, .depth = 8 },
+	{ .name = "bmp24", .format = LIS_IMG_FORMAT_BMP, .depth = 24 },
+};
+
+
+struct bench_chain {
+	const char *name;
+	/* from the innermost to the outermost ; NULL terminated */
+	wrap_cb wrappers[MAX_WRAPPERS];
+};
+
+
+static const struct bench_chain g_chains[] = {
+	{ .name = "dumb", .wrappers = { NULL } },
+	{ .name = "raw24", .wrappers = { lis_api_normalizer_raw24, NULL } },
+	{ .name = "bmp2raw", .wrappers = { lis_api_normalizer_bmp2raw, NULL } },
+	{ .name = "cache", .wrappers = { lis_api_workaround_cache, NULL } },
+	{
+		.name = "dedicated_thread",
+		.wrappers = { lis_api_workaround_dedicated_thread, NULL }
+	},
+#ifdef OS_LINUX
+	{
+		.name = "dedicated_process",
+		.wrappers = { lis_api_workaround_dedicated_process, NULL }
+	},
+#endif
+	{
+		/* same order as lis_safebet() */
+		.name = "safebet",
+		.wrappers = {
+			lis_api_workaround_check_capabilities,
+			lis_api_workaround_cache,
+			lis_api_workaround_lamp,
+			lis_api_workaround_opt_values,
+			lis_api_workaround_opt_names,
+			lis_api_normalizer_bmp2raw,
+			lis_api_normalizer_raw24,
+			lis_api_normalizer_resolution,
+			lis_api_normalizer_clean_dev_descs,
+			lis_api_normalizer_safe_defaults,
+			lis_api_normalizer_source_nodes,
+			lis_api_normalizer_min_one_source,
+			lis_api_normalizer_source_names,
+			lis_api_normalizer_source_types,
+			lis_api_workaround_one_page_flatbed,
+			lis_api_normalizer_all_opts_on_all_sources,
+#ifdef OS_LINUX
+			lis_api_workaround_dedicated_process,
+#else
+			lis_api_workaround_dedicated_thread,
+#endif
+			NULL
+		},
+	},
+};
+
+
+static const size_t g_read_sizes[] = {
+	4 * 1024,
+	64 * 1024,
+	1024 * 1024,
+};
+
+
+struct bench_result {
+	uint64_t bytes;
+	double seconds;
+	size_t nb_reads;
+	double latency_avg, latency_p50, latency_p99, latency_max;
+	uint64_t nb_allocs;
+	uint64_t nb_alloc_bytes;
+};
+
+
+/* allocated before scanning so they are not counted as allocations */
+struct latencies {
+	double *samples;
+	size_t nb;
+	size_t max;
+};
+
+
+static void add_latency(struct latencies *l, double latency)
+{
+	// if reads are shorter than expected, keep only the first samples
+	if (l->nb < l->max) {
+		l->samples[l->nb++] = latency;
+	}
+}
+
+
+static int cmp_double(const void *_a, const void *_b)
+{
+	const double *a = _a;
+	const double *b = _b;
+	return (*a > *b) - (*a < *b);
+}
+
+
+static void compute_latencies(struct latencies *l, struct bench_result *result)
+{
+	double total = 0.0;
+	size_t i;
+
+	if (l->nb == 0) {
+		return;
+	}
+	qsort(l->samples, l->nb, sizeof(double), cmp_double);
+	for (i = 0 ; i < l->nb ; i++) {
+		total += l->samples[i];
+	}
+	result->latency_avg = total / l->nb;
+	result->latency_p50 = l->samples[l->nb / 2];
+	result->latency_p99 = l->samples[(l->nb * 99) / 100];
+	result->latency_max = l->samples[l->nb - 1];
+}
+
+
+static enum lis_error build_chain(
+		const struct bench_chain *chain, const struct bench_format *format,
+		struct lis_api **out_impl
+	)
+{
+	struct lis_scan_parameters scan_params = {
+		.format = format->format,
+		.width = BENCH_WIDTH,
+		.height = BENCH_HEIGHT,
+		.image_size = format->page_size,
+	};
+	struct lis_api *impl = NULL, *next;
+	enum lis_error err;
+	int i;
+
+	err = lis_api_dumb(&impl, "bench");
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+	lis_dumb_set_nb_devices(impl, 1);
+	lis_dumb_set_scan_parameters(impl, &scan_params);
+	lis_dumb_set_scan_result(impl, &format->read, 1);
+
+	for (i = 0 ; chain->wrappers[i] != NULL ; i++) {
+		err = chain->wrappers[i](impl, &next);
+		if (LIS_IS_ERROR(err)) {
+			impl->cleanup(impl);
+			return err;
+		}
+		impl = next;
+	}
+
+	*out_impl = impl;
+	return LIS_OK;
+}
+
+
+static enum lis_error scan_pages(
+		struct lis_item *item, size_t read_size, int nb_pages,
+		uint8_t *buffer, struct latencies *latencies,
+		struct bench_result *result
+	)
+{
+	struct lis_scan_session *session;
+	enum lis_error err;
+	double start, call;
+	size_t r;
+	int page;
+
+	for (page = 0 ; page < nb_pages ; page++) {
+		start = bench_now();
+
+		err = item->scan_start(item, &session);
+		if (LIS_IS_ERROR(err)) {
+			return err;
+		}
+		while (!session->end_of_page(session)) {
+			r = read_size;
+			call = bench_now();
+			err = session->scan_read(session, buffer, &r);
+			add_latency(latencies, bench_now() - call);
+			if (LIS_IS_ERROR(err)) {
+				session->cancel(session);
+				return err;
+			}
+			result->bytes += r;
+			result->nb_reads++;
+		}
+		session->cancel(session);
+
+		result->seconds += bench_now() - start;
+	}
+
+	return LIS_OK;
+}
+
+
+static enum lis_error bench(
+		const struct bench_chain *chain, const struct bench_format *format,
+		size_t read_size, int nb_pages, struct bench_result *result
+	)
+{
+	struct lis_api *impl = NULL;
+	struct lis_item *root = NULL, *item;
+	struct lis_item **children;
+	struct latencies latencies = { 0 };
+	uint8_t *buffer;
+	uint64_t allocs_before, alloc_bytes_before;
+	enum lis_error err;
+
+	memset(result, 0, sizeof(*result));
+
+	// output is at most RGB24, and reads may return fewer bytes than
+	// requested
+	latencies.max = (
+		((size_t)BENCH_WIDTH * BENCH_HEIGHT * 3 / read_size) + 1
+	) * nb_pages * 4;
+	latencies.samples = calloc(latencies.max, sizeof(double));
+	buffer = malloc(read_size);
+	if (buffer == NULL || latencies.samples == NULL) {
+		FREE(latencies.samples);
+		FREE(buffer);
+		return LIS_ERR_NO_MEM;
+	}
+
+	err = build_chain(chain, format, &impl);
+	if (LIS_IS_ERROR(err)) {
+		FREE(latencies.samples);
+		FREE(buffer);
+		return err;
+	}
+
+	err = impl->get_device(impl, LIS_DUMB_DEV_ID_FIRST, &root);
+	if (LIS_IS_ERROR(err)) {
+		goto cleanup;
+	}
+	item = root;
+	err = root->get_children(root, &children);
+	if (LIS_IS_OK(err) && children[0] != NULL) {
+		// normalizer_source_nodes makes sure there is at least one
+		item = children[0];
+	}
+
+	bench_get_allocs(&allocs_before, &alloc_bytes_before);
+
+	err = scan_pages(item, read_size, nb_pages, buffer, &latencies, result);
+
+	bench_get_allocs(&result->nb_allocs, &result->nb_alloc_bytes);
+	result->nb_allocs -= allocs_before;
+	result->nb_alloc_bytes -= alloc_bytes_before;
+
+	compute_latencies(&latencies, result);
+
+	root->close(root);
+cleanup:
+	impl->cleanup(impl);
+	FREE(latencies.samples);
+	FREE(buffer);
+	return err;
+}
+
+
+static void print_result(
+		const struct bench_chain *chain, const struct bench_format *format,
+		size_t read_size, int has_allocs, const struct bench_result *result,
+		enum lis_error err, int first
+	)
+{
+	printf(
+		"%s    {\"chain\": \"%s\", \"format\": \"%s\", \"read_size\": %lu",
+		first ? "" : ",\n",
+		chain->name, format->name, (unsigned long)read_size
+	);
+	if (LIS_IS_ERROR(err)) {
+		printf(", \"error\": \"%s\"}", lis_strerror(err));
+		return;
+	}
+	printf(
+		", \"bytes\": %llu, \"seconds\": %.6f, \"mb_per_s\": %.1f"
+		", \"reads\": %lu"
+		", \"latency_us\": {\"avg\": %.2f, \"p50\": %.2f, \"p99\": %.2f"
+		", \"max\": %.2f}",
+		(unsigned long long)result->bytes, result->seconds,
+		result->seconds > 0.0
+			? result->bytes / (1024.0 * 1024.0) / result->seconds
+			: 0.0,
+		(unsigned long)result->nb_reads,
+		result->latency_avg * 1e6, result->latency_p50 * 1e6,
+		result->latency_p99 * 1e6, result->latency_max * 1e6
+	);
+	if (has_allocs) {
+		printf(
+			", \"allocations\": %llu, \"allocated_bytes\": %llu}",
+			(unsigned long long)result->nb_allocs,
+			(unsigned long long)result->nb_alloc_bytes
+		);
+	} else {
+		printf(", \"allocations\": null, \"allocated_bytes\": null}");
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	int nb_pages = DEFAULT_NB_PAGES;
+	struct bench_result result;
+	enum lis_error err;
+	unsigned int c, f, s;
+	uint64_t dummy;
+	int has_allocs, first = 1, has_failed = 0;
+
+	if (argc > 1) {
+		nb_pages = atoi(argv[1]);
+		if (nb_pages <= 0) {
+			fprintf(stderr, "Usage: %s [nb_pages]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// raw24 and bmp2raw complain about the formats they don't convert
+	lis_set_log_level(LIS_LOG_LVL_ERROR);
+	has_allocs = bench_get_allocs(&dummy, &dummy);
+
+	for (f = 0 ; f < LIS_COUNT_OF(g_formats) ; f++) {
+		if (g_formats[f].format == LIS_IMG_FORMAT_BMP) {
+			g_formats[f].page = bench_make_bmp(
+				BENCH_WIDTH, BENCH_HEIGHT, g_formats[f].depth,
+				&g_formats[f].page_size
+			);
+		} else {
+			g_formats[f].page = bench_make_raw(
+				BENCH_WIDTH, BENCH_HEIGHT, g_formats[f].depth,
+				&g_formats[f].page_size
+			);
+		}
+		if (g_formats[f].page == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			return EXIT_FAILURE;
+		}
+		g_formats[f].read.content = g_formats[f].page;
+		g_formats[f].read.nb_bytes = g_formats[f].page_size;
+	}
+
+	printf("{\n");
+	printf("  \"benchmark\": \"pipeline\",\n");
+	printf("  \"version\": \"%s\",\n", lis_get_version());
+	printf(
+		"  \"page\": {\"width\": %d, \"height\": %d},\n",
+		BENCH_WIDTH, BENCH_HEIGHT
+	);
+	printf("  \"nb_pages\": %d,\n", nb_pages);
+	printf("  \"results\": [\n");
+
+	for (c = 0 ; c < LIS_COUNT_OF(g_chains) ; c++) {
+		for (f = 0 ; f < LIS_COUNT_OF(g_formats) ; f++) {
+			for (s = 0 ; s < LIS_COUNT_OF(g_read_sizes) ; s++) {
+				fprintf(
+					stderr, "%s / %s / %lu B ...\n",
+					g_chains[c].name, g_formats[f].name,
+					(unsigned long)g_read_sizes[s]
+				);
+				err = bench(
+					&g_chains[c], &g_formats[f],
+					g_read_sizes[s], nb_pages, &result
+				);
+				if (LIS_IS_ERROR(err)) {
+					has_failed = 1;
+				}
+				print_result(
+					&g_chains[c], &g_formats[f],
+					g_read_sizes[s], has_allocs, &result,
+					err, first
+				);
+				first = 0;
+				fflush(stdout);
+			}
+		}
+	}
+
+	printf("\n  ]\n}\n");
+
+	for (f = 0 ; f < LIS_COUNT_OF(g_formats) ; f++) {
+		FREE(g_formats[f].page);
+	}
+
+	return (has_failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -9,6 +9,7 @@
 #include <libinsane/error.h>
 #include <libinsane/log.h>
 #include <libinsane/safebet.h>
+#include <libinsane/stats.h>
 #include <libinsane/util.h>
 
 #include "../src/bmp.h"
@@ -158,6 +159,8 @@ static void lets_scan(struct bmp *out, const char *dev_id)
 	struct lis_scan_parameters parameters;
 	struct lis_scan_session *scan_session;
 	char img_buffer[32*1024];
+	char chain[256];
+	char *stats;
 	size_t bufsize;
 	size_t obtained = 0;
 
@@ -204,6 +207,9 @@ static void lets_scan(struct bmp *out, const char *dev_id)
 	// be used
 
 	CHECK_ERR(sources[0]->scan_start(sources[0], &scan_session));
+	printf("Data path: %s\n", lis_scan_session_chain(
+		scan_session, chain, sizeof(chain)
+	));
 
 	memset(img_buffer, 0, sizeof(img_buffer));
 
@@ -256,6 +262,13 @@ static void lets_scan(struct bmp *out, const char *dev_id)
 	// do something with all the images/pages that have just been scanned
 	printf("\nAll done !\n");
 
+	// with LIBINSANE_STATS=1, lis_safebet() instruments every layer
+	if (lis_getenv("LIBINSANE_STATS", 0)) {
+		CHECK_ERR(lis_stats_dump(&stats));
+		printf("%s\n", stats);
+		free(stats);
+	}
+
 end:
 	if (device != NULL) {
 		device->close(device);
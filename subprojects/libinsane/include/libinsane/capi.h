@@ -335,6 +335,46 @@ struct lis_scan_session {
 	 * advised to wait for the end of scan session and discard the images.
 	 */
 	void (*cancel)(struct lis_scan_session *session);
+
+	/*!
+	 * \brief File descriptor to wait on before calling \ref scan_read().
+	 *
+	 * Optional: may be NULL (implementations that do not support it).
+	 *
+	 * The file descriptor becomes readable (poll(), select(), epoll) when
+	 * \ref scan_read() can be called without blocking. It is owned by
+	 * the scan session: do not read from it nor close it.
+	 *
+	 * It may change from one page to the next: call it again once
+	 * \ref end_of_page() has returned 1 and the next page has been
+	 * started.
+	 *
+	 * The Sane implementation only provides it if the environment
+	 * variable LIBINSANE_SANE_NON_BLOCKING is set to 1.
+	 *
+	 * \retval -1 not available
+	 */
+	int (*get_fd)(struct lis_scan_session *session);
+
+	/*!
+	 * \brief Name of the implementation or wrapper providing this scan
+	 * session. Debugging only.
+	 *
+	 * Optional: may be NULL.
+	 */
+	const char *name;
+
+	/*!
+	 * \brief Scan session this one reads from. Debugging only: see
+	 * \ref lis_scan_session_chain().
+	 *
+	 * Optional: may be NULL (base implementations).
+	 *
+	 * Wrappers that don't touch the image data don't wrap the scan session
+	 * at all: their scan_start() returns the scan session of the item they
+	 * wrap. So they never appear here.
+	 */
+	struct lis_scan_session *(*get_wrapped)(struct lis_scan_session *session);
 };
 
 
@@ -405,6 +445,35 @@ struct lis_item {
 	 * Will also be done automatically if you call \ref lis_api.cleanup(). (TODO(Jflesch): normalizer)
 	 */
 	void (*close)(struct lis_item *self);
+
+	/*!
+	 * \brief Set the values of several options of this item at once.
+	 *
+	 * Optional: NULL if the implementation cannot do better than calling
+	 * \ref lis_option_descriptor.fn.set_value() on each option. Use
+	 * \ref lis_set_options() rather than calling it directly.
+	 *
+	 * Values are set in the given order. Stops on the first error, and
+	 * right after the first option that returns
+	 * \ref LIS_SET_FLAG_MUST_RELOAD_OPTIONS: the descriptors of the
+	 * following options may not be valid anymore. The caller must then
+	 * call \ref get_options() again before setting them.
+	 *
+	 * \param[in] self Item the options belong to.
+	 * \param[in] nb_values Number of options to set.
+	 * \param[in] opts Options to set, as returned by \ref get_options().
+	 * \param[in] values One value per option.
+	 * \param[out] set_flags Union of the flags returned for each option
+	 *   (see \ref LIS_SET_FLAG_INEXACT, etc).
+	 * \param[out] nb_set Number of options successfully set.
+	 * \retval LIS_OK No error. All the values have been set, unless
+	 *   stopped by \ref LIS_SET_FLAG_MUST_RELOAD_OPTIONS (see nb_set).
+	 */
+	enum lis_error (*set_values)(
+		struct lis_item *self, int nb_values,
+		struct lis_option_descriptor **opts, const union lis_value *values,
+		int *set_flags, int *nb_set
+	);
 };
 
 
@@ -23,4 +23,12 @@
 #define OPT_NAME_PREVIEW "preview"
 #define OPT_NAME_LAMP_SWITCH "lamp-switch"
 
+// Added by LibInsane (see lis_api_normalizer_raw24()): raw image formats
+// the application can handle. Default: RGB24 only.
+#define OPT_NAME_OUTPUT_FORMATS "output-formats"
+#define OPT_VALUE_OUTPUT_FORMATS_RGB24 "rgb24"
+#define OPT_VALUE_OUTPUT_FORMATS_GRAYSCALE "rgb24,gray8"
+#define OPT_VALUE_OUTPUT_FORMATS_BW "rgb24,bw1"
+#define OPT_VALUE_OUTPUT_FORMATS_ALL "rgb24,gray8,bw1"
+
 #endif
@@ -47,6 +47,62 @@ void lis_dumb_set_scan_result(
 	int nb_reads
 );
 
+
+enum lis_dumb_pattern {
+	LIS_DUMB_PATTERN_GRADIENT = 0,
+	LIS_DUMB_PATTERN_NOISE,
+	LIS_DUMB_PATTERN_BARS, /*!< text-like: lines of black "words" on white */
+};
+
+/*!
+ * \brief Procedural pages.
+ *
+ * Instead of replaying the buffers given to lis_dumb_set_scan_result(),
+ * pages are generated line by line when they are read: a whole page is
+ * never held in memory. Useful for load testing.
+ */
+struct lis_dumb_generator {
+	enum lis_img_format format; /*!< RAW_RGB_24, GRAYSCALE_8 or BW_1 */
+	int width;
+	int height;
+	int nb_pages; /*!< pages fed one after the other, like an ADF */
+	enum lis_dumb_pattern pattern;
+	unsigned int seed; /*!< for the noise and the jitter */
+
+	size_t max_read; /*!< max bytes returned by scan_read() (0 = no limit) */
+	int latency_us; /*!< delay added to each scan_read() */
+	int jitter_us; /*!< random extra delay, between 0 and jitter_us */
+	/*! 0-byte reads returned before each read that returns data, like a
+	 * non-blocking source whose data isn't ready yet */
+	int empty_reads;
+
+	enum lis_error error; /*!< error to inject (LIS_OK = none) */
+	int error_page; /*!< page on which scan_read() will return 'error' */
+	size_t error_offset; /*!< position in the page, in bytes */
+};
+
+/*!
+ * \brief Generate the scanned pages instead of replaying static buffers.
+ * Scan parameters are updated accordingly.
+ * \param[in] generator NULL to go back to lis_dumb_set_scan_result().
+ * Copied.
+ *
+ * If the environment variable LIBINSANE_DUMB_PAGES is set to a value > 0,
+ * lis_api_dumb() creates one device and configures the generator with
+ * the following environment variables:
+ * LIBINSANE_DUMB_WIDTH (default: 2480), LIBINSANE_DUMB_HEIGHT (3508),
+ * LIBINSANE_DUMB_DEPTH (24, 8 or 1 ; default: 24),
+ * LIBINSANE_DUMB_PATTERN (0 = gradient, 1 = noise, 2 = bars),
+ * LIBINSANE_DUMB_SEED, LIBINSANE_DUMB_MAX_READ,
+ * LIBINSANE_DUMB_LATENCY_US, LIBINSANE_DUMB_JITTER_US,
+ * LIBINSANE_DUMB_EMPTY_READS,
+ * LIBINSANE_DUMB_ERROR_PAGE (default: -1 = none) and
+ * LIBINSANE_DUMB_ERROR_OFFSET (an I/O error is injected).
+ */
+void lis_dumb_set_generator(
+	struct lis_api *self, const struct lis_dumb_generator *generator
+);
+
 void lis_dumb_reset_counters(struct lis_api *self);
 int lis_dumb_get_nb_get(struct lis_api *self);
 int lis_dumb_get_nb_set(struct lis_api *self);
@@ -34,18 +34,59 @@ struct lis_log_callbacks {
 extern void lis_set_log_callbacks(const struct lis_log_callbacks *callbacks);
 
 
+/*!
+ * \brief set the minimum level of the messages to log.
+ * Messages with a lower level are dropped before being formatted.
+ * Levels without callbacks (NULL) are dropped too.
+ * By default, all the messages are logged.
+ */
+extern void lis_set_log_level(enum lis_log_level min_lvl);
+
+
+/*!
+ * \brief deliver log messages from a dedicated thread.
+ * When enabled, logging a message never waits for the callbacks: messages
+ * are put in a queue and the callbacks are called from a dedicated thread.
+ * Messages are truncated to 512 characters, and dropped if the queue is
+ * full.
+ * \param[in] async 1 to enable, 0 to disable. When disabling, messages still
+ *		in the queue are delivered before this function returns.
+ */
+extern void lis_log_set_async(int async);
+
+
 /* functions inside libinsane to log */
 
+/*!
+ * \brief minimum level of the messages that must be formatted.
+ * Do not modify directly. See \ref lis_set_log_level().
+ */
+extern int lis_log_min_level;
+
+#ifdef __GNUC__
+#define LIS_LOG_ENABLED(lvl) \
+	((int)(lvl) >= __atomic_load_n(&lis_log_min_level, __ATOMIC_RELAXED))
+#else
+#define LIS_LOG_ENABLED(lvl) ((int)(lvl) >= lis_log_min_level)
+#endif
+
 extern void lis_log(enum lis_log_level lvl, const char *file, int line, const char *func, const char *fmt, ...)
 #ifdef __GNUC__
 	__attribute__ ((format (printf, 5, 6)))
 #endif
 	;
 
-#define lis_log_debug(...) lis_log(LIS_LOG_LVL_DEBUG, __FILE__, __LINE__, __func__, __VA_ARGS__);
-#define lis_log_info(...) lis_log(LIS_LOG_LVL_INFO, __FILE__, __LINE__, __func__, __VA_ARGS__);
-#define lis_log_warning(...) lis_log(LIS_LOG_LVL_WARNING, __FILE__, __LINE__, __func__, __VA_ARGS__);
-#define lis_log_error(...) lis_log(LIS_LOG_LVL_ERROR, __FILE__, __LINE__, __func__, __VA_ARGS__);
+/* arguments are not evaluated if the level is disabled */
+#define lis_log_lvl(lvl, ...) do { \
+		if (LIS_LOG_ENABLED(lvl)) { \
+			lis_log(lvl, __FILE__, __LINE__, __func__, __VA_ARGS__); \
+		} \
+	} while(0)
+
+#define lis_log_debug(...) lis_log_lvl(LIS_LOG_LVL_DEBUG, __VA_ARGS__);
+#define lis_log_info(...) lis_log_lvl(LIS_LOG_LVL_INFO, __VA_ARGS__);
+#define lis_log_warning(...) lis_log_lvl(LIS_LOG_LVL_WARNING, __VA_ARGS__);
+#define lis_log_error(...) lis_log_lvl(LIS_LOG_LVL_ERROR, __VA_ARGS__);
 
 
 extern void lis_log_raw(enum lis_log_level lvl, const char *msg);
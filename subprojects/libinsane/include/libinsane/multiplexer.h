@@ -18,6 +18,14 @@ extern "C" {
  * The API multiplexer takes many API implementations in input, and merge them
  * to present them as a single one.
  *
+ * By default, list_devices() is called on each API one after the other.
+ * If the environment variable LIBINSANE_MULTIPLEXER_PARALLEL is set to 1,
+ * it is called on all the APIs at the same time, each from its own thread.
+ * In this mode, LIBINSANE_MULTIPLEXER_TIMEOUT_MS can be set to stop waiting
+ * for the APIs that are too slow (their devices are not reported). An API
+ * that timed out is skipped until its call to list_devices() has finished.
+ * Only for APIs that can be called from any thread.
+ *
  * \param[in] input_implementations Implementations to wrap together.
  * \param[in] nb_input_implementations Number of implementations to wrap together.
  * \param[out] output_implementation Implementation wrapping all the input implementations.
@@ -27,6 +35,43 @@ extern enum lis_error lis_api_multiplexer(
 	struct lis_api **output_implementation
 );
 
+
+/*!
+ * \brief Called for each device found.
+ * \param[in] dev_desc valid until the next call to list_devices() or
+ *   cleanup().
+ */
+typedef void (*lis_multiplexer_device_cb)(
+	struct lis_device_descriptor *dev_desc, void *user_data
+);
+
+/*!
+ * \brief Look for devices, and report them as soon as they are found.
+ *
+ * Same as \ref lis_api.list_devices(), except that \p cb is called with the
+ * devices of each API as soon as this API has answered (see
+ * LIBINSANE_MULTIPLEXER_PARALLEL). \p cb is always called from the thread
+ * calling this function.
+ *
+ * If \p impl is not a multiplexer (for instance if it has been wrapped by
+ * other implementations), \p cb is called once list_devices() has returned.
+ * This is the case of the implementation returned by \ref lis_safebet(): the
+ * multiplexer is wrapped by normalizers and workarounds (and, on Linux, runs
+ * in a dedicated process), so its users get all the devices at once, when
+ * the slowest API has answered or timed out. Streaming requires calling this
+ * function on the multiplexer itself.
+ *
+ * \param[in] impl multiplexer.
+ * \param[in] cb callback called for each device found.
+ * \param[out] dev_descs all the devices found, once all the APIs have
+ *   answered (or timed out). Same as \ref lis_api.list_devices().
+ */
+extern enum lis_error lis_multiplexer_list_devices(
+	struct lis_api *impl, enum lis_device_locations locs,
+	lis_multiplexer_device_cb cb, void *user_data,
+	struct lis_device_descriptor ***dev_descs
+);
+
 #ifdef __cplusplus
 }
 #endif
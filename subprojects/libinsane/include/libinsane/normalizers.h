@@ -155,6 +155,11 @@ extern enum lis_error lis_api_normalizer_source_types(
  * [must support the BMP format](https://msdn.microsoft.com/en-us/ie/ff546016(v=vs.94))
  * (Microsoft documentation states that they all must).
  *
+ * If the application accepts it (see \ref OPT_NAME_OUTPUT_FORMATS), 8bits
+ * BMP with a palette made only of grays are returned as
+ * \ref LIS_IMG_FORMAT_GRAYSCALE_8, and 1bit BMP with a black and white
+ * palette as \ref LIS_IMG_FORMAT_BW_1.
+ *
  * \param[in] to_wrap Base implementation to wrap.
  * \param[out] out_impl Implementation of the out_impl including the workaround.
  */
@@ -171,7 +176,12 @@ extern enum lis_error lis_api_normalizer_bmp2raw(
  * Sane can return the image as various raw formats:
  * RAW1 (B&W), RAW8 (Grayscale), RAW24 (RGB), etc.
  *
- * This normalization ensures the output image is always in RAW24 (RGB).
+ * This normalization ensures the output image is always in RAW24 (RGB),
+ * unless the application has indicated it can handle the other formats.
+ *
+ * Adds the option \ref OPT_NAME_OUTPUT_FORMATS to the devices (unless a
+ * normalizer further down the chain already did). Formats listed in its
+ * value are returned as is, without expanding them.
  *
  * \param[in] to_wrap Base implementation to wrap.
  * \param[out] out_impl Implementation of the out_impl including the workaround.
@@ -180,6 +190,64 @@ extern enum lis_error lis_api_normalizer_raw24(
 	struct lis_api *to_wrap, struct lis_api **out_impl
 );
 
+
+/*!
+ * \brief Emulate resolutions lower than the ones the device supports.
+ *
+ * Adds resolutions to the constraint list of the option
+ * \ref OPT_NAME_RESOLUTION: native resolutions divided by an integer factor
+ * (2 to 8; only multiples of 25, and at least 50). The option gets the
+ * capability \ref LIS_CAP_EMULATED.
+ *
+ * When an emulated resolution is selected, the device scans at the
+ * smallest native resolution that is a multiple of it, and blocks of
+ * factor x factor pixels are averaged on-the-fly. Lines are summed as they
+ * are read: only a few lines are kept in memory, whatever the image size.
+ * \ref lis_scan_session.get_scan_parameters() reports the reduced size.
+ *
+ * Works on \ref LIS_IMG_FORMAT_RAW_RGB_24 and
+ * \ref LIS_IMG_FORMAT_GRAYSCALE_8. Other formats are returned as is.
+ *
+ * Requires: \ref lis_api_normalizer_resolution (constraint as a list of
+ * integers). Not enabled by default in \ref lis_safebet
+ * (LIBINSANE_NORMALIZER_DOWNSCALE=1).
+ *
+ * \param[in] to_wrap Base implementation to wrap.
+ * \param[out] out_impl Implementation of the out_impl including the workaround.
+ */
+extern enum lis_error lis_api_normalizer_downscale(
+	struct lis_api *to_wrap, struct lis_api **out_impl
+);
+
+
+/*!
+ * \brief Reduce the colors of the image on-the-fly.
+ *
+ * Converts \ref LIS_IMG_FORMAT_RAW_RGB_24 to \ref LIS_IMG_FORMAT_GRAYSCALE_8
+ * (ITU-R BT.601 weights) or \ref LIS_IMG_FORMAT_BW_1. Lines are converted as
+ * they are read, with a constant amount of memory.
+ * \ref lis_scan_session.get_scan_parameters() reports the reduced format and
+ * image size.
+ *
+ * Configured with environment variables, read when the scan starts:
+ *
+ * - LIBINSANE_NORMALIZER_REDUCE_COLORS_DEPTH: 8 (grayscale, default) or
+ *   1 (black and white).
+ * - LIBINSANE_NORMALIZER_REDUCE_COLORS_THRESHOLD: black and white only.
+ *   Pixels darker than this value become black (default: 128).
+ *   -1 = adaptive threshold: each pixel is compared to the average of its
+ *   neighbourhood (handy with uneven lighting).
+ *
+ * Meant to be applied on top of \ref lis_api_normalizer_raw24. Not enabled
+ * by default in \ref lis_safebet (LIBINSANE_NORMALIZER_REDUCE_COLORS=1).
+ *
+ * \param[in] to_wrap Base implementation to wrap.
+ * \param[out] out_impl Implementation of the out_impl including the workaround.
+ */
+extern enum lis_error lis_api_normalizer_reduce_colors(
+	struct lis_api *to_wrap, struct lis_api **out_impl
+);
+
 /*!
  * \brief Set safest default values.
  *
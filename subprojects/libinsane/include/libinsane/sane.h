@@ -13,6 +13,15 @@ extern "C" {
  *
  * Linux Only.
  * It makes as few adjustments as possible (it's the jobs of the normalizers and the workarounds).
+ *
+ * If the environment variable LIBINSANE_SANE_NON_BLOCKING is set to 1,
+ * \ref lis_scan_session.scan_read() never blocks (it may return 0 bytes) and
+ * \ref lis_scan_session.get_fd() returns a file descriptor that can be
+ * polled. If the Sane backend doesn't support non-blocking I/O, a helper
+ * thread does the blocking reads instead. It only starts reading once
+ * get_fd() or scan_read() has been called for the page, and the other calls
+ * on the device wait for its current read to end. Starting a new page
+ * remains blocking.
  */
 extern enum lis_error lis_api_sane(struct lis_api **api);
 
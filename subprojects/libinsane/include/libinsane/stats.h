@@ -0,0 +1,76 @@
+#ifndef __LIBINSANE_STATS_H
+#define __LIBINSANE_STATS_H
+
+#include "capi.h"
+#include "error.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*!
+ * \brief Instrumentation layer: call counts and latencies
+ *
+ * Counts the calls to list_devices(), get_device(), get_options(),
+ * get_value(), set_value(), set_values(), scan_start() and scan_read() going
+ * through it, and measures their cumulative and maximum duration (monotonic
+ * clock, nanoseconds). For scan_read(), the number of bytes returned is counted
+ * too. Counters are updated atomically: the layer can be used from any
+ * thread and doesn't serialize anything.
+ *
+ * The durations include the time spent in all the layers below. When
+ * layers are stacked like "a > stats(a) > b > stats(b)", the time spent in
+ * 'b' itself is the difference between the figures of 'stats(b)' and
+ * 'stats(a)'. \ref lis_safebet() inserts this layer after the base
+ * implementations and after each workaround or normalizer if the
+ * environment variable LIBINSANE_STATS is set to 1.
+ *
+ * Counters of an instance are logged when it is cleaned up. Instances
+ * below \ref lis_api_workaround_dedicated_process run in the worker
+ * process: \ref lis_stats_dump() can't see them, but their counters are
+ * still logged.
+ *
+ * \param[in] to_wrap Implementation to instrument.
+ * \param[out] out_impl Instrumented implementation.
+ * \param[in] layer_name Name of the layer in the output of
+ *   \ref lis_stats_dump() (usually the name of the layer it wraps).
+ */
+extern enum lis_error lis_api_stats(
+	struct lis_api *to_wrap, struct lis_api **out_impl,
+	const char *layer_name
+);
+
+
+/*!
+ * \brief Counters of all the instrumentation layers currently loaded.
+ *
+ * Layers are listed in the order they have been created (usually from the
+ * innermost to the outermost one). Only the operations that have been
+ * called at least once are included:
+ *
+ * \code{.json}
+ * {"layers": [
+ *   {"name": "base", "ops": {
+ *     "get_device": {"calls": 1, "total_ns": 1200, "max_ns": 1200},
+ *     "scan_read": {"calls": 12, "total_ns": 900000, "max_ns": 120000, "bytes": 786432}
+ *   }},
+ *   ...
+ * ]}
+ * \endcode
+ *
+ * \param[out] out_json JSON string. Must be freed with free().
+ */
+extern enum lis_error lis_stats_dump(char **out_json);
+
+
+/*!
+ * \brief Reset the counters of all the instrumentation layers currently
+ * loaded.
+ */
+extern void lis_stats_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef __LIBINSANE_TRACE_H
+#define __LIBINSANE_TRACE_H
+
+#include "error.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*!
+ * \brief Record a timeline of the API calls.
+ *
+ * Each instrumentation layer (\ref lis_api_stats()) records the calls going
+ * through it: list_devices(), get_device(), get_children(), get_options(),
+ * get_value(), set_value(), scan_start(), get_scan_parameters(),
+ * end_of_feed(), end_of_page(), scan_read() and cancel(). The master and
+ * the worker of \ref lis_api_workaround_dedicated_process record each
+ * remote call too. Calls of the master and the worker are linked together
+ * (flow events).
+ *
+ * Events are stored in memory (one buffer per thread, no locking) and are
+ * written to \p path when \ref lis_trace_flush() is called, and when the
+ * instrumentation layers are cleaned up. The file uses the JSON array
+ * format of the Chrome trace events: it can be opened with
+ * chrome://tracing or [Perfetto](https://ui.perfetto.dev/). The closing
+ * ']' is omitted on purpose (the worker process may still append events
+ * to the file): both tools accept it.
+ *
+ * If the environment variable LIBINSANE_TRACE is set to a file path, tracing
+ * is started automatically and \ref lis_safebet() inserts the
+ * instrumentation layers.
+ *
+ * Events are dropped if a thread records more than 4096 events between two
+ * flushes.
+ *
+ * \param[in] path file to write. Truncated if it already exists.
+ */
+extern enum lis_error lis_trace_start(const char *path);
+
+
+/*!
+ * \brief Write the events recorded so far.
+ */
+extern enum lis_error lis_trace_flush(void);
+
+
+/*!
+ * \brief Write the events recorded so far and stop recording.
+ */
+extern void lis_trace_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -52,6 +52,42 @@ void lis_free(const enum lis_value_type type, union lis_value *value);
 enum lis_error lis_set_option(struct lis_item *item, const char *opt_name, const char *opt_value);
 
 
+/*!
+ * \brief Name and value of an option, as given to \ref lis_set_option().
+ */
+struct lis_option_setting {
+	const char *name;
+	const char *value;
+};
+
+
+/*!
+ * \brief helper to set quickly several options of the same item.
+ *
+ * Options are set in the given order. All the names and values are checked
+ * against the current option list before setting anything. When setting an
+ * option returns \ref LIS_SET_FLAG_MUST_RELOAD_OPTIONS, the option list is
+ * fetched again and the remaining options are looked up in it.
+ *
+ * Values are set with a single call to \ref lis_item.set_values() when the
+ * item implements it (one call per \ref LIS_SET_FLAG_MUST_RELOAD_OPTIONS).
+ * With the dedicated process workaround, it means a single round trip to the
+ * worker process instead of one per option.
+ *
+ * \param[in] item Item the options belong to.
+ * \param[in] settings Options to set.
+ * \param[in] nb_settings Number of options to set.
+ * \param[out] set_flags Optional (may be NULL). Union of the flags returned
+ *   for each option.
+ * \retval LIS_OK All the options have been set. Otherwise, stops on the
+ *   first option that couldn't be set.
+ */
+enum lis_error lis_set_options(
+	struct lis_item *item, const struct lis_option_setting *settings,
+	int nb_settings, int *set_flags
+);
+
+
 /*!
  * \brief compare values
  * \retval 1 if values are identical
@@ -63,6 +99,24 @@ int lis_compare(enum lis_value_type type, union lis_value val1, union lis_value
 union lis_value lis_add(enum lis_value_type type, union lis_value a, union lis_value b);
 union lis_value lis_sub(enum lis_value_type type, union lis_value a, union lis_value b);
 
+/*!
+ * \brief describe the data path of a scan session (debugging).
+ *
+ * Lists the layers a call to \ref lis_scan_session.scan_read() actually goes
+ * through, from the outermost one to the base implementation.
+ * For instance: "raw24 > bmp2raw > one_page_flatbed > sane".
+ * Layers that don't provide \ref lis_scan_session.name appear as "?".
+ *
+ * \param[in] session scan session returned by \ref lis_item.scan_start().
+ * \param[out] out buffer for the description (truncated if too small).
+ * \param[in] out_size size of out.
+ * \return out
+ */
+const char *lis_scan_session_chain(
+	struct lis_scan_session *session, char *out, size_t out_size
+);
+
+
 /*!
  * \brief return the value of an environment variable.
  * \param[in] var env variable name
@@ -131,10 +131,63 @@ extern enum lis_error lis_api_workaround_check_capabilities(
  *
  * WIA2 already has a dedicated process and therefore this workaround is not
  * required.
+ *
+ * Calls on different devices may run at the same time: by default, the
+ * worker process runs the calls of each opened device in a dedicated
+ * thread (up to 8 devices opened at the same time). If the environment
+ * variable LIBINSANE_WORKAROUND_DEDICATED_PROCESS_PER_DEVICE is set to 1,
+ * each device is opened in its own worker process instead (for backends that
+ * are not thread-safe at all). Calls on the same device are always
+ * serialized.
  */
 extern enum lis_error lis_api_workaround_dedicated_process(
 	struct lis_api *to_wrap, struct lis_api **out_impl
 );
+
+
+/*!
+ * \brief Persistent cache of the devices and their option descriptors.
+ *
+ * - API: Sane
+ *
+ * Listing the devices, opening them and going through all their options may
+ * take several seconds. Short-lived processes pay this price on every run.
+ *
+ * This workaround keeps the results of list_devices(), the item tree of the
+ * devices and their option descriptors (including constraints) in a file.
+ * The file is memory-mapped when the workaround is initialized and is
+ * specific to the wrapped implementation and to the version of Libinsane.
+ *
+ * - list_devices() returns the cached list immediately, and the list is
+ *   revalidated in a background thread. The next call returns the
+ *   revalidated list. Following calls go to the wrapped implementation.
+ * - get_device() returns the cached item tree without opening the device.
+ *   get_children() and get_options() are served from the cache too. The
+ *   device is actually opened on the first call to get_value(),
+ *   set_value() or scan_start(). Its cache entry is revalidated at this
+ *   point: if the descriptors have changed, the descriptors previously
+ *   returned are updated in place and the next set_value() returns
+ *   LIS_SET_FLAG_MUST_RELOAD_OPTIONS.
+ *
+ * Consequently errors like a device that has disappeared are only reported
+ * when the device is actually used.
+ *
+ * The background revalidation calls the wrapped implementation from
+ * another thread: calls to the wrapped implementation are serialized, but
+ * scan sessions are not. Only wrap implementations that are thread-safe
+ * (for instance \ref lis_api_workaround_dedicated_process).
+ *
+ * The file path can be set with the environment variable
+ * LIBINSANE_WORKAROUND_DISK_CACHE_PATH. Default is
+ * $XDG_CACHE_HOME/libinsane/<base name>.cache (or
+ * ~/.cache/libinsane/<base name>.cache).
+ *
+ * \param[in] to_wrap Base implementation to wrap.
+ * \param[out] out_impl Implementation of the out_impl including the workaround.
+ */
+extern enum lis_error lis_api_workaround_disk_cache(
+	struct lis_api *to_wrap, struct lis_api **out_impl
+);
 #endif
 
 /*!
@@ -148,6 +201,13 @@ extern enum lis_error lis_api_workaround_dedicated_process(
  * This workaround works around this issue by creating a dedicated thread for
  * the job and making all the request go through this thread.
  *
+ * If the environment variable LIBINSANE_WORKAROUND_DEDICATED_THREAD_PER_DEVICE
+ * is set to 1, each opened device gets its own thread instead: the device
+ * is used from this thread, and scans on different devices can run at the
+ * same time. list_devices(), get_device() and closing devices still go
+ * through a shared thread. Only for APIs that can handle different devices
+ * from different threads.
+ *
  * \param[in] to_wrap Base implementation to wrap.
  * \param[out] out_impl Implementation of the out_impl including the workaround.
  */
@@ -177,6 +237,32 @@ extern enum lis_error lis_api_workaround_one_page_flatbed(
 );
 
 
+/*!
+ * \brief Read the scanned images ahead
+ *
+ * - API: Sane, WIA, TWAIN
+ *
+ * Underlying implementations only read data from the scanner when the
+ * application calls scan_read(). Meanwhile the application processes the
+ * previous chunk, the scanner stays idle.
+ *
+ * This workaround runs a thread per scan session that keeps reading the
+ * current page in a queue of chunks while the application processes them.
+ * The next page is only requested once the application starts reading it.
+ * The memory used by the queue is limited to
+ * LIBINSANE_WORKAROUND_READAHEAD_MAX_MEMORY KB (default: 8192).
+ *
+ * The wrapped implementation must accept that scan_read() is called from
+ * another thread than the one that started the scan session.
+ *
+ * \param[in] to_wrap Base implementation to wrap.
+ * \param[out] out_impl Implementation of the out_impl including the workaround.
+ */
+extern enum lis_error lis_api_workaround_readahead(
+	struct lis_api *to_wrap, struct lis_api **out_impl
+);
+
+
 /*!
  * \brief Minimize calls to underlying API
  *
@@ -193,12 +279,50 @@ extern enum lis_error lis_api_workaround_one_page_flatbed(
  * Also keep track of the items. Return the same items as long as
  * they haven't been closed. This reduce risk of programming error
  * (even more when using the GObject layer).
+ *
+ * If the environment variable LIBINSANE_WORKAROUND_CACHE_DEVICES_TTL_MS is
+ * set, the results of list_devices() are cached too (for each
+ * \ref lis_device_locations) during this amount of milliseconds. Once
+ * this delay has expired, the cached list is still returned, but a
+ * background thread fetches a new one for the following calls
+ * (stale-while-revalidate). The wrapped implementation must therefore
+ * accept calls to list_devices() from another thread while devices are in
+ * use.
+ *
+ * APIs that must be called from a single thread (TWAIN, WIA) can't be
+ * refreshed in the background. If the environment variable
+ * LIBINSANE_WORKAROUND_CACHE_BACKGROUND_REFRESH is set to 0 (default on
+ * Windows), stale lists are refreshed by the next call to list_devices(),
+ * from the thread of the caller.
  */
 extern enum lis_error lis_api_workaround_cache(
 	struct lis_api *to_wrap, struct lis_api **out_impl
 );
 
 
+/*!
+ * \brief Drop the device lists cached by all the instances of
+ * \ref lis_api_workaround_cache.
+ *
+ * The next call to list_devices() will query the wrapped implementation.
+ * Instances running in the worker process of
+ * \ref lis_api_workaround_dedicated_process are reached too.
+ */
+void lis_workaround_cache_invalidate_devices(void);
+
+
+/*!
+ * \brief Hotplug hook for \ref lis_api_workaround_cache.
+ *
+ * To call when the application is notified that a scanner has been
+ * plugged or unplugged (udev, WM_DEVICECHANGE, etc). Cached device lists
+ * are refreshed in the background. Meanwhile, list_devices() keeps
+ * returning the previous lists. Instances running in the worker process of
+ * \ref lis_api_workaround_dedicated_process are reached too.
+ */
+void lis_workaround_cache_hotplug(void);
+
+
 /*!
  * \brief Turns the lamp off at the end of the scan
  *
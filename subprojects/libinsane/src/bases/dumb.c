@@ -1,8 +1,14 @@
 #define _GNU_SOURCE
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#ifdef OS_WINDOWS
+#include <windows.h>
+#endif
 
 #include <libinsane/capi.h>
 #include <libinsane/dumb.h>
@@ -10,8 +16,6 @@
 #include <libinsane/log.h>
 #include <libinsane/util.h>
 
-#define MAX_DUMB_OPTS 32
-
 
 struct lis_dumb_option {
 	struct lis_option_descriptor parent;
@@ -38,6 +42,17 @@ struct lis_dumb_scan_session {
 	struct lis_dumb_private *impl;
 	int read_idx;
 	int read_offset;
+
+	struct {
+		int page;
+		size_t offset; /* in the current page */
+		size_t line_length;
+		size_t page_size;
+		int line_y; /* line currently in 'line' */
+		uint8_t *line;
+		uint32_t rng; /* jitter */
+		int nb_empty; /* 0-byte reads returned since the last data */
+	} gen;
 };
 #define LIS_DUMB_SCAN_SESSION(scan_session) ((struct lis_dumb_scan_session *)(scan_session));
 
@@ -52,7 +67,8 @@ struct lis_dumb_private {
 	enum lis_error get_device_ret;
 	struct lis_dumb_item **devices;
 
-	struct lis_option_descriptor *opts[MAX_DUMB_OPTS + 1];
+	struct lis_option_descriptor **opts; /* NULL-terminated */
+	int nb_opts;
 
 	struct lis_scan_parameters scan_parameters;
 
@@ -63,6 +79,9 @@ struct lis_dumb_private {
 		struct lis_dumb_scan_session *session;
 	} scan;
 
+	int generate;
+	struct lis_dumb_generator generator;
+
 	struct {
 		int list;
 		int set;
@@ -89,6 +108,7 @@ static struct lis_scan_session g_dumb_scan_session_template = {
 	.end_of_page = dumb_end_of_page,
 	.scan_read = dumb_scan_read,
 	.cancel = dumb_cancel,
+	.name = "dumb",
 };
 
 
@@ -133,6 +153,21 @@ static struct lis_api g_dumb_api_template = {
 	.get_device = dumb_get_device,
 };
 
+static void generator_from_env(struct lis_api *self);
+
+
+static size_t generator_line_length(const struct lis_dumb_generator *gen)
+{
+	switch(gen->format) {
+		case LIS_IMG_FORMAT_GRAYSCALE_8:
+			return gen->width;
+		case LIS_IMG_FORMAT_BW_1:
+			return (gen->width + 7) / 8;
+		default:
+			return (size_t)gen->width * 3;
+	}
+}
+
 static struct lis_device_descriptor *g_dumb_default_devices[] = { NULL };
 static struct lis_item *g_dumb_default_children[] = { NULL };
 
@@ -177,6 +212,16 @@ static void dumb_cleanup_opts(struct lis_dumb_private *private)
 		lis_free(private->opts[i]->value.type, &opt_private->value);
 		FREE(opt_private);
 	}
+	FREE(private->opts);
+}
+
+
+static void dumb_free_session(struct lis_dumb_private *private)
+{
+	if (private->scan.session != NULL) {
+		FREE(private->scan.session->gen.line);
+	}
+	FREE(private->scan.session);
 }
 
 
@@ -190,6 +235,7 @@ static void dumb_cleanup(struct lis_api *self)
 	}
 	dumb_cleanup_devices(private->devices);
 	dumb_cleanup_opts(private);
+	dumb_free_session(private);
 	free(private);
 }
 
@@ -316,15 +362,32 @@ static enum lis_error dumb_scan_start(struct lis_item *self, struct lis_scan_ses
 	struct lis_dumb_item *private = LIS_DUMB_ITEM(self);
 	struct lis_dumb_scan_session *session;
 
-	if (private->impl->scan.nb_reads <= 0) {
+	if (!private->impl->generate && private->impl->scan.nb_reads <= 0) {
 		lis_log_error("DUMB: Requested a scan, but tests haven't defined scan test output: %d",
 				private->impl->scan.nb_reads);
 		return LIS_ERR_JAMMED;
 	}
 
+	dumb_free_session(private->impl);
+
 	session = calloc(1, sizeof(struct lis_dumb_scan_session));
 	memcpy(&session->parent, &g_dumb_scan_session_template, sizeof(session->parent));
 	session->impl = private->impl;
+	if (private->impl->generate) {
+		session->gen.line_length = generator_line_length(
+			&private->impl->generator
+		);
+		session->gen.page_size = (
+			session->gen.line_length * private->impl->generator.height
+		);
+		session->gen.line_y = -1;
+		session->gen.line = malloc(session->gen.line_length);
+		session->gen.rng = private->impl->generator.seed | 1;
+		if (session->gen.line == NULL) {
+			FREE(session);
+			return LIS_ERR_NO_MEM;
+		}
+	}
 	private->impl->scan.session = session;
 
 	private->impl->scan.is_scanning = 1;
@@ -336,7 +399,7 @@ static enum lis_error dumb_scan_start(struct lis_item *self, struct lis_scan_ses
 static void dumb_close(struct lis_item *self)
 {
 	struct lis_dumb_item *private = LIS_DUMB_ITEM(self);
-	FREE(private->impl->scan.session);
+	dumb_free_session(private->impl);
 }
 
 
@@ -355,8 +418,11 @@ enum lis_error lis_api_dumb(struct lis_api **out_impl, const char *name)
 	private->list_devices_ret = LIS_OK;
 	private->descs = g_dumb_default_devices;
 	private->get_device_ret = LIS_OK;
+	private->opts = calloc(1, sizeof(struct lis_option_descriptor *));
 
 	*out_impl = &private->base;
+
+	generator_from_env(&private->base);
 	return LIS_OK;
 }
 
@@ -369,6 +435,12 @@ void lis_dumb_set_nb_devices_with_type(
 	int i;
 	struct lis_dumb_item *item;
 
+	// may have already been called by generator_from_env()
+	if (private->allocated_descs) {
+		dumb_cleanup_descs(private->descs);
+	}
+	dumb_cleanup_devices(private->devices);
+
 	private->descs = calloc(nb_devices + 1, sizeof(struct lis_device_descriptor *));
 	private->allocated_descs = 1;
 	for (i = 0 ; i < nb_devices ; i++) {
@@ -440,12 +512,23 @@ void lis_dumb_add_option(struct lis_api *self, const struct lis_option_descripto
 	}
 	memcpy(&opt_private->default_value, default_value, sizeof(opt_private->default_value));
 
-	for (i = 0 ; i < MAX_DUMB_OPTS ; i++) {
-		if (private->opts[i] == NULL || strcmp(private->opts[i]->name, opt->name) == 0) {
+	for (i = 0 ; i < private->nb_opts ; i++) {
+		if (strcmp(private->opts[i]->name, opt->name) == 0) {
 			break;
 		}
 	}
-	assert(i < MAX_DUMB_OPTS);
+	if (i >= private->nb_opts) {
+		private->opts = realloc(
+			private->opts,
+			(private->nb_opts + 2) * sizeof(struct lis_option_descriptor *)
+		);
+		assert(private->opts != NULL);
+		private->nb_opts++;
+		private->opts[private->nb_opts] = NULL;
+	} else {
+		lis_free(private->opts[i]->value.type, &LIS_DUMB_OPTION(private->opts[i])->value);
+		FREE(private->opts[i]);
+	}
 
 	private->opts[i] = &opt_private->parent;
 }
@@ -459,12 +542,321 @@ void lis_dumb_set_scan_result(struct lis_api *self, const struct lis_dumb_read *
 }
 
 
+void lis_dumb_set_generator(
+		struct lis_api *self, const struct lis_dumb_generator *generator
+	)
+{
+	struct lis_dumb_private *private = LIS_DUMB_PRIVATE(self);
+
+	private->generate = (generator != NULL);
+	if (generator == NULL) {
+		return;
+	}
+
+	memcpy(&private->generator, generator, sizeof(private->generator));
+	switch(generator->format) {
+		case LIS_IMG_FORMAT_RAW_RGB_24:
+		case LIS_IMG_FORMAT_GRAYSCALE_8:
+		case LIS_IMG_FORMAT_BW_1:
+			break;
+		default:
+			lis_log_warning(
+				"[dumb] Can't generate image format %d."
+				" Will generate RGB24 instead",
+				generator->format
+			);
+			private->generator.format = LIS_IMG_FORMAT_RAW_RGB_24;
+			break;
+	}
+
+	private->scan_parameters.format = private->generator.format;
+	private->scan_parameters.width = generator->width;
+	private->scan_parameters.height = generator->height;
+	private->scan_parameters.image_size = (
+		generator_line_length(&private->generator) * generator->height
+	);
+}
+
+
+static void generator_from_env(struct lis_api *self)
+{
+	struct lis_dumb_generator gen;
+	int error_page;
+
+	memset(&gen, 0, sizeof(gen));
+	gen.nb_pages = lis_getenv("LIBINSANE_DUMB_PAGES", 0);
+	if (gen.nb_pages <= 0) {
+		return;
+	}
+
+	switch(lis_getenv("LIBINSANE_DUMB_DEPTH", 24)) {
+		case 1:
+			gen.format = LIS_IMG_FORMAT_BW_1;
+			break;
+		case 8:
+			gen.format = LIS_IMG_FORMAT_GRAYSCALE_8;
+			break;
+		default:
+			gen.format = LIS_IMG_FORMAT_RAW_RGB_24;
+			break;
+	}
+	gen.width = lis_getenv("LIBINSANE_DUMB_WIDTH", 2480);
+	gen.height = lis_getenv("LIBINSANE_DUMB_HEIGHT", 3508);
+	gen.pattern = lis_getenv("LIBINSANE_DUMB_PATTERN", LIS_DUMB_PATTERN_GRADIENT);
+	gen.seed = lis_getenv("LIBINSANE_DUMB_SEED", 0);
+	gen.max_read = lis_getenv("LIBINSANE_DUMB_MAX_READ", 0);
+	gen.latency_us = lis_getenv("LIBINSANE_DUMB_LATENCY_US", 0);
+	gen.jitter_us = lis_getenv("LIBINSANE_DUMB_JITTER_US", 0);
+	gen.empty_reads = lis_getenv("LIBINSANE_DUMB_EMPTY_READS", 0);
+	error_page = lis_getenv("LIBINSANE_DUMB_ERROR_PAGE", -1);
+	if (error_page >= 0) {
+		gen.error = LIS_ERR_IO_ERROR;
+		gen.error_page = error_page;
+		gen.error_offset = lis_getenv("LIBINSANE_DUMB_ERROR_OFFSET", 0);
+	}
+
+	lis_log_info(
+		"[dumb] Generating %d pages of %dx%d (format %d, pattern %d)",
+		gen.nb_pages, gen.width, gen.height, gen.format, gen.pattern
+	);
+	lis_dumb_set_nb_devices(self, 1);
+	lis_dumb_set_generator(self, &gen);
+}
+
+
+static uint32_t hash32(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return x;
+}
+
+
+static uint32_t xorshift32(uint32_t *state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+
+/*!
+ * Text-like pattern: lines of text separated by blank lines, words
+ * separated by spaces, with margins.
+ * \retval 1 if the pixel is ink.
+ */
+static int bars_is_ink(const struct lis_dumb_generator *gen, int page, int x, int y)
+{
+	int margin_x = gen->width / 10;
+	int margin_y = gen->height / 12;
+	int text_line = (y - margin_y) / 40;
+	uint32_t h;
+
+	if (x < margin_x || x >= gen->width - margin_x
+			|| y < margin_y || y >= gen->height - margin_y) {
+		return 0;
+	}
+	if ((y - margin_y) % 40 >= 24) {
+		return 0; // interline
+	}
+	h = hash32(gen->seed ^ (page << 20) ^ text_line);
+	if (h % 9 == 0) {
+		return 0; // end of paragraph
+	}
+	if (x >= gen->width - margin_x - (int)(h % (gen->width / 3 + 1))) {
+		return 0; // end of line
+	}
+	if ((x - margin_x) % 8 >= 6) {
+		return 0; // between 2 letters
+	}
+	h = hash32(h ^ ((x - margin_x) / 8));
+	return (h % 6 != 0); // 0 == space
+}
+
+
+static void generate_pixel(
+		const struct lis_dumb_generator *gen, int page, int x, int y,
+		uint8_t rgb[3]
+	)
+{
+	uint32_t h;
+
+	switch(gen->pattern) {
+		case LIS_DUMB_PATTERN_NOISE:
+			h = hash32(
+				gen->seed
+				^ hash32(((uint32_t)page << 24) ^ ((uint32_t)y << 12))
+				^ (uint32_t)x
+			);
+			rgb[0] = h & 0xFF;
+			rgb[1] = (h >> 8) & 0xFF;
+			rgb[2] = (h >> 16) & 0xFF;
+			return;
+		case LIS_DUMB_PATTERN_BARS:
+			memset(rgb, bars_is_ink(gen, page, x, y) ? 0x00 : 0xFF, 3);
+			return;
+		case LIS_DUMB_PATTERN_GRADIENT:
+			break;
+	}
+
+	rgb[0] = ((int64_t)x * 256) / gen->width;
+	rgb[1] = ((int64_t)y * 256) / gen->height;
+	rgb[2] = (x + y + (page * 64)) & 0xFF;
+}
+
+
+static void generate_line(struct lis_dumb_scan_session *session, int y)
+{
+	const struct lis_dumb_generator *gen = &session->impl->generator;
+	uint8_t rgb[3];
+	int x, gray;
+
+	if (gen->format == LIS_IMG_FORMAT_BW_1) {
+		memset(session->gen.line, 0, session->gen.line_length);
+	}
+
+	for (x = 0 ; x < gen->width ; x++) {
+		generate_pixel(gen, session->gen.page, x, y, rgb);
+		switch(gen->format) {
+			case LIS_IMG_FORMAT_GRAYSCALE_8:
+			case LIS_IMG_FORMAT_BW_1:
+				// BT.601
+				gray = ((77 * rgb[0]) + (150 * rgb[1]) + (29 * rgb[2])) >> 8;
+				if (gen->format == LIS_IMG_FORMAT_GRAYSCALE_8) {
+					session->gen.line[x] = gray;
+				} else if (gray < 0x80) {
+					// bit set == black
+					session->gen.line[x / 8] |= (0x80 >> (x % 8));
+				}
+				break;
+			default:
+				memcpy(session->gen.line + (3 * x), rgb, 3);
+				break;
+		}
+	}
+	session->gen.line_y = y;
+}
+
+
+static void generator_sleep(struct lis_dumb_scan_session *session)
+{
+	const struct lis_dumb_generator *gen = &session->impl->generator;
+	long us = gen->latency_us;
+#ifndef OS_WINDOWS
+	struct timespec ts;
+#endif
+
+	if (gen->jitter_us > 0) {
+		us += xorshift32(&session->gen.rng) % (gen->jitter_us + 1);
+	}
+	if (us <= 0) {
+		return;
+	}
+
+#ifdef OS_WINDOWS
+	Sleep(us / 1000);
+#else
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) != 0) { }
+#endif
+}
+
+
+static int generator_end_of_feed(struct lis_dumb_scan_session *session)
+{
+	int nb_pages = session->impl->generator.nb_pages;
+
+	return session->gen.page >= nb_pages
+		|| (session->gen.page == nb_pages - 1
+			&& session->gen.offset >= session->gen.page_size);
+}
+
+
+static enum lis_error generator_scan_read(
+		struct lis_dumb_scan_session *session,
+		uint8_t *out_buffer, size_t *buffer_size
+	)
+{
+	const struct lis_dumb_generator *gen = &session->impl->generator;
+	size_t remaining, to_copy, x;
+	int y;
+
+	if (session->gen.offset >= session->gen.page_size) {
+		// previous page is finished --> next one
+		session->gen.page++;
+		session->gen.offset = 0;
+		session->gen.line_y = -1;
+	}
+	if (session->gen.page >= gen->nb_pages) {
+		lis_log_error("[dumb] scan_read() called after the end of the feed");
+		return LIS_ERR_INVALID_VALUE;
+	}
+
+	generator_sleep(session);
+
+	if (session->gen.nb_empty < gen->empty_reads) {
+		// no data ready yet
+		session->gen.nb_empty++;
+		*buffer_size = 0;
+		return LIS_OK;
+	}
+	session->gen.nb_empty = 0;
+
+	remaining = MIN(*buffer_size, session->gen.page_size - session->gen.offset);
+	if (gen->max_read > 0) {
+		remaining = MIN(remaining, gen->max_read);
+	}
+
+	if (LIS_IS_ERROR(gen->error) && session->gen.page == gen->error_page
+			&& session->gen.offset + remaining > gen->error_offset) {
+		if (session->gen.offset >= gen->error_offset) {
+			lis_log_info(
+				"[dumb] Injecting error 0x%X (page %d, offset %lu)",
+				gen->error, session->gen.page,
+				(unsigned long)session->gen.offset
+			);
+			*buffer_size = 0;
+			return gen->error;
+		}
+		// return what comes before the error first
+		remaining = gen->error_offset - session->gen.offset;
+	}
+
+	*buffer_size = remaining;
+	while (remaining > 0) {
+		y = session->gen.offset / session->gen.line_length;
+		x = session->gen.offset % session->gen.line_length;
+		if (y != session->gen.line_y) {
+			generate_line(session, y);
+		}
+		to_copy = MIN(remaining, session->gen.line_length - x);
+		memcpy(out_buffer, session->gen.line + x, to_copy);
+		out_buffer += to_copy;
+		remaining -= to_copy;
+		session->gen.offset += to_copy;
+	}
+
+	return LIS_OK;
+}
+
+
 static int dumb_end_of_feed(struct lis_scan_session *session)
 {
 	int r;
 	struct lis_dumb_scan_session *private = LIS_DUMB_SCAN_SESSION(session);
 
-	r = (private->read_idx >= private->impl->scan.nb_reads);
+	if (private->impl->generate) {
+		r = generator_end_of_feed(private);
+	} else {
+		r = (private->read_idx >= private->impl->scan.nb_reads);
+	}
 	if (r) {
 		private->impl->scan.is_scanning = 0;
 	}
@@ -476,6 +868,11 @@ static int dumb_end_of_page(struct lis_scan_session *session)
 {
 	struct lis_dumb_scan_session *private = LIS_DUMB_SCAN_SESSION(session);
 
+	if (private->impl->generate) {
+		return private->gen.offset >= private->gen.page_size
+			|| dumb_end_of_feed(session);
+	}
+
 	if (private->read_idx >= private->impl->scan.nb_reads) {
 		return 1;
 	}
@@ -498,6 +895,10 @@ static enum lis_error dumb_scan_read(
 	size_t max_read;
 	struct lis_dumb_scan_session *private = LIS_DUMB_SCAN_SESSION(session);
 
+	if (private->impl->generate) {
+		return generator_scan_read(private, out_buffer, buffer_size);
+	}
+
 	while(private->impl->scan.read_contents[private->read_idx].nb_bytes == 0) {
 		private->read_idx++;
 	}
@@ -515,6 +916,7 @@ static enum lis_error dumb_scan_read(
 
 	if (*buffer_size >= max_read) {
 		private->read_idx++;
+		private->read_offset = 0;
 	} else {
 		private->read_offset += *buffer_size;
 	}
@@ -531,7 +933,7 @@ static void dumb_cancel(struct lis_scan_session *session)
 
 	private->read_idx = 0xFFFFFFFF;
 	private->read_offset = 0xFFFFFFFF;
-	FREE(impl->scan.session);
+	dumb_free_session(impl);
 	impl->scan.is_scanning = 0;
 }
 
@@ -1,7 +1,15 @@
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include <sane/sane.h>
 #include <sane/saneopts.h>
@@ -13,6 +21,20 @@
 
 #define NAME "sane"
 #define MAX_OPTS 128
+#define HELPER_BUFSIZE (32 * 1024)
+
+
+#define LIS_LOCK(mutex) do { \
+		int __pthread_r; \
+		__pthread_r = pthread_mutex_lock(mutex); \
+		assert(__pthread_r == 0); \
+	} while(0)
+
+#define LIS_UNLOCK(mutex) do { \
+		int __pthread_r; \
+		__pthread_r = pthread_mutex_unlock(mutex); \
+		assert(__pthread_r == 0); \
+	} while(0)
 
 struct lis_sane
 {
@@ -43,6 +65,31 @@ struct lis_sane_scan_session
 	int need_sane_start;
 	int end_of_page;
 	int end_of_feed;
+
+	/* LIBINSANE_SANE_NON_BLOCKING=1 */
+	bool non_blocking;
+	int select_fd; /* from sane_get_select_fd() */
+
+	/* Used if the backend doesn't support non-blocking I/O: a helper
+	 * thread runs the blocking sane_read() and makes fds[0] readable
+	 * when its result is available. */
+	struct {
+		bool running;
+		pthread_t thread;
+		int fds[2]; /* eventfd (fds[0] == fds[1]) or pipe */
+
+		pthread_mutex_t mutex; /* protects everything below */
+		pthread_cond_t cond;
+		bool stop;
+		bool requested; /* thread must call sane_read() */
+		bool busy; /* thread is in sane_read() */
+		int paused; /* other calls on the handle in progress */
+		bool ready; /* result of sane_read() is available */
+		SANE_Status status;
+		SANE_Int len;
+		SANE_Int offset; /* bytes of buffer already returned */
+		SANE_Byte buffer[HELPER_BUFSIZE];
+	} helper;
 };
 #define LIS_SANE_SCAN_SESSION_PRIVATE(impl) ((struct lis_sane_scan_session *)(impl))
 
@@ -97,6 +144,19 @@ static enum lis_error lis_sane_scan_read(
 		struct lis_scan_session *session, void *out_buffer, size_t *buffer_size
 	);
 static void lis_sane_cancel(struct lis_scan_session *session);
+static int lis_sane_get_fd(struct lis_scan_session *session);
+
+
+/* non-blocking I/O */
+static void setup_io(struct lis_sane_scan_session *private);
+static void helper_read(
+	struct lis_sane_scan_session *private,
+	void *out_buffer, size_t buffer_size,
+	SANE_Status *sane_err, SANE_Int *len
+);
+static void helper_stop(struct lis_sane_scan_session *private);
+static void helper_pause(struct lis_sane_scan_session *private);
+static void helper_resume(struct lis_sane_scan_session *private);
 
 
 static struct lis_api g_sane_impl_template = {
@@ -122,6 +182,8 @@ static struct lis_scan_session g_sane_scan_session_template = {
 	.end_of_page = lis_sane_end_of_page,
 	.scan_read = lis_sane_scan_read,
 	.cancel = lis_sane_cancel,
+	.get_fd = lis_sane_get_fd,
+	.name = "sane",
 };
 
 
@@ -498,9 +560,11 @@ static enum lis_error lis_sane_item_get_scan_parameters(
 	memset(&p, 0, sizeof(p)); // don't trust sane drivers --> init to 0.
 
 	lis_log_debug("sane_get_parameters() ...");
+	helper_pause(private);
 	err = sane_status_to_lis_error(sane_get_parameters(
 		private->item->handle, &p
 	));
+	helper_resume(private);
 	lis_log_debug("sane_get_parameters(): 0x%X, %s", err, lis_strerror(err));
 	if (LIS_IS_ERROR(err)) {
 		lis_log_error("%s->sane_get_parameters(): 0x%X, %s",
@@ -547,6 +611,9 @@ static void lis_sane_item_close(struct lis_item *self)
 {
 	struct lis_sane_item *private = LIS_SANE_ITEM_PRIVATE(self);
 
+	if (private->session.helper.running) {
+		lis_sane_cancel(&private->session.parent);
+	}
 	cleanup_options(private);
 	lis_log_info("Sane: item->close()");
 	free((void *)private->parent.name);
@@ -815,7 +882,7 @@ failed:
 }
 
 
-static enum lis_error lis_sane_item_get_options(struct lis_item *self,
+static enum lis_error get_options(struct lis_item *self,
 		struct lis_option_descriptor ***descs)
 {
 	struct lis_sane_item *private = LIS_SANE_ITEM_PRIVATE(self);
@@ -936,6 +1003,19 @@ error:
 }
 
 
+static enum lis_error lis_sane_item_get_options(struct lis_item *self,
+		struct lis_option_descriptor ***descs)
+{
+	struct lis_sane_item *private = LIS_SANE_ITEM_PRIVATE(self);
+	enum lis_error err;
+
+	helper_pause(&private->session);
+	err = get_options(self, descs);
+	helper_resume(&private->session);
+	return err;
+}
+
+
 static enum lis_error control_sane_value(
 	struct lis_sane_option *private,
 	SANE_Action action,
@@ -1046,12 +1126,14 @@ static enum lis_error lis_sane_opt_get_value(struct lis_option_descriptor *self,
 
 	lis_log_debug("%s->%s->sane_control_option(GET_VALUE) ...",
 			private->item->parent.name, self->name);
+	helper_pause(&private->item->session);
 	err = control_sane_value(
 		private,
 		SANE_ACTION_GET_VALUE,
 		value,
 		NULL
 	);
+	helper_resume(&private->item->session);
 	lis_log_debug("%s->%s->sane_control_option(GET_VALUE): 0x%X, %s",
 			private->item->parent.name, self->name,
 			err, lis_strerror(err));
@@ -1076,12 +1158,14 @@ static enum lis_error lis_sane_opt_set_value(struct lis_option_descriptor *self,
 
 	lis_log_debug("%s->%s->sane_control_option(SET_VALUE) ...",
 			private->item->parent.name, self->name);
+	helper_pause(&private->item->session);
 	err = control_sane_value(
 		private,
 		SANE_ACTION_SET_VALUE,
 		&value,
 		&sane_set_flags
 	);
+	helper_resume(&private->item->session);
 	lis_log_debug("%s->%s->sane_control_option(SET_VALUE): 0x%X, %s",
 			private->item->parent.name, self->name,
 			err, lis_strerror(err));
@@ -1109,6 +1193,286 @@ static enum lis_error lis_sane_opt_set_value(struct lis_option_descriptor *self,
 }
 
 
+static int notify_open(int fds[2])
+{
+#ifdef __linux__
+	fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	fds[1] = fds[0];
+	return fds[0];
+#else
+	int r;
+
+	r = pipe(fds);
+	if (r < 0) {
+		return r;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	return fds[0];
+#endif
+}
+
+
+static void notify_signal(int fds[2])
+{
+	uint64_t v = 1;
+	ssize_t r;
+
+	r = write(fds[1], &v, sizeof(v));
+	if (r != sizeof(v)) {
+		lis_log_warning("Failed to signal helper fd: %d", (int)r);
+	}
+}
+
+
+static void notify_clear(int fds[2])
+{
+	uint64_t v;
+
+	while (read(fds[0], &v, sizeof(v)) > 0) { }
+}
+
+
+static void notify_close(int fds[2])
+{
+	close(fds[0]);
+	if (fds[1] != fds[0]) {
+		close(fds[1]);
+	}
+}
+
+
+static void *helper_thread(void *_session)
+{
+	struct lis_sane_scan_session *private = _session;
+	SANE_Status sane_err;
+	SANE_Int len;
+
+	LIS_LOCK(&private->helper.mutex);
+	while (!private->helper.stop) {
+		if (!private->helper.requested || private->helper.paused > 0) {
+			pthread_cond_wait(
+				&private->helper.cond, &private->helper.mutex
+			);
+			continue;
+		}
+		private->helper.requested = false;
+		private->helper.busy = true;
+		LIS_UNLOCK(&private->helper.mutex);
+
+		len = 0;
+		lis_log_debug("sane_read() ...");
+		sane_err = sane_read(
+			private->item->handle, private->helper.buffer,
+			sizeof(private->helper.buffer), &len
+		);
+		lis_log_debug("sane_read(): %d (%dB)", sane_err, len);
+
+		LIS_LOCK(&private->helper.mutex);
+		private->helper.status = sane_err;
+		private->helper.len = len;
+		private->helper.offset = 0;
+		private->helper.ready = true;
+		private->helper.busy = false;
+		// wake up helper_pause() too
+		pthread_cond_broadcast(&private->helper.cond);
+		notify_signal(private->helper.fds);
+	}
+	LIS_UNLOCK(&private->helper.mutex);
+	return NULL;
+}
+
+
+/*!
+ * Asks the helper thread to call sane_read(), unless it is already reading
+ * or its previous result hasn't been consumed yet.
+ * Must be called with helper.mutex locked.
+ */
+static void helper_request(struct lis_sane_scan_session *private)
+{
+	if (private->helper.ready || private->helper.busy) {
+		return;
+	}
+	private->helper.requested = true;
+	pthread_cond_broadcast(&private->helper.cond);
+}
+
+
+/*!
+ * Sane handles are not thread-safe: waits for the sane_read() of the helper
+ * thread, if any, and prevents it from starting another one until
+ * helper_resume(). sane_cancel() is the only call that doesn't need it.
+ */
+static void helper_pause(struct lis_sane_scan_session *private)
+{
+	if (!private->helper.running) {
+		return;
+	}
+	LIS_LOCK(&private->helper.mutex);
+	private->helper.paused++;
+	while (private->helper.busy) {
+		pthread_cond_wait(&private->helper.cond, &private->helper.mutex);
+	}
+	LIS_UNLOCK(&private->helper.mutex);
+}
+
+
+static void helper_resume(struct lis_sane_scan_session *private)
+{
+	if (!private->helper.running) {
+		return;
+	}
+	LIS_LOCK(&private->helper.mutex);
+	assert(private->helper.paused > 0);
+	private->helper.paused--;
+	pthread_cond_broadcast(&private->helper.cond);
+	LIS_UNLOCK(&private->helper.mutex);
+}
+
+
+static void helper_start(struct lis_sane_scan_session *private)
+{
+	int r;
+
+	if (notify_open(private->helper.fds) < 0) {
+		lis_log_error("Failed to create helper fd");
+		private->non_blocking = false;
+		return;
+	}
+	pthread_mutex_init(&private->helper.mutex, NULL);
+	pthread_cond_init(&private->helper.cond, NULL);
+	private->helper.stop = false;
+	private->helper.ready = false;
+	private->helper.busy = false;
+	private->helper.paused = 0;
+	// nothing is read before the first scan_read() or get_fd(): until
+	// then, the caller may still use the handle (sane_get_parameters(),
+	// etc)
+	private->helper.requested = false;
+
+	r = pthread_create(
+		&private->helper.thread, NULL, helper_thread, private
+	);
+	if (r != 0) {
+		lis_log_error(
+			"Failed to create Sane helper thread: %d, %s",
+			r, strerror(r)
+		);
+		pthread_cond_destroy(&private->helper.cond);
+		pthread_mutex_destroy(&private->helper.mutex);
+		notify_close(private->helper.fds);
+		private->non_blocking = false;
+		return;
+	}
+	private->helper.running = true;
+}
+
+
+static void helper_stop(struct lis_sane_scan_session *private)
+{
+	if (!private->helper.running) {
+		return;
+	}
+
+	LIS_LOCK(&private->helper.mutex);
+	private->helper.stop = true;
+	pthread_cond_broadcast(&private->helper.cond);
+	LIS_UNLOCK(&private->helper.mutex);
+
+	pthread_join(private->helper.thread, NULL);
+	pthread_cond_destroy(&private->helper.cond);
+	pthread_mutex_destroy(&private->helper.mutex);
+	notify_close(private->helper.fds);
+	private->helper.running = false;
+}
+
+
+/*!
+ * Returns what the helper thread has read so far, without blocking.
+ * Behaves like sane_read() in non-blocking mode.
+ */
+static void helper_read(
+		struct lis_sane_scan_session *private,
+		void *out_buffer, size_t buffer_size,
+		SANE_Status *sane_err, SANE_Int *len
+	)
+{
+	SANE_Int r;
+
+	LIS_LOCK(&private->helper.mutex);
+
+	*sane_err = SANE_STATUS_GOOD;
+	*len = 0;
+
+	if (!private->helper.ready) {
+		// no data yet
+		helper_request(private);
+		LIS_UNLOCK(&private->helper.mutex);
+		return;
+	}
+
+	r = private->helper.len - private->helper.offset;
+	if ((size_t)r > buffer_size) {
+		r = (SANE_Int)buffer_size;
+	}
+	memcpy(
+		out_buffer, private->helper.buffer + private->helper.offset, r
+	);
+	private->helper.offset += r;
+	*len = r;
+
+	if (private->helper.offset >= private->helper.len) {
+		*sane_err = private->helper.status;
+		private->helper.ready = false;
+		notify_clear(private->helper.fds);
+		if (private->helper.status == SANE_STATUS_GOOD) {
+			helper_request(private);
+		}
+	}
+
+	LIS_UNLOCK(&private->helper.mutex);
+}
+
+
+/*!
+ * Must be called after each successful sane_start().
+ */
+static void setup_io(struct lis_sane_scan_session *private)
+{
+	SANE_Status sane_err;
+	SANE_Int fd = -1;
+
+	if (!private->non_blocking) {
+		return;
+	}
+
+	if (private->helper.running) {
+		// new page: the helper thread will start reading on the next
+		// scan_read() or get_fd()
+		return;
+	}
+
+	sane_err = sane_set_io_mode(private->item->handle, SANE_TRUE);
+	if (sane_err == SANE_STATUS_GOOD) {
+		sane_err = sane_get_select_fd(private->item->handle, &fd);
+		if (sane_err == SANE_STATUS_GOOD) {
+			private->select_fd = fd;
+			return;
+		}
+		sane_set_io_mode(private->item->handle, SANE_FALSE);
+	}
+
+	lis_log_info(
+		"Sane: backend doesn't support non-blocking I/O (%d)."
+		" Using a helper thread instead",
+		sane_err
+	);
+	private->select_fd = -1;
+	helper_start(private);
+}
+
+
 static enum lis_error lis_sane_scan_start(struct lis_item *self,
 	struct lis_scan_session **session)
 {
@@ -1118,12 +1482,21 @@ static enum lis_error lis_sane_scan_start(struct lis_item *self,
 
 	lis_log_info("Sane: scan_start() ...");
 
+	if (private->session.helper.running) {
+		// previous session hasn't been cancelled
+		lis_sane_cancel(&private->session.parent);
+	}
+
 	memset(&private->session, 0, sizeof(private->session));
 	memcpy(&private->session.parent, &g_sane_scan_session_template,
 			sizeof(private->session.parent));
 	private->session.item = private;
 	*session = &private->session.parent;
 	private->session.need_sane_start = 0;;
+	private->session.non_blocking = lis_getenv(
+		"LIBINSANE_SANE_NON_BLOCKING", 0
+	);
+	private->session.select_fd = -1;
 
 	lis_log_debug("sane_start() ...");
 	sane_err = sane_start(private->handle);
@@ -1141,6 +1514,9 @@ static enum lis_error lis_sane_scan_start(struct lis_item *self,
 		"Sane: scan_start(): %d -> %d, %s",
 		sane_err, err, lis_strerror(err)
 	);
+	if (LIS_IS_OK(err)) {
+		setup_io(&private->session);
+	}
 	return err;
 }
 
@@ -1158,7 +1534,9 @@ static void do_sane_start(struct lis_scan_session *session)
 	private->need_sane_start = 0;
 
 	lis_log_debug("sane_start() ...");
+	helper_pause(private);
 	sane_err = sane_start(private->item->handle);
+	helper_resume(private);
 	lis_log_debug("sane_start(): %d", sane_err);
 	if (sane_err == SANE_STATUS_EOF || sane_err == SANE_STATUS_NO_DOCS) {
 		lis_log_warning("sane_start() returned EOF (%d) --> No document in the feeder",
@@ -1179,7 +1557,10 @@ static void do_sane_start(struct lis_scan_session *session)
 			err, lis_strerror(err));
 		private->end_of_feed = 1;
 		sane_cancel(private->item->handle);
+		return;
 	}
+
+	setup_io(private);
 }
 
 
@@ -1228,9 +1609,16 @@ static enum lis_error lis_sane_scan_read(
 		return LIS_OK;
 	}
 
-	lis_log_debug("sane_read() ...");
-	sane_err = sane_read(private->item->handle, out_buffer, (int)(*buffer_size), &len);
-	lis_log_debug("sane_read(): %d (%dB)", sane_err, len);
+	if (private->helper.running) {
+		helper_read(private, out_buffer, *buffer_size, &sane_err, &len);
+	} else {
+		lis_log_debug("sane_read() ...");
+		sane_err = sane_read(
+			private->item->handle, out_buffer, (int)(*buffer_size),
+			&len
+		);
+		lis_log_debug("sane_read(): %d (%dB)", sane_err, len);
+	}
 
 	*buffer_size = len;
 
@@ -1261,7 +1649,30 @@ static void lis_sane_cancel(struct lis_scan_session *session)
 	struct lis_sane_scan_session *private = LIS_SANE_SCAN_SESSION_PRIVATE(session);
 	lis_log_info("Sane: session->cancel() (%d)", private->end_of_feed);
 	if (!private->end_of_feed) { // else, it's already cancelled
+		// also interrupts the sane_read() of the helper thread, if any
 		sane_cancel(private->item->handle);
 	}
 	private->end_of_feed = 1;
+	helper_stop(private);
+	private->select_fd = -1;
+}
+
+
+static int lis_sane_get_fd(struct lis_scan_session *session)
+{
+	struct lis_sane_scan_session *private = LIS_SANE_SCAN_SESSION_PRIVATE(session);
+
+	if (!private->non_blocking) {
+		return -1;
+	}
+	if (private->helper.running) {
+		if (!private->end_of_page) {
+			// the caller is about to wait for data
+			LIS_LOCK(&private->helper.mutex);
+			helper_request(private);
+			LIS_UNLOCK(&private->helper.mutex);
+		}
+		return private->helper.fds[0];
+	}
+	return private->select_fd;
 }
@@ -189,6 +189,7 @@ static struct lis_scan_session g_twain_session_template = {
 	.end_of_page = twain_end_of_page,
 	.scan_read = twain_scan_read,
 	.cancel = twain_cancel,
+	.name = "twain",
 };
 
 
@@ -92,6 +92,7 @@ static struct lis_scan_session g_scan_session_template = {
 	.end_of_page = end_of_page,
 	.scan_read = scan_read,
 	.cancel = scan_cancel,
+	.name = "wia",
 };
 
 
@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -6,6 +7,7 @@
 #include <libinsane/util.h>
 
 #include "basewrapper.h"
+#include "opt_index.h"
 
 
 struct lis_bw_impl_private {
@@ -53,6 +55,23 @@ struct lis_bw_item {
 
 	struct lis_bw_item **children;
 	struct lis_bw_option_descriptor **options;
+	/* options before filtering (lis_bw_option_descriptor.basewrapper),
+	 * to find them back when the options are reloaded */
+	struct lis_option_descriptor **originals;
+	struct lis_opt_index originals_index;
+
+	/* last option list returned by get_options() */
+	struct lis_option_descriptor **descs;
+	struct lis_opt_index descs_index; /* built on demand */
+	int descs_indexed;
+
+	/* incremented each time the option list returned by get_options()
+	 * changes */
+	unsigned int generation;
+	/* last option list returned by the wrapped item, and its generation
+	 * if the wrapped item comes from another base wrapper */
+	struct lis_option_descriptor **wrapped_descs;
+	unsigned int wrapped_generation;
 
 	struct lis_bw_item *next;
 
@@ -66,11 +85,16 @@ struct lis_bw_option_descriptor {
 	struct lis_option_descriptor basewrapper; /*!< basewrapper original */
 	struct lis_option_descriptor *wrapped; /*!< wrapped implementation */
 	struct lis_bw_item *item;
+	union lis_value *filtered_values; /*!< constraint list duplicated for the filter */
 
 	void *user;
 	lis_bw_free_fn free_cb;
 };
 #define LIS_BW_OPT_DESC(opt) ((struct lis_bw_option_descriptor *)(opt))
+#define LIS_BW_OPT_DESC_FROM_ORIGINAL(opt) \
+	((struct lis_bw_option_descriptor *)( \
+		((char *)(opt)) - offsetof(struct lis_bw_option_descriptor, basewrapper) \
+	))
 
 
 static struct lis_bw_impl_private *g_impls = NULL;
@@ -311,6 +335,14 @@ static void free_opt_user(struct lis_bw_option_descriptor *opt)
 	}
 }
 
+static void free_opt(struct lis_bw_option_descriptor *opt)
+{
+	FREE(opt->basewrapper.name);
+	free_opt_constraint(&opt->basewrapper);
+	FREE(opt->filtered_values);
+	free_opt_user(opt);
+}
+
 static void free_options(struct lis_bw_item *item)
 {
 	int i;
@@ -321,13 +353,17 @@ static void free_options(struct lis_bw_item *item)
 	}
 	if (item->options != NULL) {
 		for (i = 0 ; item->options[i] != NULL ; i++) {
-			FREE(item->options[i]->basewrapper.name);
-			free_opt_constraint(&item->options[i]->basewrapper);
-			free_opt_user(item->options[i]);
+			free_opt(item->options[i]);
 		}
 		FREE(item->options[0]);
 	}
 	FREE(item->options);
+	FREE(item->originals);
+	lis_opt_index_clean(&item->originals_index);
+	lis_opt_index_clean(&item->descs_index);
+	item->descs = NULL;
+	item->descs_indexed = 0;
+	item->wrapped_descs = NULL;
 }
 
 
@@ -407,127 +443,357 @@ static enum lis_error lis_bw_item_get_children(struct lis_item *self, struct lis
 
 
 static struct lis_bw_option_descriptor *get_bw_opt(
-		struct lis_bw_option_descriptor **opts,
-		const char *name
+		const struct lis_opt_index *originals, const char *name
 	)
 {
-	if (opts == NULL) {
+	struct lis_option_descriptor *original;
+
+	original = lis_opt_index_find(originals, name);
+	if (original == NULL) {
 		return NULL;
 	}
-	for ( ; (*opts) != NULL ; opts++) {
-		if (strcasecmp((*opts)->basewrapper.name, name) == 0) {
-			return *opts;
-		}
+	return LIS_BW_OPT_DESC_FROM_ORIGINAL(original);
+}
+
+
+/* the filtered options keep pointers to the strings of the wrapped ones
+ * --> strings are compared by pointer, not by content */
+static int same_value(enum lis_value_type type, union lis_value a, union lis_value b)
+{
+	if (type == LIS_TYPE_STRING) {
+		return a.string == b.string;
 	}
-	return NULL;
+	return lis_compare(type, a, b);
 }
 
 
-static enum lis_error lis_bw_item_get_options(
-		struct lis_item *self, struct lis_option_descriptor ***descs
+static int same_opt_desc(
+		const struct lis_option_descriptor *previous,
+		const struct lis_option_descriptor *desc
 	)
 {
-	struct lis_bw_item *private = LIS_BW_ITEM(self);
-	struct lis_option_descriptor **opts;
-	struct lis_bw_option_descriptor **old_opts;
-	struct lis_bw_option_descriptor *old_opt;
-	int nb_opts, i;
+	int i;
+
+	if (strcmp(previous->name, desc->name) != 0
+			|| previous->title != desc->title
+			|| previous->desc != desc->desc
+			|| previous->capabilities != desc->capabilities
+			|| previous->value.type != desc->value.type
+			|| previous->value.unit != desc->value.unit
+			|| previous->constraint.type != desc->constraint.type) {
+		return 0;
+	}
+
+	switch(desc->constraint.type) {
+		case LIS_CONSTRAINT_NONE:
+			return 1;
+		case LIS_CONSTRAINT_RANGE:
+			return same_value(
+					desc->value.type,
+					previous->constraint.possible.range.min,
+					desc->constraint.possible.range.min
+				) && same_value(
+					desc->value.type,
+					previous->constraint.possible.range.max,
+					desc->constraint.possible.range.max
+				) && same_value(
+					desc->value.type,
+					previous->constraint.possible.range.interval,
+					desc->constraint.possible.range.interval
+				);
+		case LIS_CONSTRAINT_LIST:
+			if (previous->constraint.possible.list.nb_values
+					!= desc->constraint.possible.list.nb_values) {
+				return 0;
+			}
+			for (i = 0 ; i < desc->constraint.possible.list.nb_values ; i++) {
+				if (!same_value(
+							desc->value.type,
+							previous->constraint.possible.list.values[i],
+							desc->constraint.possible.list.values[i]
+						)) {
+					return 0;
+				}
+			}
+			return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * \brief (Re)build an option descriptor from the wrapped one and run the
+ * filter on it. Name and user pointer of the previous descriptor (if any)
+ * are kept.
+ */
+static enum lis_error filter_opt(
+		struct lis_bw_item *private, struct lis_bw_option_descriptor *opt,
+		struct lis_option_descriptor *wrapped
+	)
+{
+	const char *name = opt->basewrapper.name;
 	enum lis_error err;
 
-	err = private->wrapped->get_options(private->wrapped, &opts);
+	free_opt_constraint(&opt->basewrapper);
+	FREE(opt->filtered_values);
+
+	opt->item = private;
+	opt->wrapped = wrapped;
+	memcpy(&opt->parent, wrapped, sizeof(opt->parent));
+	opt->parent.fn.get_value = lis_bw_get_value;
+	opt->parent.fn.set_value = lis_bw_set_value;
+	opt->parent.name = (name != NULL ? name : strdup(wrapped->name));
+
+	// copy of the wrapped option, to detect changes when the options are
+	// reloaded
+	memcpy(&opt->basewrapper, &opt->parent, sizeof(opt->basewrapper));
+	if (opt->basewrapper.name == NULL) {
+		opt->basewrapper.constraint.type = LIS_CONSTRAINT_NONE;
+		lis_log_error("Out of memory");
+		return LIS_ERR_NO_MEM;
+	}
+	err = dup_opt_constraint(&opt->basewrapper);
 	if (LIS_IS_ERROR(err)) {
+		opt->basewrapper.constraint.type = LIS_CONSTRAINT_NONE;
 		return err;
 	}
-	if(private->impl->opt_desc_filter.cb == NULL) {
-		*descs = opts;
+
+	// and another copy for the filter
+	err = dup_opt_constraint(&opt->parent);
+	if (LIS_IS_ERROR(err)) {
 		return err;
 	}
+	if (opt->parent.constraint.type == LIS_CONSTRAINT_LIST) {
+		opt->filtered_values = opt->parent.constraint.possible.list.values;
+	}
+
+	err = private->impl->opt_desc_filter.cb(
+		&private->parent, &opt->parent,
+		private->impl->opt_desc_filter.user_data
+	);
+	if (LIS_IS_ERROR(err)) {
+		lis_log_warning(
+			"%s: option filter returned an error: %d, %s",
+			private->impl->wrapper_name,
+			err, lis_strerror(err)
+		);
+	}
+	return err;
+}
+
+
+/**
+ * \brief Wrapped item returned the same options, in the same order, as the
+ * last time.
+ */
+static int same_opt_list(
+		struct lis_bw_option_descriptor **previous,
+		struct lis_option_descriptor **opts
+	)
+{
+	int i;
+
+	for (i = 0 ; opts[i] != NULL ; i++) {
+		if (previous[i] == NULL
+				|| strcmp(previous[i]->basewrapper.name, opts[i]->name) != 0) {
+			return 0;
+		}
+	}
+	return (previous[i] == NULL);
+}
+
+
+/**
+ * \brief Only run the filter again on the options that have changed.
+ */
+static enum lis_error reload_changed_opts(
+		struct lis_bw_item *private, struct lis_option_descriptor **opts,
+		int *nb_changed
+	)
+{
+	struct lis_bw_option_descriptor *opt;
+	enum lis_error err;
+	int i;
+
+	*nb_changed = 0;
+
+	for (i = 0 ; opts[i] != NULL ; i++) {
+		opt = private->options[i];
+		if (same_opt_desc(&opt->basewrapper, opts[i])) {
+			opt->wrapped = opts[i];
+			continue;
+		}
+		lis_log_debug(
+			"%s: option '%s' has changed",
+			private->impl->wrapper_name, opts[i]->name
+		);
+		(*nb_changed)++;
+		err = filter_opt(private, opt, opts[i]);
+		if (LIS_IS_ERROR(err)) {
+			return err;
+		}
+	}
+	return LIS_OK;
+}
+
+
+/**
+ * \brief The option list has changed: rebuild all the option descriptors.
+ * Options that were already there keep their user pointers.
+ */
+static enum lis_error reload_all_opts(
+		struct lis_bw_item *private, struct lis_option_descriptor **opts
+	)
+{
+	struct lis_bw_option_descriptor **old_opts;
+	struct lis_option_descriptor **old_originals;
+	struct lis_bw_option_descriptor *old_opt;
+	struct lis_bw_option_descriptor *block = NULL;
+	int nb_opts, i;
+	enum lis_error err = LIS_OK;
 
-	// ASSUMPTION(Jflesch): we assume we get the same list of options
-	// every time. If we don't get back an option, we will have a memory
-	// leak.
 	old_opts = private->options;
+	old_originals = private->originals;
+	if (old_originals != NULL) {
+		err = lis_opt_index_build(&private->originals_index, old_originals);
+		if (LIS_IS_ERROR(err)) {
+			return err;
+		}
+	}
 
 	for (nb_opts = 0 ; opts[nb_opts] != NULL ; nb_opts++) { }
 	private->options = calloc(
 		nb_opts + 1, sizeof(struct lis_bw_option_descriptor *)
 	);
-
-	if (nb_opts <= 0) {
-		// nothing more to do
-		err = LIS_OK;
+	private->originals = calloc(
+		nb_opts + 1, sizeof(struct lis_option_descriptor *)
+	);
+	if (nb_opts > 0) {
+		/* duplicate the options so the filter can modify them */
+		block = calloc(nb_opts, sizeof(struct lis_bw_option_descriptor));
+	}
+	if (private->options == NULL || private->originals == NULL
+			|| (nb_opts > 0 && block == NULL)) {
+		FREE(private->options);
+		FREE(private->originals);
+		FREE(block);
+		lis_log_error("Out of memory");
+		err = LIS_ERR_NO_MEM;
 		goto end;
 	}
 
-	/* duplicate the options so the filter can modify them */
-	private->options[0] = calloc(nb_opts, sizeof(struct lis_bw_option_descriptor));
 	for (i = 0 ; i < nb_opts ; i++) {
-		private->options[i] = private->options[0] + i;
+		private->options[i] = block + i;
+		private->originals[i] = &private->options[i]->basewrapper;
 
-		old_opt = get_bw_opt(old_opts, opts[i]->name);
+		old_opt = NULL;
+		if (old_originals != NULL) {
+			old_opt = get_bw_opt(&private->originals_index, opts[i]->name);
+		}
 
 		// reuse existing opt if possible
 		// (we have to keep the user_ptr whenever possible)
-		if (old_opt != NULL) {
-			memcpy(
-				private->options[i], old_opt,
-				sizeof(*(private->options[i]))
-			);
-			free_opt_constraint(&private->options[i]->basewrapper);
-		}
-
-		private->options[i]->item = private;
-		memcpy(
-			&private->options[i]->parent, opts[i],
-			sizeof(private->options[i]->parent)
-		);
-		private->options[i]->parent.fn.get_value = lis_bw_get_value;
-		private->options[i]->parent.fn.set_value = lis_bw_set_value;
-		private->options[i]->wrapped = opts[i];
-
-		if (old_opt != NULL) {
-			private->options[i]->parent.name = \
-				private->options[i]->basewrapper.name;
-		} else {
-			private->options[i]->parent.name = strdup(opts[i]->name);
+		if (old_opt != NULL && old_opt->item != NULL) {
+			memcpy(private->options[i], old_opt, sizeof(*(private->options[i])));
+			old_opt->item = NULL; // moved
 		}
 
-		err = dup_opt_constraint(&private->options[i]->parent);
+		err = filter_opt(private, private->options[i], opts[i]);
 		if (LIS_IS_ERROR(err)) {
-			FREE(private->options[0]);
-			FREE(private->options);
-			goto end;
-		}
-
-		memcpy(
-			&private->options[i]->basewrapper,
-			&private->options[i]->parent,
-			sizeof(private->options[i]->basewrapper)
-		);
-
-		err = private->impl->opt_desc_filter.cb(
-			self, &private->options[i]->parent,
-			private->impl->opt_desc_filter.user_data
-		);
-		if (LIS_IS_ERROR(err)) {
-			lis_log_warning(
-				"%s: option filter returned an error: %d, %s",
-				private->impl->wrapper_name,
-				err, lis_strerror(err)
-			);
-			FREE(private->options[0]);
-			FREE(private->options);
+			free_opt(private->options[i]);
+			private->options[i] = NULL;
+			private->originals[i] = NULL;
+			if (i == 0) {
+				FREE(block);
+			}
 			goto end;
 		}
 	}
 
 end:
 	if (old_opts != NULL) {
+		for (i = 0 ; old_opts[i] != NULL ; i++) {
+			if (old_opts[i]->item != NULL) {
+				// option has disappeared
+				free_opt(old_opts[i]);
+			}
+		}
 		FREE(old_opts[0]);
 		FREE(old_opts);
 	}
+	FREE(old_originals);
+	return err;
+}
+
+
+static void options_changed(struct lis_bw_item *private)
+{
+	private->generation++;
+	private->descs_indexed = 0;
+}
+
+
+static enum lis_error lis_bw_item_get_options(
+		struct lis_item *self, struct lis_option_descriptor ***descs
+	)
+{
+	struct lis_bw_item *private = LIS_BW_ITEM(self);
+	struct lis_option_descriptor **opts;
+	unsigned int wrapped_generation = 0;
+	int nb_changed;
+	enum lis_error err;
+
+	err = private->wrapped->get_options(private->wrapped, &opts);
+	if (LIS_IS_ERROR(err)) {
+		private->descs = NULL;
+		options_changed(private);
+		return err;
+	}
+
+	if (private->wrapped->get_options == lis_bw_item_get_options) {
+		// the wrapped item tells us if its options have changed
+		wrapped_generation = LIS_BW_ITEM(private->wrapped)->generation;
+		if (private->descs != NULL && opts == private->wrapped_descs
+				&& wrapped_generation == private->wrapped_generation) {
+			*descs = private->descs;
+			return LIS_OK;
+		}
+	}
+
+	if(private->impl->opt_desc_filter.cb == NULL) {
+		// nothing to compare: rely on the wrapped item if it can tell
+		err = LIS_OK;
+		nb_changed = (
+			private->descs != opts
+			|| opts != private->wrapped_descs
+			|| private->wrapped->get_options != lis_bw_item_get_options
+			|| wrapped_generation != private->wrapped_generation
+		);
+		private->descs = opts;
+	} else {
+		if (private->descs != NULL && private->options != NULL
+				&& same_opt_list(private->options, opts)) {
+			err = reload_changed_opts(private, opts, &nb_changed);
+		} else {
+			// first call, or options have been added, removed or
+			// reordered
+			nb_changed = 1;
+			err = reload_all_opts(private, opts);
+		}
+		private->descs = (struct lis_option_descriptor **)private->options;
+	}
 
-	*descs = (struct lis_option_descriptor **)private->options;
+	if (nb_changed > 0) {
+		options_changed(private);
+	}
+	if (LIS_IS_ERROR(err)) {
+		private->descs = NULL;
+		return err;
+	}
+
+	private->wrapped_descs = opts;
+	private->wrapped_generation = wrapped_generation;
+	*descs = private->descs;
 	return err;
 }
 
@@ -610,6 +876,31 @@ struct lis_option_descriptor *lis_bw_get_original_opt(struct lis_option_descript
 }
 
 
+struct lis_option_descriptor *lis_bw_item_get_option(struct lis_item *self, const char *name)
+{
+	struct lis_bw_item *item = LIS_BW_ITEM(self);
+	enum lis_error err;
+
+	if (item->descs == NULL) {
+		return NULL;
+	}
+	if (!item->descs_indexed) {
+		err = lis_opt_index_build(&item->descs_index, item->descs);
+		if (LIS_IS_ERROR(err)) {
+			return NULL;
+		}
+		item->descs_indexed = 1;
+	}
+	return lis_opt_index_find(&item->descs_index, name);
+}
+
+
+unsigned int lis_bw_item_get_generation(struct lis_item *self)
+{
+	return LIS_BW_ITEM(self)->generation;
+}
+
+
 static enum lis_error lis_bw_get_value(struct lis_option_descriptor *self, union lis_value *value)
 {
 	struct lis_bw_option_descriptor *private = LIS_BW_OPT_DESC(self);
@@ -77,9 +77,34 @@ void *lis_bw_opt_get_user_ptr(struct lis_option_descriptor *opt);
  */
 struct lis_option_descriptor *lis_bw_get_original_opt(struct lis_option_descriptor *modified);
 
+/**
+ * \brief Find an option by name (case-insensitive) in the option list last
+ * returned by \ref lis_item.get_options() on this item.
+ * The lookup goes through a hash index built once per option list.
+ * \param[in] item item from \ref lis_bw_set_item_filter() (root or child).
+ * \return the option descriptor. NULL if not found or if get_options() hasn't
+ *   been called yet.
+ */
+struct lis_option_descriptor *lis_bw_item_get_option(struct lis_item *item, const char *name);
+
+/**
+ * \brief Generation of the option list returned by \ref lis_item.get_options()
+ * on this item: it changes each time this list (or one of its descriptors)
+ * changes.
+ * \param[in] item item from \ref lis_bw_set_item_filter() (root or child).
+ */
+unsigned int lis_bw_item_get_generation(struct lis_item *item);
+
 
 /**
  * \brief Called when a scan session is requested.
+ * Wrappers that never touch the image data must not set it: the scan session
+ * of the wrapped item is then returned as is, and the wrapper isn't on the
+ * data path at all. Likewise, when there is nothing to do for a given scan,
+ * the callback should return the scan session of the original item instead of
+ * wrapping it. Only the first page can be checked at that point: this is only
+ * safe for sources whose format can't change from one page to the next
+ * (\ref LIS_ITEM_FLATBED).
  * \param[out] session scan session callbacks
  */
 typedef enum lis_error (*lis_bw_on_scan_start)(
@@ -1,15 +1,65 @@
 #include <assert.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <libinsane/log.h>
 
+#define LOG_BUFSIZE 2048
 
+/* async mode */
+#define ASYNC_NB_SLOTS 1024 /* must be a power of 2 */
+#define ASYNC_MSG_SIZE 512
+
+
+int lis_log_min_level = LIS_LOG_LVL_MIN;
+static enum lis_log_level g_min_level = LIS_LOG_LVL_MIN; /* requested */
+
+/* only protects the calls to the callbacks: they may not be thread-safe */
 static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* each thread formats its messages in its own buffer */
+static __thread char g_buffer[LOG_BUFSIZE];
+
+
+/*!
+ * Lock-free multiple producers / single consumer queue
+ * (bounded queue from Dmitry Vyukov).
+ * Each slot has a sequence number: slot is free for the producer that
+ * got position 'pos' if seq == pos, and ready for the consumer if
+ * seq == pos + 1.
+ */
+struct log_slot {
+	size_t seq;
+	enum lis_log_level lvl;
+	char msg[ASYNC_MSG_SIZE];
+};
+
+struct log_async {
+	struct log_slot slots[ASYNC_NB_SLOTS];
+	size_t enqueue_pos; /* producers */
+	size_t dequeue_pos; /* consumer */
+	size_t dropped;
+	size_t producers; /* threads in async_log() */
+
+	sem_t sem; /* one post per message + one to stop */
+	int stop;
+	pthread_t thread;
+};
+
+/* allocated the first time async mode is enabled, never freed: threads
+ * may still be logging while async mode is being disabled */
+static struct log_async *g_async = NULL;
+static int g_async_enabled = 0;
+static pthread_mutex_t g_async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t g_atfork_once = PTHREAD_ONCE_INIT;
+
 
 static const struct lis_log_callbacks g_default_callbacks = {
 	.callbacks = {
@@ -24,12 +74,76 @@ static const struct lis_log_callbacks g_default_callbacks = {
 static const struct lis_log_callbacks *g_current_callbacks = &g_default_callbacks;
 
 
+static void update_min_level(void)
+{
+	int lvl;
+
+	for (lvl = g_min_level ; lvl <= LIS_LOG_LVL_MAX ; lvl++) {
+		if (g_current_callbacks->callbacks[lvl] != NULL) {
+			break;
+		}
+	}
+	__atomic_store_n(&lis_log_min_level, lvl, __ATOMIC_RELAXED);
+}
+
+
+static void reset_queue(struct log_async *async)
+{
+	int i;
+
+	for (i = 0 ; i < ASYNC_NB_SLOTS ; i++) {
+		async->slots[i].seq = i;
+	}
+	async->enqueue_pos = 0;
+	async->dequeue_pos = 0;
+	async->dropped = 0;
+	async->producers = 0;
+	sem_init(&async->sem, 0, 0);
+}
+
+
+static void atfork_child(void)
+{
+	// only the thread that called fork() exists in the child process:
+	// the drain thread is gone, and the mutex may be held by a thread
+	// that doesn't exist anymore.
+	pthread_mutex_init(&g_mutex, NULL);
+	pthread_mutex_init(&g_async_mutex, NULL);
+	g_async_enabled = 0;
+
+	// messages still in the queue belong to the parent process (its
+	// drain thread delivers them), and the slots claimed by its other
+	// threads would never be published: start over with an empty queue
+	if (g_async != NULL) {
+		reset_queue(g_async);
+	}
+}
+
+
+static void register_atfork(void)
+{
+	pthread_atfork(NULL, NULL, atfork_child);
+}
+
+
 void lis_set_log_callbacks(const struct lis_log_callbacks *callbacks)
 {
+	pthread_once(&g_atfork_once, register_atfork);
+
 	if (callbacks == NULL) {
 		callbacks = &g_default_callbacks;
 	}
 	g_current_callbacks = callbacks;
+	update_min_level();
+}
+
+
+void lis_set_log_level(enum lis_log_level min_lvl)
+{
+	assert(min_lvl >= LIS_LOG_LVL_MIN);
+	assert(min_lvl <= LIS_LOG_LVL_MAX);
+	g_min_level = min_lvl;
+	update_min_level();
 }
 
 
@@ -69,9 +183,194 @@ void lis_log_stderr(enum lis_log_level lis_lvl, const char *msg)
 }
 
 
+static void deliver(enum lis_log_level lvl, const char *msg)
+{
+	lis_log_callback *cb;
+	int r;
+
+	cb = g_current_callbacks->callbacks[lvl];
+	if (cb == NULL) {
+		return;
+	}
+
+	r = pthread_mutex_lock(&g_mutex);
+	assert(r == 0);
+	cb(lvl, msg);
+	r = pthread_mutex_unlock(&g_mutex);
+	assert(r == 0);
+}
+
+
+/*!
+ * \retval 0 the queue is full: message has been dropped.
+ */
+static int async_push(struct log_async *async, enum lis_log_level lvl, const char *msg)
+{
+	struct log_slot *slot;
+	size_t pos, seq;
+	intptr_t diff;
+
+	pos = __atomic_load_n(&async->enqueue_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &async->slots[pos & (ASYNC_NB_SLOTS - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(
+						&async->enqueue_pos, &pos, pos + 1,
+						1 /* weak */,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED
+					)) {
+				break;
+			}
+			// pos has been updated by __atomic_compare_exchange_n()
+		} else if (diff < 0) {
+			__atomic_add_fetch(&async->dropped, 1, __ATOMIC_RELAXED);
+			return 0;
+		} else {
+			pos = __atomic_load_n(&async->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->lvl = lvl;
+	strncpy(slot->msg, msg, sizeof(slot->msg) - 1);
+	slot->msg[sizeof(slot->msg) - 1] = '\0';
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	sem_post(&async->sem);
+	return 1;
+}
+
+
+/*!
+ * \retval 0 async mode is disabled: the caller must deliver the message
+ *   itself.
+ */
+static int async_log(enum lis_log_level lvl, const char *msg)
+{
+	if (!__atomic_load_n(&g_async_enabled, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+
+	// lis_log_set_async(0) waits for us before its final drain. Check
+	// again once registered: it may have missed us.
+	__atomic_add_fetch(&g_async->producers, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&g_async_enabled, __ATOMIC_SEQ_CST)) {
+		__atomic_sub_fetch(&g_async->producers, 1, __ATOMIC_RELEASE);
+		return 0;
+	}
+	async_push(g_async, lvl, msg);
+	__atomic_sub_fetch(&g_async->producers, 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+
+/*!
+ * Consumer side. Delivers all the messages currently in the queue.
+ */
+static void async_drain(struct log_async *async)
+{
+	struct log_slot *slot;
+	size_t dropped;
+	char msg[64];
+
+	for (;;) {
+		slot = &async->slots[async->dequeue_pos & (ASYNC_NB_SLOTS - 1)];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)
+				!= async->dequeue_pos + 1) {
+			break; // empty
+		}
+		deliver(slot->lvl, slot->msg);
+		__atomic_store_n(
+			&slot->seq, async->dequeue_pos + ASYNC_NB_SLOTS,
+			__ATOMIC_RELEASE
+		);
+		async->dequeue_pos++;
+	}
+
+	dropped = __atomic_exchange_n(&async->dropped, 0, __ATOMIC_RELAXED);
+	if (dropped > 0) {
+		snprintf(
+			msg, sizeof(msg), "Log queue full: %lu messages dropped",
+			(unsigned long)dropped
+		);
+		deliver(LIS_LOG_LVL_WARNING, msg);
+	}
+}
+
+
+static void *async_thread(void *_async)
+{
+	struct log_async *async = _async;
+
+	for (;;) {
+		while (sem_wait(&async->sem) != 0 && errno == EINTR) { }
+		async_drain(async);
+		if (__atomic_load_n(&async->stop, __ATOMIC_ACQUIRE)) {
+			// messages pushed before the stop request have been
+			// delivered
+			break;
+		}
+	}
+	return NULL;
+}
+
+
+void lis_log_set_async(int async)
+{
+	int r;
+
+	pthread_once(&g_atfork_once, register_atfork);
+
+	r = pthread_mutex_lock(&g_async_mutex);
+	assert(r == 0);
+
+	if (async && !g_async_enabled) {
+		if (g_async == NULL) {
+			g_async = calloc(1, sizeof(struct log_async));
+			if (g_async == NULL) {
+				fprintf(stderr, "Failed to allocate log queue\n");
+				goto end;
+			}
+			reset_queue(g_async);
+		}
+		g_async->stop = 0;
+		r = pthread_create(&g_async->thread, NULL, async_thread, g_async);
+		if (r != 0) {
+			fprintf(
+				stderr, "Failed to create log thread: %d, %s\n",
+				r, strerror(r)
+			);
+			goto end;
+		}
+		__atomic_store_n(&g_async_enabled, 1, __ATOMIC_RELEASE);
+	} else if (!async && g_async_enabled) {
+		__atomic_store_n(&g_async_enabled, 0, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&g_async->stop, 1, __ATOMIC_RELEASE);
+		sem_post(&g_async->sem);
+		pthread_join(g_async->thread, NULL);
+		// threads that have seen async mode enabled may still be
+		// pushing. New ones deliver their messages themselves.
+		while (__atomic_load_n(&g_async->producers, __ATOMIC_SEQ_CST) > 0) {
+			sched_yield();
+		}
+		async_drain(g_async);
+	}
+
+end:
+	r = pthread_mutex_unlock(&g_async_mutex);
+	assert(r == 0);
+}
+
+
 void lis_log_raw(enum lis_log_level lvl, const char *msg)
 {
-	g_current_callbacks->callbacks[lvl](lvl, msg);
+	if (!LIS_LOG_ENABLED(lvl)) {
+		return;
+	}
+	if (async_log(lvl, msg)) {
+		return;
+	}
+	deliver(lvl, msg);
 }
 
 
@@ -80,17 +379,14 @@ void lis_log(
 		const char *msg, ...
 	)
 {
-	static char g_buffer[2048];
 	int r;
 	va_list ap;
 
-	r = pthread_mutex_lock(&g_mutex);
-	assert(r == 0);
-
 	assert(lvl >= LIS_LOG_LVL_MIN);
 	assert(lvl <= LIS_LOG_LVL_MAX);
 
-	if (g_current_callbacks->callbacks[lvl] == NULL) {
+	if (!LIS_LOG_ENABLED(lvl)
+			|| g_current_callbacks->callbacks[lvl] == NULL) {
 		return;
 	}
 
@@ -112,14 +408,15 @@ void lis_log(
 		}
 	}
 
-	g_current_callbacks->callbacks[lvl](lvl, g_buffer);
-
-	r = pthread_mutex_unlock(&g_mutex);
-	assert(r == 0);
+	if (async_log(lvl, g_buffer)) {
+		return;
+	}
+	deliver(lvl, g_buffer);
 }
 
 
 void lis_log_reset(void)
 {
 	g_current_callbacks = &g_default_callbacks;
+	update_min_level();
 }
@@ -1,18 +1,42 @@
 #define _GNU_SOURCE
 
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <libinsane/capi.h>
 #include <libinsane/error.h>
 #include <libinsane/log.h>
 #include <libinsane/multiplexer.h>
+#include <libinsane/util.h>
 
 
 #define MAX_APIS 8
 
 
+/*!
+ * list_devices() running in its own thread (parallel mode).
+ * Protected by lis_multi.mutex.
+ */
+struct lis_multi_discovery
+{
+	struct lis_multi *multi;
+	struct lis_api *impl;
+	enum lis_device_locations locations;
+
+	pthread_t thread;
+	int started; /* thread must be joined */
+	int done;
+
+	enum lis_error err;
+	struct lis_device_descriptor **devs; /* from impl */
+};
+
+
 struct lis_multi
 {
 	struct lis_api parent;
@@ -28,6 +52,12 @@ struct lis_multi
 	 * - all other pointers are those reported by the child implementation (--> no need to free them here)
 	 */
 	struct lis_device_descriptor **merged_devs;
+
+	int parallel;
+	int timeout_ms; /* 0 = none */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct lis_multi_discovery discoveries[MAX_APIS];
 };
 #define LIS_MULTI_PRIVATE(impl) ((struct lis_multi *)(impl))
 
@@ -89,6 +119,7 @@ enum lis_error lis_api_multiplexer(
 {
 	struct lis_multi *private;
 	enum lis_error err;
+	int i, ret;
 
 	if (nb_input_implementations > MAX_APIS || nb_input_implementations == 0) {
 		lis_log_error("Too many implementations to manage ! (%d > %d)",
@@ -121,6 +152,17 @@ enum lis_error lis_api_multiplexer(
 		return err;
 	}
 
+	private->parallel = lis_getenv("LIBINSANE_MULTIPLEXER_PARALLEL", 0);
+	private->timeout_ms = lis_getenv("LIBINSANE_MULTIPLEXER_TIMEOUT_MS", 0);
+	ret = pthread_mutex_init(&private->mutex, NULL);
+	assert(ret == 0);
+	ret = pthread_cond_init(&private->cond, NULL);
+	assert(ret == 0);
+	for (i = 0 ; i < nb_input_implementations ; i++) {
+		private->discoveries[i].multi = private;
+		private->discoveries[i].impl = input_implementations[i];
+	}
+
 	*output_implementation = &private->parent;
 	return LIS_OK;
 }
@@ -148,22 +190,249 @@ static void lis_multi_cleanup(struct lis_api *impl)
 	free((char *)private->parent.base_name /* drop the const */);
 	lis_multi_cleanup_dev_descs(private->merged_devs);
 	for (i = 0 ; i < private->nb_impls ; i++) {
+		if (private->discoveries[i].started) {
+			// may still be running if it timed out
+			pthread_join(private->discoveries[i].thread, NULL);
+		}
 		private->impls[i]->cleanup(private->impls[i]);
 	}
+	pthread_cond_destroy(&private->cond);
+	pthread_mutex_destroy(&private->mutex);
 	free(private->impls);
 	free(private);
 }
 
 
-static enum lis_error lis_multi_list_devices(
-		struct lis_api *impl, enum lis_device_locations locations,
+/*!
+ * Make our own copies of the device descriptors of one API, with
+ * the device ids prefixed with "<api_name>:".
+ */
+static enum lis_error prefix_devs(
+		struct lis_api *impl, struct lis_device_descriptor **devs,
+		struct lis_device_descriptor ***out,
+		lis_multiplexer_device_cb cb, void *cb_data
+	)
+{
+	int nb_devs, i;
+
+	for (nb_devs = 0 ; devs[nb_devs] != NULL ; nb_devs++) { }
+	lis_log_debug("Got %d devices from API %s", nb_devs, impl->base_name);
+
+	*out = calloc(nb_devs + 1, sizeof(struct lis_device_descriptor *));
+	if (*out == NULL) {
+		lis_log_error("out of memory");
+		return LIS_ERR_NO_MEM;
+	}
+
+	for (i = 0 ; i < nb_devs ; i++) {
+		(*out)[i] = calloc(1, sizeof(struct lis_device_descriptor));
+		if ((*out)[i] == NULL) {
+			goto error;
+		}
+		memcpy((*out)[i], devs[i], sizeof(struct lis_device_descriptor));
+		(*out)[i]->dev_id = NULL;
+		if (asprintf(&(*out)[i]->dev_id, "%s:%s",
+					impl->base_name, devs[i]->dev_id) < 0) {
+			(*out)[i]->dev_id = NULL;
+			goto error;
+		}
+	}
+
+	if (cb != NULL) {
+		for (i = 0 ; i < nb_devs ; i++) {
+			cb((*out)[i], cb_data);
+		}
+	}
+
+	return LIS_OK;
+
+error:
+	lis_log_error("out of memory");
+	lis_multi_cleanup_dev_descs(*out);
+	*out = NULL;
+	return LIS_ERR_NO_MEM;
+}
+
+
+static void *discovery_thread(void *_discovery)
+{
+	struct lis_multi_discovery *discovery = _discovery;
+	struct lis_device_descriptor **devs = NULL;
+	enum lis_error err;
+	int ret;
+
+	err = discovery->impl->list_devices(
+		discovery->impl, discovery->locations, &devs
+	);
+
+	ret = pthread_mutex_lock(&discovery->multi->mutex);
+	assert(ret == 0);
+	discovery->err = err;
+	discovery->devs = devs;
+	discovery->done = 1;
+	ret = pthread_cond_broadcast(&discovery->multi->cond);
+	assert(ret == 0);
+	ret = pthread_mutex_unlock(&discovery->multi->mutex);
+	assert(ret == 0);
+
+	return NULL;
+}
+
+
+static void list_devices_sequential(
+		struct lis_multi *private, enum lis_device_locations locations,
+		lis_multiplexer_device_cb cb, void *cb_data,
+		struct lis_device_descriptor ***devs, enum lis_error *errs
+	)
+{
+	struct lis_device_descriptor **api_devs;
+	int i;
+
+	for (i = 0 ; i < private->nb_impls ; i++) {
+		lis_log_debug("Getting devices from API %d", i);
+		errs[i] = private->impls[i]->list_devices(
+			private->impls[i], locations, &api_devs
+		);
+		if (LIS_IS_OK(errs[i])) {
+			errs[i] = prefix_devs(
+				private->impls[i], api_devs, &devs[i], cb, cb_data
+			);
+		}
+	}
+}
+
+
+/*!
+ * Calls list_devices() on all the APIs at the same time. Each API is still
+ * called from one thread at a time: if a previous call on an API timed out
+ * and is still running, this API is skipped.
+ */
+static void list_devices_parallel(
+		struct lis_multi *private, enum lis_device_locations locations,
+		lis_multiplexer_device_cb cb, void *cb_data,
+		struct lis_device_descriptor ***devs, enum lis_error *errs
+	)
+{
+	struct lis_multi_discovery *discovery;
+	int pending[MAX_APIS];
+	int nb_pending = 0, i, ret;
+	struct timespec deadline;
+
+	memset(pending, 0, sizeof(pending));
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += private->timeout_ms / 1000;
+	deadline.tv_nsec += (private->timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	ret = pthread_mutex_lock(&private->mutex);
+	assert(ret == 0);
+
+	for (i = 0 ; i < private->nb_impls ; i++) {
+		discovery = &private->discoveries[i];
+		if (discovery->started && !discovery->done) {
+			lis_log_warning(
+				"API %s: previous list_devices() is still running",
+				discovery->impl->base_name
+			);
+			errs[i] = LIS_ERR_DEVICE_BUSY;
+			continue;
+		}
+		if (discovery->started) {
+			pthread_join(discovery->thread, NULL);
+			discovery->started = 0;
+		}
+
+		lis_log_debug("Getting devices from API %d", i);
+		discovery->locations = locations;
+		discovery->done = 0;
+		discovery->devs = NULL;
+		ret = pthread_create(
+			&discovery->thread, NULL, discovery_thread, discovery
+		);
+		if (ret != 0) {
+			lis_log_error(
+				"API %s: failed to start thread: %d",
+				discovery->impl->base_name, ret
+			);
+			errs[i] = LIS_ERR_NO_MEM;
+			continue;
+		}
+		discovery->started = 1;
+		pending[i] = 1;
+		nb_pending++;
+	}
+
+	while (nb_pending > 0) {
+		for (i = 0 ; i < private->nb_impls ; i++) {
+			discovery = &private->discoveries[i];
+			if (!pending[i] || !discovery->done) {
+				continue;
+			}
+			pending[i] = 0;
+			nb_pending--;
+
+			// the API won't be called again until we return:
+			// discovery->devs remains valid
+			ret = pthread_mutex_unlock(&private->mutex);
+			assert(ret == 0);
+			errs[i] = discovery->err;
+			if (LIS_IS_OK(errs[i])) {
+				errs[i] = prefix_devs(
+					discovery->impl, discovery->devs, &devs[i],
+					cb, cb_data
+				);
+			}
+			ret = pthread_mutex_lock(&private->mutex);
+			assert(ret == 0);
+			break;
+		}
+		if (i < private->nb_impls || nb_pending <= 0) {
+			continue; // mutex has been released: check them all again
+		}
+
+		if (private->timeout_ms <= 0) {
+			ret = pthread_cond_wait(&private->cond, &private->mutex);
+			assert(ret == 0);
+			continue;
+		}
+
+		ret = pthread_cond_timedwait(
+			&private->cond, &private->mutex, &deadline
+		);
+		if (ret == ETIMEDOUT) {
+			for (i = 0 ; i < private->nb_impls ; i++) {
+				if (pending[i] && !private->discoveries[i].done) {
+					lis_log_warning(
+						"API %s: list_devices() timed out (%dms)",
+						private->impls[i]->base_name,
+						private->timeout_ms
+					);
+					errs[i] = LIS_ERR_IO_ERROR;
+					pending[i] = 0;
+					nb_pending--;
+				}
+			}
+		}
+	}
+
+	ret = pthread_mutex_unlock(&private->mutex);
+	assert(ret == 0);
+}
+
+
+static enum lis_error multi_list_devices(
+		struct lis_multi *private, enum lis_device_locations locations,
+		lis_multiplexer_device_cb cb, void *cb_data,
 		struct lis_device_descriptor ***out_dev_descs)
 {
-	struct lis_multi *private = LIS_MULTI_PRIVATE(impl);
 	enum lis_error err, last_err = LIS_OK;
+	enum lis_error errs[MAX_APIS];
 	int has_success = 0, i, j, nb_devs;
 	struct lis_device_descriptor **devs[MAX_APIS];
-	char *devid;
 
 	assert(private->nb_impls > 0);
 	assert(private->nb_impls <= MAX_APIS);
@@ -172,19 +441,22 @@ static enum lis_error lis_multi_list_devices(
 
 	/* get all the devices */
 	memset(&devs, 0, sizeof(devs));
+	if (private->parallel) {
+		list_devices_parallel(private, locations, cb, cb_data, devs, errs);
+	} else {
+		list_devices_sequential(private, locations, cb, cb_data, devs, errs);
+	}
+
 	nb_devs = 0;
 	for (i = 0 ; i < private->nb_impls ; i++) {
-		lis_log_debug("Getting devices from API %d", i);
-		err = private->impls[i]->list_devices(private->impls[i], locations, &devs[i]);
-		if (LIS_IS_ERROR(err)) {
-			last_err = err;
+		if (LIS_IS_ERROR(errs[i])) {
+			last_err = errs[i];
 			continue;
 		}
 		has_success = 1;
 		for (j = 0 ; devs[i][j] != NULL ; j++) {
 			nb_devs++;
 		}
-		lis_log_debug("Got %d devices from API %d", j, i);
 	}
 
 	/* if all implementations have failed
@@ -195,15 +467,16 @@ static enum lis_error lis_multi_list_devices(
 			" number of devices found: %d ;"
 			" last error: 0x%X, %s",
 			has_success, nb_devs, last_err, lis_strerror(last_err));
-		return last_err;
+		err = last_err;
+		goto end;
 	}
 
-	/* merge the device lists */
+	/* merge the device lists, in the order of the APIs */
 	*out_dev_descs = calloc(nb_devs + 1, sizeof(struct lis_device_descriptor *));
 	if (*out_dev_descs == NULL) {
 		lis_log_error("out of memory");
 		err = LIS_ERR_NO_MEM;
-		goto error;
+		goto end;
 	}
 	nb_devs = 0;
 	for (i = 0 ; i < private->nb_impls ; i++) {
@@ -211,40 +484,57 @@ static enum lis_error lis_multi_list_devices(
 			continue;
 		}
 		for (j = 0 ; devs[i][j] != NULL ; j++) {
-			(*out_dev_descs)[nb_devs] = calloc(1, sizeof(struct lis_device_descriptor));
-			if ((*out_dev_descs)[nb_devs] == NULL) {
-				lis_log_error("out of memory");
-				err = LIS_ERR_NO_MEM;
-				goto error;
-			}
-			memcpy((*out_dev_descs)[nb_devs], devs[i][j], sizeof(struct lis_device_descriptor));
-			devid = calloc(
-				strlen(private->impls[i]->base_name)
-				+ strlen(((*out_dev_descs)[nb_devs])->dev_id)
-				+ 2,
-				sizeof(char)
-			);
-			if (devid == NULL) {
-				((*out_dev_descs)[nb_devs])->dev_id = NULL;
-				lis_log_error("out of memory");
-				err = LIS_ERR_NO_MEM;
-				goto error;
-			}
-			sprintf(devid,
-					"%s:%s",
-					private->impls[i]->base_name,
-					((*out_dev_descs)[nb_devs])->dev_id);
-			((*out_dev_descs)[nb_devs])->dev_id = devid;
+			(*out_dev_descs)[nb_devs] = devs[i][j];
 			nb_devs++;
 		}
+		FREE(devs[i]); // descriptors now belong to out_dev_descs
 	}
 
 	lis_multi_cleanup_dev_descs(private->merged_devs);
 	private->merged_devs = *out_dev_descs;
 	return LIS_OK;
 
-error:
-	lis_multi_cleanup_dev_descs(*out_dev_descs);
+end:
+	for (i = 0 ; i < private->nb_impls ; i++) {
+		lis_multi_cleanup_dev_descs(devs[i]);
+	}
+	return err;
+}
+
+
+static enum lis_error lis_multi_list_devices(
+		struct lis_api *impl, enum lis_device_locations locations,
+		struct lis_device_descriptor ***out_dev_descs)
+{
+	return multi_list_devices(
+		LIS_MULTI_PRIVATE(impl), locations, NULL, NULL, out_dev_descs
+	);
+}
+
+
+enum lis_error lis_multiplexer_list_devices(
+		struct lis_api *impl, enum lis_device_locations locations,
+		lis_multiplexer_device_cb cb, void *cb_data,
+		struct lis_device_descriptor ***dev_descs
+	)
+{
+	enum lis_error err;
+	int i;
+
+	if (impl->list_devices == lis_multi_list_devices) {
+		return multi_list_devices(
+			LIS_MULTI_PRIVATE(impl), locations, cb, cb_data, dev_descs
+		);
+	}
+
+	// not a multiplexer: nothing to stream
+	err = impl->list_devices(impl, locations, dev_descs);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+	for (i = 0 ; (*dev_descs)[i] != NULL ; i++) {
+		cb((*dev_descs)[i], cb_data);
+	}
 	return err;
 }
 
@@ -253,7 +543,7 @@ static enum lis_error lis_multi_get_device(struct lis_api *impl, const char *dev
 	struct lis_multi *private = LIS_MULTI_PRIVATE(impl);
 	char *api_name;
 	char *sep;
-	int i;
+	int i, api_idx = -1, busy, ret;
 
 	sep = strchr(dev_id, ':');
 	if (sep == NULL) {
@@ -267,6 +557,7 @@ static enum lis_error lis_multi_get_device(struct lis_api *impl, const char *dev
 	for (i = 0 ; i < private->nb_impls ; i++) {
 		if (strcmp(api_name, private->impls[i]->base_name) == 0) {
 			impl = private->impls[i];
+			api_idx = i;
 		}
 	}
 	if (impl == NULL) {
@@ -276,5 +567,21 @@ static enum lis_error lis_multi_get_device(struct lis_api *impl, const char *dev
 	}
 	free(api_name);
 
+	// a list_devices() that timed out may still be running on this API
+	// (parallel mode): APIs must not be called from 2 threads at once.
+	ret = pthread_mutex_lock(&private->mutex);
+	assert(ret == 0);
+	busy = (private->discoveries[api_idx].started
+		&& !private->discoveries[api_idx].done);
+	ret = pthread_mutex_unlock(&private->mutex);
+	assert(ret == 0);
+	if (busy) {
+		lis_log_error(
+			"API %s: previous list_devices() is still running",
+			impl->base_name
+		);
+		return LIS_ERR_DEVICE_BUSY;
+	}
+
 	return impl->get_device(impl, sep + 1, item);
 }
@@ -5,6 +5,8 @@
 #include <libinsane/normalizers.h>
 #include <libinsane/util.h>
 
+#include "../opt_index.h"
+
 #define NAME "normalizer_all_opts_on_all_sources"
 
 
@@ -26,6 +28,7 @@ struct opts_item
 	struct opts_item **children_ptrs;
 
 	struct lis_option_descriptor **opts;
+	struct lis_opt_index source_index;
 };
 #define LIS_OPTS_ITEM_PRIVATE(item) ((struct opts_item *)(item))
 
@@ -152,6 +155,7 @@ static void free_children(struct opts_item *private)
 		}
 	}
 	free_options(private);
+	lis_opt_index_clean(&private->source_index);
 	FREE(private->children);
 	FREE(private->children_ptrs);
 }
@@ -260,14 +264,13 @@ static enum lis_error opts_source_get_options(
 		return err;
 	}
 
+	err = lis_opt_index_build(&private->source_index, source_opts);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+
 	for (dev_opt_idx = 0, nb_root_opts = 0 ; dev_opts[dev_opt_idx] != NULL ; dev_opt_idx++, nb_root_opts++) {
-		for (source_opt_idx = 0 ; source_opts[source_opt_idx] != NULL ; source_opt_idx++) {
-			if (strcasecmp(dev_opts[dev_opt_idx]->name,
-					source_opts[source_opt_idx]->name) == 0) {
-				break;
-			}
-		}
-		if (source_opts[source_opt_idx] != NULL) {
+		if (lis_opt_index_find(&private->source_index, dev_opts[dev_opt_idx]->name) != NULL) {
 			lis_log_info("Option '%s' from root item already present on child item '%s'",
 				dev_opts[dev_opt_idx]->name, self->name);
 		} else {
@@ -323,13 +326,7 @@ static enum lis_error opts_source_get_options(
 	}
 
 	for (dev_opt_idx = 0 ; dev_opts[dev_opt_idx] != NULL ; dev_opt_idx++) {
-		for (source_opt_idx = 0 ; source_opts[source_opt_idx] != NULL ; source_opt_idx++) {
-			if (strcasecmp(dev_opts[dev_opt_idx]->name,
-					source_opts[source_opt_idx]->name) == 0) {
-				break;
-			}
-		}
-		if (source_opts[source_opt_idx] == NULL) {
+		if (lis_opt_index_find(&private->source_index, dev_opts[dev_opt_idx]->name) == NULL) {
 			lis_log_info("Adding option '%s' from root item to child item '%s'",
 				dev_opts[dev_opt_idx]->name, self->name);
 			private->opts[nb_opts] = dev_opts[dev_opt_idx];
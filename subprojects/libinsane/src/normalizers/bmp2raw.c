@@ -9,9 +9,20 @@
 #include <libinsane/normalizers.h>
 #include <libinsane/util.h>
 
+#include "output_formats.h"
 #include "../basewrapper.h"
 #include "../bmp.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BMP2RAW_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__ARM_NEON)
+#define BMP2RAW_NEON
+#include <arm_neon.h>
+#endif
+
 
 #define NAME "bmp2raw"
 
@@ -284,13 +295,43 @@ static const unsigned char DEFAULT_PALETTE_8[] = {
 struct lis_bmp2raw_scan_session;
 
 /**
- * unpack a pixel line in place.
+ * Convert a BMP pixel line into a RAW pixel line (RAW24, or the native
+ * format if the application accepts it) in a single pass: palette lookup,
+ * BGR to RGB and, if required, mirroring.
+ * Implementations may read and write up to \ref LINE_SLACK bytes after
+ * the end of the lines.
+ */
+typedef void (bmp_line_to_raw_cb)(
+	const struct lis_bmp2raw_scan_session *session,
+	const uint8_t *in, uint8_t *out
+);
+
+/**
+ * Precompute the lookup table used by the line converter (if any).
  */
-typedef void (bmp_to_raw24_cb)(struct lis_bmp2raw_scan_session *session);
+typedef void (bmp_build_lut_cb)(struct lis_bmp2raw_scan_session *session);
+
+/**
+ * Indicates if the image can be returned in its native format without
+ * losing anything (palette made only of grays, or only of black and white).
+ */
+typedef bool (bmp_has_native_palette_cb)(
+	const struct lis_bmp2raw_scan_session *session
+);
+
+static bmp_build_lut_cb build_lut_1;
+static bmp_build_lut_cb build_lut_1_bw;
+static bmp_build_lut_cb build_lut_8;
+static bmp_build_lut_cb build_lut_8_gray;
+
+static bmp_has_native_palette_cb has_bw_palette;
+static bmp_has_native_palette_cb has_gray_palette;
 
-static bmp_to_raw24_cb unpack_1;
-static bmp_to_raw24_cb unpack_8;
-static bmp_to_raw24_cb unpack_24;
+static bmp_line_to_raw_cb line_1;
+static bmp_line_to_raw_cb line_1_bw;
+static bmp_line_to_raw_cb line_8;
+static bmp_line_to_raw_cb line_8_gray;
+static bmp_line_to_raw_cb line_24;
 
 
 static const struct unpack_rule
@@ -298,28 +339,68 @@ static const struct unpack_rule
 	int depth;
 	const unsigned char *default_palette;
 	int default_palette_len;
-	bmp_to_raw24_cb *unpack_cb;
+	bmp_build_lut_cb *build_lut_cb;
+	bmp_line_to_raw_cb *line_cb;
+
+	// used instead of the RAW24 conversion when the application accepts
+	// the native format (see OPT_NAME_OUTPUT_FORMATS)
+	struct {
+		enum lis_img_format format;
+		int bits_per_pixel;
+		bmp_has_native_palette_cb *has_palette_cb;
+		bmp_build_lut_cb *build_lut_cb;
+		bmp_line_to_raw_cb *line_cb;
+	} native;
 } g_unpack_rules[] = {
 	{
 		.depth = 1,
 		.default_palette = DEFAULT_PALETTE_1,
 		.default_palette_len = LIS_COUNT_OF(DEFAULT_PALETTE_1) / 4,
-		.unpack_cb = unpack_1,
+		.build_lut_cb = build_lut_1,
+		.line_cb = line_1,
+		.native = {
+			.format = LIS_IMG_FORMAT_BW_1,
+			.bits_per_pixel = 1,
+			.has_palette_cb = has_bw_palette,
+			.build_lut_cb = build_lut_1_bw,
+			.line_cb = line_1_bw,
+		},
 	},
 	{
 		.depth = 8,
 		.default_palette = DEFAULT_PALETTE_8,
 		.default_palette_len = LIS_COUNT_OF(DEFAULT_PALETTE_8) / 4,
-		.unpack_cb = unpack_8,
+		.build_lut_cb = build_lut_8,
+		.line_cb = line_8,
+		.native = {
+			.format = LIS_IMG_FORMAT_GRAYSCALE_8,
+			.bits_per_pixel = 8,
+			.has_palette_cb = has_gray_palette,
+			.build_lut_cb = build_lut_8_gray,
+			.line_cb = line_8_gray,
+		},
 	},
 	{
 		.depth = 24,
 		.default_palette = NULL,
 		.default_palette_len = 0,
-		.unpack_cb = unpack_24,
+		.build_lut_cb = NULL,
+		.line_cb = line_24,
 	},
 };
 
+// extra bytes allocated after each line buffer: line converters can read
+// and write full SIMD registers without caring for the end of the lines.
+#define LINE_SLACK 16
+
+// depth 1: 256 * 8 pixels * 3 bytes ; depth 8: 256 * 4 bytes ;
+// native formats: 256 bytes
+#define LUT_SIZE (256 * 8 * 3)
+
+// how much BMP data we try to get from the wrapped session at once
+// (rounded to a number of whole lines)
+#define BATCH_SIZE (128 * 1024)
+
 
 static enum lis_error lis_bmp2raw_get_scan_parameters(
 	struct lis_scan_session *self,
@@ -332,25 +413,56 @@ static enum lis_error lis_bmp2raw_scan_read(
 	size_t *buffer_size
 );
 static void lis_bmp2raw_cancel(struct lis_scan_session *session);
+static int lis_bmp2raw_get_fd(struct lis_scan_session *session);
+static struct lis_scan_session *lis_bmp2raw_get_wrapped(struct lis_scan_session *session);
+
+
+struct lis_bmp2raw_item
+{
+	struct lis_output_formats formats; // must remain first
+	struct lis_bmp2raw_scan_session *session;
+};
 
 
 struct lis_bmp2raw_scan_session
 {
 	struct lis_scan_session parent;
 	struct lis_scan_session *wrapped;
-	struct lis_item *item;
+	struct lis_bmp2raw_item *item;
 
 	bool header_read;
 	struct lis_scan_parameters parameters_wrapped;
 	struct lis_scan_parameters parameters_out;
 	int need_mirroring;
+	int accepted; // output formats accepted by the application
 
 	const struct unpack_rule *unpack;
-	unsigned char *palette;
+	// RAW24 or native conversion
+	bmp_build_lut_cb *build_lut_cb;
+	bmp_line_to_raw_cb *line_cb;
+	// points in the pool or in a default palette: only valid while the
+	// LUT is built
+	const unsigned char *palette;
 	unsigned int palette_len;
+	// depth 1: 256 * 8 pixels (already mirrored if required)
+	// depth 8: 256 * 4 bytes (R, G, B, 0)
+	// native B&W: 256 bytes (already mirrored if required)
+	// native grayscale: 256 bytes
+	// allocated once for the whole session (LUT_SIZE)
+	uint8_t *lut;
 
 	enum lis_error read_err;
 
+	/* BMP data read from the wrapped session (header remainder, and then
+	 * batches of whole lines). Kept from one page to the next. */
+	struct {
+		uint8_t *data;
+		size_t allocated; // without the LINE_SLACK
+		size_t start; // first byte not converted yet
+		size_t end; // end of what has been read
+		size_t max_lines; // lines per batch
+	} pool;
+
 	struct {
 		struct {
 			int useful; // useful part of the line
@@ -362,7 +474,10 @@ struct lis_bmp2raw_scan_session
 			int current; // what has been read in the current line
 		} unpacked;
 
+		/* converted line, used only when the caller's buffer cannot
+		 * receive a whole line. Kept from one page to the next. */
 		uint8_t *content;
+		size_t allocated; // without the LINE_SLACK
 	} line;
 };
 #define LIS_BMP2RAW_SCAN_SESSION_PRIVATE(session) \
@@ -375,6 +490,9 @@ static struct lis_scan_session g_scan_session_template = {
 	.end_of_page = lis_bmp2raw_end_of_page,
 	.scan_read = lis_bmp2raw_scan_read,
 	.cancel = lis_bmp2raw_cancel,
+	.get_fd = lis_bmp2raw_get_fd,
+	.name = "bmp2raw",
+	.get_wrapped = lis_bmp2raw_get_wrapped,
 };
 
 
@@ -417,21 +535,117 @@ static enum lis_error scan_read_bmp_header(
 }
 
 
+static void free_buffers(struct lis_bmp2raw_scan_session *private)
+{
+	FREE(private->lut);
+	FREE(private->pool.data);
+	private->pool.allocated = 0;
+	private->pool.start = 0;
+	private->pool.end = 0;
+	FREE(private->line.content);
+	private->line.allocated = 0;
+	private->palette = NULL;
+}
+
+
+/**
+ * Makes sure a buffer can hold 'size' bytes (+ LINE_SLACK). Buffers only
+ * grow: once they are big enough, the next pages don't allocate anything.
+ */
+static enum lis_error reserve(uint8_t **data, size_t *allocated, size_t size)
+{
+	uint8_t *new_data;
+
+	if (size <= *allocated && *data != NULL) {
+		return LIS_OK;
+	}
+
+	new_data = realloc(*data, size + LINE_SLACK);
+	if (new_data == NULL) {
+		lis_log_error("Out of memory (%lu B)", (long unsigned)size);
+		return LIS_ERR_NO_MEM;
+	}
+	// line converters may read the slack
+	memset(new_data + size, 0, LINE_SLACK);
+	*data = new_data;
+	*allocated = size;
+	return LIS_OK;
+}
+
+
+static size_t packed_line_length(const struct lis_bmp2raw_scan_session *private)
+{
+	return private->line.packed.useful + private->line.packed.padding;
+}
+
+
+static size_t pool_nb_lines(const struct lis_bmp2raw_scan_session *private)
+{
+	if (packed_line_length(private) == 0) {
+		// header not read (yet)
+		return 0;
+	}
+	return (private->pool.end - private->pool.start)
+		/ packed_line_length(private);
+}
+
+
+/**
+ * Chooses between RAW24 and the native format of the BMP, and computes
+ * the output line length and image size accordingly.
+ */
+static void select_output_format(struct lis_bmp2raw_scan_session *private)
+{
+	const struct unpack_rule *unpack = private->unpack;
+	int width = private->parameters_out.width;
+
+	private->build_lut_cb = unpack->build_lut_cb;
+	private->line_cb = unpack->line_cb;
+	private->parameters_out.format = LIS_IMG_FORMAT_RAW_RGB_24;
+	private->line.unpacked.useful = width * 3;
+
+	if (unpack->native.line_cb != NULL
+			&& (private->accepted
+				& LIS_OUTPUT_FORMAT(unpack->native.format))
+			&& unpack->native.has_palette_cb(private)) {
+		lis_log_info(
+			"[BMP] Returning the image in its native format (%d)",
+			unpack->native.format
+		);
+		private->build_lut_cb = unpack->native.build_lut_cb;
+		private->line_cb = unpack->native.line_cb;
+		private->parameters_out.format = unpack->native.format;
+		private->line.unpacked.useful = (
+			(width * unpack->native.bits_per_pixel) + 7
+		) / 8;
+	}
+
+	// lis_bmp2scan_params() returns the image size as stored in the BMP
+	// but here we want the image size as RAW
+	private->parameters_out.image_size = (
+		(size_t)private->line.unpacked.useful
+		* private->parameters_out.height
+	);
+}
+
+
 static enum lis_error read_bmp_header(struct lis_bmp2raw_scan_session *private)
 {
 	enum lis_error err;
 	unsigned char buffer[BMP_HEADER_SIZE];
-	size_t h, nb;
+	size_t h, batch;
 	int depth;
 	unsigned int i;
 
-	FREE(private->line.content);
 	private->line.unpacked.current = 0;
 	private->line.unpacked.useful = 0;
 	private->line.packed.padding = 0;
 	private->line.packed.useful = 0;
-	FREE(private->palette);
+	private->pool.start = 0;
+	private->pool.end = 0;
+	private->palette = NULL;
 	private->palette_len = 0;
+	private->need_mirroring = 0;
 
 	memset(&private->parameters_wrapped, 0, sizeof(private->parameters_wrapped));
 	memset(&private->parameters_out, 0, sizeof(private->parameters_out));
@@ -447,6 +661,10 @@ static enum lis_error read_bmp_header(struct lis_bmp2raw_scan_session *private)
 			"Unexpected image format: %d. Returning it as is",
 			private->parameters_wrapped.format
 		);
+		memcpy(
+			&private->parameters_out, &private->parameters_wrapped,
+			sizeof(private->parameters_out)
+		);
 		return LIS_OK;
 	}
 
@@ -485,48 +703,14 @@ static enum lis_error read_bmp_header(struct lis_bmp2raw_scan_session *private)
 		private->parameters_out.height *= -1;
 	}
 
-	// line length we want in the output
+	// line length in the BMP
 	private->line.packed.useful = (
-		private->parameters_out.width * depth / 8
+		(private->parameters_out.width * depth + 7) / 8
 	);
-	if (depth % 8 != 0) {
-		private->line.packed.useful += 1;
-	}
-	// we unpack into raw24, always.
-	private->line.unpacked.useful = private->parameters_out.width * 3;
-
 	private->line.packed.padding = 4 - (private->line.packed.useful % 4);
 	if (private->line.packed.padding == 4) {
 		private->line.packed.padding = 0;
 	}
-	lis_log_info(
-		"[BMP] Line length: %dB + %d (unpacked: %dB)",
-		(int)private->line.packed.useful,
-		(int)private->line.packed.padding,
-		(int)private->line.unpacked.useful
-	);
-
-	// we will read line by line ; we need somewhere to store the lines
-	i = MAX(
-		// line will be unpacked in place
-		private->line.packed.useful + private->line.packed.padding,
-		private->line.unpacked.useful
-	);
-	private->line.content = calloc(sizeof(uint8_t), i);
-	if (private->line.content == NULL) {
-		return LIS_ERR_NO_MEM;
-	}
-
-	// mark the current content as used (will force loading the next
-	// line next time read() is called)
-	private->line.unpacked.current = private->line.unpacked.useful;
-
-	// lis_bmp2scan_params() returns the image size as stored in the BMP
-	// but here we want the image size as RAW24
-	private->parameters_out.image_size = (
-		3 * private->parameters_out.width
-		* private->parameters_out.height
-	);
 
 	h -= BMP_HEADER_SIZE;
 
@@ -539,61 +723,73 @@ static enum lis_error read_bmp_header(struct lis_bmp2raw_scan_session *private)
 		return LIS_ERR_INTERNAL_UNKNOWN_ERROR;
 	}
 
-	if (private->palette_len > 0) {
+	private->pool.max_lines = MAX(
+		1, BATCH_SIZE / packed_line_length(private)
+	);
+	batch = private->pool.max_lines * packed_line_length(private);
 
-		private->palette = calloc(private->palette_len, 4);
-		if (private->palette == NULL) {
-			FREE(private->line.content);
-			lis_log_error("Failed to allocate memory to store the palette");
-			return LIS_ERR_NO_MEM;
-		}
+	err = reserve(
+		&private->pool.data, &private->pool.allocated, MAX(h, batch)
+	);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
 
-		err = scan_read_bmp_header(
-			private->wrapped, private->palette, private->palette_len * 4
-		);
+	if (h > 0) {
+		// palette + any extra BMP header: all at once
+		err = scan_read_bmp_header(private->wrapped, private->pool.data, h);
 		if (LIS_IS_ERROR(err)) {
-			FREE(private->line.content);
-			FREE(private->palette);
 			return err;
 		}
-		h -= private->palette_len * 4;
+		if (h > private->palette_len * 4) {
+			lis_log_info(
+				"Extra BMP header: %lu B",
+				(long unsigned)(h - (private->palette_len * 4))
+			);
+		}
+	}
 
+	if (private->palette_len > 0) {
+		private->palette = private->pool.data;
 	} else if (private->unpack->default_palette != NULL) {
-
 		private->palette_len = private->unpack->default_palette_len;
-		private->palette = calloc(private->palette_len, 4);
-		if (private->palette == NULL) {
-			FREE(private->line.content);
-			lis_log_error("Failed to allocate memory to store the palette");
-			return LIS_ERR_NO_MEM;
-		}
-		memcpy(
-			private->palette, private->unpack->default_palette,
-			private->palette_len * 4
-		);
-
+		private->palette = private->unpack->default_palette;
 	}
 
-	if (h > 0) {
-		lis_log_info("Extra BMP header: %lu B", (long unsigned)h);
-	}
+	select_output_format(private);
+	lis_log_info(
+		"[BMP] Line length: %dB + %d (unpacked: %dB)",
+		(int)private->line.packed.useful,
+		(int)private->line.packed.padding,
+		(int)private->line.unpacked.useful
+	);
 
-	while(h > 0) {
-		// drop any extra BMP header
-		nb = h;
-		err = private->wrapped->scan_read(private->wrapped, buffer, &nb);
-		if (LIS_IS_ERROR(err)) {
-			lis_log_error(
-				"Failed to read extra BMP header: 0x%X, %s"
-				" (remaining to read: %lu B)",
-				err, lis_strerror(err), (long unsigned)h
-			);
-			return err;
+	// mark the current content as used (will force loading the next
+	// line next time read() is called)
+	private->line.unpacked.current = private->line.unpacked.useful;
+
+	err = reserve(
+		&private->line.content, &private->line.allocated,
+		private->line.unpacked.useful
+	);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+	if (private->lut == NULL && private->build_lut_cb != NULL) {
+		private->lut = calloc(1, LUT_SIZE);
+		if (private->lut == NULL) {
+			lis_log_error("Failed to allocate memory for the palette LUT");
+			return LIS_ERR_NO_MEM;
 		}
-		h -= nb;
 	}
 
-	return err;
+	if (private->build_lut_cb != NULL) {
+		private->build_lut_cb(private);
+	}
+	// from now on, the pool only contains pixel data
+	private->palette = NULL;
+
+	return LIS_OK;
 }
 
 
@@ -604,22 +800,19 @@ static enum lis_error bmp2raw_scan_start(
 {
 	struct lis_item *original = lis_bw_get_original_item(item);
 	struct lis_item *root = lis_bw_get_root_item(item);
+	struct lis_bmp2raw_item *bmp2raw_item = lis_bw_item_get_user_ptr(root);
 	struct lis_bmp2raw_scan_session *private;
 	enum lis_error err;
 
 	LIS_UNUSED(user_data);
 
-	private = lis_bw_item_get_user_ptr(root);
-	if (private == NULL) {
-		FREE(private);
-	}
-
 	private = calloc(1, sizeof(struct lis_bmp2raw_scan_session));
 	if (private == NULL) {
 		lis_log_error("Out of memory");
 		return LIS_ERR_NO_MEM;
 	}
 	private->read_err = LIS_OK;
+	private->accepted = lis_output_formats_get(&bmp2raw_item->formats);
 
 	err = original->scan_start(original, &private->wrapped);
 	if (LIS_IS_ERROR(err)) {
@@ -632,7 +825,7 @@ static enum lis_error bmp2raw_scan_start(
 	}
 	memcpy(&private->parent, &g_scan_session_template,
 		sizeof(private->parent));
-	private->item = root;
+	private->item = bmp2raw_item;
 
 	err = read_bmp_header(private);
 	if (LIS_IS_ERROR(err)) {
@@ -641,7 +834,18 @@ static enum lis_error bmp2raw_scan_start(
 		return err;
 	}
 
-	lis_bw_item_set_user_ptr(root, private);
+	if (original->type == LIS_ITEM_FLATBED
+			&& private->parameters_wrapped.format != LIS_IMG_FORMAT_BMP) {
+		// returned as is: the application can read directly from the
+		// wrapped session. Other sources may return BMP on the next
+		// pages: the header is checked again on each page.
+		*out = private->wrapped;
+		free_buffers(private);
+		FREE(private);
+		return err;
+	}
+
+	bmp2raw_item->session = private;
 	*out = &private->parent;
 	return err;
 }
@@ -660,11 +864,34 @@ static enum lis_error lis_bmp2raw_get_scan_parameters(
 }
 
 
+static enum lis_error bmp2raw_item_filter(
+		struct lis_item *item, int root, void *user_data
+	)
+{
+	struct lis_bmp2raw_item *bmp2raw_item;
+
+	LIS_UNUSED(user_data);
+
+	if (!root) {
+		return LIS_OK;
+	}
+
+	bmp2raw_item = calloc(1, sizeof(struct lis_bmp2raw_item));
+	if (bmp2raw_item == NULL) {
+		lis_log_error("Out of memory");
+		return LIS_ERR_NO_MEM;
+	}
+	lis_bw_item_set_user_ptr(item, bmp2raw_item);
+	lis_output_formats_init(&bmp2raw_item->formats, item);
+	return LIS_OK;
+}
+
+
 static void bmp2raw_on_item_close(
 		struct lis_item *item, int root, void *user_data
 	)
 {
-	struct lis_bmp2raw_scan_session *private;
+	struct lis_bmp2raw_item *bmp2raw_item;
 
 	LIS_UNUSED(user_data);
 
@@ -672,15 +899,21 @@ static void bmp2raw_on_item_close(
 		return;
 	}
 
-	private = lis_bw_item_get_user_ptr(item);
-	if (private == NULL) {
+	bmp2raw_item = lis_bw_item_get_user_ptr(item);
+	if (bmp2raw_item == NULL) {
 		return;
 	}
 
-	lis_log_warning(
-		"Device has been closed but scan session hasn't been cancelled"
-	);
-	lis_bmp2raw_cancel(&private->parent);
+	if (bmp2raw_item->session != NULL) {
+		lis_log_warning(
+			"Device has been closed but scan session hasn't"
+			" been cancelled"
+		);
+		lis_bmp2raw_cancel(&bmp2raw_item->session->parent);
+	}
+	lis_output_formats_clean(&bmp2raw_item->formats);
+	FREE(bmp2raw_item);
+	lis_bw_item_set_user_ptr(item, NULL);
 }
 
 
@@ -694,7 +927,7 @@ static int lis_bmp2raw_end_of_feed(struct lis_scan_session *session)
 	end_of_page = private->wrapped->end_of_page(private->wrapped);
 	end_of_feed = private->wrapped->end_of_feed(private->wrapped);
 	if (end_of_feed) {
-		FREE(private->line.content);
+		free_buffers(private);
 		return 1;
 	}
 
@@ -726,121 +959,511 @@ static int lis_bmp2raw_end_of_page(struct lis_scan_session *session)
 	if (private->line.unpacked.current < private->line.unpacked.useful) {
 		return 0;
 	}
+	if (private->parameters_wrapped.format == LIS_IMG_FORMAT_BMP
+			&& pool_nb_lines(private) > 0) {
+		return 0;
+	}
 
 	return private->wrapped->end_of_page(private->wrapped);
 }
 
 
-static enum lis_error read_next_line(struct lis_bmp2raw_scan_session *private)
+/**
+ * Reads up to 'nb_lines' whole BMP lines in the pool, with as few calls
+ * to the wrapped scan_read() as possible. Only stops early at the end of
+ * the page.
+ */
+static enum lis_error fill_pool(
+		struct lis_bmp2raw_scan_session *private, size_t nb_lines
+	)
 {
+	size_t line_length = packed_line_length(private);
 	size_t to_read, r;
 	enum lis_error err;
-	uint8_t *out;
 
-	to_read = private->line.packed.useful + private->line.packed.padding;
-	out = private->line.content;
-	lis_log_debug("Reading BMP line: %d bytes", (int)to_read);
+	assert(nb_lines > 0);
+	assert(nb_lines <= private->pool.max_lines);
+
+	// keep what remains (less than a line) at the start of the pool
+	if (private->pool.start > 0) {
+		memmove(
+			private->pool.data,
+			private->pool.data + private->pool.start,
+			private->pool.end - private->pool.start
+		);
+		private->pool.end -= private->pool.start;
+		private->pool.start = 0;
+	}
+
+	to_read = (nb_lines * line_length) - private->pool.end;
+	lis_log_debug("Reading BMP lines: %lu bytes", (long unsigned)to_read);
 
 	while(to_read > 0) {
+		if (private->wrapped->end_of_page(private->wrapped)) {
+			if (private->pool.end % line_length != 0) {
+				lis_log_warning(
+					"Page ended in the middle of a line"
+					" (%lu B dropped)",
+					(long unsigned)(private->pool.end % line_length)
+				);
+			}
+			break;
+		}
+
 		r = to_read;
-		err = private->wrapped->scan_read(private->wrapped, out, &r);
+		err = private->wrapped->scan_read(
+			private->wrapped, private->pool.data + private->pool.end, &r
+		);
 		if (LIS_IS_ERROR(err)) {
 			return err;
 		}
 		to_read -= r;
-		out += r;
+		private->pool.end += r;
 	}
 
 	return LIS_OK;
 }
 
 
-static void unpack_1(struct lis_bmp2raw_scan_session *session)
+/**
+ * Converts the next 'nb_lines' lines of the pool. The output buffer must
+ * be big enough for those lines + LINE_SLACK.
+ */
+static void convert_lines(
+		struct lis_bmp2raw_scan_session *private, uint8_t *out,
+		size_t nb_lines
+	)
+{
+	size_t in_length = packed_line_length(private);
+	size_t out_length = private->line.unpacked.useful;
+
+	assert(nb_lines <= pool_nb_lines(private));
+
+	for ( ; nb_lines > 0 ; nb_lines--) {
+		private->line_cb(
+			private, private->pool.data + private->pool.start, out
+		);
+		private->pool.start += in_length;
+		out += out_length;
+	}
+}
+
+
+static void palette_to_rgb(
+		const struct lis_bmp2raw_scan_session *session,
+		unsigned int idx, uint8_t *out
+	)
 {
+	const uint8_t *p;
+
+	if (idx >= session->palette_len) {
+		// out of palette --> black
+		out[0] = out[1] = out[2] = 0;
+		return;
+	}
+	// palette entries are BGR0
+	p = session->palette + (idx * 4);
+	out[0] = p[2];
+	out[1] = p[1];
+	out[2] = p[0];
+}
+
+
+static void build_lut_1(struct lis_bmp2raw_scan_session *session)
+{
+	unsigned int v;
+	int bit;
 	int idx;
-	int b;
-	int v;
-	uint8_t *p;
 
 	assert(session->palette != NULL);
 	assert(session->palette_len != 0);
+	assert(session->lut != NULL);
+
+	// for each possible byte value: the 8 RGB pixels it expands to.
+	// If mirroring is required, the pixels are stored in reverse order.
+	for (v = 0 ; v < 256 ; v++) {
+		for (bit = 0 ; bit < 8 ; bit++) {
+			idx = session->need_mirroring ? bit : (7 - bit);
+			palette_to_rgb(
+				session, (v >> idx) & 1,
+				session->lut + (v * 8 * 3) + (bit * 3)
+			);
+		}
+	}
+}
+
+
+static void build_lut_8(struct lis_bmp2raw_scan_session *session)
+{
+	unsigned int v;
+
+	assert(session->palette != NULL);
+	assert(session->palette_len != 0);
+	assert(session->lut != NULL);
 
-	for (idx = session->parameters_out.width - 1 ; idx >= 0 ; idx--) {
-		b = session->line.content[idx / 8];
-		v = (b >> (7 - (idx % 8))) & 1;
-		p = session->palette + (v * 4);
+	// 4 bytes per entry: allows copying a whole pixel with a single
+	// 32bits store (the 4th byte is overwritten by the next pixel)
+	for (v = 0 ; v < 256 ; v++) {
+		palette_to_rgb(session, v, session->lut + (v * 4));
+	}
+}
+
+
+static bool is_black_or_white(const uint8_t *rgb)
+{
+	return (rgb[0] == 0x00 && rgb[1] == 0x00 && rgb[2] == 0x00)
+		|| (rgb[0] == 0xFF && rgb[1] == 0xFF && rgb[2] == 0xFF);
+}
 
-		session->line.content[(idx * 3) + 2] = p[2];
-		session->line.content[(idx * 3) + 1] = p[1];
-		session->line.content[(idx * 3)] = p[0];
+
+static bool has_bw_palette(const struct lis_bmp2raw_scan_session *session)
+{
+	uint8_t rgb[3];
+	unsigned int idx;
+
+	for (idx = 0 ; idx < 2 ; idx++) {
+		palette_to_rgb(session, idx, rgb);
+		if (!is_black_or_white(rgb)) {
+			return false;
+		}
 	}
+	return true;
 }
 
 
-static void unpack_8(struct lis_bmp2raw_scan_session *session)
+static bool has_gray_palette(const struct lis_bmp2raw_scan_session *session)
 {
-	int idx;
-	uint8_t v;
-	uint8_t *p;
+	uint8_t rgb[3];
+	unsigned int idx;
+
+	for (idx = 0 ; idx < session->palette_len && idx < 256 ; idx++) {
+		palette_to_rgb(session, idx, rgb);
+		if (rgb[0] != rgb[1] || rgb[1] != rgb[2]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+static void build_lut_1_bw(struct lis_bmp2raw_scan_session *session)
+{
+	uint8_t rgb[3];
+	bool black[2];
+	unsigned int v;
+	int bit;
+	uint8_t out;
 
 	assert(session->palette != NULL);
-	assert(session->palette_len != 0);
+	assert(session->lut != NULL);
+
+	// in RAW B&W, 1 == black
+	for (v = 0 ; v < 2 ; v++) {
+		palette_to_rgb(session, v, rgb);
+		black[v] = (rgb[0] == 0x00);
+	}
+
+	// for each possible byte value: the byte it becomes. If mirroring is
+	// required, the bits are stored in reverse order.
+	for (v = 0 ; v < 256 ; v++) {
+		out = 0;
+		for (bit = 0 ; bit < 8 ; bit++) {
+			if (black[(v >> (7 - bit)) & 1]) {
+				out |= 1 << (session->need_mirroring ? bit : (7 - bit));
+			}
+		}
+		session->lut[v] = out;
+	}
+}
+
+
+static void build_lut_8_gray(struct lis_bmp2raw_scan_session *session)
+{
+	uint8_t rgb[3];
+	unsigned int v;
+
+	assert(session->palette != NULL);
+	assert(session->lut != NULL);
+
+	for (v = 0 ; v < 256 ; v++) {
+		palette_to_rgb(session, v, rgb);
+		session->lut[v] = rgb[0];
+	}
+}
+
+
+static void line_1_bw(
+		const struct lis_bmp2raw_scan_session *session,
+		const uint8_t *in, uint8_t *out
+	)
+{
+	const uint8_t *lut = session->lut;
+	int width = session->parameters_out.width;
+	int nb_bytes = (width + 7) / 8;
+	int shift = (nb_bytes * 8) - width;
+	unsigned int v;
+	int b;
+
+	if (!session->need_mirroring) {
+		for (b = 0 ; b < nb_bytes ; b++) {
+			out[b] = lut[in[b]];
+		}
+		// unused bits at the end of the line: always 0
+		out[nb_bytes - 1] &= (0xFF << shift) & 0xFF;
+		return;
+	}
+
+	// LUT entries are already reversed: reading the bytes backward
+	// mirrors the line, but the unused bits of the last input byte then
+	// come first and must be shifted out.
+	for (b = 0 ; b < nb_bytes ; b++) {
+		v = lut[in[nb_bytes - 1 - b]] << shift;
+		if (shift > 0 && b + 1 < nb_bytes) {
+			v |= lut[in[nb_bytes - 2 - b]] >> (8 - shift);
+		}
+		out[b] = v & 0xFF;
+	}
+}
+
+
+static void line_8_gray(
+		const struct lis_bmp2raw_scan_session *session,
+		const uint8_t *in, uint8_t *out
+	)
+{
+	const uint8_t *lut = session->lut;
+	int width = session->parameters_out.width;
+	int p;
+
+	if (!session->need_mirroring) {
+		for (p = 0 ; p < width ; p++) {
+			out[p] = lut[in[p]];
+		}
+	} else {
+		for (p = 0 ; p < width ; p++) {
+			out[p] = lut[in[width - 1 - p]];
+		}
+	}
+}
+
+
+static void line_1(
+		const struct lis_bmp2raw_scan_session *session,
+		const uint8_t *in, uint8_t *out
+	)
+{
+	const uint8_t *lut = session->lut;
+	int width = session->parameters_out.width;
+	int nb_bytes = width / 8; // bytes with 8 useful pixels
+	int b, p;
+
+	if (!session->need_mirroring) {
+		for (b = 0 ; b < nb_bytes ; b++) {
+			memcpy(out + (b * 8 * 3), lut + (in[b] * 8 * 3), 8 * 3);
+		}
+		for (p = nb_bytes * 8 ; p < width ; p++) {
+			memcpy(
+				out + (p * 3),
+				lut + (in[nb_bytes] * 8 * 3) + ((p % 8) * 3), 3
+			);
+		}
+	} else {
+		// LUT entries are already reversed
+		for (b = 0 ; b < nb_bytes ; b++) {
+			memcpy(
+				out + ((width - ((b + 1) * 8)) * 3),
+				lut + (in[b] * 8 * 3), 8 * 3
+			);
+		}
+		for (p = nb_bytes * 8 ; p < width ; p++) {
+			memcpy(
+				out + ((width - 1 - p) * 3),
+				lut + (in[nb_bytes] * 8 * 3) + ((7 - (p % 8)) * 3),
+				3
+			);
+		}
+	}
+}
 
-	for (idx = session->line.packed.useful - 1 ; idx >= 0 ; idx--) {
-		v = session->line.content[idx];
-		p = session->palette + (v * 4);
 
-		session->line.content[(idx * 3) + 2] = p[2];
-		session->line.content[(idx * 3) + 1] = p[1];
-		session->line.content[(idx * 3)] = p[0];
+static void line_8(
+		const struct lis_bmp2raw_scan_session *session,
+		const uint8_t *in, uint8_t *out
+	)
+{
+	const uint8_t *lut = session->lut;
+	int width = session->parameters_out.width;
+	int p;
+
+	// each memcpy() writes 1 extra byte, overwritten by the next pixel
+	// (or landing in the line slack for the last one)
+	if (!session->need_mirroring) {
+		for (p = 0 ; p < width ; p++) {
+			memcpy(out + (p * 3), lut + (in[p] * 4), 4);
+		}
+	} else {
+		for (p = 0 ; p < width ; p++) {
+			memcpy(out + (p * 3), lut + (in[width - 1 - p] * 4), 4);
+		}
 	}
 }
 
 
-static void unpack_24(struct lis_bmp2raw_scan_session *session)
+/* 24bits: BGR -> RGB (+ mirroring) */
+
+/**
+ * Convert the output pixels [start, width[.
+ */
+static void line_24_scalar_range(
+		const uint8_t *in, uint8_t *out, int width, int mirror,
+		int start
+	)
 {
-	// Nothing to do
-	LIS_UNUSED(session);
+	const uint8_t *p;
+	int o;
+
+	for (o = start ; o < width ; o++) {
+		p = in + ((mirror ? (width - 1 - o) : o) * 3);
+		out[(o * 3)] = p[2];
+		out[(o * 3) + 1] = p[1];
+		out[(o * 3) + 2] = p[0];
+	}
 }
 
 
-static void bgr2rgb(uint8_t *line, int line_len)
+static void line_24_scalar(
+		const struct lis_bmp2raw_scan_session *session,
+		const uint8_t *in, uint8_t *out
+	)
 {
-	uint8_t tmp;
+	line_24_scalar_range(
+		in, out, session->parameters_out.width,
+		session->need_mirroring, 0
+	);
+}
+
 
-	for (; line_len > 0 ; line += 3, line_len -= 3) {
-		tmp = line[0];
-		line[0] = line[2];
-		line[2] = tmp;
+#ifdef BMP2RAW_X86
+
+/*
+ * 5 pixels (15 bytes) per 16 bytes register. The 16th byte of each store
+ * is garbage but is overwritten by the next store (or by the scalar tail).
+ * When mirroring, the load for the first block reads 1 byte after the end of
+ * the useful line (padding or line slack).
+ */
+__attribute__((target("ssse3")))
+static void line_24_ssse3(
+		const struct lis_bmp2raw_scan_session *session,
+		const uint8_t *in, uint8_t *out
+	)
+{
+	const __m128i swap = _mm_setr_epi8(
+		2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15
+	);
+	const __m128i swap_mirror = _mm_setr_epi8(
+		14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0, 15
+	);
+	int width = session->parameters_out.width;
+	int o;
+	__m128i v;
+
+	if (!session->need_mirroring) {
+		for (o = 0 ; o + 6 <= width ; o += 5) {
+			v = _mm_loadu_si128((const __m128i *)(in + (o * 3)));
+			v = _mm_shuffle_epi8(v, swap);
+			_mm_storeu_si128((__m128i *)(out + (o * 3)), v);
+		}
+	} else {
+		for (o = 0 ; o + 6 <= width ; o += 5) {
+			v = _mm_loadu_si128(
+				(const __m128i *)(in + ((width - 5 - o) * 3))
+			);
+			v = _mm_shuffle_epi8(v, swap_mirror);
+			_mm_storeu_si128((__m128i *)(out + (o * 3)), v);
+		}
 	}
+
+	line_24_scalar_range(in, out, width, session->need_mirroring, o);
 }
 
 
-static inline void swap_pixels(uint8_t *pa, uint8_t *pb)
+static bmp_line_to_raw_cb *get_line_24_simd(void)
 {
-	uint8_t tmp[3];
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3")) {
+		return line_24_ssse3;
+	}
+	return NULL;
+}
+
+#endif /* BMP2RAW_X86 */
+
 
-	assert(pa != pb);
+#ifdef BMP2RAW_NEON
 
-	tmp[0] = pa[0];
-	tmp[1] = pa[1];
-	tmp[2] = pa[2];
-	pa[0] = pb[0];
-	pa[1] = pb[1];
-	pa[2] = pb[2];
-	pb[0] = tmp[0];
-	pb[1] = tmp[1];
-	pb[2] = tmp[2];
+static inline uint8x16_t reverse_u8_neon(uint8x16_t v)
+{
+	v = vrev64q_u8(v);
+	return vcombine_u8(vget_high_u8(v), vget_low_u8(v));
 }
 
 
-static void mirror_line(uint8_t *line, int line_len)
+static void line_24_neon(
+		const struct lis_bmp2raw_scan_session *session,
+		const uint8_t *in, uint8_t *out
+	)
 {
-	int pos;
+	int width = session->parameters_out.width;
+	int o;
+	uint8x16x3_t bgr, rgb;
+
+	if (!session->need_mirroring) {
+		for (o = 0 ; o + 16 <= width ; o += 16) {
+			bgr = vld3q_u8(in + (o * 3));
+			rgb.val[0] = bgr.val[2];
+			rgb.val[1] = bgr.val[1];
+			rgb.val[2] = bgr.val[0];
+			vst3q_u8(out + (o * 3), rgb);
+		}
+	} else {
+		for (o = 0 ; o + 16 <= width ; o += 16) {
+			bgr = vld3q_u8(in + ((width - 16 - o) * 3));
+			rgb.val[0] = reverse_u8_neon(bgr.val[2]);
+			rgb.val[1] = reverse_u8_neon(bgr.val[1]);
+			rgb.val[2] = reverse_u8_neon(bgr.val[0]);
+			vst3q_u8(out + (o * 3), rgb);
+		}
+	}
+
+	line_24_scalar_range(in, out, width, session->need_mirroring, o);
+}
 
-	for (pos = 0; pos < (line_len / 2) - 3 ; pos += 3) {
-		swap_pixels(&line[pos], &line[line_len - pos - 3]);
+
+static bmp_line_to_raw_cb *get_line_24_simd(void)
+{
+	return line_24_neon;
+}
+
+#endif /* BMP2RAW_NEON */
+
+
+static void line_24(
+		const struct lis_bmp2raw_scan_session *session,
+		const uint8_t *in, uint8_t *out
+	)
+{
+	static bmp_line_to_raw_cb *impl = NULL;
+
+	if (impl == NULL) {
+#if defined(BMP2RAW_X86) || defined(BMP2RAW_NEON)
+		impl = get_line_24_simd();
+#endif
+		if (impl == NULL) {
+			impl = line_24_scalar;
+		}
 	}
+
+	impl(session, in, out);
 }
 
 
@@ -852,8 +1475,10 @@ static enum lis_error lis_bmp2raw_scan_read(
 	struct lis_bmp2raw_scan_session *private = \
 		LIS_BMP2RAW_SCAN_SESSION_PRIVATE(session);
 	enum lis_error err;
+	uint8_t *out = out_buffer;
 	size_t remaining_to_read = *buffer_size;
-	size_t to_copy;
+	size_t to_copy, nb_lines;
+	int line_length;
 
 	if (LIS_IS_ERROR(private->read_err)) {
 		lis_log_warning(
@@ -867,51 +1492,70 @@ static enum lis_error lis_bmp2raw_scan_read(
 	// next header of the next page
 	private->header_read = 0;
 
+	if (private->parameters_wrapped.format != LIS_IMG_FORMAT_BMP) {
+		// returned as is
+		return private->wrapped->scan_read(
+			private->wrapped, out_buffer, buffer_size
+		);
+	}
+
+	line_length = private->line.unpacked.useful;
+
 	while(remaining_to_read > 0) {
-		if (private->line.unpacked.current >= private->line.unpacked.useful) {
-			if (session->end_of_page(session)) {
+		if (private->line.unpacked.current < line_length) {
+			// end of a line converted earlier
+			to_copy = MIN(
+				line_length - private->line.unpacked.current,
+				(int)remaining_to_read
+			);
+			memcpy(
+				out,
+				private->line.content + private->line.unpacked.current,
+				to_copy
+			);
+			out += to_copy;
+			remaining_to_read -= to_copy;
+			private->line.unpacked.current += to_copy;
+			continue;
+		}
+
+		// whole lines that can be converted directly in the caller
+		// buffer (line converters may write in the LINE_SLACK)
+		nb_lines = 0;
+		if (remaining_to_read >= (size_t)line_length + LINE_SLACK) {
+			nb_lines = (remaining_to_read - LINE_SLACK) / line_length;
+		}
+
+		if (pool_nb_lines(private) == 0) {
+			if (private->wrapped->end_of_page(private->wrapped)) {
 				lis_log_debug("scan_read(): end of page");
 				*buffer_size -= remaining_to_read;
 				return LIS_OK;
 			}
 
-			err = read_next_line(private);
+			err = fill_pool(
+				private, MAX(1, MIN(nb_lines, private->pool.max_lines))
+			);
 			if (LIS_IS_ERROR(err)) {
 				lis_log_error(
 					"scan_read(): failed to read next"
-					" pixel line: 0x%X, %s",
+					" pixel lines: 0x%X, %s",
 					err, lis_strerror(err)
 				);
 				return err;
 			}
+			continue;
+		}
 
-			private->unpack->unpack_cb(private);
-
-			bgr2rgb(
-				private->line.content, private->line.unpacked.useful
-			);
-			if (private->need_mirroring) {
-				mirror_line(
-					private->line.content,
-					private->line.unpacked.useful
-				);
-			}
+		if (nb_lines > 0) {
+			nb_lines = MIN(nb_lines, pool_nb_lines(private));
+			convert_lines(private, out, nb_lines);
+			out += nb_lines * line_length;
+			remaining_to_read -= nb_lines * line_length;
+		} else {
+			convert_lines(private, private->line.content, 1);
 			private->line.unpacked.current = 0;
 		}
-
-		to_copy = MIN(
-			private->line.unpacked.useful - private->line.unpacked.current,
-			(int)remaining_to_read
-		);
-		assert(to_copy > 0);
-		memcpy(
-			out_buffer,
-			private->line.content + private->line.unpacked.current,
-			to_copy
-		);
-		out_buffer = ((uint8_t *)out_buffer) + to_copy;
-		remaining_to_read -= to_copy;
-		private->line.unpacked.current += to_copy;
 	}
 
 	return LIS_OK;
@@ -922,14 +1566,36 @@ static void lis_bmp2raw_cancel(struct lis_scan_session *session)
 {
 	struct lis_bmp2raw_scan_session *private = \
 		LIS_BMP2RAW_SCAN_SESSION_PRIVATE(session);
-	FREE(private->palette);
-	FREE(private->line.content);
+	free_buffers(private);
 	private->wrapped->cancel(private->wrapped);
-	lis_bw_item_set_user_ptr(private->item, NULL);
+	private->item->session = NULL;
 	FREE(private);
 }
 
 
+static int lis_bmp2raw_get_fd(struct lis_scan_session *session)
+{
+	struct lis_bmp2raw_scan_session *private = \
+		LIS_BMP2RAW_SCAN_SESSION_PRIVATE(session);
+
+	if (private->parameters_wrapped.format == LIS_IMG_FORMAT_BMP) {
+		// converting requires reading whole lines
+		return -1;
+	}
+	if (private->wrapped->get_fd == NULL) {
+		return -1;
+	}
+	return private->wrapped->get_fd(private->wrapped);
+}
+
+
+static struct lis_scan_session *lis_bmp2raw_get_wrapped(struct lis_scan_session *session)
+{
+	struct lis_bmp2raw_scan_session *private = LIS_BMP2RAW_SCAN_SESSION_PRIVATE(session);
+	return private->wrapped;
+}
+
+
 enum lis_error lis_api_normalizer_bmp2raw(
 		struct lis_api *to_wrap, struct lis_api **api
 	)
@@ -941,6 +1607,7 @@ enum lis_error lis_api_normalizer_bmp2raw(
 		return err;
 	}
 
+	lis_bw_set_item_filter(*api, bmp2raw_item_filter, NULL);
 	lis_bw_set_on_close_item(*api, bmp2raw_on_item_close, NULL);
 	lis_bw_set_on_scan_start(*api, bmp2raw_scan_start, NULL);
 
@@ -0,0 +1,685 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libinsane/capi.h>
+#include <libinsane/constants.h>
+#include <libinsane/log.h>
+#include <libinsane/normalizers.h>
+#include <libinsane/util.h>
+
+#include "downscale.h"
+#include "../basewrapper.h"
+
+
+#define NAME "normalizer_downscale"
+
+// emulated resolutions are obtained by averaging blocks of at most
+// MAX_FACTOR x MAX_FACTOR pixels
+#define MAX_FACTOR 8
+// only nice values are emulated (multiples of ...), and none below MIN
+#define EMULATED_RESOLUTION_INTERVAL 25
+#define MIN_EMULATED_RESOLUTION 50
+
+
+struct downscale_session;
+
+
+struct downscale_item
+{
+	int factor; // 1 = no downscaling
+	struct downscale_session *session;
+};
+
+
+struct downscale_opt
+{
+	struct lis_item *root;
+	union lis_value values[]; // native + emulated resolutions
+};
+
+
+static enum lis_error downscale_get_scan_parameters(
+	struct lis_scan_session *self,
+	struct lis_scan_parameters *params
+);
+static int downscale_end_of_feed(struct lis_scan_session *session);
+static int downscale_end_of_page(struct lis_scan_session *session);
+static enum lis_error downscale_scan_read(
+	struct lis_scan_session *session, void *out_buffer, size_t *buffer_size
+);
+static void downscale_cancel(struct lis_scan_session *session);
+static int downscale_get_fd(struct lis_scan_session *session);
+static struct lis_scan_session *downscale_get_wrapped(struct lis_scan_session *session);
+
+
+struct downscale_session
+{
+	struct lis_scan_session parent;
+	struct lis_scan_session *wrapped;
+	struct downscale_item *item;
+	int factor;
+
+	/* current page */
+	bool page_started;
+	bool passthrough; // unsupported image format
+	struct lis_scan_parameters params; // input
+	size_t nb_channels;
+	size_t out_width;
+
+	/* input line being read */
+	struct {
+		uint8_t *content;
+		size_t allocated;
+		size_t length;
+		size_t filled;
+	} in_line;
+
+	/* sums of the input lines of the current block, for each column */
+	uint16_t *sums;
+	size_t sums_allocated;
+	int nb_summed;
+
+	/* output line */
+	struct {
+		uint8_t *content;
+		size_t allocated;
+		size_t length;
+		size_t current; // what has already been returned
+	} out_line;
+};
+#define DOWNSCALE_SESSION(session) ((struct downscale_session *)(session))
+
+
+static struct lis_scan_session g_scan_session_template = {
+	.get_scan_parameters = downscale_get_scan_parameters,
+	.end_of_feed = downscale_end_of_feed,
+	.end_of_page = downscale_end_of_page,
+	.scan_read = downscale_scan_read,
+	.cancel = downscale_cancel,
+	.get_fd = downscale_get_fd,
+	.name = "downscale",
+	.get_wrapped = downscale_get_wrapped,
+};
+
+
+static int find_factor(const struct lis_value_list *native, int resolution)
+{
+	int factor, i;
+
+	for (factor = 1 ; factor <= MAX_FACTOR ; factor++) {
+		for (i = 0 ; i < native->nb_values ; i++) {
+			if (native->values[i].integer == resolution * factor) {
+				return factor;
+			}
+		}
+	}
+	return 0;
+}
+
+
+static int cmp_resolutions(const void *a, const void *b)
+{
+	return ((const union lis_value *)a)->integer
+		- ((const union lis_value *)b)->integer;
+}
+
+
+static enum lis_error opt_get_value(
+		struct lis_option_descriptor *self, union lis_value *value
+	)
+{
+	struct lis_option_descriptor *original = lis_bw_get_original_opt(self);
+	struct downscale_opt *opt = lis_bw_opt_get_user_ptr(self);
+	struct downscale_item *item = lis_bw_item_get_user_ptr(opt->root);
+	enum lis_error err;
+
+	err = original->fn.get_value(original, value);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+	value->integer /= item->factor;
+	return err;
+}
+
+
+static enum lis_error opt_set_value(
+		struct lis_option_descriptor *self, union lis_value value,
+		int *set_flags
+	)
+{
+	struct lis_option_descriptor *original = lis_bw_get_original_opt(self);
+	struct downscale_opt *opt = lis_bw_opt_get_user_ptr(self);
+	struct downscale_item *item = lis_bw_item_get_user_ptr(opt->root);
+	int factor;
+	enum lis_error err;
+
+	factor = find_factor(&original->constraint.possible.list, value.integer);
+	if (factor <= 0) {
+		// not ours: let the wrapped option deal with it
+		factor = 1;
+	}
+	if (factor > 1) {
+		lis_log_info(
+			"%s: Emulating resolution %d: scanning at %d and"
+			" downscaling (%dx%d pixels -> 1)",
+			opt->root->name, value.integer, value.integer * factor,
+			factor, factor
+		);
+	}
+
+	value.integer *= factor;
+	err = original->fn.set_value(original, value, set_flags);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+
+	if (factor != item->factor && set_flags != NULL) {
+		*set_flags |= LIS_SET_FLAG_MUST_RELOAD_PARAMS;
+	}
+	item->factor = factor;
+	return err;
+}
+
+
+static enum lis_error opt_desc_filter(
+		struct lis_item *item, struct lis_option_descriptor *desc,
+		void *user_data
+	)
+{
+	const struct lis_value_list *native;
+	struct downscale_opt *opt;
+	int nb_values, factor, i, resolution;
+
+	LIS_UNUSED(user_data);
+
+	if (strcasecmp(desc->name, OPT_NAME_RESOLUTION) != 0) {
+		return LIS_OK;
+	}
+	if (desc->value.type != LIS_TYPE_INTEGER
+			|| desc->constraint.type != LIS_CONSTRAINT_LIST) {
+		lis_log_warning(
+			"%s: Option '" OPT_NAME_RESOLUTION "' is not a list of"
+			" integers (%d, %d). Can't emulate other resolutions",
+			item->name, desc->value.type, desc->constraint.type
+		);
+		return LIS_OK;
+	}
+	native = &desc->constraint.possible.list;
+
+	opt = calloc(1, sizeof(struct downscale_opt) + (
+		native->nb_values * MAX_FACTOR * sizeof(union lis_value)
+	));
+	if (opt == NULL) {
+		lis_log_error("Out of memory");
+		return LIS_ERR_NO_MEM;
+	}
+	opt->root = lis_bw_get_root_item(item);
+
+	memcpy(opt->values, native->values,
+		native->nb_values * sizeof(union lis_value));
+	nb_values = native->nb_values;
+
+	for (i = 0 ; i < native->nb_values ; i++) {
+		for (factor = 2 ; factor <= MAX_FACTOR ; factor++) {
+			if (native->values[i].integer % factor != 0) {
+				continue;
+			}
+			resolution = native->values[i].integer / factor;
+			if (resolution < MIN_EMULATED_RESOLUTION
+					|| (resolution % EMULATED_RESOLUTION_INTERVAL) != 0) {
+				continue;
+			}
+			// only the first factor found is used
+			// (--> each value is added only once)
+			if (find_factor(native, resolution) != factor) {
+				continue;
+			}
+			opt->values[nb_values].integer = resolution;
+			nb_values++;
+		}
+	}
+
+	// replaces the one of the previous call if the options are reloaded
+	free(lis_bw_opt_get_user_ptr(desc));
+	lis_bw_opt_set_user_ptr(desc, opt, free);
+
+	if (nb_values == native->nb_values) {
+		lis_log_info(
+			"%s: No resolution to emulate", item->name
+		);
+	} else {
+		lis_log_info(
+			"%s: %d resolutions emulated", item->name,
+			nb_values - native->nb_values
+		);
+		desc->capabilities |= LIS_CAP_EMULATED;
+	}
+
+	qsort(opt->values, nb_values, sizeof(union lis_value), cmp_resolutions);
+	desc->constraint.possible.list.values = opt->values;
+	desc->constraint.possible.list.nb_values = nb_values;
+	desc->fn.get_value = opt_get_value;
+	desc->fn.set_value = opt_set_value;
+	return LIS_OK;
+}
+
+
+static enum lis_error item_filter(struct lis_item *item, int root, void *user_data)
+{
+	struct downscale_item *private;
+
+	LIS_UNUSED(user_data);
+
+	if (!root) {
+		return LIS_OK;
+	}
+
+	private = calloc(1, sizeof(struct downscale_item));
+	if (private == NULL) {
+		lis_log_error("Out of memory");
+		return LIS_ERR_NO_MEM;
+	}
+	private->factor = 1;
+	lis_bw_item_set_user_ptr(item, private);
+	return LIS_OK;
+}
+
+
+/**
+ * Only grows: once big enough, the next pages don't allocate anything.
+ */
+static enum lis_error reserve(void **data, size_t *allocated, size_t size)
+{
+	void *new_data;
+
+	if (size <= *allocated && *data != NULL) {
+		return LIS_OK;
+	}
+
+	new_data = realloc(*data, MAX(size, 1));
+	if (new_data == NULL) {
+		lis_log_error("Out of memory (%lu B)", (long unsigned)size);
+		return LIS_ERR_NO_MEM;
+	}
+	*data = new_data;
+	*allocated = size;
+	return LIS_OK;
+}
+
+
+static size_t get_nb_channels(enum lis_img_format format)
+{
+	switch(format) {
+		case LIS_IMG_FORMAT_RAW_RGB_24:
+			return 3;
+		case LIS_IMG_FORMAT_GRAYSCALE_8:
+			return 1;
+		default:
+			break;
+	}
+	return 0;
+}
+
+
+static enum lis_error downscale_get_scan_parameters(
+		struct lis_scan_session *self,
+		struct lis_scan_parameters *params
+	)
+{
+	struct downscale_session *private = DOWNSCALE_SESSION(self);
+	enum lis_error err;
+	size_t nb_channels;
+
+	err = private->wrapped->get_scan_parameters(private->wrapped, params);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+
+	nb_channels = get_nb_channels(params->format);
+	if (nb_channels == 0 || params->width < private->factor) {
+		lis_log_warning(
+			"Can't downscale image (format %d, width %d):"
+			" returned as is", params->format, params->width
+		);
+		return err;
+	}
+
+	params->width /= private->factor;
+	params->height /= private->factor;
+	params->image_size = (
+		((size_t)params->width) * nb_channels * params->height
+	);
+	return err;
+}
+
+
+static int downscale_end_of_feed(struct lis_scan_session *session)
+{
+	struct downscale_session *private = DOWNSCALE_SESSION(session);
+	return private->wrapped->end_of_feed(private->wrapped);
+}
+
+
+static int downscale_end_of_page(struct lis_scan_session *session)
+{
+	struct downscale_session *private = DOWNSCALE_SESSION(session);
+
+	if (!private->passthrough && private->page_started
+			&& private->out_line.current < private->out_line.length) {
+		return 0;
+	}
+	if (!private->wrapped->end_of_page(private->wrapped)) {
+		return 0;
+	}
+	if (private->page_started && !private->passthrough
+			&& (private->nb_summed > 0 || private->in_line.filled > 0)) {
+		lis_log_debug(
+			"End of page: incomplete block dropped (%d lines + %lu B)",
+			private->nb_summed, (long unsigned)private->in_line.filled
+		);
+	}
+	// next read will be on a new page, maybe with other parameters
+	private->page_started = false;
+	return 1;
+}
+
+
+static enum lis_error start_page(struct downscale_session *private)
+{
+	enum lis_error err;
+
+	private->in_line.filled = 0;
+	private->nb_summed = 0;
+	private->out_line.length = 0;
+	private->out_line.current = 0;
+
+	err = private->wrapped->get_scan_parameters(
+		private->wrapped, &private->params
+	);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+
+	private->nb_channels = get_nb_channels(private->params.format);
+	private->passthrough = (
+		private->nb_channels == 0
+		|| private->params.width < private->factor
+	);
+	if (private->passthrough) {
+		return LIS_OK;
+	}
+
+	private->out_width = private->params.width / private->factor;
+	private->in_line.length = private->params.width * private->nb_channels;
+	private->out_line.length = private->out_width * private->nb_channels;
+	// nothing pending in the output line
+	private->out_line.current = private->out_line.length;
+
+	err = reserve(
+		(void **)&private->in_line.content, &private->in_line.allocated,
+		private->in_line.length
+	);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+	err = reserve(
+		(void **)&private->sums, &private->sums_allocated,
+		private->in_line.length * sizeof(uint16_t)
+	);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+	memset(private->sums, 0, private->in_line.length * sizeof(uint16_t));
+	return reserve(
+		(void **)&private->out_line.content, &private->out_line.allocated,
+		private->out_line.length
+	);
+}
+
+
+/**
+ * All the lines of the block have been summed: average the columns
+ * of each block.
+ */
+static void make_out_line(struct downscale_session *private)
+{
+	const int factor = private->factor;
+	const unsigned int divisor = factor * factor;
+	const size_t nb_channels = private->nb_channels;
+	const uint16_t *sums;
+	unsigned int sum;
+	size_t x, c;
+	int k;
+
+	for (x = 0 ; x < private->out_width ; x++) {
+		sums = private->sums + (x * factor * nb_channels);
+		for (c = 0 ; c < nb_channels ; c++) {
+			sum = 0;
+			for (k = 0 ; k < factor ; k++) {
+				sum += sums[(k * nb_channels) + c];
+			}
+			private->out_line.content[(x * nb_channels) + c] = (
+				(sum + (divisor / 2)) / divisor
+			);
+		}
+	}
+
+	memset(private->sums, 0, private->in_line.length * sizeof(uint16_t));
+	private->nb_summed = 0;
+	private->out_line.current = 0;
+}
+
+
+static enum lis_error downscale_scan_read(
+		struct lis_scan_session *session,
+		void *out_buffer, size_t *buffer_size
+	)
+{
+	struct downscale_session *private = DOWNSCALE_SESSION(session);
+	uint8_t *out = out_buffer;
+	size_t remaining = *buffer_size;
+	size_t to_copy, r;
+	enum lis_error err;
+
+	if (!private->page_started) {
+		err = start_page(private);
+		if (LIS_IS_ERROR(err)) {
+			return err;
+		}
+		private->page_started = true;
+	}
+
+	if (private->passthrough) {
+		return private->wrapped->scan_read(
+			private->wrapped, out_buffer, buffer_size
+		);
+	}
+
+	while(remaining > 0) {
+		if (private->out_line.current < private->out_line.length) {
+			to_copy = MIN(
+				private->out_line.length - private->out_line.current,
+				remaining
+			);
+			memcpy(
+				out,
+				private->out_line.content + private->out_line.current,
+				to_copy
+			);
+			out += to_copy;
+			remaining -= to_copy;
+			private->out_line.current += to_copy;
+			continue;
+		}
+
+		if (private->wrapped->end_of_page(private->wrapped)) {
+			break;
+		}
+
+		r = private->in_line.length - private->in_line.filled;
+		err = private->wrapped->scan_read(
+			private->wrapped,
+			private->in_line.content + private->in_line.filled, &r
+		);
+		if (LIS_IS_ERROR(err)) {
+			return err;
+		}
+		if (r == 0) {
+			// no data ready yet (non-blocking source): return
+			// what we have so far
+			break;
+		}
+		private->in_line.filled += r;
+		if (private->in_line.filled < private->in_line.length) {
+			continue;
+		}
+
+		downscale_add_line(
+			private->in_line.content, private->sums,
+			private->in_line.length
+		);
+		private->in_line.filled = 0;
+		private->nb_summed++;
+		if (private->nb_summed >= private->factor) {
+			make_out_line(private);
+		}
+	}
+
+	*buffer_size -= remaining;
+	return LIS_OK;
+}
+
+
+static void free_session(struct downscale_session *private)
+{
+	private->item->session = NULL;
+	FREE(private->in_line.content);
+	FREE(private->sums);
+	FREE(private->out_line.content);
+	FREE(private);
+}
+
+
+static void downscale_cancel(struct lis_scan_session *session)
+{
+	struct downscale_session *private = DOWNSCALE_SESSION(session);
+
+	private->wrapped->cancel(private->wrapped);
+	free_session(private);
+}
+
+
+static int downscale_get_fd(struct lis_scan_session *session)
+{
+	struct downscale_session *private = DOWNSCALE_SESSION(session);
+
+	if (!private->page_started || !private->passthrough) {
+		// converting requires reading whole lines
+		return -1;
+	}
+	if (private->wrapped->get_fd == NULL) {
+		return -1;
+	}
+	return private->wrapped->get_fd(private->wrapped);
+}
+
+
+static struct lis_scan_session *downscale_get_wrapped(struct lis_scan_session *session)
+{
+	struct downscale_session *private = DOWNSCALE_SESSION(session);
+	return private->wrapped;
+}
+
+
+static enum lis_error downscale_scan_start(
+		struct lis_item *item, struct lis_scan_session **out,
+		void *user_data
+	)
+{
+	struct lis_item *original = lis_bw_get_original_item(item);
+	struct downscale_item *root = lis_bw_item_get_user_ptr(
+		lis_bw_get_root_item(item)
+	);
+	struct downscale_session *private;
+	enum lis_error err;
+
+	LIS_UNUSED(user_data);
+
+	if (root->factor <= 1) {
+		// nothing to do
+		return original->scan_start(original, out);
+	}
+
+	private = calloc(1, sizeof(struct downscale_session));
+	if (private == NULL) {
+		lis_log_error("Out of memory");
+		return LIS_ERR_NO_MEM;
+	}
+
+	err = original->scan_start(original, &private->wrapped);
+	if (LIS_IS_ERROR(err)) {
+		lis_log_error(
+			"scan_start() failed: 0x%X, %s",
+			err, lis_strerror(err)
+		);
+		FREE(private);
+		return err;
+	}
+	memcpy(&private->parent, &g_scan_session_template,
+		sizeof(private->parent));
+	private->item = root;
+	private->factor = root->factor;
+	root->session = private;
+
+	*out = &private->parent;
+	return err;
+}
+
+
+static void on_close_item(struct lis_item *item, int root, void *user_data)
+{
+	struct downscale_item *private;
+
+	LIS_UNUSED(user_data);
+
+	if (!root) {
+		return;
+	}
+
+	private = lis_bw_item_get_user_ptr(item);
+	if (private == NULL) {
+		return;
+	}
+	if (private->session != NULL) {
+		lis_log_warning(
+			"Device has been closed but scan session hasn't been"
+			" cancelled"
+		);
+		downscale_cancel(&private->session->parent);
+	}
+	FREE(private);
+	lis_bw_item_set_user_ptr(item, NULL);
+}
+
+
+enum lis_error lis_api_normalizer_downscale(
+		struct lis_api *to_wrap, struct lis_api **api
+	)
+{
+	enum lis_error err;
+
+	err = lis_api_base_wrapper(to_wrap, api, NAME);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+
+	lis_bw_set_item_filter(*api, item_filter, NULL);
+	lis_bw_set_opt_desc_filter(*api, opt_desc_filter, NULL);
+	lis_bw_set_on_scan_start(*api, downscale_scan_start, NULL);
+	lis_bw_set_on_close_item(*api, on_close_item, NULL);
+
+	return err;
+}
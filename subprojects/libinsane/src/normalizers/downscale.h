@@ -0,0 +1,36 @@
+#ifndef __LIBINSANE_NORMALIZERS_DOWNSCALE_H
+#define __LIBINSANE_NORMALIZERS_DOWNSCALE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * \brief Add a line to the sums of the previous lines.
+ *
+ * sums[i] += in[i], for i in [0, nb_values[. The caller must make sure the
+ * sums can't overflow (at most 257 lines).
+ *
+ * Uses the fastest implementation available on the current CPU (see
+ * \ref downscale_get_impls()).
+ */
+void downscale_add_line(const uint8_t *in, uint16_t *sums, size_t nb_values);
+
+
+typedef void (downscale_add_line_cb)(
+	const uint8_t *in, uint16_t *sums, size_t nb_values
+);
+
+struct downscale_impl {
+	const char *name;
+	int (*is_supported)(void);
+	downscale_add_line_cb *add_line;
+};
+
+/**
+ * \brief All the implementations built in.
+ * Sorted from the fastest one to the reference one (scalar). NULL
+ * terminated (name == NULL). Only useful for unit tests.
+ */
+const struct downscale_impl *downscale_get_impls(void);
+
+#endif
@@ -0,0 +1,146 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "downscale.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DOWNSCALE_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__ARM_NEON)
+#define DOWNSCALE_NEON
+#include <arm_neon.h>
+#endif
+
+
+/* Reference implementation */
+
+static void scalar_add_line(const uint8_t *in, uint16_t *sums, size_t nb_values)
+{
+	size_t i;
+
+	for (i = 0 ; i < nb_values ; i++) {
+		sums[i] += in[i];
+	}
+}
+
+
+static int always_supported(void)
+{
+	return 1;
+}
+
+
+#ifdef DOWNSCALE_X86
+
+static int sse2_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+
+/*
+ * 16 values per iteration: widened to 16 bits, and added to the sums
+ * (2 registers).
+ */
+__attribute__((target("sse2")))
+static void sse2_add_line(const uint8_t *in, uint16_t *sums, size_t nb_values)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v, lo, hi;
+	size_t i;
+
+	for (i = 0 ; i + 16 <= nb_values ; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(in + i));
+		lo = _mm_loadu_si128((const __m128i *)(sums + i));
+		hi = _mm_loadu_si128((const __m128i *)(sums + i + 8));
+		lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+		hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+		_mm_storeu_si128((__m128i *)(sums + i), lo);
+		_mm_storeu_si128((__m128i *)(sums + i + 8), hi);
+	}
+
+	scalar_add_line(in + i, sums + i, nb_values - i);
+}
+
+#endif /* DOWNSCALE_X86 */
+
+
+#ifdef DOWNSCALE_NEON
+
+static void neon_add_line(const uint8_t *in, uint16_t *sums, size_t nb_values)
+{
+	uint8x16_t v;
+	size_t i;
+
+	for (i = 0 ; i + 16 <= nb_values ; i += 16) {
+		v = vld1q_u8(in + i);
+		vst1q_u16(sums + i, vaddw_u8(vld1q_u16(sums + i), vget_low_u8(v)));
+		vst1q_u16(
+			sums + i + 8,
+			vaddw_u8(vld1q_u16(sums + i + 8), vget_high_u8(v))
+		);
+	}
+
+	scalar_add_line(in + i, sums + i, nb_values - i);
+}
+
+#endif /* DOWNSCALE_NEON */
+
+
+static const struct downscale_impl g_impls[] = {
+#ifdef DOWNSCALE_X86
+	{
+		.name = "sse2",
+		.is_supported = sse2_supported,
+		.add_line = sse2_add_line,
+	},
+#endif
+#ifdef DOWNSCALE_NEON
+	{
+		.name = "neon",
+		.is_supported = always_supported,
+		.add_line = neon_add_line,
+	},
+#endif
+	{
+		.name = "scalar",
+		.is_supported = always_supported,
+		.add_line = scalar_add_line,
+	},
+	{ .name = NULL },
+};
+
+
+const struct downscale_impl *downscale_get_impls(void)
+{
+	return g_impls;
+}
+
+
+static const struct downscale_impl *get_best_impl(void)
+{
+	static const struct downscale_impl *best = NULL;
+	const struct downscale_impl *impl;
+
+	// harmless race: all the threads will find the same implementation
+	if (best != NULL) {
+		return best;
+	}
+
+	for (impl = g_impls ; impl->name != NULL ; impl++) {
+		if (impl->is_supported()) {
+			break;
+		}
+	}
+	best = impl;
+	return best;
+}
+
+
+void downscale_add_line(const uint8_t *in, uint16_t *sums, size_t nb_values)
+{
+	get_best_impl()->add_line(in, sums, nb_values);
+}
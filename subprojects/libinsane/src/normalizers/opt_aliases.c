@@ -7,6 +7,8 @@
 #include <libinsane/normalizers.h>
 #include <libinsane/util.h>
 
+#include "../opt_index.h"
+
 
 struct alias
 {
@@ -22,13 +24,13 @@ struct alias
 	enum lis_error (*get_value)(
 		struct lis_option_descriptor *opt,
 		const struct alias *alias,
-		struct lis_option_descriptor **opts,
+		const struct lis_opt_index *opts,
 		union lis_value *value
 	);
 	enum lis_error (*set_value)(
 		struct lis_option_descriptor *opt,
 		const struct alias *alias,
-		struct lis_option_descriptor **opts,
+		const struct lis_opt_index *opts,
 		union lis_value value,
 		int *set_flags
 	);
@@ -51,6 +53,7 @@ struct aliases_item {
 
 	struct aliases_opt *opts; /* only aliases */
 	struct lis_option_descriptor **opts_ptr; /* all options, aliases included */
+	struct lis_opt_index opts_index; /* underlying options */
 };
 #define ALIASES_ITEM_PRIVATE(item) ((struct aliases_item *)(item))
 
@@ -60,7 +63,7 @@ struct aliases_opt {
 
 	struct aliases_item *item;
 	const struct alias *alias;
-	struct lis_option_descriptor **opts; // underlying options ; no aliases
+	const struct lis_opt_index *opts; // underlying options ; no aliases
 };
 #define ALIASES_OPT_PRIVATE(opt) ((struct aliases_opt *)(opt))
 
@@ -68,13 +71,13 @@ struct aliases_opt {
 static enum lis_error simple_alias_get_value(
 	struct lis_option_descriptor *opt,
 	const struct alias *alias,
-	struct lis_option_descriptor **opts,
+	const struct lis_opt_index *opts,
 	union lis_value *value
 );
 static enum lis_error simple_alias_set_value(
 	struct lis_option_descriptor *opt,
 	const struct alias *alias,
-	struct lis_option_descriptor **opts,
+	const struct lis_opt_index *opts,
 	union lis_value value,
 	int *set_flags
 );
@@ -83,13 +86,13 @@ static enum lis_error simple_alias_set_value(
 static enum lis_error tl_get_value(
 	struct lis_option_descriptor *opt,
 	const struct alias *alias,
-	struct lis_option_descriptor **opts,
+	const struct lis_opt_index *opts,
 	union lis_value *value
 );
 static enum lis_error tl_set_value(
 	struct lis_option_descriptor *opt,
 	const struct alias *alias,
-	struct lis_option_descriptor **opts,
+	const struct lis_opt_index *opts,
 	union lis_value value,
 	int *set_flags
 );
@@ -98,13 +101,13 @@ static enum lis_error tl_set_value(
 static enum lis_error br_get_value(
 	struct lis_option_descriptor *opt,
 	const struct alias *alias,
-	struct lis_option_descriptor **opts,
+	const struct lis_opt_index *opts,
 	union lis_value *value
 );
 static enum lis_error br_set_value(
 	struct lis_option_descriptor *opt,
 	const struct alias *alias,
-	struct lis_option_descriptor **opts,
+	const struct lis_opt_index *opts,
 	union lis_value value,
 	int *set_flags
 );
@@ -263,6 +266,7 @@ static void free_children(struct aliases_item *private)
 		for (i = 0 ; private->children_ptr[i] != NULL ; i++) {
 			FREE(private->children[i].opts);
 			FREE(private->children[i].opts_ptr);
+			lis_opt_index_clean(&private->children[i].opts_index);
 			free_children(&private->children[i]);
 		}
 	}
@@ -316,15 +320,9 @@ static enum lis_error aliases_get_children(struct lis_item *self, struct lis_ite
 }
 
 
-static struct lis_option_descriptor *get_option(struct lis_option_descriptor **descs, const char *name)
+static struct lis_option_descriptor *get_option(const struct lis_opt_index *opts, const char *name)
 {
-	int i;
-	for (i = 0 ; descs[i] != NULL ; i++) {
-		if (strcasecmp(descs[i]->name, name) == 0) {
-			return descs[i];
-		}
-	}
-	return NULL;
+	return lis_opt_index_find(opts, name);
 }
 
 
@@ -349,7 +347,7 @@ static enum lis_error opt_set_value(struct lis_option_descriptor *self, union li
 
 
 static int has_all_aliased_opts(
-		const struct alias *alias, struct lis_option_descriptor **opts
+		const struct alias *alias, const struct lis_opt_index *opts
 	)
 {
 	int aliased_idx;
@@ -370,7 +368,7 @@ static int has_all_aliased_opts(
 
 
 static int has_all_range_integer_constraints(
-		const struct alias *alias, struct lis_option_descriptor **opts
+		const struct alias *alias, const struct lis_opt_index *opts
 	)
 {
 	int aliased_idx;
@@ -395,7 +393,7 @@ static int has_all_range_integer_constraints(
 
 
 static int has_one_aliased_opt(
-		const struct alias *alias, struct lis_option_descriptor **opts
+		const struct alias *alias, const struct lis_opt_index *opts
 	)
 {
 	int got_one = 0;
@@ -417,7 +415,7 @@ static int has_one_aliased_opt(
 
 
 static void compute_range(
-		const struct alias *alias, struct lis_option_descriptor **opts,
+		const struct alias *alias, const struct lis_opt_index *opts,
 		struct lis_option_descriptor *out_alias_opt
 	)
 {
@@ -466,7 +464,7 @@ static void compute_range(
 }
 
 static void set_first_constraint(
-		const struct alias *alias, struct lis_option_descriptor **opts,
+		const struct alias *alias, const struct lis_opt_index *opts,
 		struct lis_option_descriptor *alias_opt
 	)
 {
@@ -490,7 +488,7 @@ static void set_first_constraint(
 
 
 static int get_caps(
-		const struct alias *alias, struct lis_option_descriptor **opts
+		const struct alias *alias, const struct lis_opt_index *opts
 	)
 {
 	int caps = LIS_CAP_EMULATED;
@@ -511,7 +509,7 @@ static int get_caps(
 
 
 static void set_alias_default_content(
-		const struct alias *alias, struct lis_option_descriptor **opts,
+		const struct alias *alias, const struct lis_opt_index *opts,
 		struct lis_option_descriptor *out_alias_opt
 	)
 {
@@ -571,8 +569,15 @@ static enum lis_error aliases_get_options(
 		private->opts_ptr[nb_opts] = descs[nb_opts];
 	}
 
+	err = lis_opt_index_build(&private->opts_index, descs);
+	if (LIS_IS_ERROR(err)) {
+		FREE(private->opts);
+		FREE(private->opts_ptr);
+		return err;
+	}
+
 	for (alias_idx = 0 ; alias_idx < LIS_COUNT_OF(g_aliases) ; alias_idx++) {
-		if (!has_one_aliased_opt(&g_aliases[alias_idx], descs)) {
+		if (!has_one_aliased_opt(&g_aliases[alias_idx], &private->opts_index)) {
 			lis_log_debug(
 				"No aliased option for '%s' -> alias not created",
 				g_aliases[alias_idx].opt_name
@@ -581,7 +586,7 @@ static enum lis_error aliases_get_options(
 		}
 
 		if (g_aliases[alias_idx].requires == ALIAS_REQ_ALL_OPTIONS
-				&& !has_all_aliased_opts(&g_aliases[alias_idx], descs)) {
+				&& !has_all_aliased_opts(&g_aliases[alias_idx], &private->opts_index)) {
 			lis_log_debug(
 				"Not all required aliased options available for for '%s'"
 				" -> alias not created",
@@ -593,18 +598,18 @@ static enum lis_error aliases_get_options(
 		lis_log_debug("Creating alias '%s'", g_aliases[alias_idx].opt_name);
 
 		private->opts[alias_idx].item = private;
-		private->opts[alias_idx].opts = descs;
+		private->opts[alias_idx].opts = &private->opts_index;
 		private->opts[alias_idx].alias = &g_aliases[alias_idx];
 
 		set_alias_default_content(
-			&g_aliases[alias_idx], descs, &private->opts[alias_idx].parent
+			&g_aliases[alias_idx], &private->opts_index, &private->opts[alias_idx].parent
 		);
 
-		if (has_all_range_integer_constraints(&g_aliases[alias_idx], descs)) {
-			compute_range(&g_aliases[alias_idx], descs, &private->opts[alias_idx].parent);
+		if (has_all_range_integer_constraints(&g_aliases[alias_idx], &private->opts_index)) {
+			compute_range(&g_aliases[alias_idx], &private->opts_index, &private->opts[alias_idx].parent);
 		} else {
 			set_first_constraint(
-				&g_aliases[alias_idx], descs, &private->opts[alias_idx].parent
+				&g_aliases[alias_idx], &private->opts_index, &private->opts[alias_idx].parent
 			);
 		}
 
@@ -631,6 +636,7 @@ static void aliases_close(struct lis_item *self)
 	free_children(private);
 	FREE(private->opts);
 	FREE(private->opts_ptr);
+	lis_opt_index_clean(&private->opts_index);
 	FREE(private);
 }
 
@@ -638,7 +644,7 @@ static void aliases_close(struct lis_item *self)
 static enum lis_error simple_alias_get_value(
 		struct lis_option_descriptor *opt,
 		const struct alias *alias,
-		struct lis_option_descriptor **opts,
+		const struct lis_opt_index *opts,
 		union lis_value *value
 	)
 {
@@ -661,7 +667,7 @@ static enum lis_error simple_alias_get_value(
 static enum lis_error simple_alias_set_value(
 		struct lis_option_descriptor *opt,
 		const struct alias *alias,
-		struct lis_option_descriptor **opts,
+		const struct lis_opt_index *opts,
 		union lis_value value,
 		int *out_set_flags
 	)
@@ -695,7 +701,7 @@ static enum lis_error simple_alias_set_value(
 static enum lis_error tl_get_value(
 		struct lis_option_descriptor *opt,
 		const struct alias *alias,
-		struct lis_option_descriptor **opts,
+		const struct lis_opt_index *opts,
 		union lis_value *value
 	)
 {
@@ -712,7 +718,7 @@ static enum lis_error tl_get_value(
 static enum lis_error tl_set_value(
 		struct lis_option_descriptor *opt,
 		const struct alias *alias,
-		struct lis_option_descriptor **opts,
+		const struct lis_opt_index *opts,
 		union lis_value in_value,
 		int *out_set_flags
 	)
@@ -781,7 +787,7 @@ static enum lis_error tl_set_value(
 static enum lis_error br_get_value(
 		struct lis_option_descriptor *opt,
 		const struct alias *alias,
-		struct lis_option_descriptor **opts,
+		const struct lis_opt_index *opts,
 		union lis_value *value
 	)
 {
@@ -824,7 +830,7 @@ static enum lis_error br_get_value(
 static enum lis_error br_set_value(
 		struct lis_option_descriptor *opt,
 		const struct alias *alias,
-		struct lis_option_descriptor **opts,
+		const struct lis_opt_index *opts,
 		union lis_value in_value,
 		int *out_set_flags
 	)
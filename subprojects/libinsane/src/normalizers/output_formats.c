@@ -0,0 +1,228 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <libinsane/constants.h>
+#include <libinsane/log.h>
+#include <libinsane/util.h>
+
+#include "output_formats.h"
+#include "../basewrapper.h"
+
+
+static const struct {
+	const char *value;
+	int accepted;
+} g_output_formats[] = {
+	{
+		.value = OPT_VALUE_OUTPUT_FORMATS_RGB24,
+		.accepted = LIS_OUTPUT_FORMATS_DEFAULT,
+	},
+	{
+		.value = OPT_VALUE_OUTPUT_FORMATS_GRAYSCALE,
+		.accepted = LIS_OUTPUT_FORMATS_DEFAULT
+			| LIS_OUTPUT_FORMAT(LIS_IMG_FORMAT_GRAYSCALE_8),
+	},
+	{
+		.value = OPT_VALUE_OUTPUT_FORMATS_BW,
+		.accepted = LIS_OUTPUT_FORMATS_DEFAULT
+			| LIS_OUTPUT_FORMAT(LIS_IMG_FORMAT_BW_1),
+	},
+	{
+		.value = OPT_VALUE_OUTPUT_FORMATS_ALL,
+		.accepted = LIS_OUTPUT_FORMATS_DEFAULT
+			| LIS_OUTPUT_FORMAT(LIS_IMG_FORMAT_GRAYSCALE_8)
+			| LIS_OUTPUT_FORMAT(LIS_IMG_FORMAT_BW_1),
+	},
+};
+
+static union lis_value g_possible_values[] = {
+	{ .string = OPT_VALUE_OUTPUT_FORMATS_RGB24 },
+	{ .string = OPT_VALUE_OUTPUT_FORMATS_GRAYSCALE },
+	{ .string = OPT_VALUE_OUTPUT_FORMATS_BW },
+	{ .string = OPT_VALUE_OUTPUT_FORMATS_ALL },
+};
+
+
+static enum lis_error opt_get_value(
+	struct lis_option_descriptor *self, union lis_value *value
+);
+static enum lis_error opt_set_value(
+	struct lis_option_descriptor *self, union lis_value value,
+	int *set_flags
+);
+
+
+static const struct lis_option_descriptor g_opt_template = {
+	.name = OPT_NAME_OUTPUT_FORMATS,
+	.title = "Output formats",
+	.desc = "Raw image formats the application can handle"
+		" (any other format is converted to RGB24)",
+	.capabilities = LIS_CAP_EMULATED | LIS_CAP_SW_SELECT,
+	.value = {
+		.type = LIS_TYPE_STRING,
+		.unit = LIS_UNIT_NONE,
+	},
+	.constraint = {
+		.type = LIS_CONSTRAINT_LIST,
+		.possible.list = {
+			.nb_values = LIS_COUNT_OF(g_possible_values),
+			.values = g_possible_values,
+		},
+	},
+	.fn = {
+		.get_value = opt_get_value,
+		.set_value = opt_set_value,
+	},
+};
+
+
+static int parse_value(const char *value)
+{
+	unsigned int i;
+
+	for (i = 0 ; i < LIS_COUNT_OF(g_output_formats) ; i++) {
+		if (strcasecmp(g_output_formats[i].value, value) == 0) {
+			return g_output_formats[i].accepted;
+		}
+	}
+	return -1;
+}
+
+
+static enum lis_error opt_get_value(
+		struct lis_option_descriptor *self, union lis_value *value
+	)
+{
+	struct lis_output_formats *formats = (struct lis_output_formats *)self;
+	unsigned int i;
+
+	for (i = 0 ; i < LIS_COUNT_OF(g_output_formats) ; i++) {
+		if (g_output_formats[i].accepted == formats->accepted) {
+			value->string = g_output_formats[i].value;
+			return LIS_OK;
+		}
+	}
+	value->string = OPT_VALUE_OUTPUT_FORMATS_RGB24;
+	return LIS_OK;
+}
+
+
+static enum lis_error opt_set_value(
+		struct lis_option_descriptor *self, union lis_value value,
+		int *set_flags
+	)
+{
+	struct lis_output_formats *formats = (struct lis_output_formats *)self;
+	int accepted;
+
+	accepted = parse_value(value.string);
+	if (accepted < 0) {
+		lis_log_error(
+			"%s: Invalid value: %s", OPT_NAME_OUTPUT_FORMATS,
+			value.string
+		);
+		return LIS_ERR_INVALID_VALUE;
+	}
+
+	lis_log_info(
+		"%s: Output formats: %s", formats->item->name, value.string
+	);
+	formats->accepted = accepted;
+	if (set_flags != NULL) {
+		*set_flags = LIS_SET_FLAG_MUST_RELOAD_PARAMS;
+	}
+	return LIS_OK;
+}
+
+
+static enum lis_error formats_get_options(
+		struct lis_item *self, struct lis_option_descriptor ***descs
+	)
+{
+	struct lis_output_formats *formats = lis_bw_item_get_user_ptr(self);
+	struct lis_option_descriptor **opts;
+	struct lis_option_descriptor **new_opts;
+	enum lis_error err;
+	int nb_opts;
+
+	err = formats->get_options(self, &opts);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+
+	if (lis_bw_item_get_option(self, OPT_NAME_OUTPUT_FORMATS) != NULL) {
+		// already provided by a normalizer further down the chain
+		*descs = opts;
+		return err;
+	}
+
+	for (nb_opts = 0 ; opts[nb_opts] != NULL ; nb_opts++) { }
+	new_opts = realloc(formats->opts, (nb_opts + 2) * sizeof(*new_opts));
+	if (new_opts == NULL) {
+		lis_log_error("Out of memory");
+		return LIS_ERR_NO_MEM;
+	}
+	memcpy(new_opts, opts, nb_opts * sizeof(*new_opts));
+	new_opts[nb_opts] = &formats->opt;
+	new_opts[nb_opts + 1] = NULL;
+	formats->opts = new_opts;
+
+	*descs = new_opts;
+	return err;
+}
+
+
+void lis_output_formats_init(
+		struct lis_output_formats *formats, struct lis_item *root
+	)
+{
+	memcpy(&formats->opt, &g_opt_template, sizeof(formats->opt));
+	formats->item = root;
+	formats->get_options = root->get_options;
+	formats->opts = NULL;
+	formats->accepted = LIS_OUTPUT_FORMATS_DEFAULT;
+	root->get_options = formats_get_options;
+}
+
+
+int lis_output_formats_get(struct lis_output_formats *formats)
+{
+	struct lis_option_descriptor **opts;
+	struct lis_option_descriptor *opt;
+	union lis_value value;
+	enum lis_error err;
+	int accepted;
+
+	err = formats->item->get_options(formats->item, &opts);
+	if (LIS_IS_ERROR(err)) {
+		lis_log_warning(
+			"%s: Failed to get options: 0x%X, %s",
+			formats->item->name, err, lis_strerror(err)
+		);
+		return LIS_OUTPUT_FORMATS_DEFAULT;
+	}
+
+	// only looks in the options of the wrapped item: never finds ours
+	opt = lis_bw_item_get_option(formats->item, OPT_NAME_OUTPUT_FORMATS);
+	if (opt == NULL) {
+		return formats->accepted;
+	}
+
+	err = opt->fn.get_value(opt, &value);
+	if (LIS_IS_ERROR(err)) {
+		lis_log_warning(
+			"%s: Failed to get value of %s: 0x%X, %s",
+			formats->item->name, OPT_NAME_OUTPUT_FORMATS,
+			err, lis_strerror(err)
+		);
+		return LIS_OUTPUT_FORMATS_DEFAULT;
+	}
+	accepted = parse_value(value.string);
+	return (accepted < 0) ? LIS_OUTPUT_FORMATS_DEFAULT : accepted;
+}
+
+
+void lis_output_formats_clean(struct lis_output_formats *formats)
+{
+	FREE(formats->opts);
+}
@@ -0,0 +1,53 @@
+#ifndef __LIBINSANE_NORMALIZERS_OUTPUT_FORMATS_H
+#define __LIBINSANE_NORMALIZERS_OUTPUT_FORMATS_H
+
+#include <libinsane/capi.h>
+#include <libinsane/error.h>
+
+
+#define LIS_OUTPUT_FORMAT(format) (1 << (format))
+#define LIS_OUTPUT_FORMATS_DEFAULT LIS_OUTPUT_FORMAT(LIS_IMG_FORMAT_RAW_RGB_24)
+
+
+/**
+ * \brief Option \ref OPT_NAME_OUTPUT_FORMATS, shared by the normalizers
+ * converting the image format (bmp2raw, raw24).
+ *
+ * The first of those normalizers in the chain adds the option to the root
+ * items. The following ones see that the option already exists and just
+ * read its value.
+ *
+ * Must be the first member of the structure pointed by the user pointer of
+ * the root items (see \ref lis_bw_item_set_user_ptr()).
+ */
+struct lis_output_formats {
+	struct lis_option_descriptor opt; // must remain first
+	struct lis_item *item;
+	enum lis_error (*get_options)(
+		struct lis_item *self, struct lis_option_descriptor ***descs
+	);
+	struct lis_option_descriptor **opts;
+	int accepted; /*!< bit mask of \ref LIS_OUTPUT_FORMAT() */
+};
+
+
+/**
+ * \brief Adds the option to a root item.
+ * To call from the item filter (see \ref lis_bw_set_item_filter()), once the
+ * user pointer of the item has been set.
+ */
+void lis_output_formats_init(
+	struct lis_output_formats *formats, struct lis_item *root
+);
+
+/**
+ * \brief Formats accepted by the application.
+ * The option may belong to another normalizer: it must be looked up again
+ * on each scan.
+ * \return bit mask of \ref LIS_OUTPUT_FORMAT()
+ */
+int lis_output_formats_get(struct lis_output_formats *formats);
+
+void lis_output_formats_clean(struct lis_output_formats *formats);
+
+#endif
@@ -2,13 +2,13 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/types.h>
 
 #include <libinsane/log.h>
 #include <libinsane/normalizers.h>
 #include <libinsane/util.h>
 
 
+#include "output_formats.h"
 #include "raw24.h"
 #include "../basewrapper.h"
 
@@ -26,16 +26,34 @@ static enum lis_error lis_raw24_scan_read(
 	struct lis_scan_session *session, void *out_buffer, size_t *buffer_size
 );
 static void lis_raw24_cancel(struct lis_scan_session *session);
+static int lis_raw24_get_fd(struct lis_scan_session *session);
+static struct lis_scan_session *lis_raw24_get_wrapped(struct lis_scan_session *session);
+
+
+struct lis_raw24_item
+{
+	struct lis_output_formats formats; // must remain first
+	struct lis_raw24_scan_session *session;
+};
 
 
 struct lis_raw24_scan_session
 {
 	struct lis_scan_session parent;
 	struct lis_scan_session *wrapped;
-	struct lis_item *item;
+	struct lis_raw24_item *item;
 
+	int accepted; /* formats returned as is */
 	struct lis_scan_parameters params;
-	int w; /* position in the current line */
+	int w; /* B&W: position in the current line (pixels) */
+
+	/* pixels already unpacked that didn't fit in the caller buffer. They
+	 * are returned first by the next call to scan_read(). */
+	struct {
+		uint8_t data[8 * 3];
+		int start;
+		int end;
+	} carry;
 };
 #define LIS_RAW24_SCAN_SESSION_PRIVATE(session) \
 	((struct lis_raw24_scan_session *)(session))
@@ -47,9 +65,28 @@ static struct lis_scan_session g_scan_session_template = {
 	.end_of_page = lis_raw24_end_of_page,
 	.scan_read = lis_raw24_scan_read,
 	.cancel = lis_raw24_cancel,
+	.get_fd = lis_raw24_get_fd,
+	.name = "raw24",
+	.get_wrapped = lis_raw24_get_wrapped,
 };
 
 
+static int needs_conversion(const struct lis_raw24_scan_session *private)
+{
+	if (private->accepted & LIS_OUTPUT_FORMAT(private->params.format)) {
+		return 0;
+	}
+	switch(private->params.format) {
+		case LIS_IMG_FORMAT_GRAYSCALE_8:
+		case LIS_IMG_FORMAT_BW_1:
+			return 1;
+		default:
+			break;
+	}
+	return 0;
+}
+
+
 static enum lis_error raw24_scan_start(
 		struct lis_item *item, struct lis_scan_session **out,
 		void *user_data
@@ -57,16 +94,13 @@ static enum lis_error raw24_scan_start(
 {
 	struct lis_item *original = lis_bw_get_original_item(item);
 	struct lis_item *root = lis_bw_get_root_item(item);
+	struct lis_raw24_item *raw24_item = lis_bw_item_get_user_ptr(root);
 	struct lis_raw24_scan_session *private;
 	enum lis_error err;
 
 	LIS_UNUSED(user_data);
 
-	private = lis_bw_item_get_user_ptr(root);
-	if (private != NULL) {
-		FREE(private);
-		lis_bw_item_set_user_ptr(root, NULL);
-	}
+	FREE(raw24_item->session);
 
 	private = calloc(1, sizeof(struct lis_raw24_scan_session));
 	if (private == NULL) {
@@ -85,11 +119,13 @@ static enum lis_error raw24_scan_start(
 	}
 	memcpy(&private->parent, &g_scan_session_template,
 		sizeof(private->parent));
-	private->item = root;
+	private->item = raw24_item;
+	private->accepted = lis_output_formats_get(&raw24_item->formats);
 
-	// grab the current parameters: see raw24_get_scan_parameters()
-	err = private->parent.get_scan_parameters(
-		&private->parent, &private->params);
+	// grab the input parameters (lis_raw24_get_scan_parameters() would
+	// return the output format)
+	err = private->wrapped->get_scan_parameters(
+		private->wrapped, &private->params);
 	if (LIS_IS_ERROR(err)) {
 		lis_log_error(
 			"get_scan_parameters() failed: 0x%X, %s",
@@ -98,7 +134,20 @@ static enum lis_error raw24_scan_start(
 		return err;
 	}
 
-	lis_bw_item_set_user_ptr(root, private);
+	if (original->type == LIS_ITEM_FLATBED && !needs_conversion(private)) {
+		// nothing to convert: the application can read directly from
+		// the wrapped session. Other sources may return pages in
+		// different formats: the session below becomes a mere
+		// pass-through for the pages that don't need any conversion.
+		lis_log_info(
+			"Image format %d returned as is", private->params.format
+		);
+		*out = private->wrapped;
+		FREE(private);
+		return err;
+	}
+
+	raw24_item->session = private;
 
 	*out = &private->parent;
 	return err;
@@ -132,9 +181,12 @@ static enum lis_error lis_raw24_get_scan_parameters(
 		);
 	}
 
+	if (private->accepted & LIS_OUTPUT_FORMAT(params->format)) {
+		// the application can handle this format: no conversion
+		return LIS_OK;
+	}
+
 	switch(params->format) {
-		case LIS_IMG_FORMAT_RAW_RGB_24:
-			return LIS_OK;
 		case LIS_IMG_FORMAT_GRAYSCALE_8:
 			lis_log_info(
 				"Will automatically convert from"
@@ -166,11 +218,34 @@ static enum lis_error lis_raw24_get_scan_parameters(
 }
 
 
+static enum lis_error raw24_item_filter(
+		struct lis_item *item, int root, void *user_data
+	)
+{
+	struct lis_raw24_item *raw24_item;
+
+	LIS_UNUSED(user_data);
+
+	if (!root) {
+		return LIS_OK;
+	}
+
+	raw24_item = calloc(1, sizeof(struct lis_raw24_item));
+	if (raw24_item == NULL) {
+		lis_log_error("Out of memory");
+		return LIS_ERR_NO_MEM;
+	}
+	lis_bw_item_set_user_ptr(item, raw24_item);
+	lis_output_formats_init(&raw24_item->formats, item);
+	return LIS_OK;
+}
+
+
 static void raw24_on_item_close(
 		struct lis_item *item, int root, void *user_data
 	)
 {
-	struct lis_raw24_scan_session *private;
+	struct lis_raw24_item *raw24_item;
 
 	LIS_UNUSED(user_data);
 
@@ -179,12 +254,17 @@ static void raw24_on_item_close(
 	}
 
 	lis_log_debug("Closing %s", item->name);
-	private = lis_bw_item_get_user_ptr(item);
-	if (private == NULL) {
+	raw24_item = lis_bw_item_get_user_ptr(item);
+	if (raw24_item == NULL) {
 		return;
 	}
 
-	lis_raw24_cancel(&private->parent);
+	if (raw24_item->session != NULL) {
+		lis_raw24_cancel(&raw24_item->session->parent);
+	}
+	lis_output_formats_clean(&raw24_item->formats);
+	FREE(raw24_item);
+	lis_bw_item_set_user_ptr(item, NULL);
 	lis_log_debug("%s closed", item->name);
 }
 
@@ -201,146 +281,269 @@ static int lis_raw24_end_of_page(struct lis_scan_session *session)
 {
 	struct lis_raw24_scan_session *private = \
 		LIS_RAW24_SCAN_SESSION_PRIVATE(session);
+
+	if (private->carry.start < private->carry.end) {
+		return 0;
+	}
 	return private->wrapped->end_of_page(private->wrapped);
 }
 
 
-void unpack_8_to_24(void *_out_buffer, size_t *out_buffer_size)
+static size_t copy_carry(
+		struct lis_raw24_scan_session *private,
+		uint8_t *out, size_t out_size
+	)
+{
+	size_t nb = MIN(
+		out_size, (size_t)(private->carry.end - private->carry.start)
+	);
+
+	memcpy(out, private->carry.data + private->carry.start, nb);
+	private->carry.start += nb;
+	return nb;
+}
+
+
+/**
+ * Unpacks as many input pixels as possible directly in the caller buffer,
+ * and fills it completely: if there is not enough room left for a whole
+ * pixel, the last one goes through the carry-over buffer.
+ */
+static enum lis_error raw8_scan_read(
+		struct lis_raw24_scan_session *private,
+		void *out_buffer, size_t *out_buffer_size
+	)
 {
-	uint8_t *out_buffer = _out_buffer;
-	ssize_t buffer_size = *out_buffer_size;
-	uint8_t val;
-
-	for (buffer_size-- ; buffer_size >= 0 ; buffer_size--) {
-		val = out_buffer[buffer_size];
-		out_buffer[buffer_size * 3] = val;
-		out_buffer[buffer_size * 3 + 1] = val;
-		out_buffer[buffer_size * 3 + 2] = val;
+	enum lis_error err;
+	uint8_t *out = out_buffer;
+	size_t remaining = *out_buffer_size;
+	size_t nb;
+
+	while(remaining > 0) {
+		if (private->carry.start < private->carry.end) {
+			nb = copy_carry(private, out, remaining);
+			out += nb;
+			remaining -= nb;
+			continue;
+		}
+
+		if (private->wrapped->end_of_page(private->wrapped)) {
+			break;
+		}
+
+		if (remaining >= 3) {
+			// read the input pixels at the start of the output
+			// area, and unpack them in place
+			nb = remaining / 3;
+			err = private->wrapped->scan_read(
+				private->wrapped, out, &nb
+			);
+			if (LIS_IS_ERROR(err)) {
+				return err;
+			}
+			if (nb == 0) {
+				break;
+			}
+			unpack_8_to_24(out, &nb);
+			out += nb;
+			remaining -= nb;
+		} else {
+			nb = 1;
+			err = private->wrapped->scan_read(
+				private->wrapped, private->carry.data, &nb
+			);
+			if (LIS_IS_ERROR(err)) {
+				return err;
+			}
+			if (nb == 0) {
+				break;
+			}
+			unpack_8_to_24(private->carry.data, &nb);
+			private->carry.start = 0;
+			private->carry.end = nb;
+		}
 	}
 
-	*out_buffer_size *= 3;
+	*out_buffer_size -= remaining;
+	return LIS_OK;
 }
 
 
-void unpack_1_to_24(void *_out_buffer, size_t *out_buffer_size)
+/**
+ * Unpacks in place B&W pixels (input bytes at the start of the buffer).
+ * Exactly nb_pixels * 3 bytes are written: the pixels of a last partial
+ * byte (end of line) are written one by one.
+ */
+static void unpack_1_segment(uint8_t *buffer, size_t nb_pixels)
 {
-	uint8_t *out_buffer = _out_buffer;
-	ssize_t buffer_size = *out_buffer_size;
+	size_t nb_bytes = nb_pixels / 8;
+	int nb_extra = nb_pixels % 8;
+	uint8_t last = 0;
 	int bit;
-	uint8_t b;
-	uint8_t val;
-
-	for (buffer_size-- ; buffer_size >= 0 ; buffer_size--) {
-		b = out_buffer[buffer_size];
-		for (bit = 0 ; bit < 8 ; bit++) {
-			val = (b & (1 << (7 - bit))) ? 0x00 : 0xFF;
-			out_buffer[buffer_size * (3 * 8) + (bit * 3)] = val;
-			out_buffer[buffer_size * (3 * 8) + (bit * 3) + 1] = val;
-			out_buffer[buffer_size * (3 * 8) + (bit * 3) + 2] = val;
-		};
-	}
 
-	*out_buffer_size *= 8 * 3;
+	if (nb_extra > 0) {
+		last = buffer[nb_bytes];
+	}
+	unpack_1_to_24(buffer, &nb_bytes);
+	for (bit = 0 ; bit < nb_extra ; bit++) {
+		memset(
+			buffer + nb_bytes + (bit * 3),
+			(last & (1 << (7 - bit))) ? 0x00 : 0xFF,
+			3
+		);
+	}
 }
 
 
-static enum lis_error raw8_scan_read(
-		struct lis_raw24_scan_session *private,
-		void *out_buffer, size_t *out_buffer_size
+/**
+ * How many input bytes can be unpacked into at most nb_pixels pixels,
+ * given that each line starts on a new byte.
+ */
+static size_t raw1_max_input(
+		const struct lis_raw24_scan_session *private, size_t nb_pixels
 	)
 {
-	enum lis_error err;
+	size_t width = private->params.width;
+	size_t line_length = (width + 7) / 8;
+	size_t rest = width - private->w;
 
-	if (*out_buffer_size < 3) {
-		lis_log_warning(
-			"Buffer too small (%luB < 3), Cannot unpack raw8",
-			(long unsigned)*out_buffer_size
-		);
-		*out_buffer_size = 0;
-		return LIS_OK; // hope for a bigger one next time
+	if (nb_pixels < rest) {
+		return nb_pixels / 8;
 	}
+	nb_pixels -= rest;
+	return ((rest + 7) / 8) + ((nb_pixels / width) * line_length)
+		+ ((nb_pixels % width) / 8);
+}
 
-	*out_buffer_size /= 3;
-	err = private->wrapped->scan_read(
-		private->wrapped, out_buffer, out_buffer_size
-	);
-	if (LIS_IS_ERROR(err)) {
-		return err;
+
+/**
+ * Unpacks in place nb_in input bytes (at the start of the buffer), that
+ * may span several lines: the padding bits at the end of each line are
+ * dropped.
+ *
+ * The input is split in 3: the end of the current line (head), whole
+ * lines, and the start of the next line (tail). Those segments are moved
+ * to their final position and unpacked from the last one to the first one,
+ * so an output never overwrites an input not unpacked yet.
+ *
+ * \return number of bytes of output
+ */
+static size_t raw1_unpack(
+		struct lis_raw24_scan_session *private, uint8_t *buffer,
+		size_t nb_in
+	)
+{
+	size_t width = private->params.width;
+	size_t line_length = (width + 7) / 8;
+	size_t rest = width - private->w;
+	size_t head_in, head_pixels, nb_lines, tail_in;
+	size_t in_offset, out_offset, out_size;
+	size_t i;
+
+	head_in = MIN(nb_in, (rest + 7) / 8);
+	head_pixels = (head_in == (rest + 7) / 8) ? rest : (head_in * 8);
+	nb_lines = (nb_in - head_in) / line_length;
+	tail_in = (nb_in - head_in) % line_length;
+
+	in_offset = head_in + (nb_lines * line_length);
+	out_offset = (head_pixels + (nb_lines * width)) * 3;
+	out_size = out_offset + (tail_in * 8 * 3);
+
+	if (tail_in > 0) {
+		memmove(buffer + out_offset, buffer + in_offset, tail_in);
+		unpack_1_segment(buffer + out_offset, tail_in * 8);
 	}
-	unpack_8_to_24(out_buffer, out_buffer_size);
-	return err;
+	for (i = 0 ; i < nb_lines ; i++) {
+		in_offset -= line_length;
+		out_offset -= width * 3;
+		memmove(buffer + out_offset, buffer + in_offset, line_length);
+		unpack_1_segment(buffer + out_offset, width);
+	}
+	assert(in_offset == head_in);
+	assert(out_offset == head_pixels * 3);
+	unpack_1_segment(buffer, head_pixels);
+
+	if (head_pixels < rest) {
+		private->w += head_pixels;
+	} else {
+		private->w = tail_in * 8;
+	}
+	return out_size;
 }
 
 
+/**
+ * Same as raw8_scan_read(), except that the input may not be a whole
+ * number of pixels at the end of each line.
+ */
 static enum lis_error raw1_scan_read(
 		struct lis_raw24_scan_session *private,
 		void *out_buffer, size_t *out_buffer_size
 	)
 {
 	enum lis_error err;
-	size_t buflen, nb_pixels;
-	size_t out_buflen;
-
-	// round the buffer size to a more convenient size
-	*out_buffer_size -= ((*out_buffer_size) % (8 * 3));
+	uint8_t *out = out_buffer;
+	size_t remaining = *out_buffer_size;
+	size_t nb, nb_pixels;
 
-	if (*out_buffer_size < 8 * 3) {
-		lis_log_error(
-			"Buffer too small (%ldB < 24), Cannot unpack raw8",
-			(long)*out_buffer_size
-		);
-		*out_buffer_size = 0;
-		return LIS_OK; // hope for a bigger one next time
-	}
-
-	if (private->w >= private->params.width) {
-		private->w = private->params.width;
+	if (private->params.width <= 0) {
+		lis_log_error("Invalid image width: %d", private->params.width);
+		return LIS_ERR_INTERNAL_UNKNOWN_ERROR;
 	}
 
-	// compute how many bytes we would need to read up to the end of
-	// the current pixel line.
-	nb_pixels = buflen = private->params.width - private->w;
-	if (buflen % 8 != 0) {
-		buflen += 8 - (buflen % 8); // round up to upper 8 pixels multiple
-	}
-	if (buflen > (*out_buffer_size / 3)) {
-		// buffer is too short --> can only read partial line
-		nb_pixels = buflen = (*out_buffer_size / 3);
-	}
-
-	// compute how many bytes we have to read (8 pixels per byte)
-	// in input to get the expected number of pixels
-	assert(buflen % 8 == 0);
-	buflen /= 8;
-
-	lis_log_info("scan_read(): Input buffer = %lu B",
-		(long unsigned) *out_buffer_size);
-	lis_log_info("scan_read(): Actually requested = %lu B",
-		(long unsigned) buflen);
-	lis_log_info("scan_read(): Expected nb of pixels = %lu",
-		(long unsigned) nb_pixels);
-
-	out_buflen = buflen;
-	err = private->wrapped->scan_read(
-		private->wrapped, out_buffer, &out_buflen
-	);
-	if (LIS_IS_ERROR(err)) {
-		return err;
-	}
-	assert(out_buflen <= buflen);
-
+	while(remaining > 0) {
+		if (private->carry.start < private->carry.end) {
+			nb = copy_carry(private, out, remaining);
+			out += nb;
+			remaining -= nb;
+			continue;
+		}
+
+		if (private->wrapped->end_of_page(private->wrapped)) {
+			// next page starts with a new line
+			private->w = 0;
+			break;
+		}
 
-	if (out_buflen < buflen) {
-		nb_pixels = out_buflen * 8;
+		nb = raw1_max_input(private, remaining / 3);
+		if (nb > 0) {
+			err = private->wrapped->scan_read(
+				private->wrapped, out, &nb
+			);
+			if (LIS_IS_ERROR(err)) {
+				return err;
+			}
+			if (nb == 0) {
+				break;
+			}
+			nb = raw1_unpack(private, out, nb);
+			out += nb;
+			remaining -= nb;
+		} else {
+			// not enough room for the next input byte
+			nb = 1;
+			err = private->wrapped->scan_read(
+				private->wrapped, private->carry.data, &nb
+			);
+			if (LIS_IS_ERROR(err)) {
+				return err;
+			}
+			if (nb == 0) {
+				break;
+			}
+			nb_pixels = MIN(8, private->params.width - private->w);
+			unpack_1_segment(private->carry.data, nb_pixels);
+			private->carry.start = 0;
+			private->carry.end = nb_pixels * 3;
+			private->w += nb_pixels;
+			if (private->w >= private->params.width) {
+				private->w = 0;
+			}
+		}
 	}
-	lis_log_info(
-		"scan_read(): Got %lu B --> %lu pixels",
-		(long unsigned)out_buflen, (long unsigned)nb_pixels
-	);
 
-	unpack_1_to_24(out_buffer, &out_buflen);
-	*out_buffer_size = nb_pixels * 3;
-	return err;
+	*out_buffer_size -= remaining;
+	return LIS_OK;
 }
 
 
@@ -352,9 +555,13 @@ static enum lis_error lis_raw24_scan_read(
 	struct lis_raw24_scan_session *private = \
 		LIS_RAW24_SCAN_SESSION_PRIVATE(session);
 
+	if (private->accepted & LIS_OUTPUT_FORMAT(private->params.format)) {
+		return private->wrapped->scan_read(
+			private->wrapped, out_buffer, buffer_size
+		);
+	}
+
 	switch(private->params.format) {
-		case LIS_IMG_FORMAT_RAW_RGB_24:
-			break;
 		case LIS_IMG_FORMAT_GRAYSCALE_8:
 			return raw8_scan_read(
 				private, out_buffer, buffer_size
@@ -380,11 +587,30 @@ static void lis_raw24_cancel(struct lis_scan_session *session)
 	struct lis_raw24_scan_session *private = \
 		LIS_RAW24_SCAN_SESSION_PRIVATE(session);
 	private->wrapped->cancel(private->wrapped);
-	lis_bw_item_set_user_ptr(private->item, NULL);
+	private->item->session = NULL;
 	FREE(private);
 }
 
 
+static int lis_raw24_get_fd(struct lis_scan_session *session)
+{
+	struct lis_raw24_scan_session *private = \
+		LIS_RAW24_SCAN_SESSION_PRIVATE(session);
+
+	if (private->wrapped->get_fd == NULL) {
+		return -1;
+	}
+	return private->wrapped->get_fd(private->wrapped);
+}
+
+
+static struct lis_scan_session *lis_raw24_get_wrapped(struct lis_scan_session *session)
+{
+	struct lis_raw24_scan_session *private = LIS_RAW24_SCAN_SESSION_PRIVATE(session);
+	return private->wrapped;
+}
+
+
 enum lis_error lis_api_normalizer_raw24(
 		struct lis_api *to_wrap, struct lis_api **api
 	)
@@ -396,6 +622,7 @@ enum lis_error lis_api_normalizer_raw24(
 		return err;
 	}
 
+	lis_bw_set_item_filter(*api, raw24_item_filter, NULL);
 	lis_bw_set_on_close_item(*api, raw24_on_item_close, NULL);
 	lis_bw_set_on_scan_start(*api, raw24_scan_start, NULL);
 
@@ -1,7 +1,37 @@
 #ifndef __LIBINSANE_NORMALIZERS_RAW24_H
 #define __LIBINSANE_NORMALIZERS_RAW24_H
 
+#include <stddef.h>
+
+/**
+ * \brief Expand pixels in place.
+ *
+ * The buffer must be big enough to contain the expanded pixels
+ * (3 times the input size for 8->24, 24 times for 1->24). The pixels are
+ * expanded backward, so the input data can be at the start of the output
+ * buffer.
+ *
+ * Those functions use the fastest implementation available on the current
+ * CPU (see \ref raw24_get_unpack_impls()).
+ */
 void unpack_8_to_24(void *buffer, size_t *buffer_size);
 void unpack_1_to_24(void *buffer, size_t *buffer_size);
 
+
+typedef void (raw24_unpack_cb)(void *buffer, size_t *buffer_size);
+
+struct raw24_unpack_impl {
+	const char *name;
+	int (*is_supported)(void);
+	raw24_unpack_cb *unpack_8_to_24;
+	raw24_unpack_cb *unpack_1_to_24;
+};
+
+/**
+ * \brief All the implementations of the unpack functions built in.
+ * Sorted from the fastest one to the reference one (scalar). NULL
+ * terminated (name == NULL). Only useful for unit tests.
+ */
+const struct raw24_unpack_impl *raw24_get_unpack_impls(void);
+
 #endif
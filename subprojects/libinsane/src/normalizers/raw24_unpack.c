@@ -0,0 +1,487 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "raw24.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RAW24_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__ARM_NEON)
+#define RAW24_NEON
+#include <arm_neon.h>
+#endif
+
+
+/*
+ * All the functions below expand the pixels in place and backward:
+ * the input bytes are at the start of the buffer and the output overwrites
+ * them. Therefore, blocks must always be processed from the end of the
+ * buffer to its start, and a block must be fully loaded before its output is
+ * stored.
+ */
+
+
+/* Reference implementations */
+
+static void scalar_8_to_24(uint8_t *buffer, size_t start, size_t end)
+{
+	uint8_t val;
+
+	while (end > start) {
+		end--;
+		val = buffer[end];
+		buffer[end * 3] = val;
+		buffer[end * 3 + 1] = val;
+		buffer[end * 3 + 2] = val;
+	}
+}
+
+
+static void scalar_1_to_24(uint8_t *buffer, size_t start, size_t end)
+{
+	int bit;
+	uint8_t b;
+	uint8_t val;
+
+	while (end > start) {
+		end--;
+		b = buffer[end];
+		for (bit = 0 ; bit < 8 ; bit++) {
+			val = (b & (1 << (7 - bit))) ? 0x00 : 0xFF;
+			buffer[end * (3 * 8) + (bit * 3)] = val;
+			buffer[end * (3 * 8) + (bit * 3) + 1] = val;
+			buffer[end * (3 * 8) + (bit * 3) + 2] = val;
+		}
+	}
+}
+
+
+static int always_supported(void)
+{
+	return 1;
+}
+
+
+static void unpack_8_to_24_scalar(void *buffer, size_t *buffer_size)
+{
+	scalar_8_to_24(buffer, 0, *buffer_size);
+	*buffer_size *= 3;
+}
+
+
+static void unpack_1_to_24_scalar(void *buffer, size_t *buffer_size)
+{
+	scalar_1_to_24(buffer, 0, *buffer_size);
+	*buffer_size *= 8 * 3;
+}
+
+
+/*
+ * B&W: output byte 'n' of each group of 24 bytes corresponds to the bit
+ * (7 - n / 3) of the input byte. Those are the bit masks to apply on a 64bits
+ * word filled with the input byte to get each third of the 24 output bytes
+ * (little endian). A pixel is black (0x00) if its bit is set.
+ */
+#define BW_MASK_0 0x2020404040808080LL
+#define BW_MASK_1 0x0408080810101020LL
+#define BW_MASK_2 0x0101010202020404LL
+
+
+#ifdef RAW24_X86
+
+static int sse2_supported(void)
+{
+#ifdef __x86_64__
+	return 1; // always available on x86_64
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+
+
+static int avx2_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+
+/*
+ * SSE2 has no byte shuffle. So we work on the 32bits words: each input word
+ * (4 pixels: x0, x1, x2, x3) gives 3 output words:
+ * (x0 x0 x0 x1) (x1 x1 x2 x2) (x2 x3 x3 x3). Those 3 words are then
+ * interleaved.
+ */
+__attribute__((target("sse2")))
+static void unpack_8_to_24_sse2(void *_buffer, size_t *buffer_size)
+{
+	uint8_t *buffer = _buffer;
+	size_t nb_blocks = *buffer_size / 16;
+	const __m128i mask_b0 = _mm_set1_epi32(0x000000FF);
+	const __m128i mask_b1 = _mm_set1_epi32(0x0000FF00);
+	const __m128i mask_b2 = _mm_set1_epi32(0x00FF0000);
+	const __m128i mask_b3 = _mm_set1_epi32((int)0xFF000000);
+	__m128i in, b0, b1, b2, b3, e0, e1, e2;
+	__m128 lo01, lo12, lo20, hi01, hi12, hi20;
+
+	scalar_8_to_24(buffer, nb_blocks * 16, *buffer_size);
+
+	while (nb_blocks > 0) {
+		nb_blocks--;
+		in = _mm_loadu_si128((const __m128i *)(buffer + (nb_blocks * 16)));
+
+		b0 = _mm_and_si128(in, mask_b0);
+		b1 = _mm_and_si128(in, mask_b1);
+		b2 = _mm_and_si128(in, mask_b2);
+		b3 = _mm_and_si128(in, mask_b3);
+
+		// (x0 x0 x0 x1)
+		e0 = _mm_or_si128(
+			_mm_or_si128(b0, _mm_slli_epi32(b0, 8)),
+			_mm_slli_epi32(_mm_or_si128(b0, b1), 16)
+		);
+		// (x1 x1 x2 x2)
+		e1 = _mm_or_si128(
+			_mm_or_si128(_mm_srli_epi32(b1, 8), b1),
+			_mm_or_si128(b2, _mm_slli_epi32(b2, 8))
+		);
+		// (x2 x3 x3 x3)
+		e2 = _mm_or_si128(
+			_mm_srli_epi32(_mm_or_si128(b2, b3), 16),
+			_mm_or_si128(_mm_srli_epi32(b3, 8), b3)
+		);
+
+		lo01 = _mm_castsi128_ps(_mm_unpacklo_epi32(e0, e1));
+		lo12 = _mm_castsi128_ps(_mm_unpacklo_epi32(e1, e2));
+		lo20 = _mm_castsi128_ps(_mm_unpacklo_epi32(e2, e0));
+		hi01 = _mm_castsi128_ps(_mm_unpackhi_epi32(e0, e1));
+		hi12 = _mm_castsi128_ps(_mm_unpackhi_epi32(e1, e2));
+		hi20 = _mm_castsi128_ps(_mm_unpackhi_epi32(e2, e0));
+
+		_mm_storeu_si128(
+			(__m128i *)(buffer + (nb_blocks * 48)),
+			_mm_castps_si128(_mm_shuffle_ps(lo01, lo20, _MM_SHUFFLE(3, 0, 1, 0)))
+		);
+		_mm_storeu_si128(
+			(__m128i *)(buffer + (nb_blocks * 48) + 16),
+			_mm_castps_si128(_mm_shuffle_ps(lo12, hi01, _MM_SHUFFLE(1, 0, 3, 2)))
+		);
+		_mm_storeu_si128(
+			(__m128i *)(buffer + (nb_blocks * 48) + 32),
+			_mm_castps_si128(_mm_shuffle_ps(hi20, hi12, _MM_SHUFFLE(3, 2, 3, 0)))
+		);
+	}
+
+	*buffer_size *= 3;
+}
+
+
+__attribute__((target("sse2")))
+static inline void bw_store_sse2(uint8_t *out, __m128i q)
+{
+	// q = (bA x 8, bB x 8) --> 48 output bytes
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i mask_01 = _mm_set_epi64x(BW_MASK_1, BW_MASK_0);
+	const __m128i mask_20 = _mm_set_epi64x(BW_MASK_0, BW_MASK_2);
+	const __m128i mask_12 = _mm_set_epi64x(BW_MASK_2, BW_MASK_1);
+
+	_mm_storeu_si128((__m128i *)out, _mm_cmpeq_epi8(
+		_mm_and_si128(_mm_unpacklo_epi64(q, q), mask_01), zero
+	));
+	_mm_storeu_si128((__m128i *)(out + 16), _mm_cmpeq_epi8(
+		_mm_and_si128(q, mask_20), zero
+	));
+	_mm_storeu_si128((__m128i *)(out + 32), _mm_cmpeq_epi8(
+		_mm_and_si128(_mm_unpackhi_epi64(q, q), mask_12), zero
+	));
+}
+
+
+__attribute__((target("sse2")))
+static void unpack_1_to_24_sse2(void *_buffer, size_t *buffer_size)
+{
+	uint8_t *buffer = _buffer;
+	uint8_t *out;
+	size_t nb_blocks = *buffer_size / 16;
+	__m128i in, lo, hi, c;
+	int i;
+
+	scalar_1_to_24(buffer, nb_blocks * 16, *buffer_size);
+
+	while (nb_blocks > 0) {
+		nb_blocks--;
+		in = _mm_loadu_si128((const __m128i *)(buffer + (nb_blocks * 16)));
+		out = buffer + (nb_blocks * 16 * 24);
+
+		// spread each input byte on 64 bits
+		lo = _mm_unpacklo_epi8(in, in);
+		hi = _mm_unpackhi_epi8(in, in);
+		for (i = 0 ; i < 4 ; i++) {
+			switch(i) {
+				case 0:
+					c = _mm_unpacklo_epi16(lo, lo);
+					break;
+				case 1:
+					c = _mm_unpackhi_epi16(lo, lo);
+					break;
+				case 2:
+					c = _mm_unpacklo_epi16(hi, hi);
+					break;
+				default:
+					c = _mm_unpackhi_epi16(hi, hi);
+					break;
+			}
+			bw_store_sse2(out, _mm_unpacklo_epi32(c, c));
+			bw_store_sse2(out + 48, _mm_unpackhi_epi32(c, c));
+			out += 96;
+		}
+	}
+
+	*buffer_size *= 8 * 3;
+}
+
+
+/*
+ * vpshufb only shuffles inside each 128bits lane. So each 32 bytes output
+ * vector is made from 16 input bytes broadcasted to both lanes.
+ */
+__attribute__((target("avx2")))
+static void unpack_8_to_24_avx2(void *_buffer, size_t *buffer_size)
+{
+	uint8_t *buffer = _buffer;
+	uint8_t *in;
+	uint8_t *out;
+	size_t nb_blocks = *buffer_size / 32;
+	// input offsets: 0, 8, 16
+	const __m256i shuf0 = _mm256_setr_epi8(
+		0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5,
+		5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10
+	);
+	const __m256i shuf1 = _mm256_setr_epi8(
+		2, 3, 3, 3, 4, 4, 4, 5, 5, 5, 6, 6, 6, 7, 7, 7,
+		8, 8, 8, 9, 9, 9, 10, 10, 10, 11, 11, 11, 12, 12, 12, 13
+	);
+	const __m256i shuf2 = _mm256_setr_epi8(
+		5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10,
+		10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15
+	);
+	__m256i v0, v1, v2;
+
+	scalar_8_to_24(buffer, nb_blocks * 32, *buffer_size);
+
+	while (nb_blocks > 0) {
+		nb_blocks--;
+		in = buffer + (nb_blocks * 32);
+		out = buffer + (nb_blocks * 96);
+
+		v0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)in));
+		v1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(in + 8)));
+		v2 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(in + 16)));
+
+		_mm256_storeu_si256((__m256i *)out, _mm256_shuffle_epi8(v0, shuf0));
+		_mm256_storeu_si256((__m256i *)(out + 32), _mm256_shuffle_epi8(v1, shuf1));
+		_mm256_storeu_si256((__m256i *)(out + 64), _mm256_shuffle_epi8(v2, shuf2));
+	}
+
+	*buffer_size *= 3;
+}
+
+
+__attribute__((target("avx2")))
+static void unpack_1_to_24_avx2(void *_buffer, size_t *buffer_size)
+{
+	uint8_t *buffer = _buffer;
+	uint8_t *out;
+	size_t nb_blocks = *buffer_size / 16;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i four = _mm256_set1_epi8(4);
+	// 64bits words: (b0 b0 b0 b1) (b1 b1 b2 b2) (b2 b3 b3 b3)
+	const __m256i base_shuf0 = _mm256_setr_epi8(
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1
+	);
+	const __m256i base_shuf1 = _mm256_setr_epi8(
+		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+		2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2
+	);
+	const __m256i base_shuf2 = _mm256_setr_epi8(
+		2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3,
+		3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3
+	);
+	const __m256i mask0 = _mm256_setr_epi64x(BW_MASK_0, BW_MASK_1, BW_MASK_2, BW_MASK_0);
+	const __m256i mask1 = _mm256_setr_epi64x(BW_MASK_1, BW_MASK_2, BW_MASK_0, BW_MASK_1);
+	const __m256i mask2 = _mm256_setr_epi64x(BW_MASK_2, BW_MASK_0, BW_MASK_1, BW_MASK_2);
+	__m256i in, shuf0, shuf1, shuf2;
+	int i;
+
+	scalar_1_to_24(buffer, nb_blocks * 16, *buffer_size);
+
+	while (nb_blocks > 0) {
+		nb_blocks--;
+		in = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i *)(buffer + (nb_blocks * 16)))
+		);
+		out = buffer + (nb_blocks * 16 * 24);
+
+		shuf0 = base_shuf0;
+		shuf1 = base_shuf1;
+		shuf2 = base_shuf2;
+		// 4 input bytes at a time --> 96 output bytes
+		for (i = 0 ; i < 4 ; i++) {
+			_mm256_storeu_si256((__m256i *)out, _mm256_cmpeq_epi8(
+				_mm256_and_si256(_mm256_shuffle_epi8(in, shuf0), mask0), zero
+			));
+			_mm256_storeu_si256((__m256i *)(out + 32), _mm256_cmpeq_epi8(
+				_mm256_and_si256(_mm256_shuffle_epi8(in, shuf1), mask1), zero
+			));
+			_mm256_storeu_si256((__m256i *)(out + 64), _mm256_cmpeq_epi8(
+				_mm256_and_si256(_mm256_shuffle_epi8(in, shuf2), mask2), zero
+			));
+			shuf0 = _mm256_add_epi8(shuf0, four);
+			shuf1 = _mm256_add_epi8(shuf1, four);
+			shuf2 = _mm256_add_epi8(shuf2, four);
+			out += 96;
+		}
+	}
+
+	*buffer_size *= 8 * 3;
+}
+
+#endif /* RAW24_X86 */
+
+
+#ifdef RAW24_NEON
+
+static void unpack_8_to_24_neon(void *_buffer, size_t *buffer_size)
+{
+	uint8_t *buffer = _buffer;
+	size_t nb_blocks = *buffer_size / 16;
+	uint8x16x3_t out;
+
+	scalar_8_to_24(buffer, nb_blocks * 16, *buffer_size);
+
+	while (nb_blocks > 0) {
+		nb_blocks--;
+		out.val[0] = vld1q_u8(buffer + (nb_blocks * 16));
+		out.val[1] = out.val[0];
+		out.val[2] = out.val[0];
+		vst3q_u8(buffer + (nb_blocks * 48), out);
+	}
+
+	*buffer_size *= 3;
+}
+
+
+static void unpack_1_to_24_neon(void *_buffer, size_t *buffer_size)
+{
+	static const uint8_t bits[] = {
+		0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+		0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+	};
+	uint8_t *buffer = _buffer;
+	uint8_t *out;
+	size_t nb_blocks = *buffer_size / 16;
+	const uint8x16_t mask = vld1q_u8(bits);
+	const uint8x16_t zero = vdupq_n_u8(0);
+	uint8_t in[16];
+	uint8x16x3_t pixels;
+	int i;
+
+	scalar_1_to_24(buffer, nb_blocks * 16, *buffer_size);
+
+	while (nb_blocks > 0) {
+		nb_blocks--;
+		memcpy(in, buffer + (nb_blocks * 16), sizeof(in));
+		out = buffer + (nb_blocks * 16 * 24);
+
+		// 2 input bytes at a time --> 16 pixels --> 48 output bytes
+		for (i = 0 ; i < 16 ; i += 2) {
+			pixels.val[0] = vceqq_u8(vandq_u8(
+				vcombine_u8(vdup_n_u8(in[i]), vdup_n_u8(in[i + 1])),
+				mask
+			), zero);
+			pixels.val[1] = pixels.val[0];
+			pixels.val[2] = pixels.val[0];
+			vst3q_u8(out, pixels);
+			out += 48;
+		}
+	}
+
+	*buffer_size *= 8 * 3;
+}
+
+#endif /* RAW24_NEON */
+
+
+static const struct raw24_unpack_impl g_unpack_impls[] = {
+#ifdef RAW24_X86
+	{
+		.name = "avx2",
+		.is_supported = avx2_supported,
+		.unpack_8_to_24 = unpack_8_to_24_avx2,
+		.unpack_1_to_24 = unpack_1_to_24_avx2,
+	},
+	{
+		.name = "sse2",
+		.is_supported = sse2_supported,
+		.unpack_8_to_24 = unpack_8_to_24_sse2,
+		.unpack_1_to_24 = unpack_1_to_24_sse2,
+	},
+#endif
+#ifdef RAW24_NEON
+	{
+		.name = "neon",
+		.is_supported = always_supported,
+		.unpack_8_to_24 = unpack_8_to_24_neon,
+		.unpack_1_to_24 = unpack_1_to_24_neon,
+	},
+#endif
+	{
+		.name = "scalar",
+		.is_supported = always_supported,
+		.unpack_8_to_24 = unpack_8_to_24_scalar,
+		.unpack_1_to_24 = unpack_1_to_24_scalar,
+	},
+	{ .name = NULL },
+};
+
+
+const struct raw24_unpack_impl *raw24_get_unpack_impls(void)
+{
+	return g_unpack_impls;
+}
+
+
+static const struct raw24_unpack_impl *get_best_impl(void)
+{
+	static const struct raw24_unpack_impl *best = NULL;
+	const struct raw24_unpack_impl *impl;
+
+	// harmless race: all the threads will find the same implementation
+	if (best != NULL) {
+		return best;
+	}
+
+	for (impl = g_unpack_impls ; impl->name != NULL ; impl++) {
+		if (impl->is_supported()) {
+			break;
+		}
+	}
+	best = impl;
+	return best;
+}
+
+
+void unpack_8_to_24(void *buffer, size_t *buffer_size)
+{
+	get_best_impl()->unpack_8_to_24(buffer, buffer_size);
+}
+
+
+void unpack_1_to_24(void *buffer, size_t *buffer_size)
+{
+	get_best_impl()->unpack_1_to_24(buffer, buffer_size);
+}
@@ -0,0 +1,666 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libinsane/log.h>
+#include <libinsane/normalizers.h>
+#include <libinsane/util.h>
+
+#include "reduce_colors.h"
+#include "../basewrapper.h"
+
+
+#define NAME "reduce_colors"
+
+// how much input data we try to get from the wrapped session at once
+// (rounded to a number of whole lines)
+#define BATCH_SIZE (64 * 1024)
+
+// adaptive threshold: a pixel is black if it is this much darker (%) than
+// the average of its neighbourhood
+#define ADAPTIVE_DARKER 15
+
+
+static enum lis_error reduce_get_scan_parameters(
+	struct lis_scan_session *self,
+	struct lis_scan_parameters *params
+);
+static int reduce_end_of_feed(struct lis_scan_session *session);
+static int reduce_end_of_page(struct lis_scan_session *session);
+static enum lis_error reduce_scan_read(
+	struct lis_scan_session *session, void *out_buffer, size_t *buffer_size
+);
+static void reduce_cancel(struct lis_scan_session *session);
+static int reduce_get_fd(struct lis_scan_session *session);
+static struct lis_scan_session *reduce_get_wrapped(struct lis_scan_session *session);
+
+
+struct reduce_session
+{
+	struct lis_scan_session parent;
+	struct lis_scan_session *wrapped;
+	struct lis_item *item;
+
+	/* configuration (environment variables) */
+	enum lis_img_format target; // GRAYSCALE_8 or BW_1
+	int threshold; // B&W only: < 0 means adaptive
+
+	/* current page */
+	bool page_started;
+	bool passthrough; // input is already in the target format (or unknown)
+	struct lis_scan_parameters params; // input
+	size_t in_line_length;
+	size_t out_line_length;
+
+	/* input data: whole lines (+ the start of the next one). Constant
+	 * size for the whole session. */
+	struct {
+		uint8_t *data;
+		size_t allocated;
+		size_t start; // first byte not converted yet
+		size_t end; // end of what has been read
+		size_t max_lines;
+	} pool;
+
+	/* grayscale line (B&W output only) */
+	uint8_t *gray;
+	size_t gray_allocated;
+
+	/* adaptive threshold: running average of each column on the
+	 * previous line */
+	int *prev_avg;
+	size_t prev_avg_allocated;
+
+	/* converted line, used only when the caller's buffer cannot receive a
+	 * whole line */
+	struct {
+		uint8_t *content;
+		size_t allocated;
+		size_t current; // what has already been returned
+	} line;
+};
+#define REDUCE_SESSION(session) ((struct reduce_session *)(session))
+
+
+static struct lis_scan_session g_scan_session_template = {
+	.get_scan_parameters = reduce_get_scan_parameters,
+	.end_of_feed = reduce_end_of_feed,
+	.end_of_page = reduce_end_of_page,
+	.scan_read = reduce_scan_read,
+	.cancel = reduce_cancel,
+	.get_fd = reduce_get_fd,
+	.name = "reduce_colors",
+	.get_wrapped = reduce_get_wrapped,
+};
+
+
+/**
+ * Only grows: once big enough, the next pages don't allocate anything.
+ */
+static enum lis_error reserve(void **data, size_t *allocated, size_t size)
+{
+	void *new_data;
+
+	if (size <= *allocated && *data != NULL) {
+		return LIS_OK;
+	}
+
+	new_data = realloc(*data, MAX(size, 1));
+	if (new_data == NULL) {
+		lis_log_error("Out of memory (%lu B)", (long unsigned)size);
+		return LIS_ERR_NO_MEM;
+	}
+	*data = new_data;
+	*allocated = size;
+	return LIS_OK;
+}
+
+
+static bool can_reduce(
+		const struct reduce_session *private, enum lis_img_format format
+	)
+{
+	switch(format) {
+		case LIS_IMG_FORMAT_RAW_RGB_24:
+			return true;
+		case LIS_IMG_FORMAT_GRAYSCALE_8:
+			return private->target == LIS_IMG_FORMAT_BW_1;
+		default:
+			break;
+	}
+	return false;
+}
+
+
+static size_t out_line_length(
+		const struct reduce_session *private, int width
+	)
+{
+	if (private->target == LIS_IMG_FORMAT_BW_1) {
+		return (width + 7) / 8;
+	}
+	return width;
+}
+
+
+static enum lis_error reduce_get_scan_parameters(
+		struct lis_scan_session *self,
+		struct lis_scan_parameters *params
+	)
+{
+	struct reduce_session *private = REDUCE_SESSION(self);
+	enum lis_error err;
+
+	err = private->wrapped->get_scan_parameters(private->wrapped, params);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+
+	if (!can_reduce(private, params->format)) {
+		if (params->format != private->target) {
+			lis_log_warning(
+				"Can't reduce image format %d: returned as is",
+				params->format
+			);
+		}
+		return err;
+	}
+
+	params->format = private->target;
+	params->image_size = (
+		out_line_length(private, params->width) * params->height
+	);
+	return err;
+}
+
+
+static int reduce_end_of_feed(struct lis_scan_session *session)
+{
+	struct reduce_session *private = REDUCE_SESSION(session);
+	return private->wrapped->end_of_feed(private->wrapped);
+}
+
+
+static size_t pool_nb_lines(const struct reduce_session *private)
+{
+	if (private->in_line_length == 0) {
+		return 0;
+	}
+	return (private->pool.end - private->pool.start)
+		/ private->in_line_length;
+}
+
+
+static int reduce_end_of_page(struct lis_scan_session *session)
+{
+	struct reduce_session *private = REDUCE_SESSION(session);
+
+	if (!private->passthrough && private->page_started) {
+		if (private->line.current < private->out_line_length) {
+			return 0;
+		}
+		if (pool_nb_lines(private) > 0) {
+			return 0;
+		}
+	}
+	if (!private->wrapped->end_of_page(private->wrapped)) {
+		return 0;
+	}
+	// next read will be on a new page, maybe with other parameters
+	private->page_started = false;
+	return 1;
+}
+
+
+static enum lis_error start_page(struct reduce_session *private)
+{
+	size_t width;
+	enum lis_error err;
+	size_t i;
+
+	private->pool.start = 0;
+	private->pool.end = 0;
+	private->in_line_length = 0;
+	private->out_line_length = 0;
+	private->line.current = 0;
+
+	err = private->wrapped->get_scan_parameters(
+		private->wrapped, &private->params
+	);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+
+	private->passthrough = !can_reduce(private, private->params.format);
+	if (private->passthrough || private->params.width <= 0) {
+		private->passthrough = true;
+		return LIS_OK;
+	}
+
+	width = private->params.width;
+	private->in_line_length = width * (
+		private->params.format == LIS_IMG_FORMAT_RAW_RGB_24 ? 3 : 1
+	);
+	private->out_line_length = out_line_length(private, width);
+	// nothing pending in the line buffer
+	private->line.current = private->out_line_length;
+
+	private->pool.max_lines = MAX(1, BATCH_SIZE / private->in_line_length);
+	err = reserve(
+		(void **)&private->pool.data, &private->pool.allocated,
+		private->pool.max_lines * private->in_line_length
+	);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+	err = reserve(
+		(void **)&private->line.content, &private->line.allocated,
+		private->out_line_length
+	);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+
+	if (private->target != LIS_IMG_FORMAT_BW_1) {
+		return LIS_OK;
+	}
+
+	err = reserve(
+		(void **)&private->gray, &private->gray_allocated, width
+	);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+	if (private->threshold < 0) {
+		err = reserve(
+			(void **)&private->prev_avg,
+			&private->prev_avg_allocated, width * sizeof(int)
+		);
+		if (LIS_IS_ERROR(err)) {
+			return err;
+		}
+		for (i = 0 ; i < width ; i++) {
+			private->prev_avg[i] = 128;
+		}
+	}
+	return LIS_OK;
+}
+
+
+/**
+ * Reads up to 'nb_lines' whole input lines in the pool. Only stops early
+ * at the end of the page.
+ */
+static enum lis_error fill_pool(struct reduce_session *private, size_t nb_lines)
+{
+	size_t to_read, r;
+	enum lis_error err;
+
+	assert(nb_lines > 0);
+	assert(nb_lines <= private->pool.max_lines);
+
+	// keep what remains (less than a line) at the start of the pool
+	if (private->pool.start > 0) {
+		memmove(
+			private->pool.data,
+			private->pool.data + private->pool.start,
+			private->pool.end - private->pool.start
+		);
+		private->pool.end -= private->pool.start;
+		private->pool.start = 0;
+	}
+
+	to_read = (nb_lines * private->in_line_length) - private->pool.end;
+	while(to_read > 0) {
+		if (private->wrapped->end_of_page(private->wrapped)) {
+			if (private->pool.end % private->in_line_length != 0) {
+				lis_log_warning(
+					"Page ended in the middle of a line"
+					" (%lu B dropped)",
+					(long unsigned)(
+						private->pool.end
+						% private->in_line_length
+					)
+				);
+				private->pool.end -= (
+					private->pool.end % private->in_line_length
+				);
+			}
+			break;
+		}
+
+		r = to_read;
+		err = private->wrapped->scan_read(
+			private->wrapped, private->pool.data + private->pool.end, &r
+		);
+		if (LIS_IS_ERROR(err)) {
+			return err;
+		}
+		if (r == 0) {
+			// no data ready yet (non-blocking source)
+			break;
+		}
+		to_read -= r;
+		private->pool.end += r;
+	}
+
+	return LIS_OK;
+}
+
+
+static void threshold_fixed(
+		const uint8_t *gray, uint8_t *out, int width, int threshold
+	)
+{
+	int x;
+
+	memset(out, 0, (width + 7) / 8);
+	for (x = 0 ; x < width ; x++) {
+		// B&W: 1 == black
+		if (gray[x] < threshold) {
+			out[x / 8] |= 1 << (7 - (x % 8));
+		}
+	}
+}
+
+
+/**
+ * Wellner's adaptive threshold: each pixel is compared to the moving
+ * average of the previous pixels on the line (width / 8 pixels), itself
+ * averaged with the one of the pixel above. Only requires to keep one line
+ * of averages.
+ */
+static void threshold_adaptive(
+		const uint8_t *gray, uint8_t *out, int width, int *prev_avg
+	)
+{
+	int s = MAX(1, width / 8);
+	int sum = 128 * s;
+	int avg, x;
+
+	memset(out, 0, (width + 7) / 8);
+	for (x = 0 ; x < width ; x++) {
+		sum += gray[x] - (sum / s);
+		avg = ((sum / s) + prev_avg[x]) / 2;
+		prev_avg[x] = sum / s;
+		if (gray[x] * 100 < avg * (100 - ADAPTIVE_DARKER)) {
+			out[x / 8] |= 1 << (7 - (x % 8));
+		}
+	}
+}
+
+
+/**
+ * Converts the next 'nb_lines' lines of the pool.
+ */
+static void convert_lines(
+		struct reduce_session *private, uint8_t *out, size_t nb_lines
+	)
+{
+	int width = private->params.width;
+	const uint8_t *in;
+	const uint8_t *gray;
+
+	assert(nb_lines <= pool_nb_lines(private));
+
+	for ( ; nb_lines > 0 ; nb_lines--) {
+		in = private->pool.data + private->pool.start;
+
+		if (private->target == LIS_IMG_FORMAT_GRAYSCALE_8) {
+			rgb24_to_gray8(in, out, width);
+		} else {
+			gray = in;
+			if (private->params.format == LIS_IMG_FORMAT_RAW_RGB_24) {
+				rgb24_to_gray8(in, private->gray, width);
+				gray = private->gray;
+			}
+			if (private->threshold >= 0) {
+				threshold_fixed(gray, out, width, private->threshold);
+			} else {
+				threshold_adaptive(
+					gray, out, width, private->prev_avg
+				);
+			}
+		}
+
+		private->pool.start += private->in_line_length;
+		out += private->out_line_length;
+	}
+}
+
+
+static enum lis_error reduce_scan_read(
+		struct lis_scan_session *session,
+		void *out_buffer, size_t *buffer_size
+	)
+{
+	struct reduce_session *private = REDUCE_SESSION(session);
+	uint8_t *out = out_buffer;
+	size_t remaining = *buffer_size;
+	size_t nb_lines, to_copy;
+	enum lis_error err;
+
+	if (!private->page_started) {
+		err = start_page(private);
+		if (LIS_IS_ERROR(err)) {
+			return err;
+		}
+		private->page_started = true;
+	}
+
+	if (private->passthrough) {
+		return private->wrapped->scan_read(
+			private->wrapped, out_buffer, buffer_size
+		);
+	}
+
+	while(remaining > 0) {
+		if (private->line.current < private->out_line_length) {
+			// end of a line converted earlier
+			to_copy = MIN(
+				private->out_line_length - private->line.current,
+				remaining
+			);
+			memcpy(
+				out, private->line.content + private->line.current,
+				to_copy
+			);
+			out += to_copy;
+			remaining -= to_copy;
+			private->line.current += to_copy;
+			continue;
+		}
+
+		// whole lines that can be converted directly in the caller
+		// buffer
+		nb_lines = remaining / private->out_line_length;
+
+		if (pool_nb_lines(private) == 0) {
+			if (private->wrapped->end_of_page(private->wrapped)) {
+				break;
+			}
+			err = fill_pool(
+				private,
+				MAX(1, MIN(nb_lines, private->pool.max_lines))
+			);
+			if (LIS_IS_ERROR(err)) {
+				return err;
+			}
+			if (pool_nb_lines(private) == 0) {
+				// not a whole line available yet: return what
+				// we have so far
+				break;
+			}
+			continue;
+		}
+
+		if (nb_lines > 0) {
+			nb_lines = MIN(nb_lines, pool_nb_lines(private));
+			convert_lines(private, out, nb_lines);
+			out += nb_lines * private->out_line_length;
+			remaining -= nb_lines * private->out_line_length;
+		} else {
+			convert_lines(private, private->line.content, 1);
+			private->line.current = 0;
+		}
+	}
+
+	*buffer_size -= remaining;
+	return LIS_OK;
+}
+
+
+static void reduce_cancel(struct lis_scan_session *session)
+{
+	struct reduce_session *private = REDUCE_SESSION(session);
+
+	private->wrapped->cancel(private->wrapped);
+	lis_bw_item_set_user_ptr(private->item, NULL);
+	FREE(private->pool.data);
+	FREE(private->gray);
+	FREE(private->prev_avg);
+	FREE(private->line.content);
+	FREE(private);
+}
+
+
+static int reduce_get_fd(struct lis_scan_session *session)
+{
+	struct reduce_session *private = REDUCE_SESSION(session);
+
+	if (!private->passthrough) {
+		// converting requires reading whole lines
+		return -1;
+	}
+	if (private->wrapped->get_fd == NULL) {
+		return -1;
+	}
+	return private->wrapped->get_fd(private->wrapped);
+}
+
+
+static struct lis_scan_session *reduce_get_wrapped(struct lis_scan_session *session)
+{
+	struct reduce_session *private = REDUCE_SESSION(session);
+	return private->wrapped;
+}
+
+
+static enum lis_error reduce_scan_start(
+		struct lis_item *item, struct lis_scan_session **out,
+		void *user_data
+	)
+{
+	struct lis_item *original = lis_bw_get_original_item(item);
+	struct lis_item *root = lis_bw_get_root_item(item);
+	struct reduce_session *private;
+	struct lis_scan_parameters params;
+	enum lis_error err;
+
+	LIS_UNUSED(user_data);
+
+	private = calloc(1, sizeof(struct reduce_session));
+	if (private == NULL) {
+		lis_log_error("Out of memory");
+		return LIS_ERR_NO_MEM;
+	}
+
+	switch(lis_getenv("LIBINSANE_NORMALIZER_REDUCE_COLORS_DEPTH", 8)) {
+		case 1:
+			private->target = LIS_IMG_FORMAT_BW_1;
+			break;
+		case 8:
+			private->target = LIS_IMG_FORMAT_GRAYSCALE_8;
+			break;
+		default:
+			lis_log_error(
+				"Unsupported depth: %d (expected 1 or 8)",
+				lis_getenv("LIBINSANE_NORMALIZER_REDUCE_COLORS_DEPTH", 8)
+			);
+			FREE(private);
+			return LIS_ERR_INVALID_VALUE;
+	}
+	private->threshold = MIN(256, lis_getenv(
+		"LIBINSANE_NORMALIZER_REDUCE_COLORS_THRESHOLD", 128
+	));
+
+	err = original->scan_start(original, &private->wrapped);
+	if (LIS_IS_ERROR(err)) {
+		lis_log_error(
+			"scan_start() failed: 0x%X, %s",
+			err, lis_strerror(err)
+		);
+		FREE(private);
+		return err;
+	}
+
+	err = private->wrapped->get_scan_parameters(private->wrapped, &params);
+	// only a flatbed is sure to keep the same format until the end of
+	// the session. On other sources, start_page() decides again on each
+	// page.
+	if (LIS_IS_OK(err) && original->type == LIS_ITEM_FLATBED
+			&& !can_reduce(private, params.format)) {
+		if (params.format != private->target) {
+			lis_log_warning(
+				"Can't reduce image format %d: returned as is",
+				params.format
+			);
+		}
+		// the application can read directly from the wrapped session
+		*out = private->wrapped;
+		FREE(private);
+		return err;
+	}
+
+	memcpy(&private->parent, &g_scan_session_template,
+		sizeof(private->parent));
+	private->item = root;
+
+	lis_bw_item_set_user_ptr(root, private);
+	*out = &private->parent;
+	return err;
+}
+
+
+static void reduce_on_item_close(
+		struct lis_item *item, int root, void *user_data
+	)
+{
+	struct reduce_session *private;
+
+	LIS_UNUSED(user_data);
+
+	if (!root) {
+		return;
+	}
+
+	private = lis_bw_item_get_user_ptr(item);
+	if (private == NULL) {
+		return;
+	}
+
+	lis_log_warning(
+		"Device has been closed but scan session hasn't been cancelled"
+	);
+	reduce_cancel(&private->parent);
+}
+
+
+enum lis_error lis_api_normalizer_reduce_colors(
+		struct lis_api *to_wrap, struct lis_api **api
+	)
+{
+	enum lis_error err;
+
+	err = lis_api_base_wrapper(to_wrap, api, NAME);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+
+	lis_bw_set_on_close_item(*api, reduce_on_item_close, NULL);
+	lis_bw_set_on_scan_start(*api, reduce_scan_start, NULL);
+
+	return err;
+}
@@ -0,0 +1,36 @@
+#ifndef __LIBINSANE_NORMALIZERS_REDUCE_COLORS_H
+#define __LIBINSANE_NORMALIZERS_REDUCE_COLORS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * \brief Convert RGB pixels to grayscale (ITU-R BT.601 weights:
+ * Y = 0.299 R + 0.587 G + 0.114 B, in 8.8 fixed point).
+ *
+ * Input and output must not overlap.
+ *
+ * Uses the fastest implementation available on the current CPU (see
+ * \ref reduce_colors_get_impls()).
+ */
+void rgb24_to_gray8(const uint8_t *in, uint8_t *out, size_t nb_pixels);
+
+
+typedef void (reduce_colors_gray_cb)(
+	const uint8_t *in, uint8_t *out, size_t nb_pixels
+);
+
+struct reduce_colors_impl {
+	const char *name;
+	int (*is_supported)(void);
+	reduce_colors_gray_cb *rgb24_to_gray8;
+};
+
+/**
+ * \brief All the implementations built in.
+ * Sorted from the fastest one to the reference one (scalar). NULL
+ * terminated (name == NULL). Only useful for unit tests.
+ */
+const struct reduce_colors_impl *reduce_colors_get_impls(void);
+
+#endif
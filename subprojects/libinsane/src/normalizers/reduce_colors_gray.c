@@ -0,0 +1,245 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "reduce_colors.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define REDUCE_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__ARM_NEON)
+#define REDUCE_NEON
+#include <arm_neon.h>
+#endif
+
+
+/* BT.601 luma weights, in 8.8 fixed point (77 + 150 + 29 == 256) */
+#define WEIGHT_R 77
+#define WEIGHT_G 150
+#define WEIGHT_B 29
+
+
+/* Reference implementation */
+
+static void scalar_rgb24_to_gray8(
+		const uint8_t *in, uint8_t *out, size_t nb_pixels
+	)
+{
+	size_t p;
+
+	for (p = 0 ; p < nb_pixels ; p++) {
+		out[p] = (
+			(in[p * 3] * WEIGHT_R)
+			+ (in[(p * 3) + 1] * WEIGHT_G)
+			+ (in[(p * 3) + 2] * WEIGHT_B)
+			+ 128
+		) >> 8;
+	}
+}
+
+
+static int always_supported(void)
+{
+	return 1;
+}
+
+
+#ifdef REDUCE_X86
+
+static int ssse3_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3");
+}
+
+
+static inline __m128i weighted_sum_ssse3(__m128i r, __m128i g, __m128i b)
+{
+	const __m128i wr = _mm_set1_epi16(WEIGHT_R);
+	const __m128i wg = _mm_set1_epi16(WEIGHT_G);
+	const __m128i wb = _mm_set1_epi16(WEIGHT_B);
+	const __m128i round = _mm_set1_epi16(128);
+	__m128i sum;
+
+	// at most 255 * 256 + 128: fits in 16 bits unsigned
+	sum = _mm_add_epi16(_mm_mullo_epi16(r, wr), _mm_mullo_epi16(g, wg));
+	sum = _mm_add_epi16(sum, _mm_mullo_epi16(b, wb));
+	sum = _mm_add_epi16(sum, round);
+	return _mm_srli_epi16(sum, 8);
+}
+
+
+/*
+ * 16 pixels (48 bytes, 3 registers) per iteration. Each color component is
+ * gathered from the 3 registers with a shuffle each, and then widened to 16
+ * bits for the weighted sum.
+ */
+__attribute__((target("ssse3")))
+static void ssse3_rgb24_to_gray8(
+		const uint8_t *in, uint8_t *out, size_t nb_pixels
+	)
+{
+	const __m128i r0 = _mm_setr_epi8(
+		0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+	);
+	const __m128i r1 = _mm_setr_epi8(
+		-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1
+	);
+	const __m128i r2 = _mm_setr_epi8(
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13
+	);
+	const __m128i g0 = _mm_setr_epi8(
+		1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+	);
+	const __m128i g1 = _mm_setr_epi8(
+		-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1
+	);
+	const __m128i g2 = _mm_setr_epi8(
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14
+	);
+	const __m128i b0 = _mm_setr_epi8(
+		2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+	);
+	const __m128i b1 = _mm_setr_epi8(
+		-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1
+	);
+	const __m128i b2 = _mm_setr_epi8(
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15
+	);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a, b, c, r, g, bl, lo, hi;
+	size_t p;
+
+	for (p = 0 ; p + 16 <= nb_pixels ; p += 16) {
+		a = _mm_loadu_si128((const __m128i *)(in + (p * 3)));
+		b = _mm_loadu_si128((const __m128i *)(in + (p * 3) + 16));
+		c = _mm_loadu_si128((const __m128i *)(in + (p * 3) + 32));
+
+		r = _mm_or_si128(
+			_mm_or_si128(_mm_shuffle_epi8(a, r0), _mm_shuffle_epi8(b, r1)),
+			_mm_shuffle_epi8(c, r2)
+		);
+		g = _mm_or_si128(
+			_mm_or_si128(_mm_shuffle_epi8(a, g0), _mm_shuffle_epi8(b, g1)),
+			_mm_shuffle_epi8(c, g2)
+		);
+		bl = _mm_or_si128(
+			_mm_or_si128(_mm_shuffle_epi8(a, b0), _mm_shuffle_epi8(b, b1)),
+			_mm_shuffle_epi8(c, b2)
+		);
+
+		lo = weighted_sum_ssse3(
+			_mm_unpacklo_epi8(r, zero), _mm_unpacklo_epi8(g, zero),
+			_mm_unpacklo_epi8(bl, zero)
+		);
+		hi = weighted_sum_ssse3(
+			_mm_unpackhi_epi8(r, zero), _mm_unpackhi_epi8(g, zero),
+			_mm_unpackhi_epi8(bl, zero)
+		);
+		_mm_storeu_si128((__m128i *)(out + p), _mm_packus_epi16(lo, hi));
+	}
+
+	scalar_rgb24_to_gray8(in + (p * 3), out + p, nb_pixels - p);
+}
+
+#endif /* REDUCE_X86 */
+
+
+#ifdef REDUCE_NEON
+
+static inline uint8x8_t weighted_sum_neon(
+		uint8x8_t r, uint8x8_t g, uint8x8_t b
+	)
+{
+	uint16x8_t sum;
+
+	sum = vmull_u8(r, vdup_n_u8(WEIGHT_R));
+	sum = vmlal_u8(sum, g, vdup_n_u8(WEIGHT_G));
+	sum = vmlal_u8(sum, b, vdup_n_u8(WEIGHT_B));
+	// (sum + 128) >> 8
+	return vrshrn_n_u16(sum, 8);
+}
+
+
+static void neon_rgb24_to_gray8(
+		const uint8_t *in, uint8_t *out, size_t nb_pixels
+	)
+{
+	uint8x16x3_t rgb;
+	size_t p;
+
+	for (p = 0 ; p + 16 <= nb_pixels ; p += 16) {
+		rgb = vld3q_u8(in + (p * 3));
+		vst1q_u8(out + p, vcombine_u8(
+			weighted_sum_neon(
+				vget_low_u8(rgb.val[0]), vget_low_u8(rgb.val[1]),
+				vget_low_u8(rgb.val[2])
+			),
+			weighted_sum_neon(
+				vget_high_u8(rgb.val[0]), vget_high_u8(rgb.val[1]),
+				vget_high_u8(rgb.val[2])
+			)
+		));
+	}
+
+	scalar_rgb24_to_gray8(in + (p * 3), out + p, nb_pixels - p);
+}
+
+#endif /* REDUCE_NEON */
+
+
+static const struct reduce_colors_impl g_impls[] = {
+#ifdef REDUCE_X86
+	{
+		.name = "ssse3",
+		.is_supported = ssse3_supported,
+		.rgb24_to_gray8 = ssse3_rgb24_to_gray8,
+	},
+#endif
+#ifdef REDUCE_NEON
+	{
+		.name = "neon",
+		.is_supported = always_supported,
+		.rgb24_to_gray8 = neon_rgb24_to_gray8,
+	},
+#endif
+	{
+		.name = "scalar",
+		.is_supported = always_supported,
+		.rgb24_to_gray8 = scalar_rgb24_to_gray8,
+	},
+	{ .name = NULL },
+};
+
+
+const struct reduce_colors_impl *reduce_colors_get_impls(void)
+{
+	return g_impls;
+}
+
+
+static const struct reduce_colors_impl *get_best_impl(void)
+{
+	static const struct reduce_colors_impl *best = NULL;
+	const struct reduce_colors_impl *impl;
+
+	// harmless race: all the threads will find the same implementation
+	if (best != NULL) {
+		return best;
+	}
+
+	for (impl = g_impls ; impl->name != NULL ; impl++) {
+		if (impl->is_supported()) {
+			break;
+		}
+	}
+	best = impl;
+	return best;
+}
+
+
+void rgb24_to_gray8(const uint8_t *in, uint8_t *out, size_t nb_pixels)
+{
+	get_best_impl()->rgb24_to_gray8(in, out, nb_pixels);
+}
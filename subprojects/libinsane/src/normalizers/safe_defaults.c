@@ -430,7 +430,7 @@ static enum lis_error set_default_values(
 	)
 {
 	struct lis_option_descriptor **opts = NULL;
-	struct lis_option_descriptor **opt;
+	struct lis_option_descriptor *opt;
 	struct lis_option_descriptor *original;
 	const struct safe_setter *setter;
 	int set_flags;
@@ -467,12 +467,8 @@ static enum lis_error set_default_values(
 			set_flags = 0;
 		}
 
-		for (opt = opts ; (*opt) != NULL ; opt++) {
-			if (strcasecmp(setter->opt_name, (*opt)->name) == 0) {
-				break;
-			}
-		}
-		if ((*opt) == NULL) {
+		opt = lis_bw_item_get_option(item, setter->opt_name);
+		if (opt == NULL) {
 			lis_log_info(
 				NAME ": set_default_value(%s): Option not"
 				" found", setter->opt_name
@@ -480,7 +476,7 @@ static enum lis_error set_default_values(
 			continue;
 		}
 
-		if (lis_bw_opt_get_user_ptr(*opt) != NULL) {
+		if (lis_bw_opt_get_user_ptr(opt) != NULL) {
 			lis_log_info(
 				NAME ": set_default_value(%s): Option already"
 				" set by user app. Won't set it to default"
@@ -490,7 +486,7 @@ static enum lis_error set_default_values(
 			continue;
 		}
 
-		original = lis_bw_get_original_opt(*opt);
+		original = lis_bw_get_original_opt(opt);
 		set_flags = 0;
 		err = setter->cb(original, setter->cb_data, &set_flags);
 		if (LIS_IS_OK(err)) {
@@ -503,7 +499,7 @@ static enum lis_error set_default_values(
 				NAME ":set default_value(%s):"
 				" Failed to set option"
 				" to safe default: 0x%X, %s",
-				(*opt)->name,
+				opt->name,
 				err, lis_strerror(err)
 			);
 			// still worth trying scanning
@@ -75,6 +75,8 @@ static enum lis_error lis_sn_scan_read(
 	struct lis_scan_session *session, void *out_buffer, size_t *buffer_size
 );
 static void lis_sn_cancel(struct lis_scan_session *session);
+static int lis_sn_get_fd(struct lis_scan_session *session);
+static struct lis_scan_session *lis_sn_get_wrapped(struct lis_scan_session *session);
 
 static const struct lis_scan_session g_sn_scan_session_template = {
 	.get_scan_parameters = lis_sn_get_scan_parameters,
@@ -82,6 +84,9 @@ static const struct lis_scan_session g_sn_scan_session_template = {
 	.end_of_page = lis_sn_end_of_page,
 	.scan_read = lis_sn_scan_read,
 	.cancel = lis_sn_cancel,
+	.get_fd = lis_sn_get_fd,
+	.name = "source_nodes",
+	.get_wrapped = lis_sn_get_wrapped,
 };
 
 
@@ -519,3 +524,21 @@ static void lis_sn_cancel(struct lis_scan_session *session)
 	private->device->scan_running = 0;
 	private->wrapped->cancel(private->wrapped);
 }
+
+
+static int lis_sn_get_fd(struct lis_scan_session *session)
+{
+	struct lis_sn_scan_session_private *private = LIS_SN_SCAN_SESSION_PRIVATE(session);
+
+	if (private->wrapped->get_fd == NULL) {
+		return -1;
+	}
+	return private->wrapped->get_fd(private->wrapped);
+}
+
+
+static struct lis_scan_session *lis_sn_get_wrapped(struct lis_scan_session *session)
+{
+	struct lis_sn_scan_session_private *private = LIS_SN_SCAN_SESSION_PRIVATE(session);
+	return private->wrapped;
+}
@@ -0,0 +1,135 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libinsane/log.h>
+#include <libinsane/util.h>
+
+#include "opt_index.h"
+
+
+/* FNV-1a, on the lower-case characters */
+static uint32_t hash_name(const char *name)
+{
+	uint32_t h = 2166136261u;
+
+	for ( ; *name != '\0' ; name++) {
+		h ^= (uint8_t)tolower((unsigned char)*name);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+static enum lis_error reserve(struct lis_opt_index *index, int nb_opts)
+{
+	unsigned int table_size;
+	void *ptr;
+
+	// keep the table at most half full
+	for (table_size = 16 ; table_size < 2 * (unsigned int)nb_opts ;
+			table_size *= 2) { }
+
+	if (nb_opts > index->allocated) {
+		ptr = realloc(index->hashes, nb_opts * sizeof(*index->hashes));
+		if (ptr == NULL) {
+			lis_log_error("Out of memory");
+			return LIS_ERR_NO_MEM;
+		}
+		index->hashes = ptr;
+		index->allocated = nb_opts;
+	}
+
+	if (index->table == NULL || table_size - 1 != index->table_mask) {
+		ptr = realloc(index->table, table_size * sizeof(*index->table));
+		if (ptr == NULL) {
+			lis_log_error("Out of memory");
+			return LIS_ERR_NO_MEM;
+		}
+		index->table = ptr;
+		index->table_mask = table_size - 1;
+	}
+	memset(index->table, 0, table_size * sizeof(*index->table));
+	return LIS_OK;
+}
+
+
+enum lis_error lis_opt_index_build(
+		struct lis_opt_index *index, struct lis_option_descriptor **opts
+	)
+{
+	enum lis_error err;
+	unsigned int slot;
+	int nb_opts, i;
+
+	for (nb_opts = 0 ; opts[nb_opts] != NULL ; nb_opts++) { }
+
+	index->opts = NULL;
+	index->nb_opts = 0;
+	err = reserve(index, nb_opts);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+
+	for (i = 0 ; i < nb_opts ; i++) {
+		index->hashes[i] = hash_name(opts[i]->name);
+
+		for (slot = index->hashes[i] & index->table_mask ;
+				index->table[slot] != 0 ;
+				slot = (slot + 1) & index->table_mask) {
+			if (index->hashes[index->table[slot] - 1] == index->hashes[i]
+					&& strcasecmp(
+						opts[index->table[slot] - 1]->name,
+						opts[i]->name
+					) == 0) {
+				// duplicated name: the first one wins, like with
+				// a linear lookup
+				break;
+			}
+		}
+		if (index->table[slot] == 0) {
+			index->table[slot] = i + 1;
+		}
+	}
+
+	index->opts = opts;
+	index->nb_opts = nb_opts;
+	return LIS_OK;
+}
+
+
+struct lis_option_descriptor *lis_opt_index_find(
+		const struct lis_opt_index *index, const char *name
+	)
+{
+	uint32_t h;
+	unsigned int slot;
+	int idx;
+
+	if (index->opts == NULL) {
+		return NULL;
+	}
+
+	h = hash_name(name);
+	for (slot = h & index->table_mask ;
+			index->table[slot] != 0 ;
+			slot = (slot + 1) & index->table_mask) {
+		idx = index->table[slot] - 1;
+		if (index->hashes[idx] == h
+				&& strcasecmp(index->opts[idx]->name, name) == 0) {
+			return index->opts[idx];
+		}
+	}
+	return NULL;
+}
+
+
+void lis_opt_index_clean(struct lis_opt_index *index)
+{
+	FREE(index->hashes);
+	FREE(index->table);
+	index->opts = NULL;
+	index->nb_opts = 0;
+	index->allocated = 0;
+	index->table_mask = 0;
+}
@@ -0,0 +1,52 @@
+#ifndef __LIBINSANE_OPT_INDEX_H
+#define __LIBINSANE_OPT_INDEX_H
+
+#include <stdint.h>
+
+#include <libinsane/capi.h>
+#include <libinsane/error.h>
+
+
+/**
+ * \brief Index of option descriptors by name (case-insensitive).
+ *
+ * Hash table of the case-folded option names. Names are compared only when
+ * their hashes match.
+ *
+ * Zero-initialize it before the first call to \ref lis_opt_index_build().
+ * Must be rebuilt each time a new option list is obtained (each call to
+ * \ref lis_item.get_options()).
+ */
+struct lis_opt_index {
+	/* what has been indexed */
+	struct lis_option_descriptor **opts;
+	uint32_t *hashes;
+	int nb_opts;
+	int allocated;
+
+	/* open addressing: index in 'opts' + 1 (0 = empty slot) */
+	int *table;
+	unsigned int table_mask;
+};
+
+
+/**
+ * \brief (Re)build the index for the given NULL-terminated option list.
+ * Memory of the previous build is reused as much as possible.
+ * The option list must remain valid as long as the index is used.
+ */
+enum lis_error lis_opt_index_build(
+	struct lis_opt_index *index, struct lis_option_descriptor **opts
+);
+
+/**
+ * \return the first option with that name (case-insensitive). NULL if there
+ *   is none.
+ */
+struct lis_option_descriptor *lis_opt_index_find(
+	const struct lis_opt_index *index, const char *name
+);
+
+void lis_opt_index_clean(struct lis_opt_index *index);
+
+#endif
@@ -8,9 +8,12 @@
 #include <libinsane/multiplexer.h>
 #include <libinsane/normalizers.h>
 #include <libinsane/safebet.h>
+#include <libinsane/stats.h>
 #include <libinsane/util.h>
 #include <libinsane/workarounds.h>
 
+#include "trace_events.h"
+
 #ifdef OS_LINUX
 #include <libinsane/sane.h>
 #endif
@@ -97,6 +100,20 @@ static const struct {
 		.wrap_cb = lis_api_normalizer_resolution,
 		.enabled_by_default = 1,
 	},
+	{
+		.name = "normalizer_downscale",
+		.env = "LIBINSANE_NORMALIZER_DOWNSCALE",
+		.wrap_cb = lis_api_normalizer_downscale,
+		.enabled_by_default = 0,
+	},
+	{
+		// after downscale: averaging before thresholding gives better
+		// results
+		.name = "normalizer_reduce_colors",
+		.env = "LIBINSANE_NORMALIZER_REDUCE_COLORS",
+		.wrap_cb = lis_api_normalizer_reduce_colors,
+		.enabled_by_default = 0,
+	},
 	{
 		.name = "normalizer_clean_dev_descs",
 		.env = "LIBINSANE_NORMALIZER_CLEAN_DEV_DESCS",
@@ -145,6 +162,13 @@ static const struct {
 		.wrap_cb = lis_api_normalizer_all_opts_on_all_sources,
 		.enabled_by_default = 1,
 	},
+	{
+		.name = "workaround_readahead",
+		.env = "LIBINSANE_WORKAROUND_READAHEAD",
+		.wrap_cb = lis_api_workaround_readahead,
+		// on Linux, the dedicated process already reads ahead
+		.enabled_by_default = 0,
+	},
 #ifdef OS_LINUX
 	{	// dedicated process wrapper ensure thread-safety and therefore
 		// should be loaded last
@@ -153,6 +177,12 @@ static const struct {
 		.wrap_cb = lis_api_workaround_dedicated_process,
 		.enabled_by_default = 1,
 	},
+	{	// must wrap a thread-safe implementation
+		.name = "workaround_disk_cache",
+		.env = "LIBINSANE_WORKAROUND_DISK_CACHE",
+		.wrap_cb = lis_api_workaround_disk_cache,
+		.enabled_by_default = 0,
+	},
 #endif
 	{	// dedicated thread wrapper should be loaded last
 		.name = "workaround_dedicated_thread",
@@ -175,6 +205,7 @@ enum lis_error lis_safebet(struct lis_api **out_impls)
 	struct lis_api *next;
 	size_t i;
 	int env;
+	int stats;
 
 	*out_impls = NULL;
 
@@ -224,6 +255,16 @@ enum lis_error lis_safebet(struct lis_api **out_impls)
 
 	lis_log_info("%d base implementations initialized", nb_impls);
 
+	// the tracer records the calls through the instrumentation layers too
+	stats = lis_getenv("LIBINSANE_STATS", 0) || lis_trace_enabled();
+	if (stats) {
+		err = lis_api_stats(*out_impls, &next, "base");
+		if (LIS_IS_ERROR(err)) {
+			goto error;
+		}
+		*out_impls = next;
+	}
+
 	lis_log_info("Initializing workarounds & normalizers ...");
 	nb_impls = 0;
 	for (i = 0 ; i < LIS_COUNT_OF(g_implementations) ; i++) {
@@ -238,6 +279,16 @@ enum lis_error lis_safebet(struct lis_api **out_impls)
 			}
 			*out_impls = next;
 			nb_impls++;
+
+			if (stats) {
+				err = lis_api_stats(
+					*out_impls, &next, g_implementations[i].name
+				);
+				if (LIS_IS_ERROR(err)) {
+					goto error;
+				}
+				*out_impls = next;
+			}
 		}
 	}
 	lis_log_info("%d workarounds & normalizers initialized", nb_impls);
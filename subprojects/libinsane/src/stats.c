@@ -0,0 +1,1059 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libinsane/log.h>
+#include <libinsane/stats.h>
+#include <libinsane/util.h>
+
+#include "trace_events.h"
+
+
+#define LIS_LOCK(mutex) do { \
+		int __pthread_r; \
+		__pthread_r = pthread_mutex_lock(mutex); \
+		assert(__pthread_r == 0); \
+	} while(0)
+
+#define LIS_UNLOCK(mutex) do { \
+		int __pthread_r; \
+		__pthread_r = pthread_mutex_unlock(mutex); \
+		assert(__pthread_r == 0); \
+	} while(0)
+
+
+enum stats_op {
+	STATS_LIST_DEVICES = 0,
+	STATS_GET_DEVICE,
+	STATS_GET_OPTIONS,
+	STATS_GET_VALUE,
+	STATS_SET_VALUE,
+	STATS_SET_VALUES,
+	STATS_SCAN_START,
+	STATS_SCAN_READ,
+};
+#define STATS_NB_OPS (STATS_SCAN_READ + 1)
+
+
+static const char *g_op_names[STATS_NB_OPS] = {
+	[STATS_LIST_DEVICES] = "list_devices",
+	[STATS_GET_DEVICE] = "get_device",
+	[STATS_GET_OPTIONS] = "get_options",
+	[STATS_GET_VALUE] = "get_value",
+	[STATS_SET_VALUE] = "set_value",
+	[STATS_SET_VALUES] = "set_values",
+	[STATS_SCAN_START] = "scan_start",
+	[STATS_SCAN_READ] = "scan_read",
+};
+
+
+/* only updated with __atomic builtins */
+struct stats_counter {
+	uint64_t calls;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t bytes;
+};
+
+
+struct stats_impl_private {
+	struct lis_api parent;
+	struct lis_api *wrapped;
+
+	char *layer_name;
+	struct stats_counter counters[STATS_NB_OPS];
+
+	struct stats_impl_private *next; // g_layers
+};
+#define STATS_IMPL_PRIVATE(impl) ((struct stats_impl_private *)(impl))
+
+
+struct stats_opt_private {
+	struct lis_option_descriptor parent;
+	struct lis_option_descriptor *wrapped;
+	struct stats_impl_private *impl;
+	int taken; // stats_get_options() only
+};
+#define STATS_OPT_PRIVATE(opt) ((struct stats_opt_private *)(opt))
+
+
+struct stats_item_private {
+	struct lis_item parent;
+	struct lis_item *wrapped;
+	struct stats_impl_private *impl;
+
+	/* wrappers are allocated one by one and reused as long as the wrapped
+	 * item or option is still there: other layers may keep pointers to
+	 * them */
+	struct stats_item_private **children;
+	struct lis_item **children_ptrs;
+	int nb_children;
+
+	struct stats_opt_private **opts;
+	struct lis_option_descriptor **opts_ptrs;
+	int nb_opts;
+
+	struct stats_session_private *session;
+
+	int taken; // stats_get_children() only
+};
+#define STATS_ITEM_PRIVATE(item) ((struct stats_item_private *)(item))
+
+
+struct stats_session_private {
+	struct lis_scan_session parent;
+	struct lis_scan_session *wrapped;
+	struct stats_item_private *item;
+};
+#define STATS_SESSION_PRIVATE(session) ((struct stats_session_private *)(session))
+
+
+static void stats_cleanup(struct lis_api *impl);
+static enum lis_error stats_list_devices(
+	struct lis_api *impl, enum lis_device_locations locs,
+	struct lis_device_descriptor ***dev_infos
+);
+static enum lis_error stats_get_device(
+	struct lis_api *impl, const char *dev_id, struct lis_item **item
+);
+
+static struct lis_api g_impl_template = {
+	.cleanup = stats_cleanup,
+	.list_devices = stats_list_devices,
+	.get_device = stats_get_device,
+};
+
+
+static enum lis_error stats_get_children(
+	struct lis_item *self, struct lis_item ***children
+);
+static enum lis_error stats_get_options(
+	struct lis_item *self, struct lis_option_descriptor ***descs
+);
+static enum lis_error stats_scan_start(
+	struct lis_item *self, struct lis_scan_session **session
+);
+static void stats_root_close(struct lis_item *self);
+static void stats_child_close(struct lis_item *self);
+static enum lis_error stats_set_values(
+	struct lis_item *self, int nb_values,
+	struct lis_option_descriptor **opts, const union lis_value *values,
+	int *set_flags, int *nb_set
+);
+
+static struct lis_item g_item_root_template = {
+	.get_children = stats_get_children,
+	.get_options = stats_get_options,
+	.scan_start = stats_scan_start,
+	.close = stats_root_close,
+};
+
+static struct lis_item g_item_child_template = {
+	.get_children = stats_get_children,
+	.get_options = stats_get_options,
+	.scan_start = stats_scan_start,
+	.close = stats_child_close,
+};
+
+
+static enum lis_error stats_get_value(
+	struct lis_option_descriptor *self, union lis_value *value
+);
+static enum lis_error stats_set_value(
+	struct lis_option_descriptor *self, union lis_value value,
+	int *set_flags
+);
+
+
+static enum lis_error stats_get_scan_parameters(
+	struct lis_scan_session *self, struct lis_scan_parameters *params
+);
+static int stats_end_of_feed(struct lis_scan_session *self);
+static int stats_end_of_page(struct lis_scan_session *self);
+static enum lis_error stats_scan_read(
+	struct lis_scan_session *self, void *out_buffer, size_t *bufsize
+);
+static void stats_cancel(struct lis_scan_session *self);
+static int stats_get_fd(struct lis_scan_session *self);
+static struct lis_scan_session *stats_get_wrapped(struct lis_scan_session *self);
+
+static struct lis_scan_session g_scan_session_template = {
+	.get_scan_parameters = stats_get_scan_parameters,
+	.end_of_feed = stats_end_of_feed,
+	.end_of_page = stats_end_of_page,
+	.scan_read = stats_scan_read,
+	.cancel = stats_cancel,
+	.get_fd = stats_get_fd,
+	.name = "stats",
+	.get_wrapped = stats_get_wrapped,
+};
+
+
+/* for lis_stats_dump() and lis_stats_reset(). Only protects the list
+ * itself, not the counters */
+static pthread_mutex_t g_layers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_impl_private *g_layers = NULL;
+
+
+static void record(
+		struct stats_impl_private *impl, enum stats_op op,
+		uint64_t start, enum lis_error err, size_t bytes
+	)
+{
+	struct stats_counter *counter = &impl->counters[op];
+	uint64_t end = lis_trace_now();
+	uint64_t duration = end - start;
+	uint64_t max;
+
+	if (lis_trace_enabled()) {
+		lis_trace_call(
+			impl->layer_name, g_op_names[op], start, end, err, bytes
+		);
+	}
+
+	__atomic_add_fetch(&counter->calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&counter->total_ns, duration, __ATOMIC_RELAXED);
+	if (bytes > 0) {
+		__atomic_add_fetch(&counter->bytes, bytes, __ATOMIC_RELAXED);
+	}
+
+	max = __atomic_load_n(&counter->max_ns, __ATOMIC_RELAXED);
+	while (duration > max) {
+		// on failure, 'max' is updated with the current value
+		if (__atomic_compare_exchange_n(
+					&counter->max_ns, &max, duration,
+					1 /* weak */,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED
+				)) {
+			break;
+		}
+	}
+}
+
+
+/**
+ * \brief Calls that are not counted, but that are useful on a timeline.
+ */
+static void trace_only(
+		struct stats_impl_private *impl, const char *name,
+		uint64_t start, enum lis_error err
+	)
+{
+	if (lis_trace_enabled()) {
+		lis_trace_call(
+			impl->layer_name, name, start, lis_trace_now(), err, 0
+		);
+	}
+}
+
+
+static void read_counter(
+		const struct stats_counter *counter, struct stats_counter *out
+	)
+{
+	out->calls = __atomic_load_n(&counter->calls, __ATOMIC_RELAXED);
+	out->total_ns = __atomic_load_n(&counter->total_ns, __ATOMIC_RELAXED);
+	out->max_ns = __atomic_load_n(&counter->max_ns, __ATOMIC_RELAXED);
+	out->bytes = __atomic_load_n(&counter->bytes, __ATOMIC_RELAXED);
+}
+
+
+static void reset_counters(struct stats_impl_private *impl)
+{
+	int op;
+
+	for (op = 0 ; op < STATS_NB_OPS ; op++) {
+		__atomic_store_n(&impl->counters[op].calls, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&impl->counters[op].total_ns, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&impl->counters[op].max_ns, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&impl->counters[op].bytes, 0, __ATOMIC_RELAXED);
+	}
+}
+
+
+static void log_counters(struct stats_impl_private *impl)
+{
+	struct stats_counter counter;
+	int op;
+
+	for (op = 0 ; op < STATS_NB_OPS ; op++) {
+		read_counter(&impl->counters[op], &counter);
+		if (counter.calls <= 0) {
+			continue;
+		}
+		lis_log_info(
+			"stats: %s: %s: %"PRIu64" calls, total %"PRIu64"us,"
+			" max %"PRIu64"us, %"PRIu64" bytes",
+			impl->layer_name, g_op_names[op], counter.calls,
+			counter.total_ns / 1000, counter.max_ns / 1000,
+			counter.bytes
+		);
+	}
+}
+
+
+static void stats_cleanup(struct lis_api *impl)
+{
+	struct stats_impl_private *private = STATS_IMPL_PRIVATE(impl);
+	struct stats_impl_private **layer;
+
+	log_counters(private);
+
+	LIS_LOCK(&g_layers_mutex);
+	for (layer = &g_layers ; *layer != NULL ; layer = &(*layer)->next) {
+		if (*layer == private) {
+			*layer = private->next;
+			break;
+		}
+	}
+	LIS_UNLOCK(&g_layers_mutex);
+
+	private->wrapped->cleanup(private->wrapped);
+	FREE(private->layer_name);
+	FREE(private);
+
+	lis_trace_flush();
+}
+
+
+static enum lis_error stats_list_devices(
+		struct lis_api *impl, enum lis_device_locations locs,
+		struct lis_device_descriptor ***dev_infos
+	)
+{
+	struct stats_impl_private *private = STATS_IMPL_PRIVATE(impl);
+	uint64_t start = lis_trace_now();
+	enum lis_error err;
+
+	err = private->wrapped->list_devices(private->wrapped, locs, dev_infos);
+	record(private, STATS_LIST_DEVICES, start, err, 0);
+	return err;
+}
+
+
+static void wrap_item(
+		struct stats_item_private *item, struct lis_item *to_wrap,
+		struct stats_impl_private *impl
+	)
+{
+	item->wrapped = to_wrap;
+	item->impl = impl;
+	item->parent.name = to_wrap->name;
+	item->parent.type = to_wrap->type;
+	// optional: only provided if the wrapped item provides it
+	item->parent.set_values = (
+		to_wrap->set_values != NULL ? stats_set_values : NULL
+	);
+}
+
+
+static enum lis_error stats_get_device(
+		struct lis_api *impl, const char *dev_id, struct lis_item **item
+	)
+{
+	struct stats_impl_private *private = STATS_IMPL_PRIVATE(impl);
+	struct stats_item_private *root;
+	struct lis_item *wrapped;
+	uint64_t start = lis_trace_now();
+	enum lis_error err;
+
+	err = private->wrapped->get_device(private->wrapped, dev_id, &wrapped);
+	record(private, STATS_GET_DEVICE, start, err, 0);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+
+	root = calloc(1, sizeof(struct stats_item_private));
+	if (root == NULL) {
+		lis_log_error("Out of memory");
+		wrapped->close(wrapped);
+		return LIS_ERR_NO_MEM;
+	}
+	memcpy(&root->parent, &g_item_root_template, sizeof(root->parent));
+	wrap_item(root, wrapped, private);
+
+	*item = &root->parent;
+	return err;
+}
+
+
+static void free_item(struct stats_item_private *item);
+
+
+static void free_children(struct stats_item_private **children, int nb_children)
+{
+	int i;
+
+	for (i = 0 ; i < nb_children ; i++) {
+		free_item(children[i]);
+		FREE(children[i]);
+	}
+}
+
+
+static void free_opts(struct stats_opt_private **opts, int nb_opts)
+{
+	int i;
+
+	for (i = 0 ; i < nb_opts ; i++) {
+		FREE(opts[i]);
+	}
+}
+
+
+static void free_item(struct stats_item_private *item)
+{
+	free_children(item->children, item->nb_children);
+	FREE(item->children);
+	FREE(item->children_ptrs);
+	free_opts(item->opts, item->nb_opts);
+	FREE(item->opts);
+	FREE(item->opts_ptrs);
+	FREE(item->session);
+}
+
+
+/**
+ * \brief Wrapped item returned the same children, in the same order, as the
+ * last time: the previous list can be returned again.
+ */
+static int same_children(
+		struct stats_item_private *item, struct lis_item **to_wrap,
+		int nb_children
+	)
+{
+	int i;
+
+	if (item->children == NULL || item->nb_children != nb_children) {
+		return 0;
+	}
+	for (i = 0 ; i < nb_children ; i++) {
+		if (item->children[i]->wrapped != to_wrap[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+static struct stats_item_private *take_child(
+		struct stats_item_private *item, int hint, struct lis_item *wrapped
+	)
+{
+	int i;
+
+	// most of the time, we get the same children in the same order
+	if (hint < item->nb_children && !item->children[hint]->taken
+			&& item->children[hint]->wrapped == wrapped) {
+		item->children[hint]->taken = 1;
+		return item->children[hint];
+	}
+	for (i = 0 ; i < item->nb_children ; i++) {
+		if (!item->children[i]->taken
+				&& item->children[i]->wrapped == wrapped) {
+			item->children[i]->taken = 1;
+			return item->children[i];
+		}
+	}
+	return NULL;
+}
+
+
+static enum lis_error stats_get_children(
+		struct lis_item *self, struct lis_item ***out_children
+	)
+{
+	struct stats_item_private *private = STATS_ITEM_PRIVATE(self);
+	struct stats_item_private **children;
+	struct lis_item **children_ptrs;
+	struct lis_item **to_wrap;
+	int nb_children, i;
+	uint64_t start = lis_trace_now();
+	enum lis_error err;
+
+	err = private->wrapped->get_children(private->wrapped, &to_wrap);
+	trace_only(private->impl, "get_children", start, err);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+
+	for (nb_children = 0 ; to_wrap[nb_children] != NULL ; nb_children++) { }
+
+	if (same_children(private, to_wrap, nb_children)) {
+		for (i = 0 ; i < nb_children ; i++) {
+			wrap_item(private->children[i], to_wrap[i], private->impl);
+		}
+		*out_children = private->children_ptrs;
+		return err;
+	}
+
+	children = calloc(nb_children + 1, sizeof(struct stats_item_private *));
+	children_ptrs = calloc(nb_children + 1, sizeof(struct lis_item *));
+	if (children == NULL || children_ptrs == NULL) {
+		FREE(children);
+		FREE(children_ptrs);
+		lis_log_error("Out of memory");
+		return LIS_ERR_NO_MEM;
+	}
+
+	for (i = 0 ; i < nb_children ; i++) {
+		children[i] = take_child(private, i, to_wrap[i]);
+		if (children[i] != NULL) {
+			continue;
+		}
+		children[i] = calloc(1, sizeof(struct stats_item_private));
+		if (children[i] == NULL) {
+			lis_log_error("Out of memory");
+			for (i-- ; i >= 0 ; i--) {
+				if (children[i]->taken) {
+					children[i]->taken = 0;
+				} else {
+					FREE(children[i]);
+				}
+			}
+			FREE(children);
+			FREE(children_ptrs);
+			return LIS_ERR_NO_MEM;
+		}
+		memcpy(
+			&children[i]->parent, &g_item_child_template,
+			sizeof(children[i]->parent)
+		);
+	}
+
+	// children that have disappeared
+	for (i = 0 ; i < private->nb_children ; i++) {
+		if (!private->children[i]->taken) {
+			free_item(private->children[i]);
+			FREE(private->children[i]);
+		}
+	}
+	FREE(private->children);
+	FREE(private->children_ptrs);
+
+	for (i = 0 ; i < nb_children ; i++) {
+		children[i]->taken = 0;
+		wrap_item(children[i], to_wrap[i], private->impl);
+		children_ptrs[i] = &children[i]->parent;
+	}
+	private->children = children;
+	private->children_ptrs = children_ptrs;
+	private->nb_children = nb_children;
+
+	*out_children = children_ptrs;
+	return err;
+}
+
+
+static void wrap_opt(
+		struct stats_opt_private *opt, struct lis_option_descriptor *to_wrap,
+		struct stats_impl_private *impl
+	)
+{
+	// the wrapped descriptor may have changed even if it is still at the
+	// same address
+	memcpy(&opt->parent, to_wrap, sizeof(opt->parent));
+	opt->parent.fn.get_value = stats_get_value;
+	opt->parent.fn.set_value = stats_set_value;
+	opt->wrapped = to_wrap;
+	opt->impl = impl;
+}
+
+
+static int same_opts(
+		struct stats_item_private *item,
+		struct lis_option_descriptor **to_wrap, int nb_opts
+	)
+{
+	int i;
+
+	if (item->opts == NULL || item->nb_opts != nb_opts) {
+		return 0;
+	}
+	for (i = 0 ; i < nb_opts ; i++) {
+		if (item->opts[i]->wrapped != to_wrap[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+static struct stats_opt_private *take_opt(
+		struct stats_item_private *item, int hint,
+		struct lis_option_descriptor *wrapped
+	)
+{
+	int i;
+
+	if (hint < item->nb_opts && !item->opts[hint]->taken
+			&& item->opts[hint]->wrapped == wrapped) {
+		item->opts[hint]->taken = 1;
+		return item->opts[hint];
+	}
+	for (i = 0 ; i < item->nb_opts ; i++) {
+		if (!item->opts[i]->taken && item->opts[i]->wrapped == wrapped) {
+			item->opts[i]->taken = 1;
+			return item->opts[i];
+		}
+	}
+	return NULL;
+}
+
+
+static enum lis_error stats_get_options(
+		struct lis_item *self, struct lis_option_descriptor ***descs
+	)
+{
+	struct stats_item_private *private = STATS_ITEM_PRIVATE(self);
+	struct stats_opt_private **opts;
+	struct lis_option_descriptor **opts_ptrs;
+	struct lis_option_descriptor **to_wrap;
+	uint64_t start = lis_trace_now();
+	int nb_opts, i;
+	enum lis_error err;
+
+	err = private->wrapped->get_options(private->wrapped, &to_wrap);
+	record(private->impl, STATS_GET_OPTIONS, start, err, 0);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+
+	for (nb_opts = 0 ; to_wrap[nb_opts] != NULL ; nb_opts++) { }
+
+	if (same_opts(private, to_wrap, nb_opts)) {
+		for (i = 0 ; i < nb_opts ; i++) {
+			wrap_opt(private->opts[i], to_wrap[i], private->impl);
+		}
+		*descs = private->opts_ptrs;
+		return err;
+	}
+
+	opts = calloc(nb_opts + 1, sizeof(struct stats_opt_private *));
+	opts_ptrs = calloc(nb_opts + 1, sizeof(struct lis_option_descriptor *));
+	if (opts == NULL || opts_ptrs == NULL) {
+		FREE(opts);
+		FREE(opts_ptrs);
+		lis_log_error("Out of memory");
+		return LIS_ERR_NO_MEM;
+	}
+
+	for (i = 0 ; i < nb_opts ; i++) {
+		opts[i] = take_opt(private, i, to_wrap[i]);
+		if (opts[i] != NULL) {
+			continue;
+		}
+		opts[i] = calloc(1, sizeof(struct stats_opt_private));
+		if (opts[i] == NULL) {
+			lis_log_error("Out of memory");
+			for (i-- ; i >= 0 ; i--) {
+				if (opts[i]->taken) {
+					opts[i]->taken = 0;
+				} else {
+					FREE(opts[i]);
+				}
+			}
+			FREE(opts);
+			FREE(opts_ptrs);
+			return LIS_ERR_NO_MEM;
+		}
+	}
+
+	// options that have disappeared
+	for (i = 0 ; i < private->nb_opts ; i++) {
+		if (!private->opts[i]->taken) {
+			FREE(private->opts[i]);
+		}
+	}
+	FREE(private->opts);
+	FREE(private->opts_ptrs);
+
+	for (i = 0 ; i < nb_opts ; i++) {
+		opts[i]->taken = 0;
+		wrap_opt(opts[i], to_wrap[i], private->impl);
+		opts_ptrs[i] = &opts[i]->parent;
+	}
+	private->opts = opts;
+	private->opts_ptrs = opts_ptrs;
+	private->nb_opts = nb_opts;
+
+	*descs = opts_ptrs;
+	return err;
+}
+
+
+static enum lis_error stats_scan_start(
+		struct lis_item *self, struct lis_scan_session **out_session
+	)
+{
+	struct stats_item_private *private = STATS_ITEM_PRIVATE(self);
+	struct stats_session_private *session;
+	uint64_t start;
+	enum lis_error err;
+
+	// previous session has reached the end of the feed without being
+	// cancelled
+	FREE(private->session);
+
+	session = calloc(1, sizeof(struct stats_session_private));
+	if (session == NULL) {
+		lis_log_error("Out of memory");
+		return LIS_ERR_NO_MEM;
+	}
+
+	start = lis_trace_now();
+	err = private->wrapped->scan_start(private->wrapped, &session->wrapped);
+	record(private->impl, STATS_SCAN_START, start, err, 0);
+	if (LIS_IS_ERROR(err)) {
+		FREE(session);
+		return err;
+	}
+
+	memcpy(
+		&session->parent, &g_scan_session_template,
+		sizeof(session->parent)
+	);
+	session->item = private;
+	private->session = session;
+
+	*out_session = &session->parent;
+	return err;
+}
+
+
+static void stats_root_close(struct lis_item *self)
+{
+	struct stats_item_private *private = STATS_ITEM_PRIVATE(self);
+
+	private->wrapped->close(private->wrapped);
+	free_item(private);
+	FREE(private);
+}
+
+
+static void stats_child_close(struct lis_item *self)
+{
+	LIS_UNUSED(self);
+	// Nothing to do
+}
+
+
+static enum lis_error stats_get_value(
+		struct lis_option_descriptor *self, union lis_value *value
+	)
+{
+	struct stats_opt_private *private = STATS_OPT_PRIVATE(self);
+	uint64_t start = lis_trace_now();
+	enum lis_error err;
+
+	err = private->wrapped->fn.get_value(private->wrapped, value);
+	record(private->impl, STATS_GET_VALUE, start, err, 0);
+	return err;
+}
+
+
+static enum lis_error stats_set_value(
+		struct lis_option_descriptor *self, union lis_value value,
+		int *set_flags
+	)
+{
+	struct stats_opt_private *private = STATS_OPT_PRIVATE(self);
+	uint64_t start = lis_trace_now();
+	enum lis_error err;
+
+	err = private->wrapped->fn.set_value(private->wrapped, value, set_flags);
+	record(private->impl, STATS_SET_VALUE, start, err, 0);
+	return err;
+}
+
+
+static enum lis_error stats_set_values(
+		struct lis_item *self, int nb_values,
+		struct lis_option_descriptor **opts, const union lis_value *values,
+		int *set_flags, int *nb_set
+	)
+{
+	struct stats_item_private *private = STATS_ITEM_PRIVATE(self);
+	struct lis_option_descriptor **wrapped_opts;
+	uint64_t start;
+	enum lis_error err;
+	int i;
+
+	wrapped_opts = calloc(nb_values, sizeof(struct lis_option_descriptor *));
+	if (wrapped_opts == NULL && nb_values > 0) {
+		lis_log_error("Out of memory");
+		*nb_set = 0;
+		return LIS_ERR_NO_MEM;
+	}
+	for (i = 0 ; i < nb_values ; i++) {
+		wrapped_opts[i] = STATS_OPT_PRIVATE(opts[i])->wrapped;
+	}
+
+	start = lis_trace_now();
+	err = private->wrapped->set_values(
+		private->wrapped, nb_values, wrapped_opts, values, set_flags,
+		nb_set
+	);
+	record(private->impl, STATS_SET_VALUES, start, err, 0);
+
+	FREE(wrapped_opts);
+	return err;
+}
+
+
+static enum lis_error stats_get_scan_parameters(
+		struct lis_scan_session *self, struct lis_scan_parameters *params
+	)
+{
+	struct stats_session_private *private = STATS_SESSION_PRIVATE(self);
+	uint64_t start = lis_trace_now();
+	enum lis_error err;
+
+	err = private->wrapped->get_scan_parameters(private->wrapped, params);
+	trace_only(private->item->impl, "get_scan_parameters", start, err);
+	return err;
+}
+
+
+static int stats_end_of_feed(struct lis_scan_session *self)
+{
+	struct stats_session_private *private = STATS_SESSION_PRIVATE(self);
+	uint64_t start = lis_trace_now();
+	int r;
+
+	r = private->wrapped->end_of_feed(private->wrapped);
+	trace_only(private->item->impl, "end_of_feed", start, LIS_OK);
+	return r;
+}
+
+
+static int stats_end_of_page(struct lis_scan_session *self)
+{
+	struct stats_session_private *private = STATS_SESSION_PRIVATE(self);
+	uint64_t start = lis_trace_now();
+	int r;
+
+	r = private->wrapped->end_of_page(private->wrapped);
+	trace_only(private->item->impl, "end_of_page", start, LIS_OK);
+	return r;
+}
+
+
+static enum lis_error stats_scan_read(
+		struct lis_scan_session *self, void *out_buffer, size_t *bufsize
+	)
+{
+	struct stats_session_private *private = STATS_SESSION_PRIVATE(self);
+	uint64_t start = lis_trace_now();
+	enum lis_error err;
+
+	err = private->wrapped->scan_read(private->wrapped, out_buffer, bufsize);
+	record(
+		private->item->impl, STATS_SCAN_READ, start, err,
+		LIS_IS_ERROR(err) ? 0 : *bufsize
+	);
+	return err;
+}
+
+
+static void stats_cancel(struct lis_scan_session *self)
+{
+	struct stats_session_private *private = STATS_SESSION_PRIVATE(self);
+	uint64_t start = lis_trace_now();
+
+	private->wrapped->cancel(private->wrapped);
+	trace_only(private->item->impl, "cancel", start, LIS_OK);
+	private->item->session = NULL;
+	FREE(private);
+}
+
+
+static int stats_get_fd(struct lis_scan_session *self)
+{
+	struct stats_session_private *private = STATS_SESSION_PRIVATE(self);
+
+	if (private->wrapped->get_fd == NULL) {
+		return -1;
+	}
+	return private->wrapped->get_fd(private->wrapped);
+}
+
+
+static struct lis_scan_session *stats_get_wrapped(struct lis_scan_session *self)
+{
+	struct stats_session_private *private = STATS_SESSION_PRIVATE(self);
+	return private->wrapped;
+}
+
+
+enum lis_error lis_api_stats(
+		struct lis_api *to_wrap, struct lis_api **out_impl,
+		const char *layer_name
+	)
+{
+	struct stats_impl_private *private;
+	struct stats_impl_private **last;
+
+	private = calloc(1, sizeof(struct stats_impl_private));
+	if (private == NULL) {
+		lis_log_error("Out of memory");
+		return LIS_ERR_NO_MEM;
+	}
+	private->layer_name = strdup(layer_name);
+	if (private->layer_name == NULL) {
+		FREE(private);
+		lis_log_error("Out of memory");
+		return LIS_ERR_NO_MEM;
+	}
+
+	memcpy(&private->parent, &g_impl_template, sizeof(private->parent));
+	private->parent.base_name = to_wrap->base_name;
+	private->wrapped = to_wrap;
+
+	LIS_LOCK(&g_layers_mutex);
+	for (last = &g_layers ; *last != NULL ; last = &(*last)->next) { }
+	*last = private;
+	LIS_UNLOCK(&g_layers_mutex);
+
+	*out_impl = &private->parent;
+	return LIS_OK;
+}
+
+
+struct stats_json {
+	char *str;
+	size_t len;
+	size_t allocated;
+	enum lis_error err;
+};
+
+
+static void json_append(struct stats_json *json, const char *fmt, ...)
+{
+	va_list ap;
+	size_t allocated;
+	char *str;
+	int r;
+
+	if (LIS_IS_ERROR(json->err)) {
+		return;
+	}
+
+	while(1) {
+		va_start(ap, fmt);
+		r = vsnprintf(
+			json->str + json->len, json->allocated - json->len,
+			fmt, ap
+		);
+		va_end(ap);
+		if (r < 0) {
+			lis_log_error("vsnprintf() failed");
+			json->err = LIS_ERR_INTERNAL_UNKNOWN_ERROR;
+			return;
+		}
+		if (json->len + (size_t)r < json->allocated) {
+			json->len += r;
+			return;
+		}
+
+		allocated = MAX(json->allocated * 2, json->len + (size_t)r + 1);
+		str = realloc(json->str, allocated);
+		if (str == NULL) {
+			lis_log_error("Out of memory");
+			json->err = LIS_ERR_NO_MEM;
+			return;
+		}
+		json->str = str;
+		json->allocated = allocated;
+	}
+}
+
+
+static void json_append_string(struct stats_json *json, const char *str)
+{
+	json_append(json, "\"");
+	for ( ; *str != '\0' ; str++) {
+		if (*str == '"' || *str == '\\') {
+			json_append(json, "\\%c", *str);
+		} else if ((unsigned char)(*str) < 0x20) {
+			json_append(json, "\\u%04x", (unsigned char)(*str));
+		} else {
+			json_append(json, "%c", *str);
+		}
+	}
+	json_append(json, "\"");
+}
+
+
+static void json_append_layer(
+		struct stats_json *json, struct stats_impl_private *layer
+	)
+{
+	struct stats_counter counter;
+	int op, first = 1;
+
+	json_append(json, "{\"name\": ");
+	json_append_string(json, layer->layer_name);
+	json_append(json, ", \"ops\": {");
+	for (op = 0 ; op < STATS_NB_OPS ; op++) {
+		read_counter(&layer->counters[op], &counter);
+		if (counter.calls <= 0) {
+			continue;
+		}
+		json_append(
+			json,
+			"%s\"%s\": {\"calls\": %"PRIu64", \"total_ns\": %"PRIu64
+			", \"max_ns\": %"PRIu64,
+			first ? "" : ", ", g_op_names[op],
+			counter.calls, counter.total_ns, counter.max_ns
+		);
+		if (op == STATS_SCAN_READ) {
+			json_append(json, ", \"bytes\": %"PRIu64, counter.bytes);
+		}
+		json_append(json, "}");
+		first = 0;
+	}
+	json_append(json, "}}");
+}
+
+
+enum lis_error lis_stats_dump(char **out_json)
+{
+	struct stats_json json = { .err = LIS_OK };
+	struct stats_impl_private *layer;
+
+	json_append(&json, "{\"layers\": [");
+	LIS_LOCK(&g_layers_mutex);
+	for (layer = g_layers ; layer != NULL ; layer = layer->next) {
+		json_append_layer(&json, layer);
+		if (layer->next != NULL) {
+			json_append(&json, ", ");
+		}
+	}
+	LIS_UNLOCK(&g_layers_mutex);
+	json_append(&json, "]}");
+
+	if (LIS_IS_ERROR(json.err)) {
+		FREE(json.str);
+		return json.err;
+	}
+	*out_json = json.str;
+	return LIS_OK;
+}
+
+
+void lis_stats_reset(void)
+{
+	struct stats_impl_private *layer;
+
+	LIS_LOCK(&g_layers_mutex);
+	for (layer = g_layers ; layer != NULL ; layer = layer->next) {
+		reset_counters(layer);
+	}
+	LIS_UNLOCK(&g_layers_mutex);
+}
@@ -6,6 +6,7 @@
 #include <libinsane/error.h>
 #include <libinsane/log.h>
 #include <libinsane/normalizers.h>
+#include <libinsane/stats.h>
 #include <libinsane/str2impls.h>
 #include <libinsane/util.h>
 #include <libinsane/workarounds.h>
@@ -25,6 +26,7 @@ enum lis_error lis_str2impls(const char *list_of_impls, struct lis_api **impls)
 	char *input_str;
 	char *save_ptr = NULL;
 	const char *tok;
+	const char *prev_tok = NULL;
 	struct lis_api *next;
 
 	lis_log_debug("enter");
@@ -64,8 +66,12 @@ enum lis_error lis_str2impls(const char *list_of_impls, struct lis_api **impls)
 		} else {
 
 			// look for a wrapper
+			// -> instrumentation of the previous layer
+			if (strcmp(tok, "stats") == 0) {
+				err = lis_api_stats(*impls, &next, prev_tok);
+			}
 			// -> normalizers
-			if (strcmp(tok, "all_opts_on_all_sources") == 0) {
+			else if (strcmp(tok, "all_opts_on_all_sources") == 0) {
 				err = lis_api_normalizer_all_opts_on_all_sources(*impls, &next);
 			} else if (strcmp(tok, "min_one_source") == 0) {
 				err = lis_api_normalizer_min_one_source(*impls, &next);
@@ -73,8 +79,12 @@ enum lis_error lis_str2impls(const char *list_of_impls, struct lis_api **impls)
 				err = lis_api_normalizer_bmp2raw(*impls, &next);
 			} else if (strcmp(tok, "raw24") == 0) {
 				err = lis_api_normalizer_raw24(*impls, &next);
+			} else if (strcmp(tok, "reduce_colors") == 0) {
+				err = lis_api_normalizer_reduce_colors(*impls, &next);
 			} else if (strcmp(tok, "resolution") == 0) {
 				err = lis_api_normalizer_resolution(*impls, &next);
+			} else if (strcmp(tok, "downscale") == 0) {
+				err = lis_api_normalizer_downscale(*impls, &next);
 			} else if (strcmp(tok, "opt_aliases") == 0) {
 				err = lis_api_normalizer_opt_aliases(*impls, &next);
 			} else if (strcmp(tok, "source_nodes") == 0) {
@@ -101,6 +111,12 @@ enum lis_error lis_str2impls(const char *list_of_impls, struct lis_api **impls)
 				err = lis_api_workaround_one_page_flatbed(*impls, &next);
 			} else if (strcmp(tok, "cache") == 0) {
 				err = lis_api_workaround_cache(*impls, &next);
+			} else if (strcmp(tok, "readahead") == 0) {
+				err = lis_api_workaround_readahead(*impls, &next);
+#ifdef OS_LINUX
+			} else if (strcmp(tok, "disk_cache") == 0) {
+				err = lis_api_workaround_disk_cache(*impls, &next);
+#endif
 			} else {
 				lis_log_error("Unknown API wrapper: %s", tok);
 				err = LIS_ERR_INTERNAL_NOT_IMPLEMENTED;
@@ -114,6 +130,7 @@ enum lis_error lis_str2impls(const char *list_of_impls, struct lis_api **impls)
 		}
 
 		*impls = next;
+		prev_tok = tok;
 	}
 
 	free(input_str);
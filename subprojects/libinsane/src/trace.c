@@ -0,0 +1,521 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libinsane/log.h>
+#include <libinsane/trace.h>
+#include <libinsane/util.h>
+
+#include "trace_events.h"
+
+
+#define TRACE_NB_EVENTS 4096 /* per thread ; must be a power of 2 */
+#define TRACE_LAYER_SIZE 48
+#define TRACE_OUT_SIZE (16 * 1024)
+#define TRACE_MAX_LINE 512
+
+
+#define LIS_LOCK(mutex) do { \
+		int __pthread_r; \
+		__pthread_r = pthread_mutex_lock(mutex); \
+		assert(__pthread_r == 0); \
+	} while(0)
+
+#define LIS_UNLOCK(mutex) do { \
+		int __pthread_r; \
+		__pthread_r = pthread_mutex_unlock(mutex); \
+		assert(__pthread_r == 0); \
+	} while(0)
+
+
+struct trace_event {
+	char phase; /* 'X': call ; 's' / 'f': flow start / end */
+	const char *name;
+	char layer[TRACE_LAYER_SIZE];
+	uint64_t start;
+	uint64_t end;
+	uint64_t id;
+	enum lis_error err;
+	size_t bytes;
+};
+
+
+/*!
+ * Single producer (the thread owning the buffer) / single consumer
+ * (lis_trace_flush(), called with g_mutex held) ring. 'head' is only
+ * written by the producer, 'tail' only by the consumer.
+ */
+struct trace_buffer {
+	struct trace_event events[TRACE_NB_EVENTS];
+	uint64_t head;
+	uint64_t tail;
+	uint64_t dropped;
+
+	int tid;
+	int orphan; /* thread has exited ; freed once flushed */
+
+	struct trace_buffer *next;
+};
+
+
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_thread_exit_key;
+
+static int g_enabled = 0;
+
+/* protects everything below */
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *g_path = NULL;
+static int g_fd = -1;
+static int g_forked = 0;
+static pid_t g_metadata_pid = 0; /* process name has been written */
+static struct trace_buffer *g_buffers = NULL;
+static int g_last_tid = 0;
+
+static __thread struct trace_buffer *g_buffer = NULL;
+
+
+uint64_t lis_trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+
+static void thread_exit(void *_buffer)
+{
+	struct trace_buffer *buffer = _buffer;
+	struct trace_buffer **prev;
+
+	LIS_LOCK(&g_mutex);
+	if (g_enabled) {
+		// events not written yet: freed by the next lis_trace_flush()
+		__atomic_store_n(&buffer->orphan, 1, __ATOMIC_RELEASE);
+	} else {
+		for (prev = &g_buffers ; *prev != NULL ; prev = &(*prev)->next) {
+			if (*prev == buffer) {
+				*prev = buffer->next;
+				break;
+			}
+		}
+		FREE(buffer);
+	}
+	LIS_UNLOCK(&g_mutex);
+}
+
+
+static void atfork_child(void)
+{
+	struct trace_buffer *buffer;
+
+	// only the thread that called fork() exists in the child process,
+	// and the mutex may be held by a thread that doesn't exist anymore.
+	// Events recorded before the fork belong to the parent process.
+	pthread_mutex_init(&g_mutex, NULL);
+	if (g_fd >= 0) {
+		close(g_fd);
+		g_fd = -1; // reopened in append mode on the next flush
+	}
+	g_forked = 1;
+	for (buffer = g_buffers ; buffer != NULL ; buffer = buffer->next) {
+		buffer->tail = buffer->head;
+		buffer->dropped = 0;
+		if (buffer != g_buffer) {
+			buffer->orphan = 1;
+		}
+	}
+}
+
+
+static enum lis_error open_output(int truncate)
+{
+	static const char header[] = "[\n";
+	ssize_t r;
+
+	g_fd = open(
+		g_path, O_WRONLY | O_CREAT | O_APPEND | (truncate ? O_TRUNC : 0),
+		0644
+	);
+	if (g_fd < 0) {
+		lis_log_error(
+			"Failed to open '%s': %d, %s", g_path, errno, strerror(errno)
+		);
+		return LIS_ERR_IO_ERROR;
+	}
+	if (truncate) {
+		r = write(g_fd, header, strlen(header));
+		if (r < (ssize_t)strlen(header)) {
+			lis_log_error(
+				"Failed to write '%s': %d, %s",
+				g_path, errno, strerror(errno)
+			);
+			return LIS_ERR_IO_ERROR;
+		}
+	}
+	return LIS_OK;
+}
+
+
+/* must be called with g_mutex held */
+static enum lis_error start(const char *path)
+{
+	enum lis_error err;
+
+	if (g_fd >= 0) {
+		close(g_fd);
+		g_fd = -1;
+	}
+	FREE(g_path);
+
+	g_path = strdup(path);
+	if (g_path == NULL) {
+		lis_log_error("Out of memory");
+		return LIS_ERR_NO_MEM;
+	}
+	g_metadata_pid = 0;
+
+	err = open_output(1 /* truncate */);
+	if (LIS_IS_ERROR(err)) {
+		FREE(g_path);
+		return err;
+	}
+	lis_log_info("Recording trace in '%s'", g_path);
+	__atomic_store_n(&g_enabled, 1, __ATOMIC_RELAXED);
+	return LIS_OK;
+}
+
+
+static void init(void)
+{
+	const char *path;
+	int r;
+
+	r = pthread_key_create(&g_thread_exit_key, thread_exit);
+	assert(r == 0);
+	pthread_atfork(NULL, NULL, atfork_child);
+
+	path = getenv("LIBINSANE_TRACE");
+	if (path != NULL && path[0] != '\0') {
+		LIS_LOCK(&g_mutex);
+		start(path);
+		LIS_UNLOCK(&g_mutex);
+	}
+}
+
+
+int lis_trace_enabled(void)
+{
+	pthread_once(&g_once, init);
+	return __atomic_load_n(&g_enabled, __ATOMIC_RELAXED);
+}
+
+
+static struct trace_buffer *get_buffer(void)
+{
+	struct trace_buffer *buffer = g_buffer;
+
+	if (buffer != NULL) {
+		return buffer;
+	}
+
+	buffer = calloc(1, sizeof(struct trace_buffer));
+	if (buffer == NULL) {
+		lis_log_error("Out of memory");
+		return NULL;
+	}
+
+	LIS_LOCK(&g_mutex);
+	buffer->tid = ++g_last_tid;
+	buffer->next = g_buffers;
+	g_buffers = buffer;
+	LIS_UNLOCK(&g_mutex);
+
+	pthread_setspecific(g_thread_exit_key, buffer);
+	g_buffer = buffer;
+	return buffer;
+}
+
+
+/*!
+ * \retval NULL buffer is full: event is dropped.
+ */
+static struct trace_event *event_get(struct trace_buffer **out_buffer)
+{
+	struct trace_buffer *buffer;
+	uint64_t tail;
+
+	if (!__atomic_load_n(&g_enabled, __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+	buffer = get_buffer();
+	if (buffer == NULL) {
+		return NULL;
+	}
+	tail = __atomic_load_n(&buffer->tail, __ATOMIC_ACQUIRE);
+	if (buffer->head - tail >= TRACE_NB_EVENTS) {
+		__atomic_add_fetch(&buffer->dropped, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	*out_buffer = buffer;
+	return &buffer->events[buffer->head & (TRACE_NB_EVENTS - 1)];
+}
+
+
+static void event_commit(struct trace_buffer *buffer)
+{
+	__atomic_store_n(&buffer->head, buffer->head + 1, __ATOMIC_RELEASE);
+}
+
+
+void lis_trace_call(
+		const char *layer, const char *name, uint64_t start, uint64_t end,
+		enum lis_error err, size_t bytes
+	)
+{
+	struct trace_buffer *buffer;
+	struct trace_event *event;
+	int i;
+
+	event = event_get(&buffer);
+	if (event == NULL) {
+		return;
+	}
+
+	event->phase = 'X';
+	event->name = name;
+	// the layer may be gone when the events are written
+	for (i = 0 ; i < TRACE_LAYER_SIZE - 1 && layer[i] != '\0' ; i++) {
+		// no escaping when writing the events
+		event->layer[i] = ((layer[i] == '"' || layer[i] == '\\') ? '_' : layer[i]);
+	}
+	event->layer[i] = '\0';
+	event->start = start;
+	event->end = end;
+	event->err = err;
+	event->bytes = bytes;
+
+	event_commit(buffer);
+}
+
+
+void lis_trace_flow(const char *name, uint64_t id, int end, uint64_t ts)
+{
+	struct trace_buffer *buffer;
+	struct trace_event *event;
+
+	event = event_get(&buffer);
+	if (event == NULL) {
+		return;
+	}
+
+	event->phase = (end ? 'f' : 's');
+	event->name = name;
+	event->layer[0] = '\0';
+	event->start = ts;
+	event->id = id;
+
+	event_commit(buffer);
+}
+
+
+static int format_event(
+		char *out, size_t out_size, const struct trace_event *event,
+		int pid, int tid
+	)
+{
+	uint64_t dur;
+	int r;
+
+	if (event->phase != 'X') {
+		return snprintf(
+			out, out_size,
+			"{\"ph\": \"%c\", \"name\": \"%s\", \"cat\": \"ipc\","
+			" \"id\": %"PRIu64",%s \"ts\": %"PRIu64".%03u,"
+			" \"pid\": %d, \"tid\": %d},\n",
+			event->phase, event->name, event->id,
+			(event->phase == 'f' ? " \"bp\": \"e\"," : ""),
+			event->start / 1000, (unsigned)(event->start % 1000),
+			pid, tid
+		);
+	}
+
+	dur = event->end - event->start;
+	r = snprintf(
+		out, out_size,
+		"{\"ph\": \"X\", \"name\": \"%s: %s\", \"cat\": \"libinsane\","
+		" \"ts\": %"PRIu64".%03u, \"dur\": %"PRIu64".%03u,"
+		" \"pid\": %d, \"tid\": %d, \"args\": {",
+		event->layer, event->name,
+		event->start / 1000, (unsigned)(event->start % 1000),
+		dur / 1000, (unsigned)(dur % 1000),
+		pid, tid
+	);
+	if (event->err != LIS_OK) {
+		r += snprintf(
+			out + r, out_size - r, "\"err\": \"%s\"%s",
+			lis_strerror(event->err), (event->bytes > 0 ? ", " : "")
+		);
+	}
+	if (event->bytes > 0) {
+		r += snprintf(
+			out + r, out_size - r, "\"bytes\": %lu",
+			(unsigned long)event->bytes
+		);
+	}
+	r += snprintf(out + r, out_size - r, "}},\n");
+	return r;
+}
+
+
+static enum lis_error write_out(const char *out, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = write(g_fd, out, len);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			lis_log_error(
+				"Failed to write '%s': %d, %s",
+				g_path, errno, strerror(errno)
+			);
+			return LIS_ERR_IO_ERROR;
+		}
+		out += r;
+		len -= r;
+	}
+	return LIS_OK;
+}
+
+
+enum lis_error lis_trace_flush(void)
+{
+	struct trace_buffer **buffer;
+	struct trace_buffer *to_free;
+	struct trace_event *event;
+	uint64_t head, tail, dropped;
+	char out[TRACE_OUT_SIZE];
+	size_t len = 0;
+	int pid = (int)getpid();
+	enum lis_error err = LIS_OK;
+
+	if (!lis_trace_enabled()) {
+		return LIS_OK;
+	}
+
+	LIS_LOCK(&g_mutex);
+
+	if (g_fd < 0) {
+		// we are in a process forked after the trace has started
+		err = open_output(0 /* !truncate */);
+		if (LIS_IS_ERROR(err)) {
+			goto end;
+		}
+	}
+
+	if (g_metadata_pid != pid) {
+		len += snprintf(
+			out + len, sizeof(out) - len,
+			"{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": %d,"
+			" \"args\": {\"name\": \"%s\"}},\n",
+			pid, (g_forked ? "libinsane worker" : "libinsane")
+		);
+		g_metadata_pid = pid;
+	}
+
+	for (buffer = &g_buffers ; *buffer != NULL ; ) {
+		head = __atomic_load_n(&(*buffer)->head, __ATOMIC_ACQUIRE);
+		for (tail = (*buffer)->tail ; tail != head ; tail++) {
+			if (sizeof(out) - len < TRACE_MAX_LINE) {
+				err = write_out(out, len);
+				len = 0;
+				if (LIS_IS_ERROR(err)) {
+					goto end;
+				}
+			}
+			event = &(*buffer)->events[tail & (TRACE_NB_EVENTS - 1)];
+			len += format_event(
+				out + len, sizeof(out) - len, event,
+				pid, (*buffer)->tid
+			);
+			// the slot can be reused by the producer once written
+			__atomic_store_n(&(*buffer)->tail, tail + 1, __ATOMIC_RELEASE);
+		}
+
+		dropped = __atomic_exchange_n(&(*buffer)->dropped, 0, __ATOMIC_RELAXED);
+		if (dropped > 0) {
+			lis_log_warning(
+				"Trace buffer of thread %d full: %lu events dropped",
+				(*buffer)->tid, (unsigned long)dropped
+			);
+		}
+
+		if (__atomic_load_n(&(*buffer)->orphan, __ATOMIC_ACQUIRE)) {
+			to_free = *buffer;
+			*buffer = to_free->next;
+			FREE(to_free);
+		} else {
+			buffer = &(*buffer)->next;
+		}
+	}
+
+	err = write_out(out, len);
+
+end:
+	LIS_UNLOCK(&g_mutex);
+	return err;
+}
+
+
+enum lis_error lis_trace_start(const char *path)
+{
+	enum lis_error err;
+
+	pthread_once(&g_once, init);
+
+	LIS_LOCK(&g_mutex);
+	err = start(path);
+	LIS_UNLOCK(&g_mutex);
+	return err;
+}
+
+
+void lis_trace_stop(void)
+{
+	struct trace_buffer **buffer;
+
+	lis_trace_flush();
+
+	LIS_LOCK(&g_mutex);
+	__atomic_store_n(&g_enabled, 0, __ATOMIC_RELAXED);
+	if (g_fd >= 0) {
+		close(g_fd);
+		g_fd = -1;
+	}
+	FREE(g_path);
+
+	// buffers of the other threads are freed once they exit
+	for (buffer = &g_buffers ; *buffer != NULL ; buffer = &(*buffer)->next) {
+		if (*buffer == g_buffer) {
+			*buffer = g_buffer->next;
+			pthread_setspecific(g_thread_exit_key, NULL);
+			FREE(g_buffer);
+			break;
+		}
+	}
+	LIS_UNLOCK(&g_mutex);
+}
@@ -0,0 +1,51 @@
+#ifndef __LIBINSANE_TRACE_EVENTS_H
+#define __LIBINSANE_TRACE_EVENTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libinsane/error.h>
+#include <libinsane/trace.h>
+
+
+/**
+ * \brief Monotonic clock, in nanoseconds. Same clock in all the processes
+ * (master and worker of dedicated_process).
+ */
+uint64_t lis_trace_now(void);
+
+
+/**
+ * \brief Is a trace being recorded ? Also starts recording if the
+ * environment variable LIBINSANE_TRACE is set.
+ */
+int lis_trace_enabled(void);
+
+
+/**
+ * \brief Record a call.
+ *
+ * \param[in] layer Name of the layer. Copied.
+ * \param[in] name Name of the call. Must be a static string.
+ * \param[in] err Returned value. Only LIS_OK for calls that don't return a
+ *   \ref lis_error.
+ * \param[in] bytes Bytes returned (scan_read() only).
+ */
+void lis_trace_call(
+	const char *layer, const char *name, uint64_t start, uint64_t end,
+	enum lis_error err, size_t bytes
+);
+
+
+/**
+ * \brief Link a call in a process to a call in another process.
+ *
+ * Must be recorded at a time when the call it applies to is running.
+ * The event with 'end' == 1 is the one running in the destination process.
+ *
+ * \param[in] name Must be a static string.
+ * \param[in] id Same on both sides.
+ */
+void lis_trace_flow(const char *name, uint64_t id, int end, uint64_t ts);
+
+#endif
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -7,6 +8,7 @@
 #include <libinsane/log.h>
 #include <libinsane/util.h>
 
+#include "opt_index.h"
 #include "version.h"
 
 
@@ -122,6 +124,38 @@ int lis_getenv(const char *var, int default_val)
 }
 
 
+const char *lis_scan_session_chain(
+		struct lis_scan_session *session, char *out, size_t out_size
+	)
+{
+	size_t len = 0;
+	int depth;
+
+	if (out_size == 0) {
+		return out;
+	}
+	out[0] = '\0';
+
+	// depth is limited in case of loop
+	for (depth = 0 ; session != NULL && depth < 64 ; depth++) {
+		snprintf(
+			out + len, out_size - len, "%s%s",
+			(depth > 0 ? " > " : ""),
+			(session->name != NULL ? session->name : "?")
+		);
+		len += strlen(out + len);
+		if (len + 1 >= out_size) {
+			break;
+		}
+		if (session->get_wrapped == NULL) {
+			break;
+		}
+		session = session->get_wrapped(session);
+	}
+	return out;
+}
+
+
 const char *lis_get_version(void)
 {
 	return LIBINSANE_VERSION;
@@ -184,13 +218,78 @@ void lis_hexdump(const char *prefix, const void *_data, size_t nb_bytes)
 }
 
 
+static struct lis_option_descriptor *find_option(
+		struct lis_option_descriptor **opts, const char *opt_name
+	)
+{
+	for ( ; (*opts) != NULL ; opts++) {
+		if (strcasecmp(opt_name, (*opts)->name) == 0) {
+			return *opts;
+		}
+	}
+	return NULL;
+}
+
+
+static enum lis_error parse_value(
+		const struct lis_item *item, const struct lis_option_descriptor *opt,
+		const char *opt_value, union lis_value *value
+	)
+{
+	char *endptr = NULL;
+
+	memset(value, 0, sizeof(*value));
+	switch(opt->value.type) {
+		case LIS_TYPE_BOOL:
+			if (strcmp(opt_value, "1") == 0
+					|| strcasecmp(opt_value, "true") == 0) {
+				value->boolean = 1;
+			}
+			return LIS_OK;
+		case LIS_TYPE_INTEGER:
+			value->integer = strtol(opt_value, &endptr, 10);
+			if (endptr == NULL || endptr[0] != '\0') {
+				lis_log_error(
+					"Option %s->%s expected an integer"
+					" value ('%s' is not an integer)",
+					item->name, opt->name, opt_value
+				);
+				return LIS_ERR_INVALID_VALUE;
+			}
+			return LIS_OK;
+		case LIS_TYPE_DOUBLE:
+			value->dbl = strtod(opt_value, &endptr);
+			if (endptr == NULL || endptr[0] != '\0') {
+				lis_log_error(
+					"Option %s->%s expected a double"
+					" ('%s' is not an double)",
+					item->name, opt->name, opt_value
+				);
+				return LIS_ERR_INVALID_VALUE;
+			}
+			return LIS_OK;
+		case LIS_TYPE_STRING:
+			value->string = opt_value;
+			return LIS_OK;
+		case LIS_TYPE_IMAGE_FORMAT:
+			break;
+	}
+
+	lis_log_error(
+		"%s: Setting image format option is not"
+		" supported", item->name
+	);
+	return LIS_ERR_INTERNAL_NOT_IMPLEMENTED;
+}
+
+
 enum lis_error lis_set_option(
 		struct lis_item *item, const char *opt_name,
 		const char *opt_value
 	)
 {
-	char *endptr = NULL;
 	struct lis_option_descriptor **opts;
+	struct lis_option_descriptor *opt;
 	enum lis_error err;
 	union lis_value value;
 	int set_flags = -1;
@@ -210,69 +309,207 @@ enum lis_error lis_set_option(
 		return err;
 	}
 
-	for ( ; (*opts) != NULL ; opts++) {
-		if (strcasecmp(opt_name, (*opts)->name) == 0) {
+	opt = find_option(opts, opt_name);
+	if (opt == NULL) {
+		lis_log_error("%s: Option '%s' not found", item->name, opt_name);
+		return LIS_ERR_INVALID_VALUE;
+	}
+
+	err = parse_value(item, opt, opt_value, &value);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+
+	err = opt->fn.set_value(opt, value, &set_flags);
+	if (LIS_IS_OK(err)) {
+		lis_log_info(
+			"%s: Successfully set %s=%s (flags=0x%X)",
+			item->name, opt_name, opt_value, set_flags
+		);
+	} else {
+		lis_log_error(
+			"%s: Failed to set %s=%s",
+			item->name, opt_name, opt_value
+		);
+	}
+	return err;
+}
+
+
+/**
+ * Looks up the options of the settings [first, nb_settings[ in the current
+ * option list of the item, and parses their values.
+ */
+static enum lis_error resolve_settings(
+		struct lis_item *item, const struct lis_option_setting *settings,
+		int first, int nb_settings,
+		struct lis_option_descriptor **to_set, union lis_value *values
+	)
+{
+	struct lis_option_descriptor **opts;
+	struct lis_opt_index index = { 0 };
+	enum lis_error err;
+	int i;
+
+	err = item->get_options(item, &opts);
+	if (LIS_IS_ERROR(err)) {
+		lis_log_error(
+			"%s: Failed to list options: 0x%X, %s",
+			item->name, err, lis_strerror(err)
+		);
+		return err;
+	}
+
+	// one lookup per setting: index the option names once
+	err = lis_opt_index_build(&index, opts);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+
+	for (i = first ; i < nb_settings ; i++) {
+		assert(settings[i].name != NULL);
+		assert(settings[i].value != NULL);
+
+		to_set[i] = lis_opt_index_find(&index, settings[i].name);
+		if (to_set[i] == NULL) {
+			lis_log_error(
+				"%s: Option '%s' not found",
+				item->name, settings[i].name
+			);
+			err = LIS_ERR_INVALID_VALUE;
+			break;
+		}
+		err = parse_value(item, to_set[i], settings[i].value, &values[i]);
+		if (LIS_IS_ERROR(err)) {
 			break;
 		}
 	}
 
-	if ((*opts) == NULL) {
-		lis_log_error("%s: Option '%s' not found", item->name, opt_name);
-		return LIS_ERR_INVALID_VALUE;
+	lis_opt_index_clean(&index);
+	return err;
+}
+
+
+/**
+ * Sets the given values in order, until an error or until an option
+ * requires reloading the option list (see \ref lis_item.set_values()).
+ */
+static enum lis_error set_values_batch(
+		struct lis_item *item, int nb_values,
+		struct lis_option_descriptor **to_set, const union lis_value *values,
+		int *set_flags, int *nb_set
+	)
+{
+	enum lis_error err = LIS_OK;
+	int flags;
+
+	if (item->set_values != NULL) {
+		return item->set_values(
+			item, nb_values, to_set, values, set_flags, nb_set
+		);
 	}
 
-	memset(&value, 0, sizeof(value));
-	switch((*opts)->value.type) {
-		case LIS_TYPE_BOOL:
-			if (strcmp(opt_value, "1") == 0
-					|| strcasecmp(opt_value, "true") == 0) {
-				value.boolean = 1;
-			}
+	*set_flags = 0;
+	for (*nb_set = 0 ; *nb_set < nb_values ; ) {
+		flags = 0;
+		err = to_set[*nb_set]->fn.set_value(
+			to_set[*nb_set], values[*nb_set], &flags
+		);
+		if (LIS_IS_ERROR(err)) {
 			break;
-		case LIS_TYPE_INTEGER:
-			value.integer = strtol(opt_value, &endptr, 10);
-			if (endptr == NULL || endptr[0] != '\0') {
-				lis_log_error(
-					"Option %s->%s expected an integer"
-					" value ('%s' is not an integer)",
-					item->name, opt_name, opt_value
-				);
-				return LIS_ERR_INVALID_VALUE;
-			}
+		}
+		*set_flags |= flags;
+		(*nb_set)++;
+		if (flags & LIS_SET_FLAG_MUST_RELOAD_OPTIONS) {
 			break;
-		case LIS_TYPE_DOUBLE:
-			value.dbl = strtod(opt_value, &endptr);
-			if (endptr == NULL || endptr[0] != '\0') {
-				lis_log_error(
-					"Option %s->%s expected a double"
-					" ('%s' is not an double)",
-					item->name, opt_name, opt_value
-				);
-				return LIS_ERR_INVALID_VALUE;
-			}
+		}
+	}
+	return err;
+}
+
+
+enum lis_error lis_set_options(
+		struct lis_item *item, const struct lis_option_setting *settings,
+		int nb_settings, int *set_flags
+	)
+{
+	struct lis_option_descriptor **to_set = NULL;
+	union lis_value *values = NULL;
+	enum lis_error err;
+	int flags = 0, all_flags = 0;
+	int nb_done = 0, nb_set;
+
+	assert(item != NULL);
+	assert(nb_settings >= 0);
+
+	if (set_flags != NULL) {
+		*set_flags = 0;
+	}
+	if (nb_settings <= 0) {
+		return LIS_OK;
+	}
+
+	lis_log_info("%s: Setting %d options", item->name, nb_settings);
+
+	to_set = calloc(nb_settings, sizeof(struct lis_option_descriptor *));
+	values = calloc(nb_settings, sizeof(union lis_value));
+	if (to_set == NULL || values == NULL) {
+		lis_log_error("Out of memory");
+		err = LIS_ERR_NO_MEM;
+		goto end;
+	}
+
+	// check everything before setting anything
+	err = resolve_settings(item, settings, 0, nb_settings, to_set, values);
+	if (LIS_IS_ERROR(err)) {
+		goto end;
+	}
+
+	while (1) {
+		nb_set = 0;
+		err = set_values_batch(
+			item, nb_settings - nb_done, to_set + nb_done,
+			values + nb_done, &flags, &nb_set
+		);
+		all_flags |= flags;
+		nb_done += nb_set;
+		if (LIS_IS_ERROR(err) || nb_done >= nb_settings) {
 			break;
-		case LIS_TYPE_STRING:
-			value.string = opt_value;
+		}
+		assert(flags & LIS_SET_FLAG_MUST_RELOAD_OPTIONS);
+
+		// the descriptors of the remaining options may have changed
+		lis_log_info(
+			"%s: Options must be reloaded after setting %s",
+			item->name, settings[nb_done - 1].name
+		);
+		err = resolve_settings(
+			item, settings, nb_done, nb_settings, to_set, values
+		);
+		if (LIS_IS_ERROR(err)) {
 			break;
-		case LIS_TYPE_IMAGE_FORMAT:
-			lis_log_error(
-				"%s: Setting image format option is not"
-				" supported", item->name
-			);
-			return LIS_ERR_INTERNAL_NOT_IMPLEMENTED;
+		}
 	}
 
-	err = (*opts)->fn.set_value(*opts, value, &set_flags);
 	if (LIS_IS_OK(err)) {
 		lis_log_info(
-			"%s: Successfully set %s=%s (flags=0x%X)",
-			item->name, opt_name, opt_value, set_flags
+			"%s: Successfully set %d options (flags=0x%X)",
+			item->name, nb_settings, all_flags
 		);
 	} else {
+		assert(nb_done < nb_settings);
 		lis_log_error(
-			"%s: Failed to set %s=%s",
-			item->name, opt_name, opt_value
+			"%s: Failed to set %s=%s: 0x%X, %s",
+			item->name, settings[nb_done].name, settings[nb_done].value,
+			err, lis_strerror(err)
 		);
 	}
+	if (set_flags != NULL) {
+		*set_flags = all_flags;
+	}
+
+end:
+	FREE(values);
+	FREE(to_set);
 	return err;
 }
@@ -1,12 +1,27 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <libinsane/log.h>
 #include <libinsane/workarounds.h>
 #include <libinsane/util.h>
 
+#include "cache.h"
+
+
+#ifdef OS_WINDOWS
+/* TWAIN and WIA must be called from the thread that initialized them (see
+ * workaround_dedicated_thread): the refresh thread can't call them */
+#define BACKGROUND_REFRESH_DEFAULT 0
+#else
+#define BACKGROUND_REFRESH_DEFAULT 1
+#endif
+
 
 struct cache_opt_private {
 	struct lis_option_descriptor parent;
@@ -42,11 +57,53 @@ struct cache_item_private {
 #define CACHE_ITEM_PRIVATE(item) ((struct cache_item_private *)(item))
 
 
+/* copy of a list returned by list_devices() */
+struct cache_dev_list {
+	struct lis_device_descriptor **ptrs;
+	/* replaced while the application may still be using it */
+	bool orphan;
+};
+
+
+struct cache_dev_lists {
+	enum lis_device_locations locs;
+	struct cache_dev_list *list; /* NULL if never fetched or invalidated */
+	double fetched; /* monotonic clock, in seconds */
+	/* hotplug without background refresh: the next call refreshes it */
+	bool outdated;
+	bool refresh_requested;
+	bool refreshing;
+	struct cache_dev_lists *next;
+};
+
+
 struct cache_impl_private {
 	struct lis_api parent;
 	struct lis_api *wrapped;
 
 	struct cache_item_private *devs;
+
+	int devs_ttl_ms; /* <= 0: list_devices() is not cached */
+	/* if false, stale lists are refreshed by the next list_devices(), from
+	 * the thread of the caller */
+	bool background_refresh;
+
+	/* protects the fields below */
+	pthread_mutex_t lists_mutex;
+	/* serializes list_devices() and get_device() on the wrapped
+	 * implementation. Must be locked before 'lists_mutex' */
+	pthread_mutex_t wrapped_mutex;
+
+	struct cache_dev_lists *lists;
+	struct cache_dev_list *returned; /* last list given to the application */
+
+	struct {
+		bool started;
+		bool running;
+		pthread_t thread;
+	} refresh;
+
+	struct cache_impl_private *next_instance;
 };
 #define CACHE_IMPL_PRIVATE(item) ((struct cache_impl_private *)(impl))
 
@@ -105,6 +162,23 @@ static struct lis_api g_impl_template = {
 };
 
 
+/* for lis_workaround_cache_invalidate_devices() and
+ * lis_workaround_cache_hotplug() */
+static pthread_mutex_t g_instances_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_impl_private *g_instances = NULL;
+
+
+struct cache_relay {
+	lis_cache_relay *cb;
+	void *data;
+	pid_t pid; // process that registered it
+	struct cache_relay *next;
+};
+
+static pthread_mutex_t g_relays_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_relay *g_relays = NULL;
+
+
 static void free_last_value(struct cache_opt_private *private)
 {
 	if (!private->has_last_value) {
@@ -514,15 +588,375 @@ static void cache_root_close(struct lis_item *self)
 }
 
 
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+
+static struct cache_dev_list *copy_dev_list(
+		struct lis_device_descriptor **descs
+	)
+{
+	struct cache_dev_list *list;
+	struct lis_device_descriptor *copies;
+	char *strings;
+	size_t strings_size = 0;
+	int nb_devs, i;
+
+#define STR_SIZE(str) ((str) != NULL ? strlen(str) + 1 : 0)
+	for (nb_devs = 0 ; descs[nb_devs] != NULL ; nb_devs++) {
+		strings_size += STR_SIZE(descs[nb_devs]->dev_id);
+		strings_size += STR_SIZE(descs[nb_devs]->vendor);
+		strings_size += STR_SIZE(descs[nb_devs]->model);
+		strings_size += STR_SIZE(descs[nb_devs]->type);
+	}
+#undef STR_SIZE
+
+	// a single allocation: list, pointers, descriptors and strings
+	list = calloc(
+		1, sizeof(struct cache_dev_list)
+		+ ((nb_devs + 1) * sizeof(struct lis_device_descriptor *))
+		+ (nb_devs * sizeof(struct lis_device_descriptor))
+		+ strings_size
+	);
+	if (list == NULL) {
+		lis_log_error("Out of memory");
+		return NULL;
+	}
+	list->ptrs = (struct lis_device_descriptor **)(list + 1);
+	copies = (struct lis_device_descriptor *)(list->ptrs + nb_devs + 1);
+	strings = (char *)(copies + nb_devs);
+
+#define COPY_STR(field) do { \
+		if (descs[i]->field != NULL) { \
+			copies[i].field = strings; \
+			strcpy(strings, descs[i]->field); \
+			strings += strlen(strings) + 1; \
+		} \
+	} while(0)
+
+	for (i = 0 ; i < nb_devs ; i++) {
+		COPY_STR(dev_id);
+		COPY_STR(vendor);
+		COPY_STR(model);
+		COPY_STR(type);
+		list->ptrs[i] = &copies[i];
+	}
+
+#undef COPY_STR
+
+	return list;
+}
+
+
+/*!
+ * Must be called with the lists_mutex held.
+ */
+static void release_dev_list(
+		struct cache_impl_private *private, struct cache_dev_list *list
+	)
+{
+	if (list == NULL) {
+		return;
+	}
+	if (list == private->returned) {
+		// freed on the next call to list_devices()
+		list->orphan = true;
+		return;
+	}
+	FREE(list);
+}
+
+
+static enum lis_error fetch_dev_list(
+		struct cache_impl_private *private, enum lis_device_locations locs,
+		struct cache_dev_list **out
+	)
+{
+	struct lis_device_descriptor **descs;
+	enum lis_error err;
+
+	pthread_mutex_lock(&private->wrapped_mutex);
+	err = private->wrapped->list_devices(private->wrapped, locs, &descs);
+	if (LIS_IS_OK(err)) {
+		*out = copy_dev_list(descs);
+		if (*out == NULL) {
+			err = LIS_ERR_NO_MEM;
+		}
+	}
+	pthread_mutex_unlock(&private->wrapped_mutex);
+	return err;
+}
+
+
+static void *refresh_thread(void *_private)
+{
+	struct cache_impl_private *private = _private;
+	struct cache_dev_lists *lists;
+	struct cache_dev_list *list = NULL;
+	enum lis_error err;
+
+	pthread_mutex_lock(&private->lists_mutex);
+	for (;;) {
+		for (lists = private->lists ; lists != NULL ; lists = lists->next) {
+			if (lists->refresh_requested) {
+				break;
+			}
+		}
+		if (lists == NULL) {
+			break;
+		}
+		lists->refresh_requested = false;
+		lists->refreshing = true;
+		pthread_mutex_unlock(&private->lists_mutex);
+
+		lis_log_info("Refreshing device list (locations=%d)", lists->locs);
+		err = fetch_dev_list(private, lists->locs, &list);
+
+		pthread_mutex_lock(&private->lists_mutex);
+		lists->refreshing = false;
+		release_dev_list(private, lists->list);
+		if (LIS_IS_OK(err)) {
+			lists->list = list;
+			lists->fetched = now();
+		} else {
+			// next call to list_devices() will report the error
+			lis_log_warning(
+				"Failed to refresh device list: 0x%X, %s",
+				err, lis_strerror(err)
+			);
+			lists->list = NULL;
+		}
+	}
+	private->refresh.running = false;
+	pthread_mutex_unlock(&private->lists_mutex);
+
+	return NULL;
+}
+
+
+/*!
+ * Must be called with the lists_mutex held.
+ */
+static void request_refresh(
+		struct cache_impl_private *private, struct cache_dev_lists *lists
+	)
+{
+	int r;
+
+	if (!private->background_refresh) {
+		lists->outdated = true;
+		return;
+	}
+	if (lists->refresh_requested || lists->refreshing) {
+		return;
+	}
+	lists->refresh_requested = true;
+
+	if (private->refresh.running) {
+		return;
+	}
+	if (private->refresh.started) {
+		// already done or about to be
+		pthread_join(private->refresh.thread, NULL);
+		private->refresh.started = false;
+	}
+
+	private->refresh.running = true;
+	r = pthread_create(
+		&private->refresh.thread, NULL, refresh_thread, private
+	);
+	if (r != 0) {
+		lis_log_warning(
+			"Failed to start device list refresh thread: %d, %s",
+			r, strerror(r)
+		);
+		private->refresh.running = false;
+		lists->refresh_requested = false;
+		// force a synchronous call on the next list_devices()
+		release_dev_list(private, lists->list);
+		lists->list = NULL;
+		return;
+	}
+	private->refresh.started = true;
+}
+
+
 static enum lis_error cache_list_devices(
 		struct lis_api *impl, enum lis_device_locations locs,
 		struct lis_device_descriptor ***dev_infos
 	)
 {
 	struct cache_impl_private *private = CACHE_IMPL_PRIVATE(impl);
-	return private->wrapped->list_devices(
-		private->wrapped, locs, dev_infos
-	);
+	struct cache_dev_lists *lists;
+	struct cache_dev_list *list = NULL;
+	enum lis_error err;
+	bool expired;
+
+	if (private->devs_ttl_ms <= 0) {
+		return private->wrapped->list_devices(
+			private->wrapped, locs, dev_infos
+		);
+	}
+
+	pthread_mutex_lock(&private->lists_mutex);
+
+	if (private->returned != NULL && private->returned->orphan) {
+		FREE(private->returned);
+	}
+	private->returned = NULL;
+
+	for (lists = private->lists ; lists != NULL ; lists = lists->next) {
+		if (lists->locs == locs) {
+			break;
+		}
+	}
+	if (lists == NULL) {
+		lists = calloc(1, sizeof(struct cache_dev_lists));
+		if (lists == NULL) {
+			lis_log_error("Out of memory");
+			pthread_mutex_unlock(&private->lists_mutex);
+			return LIS_ERR_NO_MEM;
+		}
+		lists->locs = locs;
+		lists->next = private->lists;
+		private->lists = lists;
+	}
+
+	expired = (lists->list != NULL && (
+		lists->outdated
+		|| (now() - lists->fetched) * 1000 >= private->devs_ttl_ms
+	));
+
+	if (lists->list == NULL || (expired && !private->background_refresh)) {
+		if (expired) {
+			lis_log_info("list_devices(): stale list, refreshing now");
+		}
+		pthread_mutex_unlock(&private->lists_mutex);
+		err = fetch_dev_list(private, locs, &list);
+		if (LIS_IS_ERROR(err)) {
+			lis_log_error(
+				"list_devices() failed: 0x%X, %s",
+				err, lis_strerror(err)
+			);
+			return err;
+		}
+		pthread_mutex_lock(&private->lists_mutex);
+		release_dev_list(private, lists->list);
+		lists->list = list;
+		lists->fetched = now();
+		lists->outdated = false;
+	} else if (expired) {
+		// stale-while-revalidate
+		lis_log_info("list_devices(): stale list, refreshing");
+		request_refresh(private, lists);
+	} else {
+		lis_log_info("list_devices(): using cached list");
+	}
+
+	private->returned = lists->list;
+	*dev_infos = lists->list->ptrs;
+	pthread_mutex_unlock(&private->lists_mutex);
+	return LIS_OK;
+}
+
+
+void lis_cache_add_relay(lis_cache_relay *cb, void *data)
+{
+	struct cache_relay *relay;
+
+	relay = calloc(1, sizeof(struct cache_relay));
+	if (relay == NULL) {
+		lis_log_error("Out of memory");
+		return;
+	}
+	relay->cb = cb;
+	relay->data = data;
+	relay->pid = getpid();
+
+	pthread_mutex_lock(&g_relays_mutex);
+	relay->next = g_relays;
+	g_relays = relay;
+	pthread_mutex_unlock(&g_relays_mutex);
+}
+
+
+void lis_cache_remove_relay(lis_cache_relay *cb, void *data)
+{
+	struct cache_relay **prelay, *relay;
+
+	pthread_mutex_lock(&g_relays_mutex);
+	for (prelay = &g_relays ; *prelay != NULL ; prelay = &(*prelay)->next) {
+		relay = *prelay;
+		if (relay->cb == cb && relay->data == data) {
+			*prelay = relay->next;
+			FREE(relay);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&g_relays_mutex);
+}
+
+
+static void relay_event(enum lis_cache_event event)
+{
+	struct cache_relay *relay;
+	pid_t pid = getpid();
+
+	// relays are removed only once their last call has returned
+	pthread_mutex_lock(&g_relays_mutex);
+	for (relay = g_relays ; relay != NULL ; relay = relay->next) {
+		// a forked process inherits the relays of its parent
+		if (relay->pid == pid) {
+			relay->cb(event, relay->data);
+		}
+	}
+	pthread_mutex_unlock(&g_relays_mutex);
+}
+
+
+void lis_workaround_cache_invalidate_devices(void)
+{
+	struct cache_impl_private *private;
+	struct cache_dev_lists *lists;
+
+	pthread_mutex_lock(&g_instances_mutex);
+	for (private = g_instances ; private != NULL ; private = private->next_instance) {
+		pthread_mutex_lock(&private->lists_mutex);
+		for (lists = private->lists ; lists != NULL ; lists = lists->next) {
+			release_dev_list(private, lists->list);
+			lists->list = NULL;
+		}
+		pthread_mutex_unlock(&private->lists_mutex);
+	}
+	pthread_mutex_unlock(&g_instances_mutex);
+
+	relay_event(LIS_CACHE_INVALIDATE_DEVICES);
+}
+
+
+void lis_workaround_cache_hotplug(void)
+{
+	struct cache_impl_private *private;
+	struct cache_dev_lists *lists;
+
+	pthread_mutex_lock(&g_instances_mutex);
+	for (private = g_instances ; private != NULL ; private = private->next_instance) {
+		pthread_mutex_lock(&private->lists_mutex);
+		for (lists = private->lists ; lists != NULL ; lists = lists->next) {
+			if (lists->list != NULL) {
+				request_refresh(private, lists);
+			}
+		}
+		pthread_mutex_unlock(&private->lists_mutex);
+	}
+	pthread_mutex_unlock(&g_instances_mutex);
+
+	relay_event(LIS_CACHE_HOTPLUG);
 }
 
 
@@ -561,9 +995,11 @@ static enum lis_error cache_get_device(
 	}
 	item->refcount = 1;
 
+	pthread_mutex_lock(&private->wrapped_mutex);
 	err = private->wrapped->get_device(
 		private->wrapped, dev_id, &item->wrapped
 	);
+	pthread_mutex_unlock(&private->wrapped_mutex);
 	if (LIS_IS_ERROR(err)) {
 		lis_log_error(
 			"Failed to get_device(%s): 0x%X, %s",
@@ -587,6 +1023,33 @@ static void cache_cleanup(struct lis_api *impl)
 {
 	struct cache_impl_private *private = CACHE_IMPL_PRIVATE(impl);
 	struct cache_item_private *dev, *ndev;
+	struct cache_impl_private **pinstance;
+	struct cache_dev_lists *lists;
+
+	pthread_mutex_lock(&g_instances_mutex);
+	for (pinstance = &g_instances ; *pinstance != NULL ;
+			pinstance = &(*pinstance)->next_instance) {
+		if (*pinstance == private) {
+			*pinstance = private->next_instance;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&g_instances_mutex);
+
+	if (private->refresh.started) {
+		pthread_join(private->refresh.thread, NULL);
+	}
+	if (private->returned != NULL && private->returned->orphan) {
+		FREE(private->returned);
+	}
+	while (private->lists != NULL) {
+		lists = private->lists;
+		private->lists = lists->next;
+		FREE(lists->list);
+		FREE(lists);
+	}
+	pthread_mutex_destroy(&private->wrapped_mutex);
+	pthread_mutex_destroy(&private->lists_mutex);
 
 	for (dev = private->devs, ndev = (dev != NULL ? dev->next : NULL) ;
 			dev != NULL ;
@@ -623,6 +1086,18 @@ enum lis_error lis_api_workaround_cache(
 	memcpy(&private->parent, &g_impl_template, sizeof(private->parent));
 	private->parent.base_name = to_wrap->base_name;
 	private->wrapped = to_wrap;
+	private->devs_ttl_ms = lis_getenv("LIBINSANE_WORKAROUND_CACHE_DEVICES_TTL_MS", 0);
+	private->background_refresh = lis_getenv(
+		"LIBINSANE_WORKAROUND_CACHE_BACKGROUND_REFRESH",
+		BACKGROUND_REFRESH_DEFAULT
+	);
+	pthread_mutex_init(&private->lists_mutex, NULL);
+	pthread_mutex_init(&private->wrapped_mutex, NULL);
+
+	pthread_mutex_lock(&g_instances_mutex);
+	private->next_instance = g_instances;
+	g_instances = private;
+	pthread_mutex_unlock(&g_instances_mutex);
 
 	*out_impl = &private->parent;
 	return LIS_OK;
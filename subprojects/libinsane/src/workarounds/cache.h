@@ -0,0 +1,28 @@
+#ifndef __LIBINSANE_WORKAROUND_CACHE_H
+#define __LIBINSANE_WORKAROUND_CACHE_H
+
+
+enum lis_cache_event {
+	LIS_CACHE_INVALIDATE_DEVICES = 0, // lis_workaround_cache_invalidate_devices()
+	LIS_CACHE_HOTPLUG, // lis_workaround_cache_hotplug()
+};
+
+
+typedef void (lis_cache_relay)(enum lis_cache_event event, void *data);
+
+
+/*!
+ * \brief Forward \ref lis_workaround_cache_invalidate_devices() and
+ * \ref lis_workaround_cache_hotplug() to another process.
+ *
+ * Instances of \ref lis_api_workaround_cache wrapped by
+ * \ref lis_api_workaround_dedicated_process live in the worker process.
+ * The master registers a relay so that those calls reach them too.
+ *
+ * Relays are only called in the process that registered them (not in the
+ * processes forked afterwards).
+ */
+void lis_cache_add_relay(lis_cache_relay *cb, void *data);
+void lis_cache_remove_relay(lis_cache_relay *cb, void *data);
+
+#endif
@@ -0,0 +1,379 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <libinsane/log.h>
+#include <libinsane/util.h>
+
+#include "launcher.h"
+#include "worker.h"
+
+
+#ifdef MSG_NOSIGNAL
+#define LAUNCHER_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define LAUNCHER_SEND_FLAGS 0
+#endif
+
+/* worker ends of the pipes */
+#define LAUNCHER_NB_FDS 4
+
+
+#define LIS_LOCK(mutex) do { \
+		int __pthread_r; \
+		__pthread_r = pthread_mutex_lock(mutex); \
+		assert(__pthread_r == 0); \
+	} while(0)
+
+#define LIS_UNLOCK(mutex) do { \
+		int __pthread_r; \
+		__pthread_r = pthread_mutex_unlock(mutex); \
+		assert(__pthread_r == 0); \
+	} while(0)
+
+
+struct lis_launcher
+{
+	pid_t pid;
+	int sock;
+	pthread_mutex_t mutex; // one request at a time on the socket
+};
+
+
+struct launcher_request
+{
+	int ring_idx;
+};
+
+
+struct launcher_reply
+{
+	pid_t pid; // -1 if fork() failed
+	int err; // errno
+};
+
+
+static void get_worker_fds(const struct lis_pipes *pipes, int *fds)
+{
+	fds[0] = pipes->sorted.msgs_m2w[0];
+	fds[1] = pipes->sorted.msgs_w2m[1];
+	fds[2] = pipes->sorted.logs[1];
+	fds[3] = pipes->sorted.stderr[1];
+}
+
+
+static void set_worker_fds(struct lis_pipes *pipes, const int *fds)
+{
+	unsigned int i;
+
+	for (i = 0 ; i < LIS_COUNT_OF(pipes->all) ; i++) {
+		pipes->all[i][0] = -1;
+		pipes->all[i][1] = -1;
+	}
+	pipes->sorted.msgs_m2w[0] = fds[0];
+	pipes->sorted.msgs_w2m[1] = fds[1];
+	pipes->sorted.logs[1] = fds[2];
+	pipes->sorted.stderr[1] = fds[3];
+}
+
+
+static int send_request(
+		int sock, const struct launcher_request *request, const int *fds
+	)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * LAUNCHER_NB_FDS)];
+	} control;
+	struct cmsghdr *cmsg;
+	ssize_t r;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+
+	iov.iov_base = (void *)request;
+	iov.iov_len = sizeof(*request);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * LAUNCHER_NB_FDS);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * LAUNCHER_NB_FDS);
+
+	do {
+		r = sendmsg(sock, &msg, LAUNCHER_SEND_FLAGS);
+	} while (r < 0 && errno == EINTR);
+	return (r == (ssize_t)sizeof(*request)) ? 0 : -1;
+}
+
+
+/*!
+ * \retval 0 request received
+ * \retval -1 master is gone, or invalid request
+ */
+static int recv_request(int sock, struct launcher_request *request, int *fds)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * LAUNCHER_NB_FDS)];
+	} control;
+	struct cmsghdr *cmsg;
+	ssize_t r;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+
+	iov.iov_base = request;
+	iov.iov_len = sizeof(*request);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	do {
+		r = recvmsg(sock, &msg, 0);
+	} while (r < 0 && errno == EINTR);
+	if (r != (ssize_t)sizeof(*request) || (msg.msg_flags & MSG_CTRUNC)) {
+		return -1;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL
+			|| cmsg->cmsg_level != SOL_SOCKET
+			|| cmsg->cmsg_type != SCM_RIGHTS
+			|| cmsg->cmsg_len != CMSG_LEN(sizeof(int) * LAUNCHER_NB_FDS)) {
+		return -1;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * LAUNCHER_NB_FDS);
+	return 0;
+}
+
+
+static int write_all(int fd, const void *buf, size_t count)
+{
+	ssize_t r;
+
+	while (count > 0) {
+		r = write(fd, buf, count);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			return -1;
+		}
+		buf = ((const uint8_t *)buf) + r;
+		count -= r;
+	}
+	return 0;
+}
+
+
+static int read_all(int fd, void *buf, size_t count)
+{
+	ssize_t r;
+
+	while (count > 0) {
+		r = read(fd, buf, count);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			return -1;
+		}
+		buf = ((uint8_t *)buf) + r;
+		count -= r;
+	}
+	return 0;
+}
+
+
+/*!
+ * Runs in the launcher process. Never returns. Doesn't log anything: the
+ * log callbacks are those of the application.
+ */
+static void launcher_main(
+		int sock, struct lis_api *to_wrap, struct lis_ring **rings,
+		int nb_rings
+	)
+{
+	struct launcher_request request;
+	struct launcher_reply reply;
+	struct lis_pipes pipes;
+	int fds[LAUNCHER_NB_FDS];
+	int fd, fd_limit;
+	unsigned int i;
+
+	// workers are not children of the master: it cannot wait for them.
+	// The kernel reaps them for us.
+	signal(SIGCHLD, SIG_IGN);
+
+	// only keep the socket and the standard file descriptors (workers
+	// expect the pipes to be above them). Workers close all the file
+	// descriptors they don't need anyway.
+	fd_limit = sysconf(_SC_OPEN_MAX);
+	for (fd = STDERR_FILENO + 1 ; fd < fd_limit ; fd++) {
+		if (fd != sock) {
+			close(fd);
+		}
+	}
+
+	while (recv_request(sock, &request, fds) == 0) {
+		memset(&reply, 0, sizeof(reply));
+
+		if (request.ring_idx < 0 || request.ring_idx >= nb_rings) {
+			reply.pid = -1;
+			reply.err = EINVAL;
+		} else {
+			reply.pid = fork();
+			reply.err = (reply.pid < 0 ? errno : 0);
+		}
+
+		if (reply.pid == 0) {
+			// we are the worker process
+			close(sock);
+			signal(SIGCHLD, SIG_DFL);
+			set_worker_fds(&pipes, fds);
+			lis_worker_main(
+				to_wrap, &pipes, &rings[request.ring_idx], 1
+			);
+			abort(); // lis_worker_main() must never return
+		}
+
+		for (i = 0 ; i < LIS_COUNT_OF(fds) ; i++) {
+			close(fds[i]);
+		}
+		if (write_all(sock, &reply, sizeof(reply)) < 0) {
+			break;
+		}
+	}
+
+	// master is gone. Nothing to flush: exit right away, without
+	// running the atexit() handlers of the application.
+	_exit(EXIT_SUCCESS);
+}
+
+
+enum lis_error lis_launcher_start(
+		struct lis_api *to_wrap, struct lis_ring **rings, int nb_rings,
+		struct lis_launcher **out
+	)
+{
+	struct lis_launcher *launcher;
+	int socks[2];
+	unsigned int i;
+
+	launcher = calloc(1, sizeof(struct lis_launcher));
+	if (launcher == NULL) {
+		lis_log_error("Out of memory");
+		return LIS_ERR_NO_MEM;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, socks) < 0) {
+		lis_log_error("socketpair() failed: %d, %s", errno, strerror(errno));
+		FREE(launcher);
+		return LIS_ERR_INTERNAL_UNKNOWN_ERROR;
+	}
+	for (i = 0 ; i < LIS_COUNT_OF(socks) ; i++) {
+		if (fcntl(socks[i], F_SETFD, FD_CLOEXEC) < 0) {
+			lis_log_warning(
+				"fcntl(%d, F_SETFD, FD_CLOEXEC) failed: %d, %s",
+				socks[i], errno, strerror(errno)
+			);
+		}
+	}
+
+	lis_log_info("Forking launcher ...");
+	launcher->pid = fork();
+	if (launcher->pid < 0) {
+		lis_log_error("fork() failed: %d, %s", errno, strerror(errno));
+		close(socks[0]);
+		close(socks[1]);
+		FREE(launcher);
+		return LIS_ERR_INTERNAL_UNKNOWN_ERROR;
+	}
+
+	if (launcher->pid == 0) {
+		// we are the launcher process
+		close(socks[0]);
+		launcher_main(socks[1], to_wrap, rings, nb_rings);
+		abort(); // launcher_main() must never return
+	}
+
+	close(socks[1]);
+	launcher->sock = socks[0];
+	pthread_mutex_init(&launcher->mutex, NULL);
+	lis_log_info("Launcher process PID: %u", (int)launcher->pid);
+
+	*out = launcher;
+	return LIS_OK;
+}
+
+
+enum lis_error lis_launcher_spawn(
+		struct lis_launcher *launcher, const struct lis_pipes *pipes,
+		int ring_idx, pid_t *pid
+	)
+{
+	struct launcher_request request = { .ring_idx = ring_idx };
+	struct launcher_reply reply;
+	int fds[LAUNCHER_NB_FDS];
+	int r;
+
+	get_worker_fds(pipes, fds);
+
+	LIS_LOCK(&launcher->mutex);
+	r = send_request(launcher->sock, &request, fds);
+	if (r >= 0) {
+		r = read_all(launcher->sock, &reply, sizeof(reply));
+	}
+	LIS_UNLOCK(&launcher->mutex);
+
+	if (r < 0) {
+		lis_log_error(
+			"Failed to communicate with the launcher process: %d, %s",
+			errno, strerror(errno)
+		);
+		return LIS_ERR_IO_ERROR;
+	}
+	if (reply.pid < 0) {
+		lis_log_error(
+			"Launcher: fork() failed: %d, %s",
+			reply.err, strerror(reply.err)
+		);
+		return LIS_ERR_INTERNAL_UNKNOWN_ERROR;
+	}
+
+	*pid = reply.pid;
+	return LIS_OK;
+}
+
+
+void lis_launcher_stop(struct lis_launcher *launcher)
+{
+	// the launcher stops when it gets an end of file
+	close(launcher->sock);
+	if (waitpid(launcher->pid, NULL, 0) < 0) {
+		lis_log_warning(
+			"waitpid() failed: %d, %s", errno, strerror(errno)
+		);
+	}
+	pthread_mutex_destroy(&launcher->mutex);
+	FREE(launcher);
+}
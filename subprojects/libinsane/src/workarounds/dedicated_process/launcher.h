@@ -0,0 +1,53 @@
+#ifndef __LIBINSANE_WORKAROUND_DEDICATED_PROCESS_LAUNCHER_H
+#define __LIBINSANE_WORKAROUND_DEDICATED_PROCESS_LAUNCHER_H
+
+#include <sys/types.h>
+
+#include <libinsane/capi.h>
+#include <libinsane/error.h>
+
+#include "protocol.h"
+#include "ring.h"
+
+
+/* A process that only forks worker processes.
+ *
+ * fork() is only safe while the calling process has a single thread: any
+ * lock held by another thread at that time (libc, Sane, workarounds, ...)
+ * remains locked forever in the child process. When each device gets its
+ * own worker process, workers are started long after the master has
+ * started threads (reply and log threads of the other workers, application
+ * threads, ...). They are therefore forked by the launcher: the launcher is
+ * forked when the dedicated_process wrapper is created, before any of its
+ * threads, and it never starts any thread itself.
+ *
+ * The master creates the pipes of each worker and sends the worker ends to
+ * the launcher (SCM_RIGHTS). The rings are allocated before the launcher is
+ * forked, so they are shared by the master and all the workers.
+ */
+struct lis_launcher;
+
+
+enum lis_error lis_launcher_start(
+	struct lis_api *to_wrap, struct lis_ring **rings, int nb_rings,
+	struct lis_launcher **out
+);
+
+
+/*!
+ * Forks a worker process. The worker ends of the pipes can be closed by the
+ * caller once this function returns.
+ *
+ * \param[in] ring_idx ring (see \ref lis_launcher_start()) the worker uses.
+ * \param[out] pid process ID of the worker. The worker is not a child of the
+ *   calling process: it cannot be waited for.
+ */
+enum lis_error lis_launcher_spawn(
+	struct lis_launcher *launcher, const struct lis_pipes *pipes,
+	int ring_idx, pid_t *pid
+);
+
+
+void lis_launcher_stop(struct lis_launcher *launcher);
+
+#endif
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -14,20 +15,95 @@
 #include <libinsane/workarounds.h>
 #include <libinsane/util.h>
 
+#include "../../trace_events.h"
+#include "launcher.h"
+#include "../cache.h"
+#include "messages.h"
 #include "pack.h"
 #include "protocol.h"
+#include "ring.h"
 #include "worker.h"
 
 
+/* Image data go through a shared memory ring (see ring.h), not through the
+ * pipes. One ring per device opened at the same time. */
+#define RING_SIZE (4 * 1024 * 1024)
+#define MAX_DEVICES 8
+
+
+/* Reusable buffers for calls made one after the other. Once they have
+ * grown to the size of the biggest messages, calls don't allocate anything
+ * anymore. */
+struct lis_master_channel
+{
+	struct lis_pack_buf request;
+	struct lis_pack_buf reply; // filled in by the reply thread
+};
+
+
+/* A call waiting for its reply */
+struct lis_master_call
+{
+	uint32_t request_id;
+	bool done;
+	enum lis_error err; // I/O error
+	struct lis_msg reply;
+	struct lis_pack_buf *reply_buf;
+	pthread_cond_t cond;
+	struct lis_master_call *next;
+};
+
+
+struct lis_master_impl;
+
+
+/* A worker process and the threads handling its pipes */
+struct lis_master_worker
+{
+	struct lis_master_impl *impl;
+	struct lis_pipes pipes;
+	struct lis_ring *rings[MAX_DEVICES];
+	int nb_rings;
+	/* worker forked by the launcher: index of its ring in impl->rings.
+	 * -1 if the worker has been forked by us and owns its rings. */
+	int ring_slot;
+	pid_t pid;
+	bool log_thread_started;
+	pthread_t log_thread;
+	pthread_t reply_thread;
+
+	pthread_mutex_t write_mutex; // serializes the writes on msgs_m2w
+
+	// serializes the API calls (list_devices(), get_device(), cleanup())
+	pthread_mutex_t api_mutex;
+	struct lis_master_channel api; // protected by api_mutex
+
+	pthread_mutex_t mutex; // protects everything below
+	uint32_t last_request_id;
+	struct lis_master_call *pending;
+	bool dead;
+};
+
+
 struct lis_master_impl
 {
 	struct lis_api parent;
 
 	struct lis_api *wrapped;
 
-	struct lis_pipes pipes;
-	pid_t worker;
-	pthread_t log_thread;
+	/* if true, each device opened runs in its own worker process.
+	 * Otherwise all the devices run in the same worker, each in its own
+	 * thread. */
+	bool worker_per_device;
+	struct lis_master_worker *worker; // list_devices(), get_device(), etc
+
+	/* worker_per_device only: the device workers are forked by the
+	 * launcher (see launcher.h) and use the rings allocated before it. */
+	struct lis_launcher *launcher;
+	struct lis_ring *rings[MAX_DEVICES];
+	bool rings_used[MAX_DEVICES]; // protected by mutex
+
+	pthread_mutex_t mutex; // protects data and rings_used
 
 	struct {
 		struct {
@@ -48,6 +124,11 @@ struct lis_master_opt
 	intptr_t remote;
 
 	void *value_msg;
+
+	/* value returned by the last LIS_MSG_ITEM_GET_VALUES. Only valid if
+	 * item->values.generation == root->generation */
+	bool cached;
+	union lis_value cached_value;
 };
 #define LIS_MASTER_OPT_PRIVATE(opt) ((struct lis_master_opt *)(opt))
 
@@ -66,9 +147,18 @@ struct lis_master_item
 {
 	struct lis_item parent;
 	struct lis_master_impl *impl;
+	struct lis_master_item *root;
 	void *msg;
 	intptr_t remote;
-	bool root;
+
+	/* root items only */
+	struct lis_master_worker *worker;
+	struct lis_ring *ring;
+	pthread_mutex_t mutex; // serializes the calls on the device
+	struct lis_master_channel channel; // protected by mutex
+	/* incremented each time the options values may have changed
+	 * (set_value(), scan_start(), ...) */
+	unsigned int generation;
 
 	struct {
 		void *msg;
@@ -81,21 +171,25 @@ struct lis_master_item
 		struct lis_master_opt *private;
 		struct lis_option_descriptor **ptrs;
 	} opts;
+
+	/* option values fetched all at once (see fetch_values()) */
+	struct {
+		void *msg; // cached string values point in it
+		unsigned int generation;
+	} values;
 };
 #define LIS_MASTER_ITEM_PRIVATE(item) ((struct lis_master_item *)(item))
 
 
-static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-#define LIS_LOCK() do { \
+#define LIS_LOCK(mutex) do { \
 		int __pthread_r; \
-		__pthread_r = pthread_mutex_lock(&g_mutex); \
+		__pthread_r = pthread_mutex_lock(mutex); \
 		assert(__pthread_r == 0); \
 	} while(0)
 
-#define LIS_UNLOCK() do { \
+#define LIS_UNLOCK(mutex) do { \
 		int __pthread_r; \
-		__pthread_r = pthread_mutex_unlock(&g_mutex); \
+		__pthread_r = pthread_mutex_unlock(mutex); \
 		assert(__pthread_r == 0); \
 	} while(0)
 
@@ -120,6 +214,11 @@ static enum lis_error master_item_get_children(struct lis_item *self, struct lis
 static enum lis_error master_item_get_options(struct lis_item *self, struct lis_option_descriptor ***descs);
 static enum lis_error master_item_scan_start(struct lis_item *self, struct lis_scan_session **session);
 static void master_item_close(struct lis_item *self);
+static enum lis_error master_item_set_values(
+	struct lis_item *self, int nb_values,
+	struct lis_option_descriptor **opts, const union lis_value *values,
+	int *set_flags, int *nb_set
+);
 
 
 static struct lis_item g_master_item_template = {
@@ -127,6 +226,7 @@ static struct lis_item g_master_item_template = {
 	.get_options = master_item_get_options,
 	.scan_start = master_item_scan_start,
 	.close = master_item_close,
+	.set_values = master_item_set_values,
 };
 
 
@@ -167,6 +267,7 @@ static struct lis_scan_session g_master_session_template = {
 	.end_of_page = master_session_end_of_page,
 	.scan_read = master_session_scan_read,
 	.cancel = master_session_cancel,
+	.name = "dedicated_process",
 };
 
 
@@ -216,49 +317,334 @@ static void configure_pipe(int pipe[2])
 }
 
 
-static void master_cleanup(struct lis_api *impl)
+static void *reply_thread(void *_worker)
 {
-	struct lis_master_impl *private = LIS_MASTER_IMPL_PRIVATE(impl);
-	int wstatus;
+	struct lis_master_worker *worker = _worker;
+	struct lis_master_call **call, *done;
+	struct lis_pack_buf discard; // replies nobody is waiting for
+	struct lis_msg msg;
 	enum lis_error err;
-	int r;
-	struct lis_msg msg = {
-		.header = {
-			.msg_type = LIS_MSG_API_CLEANUP,
-			.err = LIS_OK,
-		},
-		.raw = { 0 },
-	};
 
-	LIS_LOCK();
+	memset(&discard, 0, sizeof(discard));
 
-	if (kill(private->worker, 0) >= 0) { // if worker is still alive
-		lis_log_info("Requesting worker process to stop ...");
-		err = lis_protocol_msg_write(
-			private->pipes.sorted.msgs_m2w[1],
-			&msg
+	lis_log_info("Reply thread started");
+	while (1) {
+		err = lis_protocol_msg_read_header(
+			worker->pipes.sorted.msgs_w2m[0], &msg
 		);
 		if (LIS_IS_ERROR(err)) {
-			lis_log_warning("Failed to send cleanup command");
-		} else {
-			lis_log_debug("Waiting for worker reply");
-			err = lis_protocol_msg_read(
-				private->pipes.sorted.msgs_w2m[0],
-				&msg
+			break;
+		}
+
+		LIS_LOCK(&worker->mutex);
+		for (call = &worker->pending ; *call != NULL ; call = &(*call)->next) {
+			if ((*call)->request_id == msg.header.request_id) {
+				break;
+			}
+		}
+		done = *call;
+		if (done != NULL) {
+			*call = done->next;
+		}
+		LIS_UNLOCK(&worker->mutex);
+
+		if (done == NULL) {
+			lis_log_warning(
+				"Got reply to unknown request %u (type %d)",
+				msg.header.request_id, msg.header.msg_type
+			);
+			err = lis_protocol_msg_read_content(
+				worker->pipes.sorted.msgs_w2m[0], &msg, &discard
 			);
-			if (LIS_IS_ERROR(err)) {
-				lis_log_warning("Failed to receive cleanup reply");
-			} else {
-				lis_log_debug("Worker is going to stop");
-				assert(msg.header.msg_type == LIS_MSG_API_CLEANUP);
-				lis_protocol_msg_free(&msg);
+			if (LIS_IS_ERROR(err) && err != LIS_ERR_NO_MEM) {
+				break;
 			}
+			continue;
+		}
+
+		// the caller is blocked until we are done: we can write
+		// directly in its buffer
+		err = lis_protocol_msg_read_content(
+			worker->pipes.sorted.msgs_w2m[0], &msg, done->reply_buf
+		);
+
+		LIS_LOCK(&worker->mutex);
+		memcpy(&done->reply, &msg, sizeof(msg));
+		done->err = err;
+		done->done = true;
+		pthread_cond_signal(&done->cond);
+		LIS_UNLOCK(&worker->mutex);
+
+		if (LIS_IS_ERROR(err) && err != LIS_ERR_NO_MEM) {
+			break;
 		}
 	}
 
-	lis_protocol_close(&private->pipes);
+	lis_pack_buf_free(&discard);
+
+	// worker is gone: nobody will ever reply to the pending calls
+	LIS_LOCK(&worker->mutex);
+	worker->dead = true;
+	for (done = worker->pending ; done != NULL ; done = done->next) {
+		done->err = err;
+		done->done = true;
+		pthread_cond_signal(&done->cond);
+	}
+	worker->pending = NULL;
+	LIS_UNLOCK(&worker->mutex);
+
+	lis_log_info(
+		"Stopping reply thread because: 0x%X, %s", err, lis_strerror(err)
+	);
+	return NULL;
+}
+
+
+/*!
+ * Sends the request prepared in channel->request and waits for the reply.
+ *
+ * \param[in] device remote root item the call applies to. 0 for API calls.
+ * \param[out] reply content of the reply. Points in channel->reply: valid
+ *   until the next call on the same channel.
+ */
+static enum lis_error remote_call(
+		struct lis_master_worker *worker,
+		intptr_t device,
+		enum lis_msg_type msg_type,
+		const char *call_name,
+		struct lis_master_channel *channel,
+		struct lis_unpack_buf *reply
+	)
+{
+	struct lis_master_call call;
+	struct lis_master_call **prev;
+	struct lis_msg msg;
+	uint64_t start = lis_trace_now();
+	enum lis_error err;
+
+	lis_unpack_buf_init(reply, NULL, 0);
+
+	memset(&call, 0, sizeof(call));
+	memset(&msg, 0, sizeof(msg));
+	msg.header.msg_type = msg_type;
+	msg.header.err = LIS_OK;
+	msg.header.device = device;
+	msg.raw.iov_base = channel->request.data;
+	msg.raw.iov_len = channel->request.size;
+	call.reply_buf = &channel->reply;
+	pthread_cond_init(&call.cond, NULL);
+
+	if (channel->request.oom) {
+		err = LIS_ERR_NO_MEM;
+		goto end;
+	}
+
+	// the call must be known before the reply can arrive
+	LIS_LOCK(&worker->mutex);
+	if (worker->dead) {
+		LIS_UNLOCK(&worker->mutex);
+		err = LIS_ERR_IO_ERROR;
+		goto end;
+	}
+	call.request_id = ++worker->last_request_id;
+	msg.header.request_id = call.request_id;
+	call.next = worker->pending;
+	worker->pending = &call;
+	LIS_UNLOCK(&worker->mutex);
+
+	LIS_LOCK(&worker->write_mutex);
+	err = lis_protocol_msg_write(worker->pipes.sorted.msgs_m2w[1], &msg);
+	LIS_UNLOCK(&worker->write_mutex);
+
+	if (LIS_IS_OK(err) && lis_trace_enabled()) {
+		lis_trace_flow(
+			call_name, LIS_PROTOCOL_TRACE_ID(worker->pid, call.request_id),
+			0, lis_trace_now()
+		);
+	}
+
+	LIS_LOCK(&worker->mutex);
+	if (LIS_IS_ERROR(err)) {
+		for (prev = &worker->pending ; *prev != NULL ; prev = &(*prev)->next) {
+			if (*prev == &call) {
+				*prev = call.next;
+				break;
+			}
+		}
+	} else {
+		while (!call.done) {
+			pthread_cond_wait(&call.cond, &worker->mutex);
+		}
+		err = call.err;
+	}
+	LIS_UNLOCK(&worker->mutex);
+
+end:
+	pthread_cond_destroy(&call.cond);
+	if (LIS_IS_ERROR(err)) {
+		lis_log_error(
+			"%s() failed: 0x%X, %s",
+			call_name, err, lis_strerror(err)
+		);
+	} else {
+		lis_unpack_buf_init(
+			reply, call.reply.raw.iov_base, call.reply.raw.iov_len
+		);
+		err = call.reply.header.err;
+	}
+	if (lis_trace_enabled()) {
+		lis_trace_call(
+			"dedicated_process", call_name, start, lis_trace_now(),
+			err, 0
+		);
+	}
+	return err;
+}
+
+
+/*!
+ * Most calls only tell the worker which remote object (item, option or scan
+ * session) they apply to. Must be called with root->mutex held.
+ */
+static enum lis_error remote_call_on(
+		struct lis_master_item *root, intptr_t remote,
+		enum lis_msg_type msg_type, const char *call_name,
+		struct lis_unpack_buf *reply
+	)
+{
+	struct lis_msg_remote request = { .remote = remote };
+
+	lis_pack_buf_reset(&root->channel.request);
+	lis_msg_remote_pack(&root->channel.request, &request);
+	return remote_call(
+		root->worker, root->remote, msg_type, call_name,
+		&root->channel, reply
+	);
+}
+
+
+static void free_channel(struct lis_master_channel *channel)
+{
+	lis_pack_buf_free(&channel->request);
+	lis_pack_buf_free(&channel->reply);
+}
+
+
+static enum lis_error check_reply(
+		const char *call_name, const struct lis_unpack_buf *reply
+	)
+{
+	if (reply->error) {
+		lis_log_error("%s(): Truncated reply", call_name);
+		return LIS_ERR_IO_ERROR;
+	}
+	return LIS_OK;
+}
+
+
+/*!
+ * Closes a device that has been opened in the worker, but for which no item
+ * could be created here. Otherwise the remote item and its ring would never
+ * be released.
+ */
+static void close_remote_device(
+		struct lis_master_worker *worker, intptr_t remote
+	)
+{
+	struct lis_master_channel channel;
+	struct lis_msg_remote request = { .remote = remote };
+	struct lis_unpack_buf reply;
+
+	if (remote == 0) {
+		// reply truncated before the item: nothing we can close
+		return;
+	}
+
+	memset(&channel, 0, sizeof(channel));
+	lis_msg_remote_pack(&channel.request, &request);
+	remote_call(
+		worker, remote, LIS_MSG_ITEM_CLOSE, "item_close", &channel, &reply
+	);
+	free_channel(&channel);
+}
+
+
+static int ring_get(struct lis_master_impl *impl)
+{
+	int i;
+
+	LIS_LOCK(&impl->mutex);
+	for (i = 0 ; i < MAX_DEVICES ; i++) {
+		if (!impl->rings_used[i]) {
+			impl->rings_used[i] = true;
+			break;
+		}
+	}
+	LIS_UNLOCK(&impl->mutex);
+
+	if (i >= MAX_DEVICES) {
+		lis_log_error(
+			"Too many devices opened at the same time (max: %d)",
+			MAX_DEVICES
+		);
+		return -1;
+	}
+	return i;
+}
+
+
+static void ring_put(struct lis_master_impl *impl, int ring_slot)
+{
+	LIS_LOCK(&impl->mutex);
+	impl->rings_used[ring_slot] = false;
+	LIS_UNLOCK(&impl->mutex);
+}
+
+
+static void free_rings(struct lis_master_worker *worker)
+{
+	int i;
+
+	if (worker->ring_slot >= 0) {
+		ring_put(worker->impl, worker->ring_slot);
+		return;
+	}
+	for (i = 0 ; i < worker->nb_rings ; i++) {
+		lis_ring_free(worker->rings[i]);
+	}
+}
+
+
+static void worker_stop(struct lis_master_worker *worker)
+{
+	int wstatus;
+	enum lis_error err;
+	int r;
+	struct lis_unpack_buf reply;
+
+	if (kill(worker->pid, 0) >= 0) { // if worker is still alive
+		lis_log_info("Requesting worker process %u to stop ...", (int)worker->pid);
+		LIS_LOCK(&worker->api_mutex);
+		lis_pack_buf_reset(&worker->api.request);
+		err = remote_call(
+			worker, 0, LIS_MSG_API_CLEANUP, "cleanup",
+			&worker->api, &reply
+		);
+		LIS_UNLOCK(&worker->api_mutex);
+		if (LIS_IS_ERROR(err)) {
+			lis_log_warning("Failed to stop worker");
+		} else {
+			lis_log_debug("Worker is going to stop");
+		}
+	}
 
-	if (waitpid(private->worker, &wstatus, 0) < 0) {
+	close(worker->pipes.sorted.msgs_m2w[1]);
+	worker->pipes.sorted.msgs_m2w[1] = -1;
+
+	if (worker->ring_slot >= 0) {
+		// not our child: the reply thread gets an end of file once
+		// it is gone
+	} else if (waitpid(worker->pid, &wstatus, 0) < 0) {
 		lis_log_warning(
 			"waitpid() failed: %d, %s",
 			errno, strerror(errno)
@@ -274,51 +660,346 @@ static void master_cleanup(struct lis_api *impl)
 		);
 	}
 
-	lis_log_info("Waiting for log thread to end ...");
-	r = pthread_join(private->log_thread, NULL);
+	// worker is gone: both threads get an end of file and stop
+	lis_log_info("Waiting for reply and log threads to end ...");
+	r = pthread_join(worker->reply_thread, NULL);
 	if (r != 0) {
 		lis_log_warning("pthread_join() failed: %d, %s", r, strerror(r));
 	}
+	if (worker->log_thread_started) {
+		r = pthread_join(worker->log_thread, NULL);
+		if (r != 0) {
+			lis_log_warning("pthread_join() failed: %d, %s", r, strerror(r));
+		}
+	}
 
-	FREE(private->data.list_devs.msg);
-	FREE(private->data.list_devs.dev_ptrs);
-	FREE(private->data.list_devs.devs);
+	lis_protocol_close(&worker->pipes);
+	free_rings(worker);
 
-	private->wrapped->cleanup(private->wrapped);
+	free_channel(&worker->api);
+	pthread_mutex_destroy(&worker->api_mutex);
+	pthread_mutex_destroy(&worker->mutex);
+	pthread_mutex_destroy(&worker->write_mutex);
+	FREE(worker);
+}
 
-	FREE(private);
 
-	LIS_UNLOCK();
+static struct lis_master_worker *worker_new(struct lis_master_impl *impl)
+{
+	struct lis_master_worker *worker;
+	unsigned int i;
+
+	worker = calloc(1, sizeof(struct lis_master_worker));
+	if (worker == NULL) {
+		lis_log_error("Out of memory");
+		return NULL;
+	}
+	worker->impl = impl;
+	worker->ring_slot = -1;
+	for (i = 0 ; i < LIS_COUNT_OF(worker->pipes.all); i++) {
+		worker->pipes.all[i][0] = -1;
+		worker->pipes.all[i][1] = -1;
+	}
+	return worker;
+}
+
+
+static enum lis_error open_pipes(struct lis_master_worker *worker)
+{
+	unsigned int i;
+
+	lis_log_info("Creating pipes ...");
+	for (i = 0 ; i < LIS_COUNT_OF(worker->pipes.all); i++) {
+		if (pipe(worker->pipes.all[i]) < 0) {
+			lis_log_error("pipe() failed: %d, %s", errno, strerror(errno));
+			return LIS_ERR_INTERNAL_UNKNOWN_ERROR;
+		}
+		lis_log_debug(
+			"Pipe: Read: %d - Write: %d",
+			worker->pipes.all[i][0], worker->pipes.all[i][1]
+		);
+		configure_pipe(worker->pipes.all[i]);
+	}
+	return LIS_OK;
+}
+
+
+/*!
+ * Worker process has been started: closes the worker ends of the pipes and
+ * starts the threads reading the worker pipes.
+ */
+static enum lis_error worker_attach(struct lis_master_worker *worker)
+{
+	int r;
+
+	close(worker->pipes.sorted.msgs_m2w[0]);
+	worker->pipes.sorted.msgs_m2w[0] = -1;
+	close(worker->pipes.sorted.msgs_w2m[1]);
+	worker->pipes.sorted.msgs_w2m[1] = -1;
+	close(worker->pipes.sorted.logs[1]);
+	worker->pipes.sorted.logs[1] = -1;
+	close(worker->pipes.sorted.stderr[1]);
+	worker->pipes.sorted.stderr[1] = -1;
+
+	lis_log_info("Child process PID: %u", (int)worker->pid);
+
+	pthread_mutex_init(&worker->mutex, NULL);
+	pthread_mutex_init(&worker->write_mutex, NULL);
+	pthread_mutex_init(&worker->api_mutex, NULL);
+
+	lis_log_info("Starting log thread ...");
+	r = pthread_create(&worker->log_thread, NULL, log_thread, &worker->pipes);
+	if (r != 0) {
+		lis_log_warning(
+			"Failed to create log thread: %d, %s",
+			r, strerror(r)
+		);
+	}
+	worker->log_thread_started = (r == 0);
+
+	lis_log_info("Starting reply thread ...");
+	r = pthread_create(&worker->reply_thread, NULL, reply_thread, worker);
+	if (r != 0) {
+		// without it, we cannot get any reply from the worker
+		lis_log_error(
+			"Failed to create reply thread: %d, %s",
+			r, strerror(r)
+		);
+		kill(worker->pid, SIGKILL);
+		if (worker->ring_slot < 0) {
+			waitpid(worker->pid, NULL, 0);
+		}
+		if (worker->log_thread_started) {
+			pthread_join(worker->log_thread, NULL);
+		}
+		pthread_mutex_destroy(&worker->api_mutex);
+		pthread_mutex_destroy(&worker->mutex);
+		pthread_mutex_destroy(&worker->write_mutex);
+		return LIS_ERR_INTERNAL_UNKNOWN_ERROR;
+	}
+
+	return LIS_OK;
+}
+
+
+/*!
+ * Forks a worker process from this process. Only used when the wrapper is
+ * created: later on, other threads may be running (see launcher.h).
+ */
+static enum lis_error worker_start(
+		struct lis_master_impl *impl, int nb_rings,
+		struct lis_master_worker **out
+	)
+{
+	struct lis_master_worker *worker;
+	enum lis_error err;
+
+	worker = worker_new(impl);
+	if (worker == NULL) {
+		return LIS_ERR_NO_MEM;
+	}
+
+	for (worker->nb_rings = 0 ; worker->nb_rings < nb_rings ; worker->nb_rings++) {
+		worker->rings[worker->nb_rings] = lis_ring_new(RING_SIZE);
+		if (worker->rings[worker->nb_rings] == NULL) {
+			err = LIS_ERR_NO_MEM;
+			goto err;
+		}
+	}
+
+	err = open_pipes(worker);
+	if (LIS_IS_ERROR(err)) {
+		goto err;
+	}
+
+	lis_log_info("Forking ...");
+	worker->pid = fork();
+	if (worker->pid < 0) {
+		lis_log_error("fork() failed: %d, %s", errno, strerror(errno));
+		err = LIS_ERR_INTERNAL_UNKNOWN_ERROR;
+		goto err;
+	}
+
+	if (worker->pid == 0) {
+		// we are the worker processus
+		close(worker->pipes.sorted.msgs_m2w[1]);
+		worker->pipes.sorted.msgs_m2w[1] = -1;
+		close(worker->pipes.sorted.msgs_w2m[0]);
+		worker->pipes.sorted.msgs_w2m[0] = -1;
+		close(worker->pipes.sorted.logs[0]);
+		worker->pipes.sorted.logs[0] = -1;
+		close(worker->pipes.sorted.stderr[0]);
+		worker->pipes.sorted.stderr[0] = -1;
+
+		lis_worker_main(
+			impl->wrapped, &worker->pipes,
+			worker->rings, worker->nb_rings
+		);
+		abort(); // lis_worker_main() must never return
+	}
+
+	// we are the master processus
+	err = worker_attach(worker);
+	if (LIS_IS_ERROR(err)) {
+		goto err;
+	}
+
+	*out = worker;
+	return LIS_OK;
+
+err:
+	lis_protocol_close(&worker->pipes);
+	free_rings(worker);
+	FREE(worker);
+	return err;
 }
 
 
-static enum lis_error remote_call(
-		struct lis_master_impl *private,
-		const char *call_name,
-		const struct lis_msg *msg_in,
-		struct lis_msg *msg_out
-	)
-{
-	enum lis_error err;
+/*!
+ * Starts a worker process for a single device, through the launcher.
+ */
+static enum lis_error worker_spawn(
+		struct lis_master_impl *impl, struct lis_master_worker **out
+	)
+{
+	struct lis_master_worker *worker;
+	enum lis_error err;
+
+	worker = worker_new(impl);
+	if (worker == NULL) {
+		return LIS_ERR_NO_MEM;
+	}
+
+	worker->ring_slot = ring_get(impl);
+	if (worker->ring_slot < 0) {
+		FREE(worker);
+		return LIS_ERR_DEVICE_BUSY;
+	}
+	worker->rings[0] = impl->rings[worker->ring_slot];
+	worker->nb_rings = 1;
+
+	err = open_pipes(worker);
+	if (LIS_IS_ERROR(err)) {
+		goto err;
+	}
+
+	err = lis_launcher_spawn(
+		impl->launcher, &worker->pipes, worker->ring_slot, &worker->pid
+	);
+	if (LIS_IS_ERROR(err)) {
+		goto err;
+	}
+
+	err = worker_attach(worker);
+	if (LIS_IS_ERROR(err)) {
+		goto err;
+	}
+
+	*out = worker;
+	return LIS_OK;
+
+err:
+	lis_protocol_close(&worker->pipes);
+	free_rings(worker);
+	FREE(worker);
+	return err;
+}
+
+
+/*!
+ * Allocates the rings of the device workers and forks the launcher. Must be
+ * called before any of our threads is started.
+ */
+static enum lis_error launcher_start(struct lis_master_impl *impl)
+{
+	enum lis_error err;
+	int i;
+
+	for (i = 0 ; i < MAX_DEVICES ; i++) {
+		impl->rings[i] = lis_ring_new(RING_SIZE);
+		if (impl->rings[i] == NULL) {
+			err = LIS_ERR_NO_MEM;
+			goto err;
+		}
+	}
+
+	err = lis_launcher_start(
+		impl->wrapped, impl->rings, MAX_DEVICES, &impl->launcher
+	);
+	if (LIS_IS_OK(err)) {
+		return err;
+	}
+
+err:
+	for (i = 0 ; i < MAX_DEVICES && impl->rings[i] != NULL ; i++) {
+		lis_ring_free(impl->rings[i]);
+		impl->rings[i] = NULL;
+	}
+	return err;
+}
+
+
+static void launcher_stop(struct lis_master_impl *impl)
+{
+	int i;
+
+	if (impl->launcher == NULL) {
+		return;
+	}
+	lis_launcher_stop(impl->launcher);
+	impl->launcher = NULL;
+	for (i = 0 ; i < MAX_DEVICES ; i++) {
+		lis_ring_free(impl->rings[i]);
+		impl->rings[i] = NULL;
+	}
+}
+
+
+/*!
+ * Instances of workaround_cache below us live in the worker: forward them
+ * lis_workaround_cache_invalidate_devices() and lis_workaround_cache_hotplug().
+ * Only the worker handling list_devices() matters.
+ */
+static void master_cache_relay(enum lis_cache_event event, void *data)
+{
+	struct lis_master_impl *private = data;
+	struct lis_master_worker *worker = private->worker;
+	struct lis_msg_cache_event request = { .event = event };
+	struct lis_unpack_buf reply;
+
+	LIS_LOCK(&worker->api_mutex);
+	lis_pack_buf_reset(&worker->api.request);
+	lis_msg_cache_event_pack(&worker->api.request, &request);
+	remote_call(
+		worker, 0, LIS_MSG_API_CACHE_EVENT, "cache_event",
+		&worker->api, &reply
+	);
+	LIS_UNLOCK(&worker->api_mutex);
+}
+
+
+static void master_cleanup(struct lis_api *impl)
+{
+	struct lis_master_impl *private = LIS_MASTER_IMPL_PRIVATE(impl);
+
+	// waits for the relay calls in progress
+	lis_cache_remove_relay(master_cache_relay, private);
+
+	LIS_LOCK(&private->mutex);
+
+	worker_stop(private->worker);
+	launcher_stop(private);
 
-	err = lis_protocol_msg_write(private->pipes.sorted.msgs_m2w[1], msg_in);
-	if (LIS_IS_ERROR(err)) {
-		lis_log_error(
-			"%s() failed: 0x%X, %s",
-			call_name, err, lis_strerror(err)
-		);
-		return err;
-	}
+	FREE(private->data.list_devs.msg);
+	FREE(private->data.list_devs.dev_ptrs);
+	FREE(private->data.list_devs.devs);
 
-	memset(msg_out, 0, sizeof(*msg_out));
+	private->wrapped->cleanup(private->wrapped);
 
-	err = lis_protocol_msg_read(private->pipes.sorted.msgs_w2m[0], msg_out);
-	if (LIS_IS_ERROR(err)) {
-		lis_log_error("%s() failed: 0x%X, %s", call_name, err, lis_strerror(err));
-		return err;
-	}
+	LIS_UNLOCK(&private->mutex);
+	pthread_mutex_destroy(&private->mutex);
 
-	return msg_out->header.err;
+	FREE(private);
 }
 
 
@@ -327,23 +1008,15 @@ static enum lis_error master_list_devices(
 	struct lis_device_descriptor ***devs)
 {
 	struct lis_master_impl *private = LIS_MASTER_IMPL_PRIVATE(impl);
+	struct lis_master_worker *worker = private->worker;
 	enum lis_error err = LIS_OK;
-	struct lis_msg msg_in = {
-		.header = {
-			.msg_type = LIS_MSG_API_LIST_DEVICES,
-			.err = LIS_OK,
-		},
-		.raw = {
-			.iov_base = &locs,
-			.iov_len = sizeof(locs),
-		},
-	};
-	struct lis_msg msg_out;
-	const void *ptr;
-	int nb_devs = 0;
+	struct lis_msg_list_devices request = { .locations = locs };
+	struct lis_msg_int nb_devs;
+	struct lis_msg_device_desc desc;
+	struct lis_unpack_buf reply;
 	int i;
 
-	LIS_LOCK();
+	LIS_LOCK(&private->mutex);
 
 	*devs = NULL;
 
@@ -351,51 +1024,62 @@ static enum lis_error master_list_devices(
 	FREE(private->data.list_devs.dev_ptrs);
 	FREE(private->data.list_devs.devs);
 
-	err = remote_call(private, "list_devices", &msg_in, &msg_out);
+	LIS_LOCK(&worker->api_mutex);
+	lis_pack_buf_reset(&worker->api.request);
+	lis_msg_list_devices_pack(&worker->api.request, &request);
+	err = remote_call(
+		worker, 0, LIS_MSG_API_LIST_DEVICES, "list_devices",
+		&worker->api, &reply
+	);
 	if (LIS_IS_ERROR(err)) {
-		LIS_UNLOCK();
+		LIS_UNLOCK(&worker->api_mutex);
+		LIS_UNLOCK(&private->mutex);
 		return err;
 	}
-	if (LIS_IS_ERROR(msg_out.header.err)) {
-		LIS_UNLOCK();
-		return msg_out.header.err;
+	// the descriptors point in the reply: we keep it
+	private->data.list_devs.msg = lis_pack_buf_steal(&worker->api.reply);
+	LIS_UNLOCK(&worker->api_mutex);
+
+	lis_msg_int_unpack(&reply, &nb_devs);
+	if (nb_devs.value < 0) {
+		reply.error = true;
+		nb_devs.value = 0;
 	}
-	private->data.list_devs.msg = msg_out.raw.iov_base;
-
-	ptr = msg_out.raw.iov_base;
-	lis_unpack(&ptr, "i", &nb_devs);
 
-	private->data.list_devs.dev_ptrs = calloc(nb_devs + 1, sizeof(struct lis_device_descriptor *));
-	private->data.list_devs.devs = calloc(nb_devs, sizeof(struct lis_device_descriptor));
+	private->data.list_devs.dev_ptrs = calloc(nb_devs.value + 1, sizeof(struct lis_device_descriptor *));
+	private->data.list_devs.devs = calloc(nb_devs.value, sizeof(struct lis_device_descriptor));
 	if (private->data.list_devs.dev_ptrs == NULL || private->data.list_devs.devs == NULL) {
 		lis_log_error(
 			"Out of memory (%d devs --> %p %p)",
-			nb_devs, private->data.list_devs.dev_ptrs, private->data.list_devs.devs
+			nb_devs.value, private->data.list_devs.dev_ptrs, private->data.list_devs.devs
 		);
 		err = LIS_ERR_NO_MEM;
 		goto error;
 	}
 
-	for (i = 0 ; i < nb_devs ; i++) {
+	for (i = 0 ; i < nb_devs.value ; i++) {
+		lis_msg_device_desc_unpack(&reply, &desc);
 		private->data.list_devs.dev_ptrs[i] = &private->data.list_devs.devs[i];
-		lis_unpack(
-			&ptr, "ssss",
-			&private->data.list_devs.devs[i].dev_id,
-			&private->data.list_devs.devs[i].vendor,
-			&private->data.list_devs.devs[i].model,
-			&private->data.list_devs.devs[i].type
-		);
+		private->data.list_devs.devs[i].dev_id = (char *)desc.dev_id;
+		private->data.list_devs.devs[i].vendor = (char *)desc.vendor;
+		private->data.list_devs.devs[i].model = (char *)desc.model;
+		private->data.list_devs.devs[i].type = (char *)desc.type;
+	}
+
+	err = check_reply("list_devices", &reply);
+	if (LIS_IS_ERROR(err)) {
+		goto error;
 	}
 
 	*devs = private->data.list_devs.dev_ptrs;
-	LIS_UNLOCK();
-	return msg_out.header.err;
+	LIS_UNLOCK(&private->mutex);
+	return LIS_OK;
 
 error:
-	lis_protocol_msg_free(&msg_out);
+	FREE(private->data.list_devs.msg);
 	FREE(private->data.list_devs.dev_ptrs);
 	FREE(private->data.list_devs.devs);
-	LIS_UNLOCK();
+	LIS_UNLOCK(&private->mutex);
 	return err;
 }
 
@@ -404,62 +1088,79 @@ static enum lis_error master_get_device(
 	struct lis_api *impl, const char *dev_id, struct lis_item **item)
 {
 	struct lis_master_impl *private = LIS_MASTER_IMPL_PRIVATE(impl);
+	struct lis_master_worker *worker = private->worker;
 	struct lis_master_item *out;
 	enum lis_error err;
-	struct lis_msg msg_in = {
-		.header = {
-			.msg_type = LIS_MSG_API_GET_DEVICE,
-			.err = LIS_OK,
-		},
-		.raw = {
-			.iov_base = (void*)dev_id,
-			.iov_len = strlen(dev_id) + 1
-		},
-	};
-	struct lis_msg msg_out;
-	const void *ptr;
-
-	LIS_LOCK();
+	struct lis_msg_get_device request = { .dev_id = dev_id };
+	struct lis_msg_device device;
+	struct lis_unpack_buf reply;
+	void *reply_msg;
 
 	*item = NULL;
 
+	if (private->worker_per_device) {
+		lis_log_info("Starting worker process for device '%s'", dev_id);
+		err = worker_spawn(private, &worker);
+		if (LIS_IS_ERROR(err)) {
+			return err;
+		}
+	}
+
+	LIS_LOCK(&worker->api_mutex);
+	lis_pack_buf_reset(&worker->api.request);
+	lis_msg_get_device_pack(&worker->api.request, &request);
 	err = remote_call(
-		private, "get_device",
-		&msg_in, &msg_out
+		worker, 0, LIS_MSG_API_GET_DEVICE, "get_device",
+		&worker->api, &reply
 	);
 	if (LIS_IS_ERROR(err)) {
-		LIS_UNLOCK();
-		return err;
+		LIS_UNLOCK(&worker->api_mutex);
+		goto error;
+	}
+	// the item name points in the reply: the item keeps it
+	reply_msg = lis_pack_buf_steal(&worker->api.reply);
+	LIS_UNLOCK(&worker->api_mutex);
+
+	lis_msg_device_unpack(&reply, &device);
+	err = check_reply("get_device", &reply);
+	if (LIS_IS_OK(err) && (device.ring_idx < 0 || device.ring_idx >= worker->nb_rings)) {
+		lis_log_error("get_device(): Invalid ring index: %d", device.ring_idx);
+		err = LIS_ERR_IO_ERROR;
 	}
-	if (LIS_IS_ERROR(msg_out.header.err)) {
-		LIS_UNLOCK();
-		return msg_out.header.err;
+	if (LIS_IS_ERROR(err)) {
+		close_remote_device(worker, device.remote);
+		FREE(reply_msg);
+		goto error;
 	}
 
 	out = calloc(1, sizeof(struct lis_master_item));
 	if (out == NULL) {
 		lis_log_error("Out of memory");
+		err = LIS_ERR_NO_MEM;
+		close_remote_device(worker, device.remote);
+		FREE(reply_msg);
 		goto error;
 	}
 	memcpy(&out->parent, &g_master_item_template, sizeof(out->parent));
 	out->impl = private;
-	out->msg = msg_out.raw.iov_base;
-	out->root = true;
+	out->root = out;
+	out->msg = reply_msg;
+	out->worker = worker;
+	out->generation = 1;
+	pthread_mutex_init(&out->mutex, NULL);
 
-	ptr = msg_out.raw.iov_base;
-	lis_unpack(
-		&ptr, "sdp",
-		&out->parent.name, &out->parent.type, &out->remote
-	);
+	out->parent.name = device.name;
+	out->parent.type = device.type;
+	out->remote = device.remote;
+	out->ring = worker->rings[device.ring_idx];
 
 	*item = &out->parent;
-	LIS_UNLOCK();
-	return msg_out.header.err;
+	return LIS_OK;
 
 error:
-	FREE(out);
-	lis_protocol_msg_free(&msg_out);
-	LIS_UNLOCK();
+	if (private->worker_per_device) {
+		worker_stop(worker);
+	}
 	return err;
 }
 
@@ -479,6 +1180,8 @@ static void free_opts(struct lis_master_item *private)
 		FREE(private->opts.private);
 		FREE(private->opts.ptrs);
 	}
+	FREE(private->values.msg);
+	private->values.generation = 0;
 }
 
 
@@ -502,53 +1205,46 @@ static enum lis_error master_item_get_children(struct lis_item *self, struct lis
 {
 	struct lis_master_item *private = LIS_MASTER_ITEM_PRIVATE(self);
 	enum lis_error err;
-	struct lis_msg msg_in = {
-		.header = {
-			.msg_type = LIS_MSG_ITEM_GET_CHILDREN,
-			.err = LIS_OK,
-		},
-		.raw = {
-			.iov_base = &private->remote,
-			.iov_len = sizeof(private->remote),
-		},
-	};
-	struct lis_msg msg_out;
-	const void *ptr;
-	int nb_children, i;
+	struct lis_unpack_buf reply;
+	struct lis_msg_int nb_children;
+	struct lis_msg_child child;
+	int i;
 
-	LIS_LOCK();
+	LIS_LOCK(&private->root->mutex);
 
 	*out_children = NULL;
 
-	err = remote_call(
-		private->impl, "get_children",
-		&msg_in, &msg_out
+	err = remote_call_on(
+		private->root, private->remote, LIS_MSG_ITEM_GET_CHILDREN,
+		"get_children", &reply
 	);
 	if (LIS_IS_ERROR(err)) {
-		LIS_UNLOCK();
+		LIS_UNLOCK(&private->root->mutex);
 		return err;
 	}
-	if (LIS_IS_ERROR(msg_out.header.err)) {
-		LIS_UNLOCK();
-		return msg_out.header.err;
-	}
 
 	free_children(private);
 
-	private->children.msg = msg_out.raw.iov_base;
-	ptr = msg_out.raw.iov_base;
+	// the children names point in the reply: we keep it
+	private->children.msg = lis_pack_buf_steal(&private->root->channel.reply);
 
-	lis_unpack(&ptr, "d", &nb_children);
+	lis_msg_int_unpack(&reply, &nb_children);
+	if (nb_children.value < 0) {
+		reply.error = true;
+		nb_children.value = 0;
+	}
 
-	private->children.ptrs = calloc(nb_children + 1, sizeof(struct lis_item *));
-	private->children.private = calloc(nb_children, sizeof(struct lis_master_item));
+	private->children.ptrs = calloc(nb_children.value + 1, sizeof(struct lis_item *));
+	private->children.private = calloc(nb_children.value, sizeof(struct lis_master_item));
 	if (private->children.ptrs == NULL || private->children.private == NULL) {
 		lis_log_error("Out of memory");
 		err = LIS_ERR_NO_MEM;
 		goto error;
 	}
 
-	for (i = 0 ; i < nb_children ; i++) {
+	for (i = 0 ; i < nb_children.value ; i++) {
+		lis_msg_child_unpack(&reply, &child);
+
 		private->children.ptrs[i] = &private->children.private[i].parent;
 		memcpy(
 			&private->children.private[i].parent,
@@ -556,59 +1252,52 @@ static enum lis_error master_item_get_children(struct lis_item *self, struct lis
 			sizeof(private->children.private[i].parent)
 		);
 		private->children.private[i].impl = private->impl;
-		private->children.private[i].root = false;
+		private->children.private[i].root = private->root;
+		private->children.private[i].parent.name = child.name;
+		private->children.private[i].parent.type = child.type;
+		private->children.private[i].remote = child.remote;
+	}
 
-		lis_unpack(
-			&ptr, "sdp",
-			&private->children.private[i].parent.name,
-			&private->children.private[i].parent.type,
-			&private->children.private[i].remote
-		);
+	err = check_reply("get_children", &reply);
+	if (LIS_IS_ERROR(err)) {
+		goto error;
 	}
 
 	*out_children = private->children.ptrs;
-	LIS_UNLOCK();
-	return msg_out.header.err;
+	LIS_UNLOCK(&private->root->mutex);
+	return LIS_OK;
 
 error:
 	FREE(private->children.msg);
 	FREE(private->children.private);
 	FREE(private->children.ptrs);
-	lis_protocol_msg_free(&msg_out);
-	LIS_UNLOCK();
+	LIS_UNLOCK(&private->root->mutex);
 	return err;
 }
 
 
-static void deserialize_range(
-	const void **serialized,
-	enum lis_value_type vtype, struct lis_value_range *range)
-{
-	lis_unpack(
-		serialized, "vvv",
-		vtype, &range->min,
-		vtype, &range->max,
-		vtype, &range->interval
-	);
-}
-
-
 static enum lis_error deserialize_list(
-	const void **serialized,
+	struct lis_unpack_buf *reply,
 	enum lis_value_type vtype, struct lis_value_list *list)
 {
+	struct lis_msg_int nb_values;
 	int i;
 
-	lis_unpack(serialized, "d", &list->nb_values);
+	lis_msg_int_unpack(reply, &nb_values);
+	if (nb_values.value < 0) {
+		reply->error = true;
+		nb_values.value = 0;
+	}
 
-	list->values = calloc(list->nb_values, sizeof(union lis_value));
+	list->nb_values = nb_values.value;
+	list->values = calloc(MAX(list->nb_values, 1), sizeof(union lis_value));
 	if (list->values == NULL) {
 		lis_log_error("Out of memory");
 		return LIS_ERR_NO_MEM;
 	}
 
 	for (i = 0 ; i < list->nb_values ; i++) {
-		lis_unpack(serialized, "v", vtype, &list->values[i]);
+		list->values[i] = lis_unpack_value(reply, vtype);
 	}
 
 	return LIS_OK;
@@ -616,49 +1305,45 @@ static enum lis_error deserialize_list(
 
 
 static enum lis_error deserialize_option(
-	const void **serialized, struct lis_master_opt *opt,
+	struct lis_unpack_buf *reply, struct lis_master_opt *opt,
 	struct lis_master_item *item)
 {
-	enum lis_error err;
+	struct lis_msg_option desc;
+	struct lis_value_range *range;
+
+	lis_msg_option_unpack(reply, &desc);
 
 	memcpy(&opt->parent, &g_master_opt_template, sizeof(opt->parent));
 	opt->item = item;
-
-	lis_unpack(
-		serialized,
-		"psssdddd",
-		&opt->remote,
-		&opt->parent.name,
-		&opt->parent.title,
-		&opt->parent.desc,
-		&opt->parent.capabilities,
-		&opt->parent.value.type,
-		&opt->parent.value.unit,
-		&opt->parent.constraint.type
-	);
+	opt->remote = desc.remote;
+	opt->parent.name = desc.name;
+	opt->parent.title = desc.title;
+	opt->parent.desc = desc.desc;
+	opt->parent.capabilities = desc.capabilities;
+	opt->parent.value.type = desc.value_type;
+	opt->parent.value.unit = desc.unit;
+	opt->parent.constraint.type = desc.constraint_type;
 
 	switch(opt->parent.constraint.type) {
 		case LIS_CONSTRAINT_NONE:
-			break;
+			return LIS_OK;
 		case LIS_CONSTRAINT_RANGE:
-			deserialize_range(
-				serialized,
-				opt->parent.value.type,
-				&opt->parent.constraint.possible.range
-			);
-			break;
+			range = &opt->parent.constraint.possible.range;
+			range->min = lis_unpack_value(reply, opt->parent.value.type);
+			range->max = lis_unpack_value(reply, opt->parent.value.type);
+			range->interval = lis_unpack_value(reply, opt->parent.value.type);
+			return LIS_OK;
 		case LIS_CONSTRAINT_LIST:
-			err = deserialize_list(
-				serialized,
+			return deserialize_list(
+				reply,
 				opt->parent.value.type,
 				&opt->parent.constraint.possible.list
 			);
-			if (LIS_IS_ERROR(err)) {
-				return err;
-			}
-			break;
 	}
 
+	// we cannot know what follows
+	opt->parent.constraint.type = LIS_CONSTRAINT_NONE;
+	reply->error = true;
 	return LIS_OK;
 }
 
@@ -667,114 +1352,228 @@ static enum lis_error master_item_get_options(struct lis_item *self, struct lis_
 {
 	struct lis_master_item *private = LIS_MASTER_ITEM_PRIVATE(self);
 	enum lis_error err;
-	struct lis_msg msg_in = {
-		.header = {
-			.msg_type = LIS_MSG_ITEM_GET_OPTIONS,
-			.err = LIS_OK,
-		},
-		.raw = {
-			.iov_base = &private->remote,
-			.iov_len = sizeof(private->remote),
-		},
-	};
-	struct lis_msg msg_out;
-	const void *ptr;
-	int nb_opts;
+	struct lis_unpack_buf reply;
+	struct lis_msg_int nb_opts;
 	int i;
 
-	LIS_LOCK();
+	LIS_LOCK(&private->root->mutex);
 
 	*descs = NULL;
 
-	err = remote_call(
-		private->impl, "get_options",
-		&msg_in, &msg_out
+	err = remote_call_on(
+		private->root, private->remote, LIS_MSG_ITEM_GET_OPTIONS,
+		"get_options", &reply
 	);
 	if (LIS_IS_ERROR(err)) {
-		LIS_UNLOCK();
+		LIS_UNLOCK(&private->root->mutex);
 		return err;
 	}
-	if (LIS_IS_ERROR(msg_out.header.err)) {
-		LIS_UNLOCK();
-		return msg_out.header.err;
-	}
 
 	free_opts(private);
 
-	ptr = msg_out.raw.iov_base;
-	private->opts.msg = msg_out.raw.iov_base;
+	// the option names, titles, etc point in the reply: we keep it
+	private->opts.msg = lis_pack_buf_steal(&private->root->channel.reply);
 
-	lis_unpack(&ptr, "d", &nb_opts);
+	lis_msg_int_unpack(&reply, &nb_opts);
+	if (nb_opts.value < 0) {
+		reply.error = true;
+		nb_opts.value = 0;
+	}
 
-	private->opts.ptrs = calloc(nb_opts + 1, sizeof(struct lis_option_descriptor *));
-	private->opts.private = calloc(nb_opts, sizeof(struct lis_master_opt));
+	private->opts.ptrs = calloc(nb_opts.value + 1, sizeof(struct lis_option_descriptor *));
+	private->opts.private = calloc(nb_opts.value, sizeof(struct lis_master_opt));
 	if (private->opts.ptrs == NULL || private->opts.private == NULL) {
 		lis_log_error("Out of memory");
 		err = LIS_ERR_NO_MEM;
 		goto error;
 	}
 
-	for (i = 0 ; i < nb_opts ; i++) {
-		err = deserialize_option(&ptr, &private->opts.private[i], private);
+	for (i = 0 ; i < nb_opts.value ; i++) {
+		err = deserialize_option(&reply, &private->opts.private[i], private);
+		private->opts.ptrs[i] = &private->opts.private[i].parent;
 		if (LIS_IS_ERROR(err)) {
 			goto error;
 		}
-		private->opts.ptrs[i] = &private->opts.private[i].parent;
+	}
+
+	err = check_reply("get_options", &reply);
+	if (LIS_IS_ERROR(err)) {
+		goto error;
 	}
 
 	*descs = private->opts.ptrs;
-	LIS_UNLOCK();
-	return msg_out.header.err;
+	LIS_UNLOCK(&private->root->mutex);
+	return LIS_OK;
 
 error:
+	if (private->opts.ptrs != NULL) {
+		free_opts(private);
+	}
+	FREE(private->opts.msg);
 	FREE(private->opts.ptrs);
 	FREE(private->opts.private);
-	LIS_UNLOCK();
+	LIS_UNLOCK(&private->root->mutex);
 	return err;
 }
 
 
+/*!
+ * Values of options that can only be changed by software can be fetched all
+ * at once and cached until the next call that may change them.
+ */
+static bool is_cacheable(const struct lis_master_opt *opt)
+{
+	int caps = opt->parent.capabilities;
+
+	return (caps & LIS_CAP_SW_SELECT)
+		&& !(caps & (LIS_CAP_HW_SELECT | LIS_CAP_AUTOMATIC));
+}
+
+
+/*!
+ * Fetches the values of all the cacheable options of the item in a single
+ * round trip. Must be called with root->mutex held.
+ */
+static enum lis_error fetch_values(struct lis_master_item *private)
+{
+	struct lis_master_item *root = private->root;
+	struct lis_pack_buf *request = &root->channel.request;
+	struct lis_master_opt *opt;
+	struct lis_msg_value_result result;
+	struct lis_unpack_buf reply;
+	enum lis_error err;
+	int nb_values = 0;
+	int i;
+
+	for (i = 0 ; private->opts.ptrs[i] != NULL ; i++) {
+		private->opts.private[i].cached = false;
+		if (is_cacheable(&private->opts.private[i])) {
+			nb_values++;
+		}
+	}
+	FREE(private->values.msg);
+
+	if (nb_values > 0) {
+		lis_pack_buf_reset(request);
+		lis_pack_int(request, nb_values);
+		for (i = 0 ; private->opts.ptrs[i] != NULL ; i++) {
+			if (is_cacheable(&private->opts.private[i])) {
+				lis_pack_ptr(request, private->opts.private[i].remote);
+			}
+		}
+
+		err = remote_call(
+			root->worker, root->remote, LIS_MSG_ITEM_GET_VALUES,
+			"get_values", &root->channel, &reply
+		);
+		if (LIS_IS_ERROR(err)) {
+			return err;
+		}
+
+		// the string values point in the reply: we keep it
+		private->values.msg = lis_pack_buf_steal(&root->channel.reply);
+
+		for (i = 0 ; private->opts.ptrs[i] != NULL ; i++) {
+			opt = &private->opts.private[i];
+			if (!is_cacheable(opt)) {
+				continue;
+			}
+			lis_msg_value_result_unpack(&reply, &result);
+			if (LIS_IS_OK(result.err)) {
+				opt->cached_value = lis_unpack_value(
+					&reply, opt->parent.value.type
+				);
+				opt->cached = true;
+			}
+		}
+
+		err = check_reply("get_values", &reply);
+		if (LIS_IS_ERROR(err)) {
+			for (i = 0 ; private->opts.ptrs[i] != NULL ; i++) {
+				private->opts.private[i].cached = false;
+			}
+			FREE(private->values.msg);
+			return err;
+		}
+	}
+
+	private->values.generation = root->generation;
+	return LIS_OK;
+}
+
+
+/*!
+ * \retval true value has been served from the cache
+ * \retval false value must be requested to the worker (not cacheable, or
+ *   fetching it failed: the error must then come from get_value() itself)
+ */
+static bool get_cached_value(
+	struct lis_master_opt *private, union lis_value *value)
+{
+	struct lis_master_item *item = private->item;
+	char *str;
+
+	if (!is_cacheable(private)) {
+		return false;
+	}
+	if (item->values.generation != item->root->generation) {
+		fetch_values(item);
+	}
+	if (item->values.generation != item->root->generation
+			|| !private->cached) {
+		return false;
+	}
+
+	*value = private->cached_value;
+	if (private->parent.value.type == LIS_TYPE_STRING) {
+		// the string must remain valid until the next call to
+		// get_value() on this option, not until the next fetch
+		str = strdup(value->string);
+		if (str == NULL) {
+			return false;
+		}
+		FREE(private->value_msg);
+		private->value_msg = str;
+		value->string = str;
+	}
+	return true;
+}
+
+
 static enum lis_error master_opt_get_value(
 	struct lis_option_descriptor *self, union lis_value *value)
 {
 	struct lis_master_opt *private = LIS_MASTER_OPT_PRIVATE(self);
+	struct lis_master_item *root = private->item->root;
 	enum lis_error err;
-	struct lis_msg msg_in = {
-		.header = {
-			.msg_type = LIS_MSG_OPT_GET,
-			.err = LIS_OK,
-		},
-		.raw = {
-			.iov_base = &private->remote,
-			.iov_len = sizeof(private->remote),
-		},
-	};
-	struct lis_msg msg_out;
-	const void *ptr_out;
+	struct lis_unpack_buf reply;
 
-	LIS_LOCK();
+	LIS_LOCK(&root->mutex);
 
-	err = remote_call(
-		private->item->impl, "opt_get_value",
-		&msg_in, &msg_out
+	if (get_cached_value(private, value)) {
+		LIS_UNLOCK(&root->mutex);
+		return LIS_OK;
+	}
+
+	err = remote_call_on(
+		root, private->remote, LIS_MSG_OPT_GET, "opt_get_value", &reply
 	);
 	if (LIS_IS_ERROR(err)) {
-		LIS_UNLOCK();
+		LIS_UNLOCK(&root->mutex);
 		return err;
 	}
-	if (LIS_IS_ERROR(msg_out.header.err)) {
-		LIS_UNLOCK();
-		return msg_out.header.err;
-	}
-
-	FREE(private->value_msg);
 
-	ptr_out = msg_out.raw.iov_base;
-	private->value_msg = msg_out.raw.iov_base;
+	*value = lis_unpack_value(&reply, self->value.type);
+	err = check_reply("opt_get_value", &reply);
+	if (LIS_IS_OK(err) && self->value.type == LIS_TYPE_STRING) {
+		// the string points in the reply: it must remain valid until
+		// the next call to get_value() on this option
+		FREE(private->value_msg);
+		private->value_msg = lis_pack_buf_steal(&root->channel.reply);
+	}
 
-	lis_unpack(&ptr_out, "v", self->value.type, value);
-	LIS_UNLOCK();
-	return msg_out.header.err;
+	LIS_UNLOCK(&root->mutex);
+	return err;
 }
 
 
@@ -782,51 +1581,83 @@ static enum lis_error master_opt_set_value(
 	struct lis_option_descriptor *self, union lis_value value, int *set_flags)
 {
 	struct lis_master_opt *private = LIS_MASTER_OPT_PRIVATE(self);
+	struct lis_master_item *root = private->item->root;
 	enum lis_error err;
-	struct lis_msg msg_in = {
-		.header = {
-			.msg_type = LIS_MSG_OPT_SET,
-			.err = LIS_OK,
-		},
-		.raw = { 0 },
-	};
-	struct lis_msg msg_out;
-	void *ptr_in;
-	const void *ptr_out;
+	struct lis_msg_remote request = { .remote = private->remote };
+	struct lis_msg_int flags;
+	struct lis_unpack_buf reply;
+
+	LIS_LOCK(&root->mutex);
 
-	LIS_LOCK();
+	root->generation++;
 
-	msg_in.raw.iov_len = lis_compute_packed_size(
-		"pv", private->remote, self->value.type, value
+	lis_pack_buf_reset(&root->channel.request);
+	lis_msg_remote_pack(&root->channel.request, &request);
+	lis_pack_value(&root->channel.request, self->value.type, value);
+
+	err = remote_call(
+		root->worker, root->remote, LIS_MSG_OPT_SET, "opt_set_value",
+		&root->channel, &reply
 	);
-	msg_in.raw.iov_base = malloc(msg_in.raw.iov_len);
-	if (msg_in.raw.iov_base == NULL) {
-		lis_log_error("Out of memory");
-		LIS_UNLOCK();
-		return LIS_ERR_NO_MEM;
+	if (LIS_IS_ERROR(err)) {
+		LIS_UNLOCK(&root->mutex);
+		return err;
+	}
+
+	lis_msg_int_unpack(&reply, &flags);
+	*set_flags = flags.value;
+	err = check_reply("opt_set_value", &reply);
+	LIS_UNLOCK(&root->mutex);
+	return err;
+}
+
+
+static enum lis_error master_item_set_values(
+	struct lis_item *self, int nb_values,
+	struct lis_option_descriptor **opts, const union lis_value *values,
+	int *set_flags, int *nb_set)
+{
+	struct lis_master_item *private = LIS_MASTER_ITEM_PRIVATE(self);
+	struct lis_master_item *root = private->root;
+	struct lis_pack_buf *request = &root->channel.request;
+	struct lis_msg_set_values_result result;
+	struct lis_unpack_buf reply;
+	enum lis_error err;
+	int i;
+
+	*set_flags = 0;
+	*nb_set = 0;
+
+	LIS_LOCK(&root->mutex);
+
+	root->generation++;
+
+	lis_pack_buf_reset(request);
+	lis_pack_int(request, nb_values);
+	for (i = 0 ; i < nb_values ; i++) {
+		lis_pack_ptr(request, LIS_MASTER_OPT_PRIVATE(opts[i])->remote);
+		lis_pack_value(request, opts[i]->value.type, values[i]);
 	}
-	ptr_in = msg_in.raw.iov_base;
-	lis_pack(&ptr_in, "pv", private->remote, self->value.type, value);
 
 	err = remote_call(
-		private->item->impl, "opt_set_value",
-		&msg_in, &msg_out
+		root->worker, root->remote, LIS_MSG_ITEM_SET_VALUES,
+		"item_set_values", &root->channel, &reply
 	);
-	lis_protocol_msg_free(&msg_in);
 	if (LIS_IS_ERROR(err)) {
-		LIS_UNLOCK();
+		LIS_UNLOCK(&root->mutex);
 		return err;
 	}
-	if (LIS_IS_ERROR(msg_out.header.err)) {
-		LIS_UNLOCK();
-		return msg_out.header.err;
+
+	lis_msg_set_values_result_unpack(&reply, &result);
+	err = check_reply("item_set_values", &reply);
+	LIS_UNLOCK(&root->mutex);
+	if (LIS_IS_ERROR(err)) {
+		return err;
 	}
 
-	ptr_out = msg_out.raw.iov_base;
-	lis_unpack(&ptr_out, "d", set_flags);
-	lis_protocol_msg_free(&msg_out);
-	LIS_UNLOCK();
-	return msg_out.header.err;
+	*set_flags = result.set_flags;
+	*nb_set = MAX(0, MIN(result.nb_set, nb_values));
+	return result.err;
 }
 
 
@@ -835,47 +1666,43 @@ static enum lis_error master_item_scan_start(struct lis_item *self, struct lis_s
 	struct lis_master_item *private = LIS_MASTER_ITEM_PRIVATE(self);
 	struct lis_master_scan_session *session;
 	enum lis_error err;
-	struct lis_msg msg_in = {
-		.header = {
-			.msg_type = LIS_MSG_ITEM_SCAN_START,
-			.err = LIS_OK,
-		},
-		.raw = {
-			.iov_base = &private->remote,
-			.iov_len = sizeof(private->remote),
-		},
-	};
-	struct lis_msg msg_out;
-	const void *ptr_out;
+	struct lis_msg_remote remote_session;
+	struct lis_unpack_buf reply;
 
-	LIS_LOCK();
+	LIS_LOCK(&private->root->mutex);
 
-	err = remote_call(private->impl, "item_scan_start", &msg_in, &msg_out);
+	private->root->generation++;
+
+	err = remote_call_on(
+		private->root, private->remote, LIS_MSG_ITEM_SCAN_START,
+		"item_scan_start", &reply
+	);
 	if (LIS_IS_ERROR(err)) {
-		LIS_UNLOCK();
+		LIS_UNLOCK(&private->root->mutex);
 		return err;
 	}
-	if (LIS_IS_ERROR(msg_out.header.err)) {
-		LIS_UNLOCK();
-		return msg_out.header.err;
+
+	lis_msg_remote_unpack(&reply, &remote_session);
+	err = check_reply("item_scan_start", &reply);
+	if (LIS_IS_ERROR(err)) {
+		LIS_UNLOCK(&private->root->mutex);
+		return err;
 	}
 
 	session = calloc(1, sizeof(struct lis_master_scan_session));
 	if (session == NULL) {
 		lis_log_error("Out of memory");
 		// TODO: Closing session
+		LIS_UNLOCK(&private->root->mutex);
 		return LIS_ERR_NO_MEM;
 	}
 	memcpy(&session->parent, &g_master_session_template, sizeof(session->parent));
 	session->item = private;
-
-	ptr_out = msg_out.raw.iov_base;
-	lis_unpack(&ptr_out, "p", &session->remote);
+	session->remote = remote_session.remote;
 
 	*out_session = &session->parent;
-	lis_protocol_msg_free(&msg_out);
-	LIS_UNLOCK();
-	return msg_out.header.err;
+	LIS_UNLOCK(&private->root->mutex);
+	return LIS_OK;
 }
 
 
@@ -884,121 +1711,91 @@ static enum lis_error master_session_get_scan_parameters(
 	struct lis_scan_parameters *parameters)
 {
 	struct lis_master_scan_session *private = LIS_MASTER_SCAN_SESSION_PRIVATE(self);
+	struct lis_master_item *root = private->item->root;
 	enum lis_error err;
-	struct lis_msg msg_in = {
-		.header = {
-			.msg_type = LIS_MSG_SESSION_GET_SCAN_PARAMETERS,
-			.err = LIS_OK,
-		},
-		.raw = {
-			.iov_base = &private->remote,
-			.iov_len = sizeof(private->remote),
-		},
-	};
-	struct lis_msg msg_out;
+	struct lis_unpack_buf reply;
+	const void *raw;
 
-	LIS_LOCK();
+	LIS_LOCK(&root->mutex);
 
-	err = remote_call(
-		private->item->impl, "session_get_scan_parameters",
-		&msg_in, &msg_out
+	err = remote_call_on(
+		root, private->remote, LIS_MSG_SESSION_GET_SCAN_PARAMETERS,
+		"session_get_scan_parameters", &reply
 	);
 	if (LIS_IS_ERROR(err)) {
-		LIS_UNLOCK();
+		LIS_UNLOCK(&root->mutex);
 		return err;
 	}
-	if (LIS_IS_ERROR(msg_out.header.err)) {
-		LIS_UNLOCK();
-		return msg_out.header.err;
-	}
 
-	assert(msg_out.raw.iov_len == sizeof(struct lis_scan_parameters));
-	memcpy(parameters, msg_out.raw.iov_base, sizeof(*parameters));
-	lis_protocol_msg_free(&msg_out);
-	LIS_UNLOCK();
-	return msg_out.header.err;
+	raw = lis_unpack_raw(&reply, sizeof(*parameters));
+	err = check_reply("session_get_scan_parameters", &reply);
+	if (LIS_IS_OK(err)) {
+		memcpy(parameters, raw, sizeof(*parameters));
+	}
+	LIS_UNLOCK(&root->mutex);
+	return err;
 }
 
 
 static int master_session_end_of_feed(struct lis_scan_session *self)
 {
 	struct lis_master_scan_session *private = LIS_MASTER_SCAN_SESSION_PRIVATE(self);
+	struct lis_master_item *root = private->item->root;
 	enum lis_error err;
-	struct lis_msg msg_in = {
-		.header = {
-			.msg_type = LIS_MSG_SESSION_END_OF_FEED,
-			.err = LIS_OK,
-		},
-		.raw = {
-			.iov_base = &private->remote,
-			.iov_len = sizeof(private->remote),
-		},
-	};
-	struct lis_msg msg_out;
-	const void *ptr_out;
-	int r;
+	struct lis_unpack_buf reply;
+	struct lis_msg_int r;
 
-	LIS_LOCK();
+	LIS_LOCK(&root->mutex);
 
-	err = remote_call(
-		private->item->impl, "session_end_of_feed",
-		&msg_in, &msg_out
+	if (lis_ring_get_readable(root->ring) > 0) {
+		// worker has already read some data ahead
+		LIS_UNLOCK(&root->mutex);
+		return 0;
+	}
+
+	err = remote_call_on(
+		root, private->remote, LIS_MSG_SESSION_END_OF_FEED,
+		"session_end_of_feed", &reply
 	);
 	if (LIS_IS_ERROR(err)) {
-		LIS_UNLOCK();
-		return 1;
-	}
-	if (LIS_IS_ERROR(msg_out.header.err)) {
-		LIS_UNLOCK();
+		LIS_UNLOCK(&root->mutex);
 		return 1;
 	}
 
-	ptr_out = msg_out.raw.iov_base;
-	lis_unpack(&ptr_out, "i", &r);
-	lis_protocol_msg_free(&msg_out);
-	LIS_UNLOCK();
-	return r;
+	lis_msg_int_unpack(&reply, &r);
+	LIS_UNLOCK(&root->mutex);
+	return (reply.error ? 1 : r.value);
 }
 
 
 static int master_session_end_of_page(struct lis_scan_session *self)
 {
 	struct lis_master_scan_session *private = LIS_MASTER_SCAN_SESSION_PRIVATE(self);
+	struct lis_master_item *root = private->item->root;
 	enum lis_error err;
-	struct lis_msg msg_in = {
-		.header = {
-			.msg_type = LIS_MSG_SESSION_END_OF_PAGE,
-			.err = LIS_OK,
-		},
-		.raw = {
-			.iov_base = &private->remote,
-			.iov_len = sizeof(private->remote),
-		},
-	};
-	struct lis_msg msg_out;
-	const void *ptr_out;
-	int r;
+	struct lis_unpack_buf reply;
+	struct lis_msg_int r;
 
-	LIS_LOCK();
+	LIS_LOCK(&root->mutex);
 
-	err = remote_call(
-		private->item->impl, "session_end_of_page",
-		&msg_in, &msg_out
+	if (lis_ring_get_readable(root->ring) > 0) {
+		// worker has already read some data ahead
+		LIS_UNLOCK(&root->mutex);
+		return 0;
+	}
+
+	err = remote_call_on(
+		root, private->remote, LIS_MSG_SESSION_END_OF_PAGE,
+		"session_end_of_page", &reply
 	);
 	if (LIS_IS_ERROR(err)) {
-		LIS_UNLOCK();
-		return 1;
-	}
-	if (LIS_IS_ERROR(msg_out.header.err)) {
-		LIS_UNLOCK();
+		LIS_UNLOCK(&root->mutex);
 		return 1;
 	}
 
-	ptr_out = msg_out.raw.iov_base;
-	lis_unpack(&ptr_out, "i", &r);
-	lis_protocol_msg_free(&msg_out);
-	LIS_UNLOCK();
-	return r;
+	lis_msg_int_unpack(&reply, &r);
+	LIS_UNLOCK(&root->mutex);
+	return (reply.error ? 1 : r.value);
 }
 
 
@@ -1007,110 +1804,84 @@ static enum lis_error master_session_scan_read(
 	size_t *buffer_size)
 {
 	struct lis_master_scan_session *private = LIS_MASTER_SCAN_SESSION_PRIVATE(self);
+	struct lis_master_item *root = private->item->root;
+	struct lis_ring *ring = root->ring;
 	enum lis_error err;
-	struct lis_msg msg_in = {
-		.header = {
-			.msg_type = LIS_MSG_SESSION_SCAN_READ,
-			.err = LIS_OK,
-		},
-		.raw = { 0 },
+	struct lis_msg_scan_read request = {
+		.session = private->remote,
+		.buffer_size = (int)MIN(*buffer_size, (size_t)INT_MAX),
 	};
-	struct lis_msg msg_out;
-	void *ptr_in;
-
-	LIS_LOCK();
-
-	msg_in.raw.iov_len = lis_compute_packed_size(
-		"pd", private->remote, (int)(*buffer_size)
-	);
-	msg_in.raw.iov_base = malloc(msg_in.raw.iov_len);
-	if (msg_in.raw.iov_base == NULL) {
-		lis_log_error("Out of memory");
-		LIS_UNLOCK();
-		return LIS_ERR_NO_MEM;
-	}
-	ptr_in = msg_in.raw.iov_base;
-	lis_pack(&ptr_in, "pd", private->remote, (int)(*buffer_size));
-
-	err = remote_call(
-		private->item->impl, "session_scan_read",
-		&msg_in, &msg_out
-	);
-	lis_protocol_msg_free(&msg_in);
-	if (LIS_IS_ERROR(err)) {
-		LIS_UNLOCK();
-		return err;
-	}
-	if (LIS_IS_ERROR(msg_out.header.err)) {
-		LIS_UNLOCK();
-		return msg_out.header.err;
+	struct lis_unpack_buf reply;
+
+	LIS_LOCK(&root->mutex);
+
+	if (lis_ring_get_readable(ring) <= 0) {
+		// nothing read ahead by the worker yet: ask for more.
+		// The worker writes the data directly in the ring. Only
+		// the control message goes through the pipes.
+		lis_pack_buf_reset(&root->channel.request);
+		lis_msg_scan_read_pack(&root->channel.request, &request);
+		err = remote_call(
+			root->worker, root->remote, LIS_MSG_SESSION_SCAN_READ,
+			"session_scan_read", &root->channel, &reply
+		);
+		if (LIS_IS_ERROR(err)) {
+			LIS_UNLOCK(&root->mutex);
+			return err;
+		}
 	}
 
-	memcpy(
-		out_buffer, msg_out.raw.iov_base,
-		MIN((*buffer_size), msg_out.raw.iov_len)
-	);
-	*buffer_size = msg_out.raw.iov_len;
+	*buffer_size = lis_ring_read(ring, out_buffer, *buffer_size);
 
-	lis_protocol_msg_free(&msg_out);
-	LIS_UNLOCK();
-	return msg_out.header.err;
+	LIS_UNLOCK(&root->mutex);
+	return LIS_OK;
 }
 
 
 static void master_session_cancel(struct lis_scan_session *self)
 {
 	struct lis_master_scan_session *private = LIS_MASTER_SCAN_SESSION_PRIVATE(self);
-	struct lis_msg msg_in = {
-		.header = {
-			.msg_type = LIS_MSG_SESSION_CANCEL,
-			.err = LIS_OK,
-		},
-		.raw = {
-			.iov_base = &private->remote,
-			.iov_len = sizeof(private->remote),
-		},
-	};
-	struct lis_msg msg_out;
+	struct lis_master_item *root = private->item->root;
+	struct lis_unpack_buf reply;
 
-	LIS_LOCK();
+	LIS_LOCK(&root->mutex);
 
-	remote_call(private->item->impl, "scan_session_cancel", &msg_in, &msg_out);
-	lis_protocol_msg_free(&msg_out);
+	remote_call_on(
+		root, private->remote, LIS_MSG_SESSION_CANCEL,
+		"scan_session_cancel", &reply
+	);
 	FREE(private);
 
-	LIS_UNLOCK();
+	LIS_UNLOCK(&root->mutex);
 }
 
 
 static void master_item_close(struct lis_item *self)
 {
 	struct lis_master_item *private = LIS_MASTER_ITEM_PRIVATE(self);
-	struct lis_msg msg_in = {
-		.header = {
-			.msg_type = LIS_MSG_ITEM_CLOSE,
-			.err = LIS_OK,
-		},
-		.raw = {
-			.iov_base = &private->remote,
-			.iov_len = sizeof(private->remote),
-		},
-	};
-	struct lis_msg msg_out;
+	struct lis_master_item *root = private->root;
+	struct lis_unpack_buf reply;
 
-	LIS_LOCK();
+	LIS_LOCK(&root->mutex);
 
-	remote_call(private->impl, "item_close", &msg_in, &msg_out);
-	lis_protocol_msg_free(&msg_out);
+	remote_call_on(
+		root, private->remote, LIS_MSG_ITEM_CLOSE, "item_close", &reply
+	);
 
 	free_opts(private);
 	free_children(private);
 	FREE(private->msg);
-	if (private->root) {
+
+	LIS_UNLOCK(&root->mutex);
+
+	if (private == root) {
+		if (private->impl->worker_per_device) {
+			worker_stop(private->worker);
+		}
+		free_channel(&private->channel);
+		pthread_mutex_destroy(&private->mutex);
 		FREE(private);
 	}
-
-	LIS_UNLOCK();
 }
 
 
@@ -1119,8 +1890,7 @@ enum lis_error lis_api_workaround_dedicated_process(
 	)
 {
 	struct lis_master_impl *private;
-	unsigned int i;
-	int r;
+	enum lis_error err;
 
 	private = calloc(1, sizeof(struct lis_master_impl));
 	if (private == NULL) {
@@ -1129,77 +1899,37 @@ enum lis_error lis_api_workaround_dedicated_process(
 	}
 
 	private->wrapped = to_wrap;
+	private->worker_per_device = lis_getenv(
+		"LIBINSANE_WORKAROUND_DEDICATED_PROCESS_PER_DEVICE", 0
+	);
+	pthread_mutex_init(&private->mutex, NULL);
 
-	lis_log_info("Creating pipes ...");
-	for (i = 0 ; i < LIS_COUNT_OF(private->pipes.all); i++) {
-		if (pipe(private->pipes.all[i]) < 0) {
-			lis_log_error("pipe() failed: %d, %s", errno, strerror(errno));
-			goto err;
+	if (private->worker_per_device) {
+		// the launcher must be forked before any of our threads starts
+		err = launcher_start(private);
+		if (LIS_IS_ERROR(err)) {
+			pthread_mutex_destroy(&private->mutex);
+			FREE(private);
+			return err;
 		}
-		lis_log_debug(
-			"Pipe: Read: %d - Write: %d",
-			private->pipes.all[i][0], private->pipes.all[i][1]
-		);
-		configure_pipe(private->pipes.all[i]);
-	}
-
-	lis_log_info("Forking ...");
-	private->worker = fork();
-	if (private->worker < 0) {
-		lis_log_error("fork() failed: %d, %s", errno, strerror(errno));
-		goto err;
-	}
-
-	if (private->worker == 0) {
-		// we are the worker processus
-		close(private->pipes.sorted.msgs_m2w[1]);
-		private->pipes.sorted.msgs_m2w[1] = -1;
-		close(private->pipes.sorted.msgs_w2m[0]);
-		private->pipes.sorted.msgs_w2m[0] = -1;
-		close(private->pipes.sorted.logs[0]);
-		private->pipes.sorted.logs[0] = -1;
-		close(private->pipes.sorted.stderr[0]);
-		private->pipes.sorted.stderr[0] = -1;
-
-		lis_worker_main(to_wrap, &private->pipes);
-		abort(); // lis_worker_main() must never return
 	}
 
-	// we are the master processus
-	close(private->pipes.sorted.msgs_m2w[0]);
-	private->pipes.sorted.msgs_m2w[0] = -1;
-	close(private->pipes.sorted.msgs_w2m[1]);
-	private->pipes.sorted.msgs_w2m[1] = -1;
-	close(private->pipes.sorted.logs[1]);
-	private->pipes.sorted.logs[1] = -1;
-	close(private->pipes.sorted.stderr[1]);
-	private->pipes.sorted.stderr[1] = -1;
-
-	lis_log_info("Child process PID: %u", (int)private->worker);
-
-	lis_log_info("Starting log thread ...");
-	r = pthread_create(&private->log_thread, NULL, log_thread, &private->pipes);
-	if (r != 0) {
-		lis_log_warning(
-			"Failed to create log thread: %d, %s",
-			r, strerror(r)
-		);
+	err = worker_start(
+		private, (private->worker_per_device ? 0 : MAX_DEVICES),
+		&private->worker
+	);
+	if (LIS_IS_ERROR(err)) {
+		launcher_stop(private);
+		pthread_mutex_destroy(&private->mutex);
+		FREE(private);
+		return err;
 	}
 
 	memcpy(&private->parent, &g_master_impl_template, sizeof(private->parent));
 	private->parent.base_name = to_wrap->base_name;
 
+	lis_cache_add_relay(master_cache_relay, private);
+
 	*out_impl = &private->parent;
 	return LIS_OK;
-
-err:
-	for (i = 0 ; i < LIS_COUNT_OF(private->pipes.all); i++) {
-		if (private->pipes.all[i][0] > 0) {
-			close(private->pipes.all[i][0]);
-		}
-		if (private->pipes.all[i][1] > 0) {
-			close(private->pipes.all[i][1]);
-		}
-	}
-	return LIS_ERR_INTERNAL_UNKNOWN_ERROR;
 }
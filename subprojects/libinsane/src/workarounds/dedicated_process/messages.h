@@ -0,0 +1,169 @@
+#ifndef __LIBINSANE_WORKAROUND_DEDICATED_PROCESS_MESSAGES_H
+#define __LIBINSANE_WORKAROUND_DEDICATED_PROCESS_MESSAGES_H
+
+#include <stdint.h>
+
+#include "pack.h"
+
+
+/* Content of the messages exchanged between the master and the worker
+ * (see protocol.h for the header).
+ *
+ * Each layout below is a list of fields F(codec, C type, name), where codec
+ * is the suffix of the lis_pack_*() and lis_unpack_*() functions to use.
+ * LIS_MSG_DEFINE() turns each of them into a structure and a pair of
+ * encoder / decoder:
+ *
+ *   struct lis_msg_<name> { ... };
+ *   void lis_msg_<name>_pack(struct lis_pack_buf *, const struct lis_msg_<name> *);
+ *   void lis_msg_<name>_unpack(struct lis_unpack_buf *, struct lis_msg_<name> *);
+ *
+ * Decoded strings point directly in the input buffer.
+ *
+ * Any change in those layouts must come with an increment of
+ * LIS_PROTOCOL_VERSION.
+ */
+
+
+/* Most requests only carry the remote object they apply to (item, option
+ * or scan session). The reply to scan_start() carries the remote session. */
+#define LIS_MSG_LAYOUT_REMOTE(F) \
+	F(ptr, intptr_t, remote)
+
+/* list_devices() request */
+#define LIS_MSG_LAYOUT_LIST_DEVICES(F) \
+	F(int, int, locations)
+
+/* list_devices() reply: a count, and then one element per device */
+#define LIS_MSG_LAYOUT_DEVICE_DESC(F) \
+	F(str, const char *, dev_id) \
+	F(str, const char *, vendor) \
+	F(str, const char *, model) \
+	F(str, const char *, type)
+
+/* get_device() request */
+#define LIS_MSG_LAYOUT_GET_DEVICE(F) \
+	F(str, const char *, dev_id)
+
+/* get_device() reply */
+#define LIS_MSG_LAYOUT_DEVICE(F) \
+	F(str, const char *, name) \
+	F(int, int, type) \
+	F(ptr, intptr_t, remote) \
+	F(int, int, ring_idx)
+
+/* cache event request (enum lis_cache_event) */
+#define LIS_MSG_LAYOUT_CACHE_EVENT(F) \
+	F(int, int, event)
+
+/* get_children() reply: a count, and then one element per child */
+#define LIS_MSG_LAYOUT_CHILD(F) \
+	F(str, const char *, name) \
+	F(int, int, type) \
+	F(ptr, intptr_t, remote)
+
+/* get_options() reply: a count, and then one element per option. Each
+ * element is followed by its constraint (see lis_msg_constraint_pack()). */
+#define LIS_MSG_LAYOUT_OPTION(F) \
+	F(ptr, intptr_t, remote) \
+	F(str, const char *, name) \
+	F(str, const char *, title) \
+	F(str, const char *, desc) \
+	F(int, int, capabilities) \
+	F(int, int, value_type) \
+	F(int, int, unit) \
+	F(int, int, constraint_type)
+
+/* scan_read() request. Image data go through the shared memory ring. */
+#define LIS_MSG_LAYOUT_SCAN_READ(F) \
+	F(ptr, intptr_t, session) \
+	F(int, int, buffer_size)
+
+/* get_values request: a count, and then one option remote per element.
+ * get_values reply: one element per option, each followed by the value
+ * if err is LIS_OK. */
+#define LIS_MSG_LAYOUT_VALUE_RESULT(F) \
+	F(int, int, err)
+
+/* set_values request: a count, and then one option remote per element, each
+ * followed by its value. */
+
+/* set_values reply. The header error is always LIS_OK: err is the error
+ * returned by the first option that couldn't be set (nb_set is then its
+ * index). */
+#define LIS_MSG_LAYOUT_SET_VALUES_RESULT(F) \
+	F(int, int, err) \
+	F(int, int, nb_set) \
+	F(int, int, set_flags)
+
+/* Replies to end_of_feed() and end_of_page() ; set flags in the reply to
+ * set_value(). Also used for the counts preceding the lists. */
+#define LIS_MSG_LAYOUT_INT(F) \
+	F(int, int, value)
+
+
+#define LIS_MSG_FIELD_DECLARE(codec, ctype, name) ctype name;
+#define LIS_MSG_FIELD_PACK(codec, ctype, name) lis_pack_##codec(buf, msg->name);
+#define LIS_MSG_FIELD_UNPACK(codec, ctype, name) msg->name = lis_unpack_##codec(in);
+
+#define LIS_MSG_DEFINE(msg_name, LAYOUT) \
+	struct lis_msg_##msg_name { \
+		LAYOUT(LIS_MSG_FIELD_DECLARE) \
+	}; \
+	static inline void lis_msg_##msg_name##_pack( \
+			struct lis_pack_buf *buf, \
+			const struct lis_msg_##msg_name *msg \
+		) \
+	{ \
+		LAYOUT(LIS_MSG_FIELD_PACK) \
+	} \
+	static inline void lis_msg_##msg_name##_unpack( \
+			struct lis_unpack_buf *in, \
+			struct lis_msg_##msg_name *msg \
+		) \
+	{ \
+		LAYOUT(LIS_MSG_FIELD_UNPACK) \
+	}
+
+LIS_MSG_DEFINE(remote, LIS_MSG_LAYOUT_REMOTE)
+LIS_MSG_DEFINE(list_devices, LIS_MSG_LAYOUT_LIST_DEVICES)
+LIS_MSG_DEFINE(device_desc, LIS_MSG_LAYOUT_DEVICE_DESC)
+LIS_MSG_DEFINE(get_device, LIS_MSG_LAYOUT_GET_DEVICE)
+LIS_MSG_DEFINE(device, LIS_MSG_LAYOUT_DEVICE)
+LIS_MSG_DEFINE(cache_event, LIS_MSG_LAYOUT_CACHE_EVENT)
+LIS_MSG_DEFINE(child, LIS_MSG_LAYOUT_CHILD)
+LIS_MSG_DEFINE(option, LIS_MSG_LAYOUT_OPTION)
+LIS_MSG_DEFINE(scan_read, LIS_MSG_LAYOUT_SCAN_READ)
+LIS_MSG_DEFINE(value_result, LIS_MSG_LAYOUT_VALUE_RESULT)
+LIS_MSG_DEFINE(set_values_result, LIS_MSG_LAYOUT_SET_VALUES_RESULT)
+LIS_MSG_DEFINE(int, LIS_MSG_LAYOUT_INT)
+
+
+/* Option values and constraints: their layout depends on the type of
+ * the option, known by both sides. */
+
+static inline void lis_msg_constraint_pack(
+		struct lis_pack_buf *buf, const struct lis_option_descriptor *desc
+	)
+{
+	enum lis_value_type vtype = desc->value.type;
+	int i;
+
+	switch(desc->constraint.type) {
+		case LIS_CONSTRAINT_NONE:
+			return;
+		case LIS_CONSTRAINT_RANGE:
+			lis_pack_value(buf, vtype, desc->constraint.possible.range.min);
+			lis_pack_value(buf, vtype, desc->constraint.possible.range.max);
+			lis_pack_value(buf, vtype, desc->constraint.possible.range.interval);
+			return;
+		case LIS_CONSTRAINT_LIST:
+			lis_pack_int(buf, desc->constraint.possible.list.nb_values);
+			for (i = 0 ; i < desc->constraint.possible.list.nb_values ; i++) {
+				lis_pack_value(buf, vtype, desc->constraint.possible.list.values[i]);
+			}
+			return;
+	}
+}
+
+#endif
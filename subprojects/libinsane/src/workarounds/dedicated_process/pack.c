@@ -398,3 +398,70 @@ void lis_unpack(const void **in, const char *format, ...)
 
 	va_end(va.va);
 }
+
+
+#define PACK_BUF_MIN_SIZE 256
+
+
+bool lis_pack_buf_grow(struct lis_pack_buf *buf, size_t extra)
+{
+	size_t allocated;
+	uint8_t *data;
+
+	if (buf->oom) {
+		return false;
+	}
+	if (buf->size + extra <= buf->allocated) {
+		return true;
+	}
+
+	allocated = MAX(buf->allocated, PACK_BUF_MIN_SIZE);
+	while (allocated < buf->size + extra) {
+		allocated *= 2;
+	}
+
+	data = realloc(buf->data, allocated);
+	if (data == NULL) {
+		lis_log_error("Out of memory (requested: %zu)", allocated);
+		buf->oom = true;
+		return false;
+	}
+	buf->nb_allocs++;
+	buf->data = data;
+	buf->allocated = allocated;
+	return true;
+}
+
+
+void *lis_pack_raw(struct lis_pack_buf *buf, size_t size)
+{
+	void *out;
+
+	if (!lis_pack_buf_reserve(buf, size)) {
+		return NULL;
+	}
+	out = buf->data + buf->size;
+	buf->size += size;
+	return out;
+}
+
+
+void *lis_pack_buf_steal(struct lis_pack_buf *buf)
+{
+	void *data = buf->data;
+
+	buf->data = NULL;
+	buf->size = 0;
+	buf->allocated = 0;
+	buf->oom = false;
+	return data;
+}
+
+
+void lis_pack_buf_free(struct lis_pack_buf *buf)
+{
+	FREE(buf->data);
+	buf->size = 0;
+	buf->allocated = 0;
+	buf->oom = false;
+}
@@ -1,12 +1,266 @@
 #ifndef __LIBINSANE_DEDICATED_PROCESS_SERIALIZATION_H
 #define __LIBINSANE_DEDICATED_PROCESS_SERIALIZATION_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <libinsane/capi.h>
 #include <libinsane/error.h>
 
+/* Generic serialization, driven by a format string. Slow (the format is
+ * parsed on each call and the size must be computed first). lis_unpack()
+ * doesn't check anything: only for data we have just packed ourselves.
+ *
+ * The messages of the dedicated process protocol and the disk cache use the
+ * typed encoders and decoders below instead (see messages.h).
+ */
 size_t lis_compute_packed_size(const char *format, ...);
 void lis_pack(void **out_serialized, const char *format, ...);
 void lis_unpack(const void **in_serialized, const char *format, ...);
 
+
+/*!
+ * Growable output buffer. Meant to be reused from one message to the next:
+ * once it has grown to the size of the biggest message, encoding doesn't
+ * allocate anything anymore.
+ *
+ * Encoders never fail: if the buffer cannot grow, they set 'oom' and do
+ * nothing. Check it once the whole message has been encoded.
+ */
+struct lis_pack_buf
+{
+	uint8_t *data;
+	size_t size; // used
+	size_t allocated;
+	bool oom;
+
+	unsigned int nb_allocs; // number of calls to realloc(): tests only
+};
+
+/*!
+ * Input buffer. Decoders never read past 'end': if the content is
+ * truncated, they set 'error' and return zeros / empty strings.
+ */
+struct lis_unpack_buf
+{
+	const uint8_t *ptr;
+	const uint8_t *end;
+	bool error;
+};
+
+
+/*!
+ * Makes sure there is room for 'extra' more bytes.
+ * \retval false out of memory ('oom' is set)
+ */
+bool lis_pack_buf_grow(struct lis_pack_buf *buf, size_t extra);
+
+/*!
+ * Reserves 'size' bytes at the end of the buffer and returns them, so the
+ * caller can write there directly. NULL if out of memory.
+ */
+void *lis_pack_raw(struct lis_pack_buf *buf, size_t size);
+
+/*!
+ * Gives the ownership of the content to the caller, and resets the buffer.
+ * Used when the decoded message points directly in the buffer (strings are
+ * not copied) and must outlive the next message.
+ * \return must be freed with free()
+ */
+void *lis_pack_buf_steal(struct lis_pack_buf *buf);
+
+void lis_pack_buf_free(struct lis_pack_buf *buf);
+
+
+static inline void lis_pack_buf_reset(struct lis_pack_buf *buf)
+{
+	buf->size = 0;
+	buf->oom = false;
+}
+
+
+static inline bool lis_pack_buf_reserve(struct lis_pack_buf *buf, size_t extra)
+{
+	if (buf->size + extra <= buf->allocated) {
+		return true;
+	}
+	return lis_pack_buf_grow(buf, extra);
+}
+
+
+static inline void lis_pack_bytes(
+		struct lis_pack_buf *buf, const void *data, size_t size
+	)
+{
+	if (!lis_pack_buf_reserve(buf, size)) {
+		return;
+	}
+	memcpy(buf->data + buf->size, data, size);
+	buf->size += size;
+}
+
+
+static inline void lis_pack_int(struct lis_pack_buf *buf, int val)
+{
+	lis_pack_bytes(buf, &val, sizeof(val));
+}
+
+
+static inline void lis_pack_dbl(struct lis_pack_buf *buf, double val)
+{
+	lis_pack_bytes(buf, &val, sizeof(val));
+}
+
+
+static inline void lis_pack_ptr(struct lis_pack_buf *buf, intptr_t val)
+{
+	lis_pack_bytes(buf, &val, sizeof(val));
+}
+
+
+/*!
+ * NULL is packed as an empty string.
+ */
+static inline void lis_pack_str(struct lis_pack_buf *buf, const char *str)
+{
+	if (str == NULL) {
+		str = "";
+	}
+	lis_pack_bytes(buf, str, strlen(str) + 1);
+}
+
+
+static inline void lis_pack_value(
+		struct lis_pack_buf *buf, enum lis_value_type vtype,
+		union lis_value value
+	)
+{
+	switch(vtype) {
+		case LIS_TYPE_BOOL:
+		case LIS_TYPE_INTEGER:
+		case LIS_TYPE_IMAGE_FORMAT:
+			lis_pack_int(buf, value.integer);
+			return;
+		case LIS_TYPE_DOUBLE:
+			lis_pack_dbl(buf, value.dbl);
+			return;
+		case LIS_TYPE_STRING:
+			lis_pack_str(buf, value.string);
+			return;
+	}
+	// unknown type: the other side won't be able to decode it either
+	buf->oom = true;
+}
+
+
+static inline void lis_unpack_buf_init(
+		struct lis_unpack_buf *in, const void *data, size_t size
+	)
+{
+	in->ptr = data;
+	in->end = in->ptr + size;
+	in->error = false;
+}
+
+
+/*!
+ * \return pointer to the next 'size' bytes, NULL if the content is truncated
+ */
+static inline const void *lis_unpack_raw(struct lis_unpack_buf *in, size_t size)
+{
+	const void *out = in->ptr;
+
+	if ((size_t)(in->end - in->ptr) < size) {
+		in->ptr = in->end;
+		in->error = true;
+		return NULL;
+	}
+	in->ptr += size;
+	return out;
+}
+
+
+static inline int lis_unpack_int(struct lis_unpack_buf *in)
+{
+	const void *ptr = lis_unpack_raw(in, sizeof(int));
+	int val = 0;
+
+	if (ptr != NULL) {
+		memcpy(&val, ptr, sizeof(val));
+	}
+	return val;
+}
+
+
+static inline double lis_unpack_dbl(struct lis_unpack_buf *in)
+{
+	const void *ptr = lis_unpack_raw(in, sizeof(double));
+	double val = 0.0;
+
+	if (ptr != NULL) {
+		memcpy(&val, ptr, sizeof(val));
+	}
+	return val;
+}
+
+
+static inline intptr_t lis_unpack_ptr(struct lis_unpack_buf *in)
+{
+	const void *ptr = lis_unpack_raw(in, sizeof(intptr_t));
+	intptr_t val = 0;
+
+	if (ptr != NULL) {
+		memcpy(&val, ptr, sizeof(val));
+	}
+	return val;
+}
+
+
+/*!
+ * Strings are not copied: the returned pointer points in the input buffer.
+ */
+static inline const char *lis_unpack_str(struct lis_unpack_buf *in)
+{
+	const char *str = (const char *)in->ptr;
+	const uint8_t *nul = NULL;
+
+	if (in->ptr < in->end) {
+		nul = memchr(in->ptr, '\0', in->end - in->ptr);
+	}
+	if (nul == NULL) {
+		in->ptr = in->end;
+		in->error = true;
+		return "";
+	}
+	in->ptr = nul + 1;
+	return str;
+}
+
+
+static inline union lis_value lis_unpack_value(
+		struct lis_unpack_buf *in, enum lis_value_type vtype
+	)
+{
+	union lis_value value;
+
+	memset(&value, 0, sizeof(value));
+	switch(vtype) {
+		case LIS_TYPE_BOOL:
+		case LIS_TYPE_INTEGER:
+		case LIS_TYPE_IMAGE_FORMAT:
+			value.integer = lis_unpack_int(in);
+			return value;
+		case LIS_TYPE_DOUBLE:
+			value.dbl = lis_unpack_dbl(in);
+			return value;
+		case LIS_TYPE_STRING:
+			value.string = lis_unpack_str(in);
+			return value;
+	}
+	in->error = true;
+	return value;
+}
+
 #endif
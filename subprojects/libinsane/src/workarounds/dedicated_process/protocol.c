@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <libinsane/log.h>
@@ -22,6 +23,10 @@ static enum lis_error lis_read(int fd, void *buf, size_t count)
 
 	do {
 		r = read(fd, buf, count - total);
+		if (r == 0 && total == 0) {
+			// end of file: the other process has stopped
+			return LIS_ERR_IO_ERROR;
+		}
 		if (r <= 0) {
 			// do not use lis_log_*() here : socket is probably
 			// dead
@@ -43,35 +48,51 @@ static enum lis_error lis_read(int fd, void *buf, size_t count)
 }
 
 
-static enum lis_error lis_write(int fd, const void *buf, size_t count)
+/*!
+ * Writes all the buffers at once: a message and its header always go in a
+ * single system call, unless the pipe is full.
+ */
+static enum lis_error lis_writev(int fd, struct iovec *iov, int iovcnt)
 {
 	ssize_t w;
-	size_t total = 0;
+	size_t count = 0, total = 0;
+	int i;
 
-	do {
-		w = write(fd, buf, count - total);
+	for (i = 0 ; i < iovcnt ; i++) {
+		count += iov[i].iov_len;
+	}
+
+	while (total < count) {
+		w = writev(fd, iov, iovcnt);
 		if (w <= 0) {
 			// do not use lis_log_*() here : socket is probably
 			// dead
 			fprintf(
 				stderr,
-				"write() failed: fd=%d, w=%zd, written=%zd, expected=%zd; %d, %s",
-				fd, w, count, total, errno, strerror(errno)
+				"writev() failed: fd=%d, w=%zd, written=%zd, expected=%zd; %d, %s",
+				fd, w, total, count, errno, strerror(errno)
 			);
 			return LIS_ERR_IO_ERROR;
 		}
-		buf += w;
 		total += w;
-	} while(total < count);
 
-#ifdef PROTOCOL_DEBUG
-	lis_hexdump("write", buf, w);
-#endif
+		// skip what has already been written
+		while (iovcnt > 0 && (size_t)w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+
 	return LIS_OK;
 }
 
 
-enum lis_error lis_protocol_msg_read(int fd, struct lis_msg *msg)
+enum lis_error lis_protocol_msg_read_header(int fd, struct lis_msg *msg)
 {
 	enum lis_error err;
 
@@ -81,58 +102,88 @@ enum lis_error lis_protocol_msg_read(int fd, struct lis_msg *msg)
 	if (LIS_IS_ERROR(err)) {
 		return err;
 	}
-	if (LIS_IS_ERROR(msg->header.err)) {
-		return msg->header.err;
+	if (msg->header.version != LIS_PROTOCOL_VERSION) {
+		lis_log_error(
+			"Unexpected protocol version: %u (expected: %u)",
+			msg->header.version, LIS_PROTOCOL_VERSION
+		);
+		return LIS_ERR_IO_ERROR;
 	}
 
-	err = lis_read(fd, &msg->raw.iov_len, sizeof(msg->raw.iov_len));
-	if (LIS_IS_ERROR(err)) {
-		return err;
-	}
+	return LIS_OK;
+}
 
-	if (msg->raw.iov_len > 0) {
-		msg->raw.iov_base = malloc(msg->raw.iov_len);
-		if (msg->raw.iov_base == NULL) {
-			lis_log_error(
-				"Out of memory (requested: %zu)\n", msg->raw.iov_len
-			);
-			return LIS_ERR_NO_MEM;
-		}
 
-		err = lis_read(fd, msg->raw.iov_base, msg->raw.iov_len);
+static enum lis_error skip_content(int fd, size_t size)
+{
+	uint8_t buf[256];
+	size_t s;
+	enum lis_error err;
+
+	while (size > 0) {
+		s = MIN(size, sizeof(buf));
+		err = lis_read(fd, buf, s);
 		if (LIS_IS_ERROR(err)) {
 			return err;
 		}
+		size -= s;
 	}
-
 	return LIS_OK;
 }
 
-enum lis_error lis_protocol_msg_write(int fd, const struct lis_msg *msg)
+
+enum lis_error lis_protocol_msg_read_content(
+		int fd, struct lis_msg *msg, struct lis_pack_buf *buf
+	)
 {
 	enum lis_error err;
+	void *content;
 
-	err = lis_write(fd, &msg->header, sizeof(msg->header));
-	if (LIS_IS_ERROR(err)) {
-		return err;
-	}
-	if (LIS_IS_ERROR(msg->header.err)) {
+	lis_pack_buf_reset(buf);
+	msg->raw.iov_base = NULL;
+	msg->raw.iov_len = 0;
+
+	if (msg->header.size <= 0) {
 		return LIS_OK;
 	}
 
-	err = lis_write(fd, &msg->raw.iov_len, sizeof(msg->raw.iov_len));
+	content = lis_pack_raw(buf, msg->header.size);
+	if (content == NULL) {
+		err = skip_content(fd, msg->header.size);
+		return (LIS_IS_ERROR(err) ? err : LIS_ERR_NO_MEM);
+	}
+
+	err = lis_read(fd, content, msg->header.size);
 	if (LIS_IS_ERROR(err)) {
 		return err;
 	}
 
-	if (msg->raw.iov_len > 0) {
-		err = lis_write(fd, msg->raw.iov_base, msg->raw.iov_len);
-		if (LIS_IS_ERROR(err)) {
-			return err;
-		}
+	msg->raw.iov_base = content;
+	msg->raw.iov_len = msg->header.size;
+	return LIS_OK;
+}
+
+
+enum lis_error lis_protocol_msg_write(int fd, const struct lis_msg *msg)
+{
+	struct lis_msg header;
+	struct iovec iov[2];
+	int iovcnt = 1;
+
+	header.header = msg->header;
+	header.header.version = LIS_PROTOCOL_VERSION;
+	header.header.size = 0;
+
+	iov[0].iov_base = &header.header;
+	iov[0].iov_len = sizeof(header.header);
+
+	if (LIS_IS_OK(msg->header.err) && msg->raw.iov_len > 0) {
+		header.header.size = msg->raw.iov_len;
+		iov[1] = msg->raw;
+		iovcnt = 2;
 	}
 
-	return LIS_OK;
+	return lis_writev(fd, iov, iovcnt);
 }
 
 
@@ -338,12 +389,6 @@ enum lis_error lis_protocol_log_read(struct lis_pipes *pipes, enum lis_log_level
 
 
 
-void lis_protocol_msg_free(struct lis_msg *msg)
-{
-	FREE(msg->raw.iov_base);
-}
-
-
 void lis_protocol_close(struct lis_pipes *pipes)
 {
 	unsigned int i;
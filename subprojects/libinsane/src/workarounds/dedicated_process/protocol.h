@@ -10,27 +10,47 @@
 #include <libinsane/error.h>
 #include <libinsane/log.h>
 
+#include "pack.h"
+
 
 /* Both processes communicate through a pipe. Since both processes run
  * on the same host, we don't have to worry about annoying details things like
  * structure padding.
  *
  * All messages starts with:
+ * - uint32_t : version (LIS_PROTOCOL_VERSION)
  * - enum lis_msg_type : message_type
  * - enum lis_error : LIS_OK unless an error occured
- * - size_t : message_size if lis_error == LIS_OK
+ * - uint32_t : request_id
+ * - intptr_t : device
+ * - size_t : message_size (0 if lis_error != LIS_OK)
+ *
+ * The content of each type of message is described in messages.h.
+ *
+ * Several calls may be in flight at the same time (one per device at most):
+ * replies are not necessarily sent in the order of the requests. The
+ * worker copies the request ID of each request in its reply.
  */
 
+/* Must be incremented on any change in the header or in messages.h */
+#define LIS_PROTOCOL_VERSION 4
+
 enum lis_msg_type
 {
 	LIS_MSG_API_CLEANUP = 0,
 	LIS_MSG_API_LIST_DEVICES,
 	LIS_MSG_API_GET_DEVICE,
+	/* lis_workaround_cache_invalidate_devices() and
+	 * lis_workaround_cache_hotplug() (see workarounds/cache.h) */
+	LIS_MSG_API_CACHE_EVENT,
 
 	LIS_MSG_ITEM_GET_CHILDREN,
 	LIS_MSG_ITEM_GET_OPTIONS,
 	LIS_MSG_ITEM_SCAN_START,
 	LIS_MSG_ITEM_CLOSE,
+	/* batched option calls: one round trip for many options */
+	LIS_MSG_ITEM_GET_VALUES,
+	LIS_MSG_ITEM_SET_VALUES,
 
 	LIS_MSG_OPT_GET,
 	LIS_MSG_OPT_SET,
@@ -46,13 +66,27 @@ enum lis_msg_type
 struct lis_msg
 {
 	struct {
+		uint32_t version; /* set by lis_protocol_msg_write() */
 		enum lis_msg_type msg_type;
 		enum lis_error err;
+		uint32_t request_id; /* set by the master, copied in the reply */
+		/* root item (worker side) the call applies to ; 0 for API
+		 * calls (list_devices(), get_device(), cleanup(), ...). The worker
+		 * runs the calls of each device in a dedicated thread. */
+		intptr_t device;
+		size_t size; /* set by lis_protocol_msg_write() */
 	} header;
 
 	struct iovec raw;
 };
 
+/*!
+ * Identifies a request in the traces of both the master and the worker.
+ * Request IDs are only unique for a given worker.
+ */
+#define LIS_PROTOCOL_TRACE_ID(worker_pid, request_id) \
+	((((uint64_t)(worker_pid)) << 32) | (uint64_t)(request_id))
+
 
 struct lis_pipes
 {
@@ -77,23 +111,41 @@ struct lis_pipes
 
 
 /*!
- * Reads a struct lis_msg from the specified pipe file descriptor.
- * Takes care of deserializing the content.
+ * Reads the header of a message from the specified pipe file descriptor.
+ * The content must then be read with lis_protocol_msg_read_content().
  *
  * \param[in] fd file descriptor from which to read
- * \param[out] out_msg raw message
+ * \param[out] out_msg message. Errors returned by the remote call are in
+ *   out_msg->header.err.
+ * \return an error only if the message couldn't be read, or if it comes
+ *   from a different version of the protocol.
+ */
+enum lis_error lis_protocol_msg_read_header(int fd, struct lis_msg *out_msg);
+
+
+/*!
+ * Reads the content of a message whose header has just been read.
  *
- * Read message must be freed with lis_msg_free(msg);
+ * \param[in] fd file descriptor from which to read
+ * \param[in,out] msg message. msg->raw points to the content, in buf.
+ * \param[in] buf buffer where the content is read. Reset first. Meant to be
+ *   reused from one message to the next: once it has grown big enough,
+ *   reading messages doesn't allocate anything anymore.
+ * \retval LIS_ERR_NO_MEM buf couldn't grow enough: the content has been
+ *   skipped, and the next message can be read.
  */
-enum lis_error lis_protocol_msg_read(int fd, struct lis_msg *out_msg);
+enum lis_error lis_protocol_msg_read_content(
+	int fd, struct lis_msg *msg, struct lis_pack_buf *buf
+);
 
 
 /*!
- * Writes a message to the specified pipe file descriptor.
- * Takes care of serializing the content.
+ * Writes a message (header and content at once) to the specified pipe file
+ * descriptor.
  *
  * \param[in] fd file descriptor on which the message must be written
- * \param[in] in_msg raw message
+ * \param[in] in_msg raw message. Content is not sent if
+ *   in_msg->header.err is an error.
  */
 enum lis_error lis_protocol_msg_write(int fd, const struct lis_msg *in_msg);
 
@@ -114,8 +166,6 @@ enum lis_error lis_protocol_log_write(struct lis_pipes *pipes, enum lis_log_leve
  */
 enum lis_error lis_protocol_log_read(struct lis_pipes *pipes, enum lis_log_level *lvl, const char **msg);
 
-void lis_protocol_msg_free(struct lis_msg *msg);
-
 /*!
  * Closes all the pipes
  */
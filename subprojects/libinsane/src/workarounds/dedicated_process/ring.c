@@ -0,0 +1,101 @@
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <libinsane/log.h>
+#include <libinsane/util.h>
+
+#include "ring.h"
+
+
+struct lis_ring *lis_ring_new(size_t size)
+{
+	struct lis_ring *ring;
+
+	ring = mmap(
+		NULL, sizeof(struct lis_ring) + size,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (ring == MAP_FAILED) {
+		lis_log_error(
+			"mmap(%zu) failed: %d, %s", size, errno, strerror(errno)
+		);
+		return NULL;
+	}
+
+	ring->size = size;
+	ring->head = 0;
+	ring->tail = 0;
+	return ring;
+}
+
+
+void lis_ring_free(struct lis_ring *ring)
+{
+	if (munmap(ring, sizeof(struct lis_ring) + ring->size) < 0) {
+		lis_log_warning("munmap() failed: %d, %s", errno, strerror(errno));
+	}
+}
+
+
+void lis_ring_reset(struct lis_ring *ring)
+{
+	__atomic_store_n(&ring->tail, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, 0, __ATOMIC_RELEASE);
+}
+
+
+size_t lis_ring_get_readable(const struct lis_ring *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)
+		- __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+}
+
+
+size_t lis_ring_read(struct lis_ring *ring, void *out_buffer, size_t buffer_size)
+{
+	size_t head, tail;
+	size_t pos, nb;
+	size_t total = 0;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	buffer_size = MIN(buffer_size, head - tail);
+
+	while (total < buffer_size) {
+		// at most 2 iterations: before and after the end of data[]
+		pos = (tail + total) % ring->size;
+		nb = MIN(buffer_size - total, ring->size - pos);
+		memcpy(((uint8_t *)out_buffer) + total, ring->data + pos, nb);
+		total += nb;
+	}
+
+	__atomic_store_n(&ring->tail, tail + total, __ATOMIC_RELEASE);
+	return total;
+}
+
+
+void *lis_ring_get_writable(struct lis_ring *ring, size_t *size)
+{
+	size_t head, tail;
+	size_t pos;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	assert(head - tail <= ring->size);
+
+	pos = head % ring->size;
+	*size = MIN(ring->size - (head - tail), ring->size - pos);
+	return ring->data + pos;
+}
+
+
+void lis_ring_commit(struct lis_ring *ring, size_t size)
+{
+	size_t head;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	__atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+}
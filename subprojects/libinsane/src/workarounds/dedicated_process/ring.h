@@ -0,0 +1,66 @@
+#ifndef __LIBINSANE_WORKAROUND_DEDICATED_PROCESS_RING_H
+#define __LIBINSANE_WORKAROUND_DEDICATED_PROCESS_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* Ring buffer in shared memory. Used to transfer the image data from the
+ * worker to the master without copying them through the pipes: the worker
+ * gives the ring memory directly to scan_read(), the pipes only carry the
+ * control messages.
+ *
+ * The mapping is created before fork(), so both processes see the same
+ * memory. There is exactly one producer (the worker) and one consumer (the
+ * master). Positions are monotonic counters (never wrapped) and are
+ * updated atomically: no lock is required.
+ */
+struct lis_ring
+{
+	size_t size; /* size of data[] */
+	size_t head; /* bytes written so far ; only updated by the producer */
+	size_t tail; /* bytes read so far ; only updated by the consumer */
+	uint8_t data[];
+};
+
+
+/*!
+ * Allocates a ring in memory shared with the processes that will be forked
+ * afterwards.
+ *
+ * \return NULL if the allocation failed.
+ */
+struct lis_ring *lis_ring_new(size_t size);
+
+void lis_ring_free(struct lis_ring *ring);
+
+/*!
+ * Drops the content of the ring.
+ * Producer and consumer must both be idle: the caller must have
+ * synchronized them by other means (ex: waiting for a message reply).
+ */
+void lis_ring_reset(struct lis_ring *ring);
+
+
+/* Consumer */
+
+size_t lis_ring_get_readable(const struct lis_ring *ring);
+
+/*!
+ * \return number of bytes actually copied in out_buffer.
+ */
+size_t lis_ring_read(struct lis_ring *ring, void *out_buffer, size_t buffer_size);
+
+
+/* Producer */
+
+/*!
+ * \param[out] size size of the contiguous free space returned.
+ * \return pointer to where the data can be written. Nothing is available
+ *   until \ref lis_ring_commit() is called.
+ */
+void *lis_ring_get_writable(struct lis_ring *ring, size_t *size);
+
+void lis_ring_commit(struct lis_ring *ring, size_t size);
+
+#endif
@@ -1,17 +1,26 @@
+#include <assert.h>
 #include <errno.h>
 #include <execinfo.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 
 #include <libinsane/log.h>
 #include <libinsane/util.h>
+#include <libinsane/workarounds.h>
 
+#include "../../trace_events.h"
+#include "../cache.h"
+#include "messages.h"
 #include "pack.h"
+#include "ring.h"
 #include "worker.h"
 
 // #define DISABLE_CRASH_HANDLER
@@ -20,20 +29,113 @@
 
 
 /* when lis_worker_main() is called, we just forked and we are in the child
- * process. So there cannot be any other thread. Therefore using global
- * variables here is actually safe.
+ * process. The main thread only reads the requests from the master. It hands
+ * over the API calls (list_devices(), get_device(), cleanup()) to the API
+ * thread, and all the other calls to the thread of the device they apply to.
+ * A slow list_devices() therefore doesn't delay the calls on the devices
+ * already opened.
+ *
+ * The wrapped implementations were written for a single thread: they keep
+ * track of the opened devices (base wrapper roots, workaround cache, ...)
+ * without any locking. API calls and item close() are therefore serialized
+ * with g_api_mutex. Only the calls on different opened devices run in
+ * parallel.
  */
 
 static struct lis_api *g_wrapped;
 static struct lis_pipes *g_pipes;
 
+static struct lis_ring **g_rings;
+static int g_nb_rings;
+static bool *g_rings_used; // protected by g_mutex
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER; // + g_devices
+
+/* serializes the calls that open or close items, and the API calls */
+static pthread_mutex_t g_api_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* replies from the device threads and from the API thread are written on
+ * the same pipe */
+static pthread_mutex_t g_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define READ_AHEAD_CHUNK (256 * 1024)
+#define READ_AHEAD_WAIT_TIMEOUT 10 // ms ; when the ring is full
+
+
+/* Requests are recycled: once processed, they go back to the free list of
+ * their device with their buffer. Once the buffers have grown big enough,
+ * requests don't allocate anything anymore. */
+struct lis_worker_request
+{
+	struct lis_msg msg; // content points in 'content'
+	struct lis_pack_buf content;
+	bool last; // root item close: the device thread must stop afterwards
+	struct lis_worker_request *next;
+};
+
+
+/* An opened root item and the thread running all the calls related to it.
+ * The API thread uses the same structure, without item nor ring. */
+struct lis_worker_device
+{
+	struct lis_item *item; // NULL for the API thread
+	struct lis_ring *ring;
+	int ring_idx;
+	pthread_t thread;
+
+	pthread_mutex_t mutex; // protects the queue and the free requests
+	pthread_cond_t cond;
+	struct {
+		struct lis_worker_request *first;
+		struct lis_worker_request *last;
+	} queue;
+	struct lis_worker_request *free_requests;
+
+	struct lis_pack_buf reply; // only used by the device thread
+
+	/* While the master process is busy with the data already in the
+	 * ring, the device thread keeps reading the current page into it.
+	 * Only used by the device thread.
+	 */
+	struct {
+		struct lis_scan_session *session; // session owning the ring content
+		bool active; // false once the end of the page has been reached
+		enum lis_error err; // reported on the next scan_read request
+	} read_ahead;
+
+	struct lis_worker_device *next; // protected by g_mutex
+};
+
+static struct lis_worker_device *g_devices = NULL; // protected by g_mutex
+static struct lis_worker_device *g_api = NULL;
+
+
+#define LIS_LOCK(mutex) do { \
+		int __pthread_r; \
+		__pthread_r = pthread_mutex_lock(mutex); \
+		assert(__pthread_r == 0); \
+	} while(0)
+
+#define LIS_UNLOCK(mutex) do { \
+		int __pthread_r; \
+		__pthread_r = pthread_mutex_unlock(mutex); \
+		assert(__pthread_r == 0); \
+	} while(0)
+
 
 #ifndef DISABLE_REDIRECT_LOGS
 static lis_log_callback worker_log_callback;
 #endif
 
 
-typedef enum lis_error (lis_execute)(struct lis_msg *msg_in, struct lis_msg *msg_out);
+/*!
+ * Decodes the request in 'in', runs the call, and encodes the content of
+ * the reply in 'out'.
+ * \return error reported to the master (no content is sent back then)
+ */
+typedef enum lis_error (lis_execute)(
+	struct lis_worker_device *device,
+	struct lis_unpack_buf *in, struct lis_pack_buf *out
+);
 
 
 #ifndef DISABLE_CRASH_HANDLER
@@ -60,13 +162,23 @@ static const struct lis_log_callbacks g_log_callbacks = {
 #endif
 
 
+static enum lis_error device_new(
+	struct lis_item *item, struct lis_worker_device **out
+);
+static enum lis_error device_start(struct lis_worker_device *device);
+static void device_free(struct lis_worker_device *device);
+
+
 static lis_execute execute_cleanup;
 static lis_execute execute_list_devices;
 static lis_execute execute_get_device;
+static lis_execute execute_cache_event;
 static lis_execute execute_item_get_children;
 static lis_execute execute_item_get_options;
 static lis_execute execute_item_scan_start;
 static lis_execute execute_item_close;
+static lis_execute execute_item_get_values;
+static lis_execute execute_item_set_values;
 static lis_execute execute_opt_get;
 static lis_execute execute_opt_set;
 static lis_execute execute_session_get_scan_parameters;
@@ -89,6 +201,9 @@ static const struct {
 	[LIS_MSG_API_GET_DEVICE] = {
 		.name = "get_device", .callback = execute_get_device,
 	},
+	[LIS_MSG_API_CACHE_EVENT] = {
+		.name = "cache_event", .callback = execute_cache_event,
+	},
 	[LIS_MSG_ITEM_GET_CHILDREN] = {
 		.name = "item_get_children", .callback = execute_item_get_children,
 	},
@@ -101,6 +216,12 @@ static const struct {
 	[LIS_MSG_ITEM_CLOSE] = {
 		.name = "item_close", .callback = execute_item_close,
 	},
+	[LIS_MSG_ITEM_GET_VALUES] = {
+		.name = "item_get_values", .callback = execute_item_get_values,
+	},
+	[LIS_MSG_ITEM_SET_VALUES] = {
+		.name = "item_set_values", .callback = execute_item_set_values,
+	},
 	[LIS_MSG_OPT_GET] = {
 		.name = "opt_get", .callback = execute_opt_get,
 	},
@@ -184,517 +305,1001 @@ static void crash_handler(int sig) {
 #endif
 
 
-static enum lis_error execute_cleanup(struct lis_msg *msg_in, struct lis_msg *msg_out)
+static enum lis_error execute_cleanup(
+		struct lis_worker_device *device,
+		struct lis_unpack_buf *in, struct lis_pack_buf *out
+	)
 {
-	LIS_UNUSED(msg_in);
-	LIS_UNUSED(msg_out);
+	LIS_UNUSED(device);
+	LIS_UNUSED(in);
+	LIS_UNUSED(out);
 	// Nothing to do
 	return LIS_OK;
 }
 
 
-static enum lis_error execute_list_devices(struct lis_msg *msg_in, struct lis_msg *msg_out)
+static enum lis_error execute_list_devices(
+		struct lis_worker_device *device,
+		struct lis_unpack_buf *in, struct lis_pack_buf *out
+	)
 {
-	enum lis_device_locations *locs;
+	struct lis_msg_list_devices request;
+	struct lis_msg_int nb_devs;
+	struct lis_msg_device_desc desc;
 	struct lis_device_descriptor **descs = NULL;
+	enum lis_error err;
 	int i;
-	void *ptr;
 
-	locs = msg_in->raw.iov_base;
+	LIS_UNUSED(device);
+
+	lis_msg_list_devices_unpack(in, &request);
 
-	msg_out->header.err = g_wrapped->list_devices(g_wrapped, *locs, &descs);
-	if (LIS_IS_ERROR(msg_out->header.err)) {
-		return msg_out->header.err;
+	LIS_LOCK(&g_api_mutex);
+	err = g_wrapped->list_devices(g_wrapped, request.locations, &descs);
+	if (LIS_IS_ERROR(err)) {
+		LIS_UNLOCK(&g_api_mutex);
+		return err;
 	}
 
-	msg_out->raw.iov_len = lis_compute_packed_size("i", 0);
+	for (nb_devs.value = 0 ; descs[nb_devs.value] != NULL ; nb_devs.value++) { }
+	lis_msg_int_pack(out, &nb_devs);
+
 	for (i = 0 ; descs[i] != NULL ; i++) {
-		msg_out->raw.iov_len += lis_compute_packed_size(
-			"ssss",
-			descs[i]->dev_id,
-			descs[i]->vendor,
-			descs[i]->model,
-			descs[i]->type
-		);
+		desc.dev_id = descs[i]->dev_id;
+		desc.vendor = descs[i]->vendor;
+		desc.model = descs[i]->model;
+		desc.type = descs[i]->type;
+		lis_msg_device_desc_pack(out, &desc);
 	}
+	LIS_UNLOCK(&g_api_mutex);
 
-	msg_out->raw.iov_base = malloc(msg_out->raw.iov_len);
-	if (msg_out->raw.iov_base == NULL) {
-		lis_log_error("Out of memory");
-		return LIS_ERR_NO_MEM;
+	return err;
+}
+
+
+static enum lis_error execute_get_device(
+		struct lis_worker_device *device,
+		struct lis_unpack_buf *in, struct lis_pack_buf *out
+	)
+{
+	struct lis_msg_get_device request;
+	struct lis_msg_device reply;
+	struct lis_item *item = NULL;
+	enum lis_error err;
+
+	assert(device == NULL); // API call
+
+	lis_msg_get_device_unpack(in, &request);
+	if (in->error) {
+		return LIS_ERR_INVALID_VALUE;
 	}
-	ptr = msg_out->raw.iov_base;
 
-	lis_pack(&ptr, "i", i);
+	LIS_LOCK(&g_api_mutex);
+	err = g_wrapped->get_device(g_wrapped, request.dev_id, &item);
+	if (LIS_IS_ERROR(err)) {
+		LIS_UNLOCK(&g_api_mutex);
+		return err;
+	}
 
-	for (i = 0 ; descs[i] != NULL ; i++) {
-		lis_pack(
-			&ptr, "ssss",
-			descs[i]->dev_id,
-			descs[i]->vendor,
-			descs[i]->model,
-			descs[i]->type
-		);
+	err = device_new(item, &device);
+	if (LIS_IS_ERROR(err)) {
+		goto error;
+	}
+
+	reply.name = item->name;
+	reply.type = item->type;
+	reply.remote = (intptr_t)item;
+	reply.ring_idx = device->ring_idx;
+	lis_msg_device_pack(out, &reply);
+	if (out->oom) {
+		device_free(device);
+		err = LIS_ERR_NO_MEM;
+		goto error;
 	}
 
+	err = device_start(device);
+	if (LIS_IS_ERROR(err)) {
+		device_free(device);
+		goto error;
+	}
+
+	LIS_UNLOCK(&g_api_mutex);
 	return LIS_OK;
+
+error:
+	item->close(item);
+	LIS_UNLOCK(&g_api_mutex);
+	return err;
 }
 
 
-static enum lis_error execute_get_device(struct lis_msg *msg_in, struct lis_msg *msg_out)
+static enum lis_error execute_cache_event(
+		struct lis_worker_device *device,
+		struct lis_unpack_buf *in, struct lis_pack_buf *out
+	)
 {
-	struct lis_item *item = NULL;
-	void *ptr;
+	struct lis_msg_cache_event request;
 
-	msg_out->header.err = g_wrapped->get_device(g_wrapped, msg_in->raw.iov_base, &item);
-	if (LIS_IS_ERROR(msg_out->header.err)) {
-		return msg_out->header.err;
-	}
+	assert(device == NULL); // API call
+	LIS_UNUSED(out);
 
-	msg_out->raw.iov_len = lis_compute_packed_size(
-		"sdp", item->name, item->type, item
-	);
-	msg_out->raw.iov_base = malloc(msg_out->raw.iov_len);
-	if (msg_out->raw.iov_base == NULL) {
-		lis_log_error("Out of memory");
-		item->close(item);
-		return LIS_ERR_NO_MEM;
+	lis_msg_cache_event_unpack(in, &request);
+	if (in->error) {
+		return LIS_ERR_INVALID_VALUE;
 	}
-	ptr = msg_out->raw.iov_base;
 
-	lis_pack(&ptr, "sdp", item->name, item->type, item);
+	// instances of workaround_cache in this process have their own locks
+	switch(request.event) {
+		case LIS_CACHE_INVALIDATE_DEVICES:
+			lis_workaround_cache_invalidate_devices();
+			return LIS_OK;
+		case LIS_CACHE_HOTPLUG:
+			lis_workaround_cache_hotplug();
+			return LIS_OK;
+	}
 
-	return LIS_OK;
+	lis_log_error("Unknown cache event: %d", request.event);
+	return LIS_ERR_INVALID_VALUE;
 }
 
 
-static enum lis_error execute_item_close(struct lis_msg *msg_in, struct lis_msg *msg_out)
+static enum lis_error execute_item_close(
+		struct lis_worker_device *device,
+		struct lis_unpack_buf *in, struct lis_pack_buf *out
+	)
 {
+	struct lis_msg_remote request;
 	struct lis_item *item;
-	const void *ptr = msg_in->raw.iov_base;
 
-	LIS_UNUSED(msg_out);
+	LIS_UNUSED(device);
+	LIS_UNUSED(out);
 
-	lis_unpack(&ptr, "p", &item);
+	lis_msg_remote_unpack(in, &request);
+	item = (struct lis_item *)request.remote;
 
+	// runs on the device thread, while other devices may be opened or
+	// closed by other threads
+	LIS_LOCK(&g_api_mutex);
 	item->close(item);
+	LIS_UNLOCK(&g_api_mutex);
 	return LIS_OK;
 }
 
 
-static enum lis_error execute_item_get_children(struct lis_msg *msg_in, struct lis_msg *msg_out)
+static enum lis_error execute_item_get_children(
+		struct lis_worker_device *device,
+		struct lis_unpack_buf *in, struct lis_pack_buf *out
+	)
 {
+	struct lis_msg_remote request;
+	struct lis_msg_int nb_children;
+	struct lis_msg_child child;
 	struct lis_item *item;
 	struct lis_item **children;
+	enum lis_error err;
 	int i;
-	const void *ptr_in;
-	void *ptr_out;
 
-	ptr_in = msg_in->raw.iov_base;
-	lis_unpack(&ptr_in, "p", &item);
+	LIS_UNUSED(device);
+
+	lis_msg_remote_unpack(in, &request);
+	item = (struct lis_item *)request.remote;
 
-	msg_out->header.err = item->get_children(item, &children);
-	if (LIS_IS_ERROR(msg_out->header.err)) {
-		return msg_out->header.err;
+	err = item->get_children(item, &children);
+	if (LIS_IS_ERROR(err)) {
+		return err;
 	}
 
-	msg_out->raw.iov_len = lis_compute_packed_size("i", 0);
+	for (nb_children.value = 0 ; children[nb_children.value] != NULL ; nb_children.value++) { }
+	lis_msg_int_pack(out, &nb_children);
+
 	for (i = 0 ; children[i] != NULL ; i++) {
-		msg_out->raw.iov_len += lis_compute_packed_size(
-			"sdp",
-			children[i]->name,
-			children[i]->type,
-			children[i]
-		);
+		child.name = children[i]->name;
+		child.type = children[i]->type;
+		child.remote = (intptr_t)children[i];
+		lis_msg_child_pack(out, &child);
 	}
 
-	msg_out->raw.iov_base = malloc(msg_out->raw.iov_len);
-	if (msg_out->raw.iov_base == NULL) {
-		lis_log_error("Out of memory");
-		return LIS_ERR_NO_MEM;
+	return err;
+}
+
+
+static enum lis_error execute_item_get_options(
+		struct lis_worker_device *device,
+		struct lis_unpack_buf *in, struct lis_pack_buf *out
+	)
+{
+	struct lis_msg_remote request;
+	struct lis_msg_int nb_opts;
+	struct lis_msg_option opt;
+	struct lis_item *item;
+	struct lis_option_descriptor **descs;
+	enum lis_error err;
+	int i;
+
+	LIS_UNUSED(device);
+
+	lis_msg_remote_unpack(in, &request);
+	item = (struct lis_item *)request.remote;
+
+	err = item->get_options(item, &descs);
+	if (LIS_IS_ERROR(err)) {
+		return err;
 	}
-	ptr_out = msg_out->raw.iov_base;
 
-	lis_pack(&ptr_out, "i", i);
-	for (i = 0 ; children[i] != NULL ; i++) {
-		lis_pack(
-			&ptr_out, "sdp",
-			children[i]->name,
-			children[i]->type,
-			children[i]
-		);
+	for (nb_opts.value = 0 ; descs[nb_opts.value] != NULL ; nb_opts.value++) { }
+	lis_msg_int_pack(out, &nb_opts);
+
+	for (i = 0 ; descs[i] != NULL ; i++) {
+		opt.remote = (intptr_t)descs[i];
+		opt.name = descs[i]->name;
+		opt.title = descs[i]->title;
+		opt.desc = descs[i]->desc;
+		opt.capabilities = descs[i]->capabilities;
+		opt.value_type = descs[i]->value.type;
+		opt.unit = descs[i]->value.unit;
+		opt.constraint_type = descs[i]->constraint.type;
+		lis_msg_option_pack(out, &opt);
+		lis_msg_constraint_pack(out, descs[i]);
 	}
 
-	return msg_out->header.err;
+	return err;
 }
 
 
-static void serialize_range(
-	enum lis_value_type vtype, const struct lis_value_range *range,
-	void **buf, size_t *buf_size)
+static enum lis_error execute_opt_get(
+		struct lis_worker_device *device,
+		struct lis_unpack_buf *in, struct lis_pack_buf *out
+	)
 {
-	if (buf_size != NULL) {
-		*buf_size += lis_compute_packed_size(
-			"vvv",
-			vtype, range->min,
-			vtype, range->max,
-			vtype, range->interval
-		);
+	struct lis_msg_remote request;
+	struct lis_option_descriptor *opt;
+	union lis_value value;
+	enum lis_error err;
+
+	LIS_UNUSED(device);
+
+	lis_msg_remote_unpack(in, &request);
+	opt = (struct lis_option_descriptor *)request.remote;
+
+	err = opt->fn.get_value(opt, &value);
+	if (LIS_IS_ERROR(err)) {
+		return err;
 	}
-	if (buf != NULL) {
-		lis_pack(
-			buf, "vvv",
-			vtype, range->min,
-			vtype, range->max,
-			vtype, range->interval
-		);
+
+	lis_pack_value(out, opt->value.type, value);
+	return err;
+}
+
+
+static enum lis_error execute_opt_set(
+		struct lis_worker_device *device,
+		struct lis_unpack_buf *in, struct lis_pack_buf *out
+	)
+{
+	struct lis_msg_remote request;
+	struct lis_msg_int set_flags = { .value = 0 };
+	struct lis_option_descriptor *opt;
+	union lis_value value;
+	enum lis_error err;
+
+	LIS_UNUSED(device);
+
+	lis_msg_remote_unpack(in, &request);
+	opt = (struct lis_option_descriptor *)request.remote;
+	value = lis_unpack_value(in, opt->value.type);
+	if (in->error) {
+		return LIS_ERR_INVALID_VALUE;
 	}
+
+	err = opt->fn.set_value(opt, value, &set_flags.value);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+
+	lis_msg_int_pack(out, &set_flags);
+	return err;
 }
 
 
-static void serialize_list(
-	enum lis_value_type vtype, const struct lis_value_list *list,
-	void **buf, size_t *buf_size)
+static enum lis_error execute_item_get_values(
+		struct lis_worker_device *device,
+		struct lis_unpack_buf *in, struct lis_pack_buf *out
+	)
 {
+	struct lis_msg_int nb_values;
+	struct lis_msg_value_result result;
+	struct lis_option_descriptor *opt;
+	union lis_value value;
 	int i;
 
-	if (buf_size != NULL)
-		*buf_size += lis_compute_packed_size("d", list->nb_values);
-	if (buf != NULL)
-		lis_pack(buf, "d", list->nb_values);
+	LIS_UNUSED(device);
 
-	for (i = 0 ; i < list->nb_values ; i++) {
-		if (buf_size != NULL) {
-			*buf_size += lis_compute_packed_size(
-				"v", vtype, list->values[i]
-			);
+	lis_msg_int_unpack(in, &nb_values);
+	for (i = 0 ; i < nb_values.value ; i++) {
+		opt = (struct lis_option_descriptor *)lis_unpack_ptr(in);
+		if (in->error) {
+			return LIS_ERR_INVALID_VALUE;
 		}
-		if (buf != NULL) {
-			lis_pack(buf, "v", vtype, list->values[i]);
+
+		result.err = opt->fn.get_value(opt, &value);
+		lis_msg_value_result_pack(out, &result);
+		if (LIS_IS_OK(result.err)) {
+			lis_pack_value(out, opt->value.type, value);
 		}
 	}
+	return LIS_OK;
 }
 
 
-static void serialize_option(const struct lis_option_descriptor *desc, void **buf, size_t *buf_size)
+static enum lis_error execute_item_set_values(
+		struct lis_worker_device *device,
+		struct lis_unpack_buf *in, struct lis_pack_buf *out
+	)
 {
-	if (buf_size != NULL) {
-		*buf_size += lis_compute_packed_size(
-			"psssdddd",
-			desc,
-			desc->name,
-			desc->title,
-			desc->desc,
-			desc->capabilities,
-			desc->value.type,
-			desc->value.unit,
-			desc->constraint.type
-		);
-	}
-	if (buf != NULL) {
-		lis_log_info(
-			"Serializing option [%s] [%s] [%s] --> %p",
-			desc->name, desc->title, desc->desc, *buf
-		);
-		lis_pack(
-			buf,
-			"psssdddd",
-			desc,
-			desc->name,
-			desc->title,
-			desc->desc,
-			desc->capabilities,
-			desc->value.type,
-			desc->value.unit,
-			desc->constraint.type
-		);
-	}
+	struct lis_msg_int nb_values;
+	struct lis_msg_set_values_result result = {
+		.err = LIS_OK, .nb_set = 0, .set_flags = 0,
+	};
+	struct lis_option_descriptor *opt;
+	union lis_value value;
+	int set_flags;
 
-	switch(desc->constraint.type) {
-		case LIS_CONSTRAINT_NONE:
-			break;
-		case LIS_CONSTRAINT_RANGE:
-			serialize_range(
-				desc->value.type, &desc->constraint.possible.range,
-				buf, buf_size
-			);
+	LIS_UNUSED(device);
+
+	lis_msg_int_unpack(in, &nb_values);
+	for ( ; result.nb_set < nb_values.value ; result.nb_set++) {
+		opt = (struct lis_option_descriptor *)lis_unpack_ptr(in);
+		if (in->error) {
+			return LIS_ERR_INVALID_VALUE;
+		}
+		value = lis_unpack_value(in, opt->value.type);
+		if (in->error) {
+			return LIS_ERR_INVALID_VALUE;
+		}
+
+		set_flags = 0;
+		result.err = opt->fn.set_value(opt, value, &set_flags);
+		if (LIS_IS_ERROR(result.err)) {
 			break;
-		case LIS_CONSTRAINT_LIST:
-			serialize_list(
-				desc->value.type, &desc->constraint.possible.list,
-				buf, buf_size
-			);
+		}
+		result.set_flags |= set_flags;
+		if (set_flags & LIS_SET_FLAG_MUST_RELOAD_OPTIONS) {
+			// the following descriptors may not be valid anymore
+			result.nb_set++;
 			break;
+		}
 	}
+
+	// errors of set_value() go in the content: the master must still
+	// get the flags of the options set before
+	lis_msg_set_values_result_pack(out, &result);
+	return LIS_OK;
 }
 
 
-static void serialize_options(struct lis_option_descriptor **descs, void **buf, size_t *buf_size)
+static enum lis_error execute_item_scan_start(
+		struct lis_worker_device *device,
+		struct lis_unpack_buf *in, struct lis_pack_buf *out
+	)
 {
-	int i;
-
-	if (buf_size != NULL)
-		*buf_size = 0;
+	struct lis_msg_remote request, reply;
+	struct lis_scan_session *session;
+	struct lis_item *item;
+	enum lis_error err;
 
-	for (i = 0 ; descs[i] != NULL ; i++) { }
-	if (buf_size != NULL)
-		*buf_size += lis_compute_packed_size("d", i);
-	if (buf != NULL)
-		lis_pack(buf, "d", i);
+	lis_msg_remote_unpack(in, &request);
+	item = (struct lis_item *)request.remote;
 
-	for (i = 0 ; descs[i] != NULL ; i++) {
-		serialize_option(descs[i], buf, buf_size);
+	err = item->scan_start(item, &session);
+	if (LIS_IS_ERROR(err)) {
+		return err;
 	}
+
+	// the master is waiting for our reply: it's not using the ring
+	lis_ring_reset(device->ring);
+	device->read_ahead.session = session;
+	device->read_ahead.active = false;
+	device->read_ahead.err = LIS_OK;
+
+	reply.remote = (intptr_t)session;
+	lis_msg_remote_pack(out, &reply);
+	return err;
 }
 
 
-static enum lis_error execute_item_get_options(struct lis_msg *msg_in, struct lis_msg *msg_out)
+static enum lis_error execute_session_get_scan_parameters(
+		struct lis_worker_device *device,
+		struct lis_unpack_buf *in, struct lis_pack_buf *out
+	)
 {
-	const void *ptr_in;
-	void *ptr_out;
-	struct lis_item *item;
-	struct lis_option_descriptor **descs;
+	struct lis_msg_remote request;
+	struct lis_scan_session *session;
+	struct lis_scan_parameters parameters;
+	enum lis_error err;
+
+	LIS_UNUSED(device);
 
-	ptr_in = msg_in->raw.iov_base;
-	lis_unpack(&ptr_in, "p", &item);
+	lis_msg_remote_unpack(in, &request);
+	session = (struct lis_scan_session *)request.remote;
 
-	msg_out->header.err = item->get_options(item, &descs);
-	if (LIS_IS_ERROR(msg_out->header.err)) {
-		return msg_out->header.err;
+	err = session->get_scan_parameters(session, &parameters);
+	if (LIS_IS_ERROR(err)) {
+		return err;
 	}
 
-	serialize_options(descs, NULL, &msg_out->raw.iov_len);
+	lis_pack_bytes(out, &parameters, sizeof(parameters));
+	return err;
+}
 
-	msg_out->raw.iov_base = malloc(msg_out->raw.iov_len);
-	if (msg_out->raw.iov_base == NULL) {
-		lis_log_error("Out of memory");
-		return LIS_ERR_NO_MEM;
+
+static enum lis_error execute_session_end_of_feed(
+		struct lis_worker_device *device,
+		struct lis_unpack_buf *in, struct lis_pack_buf *out
+	)
+{
+	struct lis_msg_remote request;
+	struct lis_msg_int reply;
+	struct lis_scan_session *session;
+
+	lis_msg_remote_unpack(in, &request);
+	session = (struct lis_scan_session *)request.remote;
+
+	if (session == device->read_ahead.session
+			&& lis_ring_get_readable(device->ring) > 0) {
+		// master hasn't consumed everything we read ahead yet
+		reply.value = 0;
+	} else {
+		reply.value = session->end_of_feed(session);
 	}
 
-	ptr_out = msg_out->raw.iov_base;
-	serialize_options(descs, &ptr_out, NULL);
+	lis_msg_int_pack(out, &reply);
 	return LIS_OK;
 }
 
 
-static enum lis_error execute_opt_get(struct lis_msg *msg_in, struct lis_msg *msg_out)
+static enum lis_error execute_session_end_of_page(
+		struct lis_worker_device *device,
+		struct lis_unpack_buf *in, struct lis_pack_buf *out
+	)
 {
-	const void *ptr_in;
-	void *ptr_out;
-	struct lis_option_descriptor *opt;
-	union lis_value value;
-
-	ptr_in = msg_in->raw.iov_base;
-	lis_unpack(&ptr_in, "p", &opt);
+	struct lis_msg_remote request;
+	struct lis_msg_int reply;
+	struct lis_scan_session *session;
 
-	msg_out->header.err = opt->fn.get_value(opt, &value);
-	if (LIS_IS_ERROR(msg_out->header.err)) {
-		return msg_out->header.err;
+	lis_msg_remote_unpack(in, &request);
+	session = (struct lis_scan_session *)request.remote;
+
+	if (session == device->read_ahead.session && (
+				lis_ring_get_readable(device->ring) > 0
+				|| LIS_IS_ERROR(device->read_ahead.err)
+			)) {
+		// master hasn't consumed everything we read ahead yet, or
+		// the next scan_read() must return the read ahead error
+		reply.value = 0;
+	} else {
+		reply.value = session->end_of_page(session);
 	}
 
-	msg_out->raw.iov_len = lis_compute_packed_size(
-		"v", opt->value.type, value
-	);
-	msg_out->raw.iov_base = malloc(msg_out->raw.iov_len);
-	if (msg_out->raw.iov_base == NULL) {
-		lis_log_error("Out of memory");
-		return LIS_ERR_NO_MEM;
+	lis_msg_int_pack(out, &reply);
+	return LIS_OK;
+}
+
+
+static enum lis_error ring_fill(
+		struct lis_worker_device *device, struct lis_scan_session *session,
+		size_t max
+	)
+{
+	enum lis_error err;
+	void *ptr;
+	size_t size;
+
+	ptr = lis_ring_get_writable(device->ring, &size);
+	size = MIN(size, max);
+	if (size <= 0) {
+		return LIS_OK;
 	}
 
-	ptr_out = msg_out->raw.iov_base;
-	lis_pack(&ptr_out, "v", opt->value.type, value);
+	// scan_read() writes directly in the shared memory
+	err = session->scan_read(session, ptr, &size);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+	lis_ring_commit(device->ring, size);
 	return LIS_OK;
 }
 
 
-static enum lis_error execute_opt_set(struct lis_msg *msg_in, struct lis_msg *msg_out)
+static enum lis_error execute_session_scan_read(
+		struct lis_worker_device *device,
+		struct lis_unpack_buf *in, struct lis_pack_buf *out
+	)
 {
-	const void *ptr_in;
-	struct lis_option_descriptor *opt;
-	union lis_value value;
-	int set_flags = 0;
+	struct lis_msg_scan_read request;
+	struct lis_scan_session *session;
+	enum lis_error err;
+
+	LIS_UNUSED(out);
+
+	lis_msg_scan_read_unpack(in, &request);
+	session = (struct lis_scan_session *)request.session;
 
-	ptr_in = msg_in->raw.iov_base;
-	lis_unpack(&ptr_in, "p", &opt);
-	lis_unpack(&ptr_in, "v", opt->value.type, &value);
+	if (session != device->read_ahead.session) {
+		lis_log_warning(
+			"scan_read(): Unexpected session %p (expected: %p)",
+			session, device->read_ahead.session
+		);
+		lis_ring_reset(device->ring);
+		device->read_ahead.session = session;
+		device->read_ahead.err = LIS_OK;
+	}
 
-	msg_out->header.err = opt->fn.set_value(opt, value, &set_flags);
-	if (LIS_IS_ERROR(msg_out->header.err)) {
-		return msg_out->header.err;
+	if (lis_ring_get_readable(device->ring) > 0) {
+		// read ahead while the master was busy
+		device->read_ahead.active = true;
+		return LIS_OK;
 	}
 
-	msg_out->raw.iov_len = sizeof(set_flags);
-	msg_out->raw.iov_base = malloc(sizeof(set_flags));
-	if (msg_out->raw.iov_base == NULL) {
-		lis_log_error("Out of memory");
-		return LIS_ERR_NO_MEM;
+	if (LIS_IS_ERROR(device->read_ahead.err)) {
+		err = device->read_ahead.err;
+		device->read_ahead.err = LIS_OK;
+		device->read_ahead.active = false;
+		return err;
+	}
+
+	// ring is empty and the master waits for our reply: we can rewind it
+	// so we get as much contiguous space as possible.
+	lis_ring_reset(device->ring);
+
+	err = ring_fill(
+		device, session, MAX((size_t)request.buffer_size, READ_AHEAD_CHUNK)
+	);
+	device->read_ahead.active = LIS_IS_OK(err);
+	return err;
+}
+
+
+/*!
+ * Reads one more chunk of the current page in the ring.
+ * Called by the device thread when it has no request to process.
+ */
+static void read_ahead(struct lis_worker_device *device)
+{
+	struct lis_scan_session *session = device->read_ahead.session;
+
+	if (session->end_of_page(session)) {
+		device->read_ahead.active = false;
+		return;
+	}
+
+	device->read_ahead.err = ring_fill(device, session, READ_AHEAD_CHUNK);
+	if (LIS_IS_ERROR(device->read_ahead.err)) {
+		lis_log_warning(
+			"Read ahead failed: 0x%X, %s",
+			device->read_ahead.err, lis_strerror(device->read_ahead.err)
+		);
+		device->read_ahead.active = false;
 	}
-	memcpy(msg_out->raw.iov_base, &set_flags, sizeof(set_flags));
-	return LIS_OK;
 }
 
 
-static enum lis_error execute_item_scan_start(struct lis_msg *msg_in, struct lis_msg *msg_out)
+static enum lis_error execute_session_cancel(
+		struct lis_worker_device *device,
+		struct lis_unpack_buf *in, struct lis_pack_buf *out
+	)
 {
-	const void *ptr_in;
-	void *ptr_out;
+	struct lis_msg_remote request;
 	struct lis_scan_session *session;
-	struct lis_item *item;
 
-	ptr_in = msg_in->raw.iov_base;
-	lis_unpack(&ptr_in, "p", &item);
+	LIS_UNUSED(out);
 
-	msg_out->header.err = item->scan_start(item, &session);
-	if (LIS_IS_ERROR(msg_out->header.err)) {
-		return msg_out->header.err;
-	}
+	lis_msg_remote_unpack(in, &request);
+	session = (struct lis_scan_session *)request.remote;
 
-	msg_out->raw.iov_len = lis_compute_packed_size("p", session);
-	msg_out->raw.iov_base = malloc(msg_out->raw.iov_len);
-	if (msg_out->raw.iov_base == NULL) {
-		lis_log_error("Out of memory");
-		return LIS_ERR_NO_MEM;
+	if (session == device->read_ahead.session) {
+		lis_ring_reset(device->ring);
+		memset(&device->read_ahead, 0, sizeof(device->read_ahead));
 	}
-	ptr_out = msg_out->raw.iov_base;
-	lis_pack(&ptr_out, "p", session);
+
+	session->cancel(session);
 	return LIS_OK;
 }
 
 
-static enum lis_error execute_session_get_scan_parameters(struct lis_msg *msg_in, struct lis_msg *msg_out)
+static enum lis_error send_reply(const struct lis_msg *msg_out)
 {
-	const void *ptr_in;
-	struct lis_scan_session *session;
+	enum lis_error err;
 
-	ptr_in = msg_in->raw.iov_base;
-	lis_unpack(&ptr_in, "p", &session);
+	LIS_LOCK(&g_write_mutex);
+	err = lis_protocol_msg_write(g_pipes->sorted.msgs_w2m[1], msg_out);
+	LIS_UNLOCK(&g_write_mutex);
+	if (LIS_IS_ERROR(err)) {
+		lis_log_error(
+			"Failed to write message: 0x%X, %s",
+			err, lis_strerror(err)
+		);
+	}
+	return err;
+}
 
-	msg_out->raw.iov_len = sizeof(struct lis_scan_parameters);
-	msg_out->raw.iov_base = malloc(sizeof(struct lis_scan_parameters));
-	if (msg_out->raw.iov_base == NULL) {
-		lis_log_error("Out of memory");
-		return LIS_ERR_NO_MEM;
+
+static enum lis_error send_error(const struct lis_msg *msg_in, enum lis_error err)
+{
+	struct lis_msg msg_out;
+
+	memset(&msg_out, 0, sizeof(msg_out));
+	msg_out.header = msg_in->header;
+	msg_out.header.err = err;
+	return send_reply(&msg_out);
+}
+
+
+/*!
+ * Runs the call requested by the master and sends back the reply.
+ *
+ * \param[in] reply buffer in which the reply is encoded. Reused from one
+ *   request to the next.
+ */
+static enum lis_error process_request(
+		struct lis_worker_device *device, const struct lis_msg *msg_in,
+		struct lis_pack_buf *reply
+	)
+{
+	struct lis_unpack_buf in;
+	struct lis_msg msg_out;
+	enum lis_msg_type msg_type = msg_in->header.msg_type;
+	uint64_t start = lis_trace_now();
+
+	if ((unsigned int)msg_type >= LIS_COUNT_OF(g_callbacks)
+			|| g_callbacks[msg_type].callback == NULL) {
+		lis_log_error(
+			"Request %u: unknown message type %d",
+			msg_in->header.request_id, msg_type
+		);
+		return send_error(msg_in, LIS_ERR_INVALID_VALUE);
 	}
 
-	msg_out->header.err = session->get_scan_parameters(
-		session, msg_out->raw.iov_base
+	memset(&msg_out, 0, sizeof(msg_out));
+	msg_out.header = msg_in->header;
+
+	lis_log_debug(
+		"Processing %d '%s' (request %u)",
+		msg_type, g_callbacks[msg_type].name,
+		msg_in->header.request_id
 	);
-	if (LIS_IS_ERROR(msg_out->header.err)) {
-		return msg_out->header.err;
+	lis_unpack_buf_init(&in, msg_in->raw.iov_base, msg_in->raw.iov_len);
+	lis_pack_buf_reset(reply);
+	msg_out.header.err = g_callbacks[msg_type].callback(device, &in, reply);
+	if (LIS_IS_OK(msg_out.header.err) && reply->oom) {
+		lis_log_error("Out of memory");
+		msg_out.header.err = LIS_ERR_NO_MEM;
+	}
+	msg_out.raw.iov_base = reply->data;
+	msg_out.raw.iov_len = reply->size;
+
+	if (lis_trace_enabled()) {
+		lis_trace_flow(
+			g_callbacks[msg_type].name,
+			LIS_PROTOCOL_TRACE_ID(getpid(), msg_in->header.request_id),
+			1, start
+		);
+		lis_trace_call(
+			"worker", g_callbacks[msg_type].name, start,
+			lis_trace_now(), msg_out.header.err, 0
+		);
 	}
 
-	return msg_out->header.err;
+	return send_reply(&msg_out);
 }
 
 
-static enum lis_error execute_session_end_of_feed(struct lis_msg *msg_in, struct lis_msg *msg_out)
+static enum lis_error device_new(
+		struct lis_item *item, struct lis_worker_device **out
+	)
 {
-	const void *ptr_in;
-	struct lis_scan_session *session;
-	void *ptr_out;
-	int r;
+	struct lis_worker_device *device;
+	int i = -1;
 
-	ptr_in = msg_in->raw.iov_base;
-	lis_unpack(&ptr_in, "p", &session);
+	if (item == NULL) {
+		// API thread: no scan, no ring
+		goto alloc;
+	}
 
-	r = session->end_of_feed(session);
+	LIS_LOCK(&g_mutex);
+	for (i = 0 ; i < g_nb_rings ; i++) {
+		if (!g_rings_used[i]) {
+			g_rings_used[i] = true;
+			break;
+		}
+	}
+	LIS_UNLOCK(&g_mutex);
+	if (i >= g_nb_rings) {
+		lis_log_error(
+			"Too many devices opened at the same time (max: %d)",
+			g_nb_rings
+		);
+		return LIS_ERR_DEVICE_BUSY;
+	}
 
-	msg_out->raw.iov_len = lis_compute_packed_size("d", r);
-	msg_out->raw.iov_base = malloc(msg_out->raw.iov_len);
-	if (msg_out->raw.iov_base == NULL) {
+alloc:
+	device = calloc(1, sizeof(struct lis_worker_device));
+	if (device == NULL) {
 		lis_log_error("Out of memory");
+		if (i >= 0) {
+			LIS_LOCK(&g_mutex);
+			g_rings_used[i] = false;
+			LIS_UNLOCK(&g_mutex);
+		}
 		return LIS_ERR_NO_MEM;
 	}
-	ptr_out = msg_out->raw.iov_base;
-	lis_pack(&ptr_out, "d", r);
+
+	device->item = item;
+	device->ring_idx = i;
+	if (i >= 0) {
+		device->ring = g_rings[i];
+		lis_ring_reset(device->ring);
+	}
+	pthread_mutex_init(&device->mutex, NULL);
+	pthread_cond_init(&device->cond, NULL);
+
+	*out = device;
 	return LIS_OK;
 }
 
 
-static enum lis_error execute_session_end_of_page(struct lis_msg *msg_in, struct lis_msg *msg_out)
+/*!
+ * Returns a request from the free list of the device, or a new one.
+ * Called by the main thread.
+ */
+static struct lis_worker_request *request_get(struct lis_worker_device *device)
 {
-	const void *ptr_in;
-	struct lis_scan_session *session;
-	void *ptr_out;
-	int r;
-
-	ptr_in = msg_in->raw.iov_base;
-	lis_unpack(&ptr_in, "p", &session);
+	struct lis_worker_request *request;
 
-	r = session->end_of_page(session);
+	LIS_LOCK(&device->mutex);
+	request = device->free_requests;
+	if (request != NULL) {
+		device->free_requests = request->next;
+	}
+	LIS_UNLOCK(&device->mutex);
 
-	msg_out->raw.iov_len = lis_compute_packed_size("d", r);
-	msg_out->raw.iov_base = malloc(msg_out->raw.iov_len);
-	if (msg_out->raw.iov_base == NULL) {
-		lis_log_error("Out of memory");
-		return LIS_ERR_NO_MEM;
+	if (request == NULL) {
+		request = calloc(1, sizeof(struct lis_worker_request));
+		if (request == NULL) {
+			lis_log_error("Out of memory");
+			return NULL;
+		}
 	}
-	ptr_out = msg_out->raw.iov_base;
-	lis_pack(&ptr_out, "d", r);
-	return LIS_OK;
+	request->next = NULL;
+	request->last = false;
+	return request;
 }
 
 
-static enum lis_error execute_session_scan_read(struct lis_msg *msg_in, struct lis_msg *msg_out)
+static void request_put_back(
+		struct lis_worker_device *device, struct lis_worker_request *request
+	)
 {
-	const void *ptr_in;
-	struct lis_scan_session *session;
-	int buffer_size;
+	LIS_LOCK(&device->mutex);
+	request->next = device->free_requests;
+	device->free_requests = request;
+	LIS_UNLOCK(&device->mutex);
+}
 
-	ptr_in = msg_in->raw.iov_base;
-	lis_unpack(&ptr_in, "pd", &session, &buffer_size);
-	msg_out->raw.iov_len = buffer_size;
 
-	msg_out->raw.iov_base = malloc(msg_out->raw.iov_len);
-	if (msg_out->raw.iov_base == NULL) {
-		lis_log_error("Out of memory");
-		return LIS_ERR_NO_MEM;
+static void request_free_all(struct lis_worker_request *request)
+{
+	struct lis_worker_request *next;
+
+	for ( ; request != NULL ; request = next) {
+		next = request->next;
+		lis_pack_buf_free(&request->content);
+		FREE(request);
 	}
+}
 
-	msg_out->header.err = session->scan_read(
-		session, msg_out->raw.iov_base, &msg_out->raw.iov_len
-	);
-	if (LIS_IS_ERROR(msg_out->header.err)) {
-		FREE(msg_out->raw.iov_base);
-		return msg_out->header.err;
+
+static void device_free(struct lis_worker_device *device)
+{
+	request_free_all(device->queue.first);
+	request_free_all(device->free_requests);
+	lis_pack_buf_free(&device->reply);
+
+	if (device->ring_idx >= 0) {
+		LIS_LOCK(&g_mutex);
+		g_rings_used[device->ring_idx] = false;
+		LIS_UNLOCK(&g_mutex);
 	}
 
-	return msg_out->header.err;
+	pthread_cond_destroy(&device->cond);
+	pthread_mutex_destroy(&device->mutex);
+	FREE(device);
 }
 
 
-static enum lis_error execute_session_cancel(struct lis_msg *msg_in, struct lis_msg *msg_out)
+static void *device_thread(void *_device)
 {
-	const void *ptr_in;
-	struct lis_scan_session *session;
+	struct lis_worker_device *device = _device;
+	struct lis_worker_request *request;
+	struct timespec deadline;
+	size_t writable;
+	bool last = false;
+
+	if (device->item == NULL) {
+		lis_log_info("API thread started");
+	} else {
+		lis_log_info("Device thread for item %p started", device->item);
+	}
+
+	while (!last) {
+		LIS_LOCK(&device->mutex);
+		while (device->queue.first == NULL) {
+			if (!device->read_ahead.active) {
+				pthread_cond_wait(&device->cond, &device->mutex);
+				continue;
+			}
+			lis_ring_get_writable(device->ring, &writable);
+			if (writable > 0) {
+				break;
+			}
+			// ring is full: wait for the master to consume some of it
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += READ_AHEAD_WAIT_TIMEOUT * 1000 * 1000;
+			if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000 * 1000 * 1000;
+			}
+			pthread_cond_timedwait(&device->cond, &device->mutex, &deadline);
+		}
+		request = device->queue.first;
+		if (request != NULL) {
+			device->queue.first = request->next;
+			if (device->queue.first == NULL) {
+				device->queue.last = NULL;
+			}
+		}
+		LIS_UNLOCK(&device->mutex);
 
-	LIS_UNUSED(msg_out);
+		if (request == NULL) {
+			read_ahead(device);
+			continue;
+		}
 
-	ptr_in = msg_in->raw.iov_base;
-	lis_unpack(&ptr_in, "p", &session);
+		last = request->last;
+		process_request(
+			(device->item != NULL ? device : NULL), // API call
+			&request->msg, &device->reply
+		);
+		request_put_back(device, request);
+	}
 
-	session->cancel(session);
+	if (device->item == NULL) {
+		lis_log_info("API thread stopped");
+		// freed by the main thread once joined
+		return NULL;
+	}
+	lis_log_info("Device thread for item %p stopped", device->item);
+	device_free(device);
+	return NULL;
+}
+
+
+static enum lis_error device_start(struct lis_worker_device *device)
+{
+	int r;
+
+	r = pthread_create(&device->thread, NULL, device_thread, device);
+	if (r != 0) {
+		lis_log_error(
+			"Failed to create device thread: %d, %s", r, strerror(r)
+		);
+		return LIS_ERR_INTERNAL_UNKNOWN_ERROR;
+	}
+	if (device->item == NULL) {
+		// API thread: joined by the main thread
+		return LIS_OK;
+	}
+	pthread_detach(device->thread);
+
+	LIS_LOCK(&g_mutex);
+	device->next = g_devices;
+	g_devices = device;
+	LIS_UNLOCK(&g_mutex);
 	return LIS_OK;
 }
 
 
+/*!
+ * Queues a request for the thread of the device.
+ */
+static void device_push(
+		struct lis_worker_device *device, struct lis_worker_request *request
+	)
+{
+	LIS_LOCK(&device->mutex);
+	if (device->queue.last == NULL) {
+		device->queue.first = request;
+	} else {
+		device->queue.last->next = request;
+	}
+	device->queue.last = request;
+	pthread_cond_signal(&device->cond);
+	LIS_UNLOCK(&device->mutex);
+}
+
+
+static struct lis_worker_device *device_get(intptr_t item)
+{
+	struct lis_worker_device *device;
+
+	LIS_LOCK(&g_mutex);
+	for (device = g_devices ; device != NULL ; device = device->next) {
+		if ((intptr_t)device->item == item) {
+			break;
+		}
+	}
+	LIS_UNLOCK(&g_mutex);
+	return device;
+}
+
+
+static void device_remove(struct lis_worker_device *device)
+{
+	struct lis_worker_device **prev;
+
+	LIS_LOCK(&g_mutex);
+	for (prev = &g_devices ; *prev != NULL ; prev = &(*prev)->next) {
+		if (*prev == device) {
+			*prev = device->next;
+			break;
+		}
+	}
+	LIS_UNLOCK(&g_mutex);
+}
+
+
+static bool is_device_close(
+		const struct lis_worker_device *device, const struct lis_msg *msg_in
+	)
+{
+	struct lis_unpack_buf in;
+	struct lis_msg_remote request;
+
+	if (msg_in->header.msg_type != LIS_MSG_ITEM_CLOSE) {
+		return false;
+	}
+	lis_unpack_buf_init(&in, msg_in->raw.iov_base, msg_in->raw.iov_len);
+	lis_msg_remote_unpack(&in, &request);
+	return (request.remote == (intptr_t)device->item);
+}
+
+
 static enum lis_error lis_worker_main_loop(void)
 {
+	int fd = g_pipes->sorted.msgs_m2w[0];
 	enum lis_error err;
-	struct lis_msg msg_in, msg_out;
+	struct lis_msg msg_in;
 	enum lis_msg_type msg_type;
+	struct lis_worker_device *device;
+	struct lis_worker_request *request;
+	struct lis_pack_buf discarded = { 0 };
+	pthread_t api_thread;
+	bool api_stopped = false;
+
+	err = device_new(NULL, &g_api);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+	err = device_start(g_api);
+	if (LIS_IS_ERROR(err)) {
+		device_free(g_api);
+		return err;
+	}
+	api_thread = g_api->thread;
 
 	lis_log_info("Worker ready");
 
 	do {
-
-		memset(&msg_in, 0, sizeof(msg_in));
-		memset(&msg_out, 0, sizeof(msg_out));
-
-		err = lis_protocol_msg_read(
-			g_pipes->sorted.msgs_m2w[0],
-			&msg_in
-		);
+		err = lis_protocol_msg_read_header(fd, &msg_in);
 		if (LIS_IS_ERROR(err)) {
 			lis_log_error(
 				"Failed to read message: 0x%X, %s",
@@ -703,41 +1308,80 @@ static enum lis_error lis_worker_main_loop(void)
 			break;
 		}
 
-		msg_out.header.msg_type = msg_in.header.msg_type;
 		msg_type = msg_in.header.msg_type;
-		msg_out.header.err = LIS_OK;
 
-		lis_log_debug(
-			"Processing %d '%s'",
-			msg_in.header.msg_type,
-			g_callbacks[msg_in.header.msg_type].name
-		);
-		err = g_callbacks[msg_in.header.msg_type].callback(&msg_in, &msg_out);
-		if (LIS_IS_ERROR(err)) {
-			msg_out.header.err = err;
+		if (msg_in.header.device == 0) {
+			device = g_api;
+		} else {
+			device = device_get(msg_in.header.device);
+		}
+		request = NULL;
+		if (device != NULL) {
+			request = request_get(device);
 		}
 
-		err = lis_protocol_msg_write(
-			g_pipes->sorted.msgs_w2m[1],
-			&msg_out
+		err = lis_protocol_msg_read_content(
+			fd, &msg_in,
+			(request != NULL ? &request->content : &discarded)
 		);
-		lis_protocol_msg_free(&msg_in);
-		lis_protocol_msg_free(&msg_out);
-		if (LIS_IS_ERROR(err)) {
+		if (LIS_IS_ERROR(err) && err != LIS_ERR_NO_MEM) {
 			lis_log_error(
-				"Failed to write message: 0x%X, %s",
+				"Failed to read message: 0x%X, %s",
 				err, lis_strerror(err)
 			);
 			break;
 		}
 
-	} while(msg_type != LIS_MSG_API_CLEANUP);
+		if (device == NULL) {
+			lis_log_error(
+				"Request %u: unknown device %p",
+				msg_in.header.request_id,
+				(void *)msg_in.header.device
+			);
+			err = send_error(&msg_in, LIS_ERR_INVALID_VALUE);
+			continue;
+		}
 
+		if (request == NULL || LIS_IS_ERROR(err)) {
+			if (request != NULL) {
+				request_put_back(device, request);
+			}
+			err = send_error(&msg_in, LIS_ERR_NO_MEM);
+			continue;
+		}
+
+		memcpy(&request->msg, &msg_in, sizeof(request->msg));
+		if (device == g_api) {
+			request->last = (msg_type == LIS_MSG_API_CLEANUP);
+			api_stopped = request->last;
+		} else {
+			request->last = is_device_close(device, &request->msg);
+			if (request->last) {
+				// the device thread frees the device once the
+				// request has been processed: it must not be
+				// reachable anymore.
+				device_remove(device);
+			}
+		}
+		device_push(device, request);
+
+	} while(LIS_IS_OK(err) && msg_type != LIS_MSG_API_CLEANUP);
+
+	if (api_stopped) {
+		// the reply to cleanup() must be sent before exiting
+		pthread_join(api_thread, NULL);
+		device_free(g_api);
+		g_api = NULL;
+	}
+	lis_pack_buf_free(&discarded);
 	return err;
 }
 
 
-void lis_worker_main(struct lis_api *to_wrap, struct lis_pipes *pipes)
+void lis_worker_main(
+		struct lis_api *to_wrap, struct lis_pipes *pipes,
+		struct lis_ring **rings, int nb_rings
+	)
 {
 	int fd_limit;
 	int fd;
@@ -749,6 +1393,13 @@ void lis_worker_main(struct lis_api *to_wrap, struct lis_pipes *pipes)
 
 	g_wrapped = to_wrap;
 	g_pipes = pipes;
+	g_rings = rings;
+	g_nb_rings = nb_rings;
+	g_rings_used = calloc(nb_rings, sizeof(bool));
+	if (g_rings_used == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
 
 #ifndef DISABLE_REDIRECT_LOGS
 	/* We replace any log callback that calling application may have set:
@@ -810,6 +1461,7 @@ void lis_worker_main(struct lis_api *to_wrap, struct lis_pipes *pipes)
 	}
 
 	err = lis_worker_main_loop();
+	lis_trace_flush();
 
 	exit(LIS_IS_OK(err) ? EXIT_SUCCESS : EXIT_FAILURE);
 }
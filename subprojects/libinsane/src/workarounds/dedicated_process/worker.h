@@ -4,7 +4,15 @@
 #include <libinsane/capi.h>
 
 #include "protocol.h"
+#include "ring.h"
 
-void lis_worker_main(struct lis_api *to_wrap, struct lis_pipes *pipes);
+/*!
+ * \param[in] rings one ring per device that may be opened at the same time.
+ *   The worker runs the calls of each opened device in a dedicated thread.
+ */
+void lis_worker_main(
+	struct lis_api *to_wrap, struct lis_pipes *pipes,
+	struct lis_ring **rings, int nb_rings
+);
 
 #endif
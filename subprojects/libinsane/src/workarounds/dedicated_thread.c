@@ -20,23 +20,33 @@ struct op {
 };
 
 
-struct dt_impl_private {
-	struct lis_api parent;
-	struct lis_api *wrapped;
-
+struct dt_thread {
 	pthread_t mainloop;
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
 	struct op *first_op;
 	struct op *last_op;
 };
+
+
+struct dt_impl_private {
+	struct lis_api parent;
+	struct lis_api *wrapped;
+
+	/* list_devices(), get_device(), item close() and cleanup(). Also all
+	 * the calls on the devices if !per_device. Wrapped implementations
+	 * keep track of the opened devices without any locking: devices are
+	 * always opened and closed from this thread. */
+	struct dt_thread control;
+	int per_device;
+};
 #define DT_IMPL_PRIVATE(impl) ((struct dt_impl_private *)(impl))
 
 
 struct dt_opt_private {
 	struct lis_option_descriptor parent;
 	struct lis_option_descriptor *wrapped;
-	struct dt_impl_private *impl;
+	struct dt_thread *thread;
 };
 #define DT_OPT_PRIVATE(opt) ((struct dt_opt_private *)(opt))
 
@@ -45,6 +55,8 @@ struct dt_item_private {
 	struct lis_item parent;
 	struct lis_item *wrapped;
 	struct dt_impl_private *impl;
+	/* impl->control, or the thread dedicated to the root item */
+	struct dt_thread *thread;
 
 	struct dt_item_private *children;
 	struct lis_item **children_ptrs;
@@ -61,7 +73,7 @@ struct dt_scan_session_private {
 	struct lis_scan_session parent;
 	struct lis_scan_session *wrapped;
 	struct dt_item_private *item;
-	struct dt_impl_private *impl;
+	struct dt_thread *thread;
 };
 #define DT_SCAN_SESSION_PRIVATE(session) ((struct dt_scan_session_private *)(session))
 
@@ -130,6 +142,7 @@ static enum lis_error dt_scan_read(
 	struct lis_scan_session *self, void *out_buffer, size_t *buffer_size
 );
 static void dt_scan_cancel(struct lis_scan_session *self);
+static struct lis_scan_session *dt_scan_get_wrapped(struct lis_scan_session *self);
 
 
 static struct lis_scan_session g_scan_session_template = {
@@ -138,12 +151,14 @@ static struct lis_scan_session g_scan_session_template = {
 	.end_of_page = dt_scan_end_of_page,
 	.scan_read = dt_scan_read,
 	.cancel = dt_scan_cancel,
+	.name = "dedicated_thread",
+	.get_wrapped = dt_scan_get_wrapped,
 };
 
 
 static void *main_loop(void *arg)
 {
-	struct dt_impl_private *private = arg;
+	struct dt_thread *private = arg;
 	int ret;
 	struct op *op;
 
@@ -182,7 +197,7 @@ static void *main_loop(void *arg)
 }
 
 
-static void run(struct dt_impl_private *private, cb_t cb, void *data)
+static void run(struct dt_thread *private, cb_t cb, void *data)
 {
 	struct op op = {
 		.cb = cb,
@@ -216,20 +231,37 @@ static void run(struct dt_impl_private *private, cb_t cb, void *data)
 }
 
 
-static void real_impl_cleanup(void *_data)
+static enum lis_error thread_start(struct dt_thread *private)
 {
-	struct dt_impl_private *private = _data;
-	private->wrapped->cleanup(private->wrapped);
+	int ret;
+
+	ret = pthread_mutex_init(&private->mutex, NULL);
+	assert(ret == 0);
+	ret = pthread_cond_init(&private->cond, NULL);
+	assert(ret == 0);
+	ret = pthread_create(&private->mainloop, NULL, main_loop, private);
+	if (ret != 0) {
+		lis_log_error("Failed to start thread: %d", ret);
+		pthread_cond_destroy(&private->cond);
+		pthread_mutex_destroy(&private->mutex);
+		return LIS_ERR_NO_MEM;
+	}
+	return LIS_OK;
+}
+
+
+static void real_thread_exit(void *_data)
+{
+	LIS_UNUSED(_data);
 	pthread_exit(NULL);
 }
 
 
-static void dt_impl_cleanup(struct lis_api *self)
+static void thread_stop(struct dt_thread *private)
 {
-	struct dt_impl_private *private = DT_IMPL_PRIVATE(self);
 	struct op op = {
-		.cb = real_impl_cleanup,
-		.data = private,
+		.cb = real_thread_exit,
+		.data = NULL,
 		.next = NULL,
 	};
 	int ret;
@@ -267,7 +299,22 @@ static void dt_impl_cleanup(struct lis_api *self)
 
 	ret = pthread_mutex_destroy(&private->mutex);
 	assert(ret == 0);
+}
+
+
+static void real_impl_cleanup(void *_data)
+{
+	struct dt_impl_private *private = _data;
+	private->wrapped->cleanup(private->wrapped);
+}
+
+
+static void dt_impl_cleanup(struct lis_api *self)
+{
+	struct dt_impl_private *private = DT_IMPL_PRIVATE(self);
 
+	run(&private->control, real_impl_cleanup, private);
+	thread_stop(&private->control);
 	FREE(private);
 }
 
@@ -305,13 +352,14 @@ static enum lis_error dt_impl_list_devices(
 		.dev_infos = dev_infos,
 	};
 
-	run(private, real_impl_list_devices, &data);
+	run(&private->control, real_impl_list_devices, &data);
 	return data.ret;
 }
 
 
 struct impl_get_device_data {
 	struct dt_impl_private *private;
+	struct dt_thread *thread;
 	const char *dev_id;
 	struct lis_item **item;
 
@@ -343,6 +391,7 @@ static void real_impl_get_device(void *_data)
 
 	memcpy(&item->parent, &g_item_root_template, sizeof(item->parent));
 	item->impl = data->private;
+	item->thread = data->thread;
 	item->parent.name = item->wrapped->name;
 	item->parent.type = item->wrapped->type;
 	*(data->item) = &item->parent;
@@ -356,11 +405,34 @@ static enum lis_error dt_impl_get_device(
 	struct dt_impl_private *private = DT_IMPL_PRIVATE(self);
 	struct impl_get_device_data data = {
 		.private = private,
+		.thread = &private->control,
 		.dev_id = dev_id,
 		.item = item,
 	};
 
-	run(private, real_impl_get_device, &data);
+	if (!private->per_device) {
+		run(&private->control, real_impl_get_device, &data);
+		return data.ret;
+	}
+
+	// the device is used from its own thread
+	data.thread = calloc(1, sizeof(struct dt_thread));
+	if (data.thread == NULL) {
+		lis_log_error("Out of memory");
+		return LIS_ERR_NO_MEM;
+	}
+	data.ret = thread_start(data.thread);
+	if (LIS_IS_ERROR(data.ret)) {
+		FREE(data.thread);
+		return data.ret;
+	}
+
+	run(&private->control, real_impl_get_device, &data);
+
+	if (LIS_IS_ERROR(data.ret)) {
+		thread_stop(data.thread);
+		FREE(data.thread);
+	}
 	return data.ret;
 }
 
@@ -412,6 +484,7 @@ static void real_item_get_children(void *_data)
 	for (i = 0 ; to_wrap[i] != NULL ; i++) {
 		data->private->children_ptrs[i] = &data->private->children[i].parent;
 		data->private->children[i].impl = data->private->impl;
+		data->private->children[i].thread = data->private->thread;
 		data->private->children[i].wrapped = to_wrap[i];
 		memcpy(
 			&data->private->children[i].parent,
@@ -435,7 +508,7 @@ static enum lis_error dt_item_get_children(
 		.private = private,
 		.children = children,
 	};
-	run(private->impl, real_item_get_children, &data);
+	run(private->thread, real_item_get_children, &data);
 	return data.ret;
 }
 
@@ -468,6 +541,8 @@ static void real_item_get_options(void *_data)
 		return;
 	}
 
+	FREE(data->private->opts_ptrs);
+	FREE(data->private->opts);
 	data->private->opts = calloc(nb_opts, sizeof(struct dt_opt_private));
 	data->private->opts_ptrs = calloc(
 		nb_opts + 1, sizeof(struct lis_option_descriptor *)
@@ -490,7 +565,7 @@ static void real_item_get_options(void *_data)
 		data->private->opts[i].parent.fn.get_value = dt_opt_get_value;
 		data->private->opts[i].parent.fn.set_value = dt_opt_set_value;
 		data->private->opts[i].wrapped = to_wrap[i];
-		data->private->opts[i].impl = data->private->impl;
+		data->private->opts[i].thread = data->private->thread;
 	}
 
 	*(data->descs) = data->private->opts_ptrs;
@@ -506,7 +581,7 @@ static enum lis_error dt_item_get_options(
 		.private = private,
 		.descs = descs,
 	};
-	run(private->impl, real_item_get_options, &data);
+	run(private->thread, real_item_get_options, &data);
 	return data.ret;
 }
 
@@ -548,7 +623,7 @@ static void real_item_scan_start(void *_data)
 		&session->parent, &g_scan_session_template,
 		sizeof(session->parent)
 	);
-	session->impl = data->private->impl;
+	session->thread = data->private->thread;
 
 	*(data->session) = &session->parent;
 }
@@ -563,7 +638,7 @@ static enum lis_error dt_item_scan_start(
 		.private = private,
 		.session = session,
 	};
-	run(private->impl, real_item_scan_start, &data);
+	run(private->thread, real_item_scan_start, &data);
 	return data.ret;
 }
 
@@ -579,6 +654,8 @@ static void close_item(struct dt_item_private *item)
 		FREE(item->children_ptrs);
 		FREE(item->children);
 	}
+	FREE(item->opts_ptrs);
+	FREE(item->opts);
 	FREE(item->session);
 }
 
@@ -595,7 +672,17 @@ static void real_item_root_close(void *_data)
 static void dt_item_root_close(struct lis_item *self)
 {
 	struct dt_item_private *private = DT_ITEM_PRIVATE(self);
-	run(private->impl, real_item_root_close, private);
+	struct dt_impl_private *impl = private->impl;
+	struct dt_thread *thread = private->thread;
+
+	// from the thread that opened it
+	run(&impl->control, real_item_root_close, private);
+	// 'private' has been freed
+
+	if (thread != &impl->control) {
+		thread_stop(thread);
+		FREE(thread);
+	}
 }
 
 
@@ -633,7 +720,7 @@ static enum lis_error dt_opt_get_value(
 		.private = private,
 		.value = value,
 	};
-	run(private->impl, real_opt_get_value, &data);
+	run(private->thread, real_opt_get_value, &data);
 	return data.ret;
 }
 
@@ -669,7 +756,7 @@ static enum lis_error dt_opt_set_value(
 		.value = value,
 		.set_flags = set_flags,
 	};
-	run(private->impl, real_opt_set_value, &data);
+	run(private->thread, real_opt_set_value, &data);
 	return data.ret;
 }
 
@@ -703,7 +790,7 @@ static enum lis_error dt_scan_get_scan_parameters(
 		.private = private,
 		.parameters = parameters,
 	};
-	run(private->impl, real_scan_get_scan_parameters, &data);
+	run(private->thread, real_scan_get_scan_parameters, &data);
 	return data.ret;
 }
 
@@ -729,7 +816,7 @@ static int dt_scan_end_of_feed(struct lis_scan_session *self)
 	struct dt_scan_end_of_data data = {
 		.private = private,
 	};
-	run(private->impl, real_scan_end_of_feed, &data);
+	run(private->thread, real_scan_end_of_feed, &data);
 	return data.ret;
 }
 
@@ -749,7 +836,7 @@ static int dt_scan_end_of_page(struct lis_scan_session *self)
 	struct dt_scan_end_of_data data = {
 		.private = private,
 	};
-	run(private->impl, real_scan_end_of_page, &data);
+	run(private->thread, real_scan_end_of_page, &data);
 	return data.ret;
 }
 
@@ -785,7 +872,7 @@ static enum lis_error dt_scan_read(
 		.out_buffer = out_buffer,
 		.buffer_size = buffer_size,
 	};
-	run(private->impl, real_scan_read, &data);
+	run(private->thread, real_scan_read, &data);
 	return data.ret;
 }
 
@@ -801,18 +888,25 @@ static void real_scan_cancel(void *_data)
 static void dt_scan_cancel(struct lis_scan_session *self)
 {
 	struct dt_scan_session_private *private = DT_SCAN_SESSION_PRIVATE(self);
-	run(private->impl, real_scan_cancel, private);
+	run(private->thread, real_scan_cancel, private);
 	private->item->session = NULL;
 	FREE(private);
 }
 
 
+static struct lis_scan_session *dt_scan_get_wrapped(struct lis_scan_session *self)
+{
+	struct dt_scan_session_private *private = DT_SCAN_SESSION_PRIVATE(self);
+	return private->wrapped;
+}
+
+
 enum lis_error lis_api_workaround_dedicated_thread(
 		struct lis_api *to_wrap, struct lis_api **impl
 	)
 {
 	struct dt_impl_private *private;
-	int ret;
+	enum lis_error err;
 
 	private = calloc(1, sizeof(struct dt_impl_private));
 	if (private == NULL) {
@@ -823,13 +917,18 @@ enum lis_error lis_api_workaround_dedicated_thread(
 	private->wrapped = to_wrap;
 	memcpy(&private->parent, &g_impl_template, sizeof(private->parent));
 	private->parent.base_name = to_wrap->base_name;
+	private->per_device = lis_getenv(
+		"LIBINSANE_WORKAROUND_DEDICATED_THREAD_PER_DEVICE", 0
+	);
+	if (private->per_device) {
+		lis_log_info("Dedicated thread: one thread per device");
+	}
 
-	ret = pthread_mutex_init(&private->mutex, NULL);
-	assert(ret == 0);
-	ret = pthread_cond_init(&private->cond, NULL);
-	assert(ret == 0);
-	ret = pthread_create(&private->mainloop, NULL, main_loop, private);
-	assert(ret == 0);
+	err = thread_start(&private->control);
+	if (LIS_IS_ERROR(err)) {
+		FREE(private);
+		return err;
+	}
 
 	*impl = &private->parent;
 	return LIS_OK;
@@ -0,0 +1,1611 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <libinsane/log.h>
+#include <libinsane/util.h>
+#include <libinsane/workarounds.h>
+
+#include "dedicated_process/pack.h"
+
+
+#define DC_MAGIC 0x4344534C /* "LSDC" */
+#define DC_FORMAT_VERSION 1
+
+
+/*
+ * File format (see dedicated_process/pack.h ; s: lis_pack_str(),
+ * d: lis_pack_int(), v: lis_pack_value()):
+ *
+ * - header: "dddd": magic, format version, body size, body checksum
+ * - body: "ssd": base name, Libinsane version, number of records
+ * - records: "ddd": kind, key, payload size ; followed by the payload
+ *
+ * DC_RECORD_DEVICES payload: "d": number of devices ;
+ *   then "ssss" for each device: dev_id, vendor, model, type
+ * DC_RECORD_DEVICE payload: "s": dev_id ; followed by the root item.
+ * Item: "sdd": name, type, number of options ;
+ *   then for each option: "sssdddd": name, title, desc, capabilities,
+ *   value type, unit, constraint type ; followed by the constraint
+ *   (range: "vvv" ; list: "d" + "v" for each value) ;
+ *   then "d": number of children ; followed by the children.
+ *
+ * The file is mapped in memory and strings are used directly from the
+ * mapping. The file is fully checked when loaded (bounds, NUL-terminated
+ * strings, counts): it is rejected if anything is inconsistent.
+ */
+
+enum dc_record_kind {
+	DC_RECORD_DEVICES = 1, /* list_devices(), key = device locations */
+	DC_RECORD_DEVICE, /* items and options of a device, key = 0 */
+};
+
+
+enum dc_list_state {
+	DC_LIST_CACHED = 0, /* loaded from the file, not revalidated yet */
+	DC_LIST_REVALIDATING,
+	DC_LIST_FRESH, /* revalidated, not returned to the application yet */
+	DC_LIST_LIVE, /* next calls go straight to the wrapped implementation */
+};
+
+
+struct dc_record {
+	enum dc_record_kind kind;
+	int key;
+	const char *dev_id; /* DC_RECORD_DEVICE only ; points in the payload */
+	enum dc_list_state state; /* DC_RECORD_DEVICES only */
+
+	const void *payload;
+	int size;
+
+	struct dc_record *next;
+};
+
+
+/* payloads may still be referenced by descriptors or items returned to the
+ * application: replaced payloads are only freed on cleanup */
+struct dc_garbage {
+	void *ptr;
+	struct dc_garbage *next;
+};
+
+
+struct dc_opt_private {
+	struct lis_option_descriptor parent;
+	struct lis_option_descriptor *wrapped; /* NULL until the device is opened */
+	struct dc_item_private *item;
+	union lis_value *values; /* list constraint loaded from the cache */
+};
+#define DC_OPT_PRIVATE(opt) ((struct dc_opt_private *)(opt))
+
+
+struct dc_item_private {
+	struct lis_item parent;
+	struct lis_item *wrapped; /* NULL until the device is opened */
+	struct dc_root_private *root;
+
+	struct dc_item_private *children;
+	struct lis_item **children_ptrs;
+
+	int nb_opts;
+	struct dc_opt_private *opts;
+	struct lis_option_descriptor **opts_ptrs;
+};
+#define DC_ITEM_PRIVATE(item) ((struct dc_item_private *)(item))
+
+
+struct dc_root_private {
+	struct dc_item_private item;
+	struct dc_impl_private *impl;
+	char *dev_id;
+
+	/* cached descriptors didn't match the actual ones */
+	bool stale;
+
+	struct dc_root_private *next;
+};
+#define DC_ROOT_PRIVATE(item) ((struct dc_root_private *)(item))
+
+
+struct dc_impl_private {
+	struct lis_api parent;
+	struct lis_api *wrapped;
+
+	char *path;
+	void *map;
+	size_t map_size;
+
+	/* protects everything below */
+	pthread_mutex_t mutex;
+	/* serializes the calls to the wrapped implementation. Must be
+	 * locked before 'mutex' */
+	pthread_mutex_t wrapped_mutex;
+
+	struct dc_record *records;
+	struct dc_garbage *garbage;
+
+	struct {
+		bool started;
+		bool running;
+		pthread_t thread;
+		struct dc_record *record;
+	} revalidation;
+
+	struct lis_device_descriptor *descs;
+	struct lis_device_descriptor **descs_ptrs;
+
+	struct dc_root_private *devs;
+};
+#define DC_IMPL_PRIVATE(impl) ((struct dc_impl_private *)(impl))
+
+
+static enum lis_error dc_get_value(
+	struct lis_option_descriptor *self, union lis_value *value
+);
+static enum lis_error dc_set_value(
+	struct lis_option_descriptor *self, union lis_value value,
+	int *set_flags
+);
+
+static enum lis_error dc_get_children(
+	struct lis_item *self, struct lis_item ***children
+);
+static enum lis_error dc_get_options(
+	struct lis_item *self, struct lis_option_descriptor ***descs
+);
+static enum lis_error dc_scan_start(
+	struct lis_item *self, struct lis_scan_session **session
+);
+static void dc_child_close(struct lis_item *self);
+static void dc_root_close(struct lis_item *self);
+
+
+static struct lis_item g_item_child_template = {
+	.get_children = dc_get_children,
+	.get_options = dc_get_options,
+	.scan_start = dc_scan_start,
+	.close = dc_child_close,
+};
+static struct lis_item g_item_root_template = {
+	.get_children = dc_get_children,
+	.get_options = dc_get_options,
+	.scan_start = dc_scan_start,
+	.close = dc_root_close,
+};
+
+
+static enum lis_error dc_list_devices(
+	struct lis_api *impl, enum lis_device_locations locs,
+	struct lis_device_descriptor ***dev_infos
+);
+static enum lis_error dc_get_device(
+	struct lis_api *impl, const char *dev_id, struct lis_item **item
+);
+static void dc_cleanup(struct lis_api *impl);
+
+
+static struct lis_api g_impl_template = {
+	.list_devices = dc_list_devices,
+	.get_device = dc_get_device,
+	.cleanup = dc_cleanup,
+};
+
+
+static uint32_t checksum(const void *data, size_t size)
+{
+	const uint8_t *bytes = data;
+	uint32_t h = 2166136261u; /* FNV-1a */
+	size_t i;
+
+	for (i = 0 ; i < size ; i++) {
+		h ^= bytes[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+static void pack_option(
+		struct lis_pack_buf *buf, const struct lis_option_descriptor *desc
+	)
+{
+	int i;
+
+	lis_pack_str(buf, desc->name);
+	lis_pack_str(buf, desc->title);
+	lis_pack_str(buf, desc->desc);
+	lis_pack_int(buf, desc->capabilities);
+	lis_pack_int(buf, desc->value.type);
+	lis_pack_int(buf, desc->value.unit);
+	lis_pack_int(buf, desc->constraint.type);
+
+	switch(desc->constraint.type) {
+		case LIS_CONSTRAINT_NONE:
+			break;
+		case LIS_CONSTRAINT_RANGE:
+			lis_pack_value(
+				buf, desc->value.type,
+				desc->constraint.possible.range.min
+			);
+			lis_pack_value(
+				buf, desc->value.type,
+				desc->constraint.possible.range.max
+			);
+			lis_pack_value(
+				buf, desc->value.type,
+				desc->constraint.possible.range.interval
+			);
+			break;
+		case LIS_CONSTRAINT_LIST:
+			lis_pack_int(buf, desc->constraint.possible.list.nb_values);
+			for (i = 0 ; i < desc->constraint.possible.list.nb_values ; i++) {
+				lis_pack_value(
+					buf, desc->value.type,
+					desc->constraint.possible.list.values[i]
+				);
+			}
+			break;
+	}
+}
+
+
+/*!
+ * Walks the item tree of an opened device and packs it.
+ */
+static enum lis_error pack_item(struct lis_pack_buf *buf, struct lis_item *item)
+{
+	struct lis_option_descriptor **opts;
+	struct lis_item **children;
+	enum lis_error err;
+	int nb_opts, nb_children, i;
+
+	err = item->get_options(item, &opts);
+	if (LIS_IS_ERROR(err)) {
+		lis_log_error(
+			"%s->get_options() failed: 0x%X, %s",
+			item->name, err, lis_strerror(err)
+		);
+		return err;
+	}
+	for (nb_opts = 0 ; opts[nb_opts] != NULL ; nb_opts++) { }
+
+	lis_pack_str(buf, item->name);
+	lis_pack_int(buf, item->type);
+	lis_pack_int(buf, nb_opts);
+	for (i = 0 ; i < nb_opts ; i++) {
+		pack_option(buf, opts[i]);
+	}
+
+	err = item->get_children(item, &children);
+	if (LIS_IS_ERROR(err)) {
+		lis_log_error(
+			"%s->get_children() failed: 0x%X, %s",
+			item->name, err, lis_strerror(err)
+		);
+		return err;
+	}
+	for (nb_children = 0 ; children[nb_children] != NULL ; nb_children++) { }
+
+	lis_pack_int(buf, nb_children);
+	for (i = 0 ; i < nb_children ; i++) {
+		err = pack_item(buf, children[i]);
+		if (LIS_IS_ERROR(err)) {
+			return err;
+		}
+	}
+
+	return LIS_OK;
+}
+
+
+static enum lis_error pack_device(
+		struct lis_pack_buf *buf, const char *dev_id, struct lis_item *root
+	)
+{
+	enum lis_error err;
+
+	lis_pack_str(buf, dev_id);
+	err = pack_item(buf, root);
+	if (LIS_IS_OK(err) && buf->oom) {
+		lis_log_error("Out of memory");
+		err = LIS_ERR_NO_MEM;
+	}
+	return err;
+}
+
+
+static enum lis_error pack_devices(
+		struct lis_pack_buf *buf, struct lis_device_descriptor **descs
+	)
+{
+	int i;
+
+	for (i = 0 ; descs[i] != NULL ; i++) { }
+	lis_pack_int(buf, i);
+
+	for (i = 0 ; descs[i] != NULL ; i++) {
+		lis_pack_str(buf, descs[i]->dev_id);
+		lis_pack_str(buf, descs[i]->vendor);
+		lis_pack_str(buf, descs[i]->model);
+		lis_pack_str(buf, descs[i]->type);
+	}
+
+	if (buf->oom) {
+		lis_log_error("Out of memory");
+		return LIS_ERR_NO_MEM;
+	}
+	return LIS_OK;
+}
+
+
+/*!
+ * Counts come from the file: each element takes at least one byte.
+ */
+static int unpack_count(struct lis_unpack_buf *in)
+{
+	int count = lis_unpack_int(in);
+
+	if (count < 0 || (size_t)count > (size_t)(in->end - in->ptr)) {
+		in->error = true;
+		return 0;
+	}
+	return count;
+}
+
+
+static void free_descs(struct dc_impl_private *private)
+{
+	FREE(private->descs);
+	FREE(private->descs_ptrs);
+}
+
+
+static enum lis_error unpack_devices(
+		const struct dc_record *record,
+		struct lis_device_descriptor **out_descs,
+		struct lis_device_descriptor ***out_ptrs
+	)
+{
+	struct lis_unpack_buf in;
+	struct lis_device_descriptor *descs;
+	struct lis_device_descriptor **ptrs;
+	int nb_devs, i;
+
+	lis_unpack_buf_init(&in, record->payload, record->size);
+	nb_devs = unpack_count(&in);
+
+	ptrs = calloc(nb_devs + 1, sizeof(struct lis_device_descriptor *));
+	descs = calloc(MAX(nb_devs, 1), sizeof(struct lis_device_descriptor));
+	if (ptrs == NULL || descs == NULL) {
+		lis_log_error("Out of memory");
+		FREE(ptrs);
+		FREE(descs);
+		return LIS_ERR_NO_MEM;
+	}
+
+	for (i = 0 ; i < nb_devs ; i++) {
+		// the file is mapped copy-on-write: the application can
+		// safely modify those strings
+		descs[i].dev_id = (char *)lis_unpack_str(&in);
+		descs[i].vendor = (char *)lis_unpack_str(&in);
+		descs[i].model = (char *)lis_unpack_str(&in);
+		descs[i].type = (char *)lis_unpack_str(&in);
+		ptrs[i] = &descs[i];
+	}
+
+	if (in.error || in.ptr != in.end) {
+		lis_log_error("Corrupted device list in the cache");
+		FREE(ptrs);
+		FREE(descs);
+		return LIS_ERR_IO_ERROR;
+	}
+
+	*out_descs = descs;
+	*out_ptrs = ptrs;
+	return LIS_OK;
+}
+
+
+static enum lis_error load_descs(
+		struct dc_impl_private *private, const struct dc_record *record
+	)
+{
+	free_descs(private);
+	return unpack_devices(record, &private->descs, &private->descs_ptrs);
+}
+
+
+static void free_opts(struct dc_item_private *item)
+{
+	int i;
+
+	for (i = 0 ; i < item->nb_opts ; i++) {
+		FREE(item->opts[i].values);
+	}
+	FREE(item->opts);
+	FREE(item->opts_ptrs);
+	item->nb_opts = 0;
+}
+
+
+static void free_item(struct dc_item_private *item)
+{
+	int i;
+
+	free_opts(item);
+	if (item->children_ptrs != NULL) {
+		for (i = 0 ; item->children_ptrs[i] != NULL ; i++) {
+			free_item(&item->children[i]);
+		}
+	}
+	FREE(item->children);
+	FREE(item->children_ptrs);
+}
+
+
+static enum lis_error alloc_opts(struct dc_item_private *item, int nb_opts)
+{
+	int i;
+
+	item->opts_ptrs = calloc(
+		nb_opts + 1, sizeof(struct lis_option_descriptor *)
+	);
+	item->opts = calloc(MAX(nb_opts, 1), sizeof(struct dc_opt_private));
+	if (item->opts_ptrs == NULL || item->opts == NULL) {
+		lis_log_error("Out of memory");
+		FREE(item->opts_ptrs);
+		FREE(item->opts);
+		return LIS_ERR_NO_MEM;
+	}
+	item->nb_opts = nb_opts;
+
+	for (i = 0 ; i < nb_opts ; i++) {
+		item->opts[i].item = item;
+		item->opts_ptrs[i] = &item->opts[i].parent;
+	}
+	return LIS_OK;
+}
+
+
+static void unpack_option(
+		struct lis_unpack_buf *in, struct dc_opt_private *opt
+	)
+{
+	struct lis_value_list *list = &opt->parent.constraint.possible.list;
+	struct lis_value_range *range = &opt->parent.constraint.possible.range;
+	enum lis_value_type vtype;
+	int i;
+
+	opt->parent.name = lis_unpack_str(in);
+	opt->parent.title = lis_unpack_str(in);
+	opt->parent.desc = lis_unpack_str(in);
+	opt->parent.capabilities = lis_unpack_int(in);
+	opt->parent.value.type = vtype = lis_unpack_int(in);
+	opt->parent.value.unit = lis_unpack_int(in);
+	opt->parent.constraint.type = lis_unpack_int(in);
+	opt->parent.fn.get_value = dc_get_value;
+	opt->parent.fn.set_value = dc_set_value;
+
+	switch(opt->parent.constraint.type) {
+		case LIS_CONSTRAINT_NONE:
+			return;
+		case LIS_CONSTRAINT_RANGE:
+			range->min = lis_unpack_value(in, vtype);
+			range->max = lis_unpack_value(in, vtype);
+			range->interval = lis_unpack_value(in, vtype);
+			return;
+		case LIS_CONSTRAINT_LIST:
+			list->nb_values = unpack_count(in);
+			opt->values = calloc(
+				MAX(list->nb_values, 1), sizeof(union lis_value)
+			);
+			if (opt->values == NULL) {
+				lis_log_error("Out of memory");
+				list->nb_values = 0;
+				in->error = true;
+				return;
+			}
+			for (i = 0 ; i < list->nb_values ; i++) {
+				opt->values[i] = lis_unpack_value(in, vtype);
+			}
+			list->values = opt->values;
+			return;
+	}
+
+	lis_log_error(
+		"Unknown constraint type in the cache: %d",
+		opt->parent.constraint.type
+	);
+	opt->parent.constraint.type = LIS_CONSTRAINT_NONE;
+	in->error = true;
+}
+
+
+/*!
+ * Stops at the first error. in->error is set on any error (out of memory
+ * included).
+ */
+static void unpack_item(
+		struct lis_unpack_buf *in, struct dc_root_private *root,
+		struct dc_item_private *item
+	)
+{
+	int nb_opts, nb_children, i;
+
+	item->root = root;
+	item->parent.name = lis_unpack_str(in);
+	item->parent.type = lis_unpack_int(in);
+	nb_opts = unpack_count(in);
+	if (in->error) {
+		return;
+	}
+
+	if (LIS_IS_ERROR(alloc_opts(item, nb_opts))) {
+		in->error = true;
+		return;
+	}
+	for (i = 0 ; i < nb_opts && !in->error ; i++) {
+		unpack_option(in, &item->opts[i]);
+	}
+
+	nb_children = unpack_count(in);
+	if (in->error) {
+		return;
+	}
+	item->children_ptrs = calloc(nb_children + 1, sizeof(struct lis_item *));
+	item->children = calloc(
+		MAX(nb_children, 1), sizeof(struct dc_item_private)
+	);
+	if (item->children_ptrs == NULL || item->children == NULL) {
+		lis_log_error("Out of memory");
+		FREE(item->children_ptrs);
+		FREE(item->children);
+		in->error = true;
+		return;
+	}
+
+	for (i = 0 ; i < nb_children && !in->error ; i++) {
+		memcpy(
+			&item->children[i].parent, &g_item_child_template,
+			sizeof(item->children[i].parent)
+		);
+		item->children_ptrs[i] = &item->children[i].parent;
+		unpack_item(in, root, &item->children[i]);
+	}
+}
+
+
+/*!
+ * On error, root->item may be partially filled in: it must be freed with
+ * free_item().
+ */
+static enum lis_error unpack_device(
+		const struct dc_record *record, struct dc_root_private *root
+	)
+{
+	struct lis_unpack_buf in;
+
+	lis_unpack_buf_init(&in, record->payload, record->size);
+	lis_unpack_str(&in); // device id
+	unpack_item(&in, root, &root->item);
+	if (in.error || in.ptr != in.end) {
+		lis_log_error("Corrupted device in the cache");
+		return LIS_ERR_IO_ERROR;
+	}
+	return LIS_OK;
+}
+
+
+/*!
+ * Records loaded from the file are parsed once when loaded, so corrupted
+ * files can be rejected as a whole.
+ */
+static bool check_record(const struct dc_record *record)
+{
+	struct lis_device_descriptor *descs = NULL;
+	struct lis_device_descriptor **ptrs = NULL;
+	struct dc_root_private *root;
+	enum lis_error err = LIS_ERR_IO_ERROR;
+
+	switch(record->kind) {
+		case DC_RECORD_DEVICES:
+			err = unpack_devices(record, &descs, &ptrs);
+			FREE(descs);
+			FREE(ptrs);
+			break;
+		case DC_RECORD_DEVICE:
+			root = calloc(1, sizeof(struct dc_root_private));
+			if (root == NULL) {
+				lis_log_error("Out of memory");
+				return false;
+			}
+			err = unpack_device(record, root);
+			free_item(&root->item);
+			FREE(root);
+			break;
+	}
+	return LIS_IS_OK(err);
+}
+
+
+static struct dc_record *find_record(
+		struct dc_impl_private *private, enum dc_record_kind kind,
+		int key, const char *dev_id
+	)
+{
+	struct dc_record *record;
+
+	for (record = private->records ; record != NULL ; record = record->next) {
+		if (record->kind != kind || record->key != key) {
+			continue;
+		}
+		if (kind == DC_RECORD_DEVICE && strcmp(record->dev_id, dev_id) != 0) {
+			continue;
+		}
+		return record;
+	}
+	return NULL;
+}
+
+
+static void add_garbage(struct dc_impl_private *private, void *ptr)
+{
+	struct dc_garbage *garbage;
+
+	garbage = calloc(1, sizeof(struct dc_garbage));
+	if (garbage == NULL) {
+		// better leaking than risking a use-after-free
+		lis_log_error("Out of memory");
+		return;
+	}
+	garbage->ptr = ptr;
+	garbage->next = private->garbage;
+	private->garbage = garbage;
+}
+
+
+/*!
+ * Takes the content of buf, even on error. The buffer is reset.
+ */
+static struct dc_record *store_record(
+		struct dc_impl_private *private, enum dc_record_kind kind,
+		int key, struct lis_pack_buf *buf
+	)
+{
+	struct dc_record *record;
+	const char *dev_id = NULL;
+	struct lis_unpack_buf in;
+	int size = buf->size;
+	void *payload = lis_pack_buf_steal(buf);
+
+	if (kind == DC_RECORD_DEVICE) {
+		lis_unpack_buf_init(&in, payload, size);
+		dev_id = lis_unpack_str(&in);
+	}
+
+	record = find_record(private, kind, key, dev_id);
+	if (record == NULL) {
+		record = calloc(1, sizeof(struct dc_record));
+		if (record == NULL) {
+			lis_log_error("Out of memory");
+			FREE(payload);
+			return NULL;
+		}
+		record->kind = kind;
+		record->key = key;
+		record->next = private->records;
+		private->records = record;
+	}
+
+	add_garbage(private, payload);
+	record->payload = payload;
+	record->size = size;
+	record->dev_id = dev_id;
+	return record;
+}
+
+
+static void make_dirs(const char *path)
+{
+	char *dir;
+	char *sep;
+
+	dir = strdup(path);
+	if (dir == NULL) {
+		return;
+	}
+	for (sep = strchr(dir + 1, '/') ; sep != NULL ; sep = strchr(sep + 1, '/')) {
+		*sep = '\0';
+		if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+			lis_log_warning(
+				"Failed to create %s: %d, %s",
+				dir, errno, strerror(errno)
+			);
+		}
+		*sep = '/';
+	}
+	FREE(dir);
+}
+
+
+static bool write_all(int fd, const void *data, size_t size)
+{
+	ssize_t r;
+
+	while (size > 0) {
+		r = write(fd, data, size);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			return false;
+		}
+		data += r;
+		size -= r;
+	}
+	return true;
+}
+
+
+/*!
+ * Must be called with the mutex held. The file is replaced atomically:
+ * other processes either see the previous version or the new one.
+ */
+static void save_cache(struct dc_impl_private *private)
+{
+	struct dc_record *record;
+	struct lis_pack_buf header = { 0 };
+	struct lis_pack_buf body = { 0 };
+	char *tmp_path = NULL;
+	int nb_records = 0;
+	int fd;
+
+	if (private->path == NULL) {
+		return;
+	}
+
+	for (record = private->records ; record != NULL ; record = record->next) {
+		nb_records++;
+	}
+
+	lis_pack_str(&body, private->wrapped->base_name);
+	lis_pack_str(&body, lis_get_version());
+	lis_pack_int(&body, nb_records);
+	for (record = private->records ; record != NULL ; record = record->next) {
+		lis_pack_int(&body, record->kind);
+		lis_pack_int(&body, record->key);
+		lis_pack_int(&body, record->size);
+		lis_pack_bytes(&body, record->payload, record->size);
+	}
+
+	lis_pack_int(&header, DC_MAGIC);
+	lis_pack_int(&header, DC_FORMAT_VERSION);
+	lis_pack_int(&header, (int)body.size);
+	lis_pack_int(&header, (int)checksum(body.data, body.size));
+
+	if (header.oom || body.oom) {
+		lis_log_error("Out of memory");
+		goto end;
+	}
+
+	make_dirs(private->path);
+	if (asprintf(&tmp_path, "%s.XXXXXX", private->path) < 0) {
+		lis_log_error("Out of memory");
+		tmp_path = NULL;
+		goto end;
+	}
+
+	fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		lis_log_warning(
+			"Failed to create %s: %d, %s",
+			tmp_path, errno, strerror(errno)
+		);
+		goto end;
+	}
+	if (!write_all(fd, header.data, header.size)
+			|| !write_all(fd, body.data, body.size)) {
+		lis_log_warning(
+			"Failed to write %s: %d, %s",
+			tmp_path, errno, strerror(errno)
+		);
+		close(fd);
+		unlink(tmp_path);
+		goto end;
+	}
+	close(fd);
+
+	if (rename(tmp_path, private->path) < 0) {
+		lis_log_warning(
+			"Failed to rename %s into %s: %d, %s",
+			tmp_path, private->path, errno, strerror(errno)
+		);
+		unlink(tmp_path);
+		goto end;
+	}
+	lis_log_info(
+		"%s: %d records saved (%lu bytes)",
+		private->path, nb_records, (unsigned long)body.size
+	);
+
+end:
+	FREE(tmp_path);
+	lis_pack_buf_free(&header);
+	lis_pack_buf_free(&body);
+}
+
+
+static void load_cache(struct dc_impl_private *private)
+{
+	struct stat st;
+	int fd;
+	int magic, version, body_size, sum;
+	int nb_records, i;
+	const char *base_name, *lis_version;
+	struct lis_unpack_buf in;
+	struct dc_record *record;
+
+	fd = open(private->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			lis_log_warning(
+				"Failed to open %s: %d, %s",
+				private->path, errno, strerror(errno)
+			);
+		}
+		return;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)(4 * sizeof(int))) {
+		lis_log_warning("%s: invalid cache file", private->path);
+		close(fd);
+		return;
+	}
+
+	// copy-on-write: strings given to the application can be modified
+	private->map = mmap(
+		NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0
+	);
+	close(fd);
+	if (private->map == MAP_FAILED) {
+		lis_log_warning(
+			"Failed to map %s: %d, %s",
+			private->path, errno, strerror(errno)
+		);
+		private->map = NULL;
+		return;
+	}
+	private->map_size = st.st_size;
+
+	lis_unpack_buf_init(&in, private->map, private->map_size);
+	magic = lis_unpack_int(&in);
+	version = lis_unpack_int(&in);
+	body_size = lis_unpack_int(&in);
+	sum = lis_unpack_int(&in);
+	if (in.error || magic != DC_MAGIC || version != DC_FORMAT_VERSION
+			|| body_size < 0
+			|| (size_t)body_size != (size_t)(in.end - in.ptr)
+			|| (uint32_t)sum != checksum(in.ptr, body_size)) {
+		lis_log_warning(
+			"%s: invalid or corrupted cache file. Ignored",
+			private->path
+		);
+		goto error;
+	}
+
+	base_name = lis_unpack_str(&in);
+	lis_version = lis_unpack_str(&in);
+	nb_records = unpack_count(&in);
+	if (in.error) {
+		lis_log_warning("%s: truncated cache file. Ignored", private->path);
+		goto error;
+	}
+	if (strcmp(base_name, private->wrapped->base_name) != 0
+			|| strcmp(lis_version, lis_get_version()) != 0) {
+		lis_log_info(
+			"%s: cache generated by %s (Libinsane %s). Ignored",
+			private->path, base_name, lis_version
+		);
+		goto error;
+	}
+
+	for (i = 0 ; i < nb_records ; i++) {
+		record = calloc(1, sizeof(struct dc_record));
+		if (record == NULL) {
+			lis_log_error("Out of memory");
+			goto error;
+		}
+		record->next = private->records;
+		private->records = record;
+
+		record->kind = lis_unpack_int(&in);
+		record->key = lis_unpack_int(&in);
+		record->size = lis_unpack_int(&in);
+		record->state = DC_LIST_CACHED;
+		if (record->size < 0) {
+			in.error = true;
+		} else {
+			record->payload = lis_unpack_raw(&in, record->size);
+		}
+		if (in.error) {
+			lis_log_warning("%s: invalid record size", private->path);
+			goto error;
+		}
+		if (!check_record(record)) {
+			lis_log_warning(
+				"%s: invalid record (kind=%d). Ignored",
+				private->path, record->kind
+			);
+			goto error;
+		}
+		if (record->kind == DC_RECORD_DEVICE) {
+			// NUL-terminated: checked by check_record()
+			record->dev_id = record->payload;
+		}
+	}
+	if (in.ptr != in.end) {
+		lis_log_warning("%s: trailing data. Ignored", private->path);
+		goto error;
+	}
+
+	lis_log_info("%s: %d records loaded", private->path, nb_records);
+	return;
+
+error:
+	while (private->records != NULL) {
+		record = private->records;
+		private->records = record->next;
+		FREE(record);
+	}
+	munmap(private->map, private->map_size);
+	private->map = NULL;
+}
+
+
+static char *get_cache_path(struct lis_api *to_wrap)
+{
+	const char *path;
+	const char *dir;
+	char *out = NULL;
+	int r;
+
+	path = getenv("LIBINSANE_WORKAROUND_DISK_CACHE_PATH");
+	if (path != NULL && path[0] != '\0') {
+		return strdup(path);
+	}
+
+	dir = getenv("XDG_CACHE_HOME");
+	if (dir != NULL && dir[0] != '\0') {
+		r = asprintf(&out, "%s/libinsane/%s.cache", dir, to_wrap->base_name);
+	} else {
+		dir = getenv("HOME");
+		if (dir == NULL || dir[0] == '\0') {
+			lis_log_warning(
+				"Neither XDG_CACHE_HOME nor HOME is set."
+				" Device cache won't be persistent"
+			);
+			return NULL;
+		}
+		r = asprintf(
+			&out, "%s/.cache/libinsane/%s.cache", dir,
+			to_wrap->base_name
+		);
+	}
+	if (r < 0) {
+		lis_log_error("Out of memory");
+		return NULL;
+	}
+	return out;
+}
+
+
+/*!
+ * Maps the items and options of the actual device on the ones loaded from
+ * the cache (by name). Items and options that have disappeared stay
+ * unmapped: calls on them will fail.
+ */
+static enum lis_error map_item(
+		struct dc_item_private *item, struct lis_item *wrapped
+	)
+{
+	struct lis_option_descriptor **opts;
+	struct lis_item **children;
+	enum lis_error err;
+	int i, j;
+
+	item->wrapped = wrapped;
+
+	err = wrapped->get_options(wrapped, &opts);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+	for (i = 0 ; i < item->nb_opts ; i++) {
+		for (j = 0 ; opts[j] != NULL ; j++) {
+			if (strcmp(item->opts[i].parent.name, opts[j]->name) == 0) {
+				break;
+			}
+		}
+		item->opts[i].wrapped = opts[j];
+		if (opts[j] == NULL) {
+			lis_log_warning(
+				"%s: option '%s' doesn't exist anymore",
+				item->parent.name, item->opts[i].parent.name
+			);
+			continue;
+		}
+		// descriptors handed to the application are updated in place
+		memcpy(
+			&item->opts[i].parent, opts[j],
+			sizeof(item->opts[i].parent)
+		);
+		item->opts[i].parent.fn.get_value = dc_get_value;
+		item->opts[i].parent.fn.set_value = dc_set_value;
+	}
+
+	err = wrapped->get_children(wrapped, &children);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+	for (i = 0 ; item->children_ptrs[i] != NULL ; i++) {
+		for (j = 0 ; children[j] != NULL ; j++) {
+			if (strcmp(item->children[i].parent.name, children[j]->name) == 0) {
+				break;
+			}
+		}
+		if (children[j] == NULL) {
+			lis_log_warning(
+				"%s: item '%s' doesn't exist anymore",
+				item->parent.name, item->children[i].parent.name
+			);
+			continue;
+		}
+		err = map_item(&item->children[i], children[j]);
+		if (LIS_IS_ERROR(err)) {
+			return err;
+		}
+	}
+
+	return LIS_OK;
+}
+
+
+/*!
+ * Opens the actual device. Must be called with the wrapped_mutex held.
+ * The cache entry of the device is revalidated at the same time.
+ */
+static enum lis_error root_open(struct dc_root_private *root)
+{
+	struct dc_impl_private *private = root->impl;
+	struct lis_item *wrapped = NULL;
+	struct dc_record *record;
+	struct lis_pack_buf buf = { 0 };
+	enum lis_error err;
+
+	if (root->item.wrapped != NULL) {
+		return LIS_OK;
+	}
+
+	lis_log_info("%s: opening the device", root->dev_id);
+	err = private->wrapped->get_device(private->wrapped, root->dev_id, &wrapped);
+	if (LIS_IS_ERROR(err)) {
+		lis_log_error(
+			"Failed to get_device(%s): 0x%X, %s",
+			root->dev_id, err, lis_strerror(err)
+		);
+		return err;
+	}
+
+	err = pack_device(&buf, root->dev_id, wrapped);
+	if (LIS_IS_ERROR(err)) {
+		lis_pack_buf_free(&buf);
+		wrapped->close(wrapped);
+		return err;
+	}
+
+	pthread_mutex_lock(&private->mutex);
+	record = find_record(private, DC_RECORD_DEVICE, 0, root->dev_id);
+	if (record == NULL
+			|| (size_t)record->size != buf.size
+			|| memcmp(record->payload, buf.data, record->size) != 0) {
+		lis_log_info("%s: cached descriptors are outdated", root->dev_id);
+		root->stale = true;
+		store_record(private, DC_RECORD_DEVICE, 0, &buf);
+		save_cache(private);
+	}
+	pthread_mutex_unlock(&private->mutex);
+	lis_pack_buf_free(&buf);
+
+	err = map_item(&root->item, wrapped);
+	if (LIS_IS_ERROR(err)) {
+		wrapped->close(wrapped);
+		root->item.wrapped = NULL;
+		return err;
+	}
+
+	return LIS_OK;
+}
+
+
+static enum lis_error dc_get_value(
+		struct lis_option_descriptor *self, union lis_value *value
+	)
+{
+	struct dc_opt_private *private = DC_OPT_PRIVATE(self);
+	struct dc_impl_private *impl = private->item->root->impl;
+	enum lis_error err;
+
+	pthread_mutex_lock(&impl->wrapped_mutex);
+	err = root_open(private->item->root);
+	if (LIS_IS_OK(err)) {
+		if (private->wrapped == NULL) {
+			lis_log_error("%s->get_value(): option is gone", self->name);
+			err = LIS_ERR_INVALID_VALUE;
+		} else {
+			err = private->wrapped->fn.get_value(private->wrapped, value);
+		}
+	}
+	pthread_mutex_unlock(&impl->wrapped_mutex);
+	return err;
+}
+
+
+static enum lis_error dc_set_value(
+		struct lis_option_descriptor *self, union lis_value value,
+		int *set_flags
+	)
+{
+	struct dc_opt_private *private = DC_OPT_PRIVATE(self);
+	struct dc_root_private *root = private->item->root;
+	enum lis_error err;
+
+	*set_flags = 0;
+
+	pthread_mutex_lock(&root->impl->wrapped_mutex);
+	err = root_open(root);
+	if (LIS_IS_OK(err)) {
+		if (private->wrapped == NULL) {
+			lis_log_error("%s->set_value(): option is gone", self->name);
+			err = LIS_ERR_INVALID_VALUE;
+		} else {
+			err = private->wrapped->fn.set_value(
+				private->wrapped, value, set_flags
+			);
+		}
+	}
+	if (root->stale) {
+		// the application got outdated descriptors from the cache
+		*set_flags |= LIS_SET_FLAG_MUST_RELOAD_OPTIONS;
+		root->stale = false;
+	}
+	pthread_mutex_unlock(&root->impl->wrapped_mutex);
+	return err;
+}
+
+
+static enum lis_error dc_get_options(
+		struct lis_item *self, struct lis_option_descriptor ***descs
+	)
+{
+	struct dc_item_private *private = DC_ITEM_PRIVATE(self);
+	struct dc_impl_private *impl = private->root->impl;
+	struct lis_option_descriptor **opts;
+	enum lis_error err;
+	int nb_opts, i;
+
+	pthread_mutex_lock(&impl->wrapped_mutex);
+	if (private->wrapped == NULL) {
+		// not opened yet: cached descriptors
+		pthread_mutex_unlock(&impl->wrapped_mutex);
+		*descs = private->opts_ptrs;
+		return LIS_OK;
+	}
+
+	err = private->wrapped->get_options(private->wrapped, &opts);
+	if (LIS_IS_ERROR(err)) {
+		pthread_mutex_unlock(&impl->wrapped_mutex);
+		return err;
+	}
+
+	free_opts(private);
+	for (nb_opts = 0 ; opts[nb_opts] != NULL ; nb_opts++) { }
+	err = alloc_opts(private, nb_opts);
+	if (LIS_IS_ERROR(err)) {
+		pthread_mutex_unlock(&impl->wrapped_mutex);
+		return err;
+	}
+	for (i = 0 ; i < nb_opts ; i++) {
+		memcpy(
+			&private->opts[i].parent, opts[i],
+			sizeof(private->opts[i].parent)
+		);
+		private->opts[i].parent.fn.get_value = dc_get_value;
+		private->opts[i].parent.fn.set_value = dc_set_value;
+		private->opts[i].wrapped = opts[i];
+	}
+	private->root->stale = false;
+	pthread_mutex_unlock(&impl->wrapped_mutex);
+
+	*descs = private->opts_ptrs;
+	return LIS_OK;
+}
+
+
+static enum lis_error dc_get_children(
+		struct lis_item *self, struct lis_item ***children
+	)
+{
+	struct dc_item_private *private = DC_ITEM_PRIVATE(self);
+	*children = private->children_ptrs;
+	return LIS_OK;
+}
+
+
+static enum lis_error dc_scan_start(
+		struct lis_item *self, struct lis_scan_session **session
+	)
+{
+	struct dc_item_private *private = DC_ITEM_PRIVATE(self);
+	struct dc_impl_private *impl = private->root->impl;
+	enum lis_error err;
+
+	pthread_mutex_lock(&impl->wrapped_mutex);
+	err = root_open(private->root);
+	if (LIS_IS_OK(err)) {
+		if (private->wrapped == NULL) {
+			lis_log_error("%s->scan_start(): item is gone", self->name);
+			err = LIS_ERR_INVALID_VALUE;
+		} else {
+			err = private->wrapped->scan_start(private->wrapped, session);
+		}
+	}
+	pthread_mutex_unlock(&impl->wrapped_mutex);
+	return err;
+}
+
+
+static void dc_child_close(struct lis_item *self)
+{
+	// children are freed with their root item
+	LIS_UNUSED(self);
+}
+
+
+static void free_root(struct dc_root_private *root)
+{
+	free_item(&root->item);
+	FREE(root->dev_id);
+	FREE(root);
+}
+
+
+static void dc_root_close(struct lis_item *self)
+{
+	struct dc_root_private *root = DC_ROOT_PRIVATE(self);
+	struct dc_impl_private *private = root->impl;
+	struct dc_root_private **pdev;
+
+	pthread_mutex_lock(&private->wrapped_mutex);
+	if (root->item.wrapped != NULL) {
+		root->item.wrapped->close(root->item.wrapped);
+	}
+	pthread_mutex_unlock(&private->wrapped_mutex);
+
+	pthread_mutex_lock(&private->mutex);
+	for (pdev = &private->devs ; *pdev != NULL ; pdev = &(*pdev)->next) {
+		if (*pdev == root) {
+			*pdev = root->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&private->mutex);
+
+	free_root(root);
+}
+
+
+static void *revalidation_thread(void *_private)
+{
+	struct dc_impl_private *private = _private;
+	struct lis_device_descriptor **descs;
+	struct dc_record *record = private->revalidation.record;
+	struct lis_pack_buf buf = { 0 };
+	enum lis_error err;
+
+	pthread_mutex_lock(&private->wrapped_mutex);
+	err = private->wrapped->list_devices(
+		private->wrapped, record->key, &descs
+	);
+	if (LIS_IS_OK(err)) {
+		err = pack_devices(&buf, descs);
+	}
+	pthread_mutex_unlock(&private->wrapped_mutex);
+
+	pthread_mutex_lock(&private->mutex);
+	if (LIS_IS_OK(err)) {
+		store_record(private, DC_RECORD_DEVICES, record->key, &buf);
+		record->state = DC_LIST_FRESH;
+		save_cache(private);
+	} else {
+		lis_log_warning(
+			"Failed to revalidate the device list: 0x%X, %s",
+			err, lis_strerror(err)
+		);
+		lis_pack_buf_free(&buf);
+		// next call will go to the wrapped implementation and
+		// report the error
+		record->state = DC_LIST_LIVE;
+	}
+	private->revalidation.running = false;
+	pthread_mutex_unlock(&private->mutex);
+
+	return NULL;
+}
+
+
+static void start_revalidation(
+		struct dc_impl_private *private, struct dc_record *record
+	)
+{
+	int r;
+
+	if (private->revalidation.running) {
+		// one at a time: will be revalidated on next call
+		return;
+	}
+	if (private->revalidation.started) {
+		pthread_join(private->revalidation.thread, NULL);
+		private->revalidation.started = false;
+	}
+
+	private->revalidation.record = record;
+	private->revalidation.running = true;
+	record->state = DC_LIST_REVALIDATING;
+	r = pthread_create(
+		&private->revalidation.thread, NULL, revalidation_thread,
+		private
+	);
+	if (r != 0) {
+		lis_log_warning(
+			"Failed to start revalidation thread: %d, %s",
+			r, strerror(r)
+		);
+		private->revalidation.running = false;
+		record->state = DC_LIST_LIVE;
+		return;
+	}
+	private->revalidation.started = true;
+}
+
+
+static enum lis_error dc_list_devices(
+		struct lis_api *impl, enum lis_device_locations locs,
+		struct lis_device_descriptor ***dev_infos
+	)
+{
+	struct dc_impl_private *private = DC_IMPL_PRIVATE(impl);
+	struct lis_device_descriptor **descs;
+	struct dc_record *record;
+	struct lis_pack_buf buf = { 0 };
+	enum lis_error err;
+
+	pthread_mutex_lock(&private->mutex);
+	record = find_record(private, DC_RECORD_DEVICES, locs, NULL);
+	if (record != NULL && record->state != DC_LIST_LIVE) {
+		switch(record->state) {
+			case DC_LIST_CACHED:
+				lis_log_info("list_devices(): using cached list");
+				start_revalidation(private, record);
+				break;
+			case DC_LIST_REVALIDATING:
+				lis_log_info("list_devices(): still revalidating");
+				break;
+			case DC_LIST_FRESH:
+			case DC_LIST_LIVE:
+				lis_log_info("list_devices(): using revalidated list");
+				record->state = DC_LIST_LIVE;
+				break;
+		}
+		err = load_descs(private, record);
+		pthread_mutex_unlock(&private->mutex);
+		*dev_infos = private->descs_ptrs;
+		return err;
+	}
+	pthread_mutex_unlock(&private->mutex);
+
+	pthread_mutex_lock(&private->wrapped_mutex);
+	err = private->wrapped->list_devices(private->wrapped, locs, &descs);
+	if (LIS_IS_OK(err)) {
+		err = pack_devices(&buf, descs);
+	}
+	pthread_mutex_unlock(&private->wrapped_mutex);
+	if (LIS_IS_ERROR(err)) {
+		lis_pack_buf_free(&buf);
+		return err;
+	}
+
+	pthread_mutex_lock(&private->mutex);
+	record = store_record(private, DC_RECORD_DEVICES, locs, &buf);
+	if (record == NULL) {
+		pthread_mutex_unlock(&private->mutex);
+		return LIS_ERR_NO_MEM;
+	}
+	record->state = DC_LIST_LIVE;
+	save_cache(private);
+	err = load_descs(private, record);
+	pthread_mutex_unlock(&private->mutex);
+
+	*dev_infos = private->descs_ptrs;
+	return err;
+}
+
+
+static enum lis_error dc_get_device(
+		struct lis_api *impl, const char *dev_id, struct lis_item **item
+	)
+{
+	struct dc_impl_private *private = DC_IMPL_PRIVATE(impl);
+	struct dc_root_private *root;
+	struct dc_record *record;
+	struct lis_item *wrapped = NULL;
+	struct lis_pack_buf buf = { 0 };
+	enum lis_error err;
+
+	root = calloc(1, sizeof(struct dc_root_private));
+	if (root == NULL) {
+		lis_log_error("Out of memory");
+		return LIS_ERR_NO_MEM;
+	}
+	memcpy(&root->item.parent, &g_item_root_template, sizeof(root->item.parent));
+	root->impl = private;
+	root->dev_id = strdup(dev_id);
+	if (root->dev_id == NULL) {
+		lis_log_error("Out of memory");
+		FREE(root);
+		return LIS_ERR_NO_MEM;
+	}
+
+	pthread_mutex_lock(&private->wrapped_mutex);
+	pthread_mutex_lock(&private->mutex);
+	record = find_record(private, DC_RECORD_DEVICE, 0, dev_id);
+	pthread_mutex_unlock(&private->mutex);
+
+	if (record != NULL) {
+		// the device will only be opened when actually required
+		lis_log_info("get_device(%s): using cached descriptors", dev_id);
+	} else {
+		err = private->wrapped->get_device(private->wrapped, dev_id, &wrapped);
+		if (LIS_IS_ERROR(err)) {
+			lis_log_error(
+				"Failed to get_device(%s): 0x%X, %s",
+				dev_id, err, lis_strerror(err)
+			);
+			goto error;
+		}
+		err = pack_device(&buf, dev_id, wrapped);
+		if (LIS_IS_ERROR(err)) {
+			lis_pack_buf_free(&buf);
+			goto error;
+		}
+		pthread_mutex_lock(&private->mutex);
+		record = store_record(private, DC_RECORD_DEVICE, 0, &buf);
+		if (record != NULL) {
+			save_cache(private);
+		}
+		pthread_mutex_unlock(&private->mutex);
+		if (record == NULL) {
+			err = LIS_ERR_NO_MEM;
+			goto error;
+		}
+	}
+
+	// record payloads are never freed before cleanup
+	err = unpack_device(record, root);
+	if (LIS_IS_ERROR(err)) {
+		goto error;
+	}
+
+	if (wrapped != NULL) {
+		err = map_item(&root->item, wrapped);
+		if (LIS_IS_ERROR(err)) {
+			goto error;
+		}
+	}
+	pthread_mutex_unlock(&private->wrapped_mutex);
+
+	pthread_mutex_lock(&private->mutex);
+	root->next = private->devs;
+	private->devs = root;
+	pthread_mutex_unlock(&private->mutex);
+
+	*item = &root->item.parent;
+	return LIS_OK;
+
+error:
+	if (wrapped != NULL) {
+		wrapped->close(wrapped);
+	}
+	pthread_mutex_unlock(&private->wrapped_mutex);
+	free_root(root);
+	return err;
+}
+
+
+static void dc_cleanup(struct lis_api *impl)
+{
+	struct dc_impl_private *private = DC_IMPL_PRIVATE(impl);
+	struct dc_record *record;
+	struct dc_garbage *garbage;
+
+	if (private->revalidation.started) {
+		pthread_join(private->revalidation.thread, NULL);
+	}
+
+	while (private->devs != NULL) {
+		lis_log_warning(
+			"disk_cache->cleanup(): Device '%s' wasn't closed."
+			" Closing now", private->devs->dev_id
+		);
+		dc_root_close(&private->devs->item.parent);
+	}
+
+	free_descs(private);
+	while (private->records != NULL) {
+		record = private->records;
+		private->records = record->next;
+		FREE(record);
+	}
+	while (private->garbage != NULL) {
+		garbage = private->garbage;
+		private->garbage = garbage->next;
+		FREE(garbage->ptr);
+		FREE(garbage);
+	}
+	if (private->map != NULL) {
+		munmap(private->map, private->map_size);
+	}
+
+	pthread_mutex_destroy(&private->wrapped_mutex);
+	pthread_mutex_destroy(&private->mutex);
+
+	private->wrapped->cleanup(private->wrapped);
+	FREE(private->path);
+	FREE(private);
+}
+
+
+enum lis_error lis_api_workaround_disk_cache(
+		struct lis_api *to_wrap, struct lis_api **out_impl
+	)
+{
+	struct dc_impl_private *private;
+
+	private = calloc(1, sizeof(struct dc_impl_private));
+	if (private == NULL) {
+		lis_log_error("Out of memory");
+		return LIS_ERR_NO_MEM;
+	}
+	memcpy(&private->parent, &g_impl_template, sizeof(private->parent));
+	private->parent.base_name = to_wrap->base_name;
+	private->wrapped = to_wrap;
+	pthread_mutex_init(&private->mutex, NULL);
+	pthread_mutex_init(&private->wrapped_mutex, NULL);
+
+	private->path = get_cache_path(to_wrap);
+	if (private->path != NULL) {
+		load_cache(private);
+	}
+
+	*out_impl = &private->parent;
+	return LIS_OK;
+}
@@ -22,6 +22,8 @@ static enum lis_error lis_lamp_scan_read(
 	struct lis_scan_session *session, void *out_buffer, size_t *buffer_size
 );
 static void lis_lamp_cancel(struct lis_scan_session *session);
+static int lis_lamp_get_fd(struct lis_scan_session *session);
+static struct lis_scan_session *lis_lamp_get_wrapped(struct lis_scan_session *session);
 
 
 struct lis_lamp_scan_session
@@ -41,10 +43,16 @@ static struct lis_scan_session g_scan_session_template = {
 	.end_of_page = lis_lamp_end_of_page,
 	.scan_read = lis_lamp_scan_read,
 	.cancel = lis_lamp_cancel,
+	.get_fd = lis_lamp_get_fd,
+	.name = "lamp",
+	.get_wrapped = lis_lamp_get_wrapped,
 };
 
 
-static void set_lamp_switch(struct lis_item *item, int lamp_switch)
+/**
+ * \return 1 if the item has a lamp switch option, 0 otherwise
+ */
+static int set_lamp_switch(struct lis_item *item, int lamp_switch)
 {
 	enum lis_error err;
 	struct lis_option_descriptor **opts;
@@ -60,7 +68,7 @@ static void set_lamp_switch(struct lis_item *item, int lamp_switch)
 			"Cannot set lamp on %s to %d: Failed to get options: %d, %s",
 			item->name, lamp_switch, err, lis_strerror(err)
 		);
-		return;
+		return 0;
 	}
 
 	for (opt_idx = 0 ; opts[opt_idx] != NULL ; opt_idx++) {
@@ -73,7 +81,7 @@ static void set_lamp_switch(struct lis_item *item, int lamp_switch)
 					item->name, lamp_switch,
 					err, lis_strerror(err)
 				);
-				return;
+				return 1;
 			}
 			if (set_flags != 0) {
 				lis_log_warning(
@@ -81,11 +89,12 @@ static void set_lamp_switch(struct lis_item *item, int lamp_switch)
 					" was returned: 0x%X",
 					item->name, lamp_switch, set_flags
 				);
-				return;
+				return 1;
 			}
-			return;
+			return 1;
 		}
 	}
+	return 0;
 }
 
 
@@ -107,14 +116,17 @@ static enum lis_error lamp_scan_start(
 		lis_bw_item_set_user_ptr(root, NULL);
 	}
 
+	if (!set_lamp_switch(original, 1)) {
+		// no lamp to switch off at the end of the scan
+		return original->scan_start(original, out);
+	}
+
 	private = calloc(1, sizeof(struct lis_lamp_scan_session));
 	if (private == NULL) {
 		lis_log_error("Out of memory");
 		return LIS_ERR_NO_MEM;
 	}
 
-	set_lamp_switch(original, 1);
-
 	err = original->scan_start(original, &private->wrapped);
 	if (LIS_IS_ERROR(err)) {
 		lis_log_error(
@@ -186,6 +198,24 @@ static void lis_lamp_cancel(struct lis_scan_session *session)
 }
 
 
+static int lis_lamp_get_fd(struct lis_scan_session *session)
+{
+	struct lis_lamp_scan_session *private = LIS_LAMP_SCAN_SESSION_PRIVATE(session);
+
+	if (private->wrapped->get_fd == NULL) {
+		return -1;
+	}
+	return private->wrapped->get_fd(private->wrapped);
+}
+
+
+static struct lis_scan_session *lis_lamp_get_wrapped(struct lis_scan_session *session)
+{
+	struct lis_lamp_scan_session *private = LIS_LAMP_SCAN_SESSION_PRIVATE(session);
+	return private->wrapped;
+}
+
+
 static void lamp_on_item_close(struct lis_item *item, int root, void *user_data)
 {
 	struct lis_lamp_scan_session *private;
@@ -32,6 +32,8 @@ static enum lis_error one_scan_read(
 	void *out_buffer, size_t *bufsize
 );
 static void one_cancel(struct lis_scan_session *self);
+static int one_get_fd(struct lis_scan_session *self);
+static struct lis_scan_session *one_get_wrapped(struct lis_scan_session *self);
 
 
 static struct lis_scan_session g_scan_session_template = {
@@ -40,6 +42,9 @@ static struct lis_scan_session g_scan_session_template = {
 	.end_of_page = one_end_of_page,
 	.scan_read = one_scan_read,
 	.cancel = one_cancel,
+	.get_fd = one_get_fd,
+	.name = "one_page_flatbed",
+	.get_wrapped = one_get_wrapped,
 };
 
 
@@ -116,6 +121,25 @@ static void one_cancel(struct lis_scan_session *self)
 }
 
 
+static int one_get_fd(struct lis_scan_session *self)
+{
+	struct one_scan_session_private *private = \
+		ONE_SCAN_SESSION_PRIVATE(self);
+
+	if (private->wrapped->get_fd == NULL) {
+		return -1;
+	}
+	return private->wrapped->get_fd(private->wrapped);
+}
+
+
+static struct lis_scan_session *one_get_wrapped(struct lis_scan_session *self)
+{
+	struct one_scan_session_private *private = ONE_SCAN_SESSION_PRIVATE(self);
+	return private->wrapped;
+}
+
+
 static enum lis_error on_scan_start(
 		struct lis_item *item, struct lis_scan_session **out_session,
 		void *user_data
@@ -123,6 +147,7 @@ static enum lis_error on_scan_start(
 {
 	enum lis_error err;
 	struct one_scan_session_private *session;
+	struct lis_item *original;
 
 	LIS_UNUSED(user_data);
 
@@ -130,6 +155,13 @@ static enum lis_error on_scan_start(
 	FREE(session);
 	lis_bw_item_set_user_ptr(item, NULL);
 
+	original = lis_bw_get_original_item(item);
+	if (original->type == LIS_ITEM_ADF) {
+		// nothing to fix: the application can read directly from the
+		// wrapped session
+		return original->scan_start(original, out_session);
+	}
+
 	session = calloc(1, sizeof(struct one_scan_session_private));
 	if (session == NULL) {
 		lis_log_error("Out of memory");
@@ -137,7 +169,7 @@ static enum lis_error on_scan_start(
 	}
 
 	session->bw_item = item;
-	item = lis_bw_get_original_item(item);
+	item = original;
 
 	err = item->scan_start(item, &session->wrapped);
 	if (LIS_IS_ERROR(err)) {
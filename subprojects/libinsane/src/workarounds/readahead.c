@@ -0,0 +1,467 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libinsane/capi.h>
+#include <libinsane/log.h>
+#include <libinsane/workarounds.h>
+#include <libinsane/util.h>
+
+#include "../basewrapper.h"
+
+#define NAME "readahead"
+
+#define CHUNK_SIZE (64 * 1024)
+#define DEFAULT_MAX_MEMORY 8192 // KB
+
+
+#define LIS_LOCK(mutex) do { \
+		int __pthread_r; \
+		__pthread_r = pthread_mutex_lock(mutex); \
+		assert(__pthread_r == 0); \
+	} while(0)
+
+#define LIS_UNLOCK(mutex) do { \
+		int __pthread_r; \
+		__pthread_r = pthread_mutex_unlock(mutex); \
+		assert(__pthread_r == 0); \
+	} while(0)
+
+
+struct readahead_chunk
+{
+	struct readahead_chunk *next;
+	size_t size; // bytes in data[]
+	size_t offset; // bytes of data[] already returned to the application
+	uint8_t data[];
+};
+
+
+enum readahead_state
+{
+	READAHEAD_READING, // the producer is reading the current page
+	READAHEAD_PAGE_DONE, // end of page reached ; waiting for the next page
+	READAHEAD_FAILED, // the producer got an error ; see err
+	READAHEAD_STOPPING, // session is being cancelled
+};
+
+
+struct readahead_session
+{
+	struct lis_scan_session parent;
+	struct lis_scan_session *wrapped;
+	struct lis_item *bw_item; /* basewrapper item */
+
+	pthread_t producer;
+
+	/* serializes the calls to the wrapped session: the producer calls
+	 * scan_read() and end_of_page() while the application may call
+	 * get_scan_parameters() */
+	pthread_mutex_t wrapped_mutex;
+
+	pthread_mutex_t mutex; // protects everything below
+	pthread_cond_t cond;
+	enum readahead_state state;
+	enum lis_error err; // if state == READAHEAD_FAILED
+	bool page_start; // first read of a page that isn't the first one
+	bool end_of_feed; // wrapped end_of_feed() has returned 1
+
+	struct {
+		struct readahead_chunk *first;
+		struct readahead_chunk *last;
+		int nb_chunks;
+		int max_chunks;
+	} queue;
+	struct readahead_chunk *free_chunks;
+};
+#define READAHEAD_SESSION_PRIVATE(session) \
+	((struct readahead_session *)(session))
+
+
+static enum lis_error readahead_get_scan_parameters(
+	struct lis_scan_session *self,
+	struct lis_scan_parameters *params
+);
+static int readahead_end_of_feed(struct lis_scan_session *self);
+static int readahead_end_of_page(struct lis_scan_session *self);
+static enum lis_error readahead_scan_read(
+	struct lis_scan_session *self,
+	void *out_buffer, size_t *bufsize
+);
+static void readahead_cancel(struct lis_scan_session *self);
+static struct lis_scan_session *readahead_get_wrapped(struct lis_scan_session *self);
+
+
+static struct lis_scan_session g_scan_session_template = {
+	.get_scan_parameters = readahead_get_scan_parameters,
+	.end_of_feed = readahead_end_of_feed,
+	.end_of_page = readahead_end_of_page,
+	.scan_read = readahead_scan_read,
+	.cancel = readahead_cancel,
+	.name = "readahead",
+	.get_wrapped = readahead_get_wrapped,
+};
+
+
+static void *producer_thread(void *_session)
+{
+	struct readahead_session *private = _session;
+	struct readahead_chunk *chunk;
+	enum lis_error err = LIS_OK;
+	bool page_start, eop;
+
+	LIS_LOCK(&private->mutex);
+	while (private->state != READAHEAD_STOPPING) {
+		if (private->state != READAHEAD_READING
+				|| private->queue.nb_chunks >= private->queue.max_chunks) {
+			pthread_cond_wait(&private->cond, &private->mutex);
+			continue;
+		}
+
+		page_start = private->page_start;
+		private->page_start = false;
+		chunk = private->free_chunks;
+		if (chunk != NULL) {
+			private->free_chunks = chunk->next;
+		}
+		LIS_UNLOCK(&private->mutex);
+
+		// the application may process the data already read meanwhile
+		if (chunk == NULL) {
+			chunk = malloc(sizeof(struct readahead_chunk) + CHUNK_SIZE);
+		}
+		eop = false;
+		if (chunk == NULL) {
+			lis_log_error("Out of memory");
+			err = LIS_ERR_NO_MEM;
+		} else {
+			LIS_LOCK(&private->wrapped_mutex);
+			// the application calls scan_read() to start a new page:
+			// the wrapped end_of_page() may still return 1 until
+			// then.
+			eop = (!page_start && private->wrapped->end_of_page(private->wrapped));
+			if (!eop) {
+				chunk->size = CHUNK_SIZE;
+				chunk->offset = 0;
+				chunk->next = NULL;
+				err = private->wrapped->scan_read(
+					private->wrapped, chunk->data, &chunk->size
+				);
+			}
+			LIS_UNLOCK(&private->wrapped_mutex);
+		}
+
+		LIS_LOCK(&private->mutex);
+		if (private->state == READAHEAD_STOPPING) {
+			FREE(chunk);
+			break;
+		}
+		if (chunk != NULL && (eop || LIS_IS_ERROR(err) || chunk->size <= 0)) {
+			chunk->next = private->free_chunks;
+			private->free_chunks = chunk;
+		}
+		if (eop) {
+			private->state = READAHEAD_PAGE_DONE;
+		} else if (LIS_IS_ERROR(err)) {
+			lis_log_warning(
+				"scan_read() failed: 0x%X, %s", err, lis_strerror(err)
+			);
+			private->state = READAHEAD_FAILED;
+			private->err = err;
+		} else if (chunk->size > 0) {
+			if (private->queue.last == NULL) {
+				private->queue.first = chunk;
+			} else {
+				private->queue.last->next = chunk;
+			}
+			private->queue.last = chunk;
+			private->queue.nb_chunks++;
+		}
+		pthread_cond_broadcast(&private->cond);
+	}
+	LIS_UNLOCK(&private->mutex);
+
+	return NULL;
+}
+
+
+static enum lis_error readahead_get_scan_parameters(
+		struct lis_scan_session *self,
+		struct lis_scan_parameters *params
+	)
+{
+	struct readahead_session *private = READAHEAD_SESSION_PRIVATE(self);
+	enum lis_error err;
+
+	LIS_LOCK(&private->wrapped_mutex);
+	err = private->wrapped->get_scan_parameters(private->wrapped, params);
+	LIS_UNLOCK(&private->wrapped_mutex);
+	return err;
+}
+
+
+static int readahead_end_of_feed(struct lis_scan_session *self)
+{
+	struct readahead_session *private = READAHEAD_SESSION_PRIVATE(self);
+	enum readahead_state state;
+
+	LIS_LOCK(&private->mutex);
+	// we can't tell before the producer gets some data or reaches the
+	// end of the page (empty feeder)
+	while (private->queue.first == NULL
+			&& private->state == READAHEAD_READING) {
+		pthread_cond_wait(&private->cond, &private->mutex);
+	}
+	state = private->state;
+	if (private->queue.first != NULL || state != READAHEAD_PAGE_DONE) {
+		// still in a page, or the next scan_read() must return an
+		// error
+		LIS_UNLOCK(&private->mutex);
+		return 0;
+	}
+	LIS_UNLOCK(&private->mutex);
+
+	// the producer is idle until the application requests the next page
+	if (private->wrapped->end_of_feed(private->wrapped)) {
+		private->end_of_feed = true;
+		return 1;
+	}
+	return 0;
+}
+
+
+static int readahead_end_of_page(struct lis_scan_session *self)
+{
+	struct readahead_session *private = READAHEAD_SESSION_PRIVATE(self);
+	int r;
+
+	LIS_LOCK(&private->mutex);
+	// queue is empty: the producer may just be about to find the end of
+	// the page
+	while (private->queue.first == NULL
+			&& private->state == READAHEAD_READING) {
+		pthread_cond_wait(&private->cond, &private->mutex);
+	}
+	r = (private->queue.first == NULL
+		&& private->state == READAHEAD_PAGE_DONE);
+	LIS_UNLOCK(&private->mutex);
+	return r;
+}
+
+
+static enum lis_error readahead_scan_read(
+		struct lis_scan_session *self,
+		void *out_buffer, size_t *bufsize
+	)
+{
+	struct readahead_session *private = READAHEAD_SESSION_PRIVATE(self);
+	struct readahead_chunk *chunk;
+	uint8_t *out = out_buffer;
+	size_t total = 0, r;
+	enum lis_error err = LIS_OK;
+
+	LIS_LOCK(&private->mutex);
+
+	if (private->state == READAHEAD_PAGE_DONE && private->queue.first == NULL
+			&& !private->end_of_feed) {
+		// the application wants the next page
+		private->state = READAHEAD_READING;
+		private->page_start = true;
+		pthread_cond_broadcast(&private->cond);
+	}
+
+	while (private->queue.first == NULL
+			&& private->state == READAHEAD_READING) {
+		pthread_cond_wait(&private->cond, &private->mutex);
+	}
+
+	while (total < *bufsize && private->queue.first != NULL) {
+		chunk = private->queue.first;
+		r = MIN(*bufsize - total, chunk->size - chunk->offset);
+		memcpy(out + total, chunk->data + chunk->offset, r);
+		chunk->offset += r;
+		total += r;
+
+		if (chunk->offset >= chunk->size) {
+			private->queue.first = chunk->next;
+			if (private->queue.first == NULL) {
+				private->queue.last = NULL;
+			}
+			private->queue.nb_chunks--;
+			chunk->next = private->free_chunks;
+			private->free_chunks = chunk;
+			// room for the producer
+			pthread_cond_broadcast(&private->cond);
+		}
+	}
+
+	if (total <= 0 && private->state == READAHEAD_FAILED) {
+		err = private->err;
+	}
+
+	LIS_UNLOCK(&private->mutex);
+
+	*bufsize = total;
+	return err;
+}
+
+
+static void free_chunks(struct readahead_chunk *chunk)
+{
+	struct readahead_chunk *next;
+
+	for ( ; chunk != NULL ; chunk = next) {
+		next = chunk->next;
+		FREE(chunk);
+	}
+}
+
+
+/*!
+ * Stops the producer thread and frees the session.
+ */
+static void session_free(struct readahead_session *private, bool cancel_wrapped)
+{
+	int r;
+
+	LIS_LOCK(&private->mutex);
+	private->state = READAHEAD_STOPPING;
+	pthread_cond_broadcast(&private->cond);
+	LIS_UNLOCK(&private->mutex);
+
+	// may have to wait for the end of the current wrapped scan_read()
+	r = pthread_join(private->producer, NULL);
+	if (r != 0) {
+		lis_log_warning("pthread_join() failed: %d, %s", r, strerror(r));
+	}
+
+	lis_bw_item_set_user_ptr(private->bw_item, NULL);
+	if (cancel_wrapped) {
+		private->wrapped->cancel(private->wrapped);
+	}
+
+	free_chunks(private->queue.first);
+	free_chunks(private->free_chunks);
+	pthread_cond_destroy(&private->cond);
+	pthread_mutex_destroy(&private->mutex);
+	pthread_mutex_destroy(&private->wrapped_mutex);
+	FREE(private);
+}
+
+
+static void readahead_cancel(struct lis_scan_session *self)
+{
+	session_free(READAHEAD_SESSION_PRIVATE(self), true /* cancel wrapped */);
+}
+
+
+static struct lis_scan_session *readahead_get_wrapped(struct lis_scan_session *self)
+{
+	struct readahead_session *private = READAHEAD_SESSION_PRIVATE(self);
+	return private->wrapped;
+}
+
+
+static enum lis_error on_scan_start(
+		struct lis_item *item, struct lis_scan_session **out_session,
+		void *user_data
+	)
+{
+	enum lis_error err;
+	struct readahead_session *session;
+	struct lis_item *original;
+	int max_memory;
+	int r;
+
+	LIS_UNUSED(user_data);
+
+	// previous session has reached the end of the feed without being
+	// cancelled
+	session = lis_bw_item_get_user_ptr(item);
+	if (session != NULL) {
+		session_free(session, false /* !cancel wrapped */);
+	}
+
+	session = calloc(1, sizeof(struct readahead_session));
+	if (session == NULL) {
+		lis_log_error("Out of memory");
+		return LIS_ERR_NO_MEM;
+	}
+
+	max_memory = lis_getenv(
+		"LIBINSANE_WORKAROUND_READAHEAD_MAX_MEMORY", DEFAULT_MAX_MEMORY
+	);
+	session->queue.max_chunks = MAX(1, (max_memory * 1024) / CHUNK_SIZE);
+	lis_log_info(
+		"Reading ahead up to %d chunks of %d bytes",
+		session->queue.max_chunks, CHUNK_SIZE
+	);
+
+	session->bw_item = item;
+	original = lis_bw_get_original_item(item);
+
+	err = original->scan_start(original, &session->wrapped);
+	if (LIS_IS_ERROR(err)) {
+		FREE(session);
+		return err;
+	}
+
+	memcpy(
+		&session->parent, &g_scan_session_template,
+		sizeof(session->parent)
+	);
+	pthread_mutex_init(&session->wrapped_mutex, NULL);
+	pthread_mutex_init(&session->mutex, NULL);
+	pthread_cond_init(&session->cond, NULL);
+	session->state = READAHEAD_READING;
+
+	r = pthread_create(&session->producer, NULL, producer_thread, session);
+	if (r != 0) {
+		lis_log_error(
+			"Failed to create read-ahead thread: %d, %s",
+			r, strerror(r)
+		);
+		session->wrapped->cancel(session->wrapped);
+		pthread_cond_destroy(&session->cond);
+		pthread_mutex_destroy(&session->mutex);
+		pthread_mutex_destroy(&session->wrapped_mutex);
+		FREE(session);
+		return LIS_ERR_INTERNAL_UNKNOWN_ERROR;
+	}
+
+	lis_bw_item_set_user_ptr(session->bw_item, session);
+	*out_session = &session->parent;
+	return LIS_OK;
+}
+
+
+static void on_item_close(struct lis_item *item, int root, void *user_data)
+{
+	struct readahead_session *session;
+
+	LIS_UNUSED(root);
+	LIS_UNUSED(user_data);
+
+	session = lis_bw_item_get_user_ptr(item);
+	if (session != NULL) {
+		// application hasn't cancelled the session
+		session_free(session, !session->end_of_feed);
+	}
+}
+
+
+enum lis_error lis_api_workaround_readahead(struct lis_api *to_wrap, struct lis_api **impl)
+{
+	enum lis_error err;
+
+	err = lis_api_base_wrapper(to_wrap, impl, NAME);
+	if (LIS_IS_ERROR(err)) {
+		return err;
+	}
+	lis_bw_set_on_scan_start(*impl, on_scan_start, NULL);
+	lis_bw_set_on_close_item(*impl, on_item_close, NULL);
+	return err;
+}
@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <CUnit/Basic.h>
+
+#include <libinsane/capi.h>
+#include <libinsane/constants.h>
+#include <libinsane/dumb.h>
+#include <libinsane/log.h>
+#include <libinsane/util.h>
+
+#include "main.h"
+#include "util.h"
+
+#include "../src/basewrapper.h"
+
+
+static const union lis_value g_mode_constraint[] = {
+	{ .string = OPT_VALUE_MODE_BW, },
+	{ .string = OPT_VALUE_MODE_COLOR, },
+};
+static const struct lis_option_descriptor g_opt_mode = {
+	.name = OPT_NAME_MODE,
+	.title = "mode title",
+	.desc = "mode desc",
+	.capabilities = LIS_CAP_SW_SELECT,
+	.value = {
+		.type = LIS_TYPE_STRING,
+		.unit = LIS_UNIT_NONE,
+	},
+	.constraint = {
+		.type = LIS_CONSTRAINT_LIST,
+		.possible.list = {
+			.nb_values = LIS_COUNT_OF(g_mode_constraint),
+			.values = (union lis_value *)&g_mode_constraint,
+		},
+	},
+};
+static const union lis_value g_mode_default = {
+	.string = OPT_VALUE_MODE_COLOR,
+};
+
+static const union lis_value g_resolution_constraint[] = {
+	{ .integer = 150, },
+	{ .integer = 300, },
+};
+static const union lis_value g_resolution_constraint_b[] = {
+	{ .integer = 150, },
+	{ .integer = 300, },
+	{ .integer = 600, },
+};
+static const struct lis_option_descriptor g_opt_resolution = {
+	.name = OPT_NAME_RESOLUTION,
+	.title = "resolution title",
+	.desc = "resolution desc",
+	.capabilities = LIS_CAP_SW_SELECT,
+	.value = {
+		.type = LIS_TYPE_INTEGER,
+		.unit = LIS_UNIT_DPI,
+	},
+	.constraint = {
+		.type = LIS_CONSTRAINT_LIST,
+		.possible.list = {
+			.nb_values = LIS_COUNT_OF(g_resolution_constraint),
+			.values = (union lis_value *)&g_resolution_constraint,
+		},
+	},
+};
+static const union lis_value g_resolution_default = {
+	.integer = 300,
+};
+
+static const struct lis_option_descriptor g_opt_tlx = {
+	.name = OPT_NAME_TL_X,
+	.title = "tl-x title",
+	.desc = "tl-x desc",
+	.capabilities = LIS_CAP_SW_SELECT,
+	.value = {
+		.type = LIS_TYPE_INTEGER,
+		.unit = LIS_UNIT_PIXEL,
+	},
+	.constraint = {
+		.type = LIS_CONSTRAINT_RANGE,
+		.possible.range = {
+			.min.integer = 0,
+			.max.integer = 1000,
+			.interval.integer = 1,
+		},
+	},
+};
+static const union lis_value g_tlx_default = {
+	.integer = 0,
+};
+
+
+static struct lis_api *g_dumb = NULL;
+static struct lis_api *g_bw_a = NULL;
+static struct lis_api *g_bw_b = NULL;
+static int g_nb_filtered_a;
+static int g_nb_filtered_b;
+
+
+static enum lis_error count_filter(
+		struct lis_item *item, struct lis_option_descriptor *desc,
+		void *user_data
+	)
+{
+	int *counter = user_data;
+
+	LIS_UNUSED(item);
+
+	(*counter)++;
+	if (lis_bw_opt_get_user_ptr(desc) == NULL) {
+		lis_bw_opt_set_user_ptr(desc, strdup(desc->name), free);
+	}
+	return LIS_OK;
+}
+
+
+static int tests_bw_init(void)
+{
+	enum lis_error err;
+
+	g_nb_filtered_a = 0;
+	g_nb_filtered_b = 0;
+
+	err = lis_api_dumb(&g_dumb, "dummy0");
+	if (LIS_IS_ERROR(err)) {
+		return -1;
+	}
+	lis_dumb_set_nb_devices(g_dumb, 1);
+	lis_dumb_add_option(g_dumb, &g_opt_mode, &g_mode_default, 0);
+	lis_dumb_add_option(g_dumb, &g_opt_resolution, &g_resolution_default, 0);
+
+	// 2 base wrappers on top of each other
+	err = lis_api_base_wrapper(g_dumb, &g_bw_a, "test_bw_a");
+	if (LIS_IS_ERROR(err)) {
+		return -1;
+	}
+	lis_bw_set_opt_desc_filter(g_bw_a, count_filter, &g_nb_filtered_a);
+
+	err = lis_api_base_wrapper(g_bw_a, &g_bw_b, "test_bw_b");
+	if (LIS_IS_ERROR(err)) {
+		return -1;
+	}
+	lis_bw_set_opt_desc_filter(g_bw_b, count_filter, &g_nb_filtered_b);
+
+	return 0;
+}
+
+
+static int tests_bw_clean(void)
+{
+	g_bw_b->cleanup(g_bw_b);
+	return 0;
+}
+
+
+static void tests_bw_reload_unchanged(void)
+{
+	struct lis_item *item = NULL;
+	struct lis_option_descriptor **opts = NULL;
+	struct lis_option_descriptor **opts_b = NULL;
+	enum lis_error err;
+
+	LIS_ASSERT_EQUAL(tests_bw_init(), 0);
+
+	err = g_bw_b->get_device(g_bw_b, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = item->get_options(item, &opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(g_nb_filtered_a, 2);
+	LIS_ASSERT_EQUAL(g_nb_filtered_b, 2);
+
+	err = item->get_options(item, &opts_b);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(opts_b, opts);
+	LIS_ASSERT_EQUAL(g_nb_filtered_a, 2);
+	LIS_ASSERT_EQUAL(g_nb_filtered_b, 2);
+
+	LIS_ASSERT_EQUAL(strcmp(opts[0]->name, OPT_NAME_MODE), 0);
+	LIS_ASSERT_EQUAL(strcmp(opts[1]->name, OPT_NAME_RESOLUTION), 0);
+	LIS_ASSERT_EQUAL(opts[2], NULL);
+	LIS_ASSERT_EQUAL(opts[1]->constraint.possible.list.nb_values, 2);
+
+	item->close(item);
+	LIS_ASSERT_EQUAL(tests_bw_clean(), 0);
+}
+
+
+static void tests_bw_reload_changed(void)
+{
+	struct lis_item *item = NULL;
+	struct lis_option_descriptor **opts = NULL;
+	struct lis_option_descriptor **opts_b = NULL;
+	struct lis_option_descriptor opt_resolution;
+	const char *user_ptr;
+	enum lis_error err;
+
+	LIS_ASSERT_EQUAL(tests_bw_init(), 0);
+
+	err = g_bw_b->get_device(g_bw_b, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = item->get_options(item, &opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(g_nb_filtered_a, 2);
+	LIS_ASSERT_EQUAL(g_nb_filtered_b, 2);
+	user_ptr = lis_bw_opt_get_user_ptr(opts[1]);
+	LIS_ASSERT_NOT_EQUAL(user_ptr, NULL);
+
+	// only the constraint of one option changes
+	memcpy(&opt_resolution, &g_opt_resolution, sizeof(opt_resolution));
+	opt_resolution.constraint.possible.list.nb_values = LIS_COUNT_OF(g_resolution_constraint_b);
+	opt_resolution.constraint.possible.list.values = (union lis_value *)&g_resolution_constraint_b;
+	lis_dumb_add_option(g_dumb, &opt_resolution, &g_resolution_default, 0);
+
+	err = item->get_options(item, &opts_b);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(opts_b, opts);
+	LIS_ASSERT_EQUAL(g_nb_filtered_a, 3);
+	LIS_ASSERT_EQUAL(g_nb_filtered_b, 3);
+	LIS_ASSERT_EQUAL(opts[1]->constraint.possible.list.nb_values, 3);
+	LIS_ASSERT_EQUAL(opts[1]->constraint.possible.list.values[2].integer, 600);
+	LIS_ASSERT_EQUAL(lis_bw_opt_get_user_ptr(opts[1]), user_ptr);
+
+	// an option is added: everything is reloaded, user pointers are kept
+	lis_dumb_add_option(g_dumb, &g_opt_tlx, &g_tlx_default, 0);
+
+	err = item->get_options(item, &opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(g_nb_filtered_a, 6);
+	LIS_ASSERT_EQUAL(g_nb_filtered_b, 6);
+	LIS_ASSERT_EQUAL(strcmp(opts[1]->name, OPT_NAME_RESOLUTION), 0);
+	LIS_ASSERT_EQUAL(strcmp(opts[2]->name, OPT_NAME_TL_X), 0);
+	LIS_ASSERT_EQUAL(opts[3], NULL);
+	LIS_ASSERT_EQUAL(lis_bw_opt_get_user_ptr(opts[1]), user_ptr);
+	LIS_ASSERT_EQUAL(lis_bw_item_get_option(item, "TL-X"), opts[2]);
+
+	item->close(item);
+	LIS_ASSERT_EQUAL(tests_bw_clean(), 0);
+}
+
+
+/**
+ * A base wrapper without option filter between two that have one: the top
+ * one must not run its filter again if nothing has changed.
+ */
+static void tests_bw_reload_no_filter(void)
+{
+	struct lis_api *bw_mid = NULL;
+	struct lis_item *item = NULL;
+	struct lis_option_descriptor **opts = NULL;
+	struct lis_option_descriptor **opts_b = NULL;
+	struct lis_option_descriptor opt_resolution;
+	unsigned int generation;
+	enum lis_error err;
+
+	g_nb_filtered_a = 0;
+	g_nb_filtered_b = 0;
+
+	err = lis_api_dumb(&g_dumb, "dummy0");
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	lis_dumb_set_nb_devices(g_dumb, 1);
+	lis_dumb_add_option(g_dumb, &g_opt_mode, &g_mode_default, 0);
+	lis_dumb_add_option(g_dumb, &g_opt_resolution, &g_resolution_default, 0);
+
+	err = lis_api_base_wrapper(g_dumb, &g_bw_a, "test_bw_a");
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	lis_bw_set_opt_desc_filter(g_bw_a, count_filter, &g_nb_filtered_a);
+	err = lis_api_base_wrapper(g_bw_a, &bw_mid, "test_bw_mid");
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = lis_api_base_wrapper(bw_mid, &g_bw_b, "test_bw_b");
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	lis_bw_set_opt_desc_filter(g_bw_b, count_filter, &g_nb_filtered_b);
+
+	err = g_bw_b->get_device(g_bw_b, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = item->get_options(item, &opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(g_nb_filtered_a, 2);
+	LIS_ASSERT_EQUAL(g_nb_filtered_b, 2);
+	generation = lis_bw_item_get_generation(item);
+
+	err = item->get_options(item, &opts_b);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(opts_b, opts);
+	LIS_ASSERT_EQUAL(g_nb_filtered_a, 2);
+	LIS_ASSERT_EQUAL(g_nb_filtered_b, 2);
+	LIS_ASSERT_EQUAL(lis_bw_item_get_generation(item), generation);
+
+	// changes must still go through
+	memcpy(&opt_resolution, &g_opt_resolution, sizeof(opt_resolution));
+	opt_resolution.constraint.possible.list.nb_values = LIS_COUNT_OF(g_resolution_constraint_b);
+	opt_resolution.constraint.possible.list.values = (union lis_value *)&g_resolution_constraint_b;
+	lis_dumb_add_option(g_dumb, &opt_resolution, &g_resolution_default, 0);
+
+	err = item->get_options(item, &opts_b);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(g_nb_filtered_a, 3);
+	LIS_ASSERT_EQUAL(g_nb_filtered_b, 3);
+	LIS_ASSERT_EQUAL(opts_b[1]->constraint.possible.list.nb_values, 3);
+	LIS_ASSERT_NOT_EQUAL(lis_bw_item_get_generation(item), generation);
+	generation = lis_bw_item_get_generation(item);
+
+	err = item->get_options(item, &opts_b);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(g_nb_filtered_a, 3);
+	LIS_ASSERT_EQUAL(g_nb_filtered_b, 3);
+	LIS_ASSERT_EQUAL(lis_bw_item_get_generation(item), generation);
+
+	item->close(item);
+	LIS_ASSERT_EQUAL(tests_bw_clean(), 0);
+}
+
+
+int register_tests(void)
+{
+	CU_pSuite suite = NULL;
+
+	suite = CU_add_suite("Base wrapper", NULL, NULL);
+	if (suite == NULL) {
+		fprintf(stderr, "CU_add_suite() failed\n");
+		return 0;
+	}
+
+	if (CU_add_test(suite, "tests_bw_reload_unchanged()", tests_bw_reload_unchanged) == NULL
+			|| CU_add_test(suite, "tests_bw_reload_changed()", tests_bw_reload_changed) == NULL
+			|| CU_add_test(suite, "tests_bw_reload_no_filter()", tests_bw_reload_no_filter) == NULL
+			) {
+		fprintf(stderr, "CU_add_test() has failed\n");
+		return 0;
+	}
+
+	return 1;
+}
@@ -0,0 +1,370 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <CUnit/Basic.h>
+
+#include <libinsane/capi.h>
+#include <libinsane/constants.h>
+#include <libinsane/dumb.h>
+#include <libinsane/util.h>
+
+#include "main.h"
+#include "util.h"
+
+
+#define WIDTH 37
+#define HEIGHT 11
+#define NB_PAGES 3
+#define READ_SIZE 50 /* not a multiple of the line length */
+
+
+static struct lis_api *g_dumb = NULL;
+
+
+static int tests_dumb_init(void)
+{
+	enum lis_error err;
+
+	err = lis_api_dumb(&g_dumb, "dummy0");
+	if (LIS_IS_ERROR(err)) {
+		return -1;
+	}
+	lis_dumb_set_nb_devices(g_dumb, 1);
+	return 0;
+}
+
+
+static int tests_dumb_clean(void)
+{
+	g_dumb->cleanup(g_dumb);
+	return 0;
+}
+
+
+/*!
+ * \retval number of bytes read, -1 on error
+ */
+static int read_page(struct lis_scan_session *session, uint8_t *out, size_t out_size)
+{
+	size_t total = 0, r;
+	enum lis_error err;
+
+	// end_of_page() remains true after a page until the next scan_read()
+	do {
+		r = MIN(out_size - total, READ_SIZE);
+		if (r == 0) {
+			return -1; // page too big
+		}
+		err = session->scan_read(session, out + total, &r);
+		if (LIS_IS_ERROR(err)) {
+			return -1;
+		}
+		total += r;
+	} while (!session->end_of_page(session));
+	return total;
+}
+
+
+static void tests_dumb_generator(void)
+{
+	static const struct {
+		enum lis_img_format format;
+		size_t page_size;
+	} formats[] = {
+		{ LIS_IMG_FORMAT_RAW_RGB_24, WIDTH * 3 * HEIGHT },
+		{ LIS_IMG_FORMAT_GRAYSCALE_8, WIDTH * HEIGHT },
+		{ LIS_IMG_FORMAT_BW_1, ((WIDTH + 7) / 8) * HEIGHT },
+	};
+	struct lis_dumb_generator gen;
+	struct lis_item *item;
+	struct lis_scan_session *session;
+	struct lis_scan_parameters params;
+	uint8_t pages[2][NB_PAGES][WIDTH * 3 * HEIGHT];
+	enum lis_error err;
+	unsigned int f, pattern;
+	int scan, page;
+
+	for (f = 0 ; f < LIS_COUNT_OF(formats) ; f++) {
+		for (pattern = LIS_DUMB_PATTERN_GRADIENT ;
+				pattern <= LIS_DUMB_PATTERN_BARS ;
+				pattern++) {
+			LIS_ASSERT_EQUAL(tests_dumb_init(), 0);
+
+			memset(&gen, 0, sizeof(gen));
+			gen.format = formats[f].format;
+			gen.width = WIDTH;
+			gen.height = HEIGHT;
+			gen.nb_pages = NB_PAGES;
+			gen.pattern = pattern;
+			gen.seed = 42;
+			gen.jitter_us = 10;
+			lis_dumb_set_generator(g_dumb, &gen);
+
+			err = g_dumb->get_device(g_dumb, LIS_DUMB_DEV_ID_FIRST, &item);
+			LIS_ASSERT_EQUAL(err, LIS_OK);
+
+			// scan twice: pages must be the same
+			for (scan = 0 ; scan < 2 ; scan++) {
+				err = item->scan_start(item, &session);
+				LIS_ASSERT_EQUAL(err, LIS_OK);
+
+				err = session->get_scan_parameters(session, &params);
+				LIS_ASSERT_EQUAL(err, LIS_OK);
+				LIS_ASSERT_EQUAL(params.format, formats[f].format);
+				LIS_ASSERT_EQUAL(params.width, WIDTH);
+				LIS_ASSERT_EQUAL(params.height, HEIGHT);
+				LIS_ASSERT_EQUAL(params.image_size, formats[f].page_size);
+
+				for (page = 0 ; page < NB_PAGES ; page++) {
+					LIS_ASSERT_FALSE(session->end_of_feed(session));
+					LIS_ASSERT_EQUAL(
+						read_page(
+							session, pages[scan][page],
+							sizeof(pages[scan][page])
+						),
+						(int)formats[f].page_size
+					);
+				}
+				LIS_ASSERT_TRUE(session->end_of_feed(session));
+				session->cancel(session);
+			}
+
+			for (page = 0 ; page < NB_PAGES ; page++) {
+				LIS_ASSERT_EQUAL(memcmp(
+					pages[0][page], pages[1][page],
+					formats[f].page_size
+				), 0);
+			}
+			if (pattern == LIS_DUMB_PATTERN_GRADIENT) {
+				// the gradient changes from one page to another
+				LIS_ASSERT_NOT_EQUAL(memcmp(
+					pages[0][0], pages[0][1],
+					formats[f].page_size
+				), 0);
+			}
+
+			item->close(item);
+			LIS_ASSERT_EQUAL(tests_dumb_clean(), 0);
+		}
+	}
+}
+
+
+static void tests_dumb_generator_error(void)
+{
+	struct lis_dumb_generator gen;
+	struct lis_item *item;
+	struct lis_scan_session *session;
+	uint8_t buffer[WIDTH * 3 * HEIGHT];
+	enum lis_error err;
+	size_t r, total;
+
+	LIS_ASSERT_EQUAL(tests_dumb_init(), 0);
+
+	memset(&gen, 0, sizeof(gen));
+	gen.format = LIS_IMG_FORMAT_RAW_RGB_24;
+	gen.width = WIDTH;
+	gen.height = HEIGHT;
+	gen.nb_pages = 2;
+	gen.max_read = 16;
+	gen.error = LIS_ERR_JAMMED;
+	gen.error_page = 1;
+	gen.error_offset = 100;
+	lis_dumb_set_generator(g_dumb, &gen);
+
+	err = g_dumb->get_device(g_dumb, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = item->scan_start(item, &session);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	// first page is fine
+	LIS_ASSERT_EQUAL(
+		read_page(session, buffer, sizeof(buffer)), (int)sizeof(buffer)
+	);
+
+	// second page fails at offset 100
+	total = 0;
+	do {
+		r = sizeof(buffer);
+		err = session->scan_read(session, buffer, &r);
+		LIS_ASSERT_TRUE(r <= gen.max_read);
+		total += r;
+	} while (LIS_IS_OK(err));
+	LIS_ASSERT_EQUAL(err, LIS_ERR_JAMMED);
+	LIS_ASSERT_EQUAL(total, 100);
+
+	session->cancel(session);
+	item->close(item);
+	LIS_ASSERT_EQUAL(tests_dumb_clean(), 0);
+}
+
+
+static void tests_dumb_many_options(void)
+{
+	struct lis_option_descriptor opt = {
+		.value = {
+			.type = LIS_TYPE_INTEGER,
+		},
+		.constraint = {
+			.type = LIS_CONSTRAINT_NONE,
+		},
+	};
+	union lis_value value;
+	struct lis_item *item;
+	struct lis_option_descriptor **opts;
+	char names[100][16];
+	enum lis_error err;
+	int i;
+
+	LIS_ASSERT_EQUAL(tests_dumb_init(), 0);
+
+	for (i = 0 ; i < (int)LIS_COUNT_OF(names) ; i++) {
+		snprintf(names[i], sizeof(names[i]), "opt%d", i);
+		opt.name = names[i];
+		value.integer = i;
+		lis_dumb_add_option(g_dumb, &opt, &value, 0);
+	}
+	// replacing an option doesn't add a new one
+	opt.name = names[10];
+	value.integer = 1234;
+	lis_dumb_add_option(g_dumb, &opt, &value, 0);
+
+	err = g_dumb->get_device(g_dumb, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = item->get_options(item, &opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	for (i = 0 ; opts[i] != NULL ; i++) {
+		LIS_ASSERT_EQUAL(strcmp(opts[i]->name, names[i]), 0);
+		err = opts[i]->fn.get_value(opts[i], &value);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+		LIS_ASSERT_EQUAL(value.integer, (i == 10 ? 1234 : i));
+	}
+	LIS_ASSERT_EQUAL(i, (int)LIS_COUNT_OF(names));
+
+	item->close(item);
+	LIS_ASSERT_EQUAL(tests_dumb_clean(), 0);
+}
+
+
+static const struct lis_option_descriptor g_opt_mode = {
+	.name = OPT_NAME_MODE,
+	.title = "mode title",
+	.desc = "mode desc",
+	.capabilities = LIS_CAP_SW_SELECT,
+	.value = {
+		.type = LIS_TYPE_STRING,
+		.unit = LIS_UNIT_NONE,
+	},
+	.constraint = {
+		.type = LIS_CONSTRAINT_NONE,
+	},
+};
+static const union lis_value g_mode_default = {
+	.string = OPT_VALUE_MODE_COLOR,
+};
+static const struct lis_option_descriptor g_opt_resolution = {
+	.name = OPT_NAME_RESOLUTION,
+	.title = "resolution title",
+	.desc = "resolution desc",
+	.capabilities = LIS_CAP_SW_SELECT,
+	.value = {
+		.type = LIS_TYPE_INTEGER,
+		.unit = LIS_UNIT_DPI,
+	},
+	.constraint = {
+		.type = LIS_CONSTRAINT_NONE,
+	},
+};
+static const union lis_value g_resolution_default = {
+	.integer = 300,
+};
+
+
+/**
+ * Setting the mode replaces the resolution option: its previous descriptor
+ * is freed.
+ */
+static enum lis_error set_mode_reload(
+		struct lis_option_descriptor *self, union lis_value value,
+		int *set_flags
+	)
+{
+	LIS_UNUSED(self);
+	LIS_UNUSED(value);
+
+	lis_dumb_add_option(
+		g_dumb, &g_opt_resolution, &g_resolution_default, 0
+	);
+	*set_flags = LIS_SET_FLAG_MUST_RELOAD_OPTIONS;
+	return LIS_OK;
+}
+
+
+static void tests_dumb_set_options_reload(void)
+{
+	static const struct lis_option_setting settings[] = {
+		{ .name = OPT_NAME_MODE, .value = OPT_VALUE_MODE_BW },
+		{ .name = OPT_NAME_RESOLUTION, .value = "150" },
+	};
+	struct lis_option_descriptor opt_mode;
+	struct lis_option_descriptor **opts;
+	struct lis_item *item;
+	union lis_value value;
+	int set_flags;
+	enum lis_error err;
+
+	LIS_ASSERT_EQUAL(tests_dumb_init(), 0);
+	memcpy(&opt_mode, &g_opt_mode, sizeof(opt_mode));
+	opt_mode.fn.set_value = set_mode_reload;
+	lis_dumb_add_option(g_dumb, &opt_mode, &g_mode_default, 0);
+	lis_dumb_add_option(
+		g_dumb, &g_opt_resolution, &g_resolution_default, 0
+	);
+
+	err = g_dumb->get_device(g_dumb, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	lis_dumb_reset_counters(g_dumb);
+
+	err = lis_set_options(item, settings, LIS_COUNT_OF(settings), &set_flags);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(set_flags, LIS_SET_FLAG_MUST_RELOAD_OPTIONS);
+	// the options have been listed again after setting the mode
+	LIS_ASSERT_EQUAL(lis_dumb_get_nb_list_options(g_dumb), 2);
+
+	err = item->get_options(item, &opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = opts[1]->fn.get_value(opts[1], &value);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(value.integer, 150);
+
+	item->close(item);
+	LIS_ASSERT_EQUAL(tests_dumb_clean(), 0);
+}
+
+
+int register_tests(void)
+{
+	CU_pSuite suite = NULL;
+
+	suite = CU_add_suite("Dumb", NULL, NULL);
+	if (suite == NULL) {
+		fprintf(stderr, "CU_add_suite() failed\n");
+		return 0;
+	}
+
+	if (CU_add_test(suite, "tests_dumb_generator()", tests_dumb_generator) == NULL
+			|| CU_add_test(suite, "tests_dumb_generator_error()",
+				tests_dumb_generator_error) == NULL
+			|| CU_add_test(suite, "tests_dumb_many_options()",
+				tests_dumb_many_options) == NULL
+			|| CU_add_test(suite, "tests_dumb_set_options_reload()",
+				tests_dumb_set_options_reload) == NULL) {
+		fprintf(stderr, "CU_add_test() has failed\n");
+		return 0;
+	}
+
+	return 1;
+}
@@ -0,0 +1,269 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <CUnit/Basic.h>
+
+#include <libinsane/log.h>
+#include <libinsane/util.h>
+
+#include "main.h"
+#include "util.h"
+
+
+#define NB_THREADS 4
+#define NB_MSGS_PER_THREAD 200
+
+
+static int g_counts[LIS_LOG_LVL_MAX + 1];
+static int g_last_value;
+static pthread_t g_caller;
+static int g_called_from_caller;
+
+
+static void count(enum lis_log_level lvl, const char *msg)
+{
+	const char *value;
+
+	// callbacks are serialized: no need for a lock
+	g_counts[lvl]++;
+	if (pthread_equal(pthread_self(), g_caller)) {
+		g_called_from_caller++;
+	}
+	value = strstr(msg, "value=");
+	if (value != NULL) {
+		g_last_value = atoi(value + strlen("value="));
+	}
+}
+
+
+static const struct lis_log_callbacks g_log_callbacks = {
+	.callbacks = {
+		[LIS_LOG_LVL_DEBUG] = count,
+		[LIS_LOG_LVL_INFO] = count,
+		[LIS_LOG_LVL_WARNING] = count,
+		[LIS_LOG_LVL_ERROR] = count,
+	}
+};
+
+
+static const struct lis_log_callbacks g_log_callbacks_no_debug = {
+	.callbacks = {
+		[LIS_LOG_LVL_DEBUG] = NULL,
+		[LIS_LOG_LVL_INFO] = count,
+		[LIS_LOG_LVL_WARNING] = count,
+		[LIS_LOG_LVL_ERROR] = count,
+	}
+};
+
+
+static int tests_log_init(void)
+{
+	memset(g_counts, 0, sizeof(g_counts));
+	g_last_value = -1;
+	g_called_from_caller = 0;
+	g_caller = pthread_self();
+	lis_set_log_callbacks(&g_log_callbacks);
+	lis_set_log_level(LIS_LOG_LVL_MIN);
+	return 0;
+}
+
+
+static int evaluated(int *nb_evaluations)
+{
+	(*nb_evaluations)++;
+	return 42;
+}
+
+
+static void tests_log_level(void)
+{
+	int nb_evaluations = 0;
+
+	LIS_ASSERT_EQUAL(tests_log_init(), 0);
+
+	lis_log_debug("value=%d", evaluated(&nb_evaluations));
+	lis_log_info("value=%d", evaluated(&nb_evaluations));
+	LIS_ASSERT_EQUAL(g_counts[LIS_LOG_LVL_DEBUG], 1);
+	LIS_ASSERT_EQUAL(g_counts[LIS_LOG_LVL_INFO], 1);
+	LIS_ASSERT_EQUAL(g_last_value, 42);
+	LIS_ASSERT_EQUAL(nb_evaluations, 2);
+
+	lis_set_log_level(LIS_LOG_LVL_WARNING);
+	g_last_value = -1;
+	lis_log_debug("value=%d", evaluated(&nb_evaluations));
+	lis_log_info("value=%d", evaluated(&nb_evaluations));
+	// arguments must not even be evaluated
+	LIS_ASSERT_EQUAL(nb_evaluations, 2);
+	LIS_ASSERT_EQUAL(g_counts[LIS_LOG_LVL_DEBUG], 1);
+	LIS_ASSERT_EQUAL(g_counts[LIS_LOG_LVL_INFO], 1);
+	LIS_ASSERT_EQUAL(g_last_value, -1);
+
+	lis_log_warning("value=%d", 1);
+	lis_log_error("value=%d", 2);
+	LIS_ASSERT_EQUAL(g_counts[LIS_LOG_LVL_WARNING], 1);
+	LIS_ASSERT_EQUAL(g_counts[LIS_LOG_LVL_ERROR], 1);
+	LIS_ASSERT_EQUAL(g_last_value, 2);
+
+	// levels without callback are filtered out too
+	lis_set_log_level(LIS_LOG_LVL_MIN);
+	lis_set_log_callbacks(&g_log_callbacks_no_debug);
+	lis_log_debug("value=%d", evaluated(&nb_evaluations));
+	LIS_ASSERT_EQUAL(nb_evaluations, 2);
+	lis_log_info("value=%d", evaluated(&nb_evaluations));
+	LIS_ASSERT_EQUAL(nb_evaluations, 3);
+	LIS_ASSERT_EQUAL(g_counts[LIS_LOG_LVL_INFO], 2);
+
+	lis_log_reset();
+}
+
+
+static void *log_thread(void *arg)
+{
+	int i;
+
+	LIS_UNUSED(arg);
+
+	for (i = 0 ; i < NB_MSGS_PER_THREAD ; i++) {
+		lis_log_info("value=%d", i);
+	}
+	return NULL;
+}
+
+
+static void tests_log_async(void)
+{
+	pthread_t threads[NB_THREADS];
+	int i;
+
+	LIS_ASSERT_EQUAL(tests_log_init(), 0);
+
+	lis_log_set_async(1);
+
+	for (i = 0 ; i < NB_THREADS ; i++) {
+		LIS_ASSERT_EQUAL(
+			pthread_create(&threads[i], NULL, log_thread, NULL), 0
+		);
+	}
+	lis_log_warning("value=%d", 1234);
+	for (i = 0 ; i < NB_THREADS ; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	// flushes the queue
+	lis_log_set_async(0);
+
+	// the queue is big enough to never drop any of them
+	LIS_ASSERT_EQUAL(
+		g_counts[LIS_LOG_LVL_INFO], NB_THREADS * NB_MSGS_PER_THREAD
+	);
+	LIS_ASSERT_EQUAL(g_counts[LIS_LOG_LVL_WARNING], 1);
+	// all delivered from the log thread
+	LIS_ASSERT_EQUAL(g_called_from_caller, 0);
+
+	// back to synchronous delivery
+	lis_log_error("value=%d", 5678);
+	LIS_ASSERT_EQUAL(g_counts[LIS_LOG_LVL_ERROR], 1);
+	LIS_ASSERT_EQUAL(g_last_value, 5678);
+	LIS_ASSERT_EQUAL(g_called_from_caller, 1);
+
+	lis_log_reset();
+}
+
+
+static void tests_log_async_toggle(void)
+{
+	pthread_t threads[NB_THREADS];
+	int i;
+
+	LIS_ASSERT_EQUAL(tests_log_init(), 0);
+
+	for (i = 0 ; i < NB_THREADS ; i++) {
+		LIS_ASSERT_EQUAL(
+			pthread_create(&threads[i], NULL, log_thread, NULL), 0
+		);
+	}
+	// threads keep logging while async mode is switched on and off
+	for (i = 0 ; i < 50 ; i++) {
+		lis_log_set_async(1);
+		lis_log_set_async(0);
+	}
+	for (i = 0 ; i < NB_THREADS ; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	// none lost, none delivered twice
+	LIS_ASSERT_EQUAL(
+		g_counts[LIS_LOG_LVL_INFO], NB_THREADS * NB_MSGS_PER_THREAD
+	);
+
+	lis_log_reset();
+}
+
+
+static void tests_log_async_fork(void)
+{
+	pid_t pid;
+	int i, status;
+
+	LIS_ASSERT_EQUAL(tests_log_init(), 0);
+
+	lis_log_set_async(1);
+	for (i = 0 ; i < NB_MSGS_PER_THREAD ; i++) {
+		lis_log_info("value=%d", i);
+	}
+
+	pid = fork();
+	LIS_ASSERT_TRUE(pid >= 0);
+	if (pid == 0) {
+		// messages still queued belong to the parent: the child
+		// must only get its own ones
+		memset(g_counts, 0, sizeof(g_counts));
+		lis_log_set_async(1);
+		lis_log_warning("value=%d", 1234);
+		lis_log_set_async(0);
+		_exit(
+			(g_counts[LIS_LOG_LVL_INFO] == 0
+				&& g_counts[LIS_LOG_LVL_WARNING] == 1
+				&& g_last_value == 1234)
+			? EXIT_SUCCESS : EXIT_FAILURE
+		);
+	}
+
+	LIS_ASSERT_EQUAL(waitpid(pid, &status, 0), pid);
+	LIS_ASSERT_TRUE(WIFEXITED(status));
+	LIS_ASSERT_EQUAL(WEXITSTATUS(status), EXIT_SUCCESS);
+
+	lis_log_set_async(0);
+	LIS_ASSERT_EQUAL(g_counts[LIS_LOG_LVL_INFO], NB_MSGS_PER_THREAD);
+
+	lis_log_reset();
+}
+
+
+int register_tests(void)
+{
+	CU_pSuite suite = NULL;
+
+	suite = CU_add_suite("Log", NULL, NULL);
+	if (suite == NULL) {
+		fprintf(stderr, "CU_add_suite() failed\n");
+		return 0;
+	}
+
+	if (CU_add_test(suite, "tests_log_level()", tests_log_level) == NULL
+			|| CU_add_test(suite, "tests_log_async()", tests_log_async) == NULL
+			|| CU_add_test(suite, "tests_log_async_toggle()",
+				tests_log_async_toggle) == NULL
+			|| CU_add_test(suite, "tests_log_async_fork()",
+				tests_log_async_fork) == NULL) {
+		fprintf(stderr, "CU_add_test() has failed\n");
+		return 0;
+	}
+
+	return 1;
+}
@@ -1,4 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <CUnit/Basic.h>
 
@@ -155,6 +158,203 @@ static void test_get_device_ko(void)
 	LIS_ASSERT_NOT_EQUAL(dev, NULL);
 }
 
+
+/* API taking its time to answer */
+struct slow_api {
+	struct lis_api parent;
+	int delay_ms;
+};
+
+static struct lis_device_descriptor g_slow_dev = {
+	.dev_id = "slow dev0",
+	.vendor = "Slow",
+	.model = "Snail",
+};
+static struct lis_device_descriptor *g_slow_devs[] = { &g_slow_dev, NULL };
+
+
+static void slow_cleanup(struct lis_api *self)
+{
+	free(self);
+}
+
+
+static enum lis_error slow_list_devices(
+		struct lis_api *self, enum lis_device_locations locs,
+		struct lis_device_descriptor ***dev_infos
+	)
+{
+	struct slow_api *private = (struct slow_api *)self;
+	struct timespec ts = {
+		.tv_sec = private->delay_ms / 1000,
+		.tv_nsec = (private->delay_ms % 1000) * 1000000L,
+	};
+
+	LIS_UNUSED(locs);
+
+	while (nanosleep(&ts, &ts) != 0) { }
+	*dev_infos = g_slow_devs;
+	return LIS_OK;
+}
+
+
+static struct lis_api *slow_api(const char *name, int delay_ms)
+{
+	struct slow_api *api = calloc(1, sizeof(struct slow_api));
+	api->parent.base_name = name;
+	api->parent.cleanup = slow_cleanup;
+	api->parent.list_devices = slow_list_devices;
+	api->delay_ms = delay_ms;
+	return &api->parent;
+}
+
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+
+static struct lis_api *parallel_multiplexer(
+		struct lis_api **apis, int nb_apis, const char *timeout_ms
+	)
+{
+	struct lis_api *multi = NULL;
+
+	setenv("LIBINSANE_MULTIPLEXER_PARALLEL", "1", 1);
+	setenv("LIBINSANE_MULTIPLEXER_TIMEOUT_MS", timeout_ms, 1);
+	lis_api_multiplexer(apis, nb_apis, &multi);
+	unsetenv("LIBINSANE_MULTIPLEXER_PARALLEL");
+	unsetenv("LIBINSANE_MULTIPLEXER_TIMEOUT_MS");
+	return multi;
+}
+
+
+static void test_list_devices_parallel(void)
+{
+	struct lis_api *apis[2];
+	struct lis_api *multi;
+	struct lis_device_descriptor **descs;
+	enum lis_error err;
+	double start;
+
+	apis[0] = slow_api("slow0", 300);
+	apis[1] = slow_api("slow1", 300);
+	multi = parallel_multiplexer(apis, LIS_COUNT_OF(apis), "0");
+	LIS_ASSERT_NOT_EQUAL(multi, NULL);
+
+	start = now();
+	err = multi->list_devices(multi, LIS_DEVICE_LOCATIONS_ANY, &descs);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_TRUE(now() - start < 0.55);
+
+	LIS_ASSERT_EQUAL(strcmp(descs[0]->dev_id, "slow0:slow dev0"), 0);
+	LIS_ASSERT_EQUAL(strcmp(descs[1]->dev_id, "slow1:slow dev0"), 0);
+	LIS_ASSERT_EQUAL(descs[2], NULL);
+
+	multi->cleanup(multi);
+}
+
+
+static void test_list_devices_timeout(void)
+{
+	struct lis_api *apis[2];
+	struct lis_api *multi;
+	struct lis_device_descriptor **descs;
+	struct lis_item *item;
+	enum lis_error err;
+	double start;
+
+	apis[0] = slow_api("slow", 500);
+	lis_api_dumb(&apis[1], "dummy0");
+	lis_dumb_set_nb_devices(apis[1], 1);
+	multi = parallel_multiplexer(apis, LIS_COUNT_OF(apis), "100");
+	LIS_ASSERT_NOT_EQUAL(multi, NULL);
+
+	start = now();
+	err = multi->list_devices(multi, LIS_DEVICE_LOCATIONS_ANY, &descs);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_TRUE(now() - start < 0.4);
+	LIS_ASSERT_EQUAL(strcmp(descs[0]->dev_id, "dummy0:dumb dev0"), 0);
+	LIS_ASSERT_EQUAL(descs[1], NULL);
+
+	// still running --> skipped
+	err = multi->list_devices(multi, LIS_DEVICE_LOCATIONS_ANY, &descs);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(strcmp(descs[0]->dev_id, "dummy0:dumb dev0"), 0);
+	LIS_ASSERT_EQUAL(descs[1], NULL);
+
+	// still running --> must not be called from another thread
+	err = multi->get_device(multi, "slow:slow dev0", &item);
+	LIS_ASSERT_EQUAL(err, LIS_ERR_DEVICE_BUSY);
+
+	// not affected
+	err = multi->get_device(multi, "dummy0:dumb dev0", &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	item->close(item);
+
+	// waits for the slow API to finish
+	multi->cleanup(multi);
+}
+
+
+struct found {
+	int nb;
+	char dev_ids[4][64];
+};
+
+
+static void on_device_found(struct lis_device_descriptor *dev, void *_found)
+{
+	struct found *found = _found;
+
+	if (found->nb < (int)LIS_COUNT_OF(found->dev_ids)) {
+		strncpy(
+			found->dev_ids[found->nb], dev->dev_id,
+			sizeof(found->dev_ids[found->nb]) - 1
+		);
+	}
+	found->nb++;
+}
+
+
+static void test_list_devices_cb(void)
+{
+	struct lis_api *apis[2];
+	struct lis_api *multi;
+	struct lis_device_descriptor **descs;
+	struct found found;
+	enum lis_error err;
+
+	apis[0] = slow_api("slow", 200);
+	lis_api_dumb(&apis[1], "dummy0");
+	lis_dumb_set_nb_devices(apis[1], 2);
+	multi = parallel_multiplexer(apis, LIS_COUNT_OF(apis), "0");
+	LIS_ASSERT_NOT_EQUAL(multi, NULL);
+
+	memset(&found, 0, sizeof(found));
+	err = lis_multiplexer_list_devices(
+		multi, LIS_DEVICE_LOCATIONS_ANY, on_device_found, &found, &descs
+	);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	// fastest API first
+	LIS_ASSERT_EQUAL(found.nb, 3);
+	LIS_ASSERT_EQUAL(strcmp(found.dev_ids[0], "dummy0:dumb dev0"), 0);
+	LIS_ASSERT_EQUAL(strcmp(found.dev_ids[1], "dummy0:dumb dev1"), 0);
+	LIS_ASSERT_EQUAL(strcmp(found.dev_ids[2], "slow:slow dev0"), 0);
+
+	// final list: in the order of the APIs
+	LIS_ASSERT_EQUAL(strcmp(descs[0]->dev_id, "slow:slow dev0"), 0);
+	LIS_ASSERT_EQUAL(strcmp(descs[1]->dev_id, "dummy0:dumb dev0"), 0);
+	LIS_ASSERT_EQUAL(strcmp(descs[2]->dev_id, "dummy0:dumb dev1"), 0);
+	LIS_ASSERT_EQUAL(descs[3], NULL);
+
+	multi->cleanup(multi);
+}
+
 int register_tests(void)
 {
 	CU_pSuite suite = NULL;
@@ -171,7 +371,13 @@ int register_tests(void)
 			|| CU_add_test(suite, "get_device() ok", test_get_device_ok) == NULL
 			|| CU_add_test(suite, "get_device() not found",
 				test_get_device_not_found) == NULL
-			|| CU_add_test(suite, "get_device() ko", test_get_device_ko) == NULL) {
+			|| CU_add_test(suite, "get_device() ko", test_get_device_ko) == NULL
+			|| CU_add_test(suite, "list_devices() parallel",
+				test_list_devices_parallel) == NULL
+			|| CU_add_test(suite, "list_devices() timeout",
+				test_list_devices_timeout) == NULL
+			|| CU_add_test(suite, "list_devices() callback",
+				test_list_devices_cb) == NULL) {
 		fprintf(stderr, "CU_add_test() has failed\n");
 		return 0;
 	}
@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <CUnit/Basic.h>
@@ -1155,6 +1156,514 @@ static void tests_bmp2raw_1_no_palette(void)
 }
 
 
+static void put_le(uint8_t *out, uint32_t val, int nb_bytes)
+{
+	int i;
+
+	for (i = 0 ; i < nb_bytes ; i++) {
+		out[i] = (val >> (8 * i)) & 0xFF;
+	}
+}
+
+
+static uint8_t get_pixel(int depth, int x, int y)
+{
+	switch(depth) {
+		case 1:
+			return ((x * 3 + y) % 5) < 2;
+		case 8:
+			return (x * 5 + y * 3) & 0xFF;
+	}
+	return 0;
+}
+
+
+/**
+ * Generate a BMP image (with a palette if depth <= 8) and the RAW24 image
+ * that bmp2raw is expected to return for it.
+ */
+static uint8_t *make_bmp(
+		int width, int height, int depth, int top_to_bottom,
+		size_t *bmp_size, uint8_t **expected
+	)
+{
+	int nb_colors = (depth == 24 ? 0 : (1 << depth));
+	int line_length = (width * depth + 7) / 8;
+	int padding = (4 - (line_length % 4)) % 4;
+	size_t header_size = 54 + (4 * nb_colors);
+	size_t pixel_data_size = (line_length + padding) * height;
+	uint8_t *bmp, *line, *out;
+	int x, y, o, stored_x, c;
+	uint8_t v;
+
+	*bmp_size = header_size + pixel_data_size;
+	bmp = calloc(1, *bmp_size);
+	*expected = calloc(1, width * height * 3);
+
+	bmp[0] = 'B';
+	bmp[1] = 'M';
+	put_le(bmp + 2, *bmp_size, 4);
+	put_le(bmp + 10, header_size, 4);
+	put_le(bmp + 14, 0x28, 4);
+	put_le(bmp + 18, width, 4);
+	put_le(bmp + 22, top_to_bottom ? -height : height, 4);
+	put_le(bmp + 26, 1, 2);
+	put_le(bmp + 28, depth, 2);
+	put_le(bmp + 34, pixel_data_size, 4);
+	put_le(bmp + 46, nb_colors, 4);
+
+	for (c = 0 ; c < nb_colors ; c++) {
+		// BGR0
+		bmp[54 + (c * 4)] = c;
+		bmp[54 + (c * 4) + 1] = 0xFF - c;
+		bmp[54 + (c * 4) + 2] = c ^ 0x55;
+	}
+
+	for (y = 0 ; y < height ; y++) {
+		line = bmp + header_size + (y * (line_length + padding));
+		out = *expected + (y * width * 3);
+
+		for (x = 0 ; x < width ; x++) {
+			switch(depth) {
+				case 1:
+					v = get_pixel(depth, x, y);
+					line[x / 8] |= v << (7 - (x % 8));
+					break;
+				case 8:
+					line[x] = get_pixel(depth, x, y);
+					break;
+				case 24:
+					line[x * 3] = (x * 7 + y * 13) & 0xFF;
+					line[x * 3 + 1] = (x * 11 + y * 3 + 1) & 0xFF;
+					line[x * 3 + 2] = (x * 5 + y * 17 + 2) & 0xFF;
+					break;
+			}
+		}
+
+		for (o = 0 ; o < width ; o++) {
+			// bottom-to-top BMP: page is returned rotated 180 degrees
+			stored_x = top_to_bottom ? o : (width - 1 - o);
+			if (depth == 24) {
+				out[o * 3] = line[stored_x * 3 + 2];
+				out[o * 3 + 1] = line[stored_x * 3 + 1];
+				out[o * 3 + 2] = line[stored_x * 3];
+			} else {
+				v = get_pixel(depth, stored_x, y);
+				out[o * 3] = v ^ 0x55;
+				out[o * 3 + 1] = 0xFF - v;
+				out[o * 3 + 2] = v;
+			}
+		}
+	}
+
+	return bmp;
+}
+
+
+static void tests_bmp2raw_widths(void)
+{
+	static const int depths[] = { 1, 8, 24 };
+	static const int widths[] = { 1, 4, 7, 8, 16, 33, 64, 101 };
+	static const int height = 3;
+	struct lis_scan_parameters scan_params = {
+		.format = LIS_IMG_FORMAT_BMP,
+		.width = 2222,
+		.height = 2222,
+		.image_size = 22222222,
+	};
+	struct lis_dumb_read read;
+	enum lis_error err;
+	struct lis_item *item;
+	struct lis_scan_session *session;
+	struct lis_scan_parameters params;
+	size_t bmp_size, bufsize, r;
+	uint8_t *bmp, *expected, *buffer;
+	unsigned int d, w;
+	int top_to_bottom, width;
+
+	for (d = 0 ; d < LIS_COUNT_OF(depths) ; d++) {
+	for (w = 0 ; w < LIS_COUNT_OF(widths) ; w++) {
+	for (top_to_bottom = 0 ; top_to_bottom <= 1 ; top_to_bottom++) {
+		width = widths[w];
+		bmp = make_bmp(
+			width, height, depths[d], top_to_bottom,
+			&bmp_size, &expected
+		);
+		buffer = calloc(1, width * height * 3);
+		read.content = bmp;
+		read.nb_bytes = bmp_size;
+
+		LIS_ASSERT_EQUAL(tests_raw_init(), 0);
+		lis_dumb_set_scan_parameters(g_dumb, &scan_params);
+		lis_dumb_set_scan_result(g_dumb, &read, 1);
+
+		err = lis_api_normalizer_bmp2raw(g_dumb, &g_raw);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+
+		item = NULL;
+		err = g_raw->get_device(g_raw, LIS_DUMB_DEV_ID_FIRST, &item);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+
+		err = item->scan_start(item, &session);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+
+		err = session->get_scan_parameters(session, &params);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+		LIS_ASSERT_EQUAL(params.format, LIS_IMG_FORMAT_RAW_RGB_24);
+		LIS_ASSERT_EQUAL(params.width, width);
+		LIS_ASSERT_EQUAL(params.height, height);
+
+		bufsize = 0;
+		while(bufsize < (size_t)(width * height * 3)) {
+			LIS_ASSERT_FALSE(session->end_of_page(session));
+			// odd read size: must work across line boundaries
+			r = MIN(7, (width * height * 3) - bufsize);
+			err = session->scan_read(session, buffer + bufsize, &r);
+			LIS_ASSERT_EQUAL(err, LIS_OK);
+			bufsize += r;
+		}
+		LIS_ASSERT_EQUAL(memcmp(buffer, expected, bufsize), 0);
+
+		LIS_ASSERT_TRUE(session->end_of_feed(session));
+		LIS_ASSERT_TRUE(session->end_of_page(session));
+		session->cancel(session);
+
+		item->close(item);
+
+		LIS_ASSERT_EQUAL(tests_raw_clean(), 0);
+		free(bmp);
+		free(expected);
+		free(buffer);
+	}
+	}
+	}
+}
+
+
+/**
+ * Large reads (converted directly in the caller buffer), with the BMP
+ * coming from the wrapped session in small chunks.
+ */
+static void tests_bmp2raw_batch(void)
+{
+	static const int depths[] = { 1, 8, 24 };
+	static const int width = 101;
+	static const int height = 50;
+	static const size_t chunk_size = 97;
+	const size_t read_sizes[] = {
+		width * height * 3, // whole image at once
+		width * 3, // exactly one line: goes through the line buffer
+		(width * 3 * 3) + 5,
+	};
+	struct lis_scan_parameters scan_params = {
+		.format = LIS_IMG_FORMAT_BMP,
+		.width = 2222,
+		.height = 2222,
+		.image_size = 22222222,
+	};
+	struct lis_dumb_read *reads;
+	enum lis_error err;
+	struct lis_item *item;
+	struct lis_scan_session *session;
+	size_t bmp_size, bufsize, r;
+	uint8_t *bmp, *expected, *buffer;
+	unsigned int d, s, nb_reads, i;
+	int top_to_bottom;
+
+	for (d = 0 ; d < LIS_COUNT_OF(depths) ; d++) {
+	for (s = 0 ; s < LIS_COUNT_OF(read_sizes) ; s++) {
+	for (top_to_bottom = 0 ; top_to_bottom <= 1 ; top_to_bottom++) {
+		bmp = make_bmp(
+			width, height, depths[d], top_to_bottom,
+			&bmp_size, &expected
+		);
+		buffer = calloc(1, width * height * 3);
+
+		nb_reads = (bmp_size + chunk_size - 1) / chunk_size;
+		reads = calloc(nb_reads, sizeof(struct lis_dumb_read));
+		for (i = 0 ; i < nb_reads ; i++) {
+			reads[i].content = bmp + (i * chunk_size);
+			reads[i].nb_bytes = MIN(chunk_size, bmp_size - (i * chunk_size));
+		}
+
+		LIS_ASSERT_EQUAL(tests_raw_init(), 0);
+		lis_dumb_set_scan_parameters(g_dumb, &scan_params);
+		lis_dumb_set_scan_result(g_dumb, reads, nb_reads);
+
+		err = lis_api_normalizer_bmp2raw(g_dumb, &g_raw);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+
+		item = NULL;
+		err = g_raw->get_device(g_raw, LIS_DUMB_DEV_ID_FIRST, &item);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+
+		err = item->scan_start(item, &session);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+
+		bufsize = 0;
+		while(!session->end_of_page(session)) {
+			r = MIN(read_sizes[s], (width * height * 3) - bufsize);
+			LIS_ASSERT_TRUE(r > 0);
+			err = session->scan_read(session, buffer + bufsize, &r);
+			LIS_ASSERT_EQUAL(err, LIS_OK);
+			bufsize += r;
+		}
+		LIS_ASSERT_EQUAL(bufsize, (size_t)(width * height * 3));
+		LIS_ASSERT_EQUAL(memcmp(buffer, expected, bufsize), 0);
+
+		LIS_ASSERT_TRUE(session->end_of_feed(session));
+		session->cancel(session);
+
+		item->close(item);
+
+		LIS_ASSERT_EQUAL(tests_raw_clean(), 0);
+		free(reads);
+		free(bmp);
+		free(expected);
+		free(buffer);
+	}
+	}
+	}
+}
+
+
+enum test_palette {
+	PALETTE_COLORS, // from make_bmp()
+	PALETTE_GRAY,
+	PALETTE_WHITE_BLACK,
+	PALETTE_BLACK_WHITE,
+};
+
+
+static uint8_t palette_gray(enum test_palette palette, int c)
+{
+	switch(palette) {
+		case PALETTE_COLORS:
+			break;
+		case PALETTE_GRAY:
+			return 0xFF - c;
+		case PALETTE_WHITE_BLACK:
+			return (c == 0) ? 0xFF : 0x00;
+		case PALETTE_BLACK_WHITE:
+			return (c == 0) ? 0x00 : 0xFF;
+	}
+	return 0;
+}
+
+
+/**
+ * Palettes made only of grays (or only of black and white): when the
+ * application accepts it, the image is returned in its native format.
+ * Other palettes are still converted to RAW24.
+ */
+static void tests_bmp2raw_native(void)
+{
+	static const struct {
+		int depth;
+		enum test_palette palette;
+		enum lis_img_format format;
+	} cases[] = {
+		{ 1, PALETTE_WHITE_BLACK, LIS_IMG_FORMAT_BW_1 },
+		{ 1, PALETTE_BLACK_WHITE, LIS_IMG_FORMAT_BW_1 },
+		{ 1, PALETTE_COLORS, LIS_IMG_FORMAT_RAW_RGB_24 },
+		{ 8, PALETTE_GRAY, LIS_IMG_FORMAT_GRAYSCALE_8 },
+		{ 8, PALETTE_COLORS, LIS_IMG_FORMAT_RAW_RGB_24 },
+	};
+	static const int widths[] = { 1, 7, 8, 13, 33 };
+	static const int height = 3;
+	struct lis_scan_parameters scan_params = {
+		.format = LIS_IMG_FORMAT_BMP,
+		.width = 2222,
+		.height = 2222,
+		.image_size = 22222222,
+	};
+	struct lis_dumb_read read;
+	struct lis_api *bmp2raw;
+	enum lis_error err;
+	struct lis_item *item;
+	struct lis_scan_session *session;
+	struct lis_scan_parameters params;
+	size_t bmp_size, line_length, out_size, bufsize, r;
+	uint8_t *bmp, *expected, *buffer, v;
+	unsigned int c, w;
+	int top_to_bottom, width, x, y, nb_colors;
+
+	for (c = 0 ; c < LIS_COUNT_OF(cases) ; c++) {
+	for (w = 0 ; w < LIS_COUNT_OF(widths) ; w++) {
+	for (top_to_bottom = 0 ; top_to_bottom <= 1 ; top_to_bottom++) {
+		width = widths[w];
+		bmp = make_bmp(
+			width, height, cases[c].depth, top_to_bottom,
+			&bmp_size, &expected
+		);
+
+		switch(cases[c].format) {
+			case LIS_IMG_FORMAT_BW_1:
+				line_length = (width + 7) / 8;
+				break;
+			case LIS_IMG_FORMAT_GRAYSCALE_8:
+				line_length = width;
+				break;
+			default:
+				line_length = width * 3;
+				break;
+		}
+		out_size = line_length * height;
+
+		if (cases[c].palette != PALETTE_COLORS) {
+			nb_colors = 1 << cases[c].depth;
+			for (x = 0 ; x < nb_colors ; x++) {
+				memset(
+					bmp + 54 + (x * 4),
+					palette_gray(cases[c].palette, x), 3
+				);
+			}
+			memset(expected, 0, out_size);
+			for (y = 0 ; y < height ; y++) {
+				for (x = 0 ; x < width ; x++) {
+					v = palette_gray(
+						cases[c].palette,
+						get_pixel(
+							cases[c].depth,
+							top_to_bottom ? x : (width - 1 - x),
+							y
+						)
+					);
+					if (cases[c].depth == 8) {
+						expected[(y * line_length) + x] = v;
+					} else if (v == 0x00) {
+						// B&W: 1 == black
+						expected[(y * line_length) + (x / 8)] |=
+							(1 << (7 - (x % 8)));
+					}
+				}
+			}
+		}
+
+		buffer = calloc(1, out_size);
+		read.content = bmp;
+		read.nb_bytes = bmp_size;
+
+		LIS_ASSERT_EQUAL(tests_raw_init(), 0);
+		lis_dumb_set_scan_parameters(g_dumb, &scan_params);
+		lis_dumb_set_scan_result(g_dumb, &read, 1);
+
+		// bmp2raw provides the option, raw24 must not convert what
+		// the application accepts
+		err = lis_api_normalizer_bmp2raw(g_dumb, &bmp2raw);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+		err = lis_api_normalizer_raw24(bmp2raw, &g_raw);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+
+		item = NULL;
+		err = g_raw->get_device(g_raw, LIS_DUMB_DEV_ID_FIRST, &item);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+
+		err = lis_set_option(
+			item, OPT_NAME_OUTPUT_FORMATS,
+			OPT_VALUE_OUTPUT_FORMATS_ALL
+		);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+
+		err = item->scan_start(item, &session);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+
+		err = session->get_scan_parameters(session, &params);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+		LIS_ASSERT_EQUAL(params.format, cases[c].format);
+		LIS_ASSERT_EQUAL(params.width, width);
+		LIS_ASSERT_EQUAL(params.image_size, out_size);
+
+		bufsize = 0;
+		while(!session->end_of_page(session)) {
+			r = MIN(5, out_size - bufsize);
+			LIS_ASSERT_TRUE(r > 0);
+			err = session->scan_read(session, buffer + bufsize, &r);
+			LIS_ASSERT_EQUAL(err, LIS_OK);
+			bufsize += r;
+		}
+		LIS_ASSERT_EQUAL(bufsize, out_size);
+		LIS_ASSERT_EQUAL(memcmp(buffer, expected, out_size), 0);
+
+		session->cancel(session);
+		item->close(item);
+
+		LIS_ASSERT_EQUAL(tests_raw_clean(), 0);
+		free(bmp);
+		free(expected);
+		free(buffer);
+	}
+	}
+	}
+}
+
+
+static void tests_bmp2raw_not_bmp(void)
+{
+	static const struct lis_scan_parameters base_scan_params = {
+		.format = LIS_IMG_FORMAT_RAW_RGB_24,
+		.width = 2,
+		.height = 2,
+		.image_size = 2 * 2 * 3,
+	};
+	static const uint8_t body[] = {
+		0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+		0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C,
+	};
+	static const struct lis_dumb_read reads[] = {
+		{ .content = body, .nb_bytes = LIS_COUNT_OF(body) },
+	};
+
+	enum lis_error err;
+	struct lis_item *item;
+	struct lis_scan_session *session;
+	struct lis_scan_parameters params;
+	size_t bufsize, r;
+	uint8_t buffer[2 * 2 * 3];
+
+	LIS_ASSERT_EQUAL(tests_raw_init(), 0);
+	lis_dumb_set_scan_parameters(g_dumb, &base_scan_params);
+	lis_dumb_set_scan_result(g_dumb, reads, LIS_COUNT_OF(reads));
+
+	err = lis_api_normalizer_bmp2raw(g_dumb, &g_raw);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	item = NULL;
+	err = g_raw->get_device(g_raw, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = item->scan_start(item, &session);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	// image must be returned as is
+	err = session->get_scan_parameters(session, &params);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(params.format, LIS_IMG_FORMAT_RAW_RGB_24);
+	LIS_ASSERT_EQUAL(params.width, 2);
+	LIS_ASSERT_EQUAL(params.height, 2);
+	LIS_ASSERT_EQUAL(params.image_size, 2 * 2 * 3);
+
+	LIS_ASSERT_FALSE(session->end_of_feed(session));
+	bufsize = 0;
+	while(!session->end_of_page(session)) {
+		LIS_ASSERT_TRUE(bufsize < sizeof(buffer));
+		r = sizeof(buffer) - bufsize;
+		err = session->scan_read(session, buffer + bufsize, &r);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+		bufsize += r;
+	}
+	LIS_ASSERT_EQUAL(bufsize, sizeof(buffer));
+	LIS_ASSERT_EQUAL(memcmp(buffer, body, sizeof(body)), 0);
+
+	LIS_ASSERT_TRUE(session->end_of_feed(session));
+	session->cancel(session);
+
+	item->close(item);
+
+	LIS_ASSERT_EQUAL(tests_raw_clean(), 0);
+}
+
+
 int register_tests(void)
 {
 	CU_pSuite suite = NULL;
@@ -1173,7 +1682,15 @@ int register_tests(void)
 				tests_bmp2raw_8_no_palette) == NULL
 			|| CU_add_test(suite, "tests_bmp2raw_1()", tests_bmp2raw_1) == NULL
 			|| CU_add_test(suite, "tests_bmp2raw_1_no_palette()",
-				tests_bmp2raw_1_no_palette) == NULL) {
+				tests_bmp2raw_1_no_palette) == NULL
+			|| CU_add_test(suite, "tests_bmp2raw_widths()",
+				tests_bmp2raw_widths) == NULL
+			|| CU_add_test(suite, "tests_bmp2raw_batch()",
+				tests_bmp2raw_batch) == NULL
+			|| CU_add_test(suite, "tests_bmp2raw_native()",
+				tests_bmp2raw_native) == NULL
+			|| CU_add_test(suite, "tests_bmp2raw_not_bmp()",
+				tests_bmp2raw_not_bmp) == NULL) {
 		fprintf(stderr, "CU_add_test() has failed\n");
 		return 0;
 	}
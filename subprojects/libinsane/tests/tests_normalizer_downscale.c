@@ -0,0 +1,472 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <CUnit/Basic.h>
+
+#define LIS_UNIT_TESTS
+
+#include <libinsane/capi.h>
+#include <libinsane/constants.h>
+#include <libinsane/dumb.h>
+#include <libinsane/log.h>
+#include <libinsane/normalizers.h>
+#include <libinsane/util.h>
+
+#include "main.h"
+#include "util.h"
+
+#include "../src/basewrapper.h"
+#include "../src/normalizers/downscale.h"
+
+
+static struct lis_api *g_dumb = NULL;
+static struct lis_api *g_downscale = NULL;
+static struct lis_item *g_item = NULL;
+static struct lis_option_descriptor *g_opt = NULL;
+
+
+static int tests_downscale_init(void)
+{
+	static union lis_value resolutions[] = {
+		{ .integer = 300 },
+		{ .integer = 600 },
+	};
+	static const struct lis_option_descriptor opt_resolution = {
+		.name = OPT_NAME_RESOLUTION,
+		.title = "resolution title",
+		.desc = "resolution desc",
+		.capabilities = LIS_CAP_SW_SELECT,
+		.value = {
+			.type = LIS_TYPE_INTEGER,
+			.unit = LIS_UNIT_DPI,
+		},
+		.constraint = {
+			.type = LIS_CONSTRAINT_LIST,
+			.possible.list = {
+				.values = resolutions,
+				.nb_values = LIS_COUNT_OF(resolutions),
+			},
+		},
+	};
+	static const union lis_value opt_resolution_default = {
+		.integer = 300,
+	};
+	struct lis_option_descriptor **opts;
+	enum lis_error err;
+
+	g_downscale = NULL;
+	err = lis_api_dumb(&g_dumb, "dummy0");
+	if (LIS_IS_ERROR(err)) {
+		return -1;
+	}
+	lis_dumb_set_nb_devices(g_dumb, 2);
+	lis_dumb_add_option(
+		g_dumb, &opt_resolution, &opt_resolution_default,
+		LIS_SET_FLAG_MUST_RELOAD_PARAMS
+	);
+
+	err = lis_api_normalizer_downscale(g_dumb, &g_downscale);
+	if (LIS_IS_ERROR(err)) {
+		return -1;
+	}
+
+	err = g_downscale->get_device(
+		g_downscale, LIS_DUMB_DEV_ID_FIRST, &g_item
+	);
+	if (LIS_IS_ERROR(err)) {
+		return -1;
+	}
+	err = g_item->get_options(g_item, &opts);
+	if (LIS_IS_ERROR(err) || opts[0] == NULL) {
+		return -1;
+	}
+	g_opt = opts[0];
+	return 0;
+}
+
+
+static int tests_downscale_clean(void)
+{
+	struct lis_api *api = (g_downscale != NULL ? g_downscale : g_dumb);
+	if (g_item != NULL) {
+		g_item->close(g_item);
+		g_item = NULL;
+	}
+	api->cleanup(api);
+	return 0;
+}
+
+
+static void tests_downscale_impls(void)
+{
+	static const size_t max_size = 4099;
+	static const size_t guard = 64;
+	const struct downscale_impl *impls;
+	const struct downscale_impl *ref = NULL;
+	const struct downscale_impl *impl;
+	uint8_t *input;
+	uint16_t *expected, *got;
+	size_t i, s;
+	uint32_t seed = 0x12345678;
+
+	impls = downscale_get_impls();
+	for (impl = impls ; impl->name != NULL ; impl++) {
+		ref = impl;
+	}
+	LIS_ASSERT_NOT_EQUAL(ref, NULL);
+	LIS_ASSERT_EQUAL(strcmp(ref->name, "scalar"), 0);
+
+	input = malloc(max_size);
+	expected = malloc((max_size + guard) * sizeof(uint16_t));
+	got = malloc((max_size + guard) * sizeof(uint16_t));
+	LIS_ASSERT_NOT_EQUAL(input, NULL);
+	LIS_ASSERT_NOT_EQUAL(expected, NULL);
+	LIS_ASSERT_NOT_EQUAL(got, NULL);
+
+	for (i = 0 ; i < max_size ; i++) {
+		seed = (seed * 1103515245) + 12345;
+		input[i] = (seed >> 16) & 0xFF;
+	}
+	memset(input, 0xFF, 32);
+
+	memset(expected, 0, max_size * sizeof(uint16_t));
+	ref->add_line(input, expected, max_size);
+	ref->add_line(input, expected, max_size);
+	for (i = 0 ; i < max_size ; i++) {
+		LIS_ASSERT_EQUAL(expected[i], 2 * input[i]);
+	}
+
+	for (impl = impls ; impl->name != NULL ; impl++) {
+		if (!impl->is_supported()) {
+			continue;
+		}
+		for (s = 0 ; s <= 100 ; s++) {
+			for (i = 0 ; i < max_size + guard ; i++) {
+				expected[i] = got[i] = (i * 7) & 0x7FF;
+			}
+			ref->add_line(input + s, expected, max_size - s);
+			ref->add_line(input, expected, s);
+			impl->add_line(input + s, got, max_size - s);
+			impl->add_line(input, got, s);
+			LIS_ASSERT_EQUAL(
+				memcmp(
+					expected, got,
+					(max_size + guard) * sizeof(uint16_t)
+				), 0
+			);
+		}
+	}
+
+	FREE(input);
+	FREE(expected);
+	FREE(got);
+}
+
+
+static void tests_downscale_options(void)
+{
+	static const int expected[] = { 50, 75, 100, 150, 200, 300, 600 };
+	const struct lis_value_list *list;
+	union lis_value value;
+	enum lis_error err;
+	int set_flags;
+	unsigned int i;
+
+	LIS_ASSERT_EQUAL(tests_downscale_init(), 0);
+
+	LIS_ASSERT_TRUE(g_opt->capabilities & LIS_CAP_EMULATED);
+	LIS_ASSERT_EQUAL(g_opt->constraint.type, LIS_CONSTRAINT_LIST);
+	list = &g_opt->constraint.possible.list;
+	LIS_ASSERT_EQUAL(list->nb_values, (int)LIS_COUNT_OF(expected));
+	for (i = 0 ; i < LIS_COUNT_OF(expected) ; i++) {
+		LIS_ASSERT_EQUAL(list->values[i].integer, expected[i]);
+	}
+
+	err = g_opt->fn.get_value(g_opt, &value);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(value.integer, 300);
+
+	// emulated
+	value.integer = 150;
+	set_flags = 0;
+	err = g_opt->fn.set_value(g_opt, value, &set_flags);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_TRUE(set_flags & LIS_SET_FLAG_MUST_RELOAD_PARAMS);
+	err = g_opt->fn.get_value(g_opt, &value);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(value.integer, 150);
+
+	// the device actually got the closest multiple
+	err = lis_bw_get_original_opt(g_opt)->fn.get_value(
+		lis_bw_get_original_opt(g_opt), &value
+	);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(value.integer, 300);
+
+	value.integer = 200;
+	err = g_opt->fn.set_value(g_opt, value, &set_flags);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = lis_bw_get_original_opt(g_opt)->fn.get_value(
+		lis_bw_get_original_opt(g_opt), &value
+	);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(value.integer, 600);
+
+	// native
+	value.integer = 600;
+	err = g_opt->fn.set_value(g_opt, value, &set_flags);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = g_opt->fn.get_value(g_opt, &value);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(value.integer, 600);
+
+	LIS_ASSERT_EQUAL(tests_downscale_clean(), 0);
+}
+
+
+static void tests_downscale_scan(
+		enum lis_img_format format, int resolution, int factor
+	)
+{
+	static const int widths[] = { 1, 2, 7, 16, 33, 100 };
+	static const int heights[] = { 1, 6, 13 };
+	static const size_t chunk_sizes[] = { 5, 1000000 };
+	static const size_t read_sizes[] = { 1, 3, 64, 100000 };
+	const size_t nb_channels = (
+		format == LIS_IMG_FORMAT_RAW_RGB_24 ? 3 : 1
+	);
+	struct lis_scan_parameters params = { 0 };
+	struct lis_scan_parameters out_params;
+	struct lis_dumb_read *reads;
+	struct lis_scan_session *session;
+	uint8_t *input, *expected, *got;
+	size_t output_size, bufsize, r, c;
+	unsigned int w, h, ch, s, nb_reads, i;
+	union lis_value value;
+	int set_flags, x, y, kx, ky, out_width, out_height, sum;
+	enum lis_error err;
+
+	LIS_ASSERT_EQUAL(tests_downscale_init(), 0);
+	value.integer = resolution;
+	err = g_opt->fn.set_value(g_opt, value, &set_flags);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	for (w = 0 ; w < LIS_COUNT_OF(widths) ; w++) {
+	for (h = 0 ; h < LIS_COUNT_OF(heights) ; h++) {
+		params.format = format;
+		params.width = widths[w];
+		params.height = heights[h];
+		params.image_size = widths[w] * heights[h] * nb_channels;
+
+		out_width = widths[w] / factor;
+		out_height = heights[h] / factor;
+		if (out_width == 0) {
+			// returned as is
+			out_width = widths[w];
+			out_height = heights[h];
+		}
+		output_size = out_width * out_height * nb_channels;
+
+		input = malloc(params.image_size);
+		expected = calloc(1, output_size + 1);
+		got = calloc(1, output_size + 1);
+		for (i = 0 ; i < params.image_size ; i++) {
+			input[i] = (i * 37 + 11) & 0xFF;
+		}
+		for (y = 0 ; y < out_height ; y++) {
+			for (x = 0 ; x < out_width ; x++) {
+				for (c = 0 ; c < nb_channels ; c++) {
+					if (out_width == widths[w]) {
+						expected[(((y * out_width) + x) * nb_channels) + c] =
+							input[(((y * out_width) + x) * nb_channels) + c];
+						continue;
+					}
+					sum = 0;
+					for (ky = 0 ; ky < factor ; ky++) {
+						for (kx = 0 ; kx < factor ; kx++) {
+							sum += input[((((y * factor) + ky) * widths[w]
+								+ (x * factor) + kx) * nb_channels) + c];
+						}
+					}
+					expected[(((y * out_width) + x) * nb_channels) + c] =
+						(sum + (factor * factor / 2)) / (factor * factor);
+				}
+			}
+		}
+
+		for (ch = 0 ; ch < LIS_COUNT_OF(chunk_sizes) ; ch++) {
+		for (s = 0 ; s < LIS_COUNT_OF(read_sizes) ; s++) {
+			nb_reads = (params.image_size + chunk_sizes[ch] - 1)
+				/ chunk_sizes[ch];
+			reads = calloc(nb_reads, sizeof(struct lis_dumb_read));
+			for (i = 0 ; i < nb_reads ; i++) {
+				reads[i].content = input + (i * chunk_sizes[ch]);
+				reads[i].nb_bytes = MIN(
+					chunk_sizes[ch],
+					params.image_size - (i * chunk_sizes[ch])
+				);
+			}
+			lis_dumb_set_scan_parameters(g_dumb, &params);
+			lis_dumb_set_scan_result(g_dumb, reads, nb_reads);
+
+			err = g_item->scan_start(g_item, &session);
+			LIS_ASSERT_EQUAL(err, LIS_OK);
+			if (factor > 1) {
+				LIS_ASSERT_NOT_EQUAL(session->get_fd, NULL);
+				LIS_ASSERT_EQUAL(session->get_fd(session), -1);
+			}
+
+			err = session->get_scan_parameters(session, &out_params);
+			LIS_ASSERT_EQUAL(err, LIS_OK);
+			LIS_ASSERT_EQUAL(out_params.format, format);
+			LIS_ASSERT_EQUAL(out_params.width, out_width);
+			LIS_ASSERT_EQUAL(out_params.height, out_height);
+			LIS_ASSERT_EQUAL(out_params.image_size, output_size);
+
+			bufsize = 0;
+			while(!session->end_of_page(session)) {
+				r = MIN(read_sizes[s], output_size + 1 - bufsize);
+				err = session->scan_read(session, got + bufsize, &r);
+				LIS_ASSERT_EQUAL(err, LIS_OK);
+				bufsize += r;
+				LIS_ASSERT_TRUE(bufsize <= output_size);
+			}
+			LIS_ASSERT_EQUAL(bufsize, output_size);
+			LIS_ASSERT_EQUAL(memcmp(got, expected, output_size), 0);
+			LIS_ASSERT_TRUE(session->end_of_feed(session));
+
+			session->cancel(session);
+			FREE(reads);
+		}
+		}
+
+		FREE(input);
+		FREE(expected);
+		FREE(got);
+	}
+	}
+
+	LIS_ASSERT_EQUAL(tests_downscale_clean(), 0);
+}
+
+
+static void tests_downscale_rgb(void)
+{
+	tests_downscale_scan(LIS_IMG_FORMAT_RAW_RGB_24, 150, 2);
+}
+
+
+static void tests_downscale_gray(void)
+{
+	tests_downscale_scan(LIS_IMG_FORMAT_GRAYSCALE_8, 100, 3);
+	tests_downscale_scan(LIS_IMG_FORMAT_GRAYSCALE_8, 75, 4);
+}
+
+
+static void tests_downscale_native(void)
+{
+	tests_downscale_scan(LIS_IMG_FORMAT_RAW_RGB_24, 300, 1);
+}
+
+
+static void read_generated(
+		int empty_reads, uint8_t *out, size_t out_size,
+		size_t *total, int *nb_empty
+	)
+{
+	struct lis_dumb_generator gen = {
+		.format = LIS_IMG_FORMAT_RAW_RGB_24,
+		.width = 20,
+		.height = 10,
+		.nb_pages = 1,
+		.pattern = LIS_DUMB_PATTERN_NOISE,
+		.seed = 42,
+		.max_read = 5,
+		.empty_reads = empty_reads,
+	};
+	struct lis_scan_session *session;
+	size_t r;
+	int nb_calls = 0;
+	enum lis_error err;
+
+	*total = 0;
+	*nb_empty = 0;
+	lis_dumb_set_generator(g_dumb, &gen);
+
+	err = g_item->scan_start(g_item, &session);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	while (!session->end_of_page(session) && nb_calls < 10000) {
+		r = MIN(out_size - *total, 100);
+		err = session->scan_read(session, out + *total, &r);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+		if (r == 0) {
+			(*nb_empty)++;
+		}
+		*total += r;
+		nb_calls++;
+	}
+	LIS_ASSERT_TRUE(session->end_of_page(session));
+
+	session->cancel(session);
+}
+
+
+/**
+ * Non-blocking source: scan_read() may return 0 bytes. It must not spin
+ * until a whole line is available, but return what it has so far.
+ */
+static void tests_downscale_empty_reads(void)
+{
+	uint8_t expected[10 * 5 * 3], got[10 * 5 * 3];
+	union lis_value value;
+	size_t total;
+	int set_flags, nb_empty;
+	enum lis_error err;
+
+	LIS_ASSERT_EQUAL(tests_downscale_init(), 0);
+	value.integer = 150;
+	err = g_opt->fn.set_value(g_opt, value, &set_flags);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	read_generated(0, expected, sizeof(expected), &total, &nb_empty);
+	LIS_ASSERT_EQUAL(total, sizeof(expected));
+	read_generated(2, got, sizeof(got), &total, &nb_empty);
+	LIS_ASSERT_EQUAL(total, sizeof(got));
+	LIS_ASSERT_TRUE(nb_empty > 0);
+	LIS_ASSERT_EQUAL(memcmp(got, expected, sizeof(expected)), 0);
+
+	LIS_ASSERT_EQUAL(tests_downscale_clean(), 0);
+}
+
+
+int register_tests(void)
+{
+	CU_pSuite suite = NULL;
+
+	suite = CU_add_suite("Normalizer_downscale", NULL, NULL);
+	if (suite == NULL) {
+		fprintf(stderr, "CU_add_suite() failed\n");
+		return 0;
+	}
+
+	if (CU_add_test(suite, "tests_downscale_impls()",
+				tests_downscale_impls) == NULL
+			|| CU_add_test(suite, "tests_downscale_options()",
+				tests_downscale_options) == NULL
+			|| CU_add_test(suite, "tests_downscale_rgb()",
+				tests_downscale_rgb) == NULL
+			|| CU_add_test(suite, "tests_downscale_gray()",
+				tests_downscale_gray) == NULL
+			|| CU_add_test(suite, "tests_downscale_native()",
+				tests_downscale_native) == NULL
+			|| CU_add_test(suite, "tests_downscale_empty_reads()",
+				tests_downscale_empty_reads) == NULL) {
+		fprintf(stderr, "CU_add_test() has failed\n");
+		return 0;
+	}
+
+	return 1;
+}
@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <CUnit/Basic.h>
@@ -141,6 +142,72 @@ static void tests_unpack1(void)
 }
 
 
+static void tests_unpack_impls(void)
+{
+	static const size_t sizes[] = {
+		0, 1, 2, 3, 7, 8, 15, 16, 17, 31, 32, 33, 47, 48, 63, 64, 65,
+		100, 255, 4099,
+	};
+	static const size_t max_size = 4099;
+	static const size_t guard = 64;
+	const struct raw24_unpack_impl *impls;
+	const struct raw24_unpack_impl *ref = NULL;
+	const struct raw24_unpack_impl *impl;
+	uint8_t *input, *expected, *got;
+	size_t expected_size, got_size;
+	size_t i, s;
+	uint32_t seed = 0x12345678;
+
+	impls = raw24_get_unpack_impls();
+	for (impl = impls ; impl->name != NULL ; impl++) {
+		ref = impl;
+	}
+	LIS_ASSERT_NOT_EQUAL(ref, NULL);
+	LIS_ASSERT_EQUAL(strcmp(ref->name, "scalar"), 0);
+
+	input = malloc(max_size * 24 + guard);
+	expected = malloc(max_size * 24 + guard);
+	got = malloc(max_size * 24 + guard);
+	LIS_ASSERT_NOT_EQUAL(input, NULL);
+	LIS_ASSERT_NOT_EQUAL(expected, NULL);
+	LIS_ASSERT_NOT_EQUAL(got, NULL);
+
+	for (i = 0 ; i < max_size * 24 + guard ; i++) {
+		seed = (seed * 1103515245) + 12345;
+		input[i] = (seed >> 16) & 0xFF;
+	}
+
+	for (impl = impls ; impl->name != NULL ; impl++) {
+		if (!impl->is_supported()) {
+			continue;
+		}
+		for (s = 0 ; s < LIS_COUNT_OF(sizes) ; s++) {
+			memcpy(expected, input, max_size * 24 + guard);
+			memcpy(got, input, max_size * 24 + guard);
+			expected_size = got_size = sizes[s];
+			ref->unpack_8_to_24(expected, &expected_size);
+			impl->unpack_8_to_24(got, &got_size);
+			LIS_ASSERT_EQUAL(got_size, sizes[s] * 3);
+			LIS_ASSERT_EQUAL(got_size, expected_size);
+			LIS_ASSERT_EQUAL(memcmp(expected, got, max_size * 24 + guard), 0);
+
+			memcpy(expected, input, max_size * 24 + guard);
+			memcpy(got, input, max_size * 24 + guard);
+			expected_size = got_size = sizes[s];
+			ref->unpack_1_to_24(expected, &expected_size);
+			impl->unpack_1_to_24(got, &got_size);
+			LIS_ASSERT_EQUAL(got_size, sizes[s] * 24);
+			LIS_ASSERT_EQUAL(got_size, expected_size);
+			LIS_ASSERT_EQUAL(memcmp(expected, got, max_size * 24 + guard), 0);
+		}
+	}
+
+	FREE(input);
+	FREE(expected);
+	FREE(got);
+}
+
+
 static void tests_raw8(void)
 {
 	static const struct lis_scan_parameters params = {
@@ -168,6 +235,9 @@ static void tests_raw8(void)
 
 	err = item->scan_start(item, &session);
 	LIS_ASSERT_EQUAL(err, LIS_OK);
+	// the dumb implementation has no file descriptor to provide
+	LIS_ASSERT_NOT_EQUAL(session->get_fd, NULL);
+	LIS_ASSERT_EQUAL(session->get_fd(session), -1);
 
 	err = session->get_scan_parameters(session, &out_params);
 	LIS_ASSERT_EQUAL(err, LIS_OK);
@@ -176,45 +246,40 @@ static void tests_raw8(void)
 	LIS_ASSERT_EQUAL(out_params.height, 2);
 	LIS_ASSERT_EQUAL(out_params.image_size, 4 * 3);
 
+	// buffer smaller than a pixel: the rest of the pixel is carried over
 	LIS_ASSERT_FALSE(session->end_of_feed(session));
 	LIS_ASSERT_FALSE(session->end_of_page(session));
-	bufsize = sizeof(buffer);
+	bufsize = 2;
 	err = session->scan_read(session, buffer, &bufsize);
 	LIS_ASSERT_EQUAL(err, LIS_OK);
-	LIS_ASSERT_EQUAL(bufsize, 6);
+	LIS_ASSERT_EQUAL(bufsize, 2);
 	LIS_ASSERT_EQUAL(buffer[0], 0x00);
 	LIS_ASSERT_EQUAL(buffer[1], 0x00);
-	LIS_ASSERT_EQUAL(buffer[2], 0x00);
-	LIS_ASSERT_EQUAL(buffer[3], 0xAA);
-	LIS_ASSERT_EQUAL(buffer[4], 0xAA);
-	LIS_ASSERT_EQUAL(buffer[5], 0xAA);
 
 	LIS_ASSERT_FALSE(session->end_of_feed(session));
 	LIS_ASSERT_FALSE(session->end_of_page(session));
-	bufsize = 2;
+	bufsize = 4;
 	err = session->scan_read(session, buffer, &bufsize);
 	LIS_ASSERT_EQUAL(err, LIS_OK);
-	LIS_ASSERT_EQUAL(bufsize, 0);
+	LIS_ASSERT_EQUAL(bufsize, 4);
+	LIS_ASSERT_EQUAL(buffer[0], 0x00);
+	LIS_ASSERT_EQUAL(buffer[1], 0xAA);
+	LIS_ASSERT_EQUAL(buffer[2], 0xAA);
+	LIS_ASSERT_EQUAL(buffer[3], 0xAA);
 
+	// the buffer is filled with as many wrapped reads as required
 	LIS_ASSERT_FALSE(session->end_of_feed(session));
 	LIS_ASSERT_FALSE(session->end_of_page(session));
-	bufsize = 4;
+	bufsize = sizeof(buffer);
 	err = session->scan_read(session, buffer, &bufsize);
 	LIS_ASSERT_EQUAL(err, LIS_OK);
-	LIS_ASSERT_EQUAL(bufsize, 3);
+	LIS_ASSERT_EQUAL(bufsize, 6);
 	LIS_ASSERT_EQUAL(buffer[0], 0x55);
 	LIS_ASSERT_EQUAL(buffer[1], 0x55);
 	LIS_ASSERT_EQUAL(buffer[2], 0x55);
-
-	LIS_ASSERT_FALSE(session->end_of_feed(session));
-	LIS_ASSERT_FALSE(session->end_of_page(session));
-	bufsize = sizeof(buffer);
-	err = session->scan_read(session, buffer, &bufsize);
-	LIS_ASSERT_EQUAL(err, LIS_OK);
-	LIS_ASSERT_EQUAL(bufsize, 3);
-	LIS_ASSERT_EQUAL(buffer[0], 0xFF);
-	LIS_ASSERT_EQUAL(buffer[1], 0xFF);
-	LIS_ASSERT_EQUAL(buffer[2], 0xFF);
+	LIS_ASSERT_EQUAL(buffer[3], 0xFF);
+	LIS_ASSERT_EQUAL(buffer[4], 0xFF);
+	LIS_ASSERT_EQUAL(buffer[5], 0xFF);
 
 	LIS_ASSERT_TRUE(session->end_of_page(session));
 	LIS_ASSERT_TRUE(session->end_of_feed(session));
@@ -265,7 +330,7 @@ static void tests_raw1(void)
 	bufsize = sizeof(buffer);
 	err = session->scan_read(session, buffer, &bufsize);
 	LIS_ASSERT_EQUAL(err, LIS_OK);
-	LIS_ASSERT_EQUAL(bufsize, 2 * 8 * 3);
+	LIS_ASSERT_EQUAL(bufsize, sizeof(buffer));
 	LIS_ASSERT_EQUAL(buffer[0], 0xFF);
 	LIS_ASSERT_EQUAL(buffer[1], 0xFF);
 	LIS_ASSERT_EQUAL(buffer[2], 0xFF);
@@ -316,9 +381,281 @@ static void tests_raw1(void)
 	LIS_ASSERT_EQUAL(buffer[46], 0xFF);
 	LIS_ASSERT_EQUAL(buffer[47], 0xFF);
 
+	// 0x55: first 16 bytes of the second line
+	LIS_ASSERT_EQUAL(buffer[48], 0xFF);
+	LIS_ASSERT_EQUAL(buffer[50], 0xFF);
+	LIS_ASSERT_EQUAL(buffer[51], 0x00);
+	LIS_ASSERT_EQUAL(buffer[53], 0x00);
+	LIS_ASSERT_EQUAL(buffer[54], 0xFF);
+	LIS_ASSERT_EQUAL(buffer[63], 0x00);
+
+	// the rest of the second line has been carried over
 	LIS_ASSERT_FALSE(session->end_of_feed(session));
 	LIS_ASSERT_FALSE(session->end_of_page(session));
+	bufsize = sizeof(buffer);
+	err = session->scan_read(session, buffer, &bufsize);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(bufsize, 32);
+	LIS_ASSERT_EQUAL(buffer[0], 0x00);
+	LIS_ASSERT_EQUAL(buffer[1], 0x00);
+	LIS_ASSERT_EQUAL(buffer[2], 0xFF);
+	LIS_ASSERT_EQUAL(buffer[4], 0xFF);
+	LIS_ASSERT_EQUAL(buffer[5], 0x00);
+	LIS_ASSERT_EQUAL(buffer[7], 0x00);
+	// 0xFF
+	LIS_ASSERT_EQUAL(buffer[8], 0x00);
+	LIS_ASSERT_EQUAL(buffer[31], 0x00);
+
+	LIS_ASSERT_TRUE(session->end_of_page(session));
+
+	session->cancel(session);
+
+	item->close(item);
+	LIS_ASSERT_EQUAL(tests_raw_clean(), 0);
+}
+
+
+/**
+ * Any read size must work, across line boundaries, whatever the size of
+ * the chunks returned by the wrapped session.
+ */
+static void tests_raw_read_sizes(void)
+{
+	static const enum lis_img_format formats[] = {
+		LIS_IMG_FORMAT_GRAYSCALE_8, LIS_IMG_FORMAT_BW_1,
+	};
+	static const int widths[] = { 1, 3, 8, 13, 21 };
+	static const size_t read_sizes[] = { 1, 2, 5, 24, 100, 100000 };
+	static const size_t chunk_size = 7;
+	static const int height = 9;
+	struct lis_scan_parameters params = { 0 };
+	struct lis_dumb_read *reads;
+	enum lis_error err;
+	struct lis_item *item;
+	struct lis_scan_session *session;
+	uint8_t *input, *expected, *got, val;
+	size_t line_length, input_size, output_size, bufsize, r;
+	unsigned int f, w, s, nb_reads, i;
+	int x, y;
+
+	for (f = 0 ; f < LIS_COUNT_OF(formats) ; f++) {
+	for (w = 0 ; w < LIS_COUNT_OF(widths) ; w++) {
+	for (s = 0 ; s < LIS_COUNT_OF(read_sizes) ; s++) {
+		line_length = (formats[f] == LIS_IMG_FORMAT_BW_1) ?
+			(size_t)((widths[w] + 7) / 8) : (size_t)widths[w];
+		input_size = line_length * height;
+		output_size = widths[w] * height * 3;
+
+		input = calloc(1, input_size);
+		expected = calloc(1, output_size);
+		got = calloc(1, output_size);
+		for (i = 0 ; i < input_size ; i++) {
+			input[i] = (i * 37 + 11) & 0xFF;
+		}
+		for (y = 0 ; y < height ; y++) {
+			for (x = 0 ; x < widths[w] ; x++) {
+				if (formats[f] == LIS_IMG_FORMAT_BW_1) {
+					val = input[(y * line_length) + (x / 8)];
+					val = (val & (1 << (7 - (x % 8)))) ? 0x00 : 0xFF;
+				} else {
+					val = input[(y * line_length) + x];
+				}
+				memset(expected + (((y * widths[w]) + x) * 3), val, 3);
+			}
+		}
+
+		nb_reads = (input_size + chunk_size - 1) / chunk_size;
+		reads = calloc(nb_reads, sizeof(struct lis_dumb_read));
+		for (i = 0 ; i < nb_reads ; i++) {
+			reads[i].content = input + (i * chunk_size);
+			reads[i].nb_bytes = MIN(chunk_size, input_size - (i * chunk_size));
+		}
+
+		params.format = formats[f];
+		params.width = widths[w];
+		params.height = height;
+		params.image_size = input_size;
+
+		LIS_ASSERT_EQUAL(tests_raw_init(), 0);
+		lis_dumb_set_scan_parameters(g_dumb, &params);
+		lis_dumb_set_scan_result(g_dumb, reads, nb_reads);
+		err = lis_api_normalizer_raw24(g_dumb, &g_raw);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+
+		item = NULL;
+		err = g_raw->get_device(g_raw, LIS_DUMB_DEV_ID_FIRST, &item);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+
+		err = item->scan_start(item, &session);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+
+		bufsize = 0;
+		while(!session->end_of_page(session)) {
+			r = MIN(read_sizes[s], output_size - bufsize);
+			LIS_ASSERT_TRUE(r > 0);
+			err = session->scan_read(session, got + bufsize, &r);
+			LIS_ASSERT_EQUAL(err, LIS_OK);
+			// buffers are always filled completely
+			LIS_ASSERT_EQUAL(
+				r, MIN(read_sizes[s], output_size - bufsize)
+			);
+			bufsize += r;
+		}
+		LIS_ASSERT_EQUAL(bufsize, output_size);
+		LIS_ASSERT_EQUAL(memcmp(got, expected, output_size), 0);
+
+		session->cancel(session);
+		item->close(item);
+		LIS_ASSERT_EQUAL(tests_raw_clean(), 0);
+
+		FREE(reads);
+		FREE(input);
+		FREE(expected);
+		FREE(got);
+	}
+	}
+	}
+}
+
+
+/**
+ * When the application accepts the native format, the image is returned
+ * as is. Other formats are still converted.
+ */
+static void tests_raw_output_formats(void)
+{
+	static const struct lis_scan_parameters gray_params = {
+		.format = LIS_IMG_FORMAT_GRAYSCALE_8,
+		.width = 2,
+		.height = 2,
+		.image_size = 4,
+	};
+	static const struct lis_scan_parameters bw_params = {
+		.format = LIS_IMG_FORMAT_BW_1,
+		.width = 8,
+		.height = 4,
+		.image_size = 4,
+	};
+	enum lis_error err;
+	struct lis_api *inner;
+	struct lis_item *item;
+	struct lis_option_descriptor **opts;
+	struct lis_scan_session *session;
+	struct lis_scan_parameters out_params;
+	uint8_t buffer[128];
+	char chain[64];
+	size_t bufsize;
+	int i, nb_opts;
+
+	LIS_ASSERT_EQUAL(tests_raw_init(), 0);
+	lis_dumb_set_scan_parameters(g_dumb, &gray_params);
+	// raw24 on top of raw24: only the first one must add the option
+	err = lis_api_normalizer_raw24(g_dumb, &inner);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = lis_api_normalizer_raw24(inner, &g_raw);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	item = NULL;
+	err = g_raw->get_device(g_raw, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = item->get_options(item, &opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	for (i = 0, nb_opts = 0 ; opts[i] != NULL ; i++) {
+		if (strcmp(opts[i]->name, OPT_NAME_OUTPUT_FORMATS) == 0) {
+			nb_opts++;
+		}
+	}
+	LIS_ASSERT_EQUAL(nb_opts, 1);
+
+	err = lis_set_option(
+		item, OPT_NAME_OUTPUT_FORMATS, "no-such-format"
+	);
+	LIS_ASSERT_EQUAL(err, LIS_ERR_INVALID_VALUE);
+	err = lis_set_option(
+		item, OPT_NAME_OUTPUT_FORMATS,
+		OPT_VALUE_OUTPUT_FORMATS_GRAYSCALE
+	);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	// grayscale accepted: returned as is
+	err = item->scan_start(item, &session);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = session->get_scan_parameters(session, &out_params);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(out_params.format, LIS_IMG_FORMAT_GRAYSCALE_8);
+	LIS_ASSERT_EQUAL(out_params.image_size, 4);
+
+	bufsize = sizeof(buffer);
+	err = session->scan_read(session, buffer, &bufsize);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(bufsize, 2);
+	LIS_ASSERT_EQUAL(buffer[0], 0x00);
+	LIS_ASSERT_EQUAL(buffer[1], 0xAA);
+	session->cancel(session);
+
+	// B&W not accepted: still converted
+	lis_dumb_set_scan_parameters(g_dumb, &bw_params);
+	err = item->scan_start(item, &session);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = session->get_scan_parameters(session, &out_params);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(out_params.format, LIS_IMG_FORMAT_RAW_RGB_24);
+	lis_scan_session_chain(session, chain, sizeof(chain));
+	LIS_ASSERT_EQUAL(strcmp(chain, "raw24 > raw24 > dumb"), 0);
+
+	bufsize = 2 * 8 * 3;
+	err = session->scan_read(session, buffer, &bufsize);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(bufsize, 2 * 8 * 3);
+	LIS_ASSERT_EQUAL(buffer[0], 0xFF);
+	LIS_ASSERT_EQUAL(buffer[8 * 3], 0x00);
+	session->cancel(session);
 
+	// all accepted
+	err = lis_set_option(
+		item, OPT_NAME_OUTPUT_FORMATS, OPT_VALUE_OUTPUT_FORMATS_ALL
+	);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = item->scan_start(item, &session);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = session->get_scan_parameters(session, &out_params);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(out_params.format, LIS_IMG_FORMAT_BW_1);
+	// the next pages may not be in the same format: raw24 remains
+	lis_scan_session_chain(session, chain, sizeof(chain));
+	LIS_ASSERT_EQUAL(strcmp(chain, "raw24 > raw24 > dumb"), 0);
+
+	bufsize = sizeof(buffer);
+	err = session->scan_read(session, buffer, &bufsize);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(bufsize, 2);
+	LIS_ASSERT_EQUAL(buffer[0], 0x00);
+	LIS_ASSERT_EQUAL(buffer[1], 0xAA);
+	session->cancel(session);
+
+	item->close(item);
+
+	// flatbed: only one page, so nothing to convert means raw24 isn't on
+	// the data path
+	lis_dumb_set_nb_devices_with_type(g_dumb, 2, LIS_ITEM_FLATBED);
+	err = g_raw->get_device(g_raw, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = lis_set_option(
+		item, OPT_NAME_OUTPUT_FORMATS, OPT_VALUE_OUTPUT_FORMATS_ALL
+	);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = item->scan_start(item, &session);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	lis_scan_session_chain(session, chain, sizeof(chain));
+	LIS_ASSERT_EQUAL(strcmp(chain, "dumb"), 0);
+
+	bufsize = sizeof(buffer);
+	err = session->scan_read(session, buffer, &bufsize);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(bufsize, 2);
+	LIS_ASSERT_EQUAL(buffer[0], 0x00);
+	LIS_ASSERT_EQUAL(buffer[1], 0xAA);
 	session->cancel(session);
 
 	item->close(item);
@@ -338,9 +675,13 @@ int register_tests(void)
 
 	if (CU_add_test(suite, "tests_unpack8()", tests_unpack8) == NULL
 			|| CU_add_test(suite, "tests_unpack1()", tests_unpack1) == NULL
+			|| CU_add_test(suite, "tests_unpack_impls()", tests_unpack_impls) == NULL
 			|| CU_add_test(suite, "tests_raw8()", tests_raw8) == NULL
-			|| CU_add_test(suite, "tests_raw1()", tests_raw1)
-				== NULL) {
+			|| CU_add_test(suite, "tests_raw1()", tests_raw1) == NULL
+			|| CU_add_test(suite, "tests_raw_read_sizes()",
+				tests_raw_read_sizes) == NULL
+			|| CU_add_test(suite, "tests_raw_output_formats()",
+				tests_raw_output_formats) == NULL) {
 		fprintf(stderr, "CU_add_test() has failed\n");
 		return 0;
 	}
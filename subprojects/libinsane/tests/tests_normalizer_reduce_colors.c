@@ -0,0 +1,562 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <CUnit/Basic.h>
+
+#define LIS_UNIT_TESTS
+
+#include <libinsane/capi.h>
+#include <libinsane/dumb.h>
+#include <libinsane/log.h>
+#include <libinsane/normalizers.h>
+#include <libinsane/util.h>
+
+#include "main.h"
+#include "util.h"
+
+#include "../src/normalizers/reduce_colors.h"
+
+
+#define ENV_DEPTH "LIBINSANE_NORMALIZER_REDUCE_COLORS_DEPTH"
+#define ENV_THRESHOLD "LIBINSANE_NORMALIZER_REDUCE_COLORS_THRESHOLD"
+
+
+static struct lis_api *g_dumb = NULL;
+static struct lis_api *g_reduce = NULL;
+
+
+static int tests_reduce_init(void)
+{
+	enum lis_error err;
+
+	g_reduce = NULL;
+	err = lis_api_dumb(&g_dumb, "dummy0");
+	if (LIS_IS_ERROR(err)) {
+		return -1;
+	}
+	lis_dumb_set_nb_devices(g_dumb, 2);
+
+	err = lis_api_normalizer_reduce_colors(g_dumb, &g_reduce);
+	if (LIS_IS_ERROR(err)) {
+		return -1;
+	}
+	return 0;
+}
+
+
+static int tests_reduce_clean(void)
+{
+	struct lis_api *api = (g_reduce != NULL ? g_reduce : g_dumb);
+	api->cleanup(api);
+	unsetenv(ENV_DEPTH);
+	unsetenv(ENV_THRESHOLD);
+	return 0;
+}
+
+
+static uint8_t ref_gray(const uint8_t *rgb)
+{
+	return ((rgb[0] * 77) + (rgb[1] * 150) + (rgb[2] * 29) + 128) >> 8;
+}
+
+
+static void tests_gray_impls(void)
+{
+	static const size_t max_size = 4099;
+	static const size_t guard = 64;
+	const struct reduce_colors_impl *impls;
+	const struct reduce_colors_impl *ref = NULL;
+	const struct reduce_colors_impl *impl;
+	uint8_t *input, *expected, *got;
+	size_t i, s;
+	uint32_t seed = 0x12345678;
+
+	impls = reduce_colors_get_impls();
+	for (impl = impls ; impl->name != NULL ; impl++) {
+		ref = impl;
+	}
+	LIS_ASSERT_NOT_EQUAL(ref, NULL);
+	LIS_ASSERT_EQUAL(strcmp(ref->name, "scalar"), 0);
+
+	input = malloc(max_size * 3);
+	expected = malloc(max_size + guard);
+	got = malloc(max_size + guard);
+	LIS_ASSERT_NOT_EQUAL(input, NULL);
+	LIS_ASSERT_NOT_EQUAL(expected, NULL);
+	LIS_ASSERT_NOT_EQUAL(got, NULL);
+
+	for (i = 0 ; i < max_size * 3 ; i++) {
+		seed = (seed * 1103515245) + 12345;
+		input[i] = (seed >> 16) & 0xFF;
+	}
+	// extreme values
+	memset(input, 0xFF, 3 * 20);
+	memset(input + (3 * 20), 0x00, 3 * 20);
+
+	ref->rgb24_to_gray8(input, expected, max_size);
+	for (i = 0 ; i < max_size ; i++) {
+		LIS_ASSERT_EQUAL(expected[i], ref_gray(input + (i * 3)));
+	}
+	LIS_ASSERT_EQUAL(expected[0], 0xFF);
+	LIS_ASSERT_EQUAL(expected[20], 0x00);
+
+	for (impl = impls ; impl->name != NULL ; impl++) {
+		if (!impl->is_supported()) {
+			continue;
+		}
+		for (s = 0 ; s <= 100 ; s++) {
+			memset(expected, 0xAB, max_size + guard);
+			memset(got, 0xAB, max_size + guard);
+			ref->rgb24_to_gray8(input + s, expected, max_size - s);
+			impl->rgb24_to_gray8(input + s, got, max_size - s);
+			LIS_ASSERT_EQUAL(memcmp(expected, got, max_size + guard), 0);
+
+			memset(expected, 0xAB, max_size + guard);
+			memset(got, 0xAB, max_size + guard);
+			ref->rgb24_to_gray8(input, expected, s);
+			impl->rgb24_to_gray8(input, got, s);
+			LIS_ASSERT_EQUAL(memcmp(expected, got, max_size + guard), 0);
+		}
+	}
+
+	FREE(input);
+	FREE(expected);
+	FREE(got);
+}
+
+
+/**
+ * Scans the given image through the normalizer, reading 'read_size' bytes
+ * at a time. The wrapped session returns the image by chunks of
+ * 'chunk_size' bytes.
+ */
+static uint8_t *scan(
+		const struct lis_scan_parameters *in_params,
+		const uint8_t *input, size_t chunk_size, size_t read_size,
+		struct lis_scan_parameters *out_params
+	)
+{
+	struct lis_dumb_read *reads;
+	struct lis_item *item;
+	struct lis_scan_session *session;
+	unsigned int nb_reads, i;
+	enum lis_error err;
+	uint8_t *out = NULL;
+	size_t bufsize, r;
+
+	nb_reads = (in_params->image_size + chunk_size - 1) / chunk_size;
+	reads = calloc(nb_reads, sizeof(struct lis_dumb_read));
+	for (i = 0 ; i < nb_reads ; i++) {
+		reads[i].content = input + (i * chunk_size);
+		reads[i].nb_bytes = MIN(
+			chunk_size, in_params->image_size - (i * chunk_size)
+		);
+	}
+
+	lis_dumb_set_scan_parameters(g_dumb, in_params);
+	lis_dumb_set_scan_result(g_dumb, reads, nb_reads);
+
+	item = NULL;
+	err = g_reduce->get_device(g_reduce, LIS_DUMB_DEV_ID_FIRST, &item);
+	if (LIS_IS_ERROR(err)) {
+		goto end;
+	}
+	err = item->scan_start(item, &session);
+	if (LIS_IS_ERROR(err)) {
+		goto close;
+	}
+	err = session->get_scan_parameters(session, out_params);
+	if (LIS_IS_ERROR(err)) {
+		goto cancel;
+	}
+
+	out = calloc(1, out_params->image_size + 1);
+	bufsize = 0;
+	while(!session->end_of_page(session)) {
+		r = MIN(read_size, out_params->image_size + 1 - bufsize);
+		err = session->scan_read(session, out + bufsize, &r);
+		if (LIS_IS_ERROR(err)) {
+			FREE(out);
+			goto cancel;
+		}
+		bufsize += r;
+		if (bufsize > out_params->image_size) {
+			// too much data
+			FREE(out);
+			goto cancel;
+		}
+		// buffers are always filled completely
+		if (bufsize < out_params->image_size && r != read_size) {
+			FREE(out);
+			goto cancel;
+		}
+	}
+	if (bufsize != out_params->image_size) {
+		FREE(out);
+	}
+
+cancel:
+	session->cancel(session);
+close:
+	item->close(item);
+end:
+	FREE(reads);
+	return out;
+}
+
+
+static void tests_reduce(int depth, int threshold)
+{
+	static const int widths[] = { 1, 7, 8, 13, 16, 17, 33, 100 };
+	static const size_t chunk_sizes[] = { 7, 1000000 };
+	static const size_t read_sizes[] = { 1, 2, 5, 24, 100, 100000 };
+	static const int height = 9;
+	struct lis_scan_parameters params = { 0 };
+	struct lis_scan_parameters out_params;
+	uint8_t *input, *expected, *got, *ref_got = NULL;
+	size_t line_length, output_size, i;
+	unsigned int w, c, s;
+	char threshold_str[16];
+	int x, y;
+
+	if (depth == 1) {
+		setenv(ENV_DEPTH, "1", 1);
+	}
+	if (threshold != 128) {
+		snprintf(threshold_str, sizeof(threshold_str), "%d", threshold);
+		setenv(ENV_THRESHOLD, threshold_str, 1);
+	}
+	LIS_ASSERT_EQUAL(tests_reduce_init(), 0);
+
+	for (w = 0 ; w < LIS_COUNT_OF(widths) ; w++) {
+		line_length = (depth == 1) ? (size_t)((widths[w] + 7) / 8)
+			: (size_t)widths[w];
+		output_size = line_length * height;
+
+		params.format = LIS_IMG_FORMAT_RAW_RGB_24;
+		params.width = widths[w];
+		params.height = height;
+		params.image_size = widths[w] * height * 3;
+
+		input = calloc(1, params.image_size);
+		expected = calloc(1, output_size);
+		for (i = 0 ; i < params.image_size ; i++) {
+			input[i] = (i * 37 + 11) & 0xFF;
+		}
+		for (y = 0 ; y < height ; y++) {
+			for (x = 0 ; x < widths[w] ; x++) {
+				i = (y * widths[w]) + x;
+				if (depth == 8) {
+					expected[i] = ref_gray(input + (i * 3));
+				} else if (ref_gray(input + (i * 3)) < threshold) {
+					expected[(y * line_length) + (x / 8)] |=
+						1 << (7 - (x % 8));
+				}
+			}
+		}
+
+		for (c = 0 ; c < LIS_COUNT_OF(chunk_sizes) ; c++) {
+			for (s = 0 ; s < LIS_COUNT_OF(read_sizes) ; s++) {
+				got = scan(
+					&params, input, chunk_sizes[c],
+					read_sizes[s], &out_params
+				);
+				LIS_ASSERT_NOT_EQUAL(got, NULL);
+				LIS_ASSERT_EQUAL(out_params.format, (depth == 1) ?
+					LIS_IMG_FORMAT_BW_1 : LIS_IMG_FORMAT_GRAYSCALE_8);
+				LIS_ASSERT_EQUAL(out_params.width, widths[w]);
+				LIS_ASSERT_EQUAL(out_params.height, height);
+				LIS_ASSERT_EQUAL(out_params.image_size, output_size);
+
+				if (threshold >= 0) {
+					LIS_ASSERT_EQUAL(
+						memcmp(got, expected, output_size), 0
+					);
+				} else if (ref_got == NULL) {
+					ref_got = got;
+					got = NULL;
+				} else {
+					// adaptive: must not depend on how the
+					// image is read
+					LIS_ASSERT_EQUAL(
+						memcmp(got, ref_got, output_size), 0
+					);
+				}
+				FREE(got);
+			}
+		}
+
+		FREE(ref_got);
+		FREE(input);
+		FREE(expected);
+	}
+
+	LIS_ASSERT_EQUAL(tests_reduce_clean(), 0);
+}
+
+
+static void tests_reduce_gray(void)
+{
+	tests_reduce(8, 128);
+}
+
+
+static void tests_reduce_bw(void)
+{
+	tests_reduce(1, 128);
+	tests_reduce(1, 60);
+}
+
+
+static void tests_reduce_bw_adaptive(void)
+{
+	tests_reduce(1, -1);
+}
+
+
+/**
+ * Adaptive threshold: dark text on a background getting darker from left
+ * to right (uneven lighting). The text must be kept, and the background
+ * must remain white.
+ */
+static void tests_reduce_bw_uneven(void)
+{
+	static const int width = 256;
+	static const int height = 64;
+	struct lis_scan_parameters params = {
+		.format = LIS_IMG_FORMAT_RAW_RGB_24,
+		.width = width,
+		.height = height,
+		.image_size = width * height * 3,
+	};
+	struct lis_scan_parameters out_params;
+	uint8_t *input, *got, val;
+	int x, y, text, black;
+	int nb_bad_background = 0, nb_text_missed = 0, nb_text = 0;
+
+	input = malloc(params.image_size);
+	LIS_ASSERT_NOT_EQUAL(input, NULL);
+	for (y = 0 ; y < height ; y++) {
+		for (x = 0 ; x < width ; x++) {
+			// background: from 240 (left) to 120 (right)
+			val = 240 - ((x * 120) / width);
+			text = (y % 16 >= 6 && y % 16 < 9 && x % 32 >= 20);
+			if (text) {
+				val /= 3;
+			}
+			memset(input + (((y * width) + x) * 3), val, 3);
+		}
+	}
+
+	setenv(ENV_DEPTH, "1", 1);
+	setenv(ENV_THRESHOLD, "-1", 1);
+	LIS_ASSERT_EQUAL(tests_reduce_init(), 0);
+
+	got = scan(&params, input, 1000, 333, &out_params);
+	LIS_ASSERT_NOT_EQUAL(got, NULL);
+	LIS_ASSERT_EQUAL(out_params.format, LIS_IMG_FORMAT_BW_1);
+	LIS_ASSERT_EQUAL(out_params.image_size, (width / 8) * height);
+
+	// leave the moving average some room to warm up
+	for (y = 8 ; y < height ; y++) {
+		for (x = 40 ; x < width ; x++) {
+			text = (y % 16 >= 6 && y % 16 < 9 && x % 32 >= 20);
+			black = !!(got[(y * (width / 8)) + (x / 8)]
+				& (1 << (7 - (x % 8))));
+			if (text) {
+				nb_text++;
+				nb_text_missed += !black;
+			} else {
+				nb_bad_background += black;
+			}
+		}
+	}
+	LIS_ASSERT_TRUE(nb_text > 0);
+	LIS_ASSERT_TRUE(nb_text_missed < nb_text / 20);
+	LIS_ASSERT_TRUE(nb_bad_background < (width * height) / 100);
+
+	FREE(got);
+	FREE(input);
+	LIS_ASSERT_EQUAL(tests_reduce_clean(), 0);
+}
+
+
+/**
+ * Grayscale input: converted directly in B&W. Other formats are returned
+ * as is.
+ */
+static void tests_reduce_other_formats(void)
+{
+	static const uint8_t gray[] = {
+		0x00, 0xFF, 0x7F, 0x80, 0x10, 0xF0, 0x00, 0xFF, 0x00,
+	};
+	static const uint8_t bw[] = { 0xA5, 0x5A };
+	struct lis_scan_parameters params = {
+		.format = LIS_IMG_FORMAT_GRAYSCALE_8,
+		.width = 9,
+		.height = 1,
+		.image_size = sizeof(gray),
+	};
+	struct lis_scan_parameters out_params;
+	uint8_t *got;
+
+	setenv(ENV_DEPTH, "1", 1);
+	LIS_ASSERT_EQUAL(tests_reduce_init(), 0);
+
+	got = scan(&params, gray, 4, 1, &out_params);
+	LIS_ASSERT_NOT_EQUAL(got, NULL);
+	LIS_ASSERT_EQUAL(out_params.format, LIS_IMG_FORMAT_BW_1);
+	LIS_ASSERT_EQUAL(out_params.image_size, 2);
+	LIS_ASSERT_EQUAL(got[0], 0xAA);
+	LIS_ASSERT_EQUAL(got[1], 0x80);
+	FREE(got);
+
+	params.format = LIS_IMG_FORMAT_BW_1;
+	params.width = 16;
+	params.image_size = sizeof(bw);
+	got = scan(&params, bw, 1, 1, &out_params);
+	LIS_ASSERT_NOT_EQUAL(got, NULL);
+	LIS_ASSERT_EQUAL(out_params.format, LIS_IMG_FORMAT_BW_1);
+	LIS_ASSERT_EQUAL(out_params.image_size, 2);
+	LIS_ASSERT_EQUAL(memcmp(got, bw, sizeof(bw)), 0);
+	FREE(got);
+
+	LIS_ASSERT_EQUAL(tests_reduce_clean(), 0);
+
+	// grayscale is already what we want
+	LIS_ASSERT_EQUAL(tests_reduce_init(), 0);
+	params.format = LIS_IMG_FORMAT_GRAYSCALE_8;
+	params.width = 9;
+	params.image_size = sizeof(gray);
+	got = scan(&params, gray, 4, 4, &out_params);
+	LIS_ASSERT_NOT_EQUAL(got, NULL);
+	LIS_ASSERT_EQUAL(out_params.format, LIS_IMG_FORMAT_GRAYSCALE_8);
+	LIS_ASSERT_EQUAL(out_params.image_size, sizeof(gray));
+	LIS_ASSERT_EQUAL(memcmp(got, gray, sizeof(gray)), 0);
+	FREE(got);
+	LIS_ASSERT_EQUAL(tests_reduce_clean(), 0);
+}
+
+
+static void read_generated(
+		int empty_reads, uint8_t *out, size_t out_size,
+		size_t *total, int *nb_empty
+	)
+{
+	struct lis_dumb_generator gen = {
+		.format = LIS_IMG_FORMAT_RAW_RGB_24,
+		.width = 13,
+		.height = 9,
+		.nb_pages = 1,
+		.pattern = LIS_DUMB_PATTERN_NOISE,
+		.seed = 42,
+		.max_read = 5,
+		.empty_reads = empty_reads,
+	};
+	struct lis_item *item;
+	struct lis_scan_session *session;
+	size_t r;
+	int nb_calls = 0;
+	enum lis_error err;
+
+	*total = 0;
+	*nb_empty = 0;
+	lis_dumb_set_generator(g_dumb, &gen);
+
+	err = g_reduce->get_device(g_reduce, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = item->scan_start(item, &session);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	while (!session->end_of_page(session) && nb_calls < 10000) {
+		r = MIN(out_size - *total, 100);
+		err = session->scan_read(session, out + *total, &r);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+		if (r == 0) {
+			(*nb_empty)++;
+		}
+		*total += r;
+		nb_calls++;
+	}
+	LIS_ASSERT_TRUE(session->end_of_page(session));
+
+	session->cancel(session);
+	item->close(item);
+}
+
+
+/**
+ * Non-blocking source: scan_read() may return 0 bytes. It must not spin
+ * until a whole line is available, but return what it has so far.
+ */
+static void tests_reduce_empty_reads(void)
+{
+	uint8_t expected[13 * 9], got[13 * 9];
+	size_t total;
+	int nb_empty;
+
+	LIS_ASSERT_EQUAL(tests_reduce_init(), 0);
+
+	read_generated(0, expected, sizeof(expected), &total, &nb_empty);
+	LIS_ASSERT_EQUAL(total, sizeof(expected));
+	read_generated(2, got, sizeof(got), &total, &nb_empty);
+	LIS_ASSERT_EQUAL(total, sizeof(got));
+	LIS_ASSERT_TRUE(nb_empty > 0);
+	LIS_ASSERT_EQUAL(memcmp(got, expected, sizeof(expected)), 0);
+
+	LIS_ASSERT_EQUAL(tests_reduce_clean(), 0);
+}
+
+
+static void tests_reduce_invalid_depth(void)
+{
+	struct lis_item *item;
+	struct lis_scan_session *session;
+	enum lis_error err;
+
+	setenv(ENV_DEPTH, "4", 1);
+	LIS_ASSERT_EQUAL(tests_reduce_init(), 0);
+
+	err = g_reduce->get_device(g_reduce, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = item->scan_start(item, &session);
+	LIS_ASSERT_EQUAL(err, LIS_ERR_INVALID_VALUE);
+	item->close(item);
+
+	LIS_ASSERT_EQUAL(tests_reduce_clean(), 0);
+}
+
+
+int register_tests(void)
+{
+	CU_pSuite suite = NULL;
+
+	suite = CU_add_suite("Normalizer_reduce_colors", NULL, NULL);
+	if (suite == NULL) {
+		fprintf(stderr, "CU_add_suite() failed\n");
+		return 0;
+	}
+
+	if (CU_add_test(suite, "tests_gray_impls()", tests_gray_impls) == NULL
+			|| CU_add_test(suite, "tests_reduce_gray()",
+				tests_reduce_gray) == NULL
+			|| CU_add_test(suite, "tests_reduce_bw()",
+				tests_reduce_bw) == NULL
+			|| CU_add_test(suite, "tests_reduce_bw_adaptive()",
+				tests_reduce_bw_adaptive) == NULL
+			|| CU_add_test(suite, "tests_reduce_bw_uneven()",
+				tests_reduce_bw_uneven) == NULL
+			|| CU_add_test(suite, "tests_reduce_other_formats()",
+				tests_reduce_other_formats) == NULL
+			|| CU_add_test(suite, "tests_reduce_empty_reads()",
+				tests_reduce_empty_reads) == NULL
+			|| CU_add_test(suite, "tests_reduce_invalid_depth()",
+				tests_reduce_invalid_depth) == NULL) {
+		fprintf(stderr, "CU_add_test() has failed\n");
+		return 0;
+	}
+
+	return 1;
+}
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <CUnit/Basic.h>
+
+#include <libinsane/capi.h>
+#include <libinsane/error.h>
+
+#include "main.h"
+#include "util.h"
+
+#include "../src/opt_index.h"
+
+
+#define NB_MANY_OPTS 100
+
+
+static void tests_opt_index_find(void)
+{
+	struct lis_opt_index index = { 0 };
+	struct lis_option_descriptor resolution = { .name = "resolution" };
+	struct lis_option_descriptor mode = { .name = "mode" };
+	struct lis_option_descriptor source = { .name = "source" };
+	struct lis_option_descriptor mode_bis = { .name = "MODE" };
+	struct lis_option_descriptor *opts[] = {
+		&resolution, &mode, &source, &mode_bis, NULL
+	};
+	struct lis_option_descriptor *no_opts[] = { NULL };
+	enum lis_error err;
+
+	// never built
+	LIS_ASSERT_EQUAL(lis_opt_index_find(&index, "mode"), NULL);
+
+	err = lis_opt_index_build(&index, opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	LIS_ASSERT_EQUAL(lis_opt_index_find(&index, "resolution"), &resolution);
+	LIS_ASSERT_EQUAL(lis_opt_index_find(&index, "Resolution"), &resolution);
+	LIS_ASSERT_EQUAL(lis_opt_index_find(&index, "SOURCE"), &source);
+	// duplicated names: the first one wins
+	LIS_ASSERT_EQUAL(lis_opt_index_find(&index, "Mode"), &mode);
+	LIS_ASSERT_EQUAL(lis_opt_index_find(&index, "modes"), NULL);
+	LIS_ASSERT_EQUAL(lis_opt_index_find(&index, ""), NULL);
+
+	err = lis_opt_index_build(&index, no_opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(lis_opt_index_find(&index, "mode"), NULL);
+
+	lis_opt_index_clean(&index);
+	LIS_ASSERT_EQUAL(lis_opt_index_find(&index, "mode"), NULL);
+}
+
+
+static void tests_opt_index_rebuild(void)
+{
+	struct lis_opt_index index = { 0 };
+	char names[NB_MANY_OPTS][16];
+	struct lis_option_descriptor descs[NB_MANY_OPTS];
+	struct lis_option_descriptor *opts[NB_MANY_OPTS + 1];
+	struct lis_option_descriptor *few_opts[3];
+	enum lis_error err;
+	int i;
+
+	memset(descs, 0, sizeof(descs));
+	for (i = 0 ; i < NB_MANY_OPTS ; i++) {
+		snprintf(names[i], sizeof(names[i]), "opt-%d", i);
+		descs[i].name = names[i];
+		opts[i] = &descs[i];
+	}
+	opts[NB_MANY_OPTS] = NULL;
+
+	few_opts[0] = &descs[10];
+	few_opts[1] = &descs[20];
+	few_opts[2] = NULL;
+
+	err = lis_opt_index_build(&index, few_opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(lis_opt_index_find(&index, "opt-20"), &descs[20]);
+	LIS_ASSERT_EQUAL(lis_opt_index_find(&index, "opt-30"), NULL);
+
+	// grows
+	err = lis_opt_index_build(&index, opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	for (i = 0 ; i < NB_MANY_OPTS ; i++) {
+		LIS_ASSERT_EQUAL(lis_opt_index_find(&index, names[i]), &descs[i]);
+	}
+	LIS_ASSERT_EQUAL(lis_opt_index_find(&index, "opt-100"), NULL);
+
+	// shrinks: previous options must be forgotten
+	err = lis_opt_index_build(&index, few_opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(lis_opt_index_find(&index, "OPT-10"), &descs[10]);
+	LIS_ASSERT_EQUAL(lis_opt_index_find(&index, "opt-30"), NULL);
+
+	lis_opt_index_clean(&index);
+}
+
+
+int register_tests(void)
+{
+	CU_pSuite suite = NULL;
+
+	suite = CU_add_suite("Option index", NULL, NULL);
+	if (suite == NULL) {
+		fprintf(stderr, "CU_add_suite() failed\n");
+		return 0;
+	}
+
+	if (CU_add_test(suite, "tests_opt_index_find()", tests_opt_index_find) == NULL
+			|| CU_add_test(suite, "tests_opt_index_rebuild()", tests_opt_index_rebuild) == NULL
+			) {
+		fprintf(stderr, "CU_add_test() has failed\n");
+		return 0;
+	}
+
+	return 1;
+}
@@ -0,0 +1,318 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <CUnit/Basic.h>
+
+#include <libinsane/capi.h>
+#include <libinsane/constants.h>
+#include <libinsane/dumb.h>
+#include <libinsane/log.h>
+#include <libinsane/normalizers.h>
+#include <libinsane/stats.h>
+#include <libinsane/util.h>
+
+#include "main.h"
+#include "util.h"
+
+
+static struct lis_api *g_dumb = NULL;
+static struct lis_api *g_stats_dumb = NULL;
+static struct lis_api *g_sn = NULL;
+static struct lis_api *g_stats_sn = NULL;
+static int g_set_values_calls = 0;
+
+
+static int tests_stats_init(void)
+{
+	enum lis_error err;
+	static const union lis_value opt_source_constraint[] = {
+		{ .string = OPT_VALUE_SOURCE_FLATBED, },
+		{ .string = OPT_VALUE_SOURCE_ADF, },
+	};
+	static const struct lis_option_descriptor opt_source_template = {
+		.name = OPT_NAME_SOURCE,
+		.title = "source title",
+		.desc = "source desc",
+		.capabilities = LIS_CAP_SW_SELECT,
+		.value = {
+			.type = LIS_TYPE_STRING,
+			.unit = LIS_UNIT_NONE,
+		},
+		.constraint = {
+			.type = LIS_CONSTRAINT_LIST,
+			.possible.list = {
+				.nb_values = LIS_COUNT_OF(opt_source_constraint),
+				.values = (union lis_value*)&opt_source_constraint,
+			},
+		},
+	};
+	static const union lis_value opt_source_default = {
+		.string = OPT_VALUE_SOURCE_FLATBED
+	};
+	static const struct lis_option_descriptor opt_resolution_template = {
+		.name = OPT_NAME_RESOLUTION,
+		.title = "resolution title",
+		.desc = "resolution desc",
+		.capabilities = LIS_CAP_SW_SELECT,
+		.value = {
+			.type = LIS_TYPE_INTEGER,
+			.unit = LIS_UNIT_DPI,
+		},
+		.constraint = {
+			.type = LIS_CONSTRAINT_RANGE,
+			.possible.range = {
+				.min.integer = 50,
+				.max.integer = 600,
+				.interval.integer = 1,
+			},
+		},
+	};
+	static const union lis_value opt_resolution_default = {
+		.integer = 300,
+	};
+
+	err = lis_api_dumb(&g_dumb, "dummy0");
+	if (LIS_IS_ERROR(err)) {
+		return -1;
+	}
+	lis_dumb_set_nb_devices(g_dumb, 2);
+	lis_dumb_add_option(
+		g_dumb, &opt_source_template, &opt_source_default,
+		LIS_SET_FLAG_MUST_RELOAD_PARAMS
+	);
+	lis_dumb_add_option(
+		g_dumb, &opt_resolution_template, &opt_resolution_default,
+		LIS_SET_FLAG_MUST_RELOAD_PARAMS
+	);
+
+	err = lis_api_stats(g_dumb, &g_stats_dumb, "dumb");
+	if (LIS_IS_ERROR(err)) {
+		return -1;
+	}
+	err = lis_api_normalizer_source_nodes(g_stats_dumb, &g_sn);
+	if (LIS_IS_ERROR(err)) {
+		return -1;
+	}
+	err = lis_api_stats(g_sn, &g_stats_sn, "source_nodes");
+	if (LIS_IS_ERROR(err)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static int tests_stats_clean(void)
+{
+	g_stats_sn->cleanup(g_stats_sn);
+	return 0;
+}
+
+
+static void tests_stats_counters(void)
+{
+	static const struct lis_scan_parameters scan_params = {
+		.format = LIS_IMG_FORMAT_RAW_RGB_24,
+		.width = 4,
+		.height = 2,
+		.image_size = 4 * 2 * 3,
+	};
+	static const uint8_t body[4 * 2 * 3] = { 0 };
+	static const struct lis_dumb_read reads[] = {
+		{ .content = body, .nb_bytes = LIS_COUNT_OF(body) },
+	};
+
+	enum lis_error err;
+	struct lis_device_descriptor **descs;
+	struct lis_item *item;
+	struct lis_item **children;
+	struct lis_option_descriptor **opts;
+	struct lis_option_descriptor **opts_b;
+	struct lis_scan_session *session;
+	union lis_value value;
+	int set_flags;
+	size_t bufsize;
+	uint8_t buffer[64];
+	char *json;
+
+	LIS_ASSERT_EQUAL(tests_stats_init(), 0);
+	lis_dumb_set_scan_parameters(g_dumb, &scan_params);
+	lis_dumb_set_scan_result(g_dumb, reads, LIS_COUNT_OF(reads));
+
+	err = g_stats_sn->list_devices(
+		g_stats_sn, LIS_DEVICE_LOCATIONS_ANY, &descs
+	);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = g_stats_sn->get_device(g_stats_sn, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = item->get_children(item, &children);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_NOT_EQUAL(children[0], NULL);
+	LIS_ASSERT_NOT_EQUAL(children[1], NULL);
+	LIS_ASSERT_EQUAL(children[2], NULL);
+
+	err = item->get_options(item, &opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(strcmp(opts[1]->name, OPT_NAME_RESOLUTION), 0);
+
+	// option wrappers are kept: other layers may keep pointers to them
+	err = item->get_options(item, &opts_b);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(opts_b[1], opts[1]);
+
+	err = opts[1]->fn.get_value(opts[1], &value);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(value.integer, 300);
+	value.integer = 150;
+	err = opts[1]->fn.set_value(opts[1], value, &set_flags);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = children[0]->scan_start(children[0], &session);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	while (!session->end_of_page(session)) {
+		bufsize = sizeof(buffer);
+		err = session->scan_read(session, buffer, &bufsize);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+	}
+	session->cancel(session);
+
+	err = lis_stats_dump(&json);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	// layers are listed from the innermost to the outermost one
+	LIS_ASSERT_NOT_EQUAL(strstr(json, "{\"layers\": [{\"name\": \"dumb\""), NULL);
+	LIS_ASSERT_NOT_EQUAL(strstr(json, "}}}, {\"name\": \"source_nodes\""), NULL);
+	LIS_ASSERT_NOT_EQUAL(strstr(json, "\"list_devices\": {\"calls\": 1,"), NULL);
+	LIS_ASSERT_NOT_EQUAL(strstr(json, "\"get_options\": {\"calls\": 2,"), NULL);
+	LIS_ASSERT_NOT_EQUAL(strstr(json, "\"get_value\": {\"calls\": 1,"), NULL);
+	LIS_ASSERT_NOT_EQUAL(strstr(json, "\"set_value\": {\"calls\": 1,"), NULL);
+	LIS_ASSERT_NOT_EQUAL(strstr(json, "\"scan_start\": {\"calls\": 1,"), NULL);
+	LIS_ASSERT_NOT_EQUAL(strstr(json, ", \"bytes\": 24}"), NULL);
+	free(json);
+
+	lis_stats_reset();
+	err = lis_stats_dump(&json);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(strcmp(json,
+		"{\"layers\": ["
+			"{\"name\": \"dumb\", \"ops\": {}}, "
+			"{\"name\": \"source_nodes\", \"ops\": {}}"
+		"]}"
+	), 0);
+	free(json);
+
+	item->close(item);
+	LIS_ASSERT_EQUAL(tests_stats_clean(), 0);
+
+	// layers are unregistered on cleanup
+	err = lis_stats_dump(&json);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(strcmp(json, "{\"layers\": []}"), 0);
+	free(json);
+}
+
+
+static enum lis_error dumb_set_values(
+		struct lis_item *self, int nb_values,
+		struct lis_option_descriptor **opts, const union lis_value *values,
+		int *set_flags, int *nb_set
+	)
+{
+	enum lis_error err = LIS_OK;
+	int flags;
+
+	LIS_UNUSED(self);
+
+	g_set_values_calls++;
+	*set_flags = 0;
+	for (*nb_set = 0 ; *nb_set < nb_values ; (*nb_set)++) {
+		flags = 0;
+		err = opts[*nb_set]->fn.set_value(
+			opts[*nb_set], values[*nb_set], &flags
+		);
+		if (LIS_IS_ERROR(err)) {
+			break;
+		}
+		*set_flags |= flags;
+	}
+	return err;
+}
+
+
+static void tests_stats_set_values(void)
+{
+	static const struct lis_option_setting settings[] = {
+		{ .name = OPT_NAME_RESOLUTION, .value = "150" },
+	};
+	enum lis_error err;
+	struct lis_item *dumb_item;
+	struct lis_item *item;
+	struct lis_option_descriptor **opts;
+	union lis_value value;
+	int set_flags;
+	char *json;
+
+	LIS_ASSERT_EQUAL(tests_stats_init(), 0);
+	g_set_values_calls = 0;
+
+	// no set_values() below: not provided either
+	err = g_stats_dumb->get_device(g_stats_dumb, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(item->set_values, NULL);
+	item->close(item);
+
+	err = g_dumb->get_device(g_dumb, LIS_DUMB_DEV_ID_FIRST, &dumb_item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	dumb_item->set_values = dumb_set_values;
+
+	err = g_stats_dumb->get_device(g_stats_dumb, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_NOT_EQUAL(item->set_values, NULL);
+
+	// the wrapped item gets its own option descriptors
+	err = lis_set_options(item, settings, LIS_COUNT_OF(settings), &set_flags);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(g_set_values_calls, 1);
+
+	err = item->get_options(item, &opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(strcmp(opts[1]->name, OPT_NAME_RESOLUTION), 0);
+	err = opts[1]->fn.get_value(opts[1], &value);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(value.integer, 150);
+
+	err = lis_stats_dump(&json);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_NOT_EQUAL(strstr(json, "\"set_values\": {\"calls\": 1,"), NULL);
+	LIS_ASSERT_EQUAL(strstr(json, "\"set_value\": {"), NULL);
+	free(json);
+
+	dumb_item->set_values = NULL;
+	item->close(item);
+	LIS_ASSERT_EQUAL(tests_stats_clean(), 0);
+}
+
+
+int register_tests(void)
+{
+	CU_pSuite suite = NULL;
+
+	suite = CU_add_suite("Stats", NULL, NULL);
+	if (suite == NULL) {
+		fprintf(stderr, "CU_add_suite() failed\n");
+		return 0;
+	}
+
+	if (CU_add_test(suite, "tests_stats_counters()", tests_stats_counters) == NULL
+			|| CU_add_test(suite, "tests_stats_set_values()",
+				tests_stats_set_values) == NULL) {
+		fprintf(stderr, "CU_add_test() has failed\n");
+		return 0;
+	}
+
+	return 1;
+}
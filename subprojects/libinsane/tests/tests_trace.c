@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <CUnit/Basic.h>
+
+#include <libinsane/capi.h>
+#include <libinsane/dumb.h>
+#include <libinsane/log.h>
+#include <libinsane/stats.h>
+#include <libinsane/trace.h>
+#include <libinsane/util.h>
+#include <libinsane/workarounds.h>
+
+#include "main.h"
+#include "util.h"
+
+
+static char g_dir[] = "/tmp/tests_trace.XXXXXX";
+static char g_path[sizeof(g_dir) + 32];
+
+static struct lis_api *g_dumb = NULL;
+static struct lis_api *g_stats_dumb = NULL;
+
+
+static int tests_trace_init(void)
+{
+	enum lis_error err;
+
+	strcpy(g_dir, "/tmp/tests_trace.XXXXXX");
+	if (mkdtemp(g_dir) == NULL) {
+		return -1;
+	}
+	snprintf(g_path, sizeof(g_path), "%s/trace.json", g_dir);
+
+	err = lis_trace_start(g_path);
+	if (LIS_IS_ERROR(err)) {
+		return -1;
+	}
+
+	err = lis_api_dumb(&g_dumb, "dummy0");
+	if (LIS_IS_ERROR(err)) {
+		return -1;
+	}
+	lis_dumb_set_nb_devices(g_dumb, 2);
+
+	err = lis_api_stats(g_dumb, &g_stats_dumb, "dumb");
+	if (LIS_IS_ERROR(err)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static void tests_trace_clean(void)
+{
+	lis_trace_stop();
+	unlink(g_path);
+	rmdir(g_dir);
+}
+
+
+static char *read_trace(void)
+{
+	FILE *fp;
+	long size;
+	char *content;
+
+	fp = fopen(g_path, "r");
+	if (fp == NULL) {
+		return NULL;
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	content = calloc(1, size + 1);
+	if (content != NULL && fread(content, 1, size, fp) != (size_t)size) {
+		FREE(content);
+	}
+	fclose(fp);
+	return content;
+}
+
+
+static void tests_trace_calls(void)
+{
+	enum lis_error err;
+	struct lis_device_descriptor **descs;
+	struct lis_item *item;
+	struct lis_item **children;
+	char *trace;
+
+	LIS_ASSERT_EQUAL(tests_trace_init(), 0);
+
+	err = g_stats_dumb->list_devices(
+		g_stats_dumb, LIS_DEVICE_LOCATIONS_ANY, &descs
+	);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = g_stats_dumb->get_device(g_stats_dumb, "nope", &item);
+	LIS_ASSERT_EQUAL(err, LIS_ERR_INVALID_VALUE);
+
+	err = g_stats_dumb->get_device(g_stats_dumb, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = item->get_children(item, &children);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	item->close(item);
+
+	// nothing is written until flushed
+	trace = read_trace();
+	LIS_ASSERT_NOT_EQUAL(trace, NULL);
+	LIS_ASSERT_EQUAL(strcmp(trace, "[\n"), 0);
+	FREE(trace);
+
+	// flushes the trace
+	g_stats_dumb->cleanup(g_stats_dumb);
+
+	trace = read_trace();
+	LIS_ASSERT_NOT_EQUAL(trace, NULL);
+	LIS_ASSERT_EQUAL(strstr(trace, "[\n{\"ph\": \"M\", \"name\": \"process_name\""), trace);
+	LIS_ASSERT_NOT_EQUAL(strstr(trace, "\"args\": {\"name\": \"libinsane\"}}"), NULL);
+	LIS_ASSERT_NOT_EQUAL(strstr(trace, "{\"ph\": \"X\", \"name\": \"dumb: list_devices\", "), NULL);
+	LIS_ASSERT_NOT_EQUAL(strstr(trace, "{\"ph\": \"X\", \"name\": \"dumb: get_children\", "), NULL);
+	LIS_ASSERT_NOT_EQUAL(strstr(trace, "\"args\": {\"err\": \"Invalid value\"}}"), NULL);
+	LIS_ASSERT_EQUAL(strstr(trace, "\"worker"), NULL);
+	FREE(trace);
+
+	tests_trace_clean();
+}
+
+
+static void tests_trace_dedicated_process(void)
+{
+	enum lis_error err;
+	struct lis_api *process;
+	struct lis_device_descriptor **descs;
+	struct lis_item *item;
+	char *trace;
+
+	LIS_ASSERT_EQUAL(tests_trace_init(), 0);
+
+	err = lis_api_workaround_dedicated_process(g_stats_dumb, &process);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = process->list_devices(process, LIS_DEVICE_LOCATIONS_ANY, &descs);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = process->get_device(process, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	item->close(item);
+
+	// waits for the worker to exit: the worker flushes its events before
+	process->cleanup(process);
+	LIS_ASSERT_EQUAL(lis_trace_flush(), LIS_OK);
+
+	trace = read_trace();
+	LIS_ASSERT_NOT_EQUAL(trace, NULL);
+	LIS_ASSERT_NOT_EQUAL(strstr(trace, "\"args\": {\"name\": \"libinsane\"}}"), NULL);
+	LIS_ASSERT_NOT_EQUAL(strstr(trace, "\"args\": {\"name\": \"libinsane worker\"}}"), NULL);
+	// master side
+	LIS_ASSERT_NOT_EQUAL(strstr(trace, "{\"ph\": \"X\", \"name\": \"dedicated_process: list_devices\", "), NULL);
+	LIS_ASSERT_NOT_EQUAL(strstr(trace, "{\"ph\": \"s\", \"name\": \"get_device\", "), NULL);
+	// worker side
+	LIS_ASSERT_NOT_EQUAL(strstr(trace, "{\"ph\": \"X\", \"name\": \"worker: list_devices\", "), NULL);
+	LIS_ASSERT_NOT_EQUAL(strstr(trace, "{\"ph\": \"f\", \"name\": \"get_device\", "), NULL);
+	LIS_ASSERT_NOT_EQUAL(strstr(trace, "{\"ph\": \"X\", \"name\": \"dumb: get_device\", "), NULL);
+	FREE(trace);
+
+	tests_trace_clean();
+}
+
+
+int register_tests(void)
+{
+	CU_pSuite suite = NULL;
+
+	suite = CU_add_suite("Trace", NULL, NULL);
+	if (suite == NULL) {
+		fprintf(stderr, "CU_add_suite() failed\n");
+		return 0;
+	}
+
+	if (CU_add_test(suite, "tests_trace_calls()", tests_trace_calls) == NULL
+			|| CU_add_test(suite, "tests_trace_dedicated_process()",
+				tests_trace_dedicated_process) == NULL
+			) {
+		fprintf(stderr, "CU_add_test() has failed\n");
+		return 0;
+	}
+
+	return 1;
+}
@@ -1,3 +1,6 @@
+#include <stdlib.h>
+#include <unistd.h>
+
 #include <CUnit/Basic.h>
 
 #include <libinsane/capi.h>
@@ -332,6 +335,119 @@ static void test_cache_double_get_device(void)
 }
 
 
+static int count_devices(void)
+{
+	struct lis_device_descriptor **devs = NULL;
+	enum lis_error err;
+	int nb_devs;
+
+	err = g_opts->list_devices(g_opts, LIS_DEVICE_LOCATIONS_ANY, &devs);
+	if (LIS_IS_ERROR(err)) {
+		return -1;
+	}
+	for (nb_devs = 0 ; devs[nb_devs] != NULL ; nb_devs++) { }
+	return nb_devs;
+}
+
+
+static int wait_for_devices(int expected)
+{
+	int i, nb_devs = -1;
+
+	for (i = 0 ; i < 5000 ; i++) {
+		nb_devs = count_devices();
+		if (nb_devs == expected) {
+			break;
+		}
+		usleep(1000);
+	}
+	return nb_devs;
+}
+
+
+static void test_cache_list_devices(void)
+{
+	struct lis_device_descriptor **devs = NULL;
+	enum lis_error err = LIS_OK;
+	int i;
+
+	setenv("LIBINSANE_WORKAROUND_CACHE_DEVICES_TTL_MS", "3600000", 1);
+	LIS_ASSERT_EQUAL(tests_cache_init(), 0);
+	unsetenv("LIBINSANE_WORKAROUND_CACHE_DEVICES_TTL_MS");
+
+	LIS_ASSERT_EQUAL(count_devices(), 2);
+
+	// answered from memory
+	lis_dumb_set_nb_devices(g_dumb, 3);
+	LIS_ASSERT_EQUAL(count_devices(), 2);
+
+	lis_workaround_cache_invalidate_devices();
+	LIS_ASSERT_EQUAL(count_devices(), 3);
+
+	// stale list is returned until the background refresh is done
+	lis_dumb_set_nb_devices(g_dumb, 1);
+	lis_workaround_cache_hotplug();
+	LIS_ASSERT_EQUAL(wait_for_devices(1), 1);
+	LIS_ASSERT_EQUAL(count_devices(), 1);
+
+	// failed background refresh: the error is reported by the next call
+	lis_dumb_set_list_devices_return(g_dumb, LIS_ERR_IO_ERROR);
+	lis_workaround_cache_hotplug();
+	for (i = 0 ; i < 5000 ; i++) {
+		err = g_opts->list_devices(g_opts, LIS_DEVICE_LOCATIONS_ANY, &devs);
+		if (LIS_IS_ERROR(err)) {
+			break;
+		}
+		usleep(1000);
+	}
+	LIS_ASSERT_EQUAL(err, LIS_ERR_IO_ERROR);
+
+	LIS_ASSERT_EQUAL(tests_cache_cleanup(), 0);
+}
+
+
+static void test_cache_list_devices_ttl(void)
+{
+	setenv("LIBINSANE_WORKAROUND_CACHE_DEVICES_TTL_MS", "1", 1);
+	LIS_ASSERT_EQUAL(tests_cache_init(), 0);
+	unsetenv("LIBINSANE_WORKAROUND_CACHE_DEVICES_TTL_MS");
+
+	LIS_ASSERT_EQUAL(count_devices(), 2);
+
+	lis_dumb_set_nb_devices(g_dumb, 3);
+	usleep(5000);
+	LIS_ASSERT_EQUAL(wait_for_devices(3), 3);
+
+	LIS_ASSERT_EQUAL(tests_cache_cleanup(), 0);
+}
+
+
+static void test_cache_list_devices_no_background(void)
+{
+	setenv("LIBINSANE_WORKAROUND_CACHE_DEVICES_TTL_MS", "3600000", 1);
+	setenv("LIBINSANE_WORKAROUND_CACHE_BACKGROUND_REFRESH", "0", 1);
+	LIS_ASSERT_EQUAL(tests_cache_init(), 0);
+	unsetenv("LIBINSANE_WORKAROUND_CACHE_DEVICES_TTL_MS");
+	unsetenv("LIBINSANE_WORKAROUND_CACHE_BACKGROUND_REFRESH");
+
+	LIS_ASSERT_EQUAL(count_devices(), 2);
+
+	lis_dumb_set_nb_devices(g_dumb, 3);
+	LIS_ASSERT_EQUAL(count_devices(), 2);
+
+	// refreshed right away by the next call, from the calling thread
+	lis_workaround_cache_hotplug();
+	LIS_ASSERT_EQUAL(count_devices(), 3);
+
+	lis_dumb_set_list_devices_return(g_dumb, LIS_ERR_IO_ERROR);
+	LIS_ASSERT_EQUAL(count_devices(), 3);
+	lis_workaround_cache_hotplug();
+	LIS_ASSERT_EQUAL(count_devices(), -1);
+
+	LIS_ASSERT_EQUAL(tests_cache_cleanup(), 0);
+}
+
+
 int register_tests(void)
 {
 	CU_pSuite suite = NULL;
@@ -346,7 +462,11 @@ int register_tests(void)
 			|| CU_add_test(suite, "get_value", test_cache_get_value) == NULL
 			|| CU_add_test(suite, "set_value", test_cache_set_value) == NULL
 			|| CU_add_test(suite, "set_value_2", test_cache_set_value_2) == NULL
-			|| CU_add_test(suite, "double_get_device", test_cache_double_get_device) == NULL) {
+			|| CU_add_test(suite, "double_get_device", test_cache_double_get_device) == NULL
+			|| CU_add_test(suite, "list_devices", test_cache_list_devices) == NULL
+			|| CU_add_test(suite, "list_devices_ttl", test_cache_list_devices_ttl) == NULL
+			|| CU_add_test(suite, "list_devices_no_background",
+				test_cache_list_devices_no_background) == NULL) {
 		fprintf(stderr, "CU_add_test() has failed\n");
 		return 0;
 	}
@@ -1,6 +1,10 @@
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <CUnit/Basic.h>
 
@@ -20,6 +24,7 @@ static struct lis_api *g_dumb = NULL;
 static struct lis_api *g_sn = NULL;
 static struct lis_api *g_opts = NULL;
 static struct lis_api *g_process = NULL;
+static int g_xres_set_flags = LIS_SET_FLAG_MUST_RELOAD_PARAMS;
 
 
 static int tests_process_init(void)
@@ -79,8 +84,7 @@ static int tests_process_init(void)
 
 	lis_dumb_set_nb_devices(g_dumb, 2);
 	lis_dumb_add_option(
-		g_dumb, &opt_xres, &opt_xres_default,
-		LIS_SET_FLAG_MUST_RELOAD_PARAMS
+		g_dumb, &opt_xres, &opt_xres_default, g_xres_set_flags
 	);
 	lis_dumb_add_option(
 		g_dumb, &opt_source_template, &opt_source_default,
@@ -203,6 +207,146 @@ static void tests_dedicated_process_opts(void)
 }
 
 
+static void check_set_options(struct lis_item *item)
+{
+	static const struct lis_option_setting settings[] = {
+		{ .name = "xres", .value = "150" },
+		{ .name = OPT_NAME_SOURCE, .value = OPT_VALUE_SOURCE_ADF },
+	};
+	static const struct lis_option_setting unknown[] = {
+		{ .name = "xres", .value = "200" },
+		{ .name = "does_not_exist", .value = "1" },
+	};
+	static const struct lis_option_setting invalid[] = {
+		{ .name = "XRES", .value = "abc" },
+	};
+	enum lis_error err;
+	struct lis_option_descriptor **opts = NULL;
+	union lis_value value;
+	int set_flags = 0;
+
+	err = lis_set_options(item, settings, LIS_COUNT_OF(settings), &set_flags);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(set_flags, LIS_SET_FLAG_MUST_RELOAD_PARAMS);
+
+	err = item->get_options(item, &opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(strcmp(opts[0]->name, "xres"), 0);
+	LIS_ASSERT_EQUAL(strcmp(opts[1]->name, OPT_NAME_SOURCE), 0);
+
+	err = opts[0]->fn.get_value(opts[0], &value);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(value.integer, 150);
+	err = opts[1]->fn.get_value(opts[1], &value);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(strcmp(value.string, OPT_VALUE_SOURCE_ADF), 0);
+
+	// nothing is set if one of the options doesn't exist
+	err = lis_set_options(item, unknown, LIS_COUNT_OF(unknown), NULL);
+	LIS_ASSERT_EQUAL(err, LIS_ERR_INVALID_VALUE);
+	err = lis_set_options(item, invalid, LIS_COUNT_OF(invalid), NULL);
+	LIS_ASSERT_EQUAL(err, LIS_ERR_INVALID_VALUE);
+
+	err = item->get_options(item, &opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = opts[0]->fn.get_value(opts[0], &value);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(value.integer, 150);
+
+	// the value cache must not hide changes made option by option
+	value.integer = 250;
+	err = opts[0]->fn.set_value(opts[0], value, &set_flags);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = opts[0]->fn.get_value(opts[0], &value);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(value.integer, 250);
+}
+
+
+static void tests_dedicated_process_set_options(void)
+{
+	enum lis_error err;
+	struct lis_item *item;
+
+	LIS_ASSERT_EQUAL(tests_process_init(), 0);
+
+	// without dedicated process: options are set one by one
+	err = g_opts->get_device(g_opts, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	check_set_options(item);
+	item->close(item);
+
+	err = lis_api_workaround_dedicated_process(g_opts, &g_process);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = g_process->get_device(g_process, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_NOT_EQUAL(item->set_values, NULL);
+	check_set_options(item);
+	item->close(item);
+
+	LIS_ASSERT_EQUAL(tests_process_clean(), 0);
+}
+
+
+/**
+ * Setting xres requires reloading the options: the other ones must be set
+ * using the reloaded option list.
+ */
+static void tests_dedicated_process_set_options_reload(void)
+{
+	static const struct lis_option_setting settings[] = {
+		{ .name = "xres", .value = "150" },
+		{ .name = OPT_NAME_SOURCE, .value = OPT_VALUE_SOURCE_ADF },
+	};
+	struct lis_option_descriptor **opts = NULL;
+	struct lis_item *item;
+	union lis_value value;
+	int set_flags, i;
+	enum lis_error err;
+
+	g_xres_set_flags = (
+		LIS_SET_FLAG_MUST_RELOAD_PARAMS
+		| LIS_SET_FLAG_MUST_RELOAD_OPTIONS
+	);
+	LIS_ASSERT_EQUAL(tests_process_init(), 0);
+	g_xres_set_flags = LIS_SET_FLAG_MUST_RELOAD_PARAMS;
+
+	// without dedicated process (set_value()), and with (set_values())
+	for (i = 0 ; i < 2 ; i++) {
+		if (i == 0) {
+			err = g_opts->get_device(g_opts, LIS_DUMB_DEV_ID_FIRST, &item);
+		} else {
+			err = lis_api_workaround_dedicated_process(g_opts, &g_process);
+			LIS_ASSERT_EQUAL(err, LIS_OK);
+			err = g_process->get_device(g_process, LIS_DUMB_DEV_ID_FIRST, &item);
+		}
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+
+		err = lis_set_options(item, settings, LIS_COUNT_OF(settings), &set_flags);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+		LIS_ASSERT_EQUAL(
+			set_flags,
+			LIS_SET_FLAG_MUST_RELOAD_PARAMS
+			| LIS_SET_FLAG_MUST_RELOAD_OPTIONS
+		);
+
+		err = item->get_options(item, &opts);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+		err = opts[0]->fn.get_value(opts[0], &value);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+		LIS_ASSERT_EQUAL(value.integer, 150);
+		err = opts[1]->fn.get_value(opts[1], &value);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+		LIS_ASSERT_EQUAL(strcmp(value.string, OPT_VALUE_SOURCE_ADF), 0);
+
+		item->close(item);
+	}
+
+	LIS_ASSERT_EQUAL(tests_process_clean(), 0);
+}
+
+
 static void tests_dedicated_process_scan(void)
 {
 	static const struct lis_scan_parameters base_scan_params = {
@@ -293,6 +437,480 @@ static void tests_dedicated_process_scan(void)
 }
 
 
+static void tests_dedicated_process_scan_big(void)
+{
+	// big enough to not fit in a single read ahead chunk
+	static const int width = 1000, height = 300;
+	struct lis_scan_parameters base_scan_params = {
+		.format = LIS_IMG_FORMAT_RAW_RGB_24,
+		.width = width,
+		.height = height,
+		.image_size = width * height * 3,
+	};
+	struct lis_dumb_read reads[3];
+	enum lis_error err;
+	struct lis_item **children;
+	struct lis_item *item;
+	struct lis_scan_session *session;
+	size_t page_size = width * height * 3;
+	size_t bufsize, r;
+	uint8_t *page, *buffer;
+	size_t i;
+
+	page = malloc(page_size);
+	buffer = malloc(page_size);
+	for (i = 0 ; i < page_size ; i++) {
+		page[i] = (i * 7) & 0xFF;
+	}
+	// image is returned in 3 reads of different sizes
+	reads[0].content = page;
+	reads[0].nb_bytes = 1;
+	reads[1].content = page + 1;
+	reads[1].nb_bytes = page_size / 2;
+	reads[2].content = page + 1 + (page_size / 2);
+	reads[2].nb_bytes = page_size - 1 - (page_size / 2);
+
+	LIS_ASSERT_EQUAL(tests_process_init(), 0);
+	lis_dumb_set_scan_parameters(g_dumb, &base_scan_params);
+	lis_dumb_set_scan_result(g_dumb, reads, LIS_COUNT_OF(reads));
+
+	err = lis_api_workaround_dedicated_process(g_opts, &g_process);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	item = NULL;
+	err = g_process->get_device(g_process, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = item->get_children(item, &children);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = children[0]->scan_start(children[0], &session);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	LIS_ASSERT_FALSE(session->end_of_feed(session));
+
+	bufsize = 0;
+	while (!session->end_of_page(session)) {
+		// small reads of variable sizes
+		r = MIN(page_size - bufsize, 1 + (bufsize % 5000));
+		LIS_ASSERT_TRUE(r > 0);
+		err = session->scan_read(session, buffer + bufsize, &r);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+		bufsize += r;
+	}
+	LIS_ASSERT_EQUAL(bufsize, page_size);
+	LIS_ASSERT_EQUAL(memcmp(buffer, page, page_size), 0);
+
+	LIS_ASSERT_TRUE(session->end_of_feed(session));
+	session->cancel(session);
+
+	item->close(item);
+
+	LIS_ASSERT_EQUAL(tests_process_clean(), 0);
+
+	free(page);
+	free(buffer);
+}
+
+
+struct opts_thread_args
+{
+	struct lis_item *item;
+	int nb_errors;
+	int nb_reads;
+};
+
+
+static void *opts_thread(void *_args)
+{
+	struct opts_thread_args *args = _args;
+	struct lis_option_descriptor **opts;
+	union lis_value value;
+	enum lis_error err;
+	int i, j;
+
+	// the dumb API only simulates one scanner: the options cannot be
+	// changed while another device is scanning. We only read them.
+	for (i = 0 ; i < 100 ; i++) {
+		err = args->item->get_options(args->item, &opts);
+		if (LIS_IS_ERROR(err)) {
+			args->nb_errors++;
+			continue;
+		}
+		for (j = 0 ; opts[j] != NULL ; j++) {
+			if (strcmp(opts[j]->name, "xres") != 0) {
+				continue;
+			}
+			err = opts[j]->fn.get_value(opts[j], &value);
+			if (LIS_IS_ERROR(err) || value.integer != 120) {
+				args->nb_errors++;
+			}
+			args->nb_reads++;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*!
+ * Scans a page on a device while another thread keeps calling the options of
+ * another device.
+ */
+static void dedicated_process_concurrent_devices(void)
+{
+	static const int width = 1000, height = 300;
+	struct lis_scan_parameters base_scan_params = {
+		.format = LIS_IMG_FORMAT_RAW_RGB_24,
+		.width = width,
+		.height = height,
+		.image_size = width * height * 3,
+	};
+	struct lis_dumb_read reads[1];
+	struct opts_thread_args args = { 0 };
+	pthread_t thread;
+	enum lis_error err;
+	struct lis_item **children;
+	struct lis_item *items[2];
+	struct lis_scan_session *session;
+	size_t page_size = width * height * 3;
+	size_t bufsize, r;
+	uint8_t *page, *buffer;
+	size_t i;
+
+	page = malloc(page_size);
+	buffer = malloc(page_size);
+	for (i = 0 ; i < page_size ; i++) {
+		page[i] = (i * 13) & 0xFF;
+	}
+	reads[0].content = page;
+	reads[0].nb_bytes = page_size;
+
+	LIS_ASSERT_EQUAL(tests_process_init(), 0);
+	lis_dumb_set_scan_parameters(g_dumb, &base_scan_params);
+	lis_dumb_set_scan_result(g_dumb, reads, LIS_COUNT_OF(reads));
+
+	err = lis_api_workaround_dedicated_process(g_opts, &g_process);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = g_process->get_device(g_process, LIS_DUMB_DEV_ID_FIRST, &items[0]);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = g_process->get_device(g_process, "dumb dev1", &items[1]);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	args.item = items[1];
+	LIS_ASSERT_EQUAL(pthread_create(&thread, NULL, opts_thread, &args), 0);
+
+	err = items[0]->get_children(items[0], &children);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = children[0]->scan_start(children[0], &session);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	bufsize = 0;
+	while (!session->end_of_page(session)) {
+		r = MIN(page_size - bufsize, 4096);
+		LIS_ASSERT_TRUE(r > 0);
+		err = session->scan_read(session, buffer + bufsize, &r);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+		bufsize += r;
+	}
+	LIS_ASSERT_EQUAL(bufsize, page_size);
+	LIS_ASSERT_EQUAL(memcmp(buffer, page, page_size), 0);
+	session->cancel(session);
+
+	LIS_ASSERT_EQUAL(pthread_join(thread, NULL), 0);
+	LIS_ASSERT_EQUAL(args.nb_errors, 0);
+	LIS_ASSERT_EQUAL(args.nb_reads, 100);
+
+	items[0]->close(items[0]);
+	items[1]->close(items[1]);
+
+	LIS_ASSERT_EQUAL(tests_process_clean(), 0);
+
+	free(page);
+	free(buffer);
+}
+
+
+static void tests_dedicated_process_concurrent_threads(void)
+{
+	unsetenv("LIBINSANE_WORKAROUND_DEDICATED_PROCESS_PER_DEVICE");
+	dedicated_process_concurrent_devices();
+}
+
+
+static void tests_dedicated_process_concurrent_processes(void)
+{
+	setenv("LIBINSANE_WORKAROUND_DEDICATED_PROCESS_PER_DEVICE", "1", 1);
+	dedicated_process_concurrent_devices();
+	unsetenv("LIBINSANE_WORKAROUND_DEDICATED_PROCESS_PER_DEVICE");
+}
+
+
+/* API taking its time to list the devices */
+#define SLOW_LIST_DEVICES_MS 1000
+
+struct slow_api {
+	struct lis_api parent;
+	struct lis_api *wrapped;
+};
+
+
+static void slow_cleanup(struct lis_api *self)
+{
+	struct slow_api *private = (struct slow_api *)self;
+	private->wrapped->cleanup(private->wrapped);
+	free(private);
+}
+
+
+static enum lis_error slow_list_devices(
+		struct lis_api *self, enum lis_device_locations locs,
+		struct lis_device_descriptor ***dev_infos
+	)
+{
+	struct slow_api *private = (struct slow_api *)self;
+	struct timespec ts = {
+		.tv_sec = SLOW_LIST_DEVICES_MS / 1000,
+		.tv_nsec = (SLOW_LIST_DEVICES_MS % 1000) * 1000000L,
+	};
+
+	while (nanosleep(&ts, &ts) != 0) { }
+	return private->wrapped->list_devices(private->wrapped, locs, dev_infos);
+}
+
+
+static enum lis_error slow_get_device(
+		struct lis_api *self, const char *dev_id, struct lis_item **item
+	)
+{
+	struct slow_api *private = (struct slow_api *)self;
+	return private->wrapped->get_device(private->wrapped, dev_id, item);
+}
+
+
+static struct lis_api *slow_api(struct lis_api *wrapped)
+{
+	struct slow_api *api = calloc(1, sizeof(struct slow_api));
+	api->parent.base_name = wrapped->base_name;
+	api->parent.cleanup = slow_cleanup;
+	api->parent.list_devices = slow_list_devices;
+	api->parent.get_device = slow_get_device;
+	api->wrapped = wrapped;
+	return &api->parent;
+}
+
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000.0) + (ts.tv_nsec / 1e6);
+}
+
+
+struct list_thread_args {
+	struct lis_api *api;
+	enum lis_error err;
+	double end;
+};
+
+
+static void *list_thread(void *_args)
+{
+	struct list_thread_args *args = _args;
+	struct lis_device_descriptor **descs;
+
+	args->err = args->api->list_devices(
+		args->api, LIS_DEVICE_LOCATIONS_ANY, &descs
+	);
+	args->end = now_ms();
+	return NULL;
+}
+
+
+/*!
+ * A slow list_devices() must not delay the calls on the devices already
+ * opened.
+ */
+static void tests_dedicated_process_slow_list_devices(void)
+{
+	static const struct lis_scan_parameters scan_params = {
+		.format = LIS_IMG_FORMAT_RAW_RGB_24,
+		.width = 4,
+		.height = 2,
+		.image_size = 4 * 2 * 3,
+	};
+	static const uint8_t body[4 * 2 * 3] = { 0 };
+	static const struct lis_dumb_read reads[] = {
+		{ .content = body, .nb_bytes = LIS_COUNT_OF(body) },
+	};
+	struct list_thread_args args = { 0 };
+	struct lis_option_descriptor **opts;
+	struct lis_item *item;
+	struct lis_scan_session *session;
+	pthread_t thread;
+	union lis_value value;
+	uint8_t buffer[4 * 2 * 3];
+	size_t r;
+	double start, end;
+	int set_flags;
+	enum lis_error err;
+
+	LIS_ASSERT_EQUAL(tests_process_init(), 0);
+	lis_dumb_set_scan_parameters(g_dumb, &scan_params);
+	lis_dumb_set_scan_result(g_dumb, reads, LIS_COUNT_OF(reads));
+
+	err = lis_api_workaround_dedicated_process(slow_api(g_opts), &g_process);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = g_process->get_device(g_process, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = item->get_options(item, &opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	start = now_ms();
+	args.api = g_process;
+	LIS_ASSERT_EQUAL(pthread_create(&thread, NULL, list_thread, &args), 0);
+	// let list_devices() reach the worker
+	usleep(100 * 1000);
+
+	value.integer = 150;
+	err = opts[0]->fn.set_value(opts[0], value, &set_flags);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = opts[0]->fn.get_value(opts[0], &value);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(value.integer, 150);
+
+	err = item->scan_start(item, &session);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	r = sizeof(buffer);
+	err = session->scan_read(session, buffer, &r);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_TRUE(r > 0);
+	session->cancel(session);
+	end = now_ms();
+
+	LIS_ASSERT_EQUAL(pthread_join(thread, NULL), 0);
+	LIS_ASSERT_EQUAL(args.err, LIS_OK);
+	LIS_ASSERT_TRUE(args.end - start >= SLOW_LIST_DEVICES_MS);
+	// done while list_devices() was still running
+	LIS_ASSERT_TRUE(end < args.end);
+	LIS_ASSERT_TRUE(end - start < SLOW_LIST_DEVICES_MS / 2);
+
+	item->close(item);
+	LIS_ASSERT_EQUAL(tests_process_clean(), 0);
+}
+
+
+/* API whose devices are listed in a file: the worker gets a copy of
+ * everything else */
+static char g_devs_path[] = "/tmp/tests_dedicated_process.XXXXXX";
+
+static struct lis_device_descriptor g_file_devs[] = {
+	{ .dev_id = "file dev0", .vendor = "File", .model = "dev0", },
+	{ .dev_id = "file dev1", .vendor = "File", .model = "dev1", },
+	{ .dev_id = "file dev2", .vendor = "File", .model = "dev2", },
+};
+static struct lis_device_descriptor *g_file_dev_ptrs[LIS_COUNT_OF(g_file_devs) + 1];
+
+
+static void file_cleanup(struct lis_api *self)
+{
+	LIS_UNUSED(self);
+}
+
+
+static enum lis_error file_list_devices(
+		struct lis_api *self, enum lis_device_locations locs,
+		struct lis_device_descriptor ***dev_infos
+	)
+{
+	FILE *fp;
+	int nb_devs = 0, i;
+
+	LIS_UNUSED(self);
+	LIS_UNUSED(locs);
+
+	fp = fopen(g_devs_path, "r");
+	if (fp == NULL) {
+		return LIS_ERR_IO_ERROR;
+	}
+	if (fscanf(fp, "%d", &nb_devs) != 1) {
+		nb_devs = 0;
+	}
+	fclose(fp);
+
+	for (i = 0 ; i < nb_devs && i < (int)LIS_COUNT_OF(g_file_devs) ; i++) {
+		g_file_dev_ptrs[i] = &g_file_devs[i];
+	}
+	g_file_dev_ptrs[i] = NULL;
+	*dev_infos = g_file_dev_ptrs;
+	return LIS_OK;
+}
+
+
+static struct lis_api g_file_api = {
+	.base_name = "file",
+	.cleanup = file_cleanup,
+	.list_devices = file_list_devices,
+};
+
+
+static void set_nb_file_devs(int nb_devs)
+{
+	FILE *fp;
+
+	fp = fopen(g_devs_path, "w");
+	LIS_ASSERT_NOT_EQUAL(fp, NULL);
+	fprintf(fp, "%d", nb_devs);
+	fclose(fp);
+}
+
+
+static void tests_dedicated_process_cache_invalidate(void)
+{
+	struct lis_api *cache, *process;
+	struct lis_device_descriptor **descs;
+	enum lis_error err;
+	int fd;
+
+	strcpy(g_devs_path, "/tmp/tests_dedicated_process.XXXXXX");
+	fd = mkstemp(g_devs_path);
+	LIS_ASSERT_TRUE(fd >= 0);
+	close(fd);
+	set_nb_file_devs(1);
+
+	setenv("LIBINSANE_WORKAROUND_CACHE_DEVICES_TTL_MS", "600000", 1);
+	err = lis_api_workaround_cache(&g_file_api, &cache);
+	unsetenv("LIBINSANE_WORKAROUND_CACHE_DEVICES_TTL_MS");
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = lis_api_workaround_dedicated_process(cache, &process);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = process->list_devices(process, LIS_DEVICE_LOCATIONS_ANY, &descs);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_NOT_EQUAL(descs[0], NULL);
+	LIS_ASSERT_EQUAL(descs[1], NULL);
+
+	// cached in the worker
+	set_nb_file_devs(2);
+	err = process->list_devices(process, LIS_DEVICE_LOCATIONS_ANY, &descs);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(descs[1], NULL);
+
+	// must reach the cache in the worker
+	lis_workaround_cache_invalidate_devices();
+	err = process->list_devices(process, LIS_DEVICE_LOCATIONS_ANY, &descs);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_NOT_EQUAL(descs[1], NULL);
+	LIS_ASSERT_EQUAL(descs[2], NULL);
+
+	process->cleanup(process);
+	unlink(g_devs_path);
+}
+
+
 int register_tests(void)
 {
 	CU_pSuite suite = NULL;
@@ -304,7 +922,21 @@ int register_tests(void)
 	}
 
 	if (CU_add_test(suite, "tests_dedicated_process_scan()", tests_dedicated_process_scan) == NULL
-		|| CU_add_test(suite, "tests_dedicated_process_opts()", tests_dedicated_process_opts) == NULL) {
+		|| CU_add_test(suite, "tests_dedicated_process_opts()", tests_dedicated_process_opts) == NULL
+		|| CU_add_test(suite, "tests_dedicated_process_set_options()",
+			tests_dedicated_process_set_options) == NULL
+		|| CU_add_test(suite, "tests_dedicated_process_set_options_reload()",
+			tests_dedicated_process_set_options_reload) == NULL
+		|| CU_add_test(suite, "tests_dedicated_process_scan_big()",
+			tests_dedicated_process_scan_big) == NULL
+		|| CU_add_test(suite, "tests_dedicated_process_concurrent_threads()",
+			tests_dedicated_process_concurrent_threads) == NULL
+		|| CU_add_test(suite, "tests_dedicated_process_concurrent_processes()",
+			tests_dedicated_process_concurrent_processes) == NULL
+		|| CU_add_test(suite, "tests_dedicated_process_slow_list_devices()",
+			tests_dedicated_process_slow_list_devices) == NULL
+		|| CU_add_test(suite, "tests_dedicated_process_cache_invalidate()",
+			tests_dedicated_process_cache_invalidate) == NULL) {
 		fprintf(stderr, "CU_add_test() has failed\n");
 		return 0;
 	}
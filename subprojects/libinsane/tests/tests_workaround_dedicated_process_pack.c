@@ -1,13 +1,18 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <CUnit/Basic.h>
 
+#include <libinsane/util.h>
+
 #include "main.h"
 #include "util.h"
 
+#include "../src/workarounds/dedicated_process/messages.h"
 #include "../src/workarounds/dedicated_process/pack.h"
+#include "../src/workarounds/dedicated_process/protocol.h"
 
 
 static void tests_serialize_integers(void)
@@ -143,6 +148,226 @@ static void tests_strings_null(void)
 }
 
 
+static void pack_options(
+		struct lis_pack_buf *buf, const struct lis_option_descriptor *opt
+	)
+{
+	struct lis_msg_int nb_opts = { .value = 1 };
+	struct lis_msg_option desc = {
+		.remote = (intptr_t)opt,
+		.name = opt->name,
+		.title = opt->title,
+		.desc = opt->desc,
+		.capabilities = opt->capabilities,
+		.value_type = opt->value.type,
+		.unit = opt->value.unit,
+		.constraint_type = opt->constraint.type,
+	};
+
+	lis_msg_int_pack(buf, &nb_opts);
+	lis_msg_option_pack(buf, &desc);
+	lis_msg_constraint_pack(buf, opt);
+}
+
+
+static void tests_messages(void)
+{
+	union lis_value values[] = {
+		{ .integer = 75 }, { .integer = 150 }, { .integer = 300 },
+	};
+	struct lis_option_descriptor opt = {
+		.name = "resolution",
+		.title = NULL,
+		.desc = "Scan resolution",
+		.capabilities = LIS_CAP_SW_SELECT,
+		.value = { .type = LIS_TYPE_INTEGER, .unit = LIS_UNIT_DPI },
+		.constraint = {
+			.type = LIS_CONSTRAINT_LIST,
+			.possible.list = {
+				.nb_values = LIS_COUNT_OF(values),
+				.values = values,
+			},
+		},
+	};
+	struct lis_pack_buf buf = { 0 };
+	struct lis_unpack_buf in;
+	struct lis_msg_int nb_opts;
+	struct lis_msg_option desc;
+	union lis_value value;
+	int i;
+
+	pack_options(&buf, &opt);
+	LIS_ASSERT_FALSE(buf.oom);
+
+	lis_unpack_buf_init(&in, buf.data, buf.size);
+	lis_msg_int_unpack(&in, &nb_opts);
+	LIS_ASSERT_EQUAL(nb_opts.value, 1);
+	lis_msg_option_unpack(&in, &desc);
+	LIS_ASSERT_EQUAL(desc.remote, (intptr_t)&opt);
+	LIS_ASSERT_EQUAL(strcmp(desc.name, "resolution"), 0);
+	LIS_ASSERT_EQUAL(desc.title[0], '\0');
+	LIS_ASSERT_EQUAL(strcmp(desc.desc, "Scan resolution"), 0);
+	LIS_ASSERT_EQUAL(desc.capabilities, LIS_CAP_SW_SELECT);
+	LIS_ASSERT_EQUAL(desc.value_type, LIS_TYPE_INTEGER);
+	LIS_ASSERT_EQUAL(desc.unit, LIS_UNIT_DPI);
+	LIS_ASSERT_EQUAL(desc.constraint_type, LIS_CONSTRAINT_LIST);
+	LIS_ASSERT_EQUAL(lis_unpack_int(&in), 3);
+	for (i = 0 ; i < 3 ; i++) {
+		value = lis_unpack_value(&in, LIS_TYPE_INTEGER);
+		LIS_ASSERT_EQUAL(value.integer, values[i].integer);
+	}
+	LIS_ASSERT_FALSE(in.error);
+	LIS_ASSERT_EQUAL((const void *)in.ptr, (const void *)(buf.data + buf.size));
+
+	lis_pack_buf_free(&buf);
+}
+
+
+static void tests_truncated(void)
+{
+	struct lis_pack_buf buf = { 0 };
+	struct lis_unpack_buf in;
+	struct lis_msg_device device = {
+		.name = "somedevice",
+		.type = LIS_ITEM_DEVICE,
+		.remote = 0x1234,
+		.ring_idx = 2,
+	};
+	struct lis_msg_device out;
+
+	lis_msg_device_pack(&buf, &device);
+	LIS_ASSERT_FALSE(buf.oom);
+
+	lis_unpack_buf_init(&in, buf.data, buf.size);
+	lis_msg_device_unpack(&in, &out);
+	LIS_ASSERT_FALSE(in.error);
+	LIS_ASSERT_EQUAL(strcmp(out.name, "somedevice"), 0);
+	LIS_ASSERT_EQUAL(out.type, LIS_ITEM_DEVICE);
+	LIS_ASSERT_EQUAL(out.remote, 0x1234);
+	LIS_ASSERT_EQUAL(out.ring_idx, 2);
+
+	// decoders must never read past the end of the content
+	lis_unpack_buf_init(&in, buf.data, buf.size - 1);
+	lis_msg_device_unpack(&in, &out);
+	LIS_ASSERT_TRUE(in.error);
+	LIS_ASSERT_EQUAL(out.ring_idx, 0);
+
+	lis_unpack_buf_init(&in, buf.data, 4); // in the middle of the name
+	lis_msg_device_unpack(&in, &out);
+	LIS_ASSERT_TRUE(in.error);
+	LIS_ASSERT_EQUAL(out.name[0], '\0');
+
+	lis_pack_buf_free(&buf);
+}
+
+
+static void tests_no_alloc(void)
+{
+	struct lis_option_descriptor opt = {
+		.name = "mode",
+		.title = "Scan mode",
+		.desc = "Color or gray",
+		.value = { .type = LIS_TYPE_STRING },
+		.constraint = { .type = LIS_CONSTRAINT_NONE },
+	};
+	struct lis_msg_scan_read scan_read = { .session = 0x42, .buffer_size = 4096 };
+	struct lis_msg_scan_read scan_read_out;
+	struct lis_pack_buf buf = { 0 };
+	struct lis_unpack_buf in;
+	unsigned int nb_allocs;
+	int i;
+
+	// warm up: the buffer grows to the size of the biggest message
+	pack_options(&buf, &opt);
+	LIS_ASSERT_FALSE(buf.oom);
+	nb_allocs = buf.nb_allocs;
+	LIS_ASSERT_TRUE(nb_allocs > 0);
+
+	for (i = 0 ; i < 1000 ; i++) {
+		lis_pack_buf_reset(&buf);
+		if (i % 2) {
+			pack_options(&buf, &opt);
+			continue;
+		}
+		lis_msg_scan_read_pack(&buf, &scan_read);
+		lis_unpack_buf_init(&in, buf.data, buf.size);
+		lis_msg_scan_read_unpack(&in, &scan_read_out);
+		LIS_ASSERT_FALSE(in.error);
+		LIS_ASSERT_EQUAL(scan_read_out.session, 0x42);
+		LIS_ASSERT_EQUAL(scan_read_out.buffer_size, 4096);
+	}
+	LIS_ASSERT_FALSE(buf.oom);
+	LIS_ASSERT_EQUAL(buf.nb_allocs, nb_allocs);
+
+	lis_pack_buf_free(&buf);
+}
+
+
+static void tests_protocol(void)
+{
+	int fds[2];
+	struct lis_pack_buf request = { 0 };
+	struct lis_pack_buf content = { 0 };
+	struct lis_msg_remote remote = { .remote = 0x4321 };
+	struct lis_msg msg;
+	struct lis_unpack_buf in;
+	unsigned int nb_allocs = 0;
+	enum lis_error err;
+	int i;
+
+	LIS_ASSERT_EQUAL(pipe(fds), 0);
+
+	lis_msg_remote_pack(&request, &remote);
+
+	for (i = 0 ; i < 100 ; i++) {
+		memset(&msg, 0, sizeof(msg));
+		msg.header.msg_type = LIS_MSG_OPT_GET;
+		msg.header.request_id = i;
+		msg.header.device = 0x1234;
+		msg.raw.iov_base = request.data;
+		msg.raw.iov_len = request.size;
+		err = lis_protocol_msg_write(fds[1], &msg);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+
+		err = lis_protocol_msg_read_header(fds[0], &msg);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+		LIS_ASSERT_EQUAL(msg.header.version, LIS_PROTOCOL_VERSION);
+		LIS_ASSERT_EQUAL(msg.header.msg_type, LIS_MSG_OPT_GET);
+		LIS_ASSERT_EQUAL(msg.header.request_id, (uint32_t)i);
+		LIS_ASSERT_EQUAL(msg.header.device, 0x1234);
+		LIS_ASSERT_EQUAL(msg.header.size, sizeof(intptr_t));
+
+		err = lis_protocol_msg_read_content(fds[0], &msg, &content);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+		lis_unpack_buf_init(&in, msg.raw.iov_base, msg.raw.iov_len);
+		lis_msg_remote_unpack(&in, &remote);
+		LIS_ASSERT_FALSE(in.error);
+		LIS_ASSERT_EQUAL(remote.remote, 0x4321);
+
+		// the content buffer is reused from one message to the next
+		if (i == 0) {
+			nb_allocs = content.nb_allocs;
+		}
+		LIS_ASSERT_EQUAL(content.nb_allocs, nb_allocs);
+	}
+
+	// messages from another version of the protocol are rejected
+	memset(&msg, 0, sizeof(msg));
+	msg.header.version = LIS_PROTOCOL_VERSION + 1;
+	LIS_ASSERT_EQUAL(
+		write(fds[1], &msg.header, sizeof(msg.header)),
+		(ssize_t)sizeof(msg.header)
+	);
+	err = lis_protocol_msg_read_header(fds[0], &msg);
+	LIS_ASSERT_EQUAL(err, LIS_ERR_IO_ERROR);
+
+	close(fds[0]);
+	close(fds[1]);
+	lis_pack_buf_free(&request);
+	lis_pack_buf_free(&content);
+}
+
+
 int register_tests(void)
 {
 	CU_pSuite suite = NULL;
@@ -160,6 +385,10 @@ int register_tests(void)
 			|| CU_add_test(suite, "tests_strings_null()", tests_strings_null) == NULL
 			|| CU_add_test(suite, "tests_serialize_doubles()", tests_serialize_doubles) == NULL
 			|| CU_add_test(suite, "tests_deserialize_doubles()", tests_deserialize_doubles) == NULL
+			|| CU_add_test(suite, "tests_messages()", tests_messages) == NULL
+			|| CU_add_test(suite, "tests_truncated()", tests_truncated) == NULL
+			|| CU_add_test(suite, "tests_no_alloc()", tests_no_alloc) == NULL
+			|| CU_add_test(suite, "tests_protocol()", tests_protocol) == NULL
 			) {
 		fprintf(stderr, "CU_add_test() has failed\n");
 		return 0;
@@ -1,6 +1,10 @@
+#include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <CUnit/Basic.h>
 
@@ -168,6 +172,138 @@ static void tests_dedicated_thread(void)
 }
 
 
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static int g_nb_inside = 0;
+static int g_max_inside = 0;
+static int g_nb_threads = 0;
+static pthread_t g_threads[2];
+
+
+/*!
+ * Waits (up to 2 seconds) for another call to get_value() to be running
+ * at the same time.
+ */
+static enum lis_error get_value_concurrent(
+		struct lis_option_descriptor *self, union lis_value *value
+	)
+{
+	struct timespec deadline;
+
+	LIS_UNUSED(self);
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += 2;
+
+	pthread_mutex_lock(&g_mutex);
+	if (g_nb_threads < (int)LIS_COUNT_OF(g_threads)) {
+		g_threads[g_nb_threads++] = pthread_self();
+	}
+	g_nb_inside++;
+	g_max_inside = MAX(g_max_inside, g_nb_inside);
+	pthread_cond_broadcast(&g_cond);
+	while (g_max_inside < 2) {
+		if (pthread_cond_timedwait(&g_cond, &g_mutex, &deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+	g_nb_inside--;
+	pthread_mutex_unlock(&g_mutex);
+
+	value->integer = 42;
+	return LIS_OK;
+}
+
+
+static void *get_value_thread(void *_opt)
+{
+	struct lis_option_descriptor *opt = _opt;
+	union lis_value value;
+
+	opt->fn.get_value(opt, &value);
+	return NULL;
+}
+
+
+static void tests_dedicated_thread_per_device(void)
+{
+	static const struct lis_option_descriptor opt_template = {
+		.name = "concurrent",
+		.title = "concurrent title",
+		.desc = "concurrent desc",
+		.capabilities = LIS_CAP_SW_SELECT,
+		.value = {
+			.type = LIS_TYPE_INTEGER,
+			.unit = LIS_UNIT_NONE,
+		},
+		.constraint = {
+			.type = LIS_CONSTRAINT_NONE,
+		},
+		.fn = {
+			.get_value = get_value_concurrent,
+		},
+	};
+	static const union lis_value opt_default = { .integer = 0 };
+
+	enum lis_error err;
+	struct lis_item *items[2];
+	struct lis_option_descriptor **opts;
+	struct lis_option_descriptor *concurrent[2];
+	pthread_t threads[2];
+	int i, j;
+
+	LIS_ASSERT_EQUAL(tests_th_init(), 0);
+	lis_dumb_add_option(g_dumb, &opt_template, &opt_default, 0);
+
+	setenv("LIBINSANE_WORKAROUND_DEDICATED_THREAD_PER_DEVICE", "1", 1);
+	err = lis_api_workaround_dedicated_thread(g_sn, &g_th);
+	unsetenv("LIBINSANE_WORKAROUND_DEDICATED_THREAD_PER_DEVICE");
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = g_th->get_device(g_th, "dumb dev0", &items[0]);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = g_th->get_device(g_th, "dumb dev1", &items[1]);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	for (i = 0 ; i < 2 ; i++) {
+		concurrent[i] = NULL;
+		err = items[i]->get_options(items[i], &opts);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+		for (j = 0 ; opts[j] != NULL ; j++) {
+			if (strcmp(opts[j]->name, "concurrent") == 0) {
+				concurrent[i] = opts[j];
+			}
+		}
+		LIS_ASSERT_NOT_EQUAL(concurrent[i], NULL);
+	}
+
+	for (i = 0 ; i < 2 ; i++) {
+		LIS_ASSERT_EQUAL(
+			pthread_create(
+				&threads[i], NULL, get_value_thread, concurrent[i]
+			), 0
+		);
+	}
+	for (i = 0 ; i < 2 ; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	// both calls ran at the same time, each in the thread of its device
+	LIS_ASSERT_EQUAL(g_max_inside, 2);
+	LIS_ASSERT_EQUAL(g_nb_threads, 2);
+	LIS_ASSERT_FALSE(pthread_equal(g_threads[0], g_threads[1]));
+	for (i = 0 ; i < 2 ; i++) {
+		LIS_ASSERT_FALSE(pthread_equal(g_threads[i], threads[0]));
+		LIS_ASSERT_FALSE(pthread_equal(g_threads[i], threads[1]));
+	}
+
+	items[0]->close(items[0]);
+	items[1]->close(items[1]);
+
+	LIS_ASSERT_EQUAL(tests_th_clean(), 0);
+}
+
+
 int register_tests(void)
 {
 	CU_pSuite suite = NULL;
@@ -178,7 +314,9 @@ int register_tests(void)
 		return 0;
 	}
 
-	if (CU_add_test(suite, "tests_dedicated_thread()", tests_dedicated_thread) == NULL) {
+	if (CU_add_test(suite, "tests_dedicated_thread()", tests_dedicated_thread) == NULL
+			|| CU_add_test(suite, "tests_dedicated_thread_per_device()",
+				tests_dedicated_thread_per_device) == NULL) {
 		fprintf(stderr, "CU_add_test() has failed\n");
 		return 0;
 	}
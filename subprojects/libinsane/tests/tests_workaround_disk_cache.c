@@ -0,0 +1,422 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <CUnit/Basic.h>
+
+#include <libinsane/capi.h>
+#include <libinsane/constants.h>
+#include <libinsane/dumb.h>
+#include <libinsane/log.h>
+#include <libinsane/normalizers.h>
+#include <libinsane/util.h>
+#include <libinsane/workarounds.h>
+
+#include "main.h"
+#include "util.h"
+
+
+static char g_dir[] = "/tmp/tests_disk_cache.XXXXXX";
+static char g_path[sizeof(g_dir) + 32];
+
+static struct lis_api *g_dumb = NULL;
+static struct lis_api *g_disk_cache = NULL;
+
+
+static int tests_disk_cache_init(int nb_devices, int max_resolution)
+{
+	static const union lis_value opt_source_constraint[] = {
+		{ .string = OPT_VALUE_SOURCE_FLATBED, },
+		{ .string = OPT_VALUE_SOURCE_ADF, },
+	};
+	static const struct lis_option_descriptor opt_source_template = {
+		.name = OPT_NAME_SOURCE,
+		.title = "source title",
+		.desc = "source desc",
+		.capabilities = LIS_CAP_SW_SELECT,
+		.value = {
+			.type = LIS_TYPE_STRING,
+			.unit = LIS_UNIT_NONE,
+		},
+		.constraint = {
+			.type = LIS_CONSTRAINT_LIST,
+			.possible.list = {
+				.nb_values = LIS_COUNT_OF(opt_source_constraint),
+				.values = (union lis_value*)&opt_source_constraint,
+			},
+		},
+	};
+	static const union lis_value opt_source_default = {
+		.string = OPT_VALUE_SOURCE_FLATBED
+	};
+	struct lis_option_descriptor opt_resolution = {
+		.name = OPT_NAME_RESOLUTION,
+		.title = "resolution title",
+		.desc = "resolution desc",
+		.capabilities = LIS_CAP_SW_SELECT,
+		.value = {
+			.type = LIS_TYPE_INTEGER,
+			.unit = LIS_UNIT_DPI,
+		},
+		.constraint = {
+			.type = LIS_CONSTRAINT_RANGE,
+			.possible.range = {
+				.min.integer = 50,
+				.max.integer = max_resolution,
+				.interval.integer = 50,
+			},
+		},
+	};
+	static const union lis_value opt_resolution_default = {
+		.integer = 150,
+	};
+	struct lis_api *sn;
+	enum lis_error err;
+
+	err = lis_api_dumb(&g_dumb, "dummy0");
+	if (LIS_IS_ERROR(err)) {
+		return -1;
+	}
+
+	lis_dumb_set_nb_devices(g_dumb, nb_devices);
+	lis_dumb_add_option(
+		g_dumb, &opt_source_template, &opt_source_default,
+		LIS_SET_FLAG_MUST_RELOAD_PARAMS
+	);
+	lis_dumb_add_option(
+		g_dumb, &opt_resolution, &opt_resolution_default, 0
+	);
+
+	err = lis_api_normalizer_source_nodes(g_dumb, &sn);
+	if (LIS_IS_ERROR(err)) {
+		g_dumb->cleanup(g_dumb);
+		return -1;
+	}
+
+	err = lis_api_workaround_disk_cache(sn, &g_disk_cache);
+	if (LIS_IS_ERROR(err)) {
+		sn->cleanup(sn);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static int tests_disk_cache_setup(void)
+{
+	strcpy(g_dir, "/tmp/tests_disk_cache.XXXXXX");
+	if (mkdtemp(g_dir) == NULL) {
+		return -1;
+	}
+	snprintf(g_path, sizeof(g_path), "%s/devices.cache", g_dir);
+	setenv("LIBINSANE_WORKAROUND_DISK_CACHE_PATH", g_path, 1);
+	return 0;
+}
+
+
+static void tests_disk_cache_teardown(void)
+{
+	unlink(g_path);
+	rmdir(g_dir);
+	unsetenv("LIBINSANE_WORKAROUND_DISK_CACHE_PATH");
+}
+
+
+static struct lis_option_descriptor *get_option(
+		struct lis_option_descriptor **opts, const char *name
+	)
+{
+	for (; *opts != NULL ; opts++) {
+		if (strcmp((*opts)->name, name) == 0) {
+			return *opts;
+		}
+	}
+	return NULL;
+}
+
+
+/*!
+ * First run: everything goes to the wrapped implementation and is stored.
+ */
+static void fill_cache(int max_resolution)
+{
+	struct lis_device_descriptor **devs = NULL;
+	struct lis_item *device = NULL;
+	struct lis_item **sources = NULL;
+	struct lis_option_descriptor **opts = NULL;
+	enum lis_error err;
+
+	LIS_ASSERT_EQUAL(tests_disk_cache_init(2, max_resolution), 0);
+
+	err = g_disk_cache->list_devices(g_disk_cache, LIS_DEVICE_LOCATIONS_ANY, &devs);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_NOT_EQUAL(devs[0], NULL);
+	LIS_ASSERT_NOT_EQUAL(devs[1], NULL);
+	LIS_ASSERT_EQUAL(devs[2], NULL);
+
+	err = g_disk_cache->get_device(g_disk_cache, LIS_DUMB_DEV_ID_FIRST, &device);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = device->get_children(device, &sources);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = device->get_options(device, &opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	device->close(device);
+	g_disk_cache->cleanup(g_disk_cache);
+
+	LIS_ASSERT_EQUAL(access(g_path, R_OK), 0);
+}
+
+
+static void tests_disk_cache_cold_start(void)
+{
+	struct lis_device_descriptor **devs = NULL;
+	struct lis_item *device = NULL;
+	struct lis_item **sources = NULL;
+	struct lis_option_descriptor **opts = NULL;
+	struct lis_option_descriptor *opt;
+	union lis_value value;
+	enum lis_error err;
+	int i;
+
+	LIS_ASSERT_EQUAL(tests_disk_cache_setup(), 0);
+	fill_cache(300);
+
+	// second run: a device has been plugged in the meantime
+	LIS_ASSERT_EQUAL(tests_disk_cache_init(3, 300), 0);
+	lis_dumb_set_get_device_return(g_dumb, LIS_ERR_IO_ERROR);
+
+	err = g_disk_cache->list_devices(g_disk_cache, LIS_DEVICE_LOCATIONS_ANY, &devs);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(strcmp(devs[0]->dev_id, LIS_DUMB_DEV_ID_FIRST), 0);
+	LIS_ASSERT_NOT_EQUAL(devs[1], NULL);
+	LIS_ASSERT_EQUAL(devs[2], NULL);
+
+	// the revalidated list is returned once the background revalidation
+	// is done
+	for (i = 0 ; i < 5000 ; i++) {
+		err = g_disk_cache->list_devices(
+			g_disk_cache, LIS_DEVICE_LOCATIONS_ANY, &devs
+		);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+		if (devs[2] != NULL) {
+			break;
+		}
+		usleep(1000);
+	}
+	LIS_ASSERT_NOT_EQUAL(devs[2], NULL);
+	LIS_ASSERT_EQUAL(devs[3], NULL);
+
+	// the device is not opened until it's actually required
+	lis_dumb_reset_counters(g_dumb);
+	err = g_disk_cache->get_device(g_disk_cache, LIS_DUMB_DEV_ID_FIRST, &device);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = device->get_children(device, &sources);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_NOT_EQUAL(sources[0], NULL);
+	LIS_ASSERT_NOT_EQUAL(sources[1], NULL);
+	LIS_ASSERT_EQUAL(sources[2], NULL);
+	err = device->get_options(device, &opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(lis_dumb_get_nb_list_options(g_dumb), 0);
+
+	opt = get_option(opts, OPT_NAME_SOURCE);
+	LIS_ASSERT_NOT_EQUAL(opt, NULL);
+	LIS_ASSERT_EQUAL(opt->constraint.type, LIS_CONSTRAINT_LIST);
+	LIS_ASSERT_EQUAL(opt->constraint.possible.list.nb_values, 2);
+	LIS_ASSERT_EQUAL(
+		strcmp(opt->constraint.possible.list.values[1].string, OPT_VALUE_SOURCE_ADF),
+		0
+	);
+	opt = get_option(opts, OPT_NAME_RESOLUTION);
+	LIS_ASSERT_NOT_EQUAL(opt, NULL);
+	LIS_ASSERT_EQUAL(opt->constraint.possible.range.max.integer, 300);
+
+	// opening errors are reported when the device is actually used
+	err = opt->fn.get_value(opt, &value);
+	LIS_ASSERT_EQUAL(err, LIS_ERR_IO_ERROR);
+
+	lis_dumb_set_get_device_return(g_dumb, LIS_OK);
+	err = opt->fn.get_value(opt, &value);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(value.integer, 150);
+	LIS_ASSERT_EQUAL(lis_dumb_get_nb_get(g_dumb), 1);
+
+	device->close(device);
+	g_disk_cache->cleanup(g_disk_cache);
+
+	tests_disk_cache_teardown();
+}
+
+
+static void tests_disk_cache_outdated(void)
+{
+	struct lis_item *device = NULL;
+	struct lis_option_descriptor **opts = NULL;
+	struct lis_option_descriptor *opt;
+	union lis_value value;
+	enum lis_error err;
+	int set_flags;
+
+	LIS_ASSERT_EQUAL(tests_disk_cache_setup(), 0);
+	fill_cache(300);
+
+	// the driver has been updated in the meantime
+	LIS_ASSERT_EQUAL(tests_disk_cache_init(2, 600), 0);
+
+	err = g_disk_cache->get_device(g_disk_cache, LIS_DUMB_DEV_ID_FIRST, &device);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = device->get_options(device, &opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	opt = get_option(opts, OPT_NAME_RESOLUTION);
+	LIS_ASSERT_NOT_EQUAL(opt, NULL);
+	LIS_ASSERT_EQUAL(opt->constraint.possible.range.max.integer, 300);
+
+	value.integer = 200;
+	err = opt->fn.set_value(opt, value, &set_flags);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_TRUE(set_flags & LIS_SET_FLAG_MUST_RELOAD_OPTIONS);
+	// descriptors are updated in place
+	LIS_ASSERT_EQUAL(opt->constraint.possible.range.max.integer, 600);
+
+	err = device->get_options(device, &opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	opt = get_option(opts, OPT_NAME_RESOLUTION);
+	LIS_ASSERT_NOT_EQUAL(opt, NULL);
+	LIS_ASSERT_EQUAL(opt->constraint.possible.range.max.integer, 600);
+	err = opt->fn.get_value(opt, &value);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(value.integer, 200);
+
+	device->close(device);
+	g_disk_cache->cleanup(g_disk_cache);
+
+	// the cache file has been updated
+	LIS_ASSERT_EQUAL(tests_disk_cache_init(2, 600), 0);
+	err = g_disk_cache->get_device(g_disk_cache, LIS_DUMB_DEV_ID_FIRST, &device);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	err = device->get_options(device, &opts);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	opt = get_option(opts, OPT_NAME_RESOLUTION);
+	LIS_ASSERT_NOT_EQUAL(opt, NULL);
+	LIS_ASSERT_EQUAL(opt->constraint.possible.range.max.integer, 600);
+	err = opt->fn.set_value(opt, value, &set_flags);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_FALSE(set_flags & LIS_SET_FLAG_MUST_RELOAD_OPTIONS);
+
+	device->close(device);
+	g_disk_cache->cleanup(g_disk_cache);
+
+	tests_disk_cache_teardown();
+}
+
+
+static uint32_t checksum(const uint8_t *data, size_t size)
+{
+	uint32_t h = 2166136261u; /* FNV-1a */
+	size_t i;
+
+	for (i = 0 ; i < size ; i++) {
+		h ^= data[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+/*!
+ * Changes the number of devices in the cached device list, and updates the
+ * checksum of the file accordingly.
+ */
+static void corrupt_device_list(int nb_devs)
+{
+	FILE *fp;
+	uint8_t *content, *ptr;
+	long size;
+	int header[4], nb_records, record[3], i;
+
+	fp = fopen(g_path, "r+");
+	LIS_ASSERT_NOT_EQUAL(fp, NULL);
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	content = malloc(size);
+	LIS_ASSERT_EQUAL(fread(content, 1, size, fp), (size_t)size);
+
+	ptr = content + sizeof(header);
+	ptr += strlen((char *)ptr) + 1; // base name
+	ptr += strlen((char *)ptr) + 1; // Libinsane version
+	memcpy(&nb_records, ptr, sizeof(nb_records));
+	ptr += sizeof(nb_records);
+	for (i = 0 ; i < nb_records ; i++) {
+		memcpy(record, ptr, sizeof(record));
+		ptr += sizeof(record);
+		if (record[0] == 1 /* DC_RECORD_DEVICES */) {
+			memcpy(ptr, &nb_devs, sizeof(nb_devs));
+			break;
+		}
+		ptr += record[2];
+	}
+	LIS_ASSERT_TRUE(i < nb_records);
+
+	memcpy(header, content, sizeof(header));
+	header[3] = (int)checksum(
+		content + sizeof(header), size - sizeof(header)
+	);
+	memcpy(content, header, sizeof(header));
+
+	fseek(fp, 0, SEEK_SET);
+	LIS_ASSERT_EQUAL(fwrite(content, 1, size, fp), (size_t)size);
+	fclose(fp);
+	free(content);
+}
+
+
+static void tests_disk_cache_corrupted(void)
+{
+	struct lis_device_descriptor **devs = NULL;
+	enum lis_error err;
+
+	LIS_ASSERT_EQUAL(tests_disk_cache_setup(), 0);
+	fill_cache(300);
+
+	// reading 3 devices would go past the end of the record
+	corrupt_device_list(3);
+
+	// the file is ignored: the list comes from the wrapped implementation
+	LIS_ASSERT_EQUAL(tests_disk_cache_init(1, 300), 0);
+	err = g_disk_cache->list_devices(g_disk_cache, LIS_DEVICE_LOCATIONS_ANY, &devs);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_NOT_EQUAL(devs[0], NULL);
+	LIS_ASSERT_EQUAL(devs[1], NULL);
+	g_disk_cache->cleanup(g_disk_cache);
+
+	tests_disk_cache_teardown();
+}
+
+
+int register_tests(void)
+{
+	CU_pSuite suite = NULL;
+
+	suite = CU_add_suite("Workaround_disk_cache", NULL, NULL);
+	if (suite == NULL) {
+		fprintf(stderr, "CU_add_suite() failed\n");
+		return 0;
+	}
+
+	if (CU_add_test(suite, "tests_disk_cache_cold_start()",
+				tests_disk_cache_cold_start) == NULL
+			|| CU_add_test(suite, "tests_disk_cache_outdated()",
+				tests_disk_cache_outdated) == NULL
+			|| CU_add_test(suite, "tests_disk_cache_corrupted()",
+				tests_disk_cache_corrupted) == NULL) {
+		fprintf(stderr, "CU_add_test() has failed\n");
+		return 0;
+	}
+
+	return 1;
+}
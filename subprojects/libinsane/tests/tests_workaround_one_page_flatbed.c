@@ -196,6 +196,63 @@ static void tests_one(void)
 }
 
 
+static void tests_one_chain(void)
+{
+	static const struct lis_scan_parameters base_scan_params = {
+		.format = LIS_IMG_FORMAT_RAW_RGB_24,
+		.width = 4,
+		.height = 2,
+		.image_size = 4 * 2 * 3,
+	};
+	static const uint8_t body[4 * 2 * 3] = { 0 };
+	static const struct lis_dumb_read reads[] = {
+		{ .content = body, .nb_bytes = LIS_COUNT_OF(body) },
+	};
+	enum lis_error err;
+	struct lis_item *item;
+	struct lis_item **children;
+	struct lis_scan_session *session;
+	char chain[128];
+
+	LIS_ASSERT_EQUAL(tests_one_init(), 0);
+	lis_dumb_set_scan_parameters(g_dumb, &base_scan_params);
+	lis_dumb_set_scan_result(g_dumb, reads, LIS_COUNT_OF(reads));
+
+	err = lis_api_workaround_one_page_flatbed(g_st, &g_one);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	item = NULL;
+	err = g_one->get_device(g_one, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = item->get_children(item, &children);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(children[0]->type, LIS_ITEM_FLATBED);
+	LIS_ASSERT_EQUAL(children[1]->type, LIS_ITEM_ADF);
+
+	err = children[0]->scan_start(children[0], &session);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	lis_scan_session_chain(session, chain, sizeof(chain));
+	LIS_ASSERT_EQUAL(strcmp(chain, "one_page_flatbed > source_nodes > dumb"), 0);
+	session->cancel(session);
+
+	// nothing to do on an ADF: one_page_flatbed isn't on the data path
+	err = children[1]->scan_start(children[1], &session);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	lis_scan_session_chain(session, chain, sizeof(chain));
+	LIS_ASSERT_EQUAL(strcmp(chain, "source_nodes > dumb"), 0);
+
+	// truncated
+	lis_scan_session_chain(session, chain, 8);
+	LIS_ASSERT_EQUAL(strcmp(chain, "source_"), 0);
+	session->cancel(session);
+
+	item->close(item);
+
+	LIS_ASSERT_EQUAL(tests_one_clean(), 0);
+}
+
+
 int register_tests(void)
 {
 	CU_pSuite suite = NULL;
@@ -206,7 +263,9 @@ int register_tests(void)
 		return 0;
 	}
 
-	if (CU_add_test(suite, "tests_one_page_flatbed()", tests_one) == NULL) {
+	if (CU_add_test(suite, "tests_one_page_flatbed()", tests_one) == NULL
+			|| CU_add_test(suite, "tests_one_chain()", tests_one_chain) == NULL
+			) {
 		fprintf(stderr, "CU_add_test() has failed\n");
 		return 0;
 	}
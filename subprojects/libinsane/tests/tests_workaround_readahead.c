@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <CUnit/Basic.h>
+
+#include <libinsane/capi.h>
+#include <libinsane/constants.h>
+#include <libinsane/dumb.h>
+#include <libinsane/log.h>
+#include <libinsane/workarounds.h>
+#include <libinsane/util.h>
+
+#include "main.h"
+#include "util.h"
+
+
+// bigger than a few read-ahead chunks
+#define PAGE_SIZE (300 * 1024)
+
+static struct lis_api *g_dumb = NULL;
+static struct lis_api *g_readahead = NULL;
+
+static uint8_t g_page1[PAGE_SIZE];
+static uint8_t g_page2[PAGE_SIZE];
+
+
+static int tests_readahead_init(void)
+{
+	static const struct lis_scan_parameters scan_params = {
+		.format = LIS_IMG_FORMAT_RAW_RGB_24,
+		.width = 1024,
+		.height = 100,
+		.image_size = PAGE_SIZE,
+	};
+	static const struct lis_dumb_read reads[] = {
+		{ .content = g_page1, .nb_bytes = PAGE_SIZE },
+		{ .content = NULL, .nb_bytes = 0, }, // end of page
+		{ .content = g_page2, .nb_bytes = PAGE_SIZE },
+	};
+	enum lis_error err;
+	int i;
+
+	for (i = 0 ; i < PAGE_SIZE ; i++) {
+		g_page1[i] = i % 251;
+		g_page2[i] = 0xFF - (i % 241);
+	}
+
+	g_readahead = NULL;
+	g_dumb = NULL;
+	err = lis_api_dumb(&g_dumb, "dummy0");
+	if (LIS_IS_ERROR(err)) {
+		return -1;
+	}
+	lis_dumb_set_nb_devices(g_dumb, 1);
+	lis_dumb_set_scan_parameters(g_dumb, &scan_params);
+	lis_dumb_set_scan_result(g_dumb, reads, LIS_COUNT_OF(reads));
+
+	err = lis_api_workaround_readahead(g_dumb, &g_readahead);
+	if (LIS_IS_ERROR(err)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static int tests_readahead_clean(void)
+{
+	struct lis_api *api;
+
+	api = g_dumb;
+	if (g_readahead != NULL) {
+		api = g_readahead;
+	}
+	if (api != NULL) {
+		api->cleanup(api);
+	}
+	return 0;
+}
+
+
+static void read_page(
+		struct lis_scan_session *session, const uint8_t *expected,
+		size_t read_size
+	)
+{
+	enum lis_error err;
+	uint8_t *buffer;
+	size_t total = 0, bufsize;
+
+	buffer = calloc(1, PAGE_SIZE);
+	LIS_ASSERT_NOT_EQUAL(buffer, NULL);
+
+	LIS_ASSERT_FALSE(session->end_of_feed(session));
+	// end_of_page() remains true until the next page is requested
+	// with scan_read()
+	do {
+		LIS_ASSERT_TRUE(total < PAGE_SIZE);
+		bufsize = MIN(read_size, PAGE_SIZE - total);
+		err = session->scan_read(session, buffer + total, &bufsize);
+		LIS_ASSERT_EQUAL(err, LIS_OK);
+		total += bufsize;
+	} while (!session->end_of_page(session));
+	LIS_ASSERT_EQUAL(total, PAGE_SIZE);
+	LIS_ASSERT_EQUAL(memcmp(buffer, expected, PAGE_SIZE), 0);
+
+	FREE(buffer);
+}
+
+
+static void tests_readahead_pages(void)
+{
+	enum lis_error err;
+	struct lis_item *item;
+	struct lis_scan_session *session;
+	struct lis_scan_parameters params;
+
+	LIS_ASSERT_EQUAL(tests_readahead_init(), 0);
+
+	err = g_readahead->get_device(g_readahead, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = item->scan_start(item, &session);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = session->get_scan_parameters(session, &params);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(params.image_size, PAGE_SIZE);
+
+	read_page(session, g_page1, 1000);
+	LIS_ASSERT_TRUE(session->end_of_page(session));
+	read_page(session, g_page2, 4096);
+	LIS_ASSERT_TRUE(session->end_of_page(session));
+	LIS_ASSERT_TRUE(session->end_of_feed(session));
+
+	item->close(item);
+
+	LIS_ASSERT_EQUAL(tests_readahead_clean(), 0);
+}
+
+
+static void tests_readahead_cancel(void)
+{
+	enum lis_error err;
+	struct lis_item *item;
+	struct lis_scan_session *session;
+	uint8_t buffer[512];
+	size_t bufsize;
+
+	LIS_ASSERT_EQUAL(tests_readahead_init(), 0);
+
+	err = g_readahead->get_device(g_readahead, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = item->scan_start(item, &session);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	bufsize = sizeof(buffer);
+	err = session->scan_read(session, buffer, &bufsize);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	LIS_ASSERT_EQUAL(bufsize, sizeof(buffer));
+	LIS_ASSERT_EQUAL(memcmp(buffer, g_page1, sizeof(buffer)), 0);
+
+	session->cancel(session);
+
+	// scanner must be available again
+	err = item->scan_start(item, &session);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+	read_page(session, g_page1, 65536);
+	session->cancel(session);
+
+	item->close(item);
+
+	LIS_ASSERT_EQUAL(tests_readahead_clean(), 0);
+}
+
+
+static void tests_readahead_max_memory(void)
+{
+	enum lis_error err;
+	struct lis_item *item;
+	struct lis_scan_session *session;
+
+	// a single chunk in the queue
+	setenv("LIBINSANE_WORKAROUND_READAHEAD_MAX_MEMORY", "64", 1);
+
+	LIS_ASSERT_EQUAL(tests_readahead_init(), 0);
+
+	err = g_readahead->get_device(g_readahead, LIS_DUMB_DEV_ID_FIRST, &item);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	err = item->scan_start(item, &session);
+	LIS_ASSERT_EQUAL(err, LIS_OK);
+
+	read_page(session, g_page1, 777);
+	read_page(session, g_page2, 100000);
+	LIS_ASSERT_TRUE(session->end_of_feed(session));
+
+	item->close(item);
+
+	LIS_ASSERT_EQUAL(tests_readahead_clean(), 0);
+
+	unsetenv("LIBINSANE_WORKAROUND_READAHEAD_MAX_MEMORY");
+}
+
+
+int register_tests(void)
+{
+	CU_pSuite suite = NULL;
+
+	suite = CU_add_suite("Workaround_readahead", NULL, NULL);
+	if (suite == NULL) {
+		fprintf(stderr, "CU_add_suite() failed\n");
+		return 0;
+	}
+
+	if (CU_add_test(suite, "tests_readahead_pages()",
+				tests_readahead_pages) == NULL
+			|| CU_add_test(suite, "tests_readahead_cancel()",
+				tests_readahead_cancel) == NULL
+			|| CU_add_test(suite, "tests_readahead_max_memory()",
+				tests_readahead_max_memory) == NULL) {
+		fprintf(stderr, "CU_add_test() has failed\n");
+		return 0;
+	}
+
+	return 1;
+}